@@ -0,0 +1,498 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Tests and benchmark of the allocator of the pended packets
+   (sys\alloc.c), built in user mode on Linux over the pool and the
+   lookaside lists of bench\shim:
+
+      cc -O2 -pthread -fshort-wchar -I bench/shim -iquote sys -iquote inc \
+         -o allocbench bench/allocbench.c bench/shim/shim.c sys/[A-Za-z]*.c
+      ./allocbench [packets]
+
+   Threads stand for the classify functions, each running on a processor
+   of the shim of its own. Each allocates its share of the packets, copies
+   control data of 0, 32, 64 or 128 bytes into them, and frees each packet
+   once it has allocated a window of later ones, as the worker threads free
+   the packets they injected; the windows are 64 packets, which the
+   lookaside lists hold, and 1024, which they do not. The same is done with
+   1, 2, 4, 8 and 16 threads through TLInspectAllocatePendedPacket and
+   TLInspectAllocateControlData, and through what the classify functions
+   did before: ExAllocatePoolZero for the packet and again for its control
+   data, and ExFreePoolWithTag for both.
+
+   For each run it prints the time per packet of both, and the allocations
+   counted under the pool tags of the packets and of the control data with
+   their high-water marks. The pool of the shim is the C library heap, so
+   the ratio of the two only hints at that of the kernel pool.
+
+   Each run is also checked: a packet has to come zeroed up to its inline
+   buffer even when reused dirty from a lookaside list, control data of up
+   to TL_INSPECT_INLINE_CONTROL_DATA_SIZE bytes has to be held inline and
+   larger control data allocated under its own tag, every packet and
+   control data allocated has to be counted and freed, and the high-water
+   mark of a single thread has to be its window. The program fails if any
+   check failed.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "shim.h"
+
+#include "inspect.h"
+#include "alloc.h"
+#include "stats.h"
+
+#define ALLOCBENCH_PACKETS (1 << 20)
+#define ALLOCBENCH_MAX_THREADS 16
+#define ALLOCBENCH_MAX_WINDOW 1024
+#define ALLOCBENCH_MAX_CONTROL_DATA 128
+
+const ULONG gThreadCounts[] = { 1, 2, 4, 8, 16 };
+const ULONG gWindows[] = { 64, ALLOCBENCH_MAX_WINDOW };
+const ULONG gControlDataLengths[] = { 0, 32, TL_INSPECT_INLINE_CONTROL_DATA_SIZE, ALLOCBENCH_MAX_CONTROL_DATA };
+
+//
+// ALLOCBENCH_RUN is a run with a number of threads, each of which
+// allocates perThread packets with controlDataLength bytes of control
+// data, through the allocator of the driver or the pool.
+//
+typedef struct ALLOCBENCH_RUN_
+{
+   BOOLEAN pool;
+   BOOLEAN check;
+   ULONG threadCount;
+   ULONG perThread;
+   ULONG window;
+   ULONG controlDataLength;
+
+   pthread_barrier_t start;
+
+   volatile LONG64 notZeroed;
+   volatile LONG64 notInline;
+   volatile LONG64 failures;
+} ALLOCBENCH_RUN;
+
+typedef struct ALLOCBENCH_THREAD_
+{
+   pthread_t thread;
+   ALLOCBENCH_RUN* run;
+   TL_INSPECT_PENDED_PACKET* window[ALLOCBENCH_MAX_WINDOW];
+} ALLOCBENCH_THREAD;
+
+UINT8 gControlData[ALLOCBENCH_MAX_CONTROL_DATA];
+ULONG gErrors;
+
+UINT64
+AllocBenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 1000000000 + (UINT64)now.tv_nsec;
+}
+
+void
+AllocBenchError(
+   _In_ const ALLOCBENCH_RUN* run,
+   _In_ const char* what,
+   _In_ LONG64 value
+   )
+{
+   //
+   // Only the first errors are printed; all are counted.
+   //
+   if (gErrors++ < 20)
+   {
+      printf("FAILED %s, %lu threads, window %lu, %lu bytes of control data: %s (%lld)\n",
+             run->pool ? "pool" : "lookaside",
+             (unsigned long)run->threadCount,
+             (unsigned long)run->window,
+             (unsigned long)run->controlDataLength,
+             what,
+             (long long)value);
+   }
+}
+
+TL_INSPECT_PENDED_PACKET*
+AllocBenchAllocate(
+   _Inout_ ALLOCBENCH_RUN* run
+   )
+/* ++
+
+   Allocates a packet and its control data, and copies the control data,
+   as the classify functions do. The packets of the allocator are checked
+   to come zeroed, and their control data inline when it fits.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet;
+   ULONG length = run->controlDataLength;
+   const UINT8* bytes;
+   ULONG i;
+
+   if (run->pool)
+   {
+      //
+      // The packet had no inline buffer then.
+      //
+      packet = ExAllocatePoolZero(
+                  NonPagedPool,
+                  FIELD_OFFSET(TL_INSPECT_PENDED_PACKET, inlineControlData),
+                  TL_INSPECT_PENDED_PACKET_POOL_TAG
+                  );
+      if (packet == NULL)
+      {
+         InterlockedIncrement64(&run->failures);
+         return NULL;
+      }
+
+      if (length != 0)
+      {
+         packet->controlData = ExAllocatePoolZero(
+                                 NonPagedPool,
+                                 length,
+                                 TL_INSPECT_CONTROL_DATA_POOL_TAG
+                                 );
+         if (packet->controlData == NULL)
+         {
+            ExFreePoolWithTag(packet, TL_INSPECT_PENDED_PACKET_POOL_TAG);
+            InterlockedIncrement64(&run->failures);
+            return NULL;
+         }
+
+         RtlCopyMemory(packet->controlData, gControlData, length);
+         packet->controlDataLength = length;
+      }
+
+      return packet;
+   }
+
+   packet = TLInspectAllocatePendedPacket();
+   if (packet == NULL)
+   {
+      InterlockedIncrement64(&run->failures);
+      return NULL;
+   }
+
+   if (run->check)
+   {
+      bytes = (const UINT8*)packet;
+      for (i = 0; i < FIELD_OFFSET(TL_INSPECT_PENDED_PACKET, inlineControlData); i++)
+      {
+         if (bytes[i] != 0)
+         {
+            InterlockedIncrement64(&run->notZeroed);
+            break;
+         }
+      }
+   }
+
+   if (length != 0)
+   {
+      if (TLInspectAllocateControlData(packet, length) == NULL)
+      {
+         TLInspectFreePendedPacketMemory(packet);
+         InterlockedIncrement64(&run->failures);
+         return NULL;
+      }
+
+      if ((packet->controlData == (WSACMSGHDR*)packet->inlineControlData) !=
+          (length <= TL_INSPECT_INLINE_CONTROL_DATA_SIZE))
+      {
+         InterlockedIncrement64(&run->notInline);
+      }
+
+      RtlCopyMemory(packet->controlData, gControlData, length);
+      packet->controlDataLength = length;
+   }
+
+   return packet;
+}
+
+void
+AllocBenchFree(
+   _In_ const ALLOCBENCH_RUN* run,
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   if (run->pool)
+   {
+      if (packet->controlData != NULL)
+      {
+         ExFreePoolWithTag(packet->controlData, TL_INSPECT_CONTROL_DATA_POOL_TAG);
+      }
+      ExFreePoolWithTag(packet, TL_INSPECT_PENDED_PACKET_POOL_TAG);
+      return;
+   }
+
+   TLInspectFreeControlData(packet);
+
+   if (run->check)
+   {
+      //
+      // Leave the packet dirty, as a packet freed by a worker is, so that
+      // its next allocation from the lookaside list has to zero it.
+      //
+      RtlFillMemory(
+         packet,
+         FIELD_OFFSET(TL_INSPECT_PENDED_PACKET, inlineControlData),
+         0xA5
+         );
+      packet->controlData = NULL;
+   }
+
+   TLInspectFreePendedPacketMemory(packet);
+}
+
+void*
+AllocBenchThread(
+   _In_ void* context
+   )
+{
+   ALLOCBENCH_THREAD* thread = context;
+   ALLOCBENCH_RUN* run = thread->run;
+   ULONG window = run->window;
+   ULONG i;
+
+   pthread_barrier_wait(&run->start);
+
+   for (i = 0; i < run->perThread + window; i++)
+   {
+      TL_INSPECT_PENDED_PACKET** slot = &thread->window[i % window];
+
+      if (*slot != NULL)
+      {
+         AllocBenchFree(run, *slot);
+         *slot = NULL;
+      }
+
+      if (i < run->perThread)
+      {
+         *slot = AllocBenchAllocate(run);
+      }
+   }
+
+   return NULL;
+}
+
+double
+AllocBenchRun(
+   _In_ BOOLEAN pool,
+   _In_ BOOLEAN check,
+   _In_ ULONG threadCount,
+   _In_ ULONG window,
+   _In_ ULONG controlDataLength,
+   _In_ ULONG packetCount
+   )
+/* ++
+
+   Runs the threads and returns the time per packet, in nanoseconds. The
+   pool counters of the allocator are reset before the run and checked
+   after it; a run that checks the packets themselves is not timed.
+
+-- */
+{
+   static ALLOCBENCH_THREAD threads[ALLOCBENCH_MAX_THREADS];
+   ALLOCBENCH_RUN run;
+   LONG64 packetAllocations;
+   LONG64 controlDataAllocations;
+   LONG64 expected;
+   UINT64 start;
+   UINT64 end;
+   ULONG i;
+
+   RtlZeroMemory(&run, sizeof(run));
+   run.pool = pool;
+   run.check = check;
+   run.threadCount = threadCount;
+   run.perThread = packetCount / threadCount;
+   run.window = window;
+   run.controlDataLength = controlDataLength;
+
+   packetAllocations = gStats.packetPool.allocations;
+   controlDataAllocations = gStats.controlDataPool.allocations;
+   gStats.packetPool.inUseMax = 0;
+   gStats.controlDataPool.inUseMax = 0;
+
+   pthread_barrier_init(&run.start, NULL, threadCount + 1);
+
+   for (i = 0; i < threadCount; i++)
+   {
+      RtlZeroMemory(&threads[i], sizeof(threads[i]));
+      threads[i].run = &run;
+      pthread_create(&threads[i].thread, NULL, AllocBenchThread, &threads[i]);
+   }
+
+   pthread_barrier_wait(&run.start);
+   start = AllocBenchNow();
+
+   for (i = 0; i < threadCount; i++)
+   {
+      pthread_join(threads[i].thread, NULL);
+   }
+
+   end = AllocBenchNow();
+
+   pthread_barrier_destroy(&run.start);
+
+   if (run.failures != 0)
+   {
+      AllocBenchError(&run, "allocations failed", run.failures);
+   }
+
+   if (pool)
+   {
+      return (double)(end - start) / (double)run.perThread;
+   }
+
+   expected = (LONG64)threadCount * run.perThread;
+
+   if (run.notZeroed != 0)
+   {
+      AllocBenchError(&run, "packets not zeroed", run.notZeroed);
+   }
+   if (run.notInline != 0)
+   {
+      AllocBenchError(&run, "control data inline if and only if it fits", run.notInline);
+   }
+   if (gStats.packetPool.allocations - packetAllocations != expected)
+   {
+      AllocBenchError(&run, "packet allocations counted",
+                      gStats.packetPool.allocations - packetAllocations);
+   }
+   if (gStats.controlDataPool.allocations - controlDataAllocations !=
+       ((controlDataLength > TL_INSPECT_INLINE_CONTROL_DATA_SIZE) ? expected : 0))
+   {
+      AllocBenchError(&run, "control data allocations counted",
+                      gStats.controlDataPool.allocations - controlDataAllocations);
+   }
+   if ((gStats.packetPool.inUse != 0) || (gStats.controlDataPool.inUse != 0))
+   {
+      AllocBenchError(&run, "packets still in use", gStats.packetPool.inUse);
+   }
+   if ((threadCount == 1) && (gStats.packetPool.inUseMax != (LONG)window))
+   {
+      AllocBenchError(&run, "packet high-water mark", gStats.packetPool.inUseMax);
+   }
+
+   return (double)(end - start) / (double)run.perThread;
+}
+
+int
+main(
+   int argc,
+   char** argv
+   )
+{
+   ULONG packetCount = ALLOCBENCH_PACKETS;
+   ULONG i;
+   ULONG j;
+   ULONG k;
+
+   if (argc > 1)
+   {
+      packetCount = (ULONG)strtoul(argv[1], NULL, 0);
+   }
+
+   //
+   // A processor, and so a lookaside list, for each thread of the largest
+   // run, whichever processors the earlier runs took.
+   //
+   ShimInitialize(2 * ALLOCBENCH_MAX_THREADS);
+
+   if (!NT_SUCCESS(TLInspectStatsInitialize()) ||
+       !NT_SUCCESS(TLInspectInitializePacketAllocator()))
+   {
+      printf("FAILED: cannot initialize the packet allocator\n");
+      return 1;
+   }
+
+   for (i = 0; i < sizeof(gControlData); i++)
+   {
+      gControlData[i] = (UINT8)i;
+   }
+
+   printf("%lu packets of %lu bytes, ns per packet on each thread\n",
+          (unsigned long)packetCount,
+          (unsigned long)sizeof(TL_INSPECT_PENDED_PACKET));
+   printf("threads  window  control  lookaside     pool  packets (max)  control data (max)\n");
+
+   for (i = 0; i < ARRAYSIZE(gThreadCounts); i++)
+   {
+      for (j = 0; j < ARRAYSIZE(gWindows); j++)
+      {
+         for (k = 0; k < ARRAYSIZE(gControlDataLengths); k++)
+         {
+            LONG64 packetAllocations;
+            LONG64 controlDataAllocations;
+            double lookaside;
+            LONG packetMax;
+            LONG controlDataMax;
+            double pool;
+
+            AllocBenchRun(
+               FALSE,
+               TRUE,
+               gThreadCounts[i],
+               gWindows[j],
+               gControlDataLengths[k],
+               4 * gThreadCounts[i] * gWindows[j]
+               );
+
+            packetAllocations = gStats.packetPool.allocations;
+            controlDataAllocations = gStats.controlDataPool.allocations;
+
+            lookaside = AllocBenchRun(
+                           FALSE,
+                           FALSE,
+                           gThreadCounts[i],
+                           gWindows[j],
+                           gControlDataLengths[k],
+                           packetCount
+                           );
+
+            packetMax = gStats.packetPool.inUseMax;
+            controlDataMax = gStats.controlDataPool.inUseMax;
+
+            pool = AllocBenchRun(
+                      TRUE,
+                      FALSE,
+                      gThreadCounts[i],
+                      gWindows[j],
+                      gControlDataLengths[k],
+                      packetCount
+                      );
+
+            printf("%7lu  %6lu  %7lu  %9.1f  %7.1f  %7lld (%4ld)  %12lld (%4ld)\n",
+                   (unsigned long)gThreadCounts[i],
+                   (unsigned long)gWindows[j],
+                   (unsigned long)gControlDataLengths[k],
+                   lookaside,
+                   pool,
+                   (long long)(gStats.packetPool.allocations - packetAllocations),
+                   (long)packetMax,
+                   (long long)(gStats.controlDataPool.allocations - controlDataAllocations),
+                   (long)controlDataMax);
+            fflush(stdout);
+         }
+      }
+   }
+
+   TLInspectFreePacketAllocator();
+   TLInspectStatsFree();
+
+   return (gErrors == 0) ? 0 : 1;
+}
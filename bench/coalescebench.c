@@ -0,0 +1,417 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Connection burst benchmark of the coalescing of pended connects of the
+   driver (sys\coalesce.h), built in user mode on Linux:
+
+      cc -O2 -I sys -I inc -o coalescebench bench/coalescebench.c -lm
+      ./coalescebench [seconds]
+
+   It simulates worker 0, the only one to take connects, fed with the
+   connects of a service that opens 200 connections to the same upstream
+   at once, every 100 ms, on top of connects of other applications to
+   other services at 5000 per second. Every inspection takes the worker
+   20us. The connects are decided one by one first, the way the worker did
+   before coalescing, and then through the index of the driver, which
+   decides the connects pended for the same decision as a connect still
+   waiting for its own along with it. For each run it prints the number of
+   inspections, the connects completed per inspection, and the percentiles
+   of the time from pending a connect to completing it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t LONG64;
+typedef int32_t LONG;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_bytes_(size)
+
+#define __inline static inline
+
+typedef struct LIST_ENTRY_
+{
+   struct LIST_ENTRY_* Flink;
+   struct LIST_ENTRY_* Blink;
+} LIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field) \
+   ((type*)((char*)(address) - offsetof(type, field)))
+
+#define RtlEqualMemory(destination, source, length) \
+   (memcmp((destination), (source), (length)) == 0)
+
+static inline void
+InitializeListHead(
+   _Out_ LIST_ENTRY* head
+   )
+{
+   head->Flink = head->Blink = head;
+}
+
+static inline BOOLEAN
+IsListEmpty(
+   _In_ const LIST_ENTRY* head
+   )
+{
+   return head->Flink == head;
+}
+
+static inline void
+InsertTailList(
+   _Inout_ LIST_ENTRY* head,
+   _Inout_ LIST_ENTRY* entry
+   )
+{
+   entry->Flink = head;
+   entry->Blink = head->Blink;
+   head->Blink->Flink = entry;
+   head->Blink = entry;
+}
+
+static inline void
+RemoveEntryList(
+   _Inout_ LIST_ENTRY* entry
+   )
+{
+   entry->Blink->Flink = entry->Flink;
+   entry->Flink->Blink = entry->Blink;
+}
+
+static inline LIST_ENTRY*
+RemoveHeadList(
+   _Inout_ LIST_ENTRY* head
+   )
+{
+   LIST_ENTRY* entry = head->Flink;
+
+   RemoveEntryList(entry);
+
+   return entry;
+}
+
+#include "coalesce.h"
+
+//
+// Times are in 100ns units.
+//
+#define COALESCEBENCH_MS 10000
+
+#define COALESCEBENCH_SERVICE_TIME 200                  // 20us
+#define COALESCEBENCH_BACKGROUND_RATE 5000              // connects per second
+#define COALESCEBENCH_BURST_INTERVAL (100 * COALESCEBENCH_MS)
+#define COALESCEBENCH_BURST_LENGTH (COALESCEBENCH_MS / 2)
+#define COALESCEBENCH_BURST_CONNECTS 200
+
+//
+// COALESCEBENCH_CONNECT stands for a pended connect; queued links it into
+// the queue of the worker while it is undecided.
+//
+typedef struct COALESCEBENCH_CONNECT_
+{
+   LIST_ENTRY queued;
+   TL_INSPECT_COALESCE_ENTRY coalesce;
+   UINT64 arrival;
+   UINT32 upstream;
+} COALESCEBENCH_CONNECT;
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+CoalesceBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+double
+CoalesceBenchUniform(void)
+{
+   return (double)((CoalesceBenchRandom() >> 11) + 1) / 9007199254740993.0;
+}
+
+int
+CoalesceBenchCompare(
+   const void* first,
+   const void* second
+   )
+{
+   UINT64 a = *(const UINT64*)first;
+   UINT64 b = *(const UINT64*)second;
+
+   return (a > b) - (a < b);
+}
+
+int
+CoalesceBenchCompareConnects(
+   const void* first,
+   const void* second
+   )
+{
+   return CoalesceBenchCompare(
+             &((const COALESCEBENCH_CONNECT*)first)->arrival,
+             &((const COALESCEBENCH_CONNECT*)second)->arrival
+             );
+}
+
+COALESCEBENCH_CONNECT*
+CoalesceBenchGenerate(
+   _In_ UINT64 duration,
+   _Out_ UINT32* count
+   )
+/* ++
+
+   Returns the connects pended over duration, in increasing order of
+   arrival. The connects of a burst all go to upstream 0, the others each
+   to an upstream of their own.
+
+-- */
+{
+   UINT32 capacity = (UINT32)(duration / 10000000 + 1) * COALESCEBENCH_BACKGROUND_RATE * 2 +
+                     (UINT32)(duration / COALESCEBENCH_BURST_INTERVAL + 1) *
+                        COALESCEBENCH_BURST_CONNECTS;
+   COALESCEBENCH_CONNECT* connects;
+   double now = 0;
+   UINT64 burst;
+   UINT32 i;
+
+   *count = 0;
+
+   connects = calloc(capacity, sizeof(COALESCEBENCH_CONNECT));
+   if (connects == NULL)
+   {
+      return NULL;
+   }
+
+   for (burst = COALESCEBENCH_BURST_INTERVAL / 2;
+        burst < duration;
+        burst += COALESCEBENCH_BURST_INTERVAL)
+   {
+      for (i = 0; i < COALESCEBENCH_BURST_CONNECTS; i++)
+      {
+         connects[*count].arrival =
+            burst + (UINT64)i * COALESCEBENCH_BURST_LENGTH / COALESCEBENCH_BURST_CONNECTS;
+         connects[*count].upstream = 0;
+         (*count)++;
+      }
+   }
+
+   for (;;)
+   {
+      now += -log(CoalesceBenchUniform()) * 1e7 / COALESCEBENCH_BACKGROUND_RATE;
+      if ((now >= (double)duration) || (*count == capacity))
+      {
+         break;
+      }
+      connects[*count].arrival = (UINT64)now;
+      connects[*count].upstream = *count + 1;
+      (*count)++;
+   }
+
+   qsort(connects, *count, sizeof(COALESCEBENCH_CONNECT), CoalesceBenchCompareConnects);
+
+   return connects;
+}
+
+void
+CoalesceBenchKey(
+   _In_ const COALESCEBENCH_CONNECT* connect,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   )
+{
+   memset(key, 0, sizeof(*key));
+
+   key->appId = (connect->upstream == 0) ? 1 : 2 + connect->upstream % 16;
+   key->addressFamily = 2;
+   key->protocol = 6;
+   key->direction = 1;
+   key->remotePort = 443;
+   memcpy(key->remoteAddr, &connect->upstream, sizeof(connect->upstream));
+}
+
+void
+CoalesceBenchRun(
+   _Inout_ COALESCEBENCH_CONNECT* connects,
+   _In_ UINT32 count,
+   _Inout_ UINT64* latencies,
+   _In_ BOOLEAN coalesce,
+   _In_ const char* name
+   )
+/* ++
+
+   Decides all the connects, coalescing them if coalesce is set, and
+   prints the inspections and the latencies of the connects.
+
+-- */
+{
+   static LIST_ENTRY buckets[TL_INSPECT_COALESCE_TABLE_SIZE];
+   TL_INSPECT_COALESCE_TABLE table;
+   COALESCEBENCH_CONNECT* inspected = NULL;
+   LIST_ENTRY queue;
+   LIST_ENTRY followers;
+   UINT64 now = 0;
+   UINT64 finish = 0;
+   UINT64 inspections = 0;
+   UINT32 completed = 0;
+   UINT32 next = 0;
+   UINT32 i;
+
+   for (i = 0; i < TL_INSPECT_COALESCE_TABLE_SIZE; i++)
+   {
+      InitializeListHead(&buckets[i]);
+   }
+
+   table.buckets = buckets;
+   table.seed = (ULONG)CoalesceBenchRandom();
+
+   InitializeListHead(&queue);
+   InitializeListHead(&followers);
+
+   while (completed < count)
+   {
+      //
+      // The connects pended before the inspection in progress ends join
+      // the queue, or their leader.
+      //
+      if ((next < count) &&
+          ((inspected == NULL) || (connects[next].arrival < finish)))
+      {
+         COALESCEBENCH_CONNECT* connect = &connects[next++];
+
+         if (connect->arrival > now)
+         {
+            now = connect->arrival;
+         }
+
+         memset(&connect->coalesce, 0, sizeof(connect->coalesce));
+         CoalesceBenchKey(connect, &connect->coalesce.key);
+
+         if (!coalesce ||
+             (TLInspectCoalesceJoin(&table, &connect->coalesce) == NULL))
+         {
+            InsertTailList(&queue, &connect->queued);
+         }
+      }
+      else if (inspected != NULL)
+      {
+         now = finish;
+
+         TLInspectCoalesceTakeFollowers(&inspected->coalesce, &followers);
+
+         latencies[completed++] = now - inspected->arrival;
+
+         while (!IsListEmpty(&followers))
+         {
+            COALESCEBENCH_CONNECT* follower = CONTAINING_RECORD(
+                                                 RemoveHeadList(&followers),
+                                                 COALESCEBENCH_CONNECT,
+                                                 coalesce.link
+                                                 );
+
+            latencies[completed++] = now - follower->arrival;
+         }
+
+         inspected = NULL;
+      }
+
+      if ((inspected == NULL) && !IsListEmpty(&queue))
+      {
+         inspected = CONTAINING_RECORD(
+                        RemoveHeadList(&queue),
+                        COALESCEBENCH_CONNECT,
+                        queued
+                        );
+         finish = now + COALESCEBENCH_SERVICE_TIME;
+         inspections++;
+      }
+   }
+
+   qsort(latencies, count, sizeof(UINT64), CoalesceBenchCompare);
+
+   printf("%s\n", name);
+   printf("   %7llu inspections, %6.2f connects/inspection, "
+          "p50 %8.3f ms, p99 %8.3f ms, max %8.3f ms\n",
+          (unsigned long long)inspections,
+          (double)count / (double)inspections,
+          (double)latencies[count / 2] / COALESCEBENCH_MS,
+          (double)latencies[(UINT64)count * 99 / 100] / COALESCEBENCH_MS,
+          (double)latencies[count - 1] / COALESCEBENCH_MS);
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   COALESCEBENCH_CONNECT* connects = NULL;
+   UINT64* latencies = NULL;
+   UINT64 seconds = 2;
+   UINT32 count;
+   int result = 1;
+
+   if (argc > 1)
+   {
+      seconds = strtoull(argv[1], NULL, 0);
+   }
+
+   connects = CoalesceBenchGenerate(seconds * 10000000, &count);
+   if ((connects == NULL) || (count == 0))
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   latencies = malloc(count * sizeof(UINT64));
+   if (latencies == NULL)
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   printf("%u connects to one upstream every %u ms, %u other connects/s, "
+          "%u us per inspection\n",
+          COALESCEBENCH_BURST_CONNECTS,
+          COALESCEBENCH_BURST_INTERVAL / COALESCEBENCH_MS,
+          COALESCEBENCH_BACKGROUND_RATE,
+          COALESCEBENCH_SERVICE_TIME / 10);
+
+   CoalesceBenchRun(connects, count, latencies, FALSE, "one inspection per connect");
+   CoalesceBenchRun(connects, count, latencies, TRUE, "coalesced");
+
+   result = 0;
+
+Exit:
+
+   free(connects);
+   free(latencies);
+
+   return result;
+}
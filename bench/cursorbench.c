@@ -0,0 +1,876 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Tests and benchmark of the MDL cursor (sys\cursor.c) and of the header
+   parsers built on it (sys\parse.c), built in user mode on Linux over the
+   NET_BUFFER and MDL of bench\shim:
+
+      cc -O2 -pthread -fshort-wchar -I bench/shim -iquote sys -iquote inc \
+         -o cursorbench bench/cursorbench.c bench/shim/shim.c sys/cursor.c \
+         sys/parse.c
+      ./cursorbench [iterations]
+
+   The packets are an IPv4 TCP packet with options, an IPv4 UDP packet
+   with IP options, an IPv6 TCP packet behind hop-by-hop and destination
+   options headers, and the first fragment of an IPv6 UDP packet. Each is
+   parsed out of net buffers whose MDL chains split it at every offset,
+   at every pair of offsets, into MDLs of every size with empty MDLs in
+   between, and with the data start moved past its IP header, and the
+   fields and the payload walked after the headers are checked against
+   those of the packet. A header that fits in the current MDL has to be
+   returned in place, and only one that straddles MDLs from the scratch
+   buffer of the cursor.
+
+   The short chains are then checked: net buffers whose data length stops
+   at every offset of the packet, held in buffers of exactly that size,
+   and MDL chains that end before the data length, which the parsers have
+   to fail or parse within the data, and a retreat that is not in the
+   current MDL, which has to fail.
+
+   Last, the parse of each packet is timed in a single MDL, split inside
+   its IP header and in MDLs of 16 bytes, next to the NdisGetDataBuffer
+   read with no storage the classify functions used before, which gives
+   up on a header that straddles MDLs; and the walk of a 1500-byte payload
+   in spans is timed next to its copy by NdisGetDataBuffer. The program
+   fails if any check failed.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ntddk.h>
+#include <fwpsk.h>
+
+#include "parse.h"
+
+#define CURSORBENCH_MAX_PACKET 1600
+#define CURSORBENCH_MAX_MDLS (2 * CURSORBENCH_MAX_PACKET + 1)
+#define CURSORBENCH_ITERATIONS 1000000
+
+//
+// CURSORBENCH_PACKET is a test packet, starting at its IP header, and the
+// fields the parsers have to find in it.
+//
+typedef struct CURSORBENCH_PACKET_
+{
+   const char* name;
+   UINT8 data[CURSORBENCH_MAX_PACKET];
+   ULONG length;
+
+   ADDRESS_FAMILY addressFamily;
+   UINT8 protocol;
+   BOOLEAN isFragment;
+   ULONG ipHeaderLength;
+   ULONG transportHeaderLength;
+   UINT16 sourcePort;
+   UINT16 destinationPort;
+} CURSORBENCH_PACKET;
+
+//
+// CURSORBENCH_BUFFER is a net buffer over the data of a packet, described
+// by a chain of MDLs of the given lengths.
+//
+typedef struct CURSORBENCH_BUFFER_
+{
+   NET_BUFFER netBuffer;
+   ULONG mdlCount;
+   MDL mdls[CURSORBENCH_MAX_MDLS];
+} CURSORBENCH_BUFFER;
+
+CURSORBENCH_PACKET gPackets[4];
+ULONG gErrors;
+
+UINT64
+CursorBenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 1000000000 + (UINT64)now.tv_nsec;
+}
+
+void
+CursorBenchError(
+   _In_ const CURSORBENCH_PACKET* packet,
+   _In_ const char* what,
+   _In_ ULONG first,
+   _In_ ULONG second
+   )
+{
+   //
+   // Only the first errors are printed; all are counted.
+   //
+   if (gErrors++ < 20)
+   {
+      printf("FAILED %s: %s (%lu, %lu)\n",
+             packet->name,
+             what,
+             (unsigned long)first,
+             (unsigned long)second);
+   }
+}
+
+void
+CursorBenchPut16(
+   _Out_writes_bytes_(2) UINT8* data,
+   _In_ UINT16 value
+   )
+{
+   data[0] = (UINT8)(value >> 8);
+   data[1] = (UINT8)value;
+}
+
+void
+CursorBenchFill(
+   _Out_writes_bytes_(length) UINT8* data,
+   _In_ ULONG length,
+   _In_ ULONG seed
+   )
+{
+   ULONG i;
+
+   for (i = 0; i < length; i++)
+   {
+      data[i] = (UINT8)(seed + i * 7);
+   }
+}
+
+void
+CursorBenchBuildPackets(void)
+/* ++
+
+   Builds the test packets. Checksums are left at 0; the parsers do not
+   look at them.
+
+-- */
+{
+   CURSORBENCH_PACKET* packet;
+   UINT8* data;
+   ULONG offset;
+
+   //
+   // IPv4 TCP, 20 bytes of TCP options, 100 bytes of payload.
+   //
+   packet = &gPackets[0];
+   packet->name = "IPv4 TCP";
+   packet->addressFamily = AF_INET;
+   packet->protocol = IPPROTO_TCP;
+   packet->ipHeaderLength = 20;
+   packet->transportHeaderLength = 40;
+   packet->sourcePort = 49152;
+   packet->destinationPort = 443;
+   packet->length = 20 + 40 + 100;
+
+   data = packet->data;
+   CursorBenchFill(data, packet->length, 1);
+   data[0] = 0x45;
+   data[1] = 0;
+   CursorBenchPut16(data + 2, (UINT16)packet->length);
+   CursorBenchPut16(data + 6, 0);
+   data[9] = IPPROTO_TCP;
+   data[12] = 10;
+   data[15] = 1;
+   data[16] = 192;
+   data[17] = 0;
+   data[18] = 2;
+   data[19] = 7;
+   CursorBenchPut16(data + 20, packet->sourcePort);
+   CursorBenchPut16(data + 22, packet->destinationPort);
+   data[32] = 10 << 4;
+   data[33] = 0x18;
+
+   //
+   // IPv4 UDP with 4 bytes of IP options, 37 bytes of payload.
+   //
+   packet = &gPackets[1];
+   packet->name = "IPv4 UDP, IP options";
+   packet->addressFamily = AF_INET;
+   packet->protocol = IPPROTO_UDP;
+   packet->ipHeaderLength = 24;
+   packet->transportHeaderLength = 8;
+   packet->sourcePort = 53;
+   packet->destinationPort = 50000;
+   packet->length = 24 + 8 + 37;
+
+   data = packet->data;
+   CursorBenchFill(data, packet->length, 2);
+   data[0] = 0x46;
+   CursorBenchPut16(data + 2, (UINT16)packet->length);
+   CursorBenchPut16(data + 6, 0);
+   data[9] = IPPROTO_UDP;
+   CursorBenchPut16(data + 24, packet->sourcePort);
+   CursorBenchPut16(data + 26, packet->destinationPort);
+   CursorBenchPut16(data + 28, 8 + 37);
+
+   //
+   // IPv6 TCP behind an 8-byte hop-by-hop and a 16-byte destination
+   // options header, 200 bytes of payload.
+   //
+   packet = &gPackets[2];
+   packet->name = "IPv6 TCP, extension headers";
+   packet->addressFamily = AF_INET6;
+   packet->protocol = IPPROTO_TCP;
+   packet->ipHeaderLength = 40 + 8 + 16;
+   packet->transportHeaderLength = 20;
+   packet->sourcePort = 50001;
+   packet->destinationPort = 80;
+   packet->length = 40 + 8 + 16 + 20 + 200;
+
+   data = packet->data;
+   CursorBenchFill(data, packet->length, 3);
+   data[0] = 0x60;
+   CursorBenchPut16(data + 4, (UINT16)(packet->length - 40));
+   data[6] = IPPROTO_HOPOPTS;
+   offset = 40;
+   data[offset] = IPPROTO_DSTOPTS;
+   data[offset + 1] = 0;
+   offset += 8;
+   data[offset] = IPPROTO_TCP;
+   data[offset + 1] = 1;
+   offset += 16;
+   CursorBenchPut16(data + offset, packet->sourcePort);
+   CursorBenchPut16(data + offset + 2, packet->destinationPort);
+   data[offset + 12] = 5 << 4;
+   data[offset + 13] = 0x02;
+
+   //
+   // First fragment of an IPv6 UDP packet, 300 bytes of payload.
+   //
+   packet = &gPackets[3];
+   packet->name = "IPv6 UDP, first fragment";
+   packet->addressFamily = AF_INET6;
+   packet->protocol = IPPROTO_UDP;
+   packet->isFragment = TRUE;
+   packet->ipHeaderLength = 40 + 8;
+   packet->transportHeaderLength = 8;
+   packet->sourcePort = 4500;
+   packet->destinationPort = 4500;
+   packet->length = 40 + 8 + 8 + 300;
+
+   data = packet->data;
+   CursorBenchFill(data, packet->length, 4);
+   data[0] = 0x60;
+   CursorBenchPut16(data + 4, (UINT16)(packet->length - 40));
+   data[6] = IPPROTO_FRAGMENT;
+   offset = 40;
+   data[offset] = IPPROTO_UDP;
+   data[offset + 1] = 0;
+   CursorBenchPut16(data + offset + 2, TL_INSPECT_IPV6_MORE_FRAGMENTS);
+   offset += 8;
+   CursorBenchPut16(data + offset, packet->sourcePort);
+   CursorBenchPut16(data + offset + 2, packet->destinationPort);
+   CursorBenchPut16(data + offset + 4, 1200);
+}
+
+void
+CursorBenchBuild(
+   _Out_ CURSORBENCH_BUFFER* buffer,
+   _In_ const UINT8* data,
+   _In_ ULONG length,
+   _In_ ULONG dataOffset,
+   _In_reads_(mdlCount) const ULONG* mdlLengths,
+   _In_ ULONG mdlCount
+   )
+/* ++
+
+   Describes length bytes of data by MDLs of mdlLengths, and starts the
+   data of the net buffer at dataOffset. The MDLs may cover less than
+   length, for a chain shorter than the data length.
+
+-- */
+{
+   NET_BUFFER* netBuffer = &buffer->netBuffer;
+   ULONG offset = 0;
+   ULONG i;
+
+   memset(netBuffer, 0, sizeof(*netBuffer));
+   buffer->mdlCount = mdlCount;
+
+   for (i = 0; i < mdlCount; i++)
+   {
+      buffer->mdls[i].MappedSystemVa = (UINT8*)data + offset;
+      buffer->mdls[i].ByteCount = mdlLengths[i];
+      buffer->mdls[i].Next = (i + 1 < mdlCount) ? &buffer->mdls[i + 1] : NULL;
+      offset += mdlLengths[i];
+   }
+
+   netBuffer->MdlChain = (mdlCount != 0) ? &buffer->mdls[0] : NULL;
+   netBuffer->DataOffset = dataOffset;
+   netBuffer->DataLength = length - dataOffset;
+
+   //
+   // The current MDL is the one holding the first byte of data, and
+   // never an empty one.
+   //
+   netBuffer->CurrentMdl = netBuffer->MdlChain;
+   netBuffer->CurrentMdlOffset = dataOffset;
+
+   while ((netBuffer->CurrentMdl != NULL) &&
+          (netBuffer->CurrentMdlOffset >= netBuffer->CurrentMdl->ByteCount) &&
+          (netBuffer->CurrentMdl->Next != NULL))
+   {
+      netBuffer->CurrentMdlOffset -= netBuffer->CurrentMdl->ByteCount;
+      netBuffer->CurrentMdl = netBuffer->CurrentMdl->Next;
+   }
+}
+
+void
+CursorBenchBuildSplit(
+   _Out_ CURSORBENCH_BUFFER* buffer,
+   _In_ const CURSORBENCH_PACKET* packet,
+   _In_ ULONG dataOffset,
+   _In_ ULONG first,
+   _In_ ULONG second
+   )
+/* ++
+
+   Describes the packet by MDLs split at the offsets first and second, or
+   at first only if second is 0, or by a single MDL if both are 0.
+
+-- */
+{
+   ULONG lengths[3];
+   ULONG count = 0;
+   ULONG start = 0;
+
+   if (first != 0)
+   {
+      lengths[count++] = first;
+      start = first;
+   }
+
+   if (second != 0)
+   {
+      lengths[count++] = second - first;
+      start = second;
+   }
+
+   lengths[count++] = packet->length - start;
+
+   CursorBenchBuild(buffer, packet->data, packet->length, dataOffset, lengths, count);
+}
+
+void
+CursorBenchBuildUniform(
+   _Out_ CURSORBENCH_BUFFER* buffer,
+   _In_ const UINT8* data,
+   _In_ ULONG length,
+   _In_ ULONG mdlSize,
+   _In_ BOOLEAN emptyMdls
+   )
+{
+   static ULONG lengths[CURSORBENCH_MAX_MDLS];
+   ULONG count = 0;
+   ULONG offset;
+
+   for (offset = 0; offset < length; offset += mdlSize)
+   {
+      lengths[count++] = min(mdlSize, length - offset);
+
+      if (emptyMdls && (offset + mdlSize < length))
+      {
+         lengths[count++] = 0;
+      }
+   }
+
+   CursorBenchBuild(buffer, data, length, 0, lengths, count);
+}
+
+BOOLEAN
+CursorBenchParse(
+   _In_ NET_BUFFER* netBuffer,
+   _In_ ULONG retreat,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _Out_ TL_INSPECT_CURSOR* cursor,
+   _Out_ TL_INSPECT_PACKET_INFO* info
+   )
+{
+   return TLInspectCursorInitialize(cursor, netBuffer, retreat) &&
+          TLInspectParseIpHeader(cursor, addressFamily, info) &&
+          TLInspectParseTransportHeader(cursor, info);
+}
+
+void
+CursorBenchCheck(
+   _In_ const CURSORBENCH_PACKET* packet,
+   _In_ NET_BUFFER* netBuffer,
+   _In_ ULONG retreat,
+   _In_ ULONG first,
+   _In_ ULONG second
+   )
+/* ++
+
+   Parses the packet out of the net buffer and checks the fields found and
+   the payload walked past the headers. first and second identify the
+   layout in the messages.
+
+-- */
+{
+   TL_INSPECT_CURSOR cursor;
+   TL_INSPECT_PACKET_INFO info;
+   ULONG headers = packet->ipHeaderLength + packet->transportHeaderLength;
+   ULONG addressOffset = (packet->addressFamily == AF_INET) ? 12 : 8;
+   ULONG addressLength = (packet->addressFamily == AF_INET) ? 4 : 16;
+   const UINT8* span;
+   ULONG spanLength;
+   ULONG walked = 0;
+
+   if (!CursorBenchParse(netBuffer, retreat, packet->addressFamily, &cursor, &info))
+   {
+      CursorBenchError(packet, "parse failed", first, second);
+      return;
+   }
+
+   if ((info.protocol != packet->protocol) ||
+       (info.isFragment != packet->isFragment) ||
+       (info.ipHeaderLength != packet->ipHeaderLength) ||
+       (info.transportHeaderLength != packet->transportHeaderLength) ||
+       (info.sourcePort != packet->sourcePort) ||
+       (info.destinationPort != packet->destinationPort) ||
+       (info.payloadLength != packet->length - headers))
+   {
+      CursorBenchError(packet, "wrong fields", first, second);
+      return;
+   }
+
+   if ((memcmp(&info.sourceAddress, packet->data + addressOffset, addressLength) != 0) ||
+       (memcmp(&info.destinationAddress,
+               packet->data + addressOffset + addressLength,
+               addressLength) != 0))
+   {
+      CursorBenchError(packet, "wrong addresses", first, second);
+      return;
+   }
+
+   while ((span = TLInspectCursorNextSpan(&cursor, &spanLength)) != NULL)
+   {
+      if ((spanLength == 0) ||
+          (walked + spanLength > info.payloadLength) ||
+          (memcmp(span, packet->data + headers + walked, spanLength) != 0))
+      {
+         CursorBenchError(packet, "wrong payload span", first, second);
+         return;
+      }
+
+      walked += spanLength;
+   }
+
+   if (walked != info.payloadLength)
+   {
+      CursorBenchError(packet, "payload cut short", first, second);
+   }
+}
+
+void
+CursorBenchTestSplits(
+   _In_ const CURSORBENCH_PACKET* packet
+   )
+/* ++
+
+   Parses the packet split into two MDLs at every offset and into three at
+   every pair of offsets, and checks that the fixed IP header is returned
+   in place when the first MDL holds it, and from the scratch buffer only
+   when it does not.
+
+-- */
+{
+   static CURSORBENCH_BUFFER buffer;
+   ULONG fixedLength = (packet->addressFamily == AF_INET) ? 20 : 40;
+   ULONG first;
+   ULONG second;
+
+   CursorBenchBuildSplit(&buffer, packet, 0, 0, 0);
+   CursorBenchCheck(packet, &buffer.netBuffer, 0, 0, 0);
+
+   for (first = 1; first < packet->length; first++)
+   {
+      TL_INSPECT_CURSOR cursor;
+      const void* header;
+
+      CursorBenchBuildSplit(&buffer, packet, 0, first, 0);
+      CursorBenchCheck(packet, &buffer.netBuffer, 0, first, 0);
+
+      TLInspectCursorInitialize(&cursor, &buffer.netBuffer, 0);
+      header = TLInspectCursorPeek(&cursor, fixedLength);
+
+      if ((first >= fixedLength) && (header != packet->data))
+      {
+         CursorBenchError(packet, "contiguous header copied", first, 0);
+      }
+      else if ((first < fixedLength) &&
+               ((header != cursor.scratch) ||
+                (memcmp(header, packet->data, fixedLength) != 0)))
+      {
+         CursorBenchError(packet, "straddled header not gathered", first, 0);
+      }
+
+      for (second = first + 1; second < packet->length; second++)
+      {
+         CursorBenchBuildSplit(&buffer, packet, 0, first, second);
+         CursorBenchCheck(packet, &buffer.netBuffer, 0, first, second);
+      }
+   }
+}
+
+void
+CursorBenchTestUniform(
+   _In_ const CURSORBENCH_PACKET* packet
+   )
+/* ++
+
+   Parses the packet in MDLs of every size, with and without an empty MDL
+   between each two, and with the data start moved past the IP header as
+   at the inbound layers, where the parse retreats to it.
+
+-- */
+{
+   static CURSORBENCH_BUFFER buffer;
+   ULONG mdlSize;
+
+   for (mdlSize = 1; mdlSize <= packet->length; mdlSize++)
+   {
+      CursorBenchBuildUniform(&buffer, packet->data, packet->length, mdlSize, FALSE);
+      CursorBenchCheck(packet, &buffer.netBuffer, 0, mdlSize, 0);
+
+      CursorBenchBuildUniform(&buffer, packet->data, packet->length, mdlSize, TRUE);
+      CursorBenchCheck(packet, &buffer.netBuffer, 0, mdlSize, 1);
+   }
+
+   //
+   // A retreat is only possible within the current MDL.
+   //
+   for (mdlSize = packet->ipHeaderLength; mdlSize <= packet->length; mdlSize++)
+   {
+      ULONG lengths[2] = { mdlSize, packet->length - mdlSize };
+
+      CursorBenchBuild(&buffer,
+                       packet->data,
+                       packet->length,
+                       packet->ipHeaderLength,
+                       lengths,
+                       (mdlSize < packet->length) ? 2 : 1);
+
+      if (buffer.netBuffer.CurrentMdl == &buffer.mdls[0])
+      {
+         CursorBenchCheck(packet, &buffer.netBuffer, packet->ipHeaderLength, mdlSize, 2);
+      }
+   }
+}
+
+void
+CursorBenchTestShortChains(
+   _In_ const CURSORBENCH_PACKET* packet
+   )
+/* ++
+
+   Parses the packet cut at every length, out of a buffer of exactly that
+   size so that a read past the data is caught by the sanitizers, in one
+   MDL and split in two in the middle; then out of MDL chains that end
+   before the data length, and with a retreat past the current MDL. The
+   parse has to fail, or find headers and payload within the data.
+
+-- */
+{
+   static CURSORBENCH_BUFFER buffer;
+   TL_INSPECT_CURSOR cursor;
+   TL_INSPECT_PACKET_INFO info;
+   ULONG length;
+
+   for (length = 0; length < packet->length; length++)
+   {
+      UINT8* data = malloc(max(length, 1));
+      ULONG lengths[2] = { length / 2, length - length / 2 };
+      ULONG layout;
+
+      if (data == NULL)
+      {
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+
+      memcpy(data, packet->data, length);
+
+      for (layout = 0; layout < 2; layout++)
+      {
+         if (layout == 0)
+         {
+            CursorBenchBuild(&buffer, data, length, 0, &length, 1);
+         }
+         else
+         {
+            CursorBenchBuild(&buffer, data, length, 0, lengths, 2);
+         }
+
+         if (CursorBenchParse(&buffer.netBuffer, 0, packet->addressFamily, &cursor, &info) &&
+             (info.ipHeaderLength + info.transportHeaderLength + info.payloadLength > length))
+         {
+            CursorBenchError(packet, "parsed past a short packet", length, layout);
+         }
+      }
+
+      free(data);
+   }
+
+   for (length = 0; length < packet->length; length++)
+   {
+      const UINT8* span;
+      ULONG spanLength;
+      ULONG walked = 0;
+
+      //
+      // The chain holds length bytes of a net buffer of the whole packet.
+      //
+      CursorBenchBuild(&buffer, packet->data, packet->length, 0, &length, 1);
+
+      if (CursorBenchParse(&buffer.netBuffer, 0, packet->addressFamily, &cursor, &info) &&
+          (info.ipHeaderLength + info.transportHeaderLength > length))
+      {
+         CursorBenchError(packet, "parsed past a short chain", length, 0);
+      }
+
+      TLInspectCursorInitialize(&cursor, &buffer.netBuffer, 0);
+
+      while ((span = TLInspectCursorNextSpan(&cursor, &spanLength)) != NULL)
+      {
+         walked += spanLength;
+      }
+
+      if (walked > length)
+      {
+         CursorBenchError(packet, "walked past a short chain", length, walked);
+      }
+   }
+
+   CursorBenchBuildSplit(&buffer, packet, 8, 8, 0);
+
+   if (TLInspectCursorInitialize(&cursor, &buffer.netBuffer, 4) ||
+       (TLInspectCursorRemaining(&cursor) != 0) ||
+       (TLInspectCursorPeek(&cursor, 1) != NULL))
+   {
+      CursorBenchError(packet, "retreat past the current MDL", 8, 4);
+   }
+}
+
+void
+CursorBenchTestScratch(void)
+/* ++
+
+   A read that straddles MDLs and does not fit in the scratch buffer has
+   to fail, and the same read within one MDL has to succeed in place.
+
+-- */
+{
+   static CURSORBENCH_BUFFER buffer;
+   const CURSORBENCH_PACKET* packet = &gPackets[2];
+   TL_INSPECT_CURSOR cursor;
+   ULONG size = TL_INSPECT_CURSOR_SCRATCH_SIZE + 1;
+
+   CursorBenchBuildSplit(&buffer, packet, 0, 1, 0);
+   TLInspectCursorInitialize(&cursor, &buffer.netBuffer, 0);
+
+   if (TLInspectCursorPeek(&cursor, size) != NULL)
+   {
+      CursorBenchError(packet, "straddled read larger than the scratch buffer", size, 0);
+   }
+
+   CursorBenchBuildSplit(&buffer, packet, 0, 0, 0);
+   TLInspectCursorInitialize(&cursor, &buffer.netBuffer, 0);
+
+   if (TLInspectCursorPull(&cursor, size) != packet->data)
+   {
+      CursorBenchError(packet, "contiguous read larger than the scratch buffer", size, 0);
+   }
+   else if (TLInspectCursorRemaining(&cursor) != packet->length - size)
+   {
+      CursorBenchError(packet, "pull did not advance", size, 0);
+   }
+}
+
+void
+CursorBenchTimeParse(
+   _In_ const CURSORBENCH_PACKET* packet,
+   _In_ const char* layoutName,
+   _In_ CURSORBENCH_BUFFER* buffer,
+   _In_ ULONG iterations
+   )
+/* ++
+
+   Times the parse of the packet in the layout of buffer, and the read of
+   its fixed IP header by NdisGetDataBuffer with no storage.
+
+-- */
+{
+   ULONG fixedLength = (packet->addressFamily == AF_INET) ? 20 : 40;
+   TL_INSPECT_CURSOR cursor;
+   TL_INSPECT_PACKET_INFO info;
+   volatile ULONG sink = 0;
+   ULONG parsed = 0;
+   ULONG read = 0;
+   UINT64 start;
+   UINT64 parseTime;
+   UINT64 readTime;
+   ULONG i;
+
+   start = CursorBenchNow();
+
+   for (i = 0; i < iterations; i++)
+   {
+      if (CursorBenchParse(&buffer->netBuffer, 0, packet->addressFamily, &cursor, &info))
+      {
+         sink += info.sourcePort;
+         parsed++;
+      }
+   }
+
+   parseTime = CursorBenchNow() - start;
+   start = CursorBenchNow();
+
+   for (i = 0; i < iterations; i++)
+   {
+      const UINT8* header = NdisGetDataBuffer(&buffer->netBuffer, fixedLength, NULL, 1, 0);
+
+      if (header != NULL)
+      {
+         sink += header[9];
+         read++;
+      }
+   }
+
+   readTime = CursorBenchNow() - start;
+
+   (void)sink;
+
+   printf("%-28s %-16s parse %6.1f ns (%3.0f%% parsed)   "
+          "NdisGetDataBuffer %6.1f ns (%3.0f%% read)\n",
+          packet->name,
+          layoutName,
+          (double)parseTime / iterations,
+          100.0 * parsed / iterations,
+          (double)readTime / iterations,
+          100.0 * read / iterations);
+}
+
+void
+CursorBenchTimePayload(
+   _In_ ULONG mdlSize,
+   _In_ ULONG iterations
+   )
+/* ++
+
+   Times the walk of a 1500-byte packet in spans, and its copy into a
+   buffer by NdisGetDataBuffer, when its MDLs are of mdlSize bytes.
+
+-- */
+{
+   static UINT8 data[1500];
+   static UINT8 storage[1500];
+   static CURSORBENCH_BUFFER buffer;
+   TL_INSPECT_CURSOR cursor;
+   volatile ULONG sink = 0;
+   UINT64 start;
+   UINT64 walkTime;
+   UINT64 copyTime;
+   ULONG i;
+
+   CursorBenchFill(data, sizeof(data), 5);
+   CursorBenchBuildUniform(&buffer, data, sizeof(data), mdlSize, FALSE);
+
+   start = CursorBenchNow();
+
+   for (i = 0; i < iterations; i++)
+   {
+      const UINT8* span;
+      ULONG spanLength;
+
+      TLInspectCursorInitialize(&cursor, &buffer.netBuffer, 0);
+
+      while ((span = TLInspectCursorNextSpan(&cursor, &spanLength)) != NULL)
+      {
+         sink += span[spanLength - 1];
+      }
+   }
+
+   walkTime = CursorBenchNow() - start;
+   start = CursorBenchNow();
+
+   for (i = 0; i < iterations; i++)
+   {
+      const UINT8* copy = NdisGetDataBuffer(&buffer.netBuffer, sizeof(data), storage, 1, 0);
+
+      sink += copy[sizeof(data) - 1];
+   }
+
+   copyTime = CursorBenchNow() - start;
+
+   (void)sink;
+
+   printf("1500-byte payload in MDLs of %4lu bytes: spans %7.1f ns (%5.1f GB/s), "
+          "NdisGetDataBuffer %7.1f ns (%5.1f GB/s)\n",
+          (unsigned long)mdlSize,
+          (double)walkTime / iterations,
+          (double)sizeof(data) * iterations / walkTime,
+          (double)copyTime / iterations,
+          (double)sizeof(data) * iterations / copyTime);
+}
+
+int
+main(
+   int argc,
+   char** argv
+   )
+{
+   static CURSORBENCH_BUFFER buffer;
+   ULONG iterations = CURSORBENCH_ITERATIONS;
+   ULONG i;
+
+   if (argc > 1)
+   {
+      iterations = (ULONG)strtoul(argv[1], NULL, 0);
+   }
+
+   CursorBenchBuildPackets();
+
+   for (i = 0; i < ARRAYSIZE(gPackets); i++)
+   {
+      CursorBenchTestSplits(&gPackets[i]);
+      CursorBenchTestUniform(&gPackets[i]);
+      CursorBenchTestShortChains(&gPackets[i]);
+   }
+
+   CursorBenchTestScratch();
+
+   printf("%lu packets parsed at every split: %lu errors\n",
+          (unsigned long)ARRAYSIZE(gPackets),
+          (unsigned long)gErrors);
+
+   for (i = 0; i < ARRAYSIZE(gPackets); i++)
+   {
+      const CURSORBENCH_PACKET* packet = &gPackets[i];
+
+      CursorBenchBuildSplit(&buffer, packet, 0, 0, 0);
+      CursorBenchTimeParse(packet, "one MDL", &buffer, iterations);
+
+      CursorBenchBuildSplit(&buffer, packet, 0, 14, 0);
+      CursorBenchTimeParse(packet, "split at 14", &buffer, iterations);
+
+      CursorBenchBuildUniform(&buffer, packet->data, packet->length, 16, FALSE);
+      CursorBenchTimeParse(packet, "MDLs of 16", &buffer, iterations);
+   }
+
+   CursorBenchTimePayload(1500, iterations);
+   CursorBenchTimePayload(256, iterations);
+   CursorBenchTimePayload(64, iterations);
+
+   return (gErrors == 0) ? 0 : 1;
+}
@@ -0,0 +1,532 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Tests and benchmark of the walk of the IPv6 extension headers by the
+   header parsers (sys\parse.c), built in user mode on Linux over the
+   NET_BUFFER and MDL of bench\shim:
+
+      cc -O2 -pthread -fshort-wchar -I bench/shim -iquote sys -iquote inc \
+         -o ipv6bench bench/ipv6bench.c bench/shim/shim.c sys/cursor.c \
+         sys/parse.c
+      ./ipv6bench [iterations]
+
+   Typical chains are parsed: no extension header, hop-by-hop, routing and
+   destination options headers, first and later fragments, and chains that
+   end in ESP or in no next header. So are adversarial ones: as many
+   headers as TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS, one more, a thousand,
+   headers of the largest length, headers past the payload length or past
+   the packet, and a chain of fragment headers. Each is parsed in a single
+   MDL and in MDLs of 1, 7 and 64 bytes, and the upper-layer protocol, the
+   length of the headers, the fragment and the ports found are checked;
+   the typical chains are also cut at every length, in buffers of exactly
+   that size, and have to fail or parse within the data.
+
+   Last, the parse of each chain is timed in a single MDL and in MDLs of
+   64 bytes. A chain longer than the bound costs about what the bound
+   does, however long it is. The program fails if any check failed.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ntddk.h>
+#include <fwpsk.h>
+
+#include "parse.h"
+
+#define IPV6BENCH_MAX_PACKET 16384
+#define IPV6BENCH_MAX_HEADERS 1000
+#define IPV6BENCH_ITERATIONS 1000000
+
+//
+// IPV6BENCH_CHAIN describes a test packet: its extension headers, of the
+// given types and lengths in bytes, then a header of upperProtocol. The
+// payload length of the IPv6 header is cut to payloadLength if not 0, and
+// the packet is cut to truncate bytes if not 0. The rest of the fields is
+// what the parse has to find.
+//
+typedef struct IPV6BENCH_CHAIN_
+{
+   const char* name;
+   ULONG headerCount;
+   UINT8 headerTypes[IPV6BENCH_MAX_HEADERS];
+   ULONG headerLengths[IPV6BENCH_MAX_HEADERS];
+   UINT16 fragmentOffset;
+   UINT8 upperProtocol;
+   ULONG payloadLength;
+   ULONG truncate;
+
+   BOOLEAN parsed;
+   UINT8 protocol;
+   ULONG ipHeaderLength;
+   BOOLEAN isFragment;
+   BOOLEAN hasPorts;
+
+   DECLSPEC_ALIGN(8) UINT8 data[IPV6BENCH_MAX_PACKET];
+   ULONG length;
+} IPV6BENCH_CHAIN;
+
+typedef struct IPV6BENCH_BUFFER_
+{
+   NET_BUFFER netBuffer;
+   MDL mdls[IPV6BENCH_MAX_PACKET];
+} IPV6BENCH_BUFFER;
+
+#define IPV6BENCH_SOURCE_PORT 50000
+#define IPV6BENCH_DESTINATION_PORT 443
+
+IPV6BENCH_CHAIN gChains[14];
+ULONG gChainCount;
+ULONG gErrors;
+
+UINT64
+Ipv6BenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 1000000000 + (UINT64)now.tv_nsec;
+}
+
+void
+Ipv6BenchError(
+   _In_ const IPV6BENCH_CHAIN* chain,
+   _In_ const char* what,
+   _In_ ULONG mdlSize
+   )
+{
+   if (gErrors++ < 20)
+   {
+      printf("FAILED %s: %s (MDLs of %lu bytes)\n",
+             chain->name,
+             what,
+             (unsigned long)mdlSize);
+   }
+}
+
+void
+Ipv6BenchPut16(
+   _Out_writes_bytes_(2) UINT8* data,
+   _In_ UINT16 value
+   )
+{
+   data[0] = (UINT8)(value >> 8);
+   data[1] = (UINT8)value;
+}
+
+IPV6BENCH_CHAIN*
+Ipv6BenchAddChain(
+   _In_ const char* name,
+   _In_ UINT8 upperProtocol
+   )
+{
+   IPV6BENCH_CHAIN* chain = &gChains[gChainCount++];
+
+   chain->name = name;
+   chain->upperProtocol = upperProtocol;
+   chain->parsed = TRUE;
+   chain->protocol = upperProtocol;
+   chain->hasPorts = (upperProtocol == IPPROTO_TCP) || (upperProtocol == IPPROTO_UDP);
+
+   return chain;
+}
+
+void
+Ipv6BenchAddHeaders(
+   _Inout_ IPV6BENCH_CHAIN* chain,
+   _In_ UINT8 type,
+   _In_ ULONG length,
+   _In_ ULONG count
+   )
+{
+   ULONG i;
+
+   for (i = 0; i < count; i++)
+   {
+      chain->headerTypes[chain->headerCount] = type;
+      chain->headerLengths[chain->headerCount] = length;
+      chain->headerCount++;
+   }
+}
+
+void
+Ipv6BenchBuild(
+   _Inout_ IPV6BENCH_CHAIN* chain
+   )
+/* ++
+
+   Writes the packet of the chain, with 64 bytes of payload after the
+   upper-layer header, and the length of its IP headers when they parse.
+
+-- */
+{
+   UINT8* data = chain->data;
+   ULONG offset = 40;
+   ULONG i;
+
+   memset(data, 0, sizeof(chain->data));
+   data[0] = 0x60;
+   data[7] = 64;
+   data[8] = 0x20;
+   data[9] = 0x01;
+   data[10] = 0x0d;
+   data[11] = 0xb8;
+   data[23] = 1;
+   data[24] = 0xfd;
+   data[39] = 2;
+   data[6] = (chain->headerCount != 0) ? chain->headerTypes[0] : chain->upperProtocol;
+
+   for (i = 0; i < chain->headerCount; i++)
+   {
+      UINT8 next = (i + 1 < chain->headerCount) ? chain->headerTypes[i + 1] :
+                                                  chain->upperProtocol;
+
+      data[offset] = next;
+
+      if (chain->headerTypes[i] == IPPROTO_FRAGMENT)
+      {
+         Ipv6BenchPut16(data + offset + 2,
+                        chain->fragmentOffset | TL_INSPECT_IPV6_MORE_FRAGMENTS);
+      }
+      else
+      {
+         data[offset + 1] = (UINT8)(chain->headerLengths[i] / 8 - 1);
+      }
+
+      offset += chain->headerLengths[i];
+   }
+
+   if (chain->parsed && (chain->ipHeaderLength == 0))
+   {
+      chain->ipHeaderLength = offset;
+   }
+
+   if (chain->upperProtocol == IPPROTO_TCP)
+   {
+      Ipv6BenchPut16(data + offset, IPV6BENCH_SOURCE_PORT);
+      Ipv6BenchPut16(data + offset + 2, IPV6BENCH_DESTINATION_PORT);
+      data[offset + 12] = 5 << 4;
+      offset += 20;
+   }
+   else if (chain->upperProtocol == IPPROTO_UDP)
+   {
+      Ipv6BenchPut16(data + offset, IPV6BENCH_SOURCE_PORT);
+      Ipv6BenchPut16(data + offset + 2, IPV6BENCH_DESTINATION_PORT);
+      Ipv6BenchPut16(data + offset + 4, 8 + 64);
+      offset += 8;
+   }
+
+   offset += 64;
+
+   chain->length = (chain->truncate != 0) ? chain->truncate : offset;
+
+   Ipv6BenchPut16(data + 4,
+                  (UINT16)((chain->payloadLength != 0) ? chain->payloadLength :
+                                                         offset - 40));
+}
+
+void
+Ipv6BenchBuildChains(void)
+{
+   IPV6BENCH_CHAIN* chain;
+
+   //
+   // Typical chains.
+   //
+   chain = Ipv6BenchAddChain("no extension header", IPPROTO_TCP);
+
+   chain = Ipv6BenchAddChain("hop-by-hop", IPPROTO_UDP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_HOPOPTS, 8, 1);
+
+   chain = Ipv6BenchAddChain("hop-by-hop, routing, dest options", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_HOPOPTS, 8, 1);
+   Ipv6BenchAddHeaders(chain, IPPROTO_ROUTING, 24, 1);
+   Ipv6BenchAddHeaders(chain, IPPROTO_DSTOPTS, 16, 1);
+
+   chain = Ipv6BenchAddChain("first fragment", IPPROTO_UDP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_FRAGMENT, 8, 1);
+   chain->isFragment = TRUE;
+
+   //
+   // What follows the fragment header of a later fragment is data, not a
+   // header, so it has no ports.
+   //
+   chain = Ipv6BenchAddChain("later fragment", IPPROTO_UDP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_FRAGMENT, 8, 1);
+   chain->fragmentOffset = 1480;
+   chain->isFragment = TRUE;
+   chain->hasPorts = FALSE;
+
+   chain = Ipv6BenchAddChain("dest options, ESP", IPPROTO_ESP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_DSTOPTS, 8, 1);
+
+   chain = Ipv6BenchAddChain("hop-by-hop, no next header", IPPROTO_NONE);
+   Ipv6BenchAddHeaders(chain, IPPROTO_HOPOPTS, 8, 1);
+
+   //
+   // Adversarial chains.
+   //
+   chain = Ipv6BenchAddChain("headers up to the bound", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_DSTOPTS, 8, TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS);
+
+   chain = Ipv6BenchAddChain("one header past the bound", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_DSTOPTS, 8, TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS + 1);
+   chain->parsed = FALSE;
+
+   chain = Ipv6BenchAddChain("1000 headers", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_HOPOPTS, 8, IPV6BENCH_MAX_HEADERS);
+   chain->parsed = FALSE;
+
+   chain = Ipv6BenchAddChain("fragment headers past the bound", IPPROTO_UDP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_FRAGMENT, 8, TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS + 1);
+   chain->parsed = FALSE;
+
+   chain = Ipv6BenchAddChain("headers of the largest length", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_DSTOPTS, 2048, 4);
+
+   chain = Ipv6BenchAddChain("header past the payload length", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_HOPOPTS, 8, 1);
+   Ipv6BenchAddHeaders(chain, IPPROTO_DSTOPTS, 256, 1);
+   chain->payloadLength = 64;
+   chain->parsed = FALSE;
+
+   chain = Ipv6BenchAddChain("header past the packet", IPPROTO_TCP);
+   Ipv6BenchAddHeaders(chain, IPPROTO_HOPOPTS, 2048, 1);
+   chain->truncate = 40 + 1024;
+   chain->parsed = FALSE;
+}
+
+void
+Ipv6BenchBuildBuffer(
+   _Out_ IPV6BENCH_BUFFER* buffer,
+   _In_ const UINT8* data,
+   _In_ ULONG length,
+   _In_ ULONG mdlSize
+   )
+/* ++
+
+   Describes length bytes of data by MDLs of mdlSize bytes, or by a single
+   MDL if mdlSize is 0.
+
+-- */
+{
+   ULONG offset = 0;
+   ULONG count = 0;
+
+   if (mdlSize == 0)
+   {
+      mdlSize = max(length, 1);
+   }
+
+   do
+   {
+      buffer->mdls[count].MappedSystemVa = (UINT8*)data + offset;
+      buffer->mdls[count].ByteCount = min(mdlSize, length - offset);
+      buffer->mdls[count].Next = NULL;
+
+      if (count != 0)
+      {
+         buffer->mdls[count - 1].Next = &buffer->mdls[count];
+      }
+
+      offset += buffer->mdls[count].ByteCount;
+      count++;
+   } while (offset < length);
+
+   memset(&buffer->netBuffer, 0, sizeof(buffer->netBuffer));
+   buffer->netBuffer.MdlChain = &buffer->mdls[0];
+   buffer->netBuffer.CurrentMdl = &buffer->mdls[0];
+   buffer->netBuffer.DataLength = length;
+}
+
+BOOLEAN
+Ipv6BenchParse(
+   _In_ NET_BUFFER* netBuffer,
+   _Out_ TL_INSPECT_PACKET_INFO* info
+   )
+{
+   TL_INSPECT_CURSOR cursor;
+
+   return TLInspectCursorInitialize(&cursor, netBuffer, 0) &&
+          TLInspectParseIpHeader(&cursor, AF_INET6, info) &&
+          TLInspectParseTransportHeader(&cursor, info);
+}
+
+void
+Ipv6BenchCheck(
+   _In_ const IPV6BENCH_CHAIN* chain,
+   _In_ ULONG mdlSize
+   )
+{
+   static IPV6BENCH_BUFFER buffer;
+   TL_INSPECT_PACKET_INFO info;
+   BOOLEAN parsed;
+
+   Ipv6BenchBuildBuffer(&buffer, chain->data, chain->length, mdlSize);
+
+   parsed = Ipv6BenchParse(&buffer.netBuffer, &info);
+
+   if (parsed != chain->parsed)
+   {
+      Ipv6BenchError(chain, parsed ? "parsed" : "not parsed", mdlSize);
+      return;
+   }
+
+   if (!parsed)
+   {
+      return;
+   }
+
+   if ((info.protocol != chain->protocol) ||
+       (info.ipHeaderLength != chain->ipHeaderLength) ||
+       (info.isFragment != chain->isFragment) ||
+       (info.fragmentOffset != chain->fragmentOffset))
+   {
+      Ipv6BenchError(chain, "wrong IP fields", mdlSize);
+   }
+   else if (chain->hasPorts &&
+            ((info.sourcePort != IPV6BENCH_SOURCE_PORT) ||
+             (info.destinationPort != IPV6BENCH_DESTINATION_PORT)))
+   {
+      Ipv6BenchError(chain, "wrong ports", mdlSize);
+   }
+   else if (!chain->hasPorts &&
+            ((info.sourcePort != 0) || (info.transportHeaderLength != 0)))
+   {
+      Ipv6BenchError(chain, "transport header parsed", mdlSize);
+   }
+}
+
+void
+Ipv6BenchCheckTruncated(
+   _In_ const IPV6BENCH_CHAIN* chain
+   )
+{
+   static IPV6BENCH_BUFFER buffer;
+   TL_INSPECT_PACKET_INFO info;
+   ULONG length;
+
+   for (length = 0; length < chain->length; length++)
+   {
+      UINT8* data = malloc(max(length, 1));
+      ULONG mdlSize;
+
+      if (data == NULL)
+      {
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+
+      memcpy(data, chain->data, length);
+
+      for (mdlSize = 0; mdlSize <= 2; mdlSize += 2)
+      {
+         Ipv6BenchBuildBuffer(&buffer, data, length, mdlSize);
+
+         if (Ipv6BenchParse(&buffer.netBuffer, &info) &&
+             (info.ipHeaderLength + info.transportHeaderLength + info.payloadLength > length))
+         {
+            Ipv6BenchError(chain, "parsed past a short packet", mdlSize);
+         }
+      }
+
+      free(data);
+   }
+}
+
+void
+Ipv6BenchTime(
+   _In_ const IPV6BENCH_CHAIN* chain,
+   _In_ ULONG iterations
+   )
+{
+   static IPV6BENCH_BUFFER buffer;
+   static const ULONG mdlSizes[] = { 0, 64 };
+   TL_INSPECT_PACKET_INFO info;
+   volatile ULONG sink = 0;
+   double times[2];
+   ULONG i;
+   ULONG j;
+
+   for (j = 0; j < ARRAYSIZE(mdlSizes); j++)
+   {
+      UINT64 start;
+
+      Ipv6BenchBuildBuffer(&buffer, chain->data, chain->length, mdlSizes[j]);
+
+      start = Ipv6BenchNow();
+
+      for (i = 0; i < iterations; i++)
+      {
+         sink += Ipv6BenchParse(&buffer.netBuffer, &info);
+      }
+
+      times[j] = (double)(Ipv6BenchNow() - start) / iterations;
+   }
+
+   (void)sink;
+
+   printf("%-36s %4lu headers %6lu bytes  %-10s one MDL %6.1f ns   MDLs of 64 %6.1f ns\n",
+          chain->name,
+          (unsigned long)chain->headerCount,
+          (unsigned long)chain->length,
+          chain->parsed ? "parsed" : "rejected",
+          times[0],
+          times[1]);
+}
+
+int
+main(
+   int argc,
+   char** argv
+   )
+{
+   static const ULONG mdlSizes[] = { 0, 1, 7, 64 };
+   ULONG iterations = IPV6BENCH_ITERATIONS;
+   ULONG i;
+   ULONG j;
+
+   if (argc > 1)
+   {
+      iterations = (ULONG)strtoul(argv[1], NULL, 0);
+   }
+
+   Ipv6BenchBuildChains();
+
+   for (i = 0; i < gChainCount; i++)
+   {
+      Ipv6BenchBuild(&gChains[i]);
+
+      for (j = 0; j < ARRAYSIZE(mdlSizes); j++)
+      {
+         Ipv6BenchCheck(&gChains[i], mdlSizes[j]);
+      }
+
+      if (gChains[i].parsed)
+      {
+         Ipv6BenchCheckTruncated(&gChains[i]);
+      }
+   }
+
+   printf("%lu chains parsed in MDLs of 1, 7, 64 bytes and one MDL: %lu errors\n",
+          (unsigned long)gChainCount,
+          (unsigned long)gErrors);
+
+   for (i = 0; i < gChainCount; i++)
+   {
+      Ipv6BenchTime(&gChains[i], iterations);
+   }
+
+   return (gErrors == 0) ? 0 : 1;
+}
@@ -0,0 +1,699 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Benchmark of the layer table of the driver (sys\layer.h), built in user
+   mode on Linux:
+
+      cc -O2 -I sys -I inc -o layerbench bench/layerbench.c
+      ./layerbench [calls]
+
+   It times FillNetwork5Tuple and IsMatchingConnectPacket as they were
+   before the table, picking the field indexes by a switch on the layer id
+   in an out-of-line function, against the table read at run time from the
+   layer id, and against the constant entry of a layer, as passed by the
+   classifyFn of that layer. The calls are first checked to give the same
+   results. Half of the pended connects match the values they are compared
+   with.
+
+   The field indexes of the layers stand in for those of fwpsk.h; only
+   their differing between the layers matters here.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t LONG64;
+typedef unsigned long ULONG;
+typedef unsigned int UINT;
+typedef size_t SIZE_T;
+typedef unsigned char BOOLEAN;
+typedef UINT16 ADDRESS_FAMILY;
+
+#define TRUE 1
+#define FALSE 0
+
+#define AF_UNSPEC 0
+#define AF_INET 2
+#define AF_INET6 23
+
+#define _In_
+#define _Out_
+#define _Inout_
+
+#define __forceinline static inline __attribute__((always_inline))
+#define DECLSPEC_SELECTANY
+#define LAYERBENCH_NOINLINE __attribute__((noinline))
+
+#define NT_ASSERT(expression) assert(expression)
+
+#define RtlCopyMemory(destination, source, length) \
+   memcpy((destination), (source), (length))
+#define RtlCompareMemory(source1, source2, length) \
+   ((memcmp((source1), (source2), (length)) == 0) ? (length) : 0)
+#define RtlUlongByteSwap(value) __builtin_bswap32(value)
+#define RtlUshortByteSwap(value) __builtin_bswap16(value)
+
+typedef enum FWP_DIRECTION_
+{
+   FWP_DIRECTION_OUTBOUND,
+   FWP_DIRECTION_INBOUND
+} FWP_DIRECTION;
+
+typedef struct FWP_BYTE_ARRAY16_
+{
+   UINT8 byteArray16[16];
+} FWP_BYTE_ARRAY16;
+
+typedef struct FWP_VALUE_
+{
+   UINT32 type;
+   union
+   {
+      UINT8 uint8;
+      UINT16 uint16;
+      UINT32 uint32;
+      FWP_BYTE_ARRAY16* byteArray16;
+   };
+} FWP_VALUE;
+
+typedef struct FWPS_INCOMING_VALUE_
+{
+   FWP_VALUE value;
+} FWPS_INCOMING_VALUE;
+
+typedef struct FWPS_INCOMING_VALUES_
+{
+   UINT16 layerId;
+   UINT32 valueCount;
+   FWPS_INCOMING_VALUE* incomingValue;
+} FWPS_INCOMING_VALUES;
+
+enum
+{
+   FWPS_LAYER_INBOUND_IPPACKET_V4,
+   FWPS_LAYER_INBOUND_IPPACKET_V6,
+   FWPS_LAYER_OUTBOUND_IPPACKET_V4,
+   FWPS_LAYER_OUTBOUND_IPPACKET_V6,
+   FWPS_LAYER_INBOUND_TRANSPORT_V4,
+   FWPS_LAYER_INBOUND_TRANSPORT_V6,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V4,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V6,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V4,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V6,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6,
+   FWPS_BUILTIN_LAYER_MAX
+};
+
+#define LAYERBENCH_TRANSPORT_FIELDS(layer)            \
+   enum                                               \
+   {                                                  \
+      FWPS_FIELD_##layer##_IP_PROTOCOL,               \
+      FWPS_FIELD_##layer##_IP_LOCAL_ADDRESS,          \
+      FWPS_FIELD_##layer##_IP_REMOTE_ADDRESS,         \
+      FWPS_FIELD_##layer##_IP_LOCAL_PORT,             \
+      FWPS_FIELD_##layer##_IP_REMOTE_PORT,            \
+      FWPS_FIELD_##layer##_FLAGS,                     \
+      FWPS_FIELD_##layer##_INTERFACE_INDEX,           \
+      FWPS_FIELD_##layer##_SUB_INTERFACE_INDEX,       \
+      FWPS_FIELD_##layer##_MAX                        \
+   };
+
+#define LAYERBENCH_ALE_FIELDS(layer)                  \
+   enum                                               \
+   {                                                  \
+      FWPS_FIELD_##layer##_ALE_APP_ID,                \
+      FWPS_FIELD_##layer##_ALE_USER_ID,               \
+      FWPS_FIELD_##layer##_IP_LOCAL_ADDRESS,          \
+      FWPS_FIELD_##layer##_IP_LOCAL_PORT,             \
+      FWPS_FIELD_##layer##_IP_PROTOCOL,               \
+      FWPS_FIELD_##layer##_IP_REMOTE_ADDRESS,         \
+      FWPS_FIELD_##layer##_IP_REMOTE_PORT,            \
+      FWPS_FIELD_##layer##_FLAGS,                     \
+      FWPS_FIELD_##layer##_INTERFACE_INDEX,           \
+      FWPS_FIELD_##layer##_SUB_INTERFACE_INDEX,       \
+      FWPS_FIELD_##layer##_MAX                        \
+   };
+
+LAYERBENCH_TRANSPORT_FIELDS(OUTBOUND_TRANSPORT_V4)
+LAYERBENCH_TRANSPORT_FIELDS(OUTBOUND_TRANSPORT_V6)
+LAYERBENCH_TRANSPORT_FIELDS(INBOUND_TRANSPORT_V4)
+LAYERBENCH_TRANSPORT_FIELDS(INBOUND_TRANSPORT_V6)
+LAYERBENCH_ALE_FIELDS(ALE_AUTH_CONNECT_V4)
+LAYERBENCH_ALE_FIELDS(ALE_AUTH_CONNECT_V6)
+LAYERBENCH_ALE_FIELDS(ALE_AUTH_RECV_ACCEPT_V4)
+LAYERBENCH_ALE_FIELDS(ALE_AUTH_RECV_ACCEPT_V6)
+
+#define LAYERBENCH_FIELDS 10
+
+typedef enum TL_INSPECT_PACKET_TYPE_
+{
+   TL_INSPECT_CONNECT_PACKET,
+   TL_INSPECT_DATA_PACKET,
+   TL_INSPECT_REAUTH_PACKET
+} TL_INSPECT_PACKET_TYPE;
+
+//
+// The fields of the pended packet of the driver that the functions read.
+//
+typedef struct TL_INSPECT_PENDED_PACKET_
+{
+   ADDRESS_FAMILY addressFamily;
+   TL_INSPECT_PACKET_TYPE type;
+   FWP_DIRECTION direction;
+   UINT8 protocol;
+   union
+   {
+      FWP_BYTE_ARRAY16 localAddr;
+      UINT32 ipv4LocalAddr;
+   };
+   UINT16 localPort;
+   UINT16 remotePort;
+   union
+   {
+      FWP_BYTE_ARRAY16 remoteAddr;
+      UINT32 ipv4RemoteAddr;
+   };
+} TL_INSPECT_PENDED_PACKET;
+
+#include "layer.h"
+
+#define LAYERBENCH_VALUES 4096
+
+//
+// The layers with a 5-tuple.
+//
+static const UINT16 gLayerBenchLayers[] =
+{
+   FWPS_LAYER_ALE_AUTH_CONNECT_V4,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V6,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V4,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V6,
+   FWPS_LAYER_INBOUND_TRANSPORT_V4,
+   FWPS_LAYER_INBOUND_TRANSPORT_V6
+};
+
+#define LAYERBENCH_LAYERS \
+   (sizeof(gLayerBenchLayers) / sizeof(gLayerBenchLayers[0]))
+
+FWPS_INCOMING_VALUES gMixedValues[LAYERBENCH_VALUES];
+FWPS_INCOMING_VALUES gLayerValues[LAYERBENCH_VALUES];
+FWPS_INCOMING_VALUE gFields[2 * LAYERBENCH_VALUES][LAYERBENCH_FIELDS];
+FWP_BYTE_ARRAY16 gAddresses[2 * LAYERBENCH_VALUES][2];
+
+TL_INSPECT_PENDED_PACKET gMixedPackets[LAYERBENCH_VALUES];
+TL_INSPECT_PENDED_PACKET gLayerPackets[LAYERBENCH_VALUES];
+TL_INSPECT_PENDED_PACKET gOutput[LAYERBENCH_VALUES];
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+LayerBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+double
+LayerBenchSeconds(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+//
+// The functions as they were before the layer table.
+//
+
+__forceinline
+void
+GetNetwork5TupleIndexesForLayer(
+   _In_ UINT16 layerId,
+   _Out_ UINT* localAddressIndex,
+   _Out_ UINT* remoteAddressIndex,
+   _Out_ UINT* localPortIndex,
+   _Out_ UINT* remotePortIndex,
+   _Out_ UINT* protocolIndex
+   )
+{
+   switch (layerId)
+   {
+   case FWPS_LAYER_ALE_AUTH_CONNECT_V4:
+      *localAddressIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_ALE_AUTH_CONNECT_V6:
+      *localAddressIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_ALE_AUTH_CONNECT_V6_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4:
+      *localAddressIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V4_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6:
+      *localAddressIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_ALE_AUTH_RECV_ACCEPT_V6_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_OUTBOUND_TRANSPORT_V4:
+      *localAddressIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V4_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_OUTBOUND_TRANSPORT_V6:
+      *localAddressIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_OUTBOUND_TRANSPORT_V6_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_INBOUND_TRANSPORT_V4:
+      *localAddressIndex = FWPS_FIELD_INBOUND_TRANSPORT_V4_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_INBOUND_TRANSPORT_V4_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_INBOUND_TRANSPORT_V4_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_INBOUND_TRANSPORT_V4_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_INBOUND_TRANSPORT_V4_IP_PROTOCOL;
+      break;
+   case FWPS_LAYER_INBOUND_TRANSPORT_V6:
+      *localAddressIndex = FWPS_FIELD_INBOUND_TRANSPORT_V6_IP_LOCAL_ADDRESS;
+      *remoteAddressIndex = FWPS_FIELD_INBOUND_TRANSPORT_V6_IP_REMOTE_ADDRESS;
+      *localPortIndex = FWPS_FIELD_INBOUND_TRANSPORT_V6_IP_LOCAL_PORT;
+      *remotePortIndex = FWPS_FIELD_INBOUND_TRANSPORT_V6_IP_REMOTE_PORT;
+      *protocolIndex = FWPS_FIELD_INBOUND_TRANSPORT_V6_IP_PROTOCOL;
+      break;
+   default:
+      *localAddressIndex = UINT32_MAX;
+      *remoteAddressIndex = UINT32_MAX;
+      *localPortIndex = UINT32_MAX;
+      *remotePortIndex = UINT32_MAX;
+      *protocolIndex = UINT32_MAX;
+      NT_ASSERT(0);
+   }
+}
+
+LAYERBENCH_NOINLINE
+void
+SwitchFillNetwork5Tuple(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   UINT localAddrIndex;
+   UINT remoteAddrIndex;
+   UINT localPortIndex;
+   UINT remotePortIndex;
+   UINT protocolIndex;
+
+   GetNetwork5TupleIndexesForLayer(
+      inFixedValues->layerId,
+      &localAddrIndex,
+      &remoteAddrIndex,
+      &localPortIndex,
+      &remotePortIndex,
+      &protocolIndex
+      );
+
+   if (addressFamily == AF_INET)
+   {
+      packet->ipv4LocalAddr = RtlUlongByteSwap(
+         inFixedValues->incomingValue[localAddrIndex].value.uint32);
+      packet->ipv4RemoteAddr = RtlUlongByteSwap(
+         inFixedValues->incomingValue[remoteAddrIndex].value.uint32);
+   }
+   else
+   {
+      RtlCopyMemory(
+         (UINT8*)&packet->localAddr,
+         inFixedValues->incomingValue[localAddrIndex].value.byteArray16,
+         sizeof(FWP_BYTE_ARRAY16)
+         );
+      RtlCopyMemory(
+         (UINT8*)&packet->remoteAddr,
+         inFixedValues->incomingValue[remoteAddrIndex].value.byteArray16,
+         sizeof(FWP_BYTE_ARRAY16)
+         );
+   }
+
+   packet->localPort = RtlUshortByteSwap(
+      inFixedValues->incomingValue[localPortIndex].value.uint16);
+   packet->remotePort = RtlUshortByteSwap(
+      inFixedValues->incomingValue[remotePortIndex].value.uint16);
+
+   packet->protocol = inFixedValues->incomingValue[protocolIndex].value.uint8;
+}
+
+LAYERBENCH_NOINLINE
+BOOLEAN
+SwitchIsMatchingConnectPacket(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ FWP_DIRECTION direction,
+   _In_ const TL_INSPECT_PENDED_PACKET* pendedPacket
+   )
+{
+   UINT localAddrIndex;
+   UINT remoteAddrIndex;
+   UINT localPortIndex;
+   UINT remotePortIndex;
+   UINT protocolIndex;
+
+   GetNetwork5TupleIndexesForLayer(
+      inFixedValues->layerId,
+      &localAddrIndex,
+      &remoteAddrIndex,
+      &localPortIndex,
+      &remotePortIndex,
+      &protocolIndex
+      );
+
+   if (localAddrIndex == UINT32_MAX)
+   {
+      return FALSE;
+   }
+
+   if ((addressFamily != pendedPacket->addressFamily) ||
+       (direction != pendedPacket->direction) ||
+       (inFixedValues->incomingValue[protocolIndex].value.uint8 !=
+        pendedPacket->protocol) ||
+       (RtlUshortByteSwap(inFixedValues->incomingValue[localPortIndex].value.uint16) !=
+        pendedPacket->localPort) ||
+       (RtlUshortByteSwap(inFixedValues->incomingValue[remotePortIndex].value.uint16) !=
+        pendedPacket->remotePort))
+   {
+      return FALSE;
+   }
+
+   if (addressFamily == AF_INET)
+   {
+      return (RtlUlongByteSwap(
+                 inFixedValues->incomingValue[localAddrIndex].value.uint32) ==
+              pendedPacket->ipv4LocalAddr) &&
+             (RtlUlongByteSwap(
+                 inFixedValues->incomingValue[remoteAddrIndex].value.uint32) ==
+              pendedPacket->ipv4RemoteAddr);
+   }
+
+   return (RtlCompareMemory(
+              inFixedValues->incomingValue[localAddrIndex].value.byteArray16,
+              &pendedPacket->localAddr,
+              sizeof(FWP_BYTE_ARRAY16)) == sizeof(FWP_BYTE_ARRAY16)) &&
+          (RtlCompareMemory(
+              inFixedValues->incomingValue[remoteAddrIndex].value.byteArray16,
+              &pendedPacket->remoteAddr,
+              sizeof(FWP_BYTE_ARRAY16)) == sizeof(FWP_BYTE_ARRAY16));
+}
+
+void
+LayerBenchGenerate(
+   _Out_ FWPS_INCOMING_VALUES* values,
+   _Out_ TL_INSPECT_PENDED_PACKET* packets,
+   _In_ UINT32 first,
+   _In_ BOOLEAN mixed
+   )
+/* ++
+
+   Fills random values at the layers with a 5-tuple, or only at the
+   inbound transport v4 layer, and for each a pended connect, made from
+   the values and changed in its remote port for every other one.
+
+-- */
+{
+   UINT32 i;
+   UINT32 field;
+
+   for (i = 0; i < LAYERBENCH_VALUES; i++)
+   {
+      FWPS_INCOMING_VALUE* fields = gFields[first + i];
+      const TL_INSPECT_LAYER* layer;
+
+      values[i].layerId = mixed ?
+         gLayerBenchLayers[LayerBenchRandom() % LAYERBENCH_LAYERS] :
+         FWPS_LAYER_INBOUND_TRANSPORT_V4;
+      values[i].valueCount = LAYERBENCH_FIELDS;
+      values[i].incomingValue = fields;
+
+      layer = TLInspectLayerForId(values[i].layerId);
+
+      for (field = 0; field < LAYERBENCH_FIELDS; field++)
+      {
+         fields[field].value.uint32 = (UINT32)LayerBenchRandom();
+      }
+
+      fields[layer->protocol].value.uint8 = (LayerBenchRandom() % 2) ? 6 : 17;
+
+      if (layer->addressFamily == AF_INET6)
+      {
+         UINT64 random[4] =
+         {
+            LayerBenchRandom(), LayerBenchRandom(),
+            LayerBenchRandom(), LayerBenchRandom()
+         };
+
+         memcpy(&gAddresses[first + i][0], &random[0], 16);
+         memcpy(&gAddresses[first + i][1], &random[2], 16);
+         fields[layer->localAddress].value.byteArray16 = &gAddresses[first + i][0];
+         fields[layer->remoteAddress].value.byteArray16 = &gAddresses[first + i][1];
+      }
+
+      memset(&packets[i], 0, sizeof(packets[i]));
+      packets[i].type = TL_INSPECT_CONNECT_PACKET;
+      packets[i].addressFamily = layer->addressFamily;
+      packets[i].direction = (FWP_DIRECTION)layer->direction;
+      FillNetwork5Tuple(&values[i], layer, &packets[i]);
+
+      if (i & 1)
+      {
+         packets[i].remotePort ^= 1;
+      }
+   }
+}
+
+int
+LayerBenchCheck(
+   _In_ const FWPS_INCOMING_VALUES* values,
+   _In_ const TL_INSPECT_PENDED_PACKET* packets
+   )
+{
+   UINT32 i;
+
+   for (i = 0; i < LAYERBENCH_VALUES; i++)
+   {
+      const TL_INSPECT_LAYER* layer = TLInspectLayerForId(values[i].layerId);
+      TL_INSPECT_PENDED_PACKET expected;
+      TL_INSPECT_PENDED_PACKET packet;
+
+      memset(&expected, 0, sizeof(expected));
+      memset(&packet, 0, sizeof(packet));
+
+      SwitchFillNetwork5Tuple(&values[i], layer->addressFamily, &expected);
+      FillNetwork5Tuple(&values[i], layer, &packet);
+
+      if ((memcmp(&expected, &packet, sizeof(packet)) != 0) ||
+          (SwitchIsMatchingConnectPacket(
+              &values[i],
+              layer->addressFamily,
+              (FWP_DIRECTION)layer->direction,
+              &packets[i]) !=
+           IsMatchingConnectPacket(
+              &values[i],
+              layer,
+              (FWP_DIRECTION)layer->direction,
+              &packets[i])))
+      {
+         fprintf(stderr, "values %u at layer %u differ\n", i, values[i].layerId);
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+//
+// The loops of the variants; with the constant layer, the loop is built
+// for the inbound transport v4 layer, like its classifyFn.
+//
+#define LAYERBENCH_LOOP(calls, values, body)                         \
+   {                                                                 \
+      UINT64 i;                                                      \
+                                                                     \
+      for (i = 0; i < (calls); i++)                                  \
+      {                                                              \
+         UINT32 slot = (UINT32)(i & (LAYERBENCH_VALUES - 1));        \
+         const FWPS_INCOMING_VALUES* inFixedValues = &(values)[slot];\
+                                                                     \
+         body                                                        \
+      }                                                              \
+   }
+
+double
+LayerBenchFill(
+   _In_ const FWPS_INCOMING_VALUES* values,
+   _In_ UINT64 calls,
+   _In_ int variant
+   )
+{
+   double start = LayerBenchSeconds();
+
+   switch (variant)
+   {
+   case 0:
+      LAYERBENCH_LOOP(calls, values,
+         SwitchFillNetwork5Tuple(
+            inFixedValues,
+            TLInspectLayerForId(inFixedValues->layerId)->addressFamily,
+            &gOutput[slot]);)
+      break;
+   case 1:
+      LAYERBENCH_LOOP(calls, values,
+         FillNetwork5Tuple(
+            inFixedValues,
+            TLInspectLayerForId(inFixedValues->layerId),
+            &gOutput[slot]);)
+      break;
+   default:
+      LAYERBENCH_LOOP(calls, values,
+         FillNetwork5Tuple(
+            inFixedValues,
+            &gInspectLayers[FWPS_LAYER_INBOUND_TRANSPORT_V4],
+            &gOutput[slot]);)
+      break;
+   }
+
+   __asm__ volatile("" : : "g"(gOutput) : "memory");
+
+   return (LayerBenchSeconds() - start) * 1e9 / (double)calls;
+}
+
+double
+LayerBenchMatch(
+   _In_ const FWPS_INCOMING_VALUES* values,
+   _In_ const TL_INSPECT_PENDED_PACKET* packets,
+   _In_ UINT64 calls,
+   _In_ int variant,
+   _Out_ UINT64* matches
+   )
+{
+   double start = LayerBenchSeconds();
+   UINT64 count = 0;
+
+   switch (variant)
+   {
+   case 0:
+      LAYERBENCH_LOOP(calls, values,
+         const TL_INSPECT_LAYER* layer =
+            TLInspectLayerForId(inFixedValues->layerId);
+
+         count += SwitchIsMatchingConnectPacket(
+                     inFixedValues,
+                     layer->addressFamily,
+                     (FWP_DIRECTION)layer->direction,
+                     &packets[slot]);)
+      break;
+   case 1:
+      LAYERBENCH_LOOP(calls, values,
+         const TL_INSPECT_LAYER* layer =
+            TLInspectLayerForId(inFixedValues->layerId);
+
+         count += IsMatchingConnectPacket(
+                     inFixedValues,
+                     layer,
+                     (FWP_DIRECTION)layer->direction,
+                     &packets[slot]);)
+      break;
+   default:
+      LAYERBENCH_LOOP(calls, values,
+         count += IsMatchingConnectPacket(
+                     inFixedValues,
+                     &gInspectLayers[FWPS_LAYER_INBOUND_TRANSPORT_V4],
+                     FWP_DIRECTION_INBOUND,
+                     &packets[slot]);)
+      break;
+   }
+
+   *matches = count;
+
+   return (LayerBenchSeconds() - start) * 1e9 / (double)calls;
+}
+
+int
+main(
+   int argc,
+   char** argv
+   )
+{
+   static const char* names[] = { "switch", "table", "constant layer" };
+   UINT64 calls = (argc > 1) ? strtoull(argv[1], NULL, 0) : 100000000ull;
+   UINT64 matches;
+   int variant;
+
+   LayerBenchGenerate(gMixedValues, gMixedPackets, 0, TRUE);
+   LayerBenchGenerate(gLayerValues, gLayerPackets, LAYERBENCH_VALUES, FALSE);
+
+   if ((LayerBenchCheck(gMixedValues, gMixedPackets) != 0) ||
+       (LayerBenchCheck(gLayerValues, gLayerPackets) != 0))
+   {
+      return 1;
+   }
+
+   printf("%-16s %-15s %18s %24s\n",
+          "values", "indexes", "FillNetwork5Tuple", "IsMatchingConnectPacket");
+
+   for (variant = 0; variant < 2; variant++)
+   {
+      double fill = LayerBenchFill(gMixedValues, calls, variant);
+      double match = LayerBenchMatch(gMixedValues, gMixedPackets, calls, variant, &matches);
+
+      printf("%-16s %-15s %15.2f ns %21.2f ns\n",
+             "8 layers", names[variant], fill, match);
+   }
+
+   for (variant = 0; variant < 3; variant++)
+   {
+      double fill = LayerBenchFill(gLayerValues, calls, variant);
+      double match = LayerBenchMatch(gLayerValues, gLayerPackets, calls, variant, &matches);
+
+      printf("%-16s %-15s %15.2f ns %21.2f ns\n",
+             "inbound v4", names[variant], fill, match);
+   }
+
+   return (matches == calls / 2) ? 0 : 1;
+}
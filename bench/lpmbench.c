@@ -0,0 +1,402 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Lookup-rate benchmark of the longest-prefix-match tables of the driver
+   (sys\lpm.c), built in user mode on Linux:
+
+      cc -O2 -I sys -o lpmbench bench/lpmbench.c
+      ./lpmbench [lookups]
+
+   For 1k, 100k and 1M random IPv4 and IPv6 prefixes, with lengths spread
+   like in an Internet routing table, it prints the build time, the size
+   of the table and the lookup rate. Half of the looked up addresses
+   fall within a prefix. The 1k tables are first checked against a linear
+   search of the prefixes.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef size_t SIZE_T;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXUINT32 UINT32_MAX
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_opt_
+#define _In_reads_bytes_(size)
+#define _Inout_updates_(count)
+
+#define RtlZeroMemory(destination, length) memset((destination), 0, (length))
+#define RtlCopyMemory(destination, source, length) \
+   memcpy((destination), (source), (length))
+
+#define TL_INSPECT_LPM_USER_MODE
+#include "lpm.c"
+
+#define LPMBENCH_ADDRESSES (1 << 20)
+#define LPMBENCH_CHECKED_LOOKUPS 200000
+
+typedef struct LPMBENCH_PREFIX_
+{
+   UINT8 address[16];
+   UINT32 length;
+   UINT16 value;
+} LPMBENCH_PREFIX;
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+LpmBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+double
+LpmBenchSeconds(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+UINT32
+LpmBenchPrefixLength(
+   _In_ UINT32 addressLength
+   )
+/* ++
+
+   Roughly the distribution of a routing table: mostly /24 for IPv4 and
+   /48 for IPv6, the rest spread over the shorter lengths.
+
+-- */
+{
+   UINT32 draw = (UINT32)(LpmBenchRandom() % 100);
+
+   if (addressLength == 32)
+   {
+      if (draw < 60)
+      {
+         return 24;
+      }
+      if (draw < 80)
+      {
+         return 20 + (UINT32)(LpmBenchRandom() % 4);
+      }
+      if (draw < 95)
+      {
+         return 16 + (UINT32)(LpmBenchRandom() % 4);
+      }
+      return 8 + (UINT32)(LpmBenchRandom() % 8);
+   }
+
+   if (draw < 50)
+   {
+      return 48;
+   }
+   if (draw < 80)
+   {
+      return 32 + (UINT32)(LpmBenchRandom() % 16);
+   }
+   return 49 + (UINT32)(LpmBenchRandom() % 16);
+}
+
+void
+LpmBenchRandomBytes(
+   _Out_ UINT8* bytes,
+   _In_ UINT32 count
+   )
+{
+   UINT32 i;
+
+   for (i = 0; i < count; i++)
+   {
+      bytes[i] = (UINT8)LpmBenchRandom();
+   }
+}
+
+void
+LpmBenchGeneratePrefixes(
+   _Out_ LPMBENCH_PREFIX* prefixes,
+   _In_ UINT32 count,
+   _In_ UINT32 addressLength
+   )
+{
+   UINT32 i;
+
+   for (i = 0; i < count; i++)
+   {
+      memset(&prefixes[i], 0, sizeof(prefixes[i]));
+      LpmBenchRandomBytes(prefixes[i].address, addressLength / 8);
+
+      //
+      // IPv6 prefixes are kept in 2000::/3, like global unicast space.
+      //
+      if (addressLength == 128)
+      {
+         prefixes[i].address[0] = 0x20 | (prefixes[i].address[0] & 0x1f);
+      }
+
+      prefixes[i].length = LpmBenchPrefixLength(addressLength);
+      prefixes[i].value = (UINT16)(i + 1);
+   }
+}
+
+void
+LpmBenchGenerateAddresses(
+   _Out_ UINT8* addresses,
+   _In_ const LPMBENCH_PREFIX* prefixes,
+   _In_ UINT32 prefixCount,
+   _In_ UINT32 addressLength
+   )
+/* ++
+
+   Every other address is taken within a random prefix, the others are
+   random.
+
+-- */
+{
+   UINT32 addressBytes = addressLength / 8;
+   UINT32 i;
+   UINT32 j;
+
+   for (i = 0; i < LPMBENCH_ADDRESSES; i++)
+   {
+      UINT8* address = &addresses[(SIZE_T)i * addressBytes];
+
+      LpmBenchRandomBytes(address, addressBytes);
+
+      if (i & 1)
+      {
+         const LPMBENCH_PREFIX* prefix =
+            &prefixes[LpmBenchRandom() % prefixCount];
+
+         for (j = 0; j < prefix->length; j++)
+         {
+            UINT8 mask = (UINT8)(0x80 >> (j % 8));
+
+            address[j / 8] = (UINT8)((address[j / 8] & ~mask) |
+                                     (prefix->address[j / 8] & mask));
+         }
+      }
+   }
+}
+
+BOOLEAN
+LpmBenchLinearLookup(
+   _In_ const LPMBENCH_PREFIX* prefixes,
+   _In_ UINT32 prefixCount,
+   _In_ const UINT8* address,
+   _Out_ UINT16* value
+   )
+/* ++
+
+   Reference lookup. Among prefixes of the same length and bits, the last
+   one inserted wins, as in TLInspectLpmInsert.
+
+-- */
+{
+   UINT32 best = 0;
+   BOOLEAN found = FALSE;
+   UINT32 i;
+   UINT32 j;
+
+   for (i = 0; i < prefixCount; i++)
+   {
+      const LPMBENCH_PREFIX* prefix = &prefixes[i];
+      BOOLEAN match = TRUE;
+
+      for (j = 0; j < prefix->length; j++)
+      {
+         UINT8 mask = (UINT8)(0x80 >> (j % 8));
+
+         if ((address[j / 8] & mask) != (prefix->address[j / 8] & mask))
+         {
+            match = FALSE;
+            break;
+         }
+      }
+
+      if (match && (!found || (prefix->length >= best)))
+      {
+         best = prefix->length;
+         *value = prefix->value;
+         found = TRUE;
+      }
+   }
+
+   return found;
+}
+
+int
+LpmBenchRun(
+   _In_ UINT32 prefixCount,
+   _In_ UINT32 addressLength,
+   _In_ UINT64 lookups
+   )
+{
+   UINT32 addressBytes = addressLength / 8;
+   LPMBENCH_PREFIX* prefixes;
+   UINT8* addresses;
+   TL_INSPECT_LPM_TABLE table = { 0 };
+   double start;
+   double buildTime;
+   double lookupTime;
+   SIZE_T size;
+   UINT64 matches = 0;
+   UINT64 i;
+   int result = 1;
+
+   prefixes = calloc(prefixCount, sizeof(*prefixes));
+   addresses = malloc((SIZE_T)LPMBENCH_ADDRESSES * addressBytes);
+
+   if ((prefixes == NULL) || (addresses == NULL) ||
+       !TLInspectLpmInitialize(&table, addressLength))
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   LpmBenchGeneratePrefixes(prefixes, prefixCount, addressLength);
+   LpmBenchGenerateAddresses(addresses, prefixes, prefixCount, addressLength);
+
+   start = LpmBenchSeconds();
+
+   for (i = 0; i < prefixCount; i++)
+   {
+      if (!TLInspectLpmInsert(
+              &table,
+              prefixes[i].address,
+              prefixes[i].length,
+              prefixes[i].value))
+      {
+         fprintf(stderr, "insert failed\n");
+         goto Exit;
+      }
+   }
+
+   if (!TLInspectLpmBuild(&table))
+   {
+      fprintf(stderr, "build failed\n");
+      goto Exit;
+   }
+
+   buildTime = LpmBenchSeconds() - start;
+
+   size = (SIZE_T)table.entryCapacity * sizeof(TL_INSPECT_LPM_ENTRY);
+   if (table.ranges != NULL)
+   {
+      size += (SIZE_T)table.rangeCount * sizeof(TL_INSPECT_LPM_RANGE) +
+              (TL_INSPECT_LPM_ROOT_ENTRIES + 1) * sizeof(UINT32);
+   }
+
+   if (prefixCount <= 1000)
+   {
+      for (i = 0; i < LPMBENCH_CHECKED_LOOKUPS; i++)
+      {
+         const UINT8* address =
+            &addresses[(SIZE_T)(i % LPMBENCH_ADDRESSES) * addressBytes];
+         UINT16 expected = 0;
+         UINT16 value = 0;
+         BOOLEAN expectedFound =
+            LpmBenchLinearLookup(prefixes, prefixCount, address, &expected);
+         BOOLEAN found = TLInspectLpmLookup(&table, address, &value);
+
+         if ((found != expectedFound) || (found && (value != expected)))
+         {
+            fprintf(stderr, "IPv%u lookup %llu: got %u/%u, expected %u/%u\n",
+                    (addressLength == 32) ? 4 : 6,
+                    (unsigned long long)i,
+                    found, value, expectedFound, expected);
+            goto Exit;
+         }
+      }
+   }
+
+   start = LpmBenchSeconds();
+
+   for (i = 0; i < lookups; i++)
+   {
+      UINT16 value;
+
+      matches += TLInspectLpmLookup(
+                    &table,
+                    &addresses[(SIZE_T)(i & (LPMBENCH_ADDRESSES - 1)) * addressBytes],
+                    &value
+                    );
+   }
+
+   lookupTime = LpmBenchSeconds() - start;
+
+   printf("IPv%u %8u prefixes: build %8.1f ms, %8.1f MB, "
+          "%7.1f M lookups/s (%5.1f ns), %4.1f%% matched\n",
+          (addressLength == 32) ? 4 : 6,
+          prefixCount,
+          buildTime * 1e3,
+          (double)size / 1e6,
+          (double)lookups / lookupTime / 1e6,
+          lookupTime * 1e9 / (double)lookups,
+          100.0 * (double)matches / (double)lookups);
+
+   result = 0;
+
+Exit:
+
+   TLInspectLpmFree(&table);
+   free(addresses);
+   free(prefixes);
+
+   return result;
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   static const UINT32 prefixCounts[] = { 1000, 100000, 1000000 };
+   UINT64 lookups = 20000000;
+   UINT32 i;
+
+   if (argc > 1)
+   {
+      lookups = strtoull(argv[1], NULL, 0);
+   }
+
+   for (i = 0; i < sizeof(prefixCounts) / sizeof(prefixCounts[0]); i++)
+   {
+      if ((LpmBenchRun(prefixCounts[i], 32, lookups) != 0) ||
+          (LpmBenchRun(prefixCounts[i], 128, lookups) != 0))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,606 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Order verification of the flow sharding of the driver (sys\shard.h),
+   built in user mode on Linux:
+
+      cc -O2 -pthread -iquote sys -iquote inc -o orderbench bench/orderbench.c
+      ./orderbench [packets]
+
+   Producer threads, standing for the classify functions, queue numbered
+   packets of many flows to the shard of their flow, picked with
+   TLInspectShardHash from a 5-tuple whose ends are swapped at random.
+   Worker threads dequeue and inspect the packets, taking a random time
+   for each, and inject them; the injection checks that the packets of
+   each flow come in the order they were numbered.
+
+   The workers run the way the driver does, claiming a shard with
+   TLInspectShardTryClaim and injecting what they dequeued from it before
+   releasing it, and then the way it did before, each worker stealing
+   packets one by one from the other shards with no claim. The traffic is
+   spread evenly over the flows, and then half of it goes to one flow. For
+   each run it prints the packets injected out of order, the share of each
+   worker and the packets taken over from the shards of other workers, and
+   it fails if the sharded workers injected any packet out of order.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t LONG;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_(count)
+
+#define __inline static inline
+
+#define ReadNoFence(address) __atomic_load_n((address), __ATOMIC_RELAXED)
+#define InterlockedCompareExchange(address, exchange, comparand) \
+   __sync_val_compare_and_swap((address), (comparand), (exchange))
+#define InterlockedExchange(address, value) \
+   __atomic_exchange_n((address), (value), __ATOMIC_SEQ_CST)
+
+#include "shard.h"
+
+#define ORDERBENCH_WORKERS 4
+#define ORDERBENCH_SHARDS (ORDERBENCH_WORKERS * TL_INSPECT_SHARDS_PER_PROCESSOR)
+#define ORDERBENCH_PRODUCERS 4
+#define ORDERBENCH_FLOWS 1024
+#define ORDERBENCH_MAX_WORK 2000                // spins per packet
+
+typedef struct ORDERBENCH_FLOW_
+{
+   UINT32 localAddr[4];
+   UINT32 remoteAddr[4];
+   UINT16 localPort;
+   UINT16 remotePort;
+   UINT8 protocol;
+
+   //
+   // nextSeq is numbered under the lock of the shard of the flow, and
+   // lastSeq updated by the injection.
+   //
+   UINT32 nextSeq;
+   volatile UINT32 lastSeq;
+} ORDERBENCH_FLOW;
+
+typedef struct ORDERBENCH_PACKET_
+{
+   struct ORDERBENCH_PACKET_* next;
+   UINT32 flow;
+   UINT32 seq;
+} ORDERBENCH_PACKET;
+
+typedef struct ORDERBENCH_SHARD_
+{
+   pthread_mutex_t lock;
+   ORDERBENCH_PACKET* head;
+   ORDERBENCH_PACKET* tail;
+   volatile LONG depth;
+   volatile LONG claimed;
+} ORDERBENCH_SHARD;
+
+typedef struct ORDERBENCH_RUN_
+{
+   const char* name;
+   BOOLEAN sharded;
+   BOOLEAN hotFlow;
+   UINT32 packetsPerProducer;
+
+   ORDERBENCH_FLOW flows[ORDERBENCH_FLOWS];
+   ORDERBENCH_SHARD shards[ORDERBENCH_SHARDS];
+   ORDERBENCH_PACKET* packets;
+
+   volatile UINT64 injected;
+   volatile UINT64 reordered;
+   UINT64 workerPackets[ORDERBENCH_WORKERS];
+   UINT64 takenOver[ORDERBENCH_WORKERS];
+} ORDERBENCH_RUN;
+
+typedef struct ORDERBENCH_THREAD_
+{
+   ORDERBENCH_RUN* run;
+   UINT32 index;
+   UINT64 randomState;
+} ORDERBENCH_THREAD;
+
+UINT64
+OrderBenchRandom(
+   _Inout_ UINT64* state
+   )
+{
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+ULONG
+OrderBenchFlowHash(
+   _In_ const ORDERBENCH_FLOW* flow,
+   _In_ BOOLEAN swapped
+   )
+{
+   if (swapped)
+   {
+      return TLInspectShardHash(
+                flow->remoteAddr,
+                flow->localAddr,
+                flow->remotePort,
+                flow->localPort,
+                flow->protocol
+                );
+   }
+
+   return TLInspectShardHash(
+             flow->localAddr,
+             flow->remoteAddr,
+             flow->localPort,
+             flow->remotePort,
+             flow->protocol
+             );
+}
+
+void*
+OrderBenchProducer(
+   void* context
+   )
+/* ++
+
+   Queues the packets of the producer to the shards of their flows, the
+   way TLInspectQueuePacket does.
+
+-- */
+{
+   ORDERBENCH_THREAD* thread = context;
+   ORDERBENCH_RUN* run = thread->run;
+   ORDERBENCH_PACKET* packets = run->packets +
+                                (size_t)thread->index * run->packetsPerProducer;
+   UINT32 i;
+
+   for (i = 0; i < run->packetsPerProducer; i++)
+   {
+      UINT64 random = OrderBenchRandom(&thread->randomState);
+      ORDERBENCH_PACKET* packet = &packets[i];
+      ORDERBENCH_FLOW* flow;
+      ORDERBENCH_SHARD* shard;
+
+      if (run->hotFlow && ((random & 1) != 0))
+      {
+         packet->flow = 0;
+      }
+      else
+      {
+         packet->flow = (UINT32)((random >> 1) % ORDERBENCH_FLOWS);
+      }
+
+      flow = &run->flows[packet->flow];
+      shard = &run->shards[OrderBenchFlowHash(flow, (random >> 32) & 1) %
+                           ORDERBENCH_SHARDS];
+
+      packet->next = NULL;
+
+      pthread_mutex_lock(&shard->lock);
+
+      packet->seq = ++flow->nextSeq;
+
+      if (shard->tail != NULL)
+      {
+         shard->tail->next = packet;
+      }
+      else
+      {
+         shard->head = packet;
+      }
+      shard->tail = packet;
+
+      __atomic_add_fetch(&shard->depth, 1, __ATOMIC_SEQ_CST);
+
+      pthread_mutex_unlock(&shard->lock);
+   }
+
+   return NULL;
+}
+
+ORDERBENCH_PACKET*
+OrderBenchPop(
+   _Inout_ ORDERBENCH_SHARD* shard
+   )
+{
+   ORDERBENCH_PACKET* packet;
+
+   pthread_mutex_lock(&shard->lock);
+
+   packet = shard->head;
+
+   if (packet != NULL)
+   {
+      shard->head = packet->next;
+      if (shard->head == NULL)
+      {
+         shard->tail = NULL;
+      }
+
+      __atomic_sub_fetch(&shard->depth, 1, __ATOMIC_SEQ_CST);
+   }
+
+   pthread_mutex_unlock(&shard->lock);
+
+   return packet;
+}
+
+void
+OrderBenchInspect(
+   _Inout_ ORDERBENCH_THREAD* thread
+   )
+{
+   volatile UINT32 spin;
+   UINT32 work = (UINT32)(OrderBenchRandom(&thread->randomState) %
+                          ORDERBENCH_MAX_WORK);
+
+   for (spin = 0; spin < work; spin++)
+   {
+   }
+}
+
+void
+OrderBenchInject(
+   _Inout_ ORDERBENCH_RUN* run,
+   _In_ const ORDERBENCH_PACKET* packet
+   )
+/* ++
+
+   Counts the packet as reordered if a later packet of its flow was
+   injected before it.
+
+-- */
+{
+   ORDERBENCH_FLOW* flow = &run->flows[packet->flow];
+   UINT32 last = __atomic_load_n(&flow->lastSeq, __ATOMIC_SEQ_CST);
+
+   for (;;)
+   {
+      if (packet->seq < last)
+      {
+         __atomic_add_fetch(&run->reordered, 1, __ATOMIC_SEQ_CST);
+         break;
+      }
+
+      if (__atomic_compare_exchange_n(
+             &flow->lastSeq,
+             &last,
+             packet->seq,
+             FALSE,
+             __ATOMIC_SEQ_CST,
+             __ATOMIC_SEQ_CST))
+      {
+         break;
+      }
+   }
+
+   __atomic_add_fetch(&run->injected, 1, __ATOMIC_SEQ_CST);
+}
+
+UINT32
+OrderBenchDrainShard(
+   _Inout_ ORDERBENCH_THREAD* thread,
+   _Inout_ ORDERBENCH_SHARD* shard
+   )
+/* ++
+
+   Drains a shard the way a worker of the driver does: it claims the
+   shard, dequeues and inspects up to TL_INSPECT_SHARD_QUANTUM packets,
+   injects them, and releases the shard. Returns the packets drained.
+
+-- */
+{
+   ORDERBENCH_PACKET* batch[TL_INSPECT_SHARD_QUANTUM];
+   UINT32 count = 0;
+   UINT32 i;
+
+   if ((ReadNoFence(&shard->depth) <= 0) ||
+       !TLInspectShardTryClaim(&shard->claimed))
+   {
+      return 0;
+   }
+
+   while (count < TL_INSPECT_SHARD_QUANTUM)
+   {
+      batch[count] = OrderBenchPop(shard);
+      if (batch[count] == NULL)
+      {
+         break;
+      }
+
+      OrderBenchInspect(thread);
+      count++;
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      OrderBenchInject(thread->run, batch[i]);
+   }
+
+   TLInspectShardRelease(&shard->claimed);
+
+   return count;
+}
+
+UINT32
+OrderBenchStealPacket(
+   _Inout_ ORDERBENCH_THREAD* thread,
+   _Inout_ ORDERBENCH_SHARD* shard
+   )
+/* ++
+
+   Dequeues, inspects and injects one packet of the shard with no claim,
+   the way the workers stole from each other before the sharding.
+
+-- */
+{
+   ORDERBENCH_PACKET* packet = OrderBenchPop(shard);
+
+   if (packet == NULL)
+   {
+      return 0;
+   }
+
+   OrderBenchInspect(thread);
+   OrderBenchInject(thread->run, packet);
+
+   return 1;
+}
+
+void*
+OrderBenchWorker(
+   void* context
+   )
+{
+   ORDERBENCH_THREAD* thread = context;
+   ORDERBENCH_RUN* run = thread->run;
+   UINT64 total = (UINT64)run->packetsPerProducer * ORDERBENCH_PRODUCERS;
+   UINT32 i;
+   UINT32 n;
+
+   while (__atomic_load_n(&run->injected, __ATOMIC_SEQ_CST) < total)
+   {
+      UINT32 drained = 0;
+
+      //
+      // Own shards first, then those of the other workers.
+      //
+      for (n = 0; n < ORDERBENCH_SHARDS; n++)
+      {
+         ORDERBENCH_SHARD* shard;
+
+         i = (thread->index + n * ORDERBENCH_WORKERS) % ORDERBENCH_SHARDS;
+         if (n >= ORDERBENCH_SHARDS / ORDERBENCH_WORKERS)
+         {
+            i = (thread->index + n) % ORDERBENCH_SHARDS;
+            if ((i % ORDERBENCH_WORKERS) == thread->index)
+            {
+               continue;
+            }
+         }
+
+         shard = &run->shards[i];
+
+         drained = run->sharded ? OrderBenchDrainShard(thread, shard) :
+                                  OrderBenchStealPacket(thread, shard);
+
+         if (drained != 0)
+         {
+            run->workerPackets[thread->index] += drained;
+            if ((i % ORDERBENCH_WORKERS) != thread->index)
+            {
+               run->takenOver[thread->index] += drained;
+            }
+            break;
+         }
+      }
+
+      if (drained == 0)
+      {
+         sched_yield();
+      }
+   }
+
+   return NULL;
+}
+
+int
+OrderBenchRun(
+   _Inout_ ORDERBENCH_RUN* run
+   )
+{
+   ORDERBENCH_THREAD producers[ORDERBENCH_PRODUCERS];
+   ORDERBENCH_THREAD workers[ORDERBENCH_WORKERS];
+   pthread_t producerThreads[ORDERBENCH_PRODUCERS];
+   pthread_t workerThreads[ORDERBENCH_WORKERS];
+   UINT64 total = (UINT64)run->packetsPerProducer * ORDERBENCH_PRODUCERS;
+   UINT64 random = 0x9e3779b97f4a7c15ull;
+   struct timespec start;
+   struct timespec end;
+   double seconds;
+   UINT32 i;
+
+   run->packets = malloc(total * sizeof(ORDERBENCH_PACKET));
+   if (run->packets == NULL)
+   {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   for (i = 0; i < ORDERBENCH_FLOWS; i++)
+   {
+      ORDERBENCH_FLOW* flow = &run->flows[i];
+
+      flow->localAddr[0] = (UINT32)OrderBenchRandom(&random);
+      flow->remoteAddr[0] = (UINT32)OrderBenchRandom(&random);
+      if ((i & 1) != 0)
+      {
+         flow->localAddr[1] = (UINT32)OrderBenchRandom(&random);
+         flow->localAddr[3] = (UINT32)OrderBenchRandom(&random);
+         flow->remoteAddr[3] = (UINT32)OrderBenchRandom(&random);
+      }
+      flow->localPort = (UINT16)OrderBenchRandom(&random);
+      flow->remotePort = (UINT16)OrderBenchRandom(&random);
+      flow->protocol = ((i & 3) != 0) ? 6 : 17;
+
+      if (OrderBenchFlowHash(flow, FALSE) != OrderBenchFlowHash(flow, TRUE))
+      {
+         fprintf(stderr, "flow %u: the hash is not symmetric\n", i);
+         free(run->packets);
+         return 1;
+      }
+   }
+
+   for (i = 0; i < ORDERBENCH_SHARDS; i++)
+   {
+      pthread_mutex_init(&run->shards[i].lock, NULL);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (i = 0; i < ORDERBENCH_WORKERS; i++)
+   {
+      workers[i].run = run;
+      workers[i].index = i;
+      workers[i].randomState = OrderBenchRandom(&random);
+      pthread_create(&workerThreads[i], NULL, OrderBenchWorker, &workers[i]);
+   }
+
+   for (i = 0; i < ORDERBENCH_PRODUCERS; i++)
+   {
+      producers[i].run = run;
+      producers[i].index = i;
+      producers[i].randomState = OrderBenchRandom(&random);
+      pthread_create(&producerThreads[i], NULL, OrderBenchProducer, &producers[i]);
+   }
+
+   for (i = 0; i < ORDERBENCH_PRODUCERS; i++)
+   {
+      pthread_join(producerThreads[i], NULL);
+   }
+
+   for (i = 0; i < ORDERBENCH_WORKERS; i++)
+   {
+      pthread_join(workerThreads[i], NULL);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   seconds = (double)(end.tv_sec - start.tv_sec) +
+             (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+   printf("%-18s %8llu packets in %6.3f s, %7llu out of order, shares",
+          run->name,
+          (unsigned long long)run->injected,
+          seconds,
+          (unsigned long long)run->reordered);
+
+   for (i = 0; i < ORDERBENCH_WORKERS; i++)
+   {
+      printf(" %4.1f%%", 100.0 * (double)run->workerPackets[i] / (double)total);
+   }
+
+   printf(", taken over");
+
+   for (i = 0; i < ORDERBENCH_WORKERS; i++)
+   {
+      printf(" %4.1f%%", 100.0 * (double)run->takenOver[i] / (double)total);
+   }
+
+   printf("\n");
+
+   for (i = 0; i < ORDERBENCH_SHARDS; i++)
+   {
+      pthread_mutex_destroy(&run->shards[i].lock);
+   }
+
+   free(run->packets);
+
+   if (run->sharded && (run->reordered != 0))
+   {
+      fprintf(stderr, "%s: packets were injected out of order\n", run->name);
+      return 1;
+   }
+
+   return 0;
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   static const struct
+   {
+      const char* name;
+      BOOLEAN sharded;
+      BOOLEAN hotFlow;
+   } runs[] =
+   {
+      { "stealing", FALSE, FALSE },
+      { "sharded", TRUE, FALSE },
+      { "stealing hot flow", FALSE, TRUE },
+      { "sharded hot flow", TRUE, TRUE }
+   };
+   UINT32 packets = 1000000;
+   int result = 0;
+   UINT32 i;
+
+   if (argc > 1)
+   {
+      packets = (UINT32)strtoul(argv[1], NULL, 0);
+   }
+
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      ORDERBENCH_RUN* run = calloc(1, sizeof(ORDERBENCH_RUN));
+
+      if (run == NULL)
+      {
+         fprintf(stderr, "out of memory\n");
+         return 1;
+      }
+
+      run->name = runs[i].name;
+      run->sharded = runs[i].sharded;
+      run->hotFlow = runs[i].hotFlow;
+      run->packetsPerProducer = packets / ORDERBENCH_PRODUCERS;
+
+      if (OrderBenchRun(run) != 0)
+      {
+         result = 1;
+      }
+
+      free(run);
+   }
+
+   return result;
+}
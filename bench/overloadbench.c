@@ -0,0 +1,374 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Overload scenarios of the admission control of the driver
+   (sys\overload.h), built in user mode on Linux:
+
+      cc -O2 -I sys -I inc -o overloadbench bench/overloadbench.c -lm
+      ./overloadbench [seconds]
+
+   It simulates the packet queues of four processors, each served by a
+   worker that takes a fixed time per packet, fed by random arrivals that
+   are admitted by TLInspectOverloadAdmit as the classify functions do. A
+   packet is charged to its queue until the worker dequeues it, and to the
+   memory budget until the worker is done with it; the delay of a queue is
+   that of the last packet dequeued.
+
+   The scenarios are a nominal load, twice the load the workers can serve,
+   the same with large send offload sized packets, and a nominal load
+   whose first worker stalls for half a second. For each it prints the
+   packets offered and shed by limit exceeded, and the peaks of the queues,
+   of the memory and of the delay, and fails if a queue or the memory ever
+   exceeded its limit.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t LONG64;
+typedef int32_t LONG;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+
+#define __inline static inline
+
+#define TL_INSPECT_OVERLOAD_USER_MODE
+#include "overload.h"
+
+#define OVERLOADBENCH_QUEUES 4
+#define OVERLOADBENCH_SERVICE_TIME 50            // 5us per packet
+#define OVERLOADBENCH_PACKET_OVERHEAD 256        // pended packet, control data
+
+typedef struct OVERLOADBENCH_SCENARIO_
+{
+   const char* name;
+   double load;                  // offered load per worker
+   UINT32 packetMin;
+   UINT32 packetMax;
+   UINT64 stallStart;            // stall of worker 0, 100ns units
+   UINT64 stallEnd;
+} OVERLOADBENCH_SCENARIO;
+
+typedef struct OVERLOADBENCH_ENTRY_
+{
+   double enqueueTime;
+   ULONG bytes;
+} OVERLOADBENCH_ENTRY;
+
+//
+// OVERLOADBENCH_QUEUE is a packet queue, as a ring of entries, and its
+// worker; busyBytes is the charge of the packet being inspected until
+// busyUntil.
+//
+typedef struct OVERLOADBENCH_QUEUE_
+{
+   OVERLOADBENCH_ENTRY* entries;
+   UINT32 capacity;
+   UINT32 head;
+   LONG depth;
+   LONG64 bytes;
+   UINT64 delay;
+
+   double busyUntil;
+   ULONG busyBytes;
+} OVERLOADBENCH_QUEUE;
+
+typedef struct OVERLOADBENCH_RESULT_
+{
+   UINT64 offered;
+   UINT64 shed[TL_INSPECT_OVERLOAD_REASON_MAX];
+   LONG depthMax;
+   LONG64 queueBytesMax;
+   LONG64 memoryMax;
+   UINT64 delayMax;
+   double delaySum;
+   UINT64 dequeued;
+} OVERLOADBENCH_RESULT;
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+OverloadBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+double
+OverloadBenchUniform(void)
+{
+   return (double)((OverloadBenchRandom() >> 11) + 1) / 9007199254740993.0;
+}
+
+void
+OverloadBenchDrain(
+   _In_ const OVERLOADBENCH_SCENARIO* scenario,
+   _Inout_ OVERLOADBENCH_QUEUE* queue,
+   _In_ BOOLEAN stalls,
+   _In_ double now,
+   _Inout_ LONG64* memory,
+   _Inout_ OVERLOADBENCH_RESULT* result
+   )
+/* ++
+
+   Runs the worker of the queue up to now: it dequeues a packet once it is
+   done with the previous one, unless it is stalled.
+
+-- */
+{
+   for (;;)
+   {
+      const OVERLOADBENCH_ENTRY* entry;
+      double start;
+
+      if ((queue->busyBytes != 0) && (queue->busyUntil <= now))
+      {
+         *memory -= queue->busyBytes;
+         queue->busyBytes = 0;
+      }
+
+      if (queue->depth == 0)
+      {
+         return;
+      }
+
+      entry = &queue->entries[queue->head];
+      start = (queue->busyUntil > entry->enqueueTime) ?
+              queue->busyUntil : entry->enqueueTime;
+
+      if (stalls &&
+          (start >= (double)scenario->stallStart) &&
+          (start < (double)scenario->stallEnd))
+      {
+         start = (double)scenario->stallEnd;
+      }
+
+      if (start > now)
+      {
+         return;
+      }
+
+      queue->delay = (UINT64)(start - entry->enqueueTime);
+      queue->bytes -= entry->bytes;
+      queue->depth--;
+      queue->head = (queue->head + 1) % queue->capacity;
+
+      queue->busyUntil = start + OVERLOADBENCH_SERVICE_TIME;
+      queue->busyBytes = entry->bytes;
+
+      result->dequeued++;
+      result->delaySum += (double)queue->delay;
+      if (queue->delay > result->delayMax)
+      {
+         result->delayMax = queue->delay;
+      }
+   }
+}
+
+int
+OverloadBenchRun(
+   _In_ const OVERLOADBENCH_SCENARIO* scenario,
+   _In_ const TL_INSPECT_OVERLOAD_LIMITS* limits,
+   _In_ UINT64 duration
+   )
+{
+   OVERLOADBENCH_QUEUE queues[OVERLOADBENCH_QUEUES];
+   OVERLOADBENCH_RESULT result;
+   double interval;
+   double now = 0;
+   LONG64 memory = 0;
+   UINT64 shedCount = 0;
+   int status = 1;
+   UINT32 i;
+
+   memset(queues, 0, sizeof(queues));
+   memset(&result, 0, sizeof(result));
+
+   for (i = 0; i < OVERLOADBENCH_QUEUES; i++)
+   {
+      queues[i].capacity = (UINT32)limits->queueDepth + 1;
+      queues[i].entries = malloc(queues[i].capacity * sizeof(OVERLOADBENCH_ENTRY));
+      if (queues[i].entries == NULL)
+      {
+         fprintf(stderr, "out of memory\n");
+         goto Exit;
+      }
+   }
+
+   //
+   // Mean time between two arrivals on any of the queues.
+   //
+   interval = OVERLOADBENCH_SERVICE_TIME /
+              (scenario->load * OVERLOADBENCH_QUEUES);
+
+   for (;;)
+   {
+      OVERLOADBENCH_QUEUE* queue;
+      OVERLOADBENCH_ENTRY* entry;
+      TL_INSPECT_OVERLOAD_SAMPLE sample;
+      TL_INSPECT_OVERLOAD_REASON reason;
+
+      now += -log(OverloadBenchUniform()) * interval;
+      if (now >= (double)duration)
+      {
+         break;
+      }
+
+      for (i = 0; i < OVERLOADBENCH_QUEUES; i++)
+      {
+         OverloadBenchDrain(scenario, &queues[i], (i == 0), now, &memory, &result);
+      }
+
+      queue = &queues[OverloadBenchRandom() % OVERLOADBENCH_QUEUES];
+
+      sample.connect = FALSE;
+      sample.depth = queue->depth;
+      sample.queueBytes = queue->bytes;
+      sample.delay = queue->delay;
+      sample.memory = memory;
+      sample.bytes = OVERLOADBENCH_PACKET_OVERHEAD + scenario->packetMin +
+                     (ULONG)(OverloadBenchRandom() %
+                             (scenario->packetMax - scenario->packetMin + 1));
+
+      result.offered++;
+
+      if (!TLInspectOverloadAdmit(limits, &sample, &reason))
+      {
+         result.shed[reason]++;
+         shedCount++;
+         continue;
+      }
+
+      entry = &queue->entries[(queue->head + queue->depth) % queue->capacity];
+      entry->enqueueTime = now;
+      entry->bytes = sample.bytes;
+
+      queue->depth++;
+      queue->bytes += sample.bytes;
+      memory += sample.bytes;
+
+      if (queue->depth > result.depthMax)
+      {
+         result.depthMax = queue->depth;
+      }
+      if (queue->bytes > result.queueBytesMax)
+      {
+         result.queueBytesMax = queue->bytes;
+      }
+      if (memory > result.memoryMax)
+      {
+         result.memoryMax = memory;
+      }
+   }
+
+   printf("%-10s offered %8llu, shed %5.1f%% (depth %llu, bytes %llu, "
+          "delay %llu, memory %llu)\n",
+          scenario->name,
+          (unsigned long long)result.offered,
+          (result.offered != 0) ?
+             100.0 * (double)shedCount / (double)result.offered : 0.0,
+          (unsigned long long)result.shed[TL_INSPECT_OVERLOAD_QUEUE_DEPTH],
+          (unsigned long long)result.shed[TL_INSPECT_OVERLOAD_QUEUE_BYTES],
+          (unsigned long long)result.shed[TL_INSPECT_OVERLOAD_QUEUE_DELAY],
+          (unsigned long long)result.shed[TL_INSPECT_OVERLOAD_MEMORY]);
+   printf("%-10s peak depth %5d, queue %6.2f MB, memory %6.2f MB, "
+          "delay %7.2f ms (mean %6.2f ms)\n",
+          "",
+          result.depthMax,
+          (double)result.queueBytesMax / 1048576.0,
+          (double)result.memoryMax / 1048576.0,
+          (double)result.delayMax / 1e4,
+          (result.dequeued != 0) ?
+             result.delaySum / (double)result.dequeued / 1e4 : 0.0);
+
+   if ((result.depthMax > limits->queueDepth) ||
+       (result.queueBytesMax > limits->queueBytes) ||
+       (result.memoryMax > limits->memory))
+   {
+      fprintf(stderr, "%s: a limit was exceeded\n", scenario->name);
+      goto Exit;
+   }
+
+   status = 0;
+
+Exit:
+
+   for (i = 0; i < OVERLOADBENCH_QUEUES; i++)
+   {
+      free(queues[i].entries);
+   }
+
+   return status;
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   //
+   // The defaults of the driver, but for a 10ms delay and a 24MB budget:
+   // at 5us a packet, the workers would reach the default depth before the
+   // default delay, and the four queues could not exceed the default
+   // budget.
+   //
+   static const TL_INSPECT_OVERLOAD_LIMITS limits =
+   {
+      4096,                   // queueDepth
+      4096,                   // pendedConnects
+      8192 * 1024,            // queueBytes
+      24576 * 1024,           // memory
+      10 * 10000,             // queueDelay
+      TRUE                    // failOpen
+   };
+   static const OVERLOADBENCH_SCENARIO scenarios[] =
+   {
+      { "nominal", 0.8, 64, 1500, 0, 0 },
+      { "overload", 2.0, 64, 1500, 0, 0 },
+      { "large", 2.0, 16384, 65536, 0, 0 },
+      { "stall", 0.8, 64, 1500, 2000000, 7000000 }
+   };
+   UINT64 seconds = 2;
+   UINT32 i;
+
+   if (argc > 1)
+   {
+      seconds = strtoull(argv[1], NULL, 0);
+   }
+
+   for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+   {
+      if (OverloadBenchRun(&scenarios[i], &limits, seconds * 10000000) != 0)
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,547 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Contention benchmark of the packet queues of the driver (sys\queue.c),
+   built in user mode on Linux over the kernel of bench\shim:
+
+      cc -O2 -pthread -fshort-wchar -I bench/shim -iquote sys -iquote inc \
+         -o queuebench bench/queuebench.c bench/shim/shim.c sys/[A-Za-z]*.c
+      ./queuebench [packets]
+
+   Producer threads stand for the classify functions, each running on a
+   processor of the shim of its own: they queue their share of the packets
+   as fast as they can, while a consumer thread stands for a worker and
+   drains them. Three designs are run with 1, 2, 4, 8 and 16 producers:
+
+      lock pair   the queue the driver had before its packet queues: a
+                  producer takes gConnListLock and gPacketQueueLock, nested
+                  in-stack queued spin locks, to insert the packet at the
+                  tail of the list and tell whether it was empty, and sets
+                  the event of the worker if it was; the worker takes both
+                  locks in turn to remove each packet.
+
+      one shard   TLInspectQueuePacket, with every packet in one flow, so
+                  that all producers push to the lock-free ring of one
+                  shard, and a worker that drains it with
+                  TLInspectDequeuePacket as the worker threads do.
+
+      own flows   the same, with a flow per producer, so that the producers
+                  push to shards of their own, as they do when RSS spreads
+                  the flows over the processors.
+
+   For each run it prints the packets queued and drained per second, and
+   the wakeups of the worker, which only the producer that finds the queue
+   empty asks for. The program fails if a packet was drained out of the
+   order its producer queued it in, or if the worker slept while packets
+   were waiting.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "shim.h"
+
+#include "inspect.h"
+#include "queue.h"
+#include "stats.h"
+
+#define QUEUEBENCH_PACKETS (1 << 18)
+#define QUEUEBENCH_MAX_PRODUCERS 16
+
+typedef enum QUEUEBENCH_DESIGN_
+{
+   QUEUEBENCH_LOCK_PAIR,
+   QUEUEBENCH_ONE_SHARD,
+   QUEUEBENCH_OWN_FLOWS,
+   QUEUEBENCH_DESIGN_MAX
+} QUEUEBENCH_DESIGN;
+
+const char* gDesignNames[QUEUEBENCH_DESIGN_MAX] =
+{
+   "lock pair",
+   "one shard",
+   "own flows"
+};
+
+const ULONG gProducerCounts[] = { 1, 2, 4, 8, 16 };
+
+//
+// QUEUEBENCH_RUN is a run of a design with a number of producers, each of
+// which queues perProducer packets, producer i those from
+// i * perProducer on.
+//
+typedef struct QUEUEBENCH_RUN_
+{
+   QUEUEBENCH_DESIGN design;
+   ULONG producerCount;
+   ULONG perProducer;
+
+   pthread_barrier_t start;
+
+   LONG64 consumed;
+   LONG64 last[QUEUEBENCH_MAX_PRODUCERS];
+   LONG64 outOfOrder;
+   LONG64 lostWakeups;
+   LONG64 wakeups;
+} QUEUEBENCH_RUN;
+
+typedef struct QUEUEBENCH_PRODUCER_
+{
+   pthread_t thread;
+   QUEUEBENCH_RUN* run;
+   ULONG index;
+} QUEUEBENCH_PRODUCER;
+
+TL_INSPECT_PENDED_PACKET* gPackets;
+
+//
+// The lock pair and the lists of the queue the driver had before.
+//
+KSPIN_LOCK gLockPairConnListLock;
+KSPIN_LOCK gLockPairPacketQueueLock;
+LIST_ENTRY gLockPairConnList;
+LIST_ENTRY gLockPairPacketQueue;
+KEVENT gLockPairEvent;
+
+UINT64
+QueueBenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 1000000000 + (UINT64)now.tv_nsec;
+}
+
+LONG64
+QueueBenchWakeups(void)
+{
+   LONG64 wakeups = 0;
+   ULONG i;
+
+   for (i = 0; i < gStats.cpuCount; i++)
+   {
+      wakeups += ReadNoFence64(&gStats.cpu[i].dequeue.wakeups);
+   }
+
+   return wakeups;
+}
+
+void
+QueueBenchLockPairPush(
+   _In_ QUEUEBENCH_RUN* run,
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   Queues the packet as the classify functions did before the packet
+   queues.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
+   BOOLEAN signalWorkerThread;
+
+   KeAcquireInStackQueuedSpinLock(
+      &gLockPairConnListLock,
+      &connListLockHandle
+      );
+   KeAcquireInStackQueuedSpinLock(
+      &gLockPairPacketQueueLock,
+      &packetQueueLockHandle
+      );
+
+   signalWorkerThread = IsListEmpty(&gLockPairConnList) &&
+      IsListEmpty(&gLockPairPacketQueue);
+
+   InsertTailList(&gLockPairPacketQueue, &packet->listEntry);
+
+   KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
+   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
+   if (signalWorkerThread)
+   {
+      InterlockedIncrement64(&run->wakeups);
+
+      KeSetEvent(&gLockPairEvent, 0, FALSE);
+   }
+}
+
+TL_INSPECT_PENDED_PACKET*
+QueueBenchLockPairPop(void)
+/* ++
+
+   Removes the oldest packet as the worker thread did before the packet
+   queues: the connection list is looked at first, under its own lock.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
+   TL_INSPECT_PENDED_PACKET* packet = NULL;
+
+   KeAcquireInStackQueuedSpinLock(
+      &gLockPairConnListLock,
+      &connListLockHandle
+      );
+
+   if (!IsListEmpty(&gLockPairConnList))
+   {
+      packet = CONTAINING_RECORD(
+                  RemoveHeadList(&gLockPairConnList),
+                  TL_INSPECT_PENDED_PACKET,
+                  listEntry
+                  );
+   }
+
+   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
+   if (packet == NULL)
+   {
+      KeAcquireInStackQueuedSpinLock(
+         &gLockPairPacketQueueLock,
+         &packetQueueLockHandle
+         );
+
+      if (!IsListEmpty(&gLockPairPacketQueue))
+      {
+         packet = CONTAINING_RECORD(
+                     RemoveHeadList(&gLockPairPacketQueue),
+                     TL_INSPECT_PENDED_PACKET,
+                     listEntry
+                     );
+      }
+
+      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
+   }
+
+   return packet;
+}
+
+void
+QueueBenchConsume(
+   _Inout_ QUEUEBENCH_RUN* run,
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   Checks that the packet comes after the last one drained of its
+   producer. Every producer queues its packets in order, and each of them
+   is in a single flow, so the queue has to keep that order.
+
+-- */
+{
+   LONG64 index = packet - gPackets;
+   ULONG producer = (ULONG)(index / run->perProducer);
+
+   if (index <= run->last[producer])
+   {
+      if (run->outOfOrder++ < 20)
+      {
+         printf("FAILED %s: packet %lld of producer %lu drained after %lld\n",
+                gDesignNames[run->design],
+                (long long)index,
+                (unsigned long)producer,
+                (long long)run->last[producer]);
+      }
+   }
+
+   run->last[producer] = index;
+   run->consumed++;
+}
+
+void*
+QueueBenchConsumer(
+   _In_ void* context
+   )
+/* ++
+
+   Drains the packets of the run as the worker thread of its design does:
+   it sleeps until a producer sets its event, then drains until the queue
+   is empty. A wait that times out while packets are queued is a lost
+   wakeup.
+
+-- */
+{
+   QUEUEBENCH_RUN* run = context;
+   TL_INSPECT_WORKER* worker = &gWorkers[0];
+   LONG64 total = (LONG64)run->producerCount * run->perProducer;
+   TL_INSPECT_PENDED_PACKET* packet;
+   LARGE_INTEGER timeout;
+   NTSTATUS status;
+
+   timeout.QuadPart = -1000 * 10000;
+
+   pthread_barrier_wait(&run->start);
+
+   while (run->consumed < total)
+   {
+      if (run->design == QUEUEBENCH_LOCK_PAIR)
+      {
+         status = KeWaitForSingleObject(
+                     &gLockPairEvent,
+                     Executive,
+                     KernelMode,
+                     FALSE,
+                     &timeout
+                     );
+
+         if ((status == STATUS_TIMEOUT) &&
+             !IsListEmpty(&gLockPairPacketQueue))
+         {
+            run->lostWakeups++;
+         }
+
+         while ((packet = QueueBenchLockPairPop()) != NULL)
+         {
+            QueueBenchConsume(run, packet);
+         }
+
+         continue;
+      }
+
+      InterlockedExchange(&worker->idle, TRUE);
+
+      status = KeWaitForSingleObject(
+                  &worker->workEvent,
+                  Executive,
+                  KernelMode,
+                  FALSE,
+                  &timeout
+                  );
+
+      InterlockedExchange(&worker->idle, FALSE);
+      InterlockedExchange(&worker->wakePending, FALSE);
+
+      if ((status == STATUS_TIMEOUT) && (TLInspectQueueDepth() != 0))
+      {
+         run->lostWakeups++;
+      }
+
+      //
+      // See TLInspectDequeueNext.
+      //
+      for (;;)
+      {
+         packet = TLInspectDequeuePacket(worker, TL_INSPECT_SCHED_CLASS_DATA);
+
+         if ((packet == NULL) && (worker->shard != NULL) &&
+             IsListEmpty(&worker->spliced))
+         {
+            TLInspectReleaseShard(worker);
+
+            packet = TLInspectDequeuePacket(worker, TL_INSPECT_SCHED_CLASS_DATA);
+         }
+
+         if (packet == NULL)
+         {
+            break;
+         }
+
+         QueueBenchConsume(run, packet);
+      }
+
+      TLInspectReleaseShard(worker);
+   }
+
+   return NULL;
+}
+
+void*
+QueueBenchProducer(
+   _In_ void* context
+   )
+{
+   QUEUEBENCH_PRODUCER* producer = context;
+   QUEUEBENCH_RUN* run = producer->run;
+   TL_INSPECT_PENDED_PACKET* packet = &gPackets[producer->index * run->perProducer];
+   ULONG flowHash = (run->design == QUEUEBENCH_OWN_FLOWS) ? producer->index : 0;
+   ULONG i;
+
+   for (i = 0; i < run->perProducer; i++)
+   {
+      packet[i].type = TL_INSPECT_DATA_PACKET;
+      packet[i].flowHash = flowHash;
+   }
+
+   pthread_barrier_wait(&run->start);
+
+   for (i = 0; i < run->perProducer; i++)
+   {
+      if (run->design == QUEUEBENCH_LOCK_PAIR)
+      {
+         QueueBenchLockPairPush(run, &packet[i]);
+      }
+      else if (!TLInspectQueuePacket(&packet[i]))
+      {
+         printf("FAILED %s: packet not queued\n", gDesignNames[run->design]);
+         exit(1);
+      }
+   }
+
+   return NULL;
+}
+
+BOOLEAN
+QueueBenchRun(
+   _In_ QUEUEBENCH_DESIGN design,
+   _In_ ULONG producerCount,
+   _In_ ULONG packetCount,
+   _Out_ double* rate,
+   _Out_ LONG64* wakeups
+   )
+{
+   static QUEUEBENCH_RUN run;
+   QUEUEBENCH_PRODUCER producers[QUEUEBENCH_MAX_PRODUCERS];
+   pthread_t consumer;
+   LONG64 wakeupsBefore = QueueBenchWakeups();
+   UINT64 start;
+   UINT64 end;
+   ULONG i;
+
+   RtlZeroMemory(&run, sizeof(run));
+   run.design = design;
+   run.producerCount = producerCount;
+   run.perProducer = packetCount / producerCount;
+
+   for (i = 0; i < producerCount; i++)
+   {
+      run.last[i] = -1;
+   }
+
+   pthread_barrier_init(&run.start, NULL, producerCount + 2);
+
+   pthread_create(&consumer, NULL, QueueBenchConsumer, &run);
+
+   for (i = 0; i < producerCount; i++)
+   {
+      producers[i].run = &run;
+      producers[i].index = i;
+      pthread_create(&producers[i].thread, NULL, QueueBenchProducer, &producers[i]);
+   }
+
+   pthread_barrier_wait(&run.start);
+   start = QueueBenchNow();
+
+   for (i = 0; i < producerCount; i++)
+   {
+      pthread_join(producers[i].thread, NULL);
+   }
+
+   pthread_join(consumer, NULL);
+   end = QueueBenchNow();
+
+   pthread_barrier_destroy(&run.start);
+
+   *rate = (double)run.consumed * 1e9 / (double)(end - start);
+   *wakeups = (design == QUEUEBENCH_LOCK_PAIR) ?
+                 run.wakeups :
+                 QueueBenchWakeups() - wakeupsBefore;
+
+   if (run.lostWakeups != 0)
+   {
+      printf("FAILED %s: %lld lost wakeups with %lu producers\n",
+             gDesignNames[design],
+             (long long)run.lostWakeups,
+             (unsigned long)producerCount);
+   }
+
+   return (run.outOfOrder == 0) && (run.lostWakeups == 0);
+}
+
+int
+main(
+   int argc,
+   char** argv
+   )
+{
+   TL_INSPECT_SCHED_CONFIG schedConfig;
+   ULONG packetCount = QUEUEBENCH_PACKETS;
+   BOOLEAN passed = TRUE;
+   ULONG design;
+   ULONG i;
+
+   if (argc > 1)
+   {
+      packetCount = (ULONG)strtoul(argv[1], NULL, 0);
+   }
+
+   //
+   // A processor for each producer and the consumer of the largest run.
+   //
+   ShimInitialize(2 * (QUEUEBENCH_MAX_PRODUCERS + 1));
+
+   RtlZeroMemory(&schedConfig, sizeof(schedConfig));
+
+   if (!NT_SUCCESS(TLInspectInitializeQueues(1, &schedConfig)) ||
+       !NT_SUCCESS(TLInspectStatsInitialize()))
+   {
+      printf("FAILED: cannot initialize the packet queues\n");
+      return 1;
+   }
+
+   KeInitializeSpinLock(&gLockPairConnListLock);
+   KeInitializeSpinLock(&gLockPairPacketQueueLock);
+   InitializeListHead(&gLockPairConnList);
+   InitializeListHead(&gLockPairPacketQueue);
+   KeInitializeEvent(&gLockPairEvent, SynchronizationEvent, FALSE);
+
+   gPackets = calloc(packetCount, sizeof(TL_INSPECT_PENDED_PACKET));
+   if (gPackets == NULL)
+   {
+      printf("FAILED: out of memory\n");
+      return 1;
+   }
+
+   printf("%lu packets, %lu-slot rings, Mpackets/s (wakeups)\n",
+          (unsigned long)packetCount,
+          (unsigned long)TL_INSPECT_QUEUE_RING_SIZE);
+   printf("producers  %-20s  %-20s  %-20s\n",
+          gDesignNames[QUEUEBENCH_LOCK_PAIR],
+          gDesignNames[QUEUEBENCH_ONE_SHARD],
+          gDesignNames[QUEUEBENCH_OWN_FLOWS]);
+
+   for (i = 0; i < ARRAYSIZE(gProducerCounts); i++)
+   {
+      printf("%9lu", (unsigned long)gProducerCounts[i]);
+
+      for (design = 0; design < QUEUEBENCH_DESIGN_MAX; design++)
+      {
+         char column[32];
+         double rate;
+         LONG64 wakeups;
+
+         passed &= QueueBenchRun(
+                      (QUEUEBENCH_DESIGN)design,
+                      gProducerCounts[i],
+                      packetCount,
+                      &rate,
+                      &wakeups
+                      );
+
+         snprintf(column, sizeof(column), "%.2f (%lld)", rate / 1e6, (long long)wakeups);
+         printf("  %-20s", column);
+      }
+
+      printf("\n");
+      fflush(stdout);
+   }
+
+   TLInspectStatsFree();
+   TLInspectFreeQueues();
+   free(gPackets);
+
+   return passed ? 0 : 1;
+}
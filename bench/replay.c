@@ -0,0 +1,1816 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Replay of a packet capture through the driver, built in user mode on
+   Linux over the shim of the kernel, WFP and WDF of bench\shim:
+
+      cc -O2 -pthread -fshort-wchar -I bench/shim -iquote sys -iquote inc \
+         -o replay bench/replay.c bench/shim/shim.c sys/[A-Za-z]*.c
+      ./replay -w capture.pcap
+      ./replay -p 0.0.0.0/0 -p ::/0 capture.pcap
+
+   The driver is loaded as DriverEntry would be, and each packet of the
+   capture is classified at the layers where the TCP/IP stack would
+   indicate it, then freed as the stack would once the classify returns.
+   The worker threads of the driver run as they do in the kernel, and the
+   packets they inject are classified again at the layer they were
+   injected to, where the driver skips them.
+
+   Without -p, the driver inspects all addresses at the IP packet layers,
+   where every packet is decided by the classify. With the remote prefixes
+   to inspect given by -p, the driver classifies at the ALE and transport
+   layers: the first packet of an outbound connection is held while its
+   connect is pended, and released through the outbound transport layer
+   once the re-authorization that completing it triggers is permitted;
+   the first packet of an inbound connection goes to the inbound
+   transport layer, which leaves it to the ALE, then to the recv-accept
+   layer, and the packets that follow are held until the driver completes
+   the recv-accept. Other packets go to the transport layer of their
+   direction. A packet is outbound if its source is in a prefix given by
+   -l, or, without -l, if its source port is above its destination port.
+
+   The capture is replayed by -j threads, standing for the processors the
+   receive side scaling of the adapter spreads the flows to: each replays
+   the packets of the flows whose hash falls to it, in their order.
+
+   The replay prints the packets classified per second, the time taken by
+   the driver to drain its queues once the capture is replayed, the depth
+   of the packet queues sampled during the replay, and what the driver
+   pended, blocked and injected.
+
+   -s replays the capture at 1, 2, 4, 8 and 16 worker threads, on as many
+   processors of the shim at least, and prints a line for each. Since the
+   driver can only be loaded once in a process, each is replayed by a
+   child process of its own.
+
+   -w writes a capture of synthetic TCP connections, IPv4 and IPv6, from
+   local ports above 49152 to remote ports 80 and 443, interleaved, with
+   the handshake, data both ways and the closing of each.
+
+   Options:
+
+      -p prefix    remote prefix to inspect; may be repeated
+      -r rule      inspection rule (see TLInspectAddRule); may be repeated
+      -l prefix    local prefix; may be repeated
+      -b           block the inspected traffic (BlockTraffic)
+      -t n         worker threads (WorkerThreadCount; 0, one per processor)
+      -c n         processors of the shim (default, those of the host)
+      -j n         threads replaying the capture (1, default)
+      -s           replay at 1, 2, 4, 8 and 16 worker threads
+      -n n         times the capture is replayed (1, default)
+      -m n         bytes of each MDL of the net buffer lists (0, one MDL)
+      -w file      write a synthetic capture to file instead
+      -f n         connections of the synthetic capture (1000, default)
+      -k n         data packets of each connection (20, default)
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "shim.h"
+#include "fwpmk.h"
+#include "inspect.h"
+#include "stats.h"
+#include "queue.h"
+#include "overload.h"
+
+//
+// The socket headers of the host cannot be included with those of the
+// shim, which define the same structures.
+//
+#define REPLAY_HOST_AF_INET 2
+#define REPLAY_HOST_AF_INET6 10
+
+int inet_pton(int family, const char* string, void* address);
+
+extern BOOLEAN gInspectAllByDefault;
+
+DRIVER_INITIALIZE DriverEntry;
+
+void
+TLInspectStatsCollect(
+   _Out_ TL_INSPECT_STATS_PAGE* snapshot
+   );
+
+#define REPLAY_MAX_PREFIXES 16
+#define REPLAY_MAX_THREADS 64
+#define REPLAY_FLOW_BUCKETS 65536
+#define REPLAY_DEPTH_SAMPLE 256
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NANOSECONDS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_LINKTYPE_RAW 101
+#define PCAP_LINKTYPE_LINUX_SLL 113
+#define PCAP_LINKTYPE_IPV4 228
+#define PCAP_LINKTYPE_IPV6 229
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+typedef struct PCAP_HEADER_
+{
+   UINT32 magic;
+   UINT16 versionMajor;
+   UINT16 versionMinor;
+   INT32 timeZone;
+   UINT32 sigFigs;
+   UINT32 snapLength;
+   UINT32 linkType;
+} PCAP_HEADER;
+
+typedef struct PCAP_RECORD_
+{
+   UINT32 seconds;
+   UINT32 fraction;
+   UINT32 capturedLength;
+   UINT32 length;
+} PCAP_RECORD;
+
+typedef struct REPLAY_PREFIX_
+{
+   ADDRESS_FAMILY addressFamily;
+   UINT8 address[16];
+   ULONG length;
+} REPLAY_PREFIX;
+
+//
+// REPLAY_PACKET is a packet of the capture, its IP header at data. The
+// addresses and ports are those of the local and the remote end.
+//
+typedef struct REPLAY_PACKET_
+{
+   struct REPLAY_PACKET_* next;
+   const UINT8* data;
+   ULONG length;
+   ULONG ipHeaderSize;
+   ULONG transportHeaderSize;
+   ADDRESS_FAMILY addressFamily;
+   UINT8 protocol;
+   UINT8 tcpFlags;
+   FWP_DIRECTION direction;
+   UINT8 localAddress[16];
+   UINT8 remoteAddress[16];
+   UINT16 localPort;
+   UINT16 remotePort;
+   ULONG hash;
+} REPLAY_PACKET;
+
+typedef enum REPLAY_FLOW_STATE_
+{
+   REPLAY_FLOW_NEW,
+   REPLAY_FLOW_PENDING,
+   REPLAY_FLOW_PERMITTED,
+   REPLAY_FLOW_BLOCKED
+} REPLAY_FLOW_STATE;
+
+//
+// REPLAY_FLOW is a connection, keyed by the ends, the protocol and the
+// direction of its first packet. Its packets are held in held while its
+// ALE classify is pended.
+//
+typedef struct REPLAY_FLOW_
+{
+   struct REPLAY_FLOW_* next;
+   ADDRESS_FAMILY addressFamily;
+   UINT8 protocol;
+   FWP_DIRECTION direction;
+   UINT8 localAddress[16];
+   UINT8 remoteAddress[16];
+   UINT16 localPort;
+   UINT16 remotePort;
+
+   REPLAY_FLOW_STATE state;
+   REPLAY_PACKET* heldHead;
+   REPLAY_PACKET* heldTail;
+} REPLAY_FLOW;
+
+typedef struct REPLAY_COUNTERS_
+{
+   LONG64 packets;
+   LONG64 bytes;
+   LONG64 skipped;
+   LONG64 permitted;
+   LONG64 blocked;
+   LONG64 absorbed;
+   LONG64 held;
+   LONG64 dropped;
+   LONG64 reinjected;
+} REPLAY_COUNTERS;
+
+//
+// REPLAY_THREAD replays the packets of the flows whose hash falls to its
+// index. The first thread also samples the depth of the packet queues.
+//
+typedef struct REPLAY_THREAD_
+{
+   pthread_t thread;
+   ULONG index;
+   ULONG count;
+   const REPLAY_PACKET* packets;
+   ULONG packetCount;
+   ULONG times;
+
+   UINT64 depthSum;
+   ULONG depthSamples;
+   LONG depthMax;
+} REPLAY_THREAD;
+
+const ULONG gScaleWorkers[] = { 1, 2, 4, 8, 16 };
+
+REPLAY_PREFIX gLocalPrefixes[REPLAY_MAX_PREFIXES];
+ULONG gLocalPrefixCount;
+BOOLEAN gPrefixMode;
+ULONG gMdlSize;
+
+REPLAY_FLOW* gFlows[REPLAY_FLOW_BUCKETS];
+pthread_mutex_t gFlowLock = PTHREAD_MUTEX_INITIALIZER;
+volatile LONG gFlowsPending;
+
+REPLAY_COUNTERS gCounters;
+
+FWP_BYTE_BLOB gAppId = { sizeof(L"replay"), (UINT8*)L"replay" };
+
+UINT64
+ReplayNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 1000000000 + (UINT64)now.tv_nsec;
+}
+
+BOOLEAN
+ReplayParsePrefix(
+   _In_ const char* string,
+   _Out_ REPLAY_PREFIX* prefix
+   )
+{
+   char address[64];
+   const char* slash = strchr(string, '/');
+   size_t length = (slash != NULL) ? (size_t)(slash - string) : strlen(string);
+
+   if (length >= sizeof(address))
+   {
+      return FALSE;
+   }
+
+   memcpy(address, string, length);
+   address[length] = '\0';
+   memset(prefix, 0, sizeof(*prefix));
+
+   if (inet_pton(REPLAY_HOST_AF_INET, address, prefix->address) == 1)
+   {
+      prefix->addressFamily = AF_INET;
+      prefix->length = 32;
+   }
+   else if (inet_pton(REPLAY_HOST_AF_INET6, address, prefix->address) == 1)
+   {
+      prefix->addressFamily = AF_INET6;
+      prefix->length = 128;
+   }
+   else
+   {
+      return FALSE;
+   }
+
+   if (slash != NULL)
+   {
+      ULONG bits = (ULONG)strtoul(slash + 1, NULL, 10);
+
+      if (bits > prefix->length)
+      {
+         return FALSE;
+      }
+
+      prefix->length = bits;
+   }
+
+   return TRUE;
+}
+
+BOOLEAN
+ReplayPrefixMatch(
+   _In_ const REPLAY_PREFIX* prefix,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ const UINT8* address
+   )
+{
+   ULONG bytes = prefix->length / 8;
+   ULONG bits = prefix->length % 8;
+
+   if (prefix->addressFamily != addressFamily)
+   {
+      return FALSE;
+   }
+
+   if (memcmp(prefix->address, address, bytes) != 0)
+   {
+      return FALSE;
+   }
+
+   return (bits == 0) ||
+          (((prefix->address[bytes] ^ address[bytes]) & (0xFF00 >> bits)) == 0);
+}
+
+BOOLEAN
+ReplayParsePacket(
+   _In_reads_bytes_(length) const UINT8* data,
+   _In_ ULONG length,
+   _Out_ REPLAY_PACKET* packet
+   )
+/* ++
+
+   Parses the IP header, the IPv6 extension headers and the transport
+   header of a packet, and picks its direction.
+
+-- */
+{
+   const UINT8* source;
+   const UINT8* destination;
+   ULONG addressLength;
+   UINT16 sourcePort = 0;
+   UINT16 destinationPort = 0;
+   BOOLEAN outbound;
+   ULONG i;
+
+   memset(packet, 0, sizeof(*packet));
+   packet->data = data;
+   packet->length = length;
+
+   if ((length >= 20) && ((data[0] >> 4) == 4))
+   {
+      packet->addressFamily = AF_INET;
+      packet->ipHeaderSize = (data[0] & 0x0F) * 4;
+      packet->protocol = data[9];
+      source = data + 12;
+      destination = data + 16;
+      addressLength = 4;
+
+      if ((packet->ipHeaderSize < 20) || (packet->ipHeaderSize > length))
+      {
+         return FALSE;
+      }
+   }
+   else if ((length >= 40) && ((data[0] >> 4) == 6))
+   {
+      UINT8 nextHeader = data[6];
+      ULONG offset = 40;
+
+      packet->addressFamily = AF_INET6;
+      source = data + 8;
+      destination = data + 24;
+      addressLength = 16;
+
+      for (i = 0; i < 8; i++)
+      {
+         ULONG headerSize;
+
+         if ((nextHeader != IPPROTO_HOPOPTS) &&
+             (nextHeader != IPPROTO_ROUTING) &&
+             (nextHeader != IPPROTO_FRAGMENT) &&
+             (nextHeader != IPPROTO_DSTOPTS))
+         {
+            break;
+         }
+
+         if (offset + 8 > length)
+         {
+            return FALSE;
+         }
+
+         headerSize = (nextHeader == IPPROTO_FRAGMENT) ? 8 : (data[offset + 1] + 1) * 8;
+         nextHeader = data[offset];
+         offset += headerSize;
+
+         if (offset > length)
+         {
+            return FALSE;
+         }
+      }
+
+      packet->ipHeaderSize = offset;
+      packet->protocol = nextHeader;
+   }
+   else
+   {
+      return FALSE;
+   }
+
+   if (packet->protocol == IPPROTO_TCP)
+   {
+      const UINT8* tcp = data + packet->ipHeaderSize;
+
+      if (packet->ipHeaderSize + 20 > length)
+      {
+         return FALSE;
+      }
+
+      sourcePort = (UINT16)((tcp[0] << 8) | tcp[1]);
+      destinationPort = (UINT16)((tcp[2] << 8) | tcp[3]);
+      packet->transportHeaderSize = (tcp[12] >> 4) * 4;
+      packet->tcpFlags = tcp[13];
+
+      if ((packet->transportHeaderSize < 20) ||
+          (packet->ipHeaderSize + packet->transportHeaderSize > length))
+      {
+         return FALSE;
+      }
+   }
+   else if (packet->protocol == IPPROTO_UDP)
+   {
+      const UINT8* udp = data + packet->ipHeaderSize;
+
+      if (packet->ipHeaderSize + 8 > length)
+      {
+         return FALSE;
+      }
+
+      sourcePort = (UINT16)((udp[0] << 8) | udp[1]);
+      destinationPort = (UINT16)((udp[2] << 8) | udp[3]);
+      packet->transportHeaderSize = 8;
+   }
+
+   if (gLocalPrefixCount != 0)
+   {
+      outbound = FALSE;
+
+      for (i = 0; i < gLocalPrefixCount; i++)
+      {
+         if (ReplayPrefixMatch(&gLocalPrefixes[i], packet->addressFamily, source))
+         {
+            outbound = TRUE;
+            break;
+         }
+      }
+   }
+   else
+   {
+      outbound = (sourcePort > destinationPort);
+   }
+
+   packet->direction = outbound ? FWP_DIRECTION_OUTBOUND : FWP_DIRECTION_INBOUND;
+   memcpy(packet->localAddress, outbound ? source : destination, addressLength);
+   memcpy(packet->remoteAddress, outbound ? destination : source, addressLength);
+   packet->localPort = outbound ? sourcePort : destinationPort;
+   packet->remotePort = outbound ? destinationPort : sourcePort;
+
+   return TRUE;
+}
+
+UINT16
+ReplayLayer(
+   _In_ TL_INSPECT_CLASSIFY_FUNCTION function,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ FWP_DIRECTION direction
+   )
+{
+   BOOLEAN v6 = (addressFamily == AF_INET6);
+   BOOLEAN outbound = (direction == FWP_DIRECTION_OUTBOUND);
+
+   switch (function)
+   {
+   case TL_INSPECT_CLASSIFY_CONNECT:
+      return v6 ? FWPS_LAYER_ALE_AUTH_CONNECT_V6 : FWPS_LAYER_ALE_AUTH_CONNECT_V4;
+
+   case TL_INSPECT_CLASSIFY_RECV_ACCEPT:
+      return v6 ? FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6 : FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4;
+
+   case TL_INSPECT_CLASSIFY_TRANSPORT:
+      if (outbound)
+      {
+         return v6 ? FWPS_LAYER_OUTBOUND_TRANSPORT_V6 : FWPS_LAYER_OUTBOUND_TRANSPORT_V4;
+      }
+      return v6 ? FWPS_LAYER_INBOUND_TRANSPORT_V6 : FWPS_LAYER_INBOUND_TRANSPORT_V4;
+
+   default:
+      if (outbound)
+      {
+         return v6 ? FWPS_LAYER_OUTBOUND_IPPACKET_V6 : FWPS_LAYER_OUTBOUND_IPPACKET_V4;
+      }
+      return v6 ? FWPS_LAYER_INBOUND_IPPACKET_V6 : FWPS_LAYER_INBOUND_IPPACKET_V4;
+   }
+}
+
+void
+ReplaySetAddress(
+   _Out_ FWP_VALUE* value,
+   _Out_ FWP_BYTE_ARRAY16* storage,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ const UINT8* address
+   )
+{
+   if (addressFamily == AF_INET)
+   {
+      value->type = FWP_UINT32;
+      value->uint32 = ((UINT32)address[0] << 24) | ((UINT32)address[1] << 16) |
+                      ((UINT32)address[2] << 8) | address[3];
+   }
+   else
+   {
+      memcpy(storage->byteArray16, address, 16);
+      value->type = FWP_BYTE_ARRAY16_TYPE;
+      value->byteArray16 = storage;
+   }
+}
+
+FWP_ACTION_TYPE
+ReplayClassify(
+   _In_ TL_INSPECT_CLASSIFY_FUNCTION function,
+   _In_ const REPLAY_PACKET* packet,
+   _In_ REPLAY_FLOW* flow,
+   _In_ UINT32 flags,
+   _In_ UINT32 metadataFields,
+   _In_opt_ NET_BUFFER_LIST* netBufferList,
+   _In_ BOOLEAN withData,
+   _Out_opt_ BOOLEAN* absorbed
+   )
+/* ++
+
+   Classifies a packet, or a connection when withData is FALSE, at the
+   layer of the classify function for its family and direction, the way
+   the TCP/IP stack indicates it there: the values of the layer are those
+   of the packet, and its net buffer list starts at the IP header at the
+   IP packet layers, except inbound, and at the transport header at the
+   other layers, except inbound, where it starts past the headers. The net
+   buffer list given, if any, is classified as is.
+
+-- */
+{
+   UINT16 layerId = ReplayLayer(function, packet->addressFamily, packet->direction);
+   const TL_INSPECT_LAYER* layer = &gInspectLayers[layerId];
+   FWPS_INCOMING_VALUE values[64];
+   FWPS_INCOMING_VALUES inFixedValues;
+   FWPS_INCOMING_METADATA_VALUES inMetaValues;
+   FWPS_CLASSIFY_OUT classifyOut;
+   FWP_BYTE_ARRAY16 localAddress;
+   FWP_BYTE_ARRAY16 remoteAddress;
+   NET_BUFFER_LIST* allocated = NULL;
+   ULONG dataOffset;
+
+   memset(values, 0, sizeof(values));
+   memset(&inMetaValues, 0, sizeof(inMetaValues));
+
+   if (layer->localAddress != TL_INSPECT_LAYER_NO_FIELD)
+   {
+      ReplaySetAddress(&values[layer->localAddress].value,
+                       &localAddress,
+                       packet->addressFamily,
+                       packet->localAddress);
+      ReplaySetAddress(&values[layer->remoteAddress].value,
+                       &remoteAddress,
+                       packet->addressFamily,
+                       packet->remoteAddress);
+
+      values[layer->localPort].value.type = FWP_UINT16;
+      values[layer->localPort].value.uint16 = packet->localPort;
+      values[layer->remotePort].value.type = FWP_UINT16;
+      values[layer->remotePort].value.uint16 = packet->remotePort;
+      values[layer->protocol].value.type = FWP_UINT8;
+      values[layer->protocol].value.uint8 = packet->protocol;
+      values[layer->flags].value.type = FWP_UINT32;
+      values[layer->flags].value.uint32 = flags;
+   }
+
+   if (layer->interfaceIndex != TL_INSPECT_LAYER_NO_FIELD)
+   {
+      values[layer->interfaceIndex].value.type = FWP_UINT32;
+      values[layer->interfaceIndex].value.uint32 = 1;
+      values[layer->subInterfaceIndex].value.type = FWP_UINT32;
+      values[layer->subInterfaceIndex].value.uint32 = 0;
+   }
+
+   if (layer->appId != TL_INSPECT_LAYER_NO_FIELD)
+   {
+      values[layer->appId].value.type = FWP_BYTE_BLOB_TYPE;
+      values[layer->appId].value.byteBlob = &gAppId;
+   }
+
+   inFixedValues.layerId = layerId;
+   inFixedValues.valueCount = ARRAYSIZE(values);
+   inFixedValues.incomingValue = values;
+
+   inMetaValues.currentMetadataValues =
+      metadataFields |
+      FWPS_METADATA_FIELD_COMPARTMENT_ID |
+      FWPS_METADATA_FIELD_IP_HEADER_SIZE |
+      FWPS_METADATA_FIELD_TRANSPORT_HEADER_SIZE;
+   inMetaValues.compartmentId = 1;
+   inMetaValues.ipHeaderSize = packet->ipHeaderSize;
+   inMetaValues.transportHeaderSize = packet->transportHeaderSize;
+   inMetaValues.packetDirection = packet->direction;
+   inMetaValues.processId = (UINT64)getpid();
+   inMetaValues.transportEndpointHandle = (UINT64)(ULONG_PTR)flow;
+   inMetaValues.completionHandle = flow;
+
+   if ((netBufferList == NULL) && withData)
+   {
+      if (function == TL_INSPECT_CLASSIFY_IP)
+      {
+         dataOffset = (packet->direction == FWP_DIRECTION_INBOUND) ?
+                         packet->ipHeaderSize : 0;
+      }
+      else
+      {
+         dataOffset = packet->ipHeaderSize;
+
+         if (packet->direction == FWP_DIRECTION_INBOUND)
+         {
+            dataOffset += packet->transportHeaderSize;
+         }
+      }
+
+      allocated = ShimAllocateNetBufferList(
+                     packet->data, packet->length, dataOffset, gMdlSize, flow);
+      if (allocated == NULL)
+      {
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+
+      netBufferList = allocated;
+   }
+
+   ShimClassify(layerId, &inFixedValues, &inMetaValues, netBufferList, &classifyOut);
+
+   //
+   // The stack frees its packet once the classify returns; the driver
+   // keeps a reference on those it pended.
+   //
+   if (allocated != NULL)
+   {
+      FwpsDereferenceNetBufferList(allocated, FALSE);
+   }
+
+   if (absorbed != NULL)
+   {
+      *absorbed = ((classifyOut.flags & FWPS_CLASSIFY_OUT_FLAG_ABSORB) != 0);
+   }
+
+   return classifyOut.actionType;
+}
+
+void
+ReplayCount(
+   _In_ FWP_ACTION_TYPE action,
+   _In_ BOOLEAN absorbed
+   )
+{
+   if (absorbed)
+   {
+      InterlockedIncrement64(&gCounters.absorbed);
+   }
+   else if (action == FWP_ACTION_PERMIT)
+   {
+      InterlockedIncrement64(&gCounters.permitted);
+   }
+   else
+   {
+      InterlockedIncrement64(&gCounters.blocked);
+   }
+}
+
+void
+ReplayTransport(
+   _In_ const REPLAY_PACKET* packet,
+   _In_ REPLAY_FLOW* flow
+   )
+{
+   FWP_ACTION_TYPE action;
+   BOOLEAN absorbed;
+
+   action = ReplayClassify(
+               TL_INSPECT_CLASSIFY_TRANSPORT,
+               packet,
+               flow,
+               0,
+               (packet->direction == FWP_DIRECTION_OUTBOUND) ?
+                  FWPS_METADATA_FIELD_TRANSPORT_ENDPOINT_HANDLE : 0,
+               NULL,
+               TRUE,
+               &absorbed
+               );
+
+   ReplayCount(action, absorbed);
+}
+
+void
+ReplayFlowPacket(
+   _In_ const REPLAY_FLOW* flow,
+   _In_ FWP_DIRECTION direction,
+   _Out_ REPLAY_PACKET* packet
+   )
+{
+   memset(packet, 0, sizeof(*packet));
+   packet->addressFamily = flow->addressFamily;
+   packet->protocol = flow->protocol;
+   packet->direction = direction;
+   memcpy(packet->localAddress, flow->localAddress, sizeof(packet->localAddress));
+   memcpy(packet->remoteAddress, flow->remoteAddress, sizeof(packet->remoteAddress));
+   packet->localPort = flow->localPort;
+   packet->remotePort = flow->remotePort;
+}
+
+void
+ReplayReleaseFlow(
+   _Inout_ REPLAY_FLOW* flow,
+   _In_ BOOLEAN permitted
+   )
+/* ++
+
+   Decides a pended flow: its held packets are classified at the transport
+   layer, or dropped, in the order they came, and the packets that come
+   after them are not held any more.
+
+-- */
+{
+   for (;;)
+   {
+      REPLAY_PACKET* packet;
+
+      pthread_mutex_lock(&gFlowLock);
+
+      packet = flow->heldHead;
+      if (packet == NULL)
+      {
+         flow->state = permitted ? REPLAY_FLOW_PERMITTED : REPLAY_FLOW_BLOCKED;
+         InterlockedDecrement(&gFlowsPending);
+         pthread_mutex_unlock(&gFlowLock);
+         break;
+      }
+
+      flow->heldHead = packet->next;
+      if (flow->heldHead == NULL)
+      {
+         flow->heldTail = NULL;
+      }
+
+      pthread_mutex_unlock(&gFlowLock);
+
+      if (permitted)
+      {
+         ReplayTransport(packet, flow);
+      }
+      else
+      {
+         InterlockedIncrement64(&gCounters.dropped);
+      }
+
+      free(packet);
+   }
+}
+
+SHIM_COMPLETE_OPERATION_FN ReplayCompleteOperation;
+
+void
+ReplayCompleteOperation(
+   _In_ HANDLE completionHandle,
+   _In_opt_ NET_BUFFER_LIST* netBufferList
+   )
+/* ++
+
+   Called when the driver completes the pended ALE classify of a flow. An
+   outbound connect is authorized again, which finds the verdict of the
+   driver; an inbound connection was permitted if the driver completed the
+   recv-accept with a clone of its packet, which it injects.
+
+-- */
+{
+   REPLAY_FLOW* flow = completionHandle;
+   REPLAY_PACKET packet;
+   FWP_ACTION_TYPE action;
+   BOOLEAN permitted;
+
+   if (flow->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      ReplayFlowPacket(flow, FWP_DIRECTION_OUTBOUND, &packet);
+
+      action = ReplayClassify(
+                  TL_INSPECT_CLASSIFY_CONNECT,
+                  &packet,
+                  flow,
+                  FWP_CONDITION_FLAG_IS_REAUTHORIZE,
+                  FWPS_METADATA_FIELD_PACKET_DIRECTION,
+                  NULL,
+                  FALSE,
+                  NULL
+                  );
+
+      permitted = (action == FWP_ACTION_PERMIT);
+   }
+   else
+   {
+      permitted = (netBufferList != NULL);
+   }
+
+   ReplayReleaseFlow(flow, permitted);
+}
+
+SHIM_INJECT_FN ReplayInject;
+
+void
+ReplayInject(
+   _In_ FWP_DIRECTION direction,
+   _In_ NET_BUFFER_LIST* netBufferList
+   )
+/* ++
+
+   Called for each packet the driver injects, which the stack indicates
+   again to the transport layer of its direction, where the driver skips
+   the packets it injected.
+
+-- */
+{
+   REPLAY_FLOW* flow = netBufferList->ShimContext;
+   REPLAY_PACKET packet;
+   FWP_ACTION_TYPE action;
+
+   InterlockedIncrement64(&gCounters.reinjected);
+
+   ReplayFlowPacket(flow, direction, &packet);
+
+   action = ReplayClassify(
+               TL_INSPECT_CLASSIFY_TRANSPORT,
+               &packet,
+               flow,
+               0,
+               0,
+               netBufferList,
+               TRUE,
+               NULL
+               );
+
+   if (action != FWP_ACTION_PERMIT)
+   {
+      fprintf(stderr, "an injected packet was blocked\n");
+   }
+}
+
+ULONG
+ReplayPacketHash(
+   _In_ const REPLAY_PACKET* packet
+   )
+/* ++
+
+   Returns the hash of the flow of a packet, the same for both directions.
+
+-- */
+{
+   UINT32 hash = 2166136261;
+   ULONG i;
+
+   for (i = 0; i < 16; i++)
+   {
+      hash = (hash ^ packet->remoteAddress[i] ^ packet->localAddress[i]) * 16777619;
+   }
+
+   hash = (hash ^ packet->localPort) * 16777619;
+   hash = (hash ^ packet->remotePort) * 16777619;
+   hash = (hash ^ packet->protocol) * 16777619;
+
+   return hash;
+}
+
+REPLAY_FLOW*
+ReplayLookupFlow(
+   _In_ const REPLAY_PACKET* packet
+   )
+/* ++
+
+   Returns the flow of a packet, which is created if it is the first one.
+   Called with gFlowLock held.
+
+-- */
+{
+   ULONG hash = packet->hash;
+   REPLAY_FLOW* flow;
+
+   for (flow = gFlows[hash % REPLAY_FLOW_BUCKETS]; flow != NULL; flow = flow->next)
+   {
+      if ((flow->addressFamily == packet->addressFamily) &&
+          (flow->protocol == packet->protocol) &&
+          (flow->localPort == packet->localPort) &&
+          (flow->remotePort == packet->remotePort) &&
+          (memcmp(flow->localAddress, packet->localAddress, 16) == 0) &&
+          (memcmp(flow->remoteAddress, packet->remoteAddress, 16) == 0))
+      {
+         return flow;
+      }
+   }
+
+   flow = calloc(1, sizeof(*flow));
+   if (flow == NULL)
+   {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+
+   flow->addressFamily = packet->addressFamily;
+   flow->protocol = packet->protocol;
+   flow->direction = packet->direction;
+   memcpy(flow->localAddress, packet->localAddress, 16);
+   memcpy(flow->remoteAddress, packet->remoteAddress, 16);
+   flow->localPort = packet->localPort;
+   flow->remotePort = packet->remotePort;
+   flow->state = REPLAY_FLOW_NEW;
+
+   flow->next = gFlows[hash % REPLAY_FLOW_BUCKETS];
+   gFlows[hash % REPLAY_FLOW_BUCKETS] = flow;
+
+   return flow;
+}
+
+void
+ReplayFreeFlows(void)
+{
+   ULONG i;
+
+   for (i = 0; i < REPLAY_FLOW_BUCKETS; i++)
+   {
+      while (gFlows[i] != NULL)
+      {
+         REPLAY_FLOW* flow = gFlows[i];
+
+         gFlows[i] = flow->next;
+         free(flow);
+      }
+   }
+}
+
+void
+ReplayPacket(
+   _In_ const REPLAY_PACKET* packet
+   )
+{
+   REPLAY_FLOW* flow;
+   REPLAY_PACKET* held;
+   FWP_ACTION_TYPE action;
+   BOOLEAN absorbed;
+   BOOLEAN connecting;
+
+   if (!gPrefixMode)
+   {
+      action = ReplayClassify(
+                  TL_INSPECT_CLASSIFY_IP, packet, NULL, 0, 0, NULL, TRUE, &absorbed);
+      ReplayCount(action, absorbed);
+      return;
+   }
+
+   connecting = (packet->protocol != IPPROTO_TCP) ||
+                ((packet->tcpFlags & (TCP_SYN | TCP_ACK)) == TCP_SYN);
+
+   pthread_mutex_lock(&gFlowLock);
+
+   flow = ReplayLookupFlow(packet);
+
+   switch (flow->state)
+   {
+   case REPLAY_FLOW_NEW:
+      if (!connecting)
+      {
+         //
+         // The capture started after the connection was authorized.
+         //
+         flow->state = REPLAY_FLOW_PERMITTED;
+         break;
+      }
+
+      flow->state = REPLAY_FLOW_PENDING;
+      InterlockedIncrement(&gFlowsPending);
+
+      if (packet->direction == FWP_DIRECTION_OUTBOUND)
+      {
+         //
+         // The stack sends the packet once the connect is authorized.
+         //
+         held = malloc(sizeof(*held));
+         if (held == NULL)
+         {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+         }
+
+         *held = *packet;
+         held->next = NULL;
+         flow->heldHead = held;
+         flow->heldTail = held;
+
+         pthread_mutex_unlock(&gFlowLock);
+
+         action = ReplayClassify(
+                     TL_INSPECT_CLASSIFY_CONNECT,
+                     packet,
+                     flow,
+                     0,
+                     FWPS_METADATA_FIELD_COMPLETION_HANDLE |
+                     FWPS_METADATA_FIELD_PROCESS_ID,
+                     NULL,
+                     FALSE,
+                     &absorbed
+                     );
+      }
+      else
+      {
+         pthread_mutex_unlock(&gFlowLock);
+
+         ReplayClassify(
+            TL_INSPECT_CLASSIFY_TRANSPORT,
+            packet,
+            flow,
+            0,
+            FWPS_METADATA_FIELD_ALE_CLASSIFY_REQUIRED,
+            NULL,
+            TRUE,
+            NULL
+            );
+
+         action = ReplayClassify(
+                     TL_INSPECT_CLASSIFY_RECV_ACCEPT,
+                     packet,
+                     flow,
+                     0,
+                     FWPS_METADATA_FIELD_COMPLETION_HANDLE |
+                     FWPS_METADATA_FIELD_PROCESS_ID,
+                     NULL,
+                     TRUE,
+                     &absorbed
+                     );
+
+         ReplayCount(action, absorbed);
+      }
+
+      if (!absorbed)
+      {
+         ReplayReleaseFlow(flow, (action == FWP_ACTION_PERMIT));
+      }
+
+      return;
+
+   case REPLAY_FLOW_PENDING:
+      held = malloc(sizeof(*held));
+      if (held == NULL)
+      {
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+
+      *held = *packet;
+      held->next = NULL;
+
+      if (flow->heldTail != NULL)
+      {
+         flow->heldTail->next = held;
+      }
+      else
+      {
+         flow->heldHead = held;
+      }
+
+      flow->heldTail = held;
+      InterlockedIncrement64(&gCounters.held);
+
+      pthread_mutex_unlock(&gFlowLock);
+      return;
+
+   case REPLAY_FLOW_BLOCKED:
+      InterlockedIncrement64(&gCounters.dropped);
+      pthread_mutex_unlock(&gFlowLock);
+      return;
+
+   default:
+      break;
+   }
+
+   pthread_mutex_unlock(&gFlowLock);
+
+   ReplayTransport(packet, flow);
+}
+
+//
+// Captures.
+//
+
+UINT32
+ReplaySwap32(
+   _In_ UINT32 value,
+   _In_ BOOLEAN swap
+   )
+{
+   return swap ? __builtin_bswap32(value) : value;
+}
+
+REPLAY_PACKET*
+ReplayReadCapture(
+   _In_ const char* path,
+   _Out_ ULONG* packetCount,
+   _Out_ UINT8** buffer
+   )
+/* ++
+
+   Reads a capture in the pcap format, of Ethernet, Linux cooked or raw IP
+   frames, and returns its IP packets.
+
+-- */
+{
+   FILE* file;
+   long size;
+   UINT8* data;
+   PCAP_HEADER header;
+   REPLAY_PACKET* packets;
+   ULONG capacity = 0;
+   ULONG count = 0;
+   size_t offset;
+   BOOLEAN swap;
+
+   file = fopen(path, "rb");
+   if (file == NULL)
+   {
+      perror(path);
+      exit(1);
+   }
+
+   fseek(file, 0, SEEK_END);
+   size = ftell(file);
+   fseek(file, 0, SEEK_SET);
+
+   data = malloc((size_t)size + 1);
+   if ((data == NULL) || (fread(data, 1, (size_t)size, file) != (size_t)size) ||
+       ((size_t)size < sizeof(header)))
+   {
+      fprintf(stderr, "%s: cannot read the capture\n", path);
+      exit(1);
+   }
+
+   fclose(file);
+
+   memcpy(&header, data, sizeof(header));
+
+   if ((header.magic == PCAP_MAGIC) || (header.magic == PCAP_MAGIC_NANOSECONDS))
+   {
+      swap = FALSE;
+   }
+   else if ((__builtin_bswap32(header.magic) == PCAP_MAGIC) ||
+            (__builtin_bswap32(header.magic) == PCAP_MAGIC_NANOSECONDS))
+   {
+      swap = TRUE;
+   }
+   else
+   {
+      fprintf(stderr, "%s: not a pcap capture\n", path);
+      exit(1);
+   }
+
+   header.linkType = ReplaySwap32(header.linkType, swap);
+   packets = NULL;
+
+   for (offset = sizeof(header); offset + sizeof(PCAP_RECORD) <= (size_t)size;)
+   {
+      PCAP_RECORD record;
+      const UINT8* frame;
+      ULONG length;
+      ULONG linkHeader = 0;
+      UINT16 etherType = 0;
+
+      memcpy(&record, data + offset, sizeof(record));
+      offset += sizeof(record);
+
+      length = ReplaySwap32(record.capturedLength, swap);
+      if (offset + length > (size_t)size)
+      {
+         break;
+      }
+
+      frame = data + offset;
+      offset += length;
+
+      switch (header.linkType)
+      {
+      case PCAP_LINKTYPE_ETHERNET:
+         linkHeader = 14;
+         if (length >= 14)
+         {
+            etherType = (UINT16)((frame[12] << 8) | frame[13]);
+            if ((etherType == 0x8100) && (length >= 18))
+            {
+               etherType = (UINT16)((frame[16] << 8) | frame[17]);
+               linkHeader = 18;
+            }
+         }
+         if ((etherType != 0x0800) && (etherType != 0x86DD))
+         {
+            linkHeader = length;
+         }
+         break;
+
+      case PCAP_LINKTYPE_LINUX_SLL:
+         linkHeader = 16;
+         break;
+
+      case PCAP_LINKTYPE_RAW:
+      case PCAP_LINKTYPE_IPV4:
+      case PCAP_LINKTYPE_IPV6:
+         break;
+
+      default:
+         fprintf(stderr, "%s: link type %u is not supported\n", path, header.linkType);
+         exit(1);
+      }
+
+      if (count == capacity)
+      {
+         capacity = (capacity != 0) ? capacity * 2 : 4096;
+         packets = realloc(packets, capacity * sizeof(*packets));
+         if (packets == NULL)
+         {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+         }
+      }
+
+      if ((linkHeader >= length) ||
+          !ReplayParsePacket(frame + linkHeader, length - linkHeader, &packets[count]))
+      {
+         gCounters.skipped++;
+         continue;
+      }
+
+      packets[count].hash = ReplayPacketHash(&packets[count]);
+      count++;
+   }
+
+   *packetCount = count;
+   *buffer = data;
+
+   return packets;
+}
+
+ULONG
+ReplayBuildPacket(
+   _Out_writes_bytes_(2048) UINT8* packet,
+   _In_ ULONG connection,
+   _In_ BOOLEAN outbound,
+   _In_ UINT8 tcpFlags,
+   _In_ UINT32 sequence,
+   _In_ ULONG payloadLength
+   )
+{
+   BOOLEAN v6 = ((connection % 4) == 3);
+   UINT8 local[16] = { 0 };
+   UINT8 remote[16] = { 0 };
+   UINT16 localPort = (UINT16)(49152 + connection % 16384);
+   UINT16 remotePort = (connection % 2) ? 443 : 80;
+   ULONG ipHeaderSize = v6 ? 40 : 20;
+   ULONG length = ipHeaderSize + 20 + payloadLength;
+   UINT8* tcp = packet + ipHeaderSize;
+   const UINT8* source;
+   const UINT8* destination;
+   UINT16 sourcePort;
+   UINT16 destinationPort;
+
+   if (v6)
+   {
+      local[0] = 0xfd;
+      local[13] = (UINT8)(connection >> 16);
+      local[14] = (UINT8)(connection >> 8);
+      local[15] = (UINT8)connection;
+      remote[0] = 0x20;
+      remote[1] = 0x01;
+      remote[2] = 0x0d;
+      remote[3] = 0xb8;
+      remote[15] = (UINT8)(1 + connection % 250);
+   }
+   else
+   {
+      local[0] = 10;
+      local[1] = (UINT8)(connection >> 16);
+      local[2] = (UINT8)(connection >> 8);
+      local[3] = (UINT8)connection;
+      remote[0] = 192;
+      remote[1] = 0;
+      remote[2] = 2;
+      remote[3] = (UINT8)(1 + connection % 250);
+   }
+
+   source = outbound ? local : remote;
+   destination = outbound ? remote : local;
+   sourcePort = outbound ? localPort : remotePort;
+   destinationPort = outbound ? remotePort : localPort;
+
+   memset(packet, 0, length);
+
+   if (v6)
+   {
+      packet[0] = 0x60;
+      packet[4] = (UINT8)((length - 40) >> 8);
+      packet[5] = (UINT8)(length - 40);
+      packet[6] = IPPROTO_TCP;
+      packet[7] = 64;
+      memcpy(packet + 8, source, 16);
+      memcpy(packet + 24, destination, 16);
+   }
+   else
+   {
+      packet[0] = 0x45;
+      packet[2] = (UINT8)(length >> 8);
+      packet[3] = (UINT8)length;
+      packet[8] = 64;
+      packet[9] = IPPROTO_TCP;
+      memcpy(packet + 12, source, 4);
+      memcpy(packet + 16, destination, 4);
+   }
+
+   tcp[0] = (UINT8)(sourcePort >> 8);
+   tcp[1] = (UINT8)sourcePort;
+   tcp[2] = (UINT8)(destinationPort >> 8);
+   tcp[3] = (UINT8)destinationPort;
+   tcp[4] = (UINT8)(sequence >> 24);
+   tcp[5] = (UINT8)(sequence >> 16);
+   tcp[6] = (UINT8)(sequence >> 8);
+   tcp[7] = (UINT8)sequence;
+   tcp[12] = 5 << 4;
+   tcp[13] = tcpFlags;
+   tcp[14] = 0xff;
+   tcp[15] = 0xff;
+
+   return length;
+}
+
+void
+ReplayWriteCapture(
+   _In_ const char* path,
+   _In_ ULONG connections,
+   _In_ ULONG dataPackets
+   )
+/* ++
+
+   Writes connections of dataPackets data packets each, in groups of 64
+   open at once whose packets are interleaved.
+
+-- */
+{
+   PCAP_HEADER header = { PCAP_MAGIC, 2, 4, 0, 0, 65535, PCAP_LINKTYPE_RAW };
+   UINT8 packet[2048];
+   ULONG steps = dataPackets + 5;
+   UINT64 time = 0;
+   ULONG first;
+   FILE* file;
+
+   file = fopen(path, "wb");
+   if (file == NULL)
+   {
+      perror(path);
+      exit(1);
+   }
+
+   fwrite(&header, sizeof(header), 1, file);
+
+   for (first = 0; first < connections; first += 64)
+   {
+      ULONG step;
+      ULONG i;
+
+      for (step = 0; step < steps; step++)
+      {
+         for (i = first; (i < first + 64) && (i < connections); i++)
+         {
+            PCAP_RECORD record;
+            BOOLEAN outbound;
+            UINT8 flags;
+            ULONG payload = 0;
+            ULONG length;
+
+            if (step == 0)
+            {
+               outbound = TRUE;
+               flags = TCP_SYN;
+            }
+            else if (step == 1)
+            {
+               outbound = FALSE;
+               flags = TCP_SYN | TCP_ACK;
+            }
+            else if (step == 2)
+            {
+               outbound = TRUE;
+               flags = TCP_ACK;
+            }
+            else if (step < steps - 2)
+            {
+               outbound = ((step % 2) == 1);
+               flags = TCP_ACK;
+               payload = 64 + ((i * 131 + step * 977) % 1337);
+            }
+            else
+            {
+               outbound = (step == steps - 2);
+               flags = TCP_FIN | TCP_ACK;
+            }
+
+            length = ReplayBuildPacket(packet, i, outbound, flags, step, payload);
+
+            time += 10;
+            record.seconds = (UINT32)(time / 1000000);
+            record.fraction = (UINT32)(time % 1000000);
+            record.capturedLength = length;
+            record.length = length;
+
+            fwrite(&record, sizeof(record), 1, file);
+            fwrite(packet, length, 1, file);
+         }
+      }
+   }
+
+   if (fclose(file) != 0)
+   {
+      perror(path);
+      exit(1);
+   }
+
+   printf("wrote %lu connections of %lu data packets to %s\n",
+          (unsigned long)connections, (unsigned long)dataPackets, path);
+}
+
+//
+// The replay.
+//
+
+void*
+ReplayThread(
+   _In_ void* context
+   )
+{
+   REPLAY_THREAD* thread = context;
+   LONG64 packets = 0;
+   LONG64 bytes = 0;
+   ULONG time;
+   ULONG i;
+
+   for (time = 0; time < thread->times; time++)
+   {
+      for (i = 0; i < thread->packetCount; i++)
+      {
+         const REPLAY_PACKET* packet = &thread->packets[i];
+
+         if ((packet->hash % thread->count) != thread->index)
+         {
+            continue;
+         }
+
+         ReplayPacket(packet);
+
+         packets++;
+         bytes += packet->length;
+
+         if ((thread->index == 0) && ((packets % REPLAY_DEPTH_SAMPLE) == 0))
+         {
+            LONG depth = TLInspectQueueDepth();
+
+            thread->depthSum += (UINT64)depth;
+            thread->depthSamples++;
+            thread->depthMax = max(thread->depthMax, depth);
+         }
+      }
+   }
+
+   InterlockedAdd64(&gCounters.packets, packets);
+   InterlockedAdd64(&gCounters.bytes, bytes);
+
+   return NULL;
+}
+
+BOOLEAN
+ReplayDrained(void)
+{
+   return (ReadNoFence(&gFlowsPending) == 0) &&
+          (ReadNoFence64(&gOverload.memory) == 0) &&
+          (TLInspectQueueDepth() == 0) &&
+          (ReadNoFence(&gStats.connListDepth) == 0);
+}
+
+void
+ReplayUsage(void)
+{
+   fprintf(stderr,
+           "usage: replay [-p prefix]... [-r rule]... [-l prefix]... [-b] [-t workers]\n"
+           "              [-c processors] [-j threads] [-s] [-n times] [-m mdlSize]\n"
+           "              capture.pcap\n"
+           "       replay -w capture.pcap [-f connections] [-k packets]\n");
+   exit(2);
+}
+
+int
+main(
+   int argc,
+   char** argv
+   )
+{
+   const char* writePath = NULL;
+   ULONG connections = 1000;
+   ULONG dataPackets = 20;
+   ULONG processors = 0;
+   ULONG times = 1;
+   LONG workers = -1;
+   ULONG threadCount = 1;
+   BOOLEAN scale = FALSE;
+   BOOLEAN block = FALSE;
+   REPLAY_PACKET* packets;
+   ULONG packetCount;
+   UINT8* buffer;
+   static REPLAY_THREAD threads[REPLAY_MAX_THREADS];
+   TL_INSPECT_STATS_PAGE snapshot;
+   SHIM_COUNTERS shim;
+   UINT64 depthSum = 0;
+   ULONG depthSamples = 0;
+   LONG depthMax = 0;
+   UINT64 start;
+   UINT64 replayed;
+   UINT64 drained;
+   BOOLEAN isDrained;
+   NTSTATUS status;
+   ULONG i;
+   int option;
+
+   while ((option = getopt(argc, argv, "p:r:l:bt:c:j:sn:m:w:f:k:")) != -1)
+   {
+      switch (option)
+      {
+      case 'p':
+         ShimRegistryAddString("RemotePrefixesToInspect", optarg);
+         gPrefixMode = TRUE;
+         break;
+
+      case 'r':
+         ShimRegistryAddString("InspectRules", optarg);
+         break;
+
+      case 'l':
+         if ((gLocalPrefixCount == REPLAY_MAX_PREFIXES) ||
+             !ReplayParsePrefix(optarg, &gLocalPrefixes[gLocalPrefixCount]))
+         {
+            ReplayUsage();
+         }
+         gLocalPrefixCount++;
+         break;
+
+      case 'b':
+         block = TRUE;
+         break;
+
+      case 't':
+         workers = atoi(optarg);
+         break;
+
+      case 'c':
+         processors = (ULONG)atoi(optarg);
+         break;
+
+      case 'j':
+         threadCount = (ULONG)atoi(optarg);
+         if ((threadCount == 0) || (threadCount > REPLAY_MAX_THREADS))
+         {
+            ReplayUsage();
+         }
+         break;
+
+      case 's':
+         scale = TRUE;
+         break;
+
+      case 'n':
+         times = (ULONG)atoi(optarg);
+         break;
+
+      case 'm':
+         gMdlSize = (ULONG)atoi(optarg);
+         break;
+
+      case 'w':
+         writePath = optarg;
+         break;
+
+      case 'f':
+         connections = (ULONG)atoi(optarg);
+         break;
+
+      case 'k':
+         dataPackets = (ULONG)atoi(optarg);
+         break;
+
+      default:
+         ReplayUsage();
+      }
+   }
+
+   if (writePath != NULL)
+   {
+      ReplayWriteCapture(writePath, connections, dataPackets);
+      return 0;
+   }
+
+   if (optind + 1 != argc)
+   {
+      ReplayUsage();
+   }
+
+   packets = ReplayReadCapture(argv[optind], &packetCount, &buffer);
+
+   if (scale)
+   {
+      BOOLEAN failed = FALSE;
+
+      printf("workers  replayed/s    overall/s  drain (s)  depth avg  depth max   reinjected  inject calls\n");
+      fflush(stdout);
+
+      //
+      // The driver is loaded once per process, so each worker count is
+      // replayed by a child of its own, which goes on below.
+      //
+      for (i = 0; i < ARRAYSIZE(gScaleWorkers); i++)
+      {
+         pid_t child = fork();
+         int childStatus;
+
+         if (child == 0)
+         {
+            workers = (LONG)gScaleWorkers[i];
+            processors = max(processors, gScaleWorkers[i]);
+            break;
+         }
+
+         if ((child < 0) ||
+             (waitpid(child, &childStatus, 0) != child) ||
+             !WIFEXITED(childStatus) ||
+             (WEXITSTATUS(childStatus) != 0))
+         {
+            fprintf(stderr, "the replay at %lu workers failed\n",
+                    (unsigned long)gScaleWorkers[i]);
+            failed = TRUE;
+         }
+      }
+
+      if (i == ARRAYSIZE(gScaleWorkers))
+      {
+         free(packets);
+         free(buffer);
+         return failed ? 1 : 0;
+      }
+   }
+
+   ShimInitialize(processors);
+
+   ShimRegistrySetULong("BlockTraffic", block);
+   if (workers >= 0)
+   {
+      ShimRegistrySetULong("WorkerThreadCount", (ULONG)workers);
+   }
+
+   //
+   // With no remote prefix to inspect, the driver inspects all addresses
+   // at the IP packet layers.
+   //
+   gInspectAllByDefault = !gPrefixMode;
+
+   ShimSetCallbacks(ReplayCompleteOperation, ReplayInject);
+
+   status = ShimLoadDriver(DriverEntry);
+   if (!NT_SUCCESS(status))
+   {
+      fprintf(stderr, "DriverEntry failed with 0x%08x\n", (unsigned)status);
+      return 1;
+   }
+
+   if (!ShimLayerRegistered(gPrefixMode ? FWPS_LAYER_OUTBOUND_TRANSPORT_V4 :
+                                          FWPS_LAYER_OUTBOUND_IPPACKET_V4))
+   {
+      fprintf(stderr, "the driver did not register its callouts\n");
+      return 1;
+   }
+
+   start = ReplayNow();
+
+   for (i = 0; i < threadCount; i++)
+   {
+      threads[i].index = i;
+      threads[i].count = threadCount;
+      threads[i].packets = packets;
+      threads[i].packetCount = packetCount;
+      threads[i].times = times;
+
+      if (pthread_create(&threads[i].thread, NULL, ReplayThread, &threads[i]) != 0)
+      {
+         fprintf(stderr, "cannot create the replay threads\n");
+         return 1;
+      }
+   }
+
+   for (i = 0; i < threadCount; i++)
+   {
+      pthread_join(threads[i].thread, NULL);
+   }
+
+   replayed = ReplayNow();
+
+   depthSum = threads[0].depthSum;
+   depthSamples = threads[0].depthSamples;
+   depthMax = threads[0].depthMax;
+
+   //
+   // The queues of the driver are drained by its worker threads, and the
+   // pended connects are at last completed by its connect timeout.
+   //
+   for (i = 0; !(isDrained = ReplayDrained()) && (i < 30000); i++)
+   {
+      ShimWaitForCompletions();
+      usleep(1000);
+   }
+
+   ShimWaitForCompletions();
+   drained = ReplayNow();
+
+   TLInspectStatsCollect(&snapshot);
+   ShimQueryCounters(&shim);
+
+   if (scale)
+   {
+      printf("%7lu  %10.0f  %11.0f  %9.3f  %9.1f  %9ld  %11lld  %12lld%s\n",
+             (unsigned long)gWorkerCount,
+             (double)gCounters.packets * 1e9 / (double)(replayed - start),
+             (double)gCounters.packets * 1e9 / (double)(drained - start),
+             (double)(drained - replayed) / 1e9,
+             (depthSamples != 0) ? (double)depthSum / depthSamples : 0.0,
+             (long)depthMax,
+             (long long)snapshot.reinjectCount,
+             (long long)snapshot.injectCalls,
+             isDrained ? "" : "  NOT drained");
+      fflush(stdout);
+
+      goto Exit;
+   }
+
+   printf("%s, %lu worker threads on %lu processors, %lu replay threads\n",
+          gPrefixMode ? "ALE and transport layers" : "IP packet layers",
+          (unsigned long)gWorkerCount,
+          (unsigned long)KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+          (unsigned long)threadCount);
+   printf("replayed  %llu packets, %llu bytes (%llu skipped) in %.3f s: %.0f packets/s, %.1f Mb/s\n",
+          (unsigned long long)gCounters.packets,
+          (unsigned long long)gCounters.bytes,
+          (unsigned long long)gCounters.skipped,
+          (double)(replayed - start) / 1e9,
+          (double)gCounters.packets * 1e9 / (double)(replayed - start),
+          (double)gCounters.bytes * 8e3 / (double)(replayed - start));
+   printf("drained   %s in %.3f s after the replay: %.0f packets/s overall\n",
+          isDrained ? "all queues" : "NOT all queues",
+          (double)(drained - replayed) / 1e9,
+          (double)gCounters.packets * 1e9 / (double)(drained - start));
+   printf("queue     depth %.1f on average, %ld at most during the replay\n",
+          (depthSamples != 0) ? (double)depthSum / depthSamples : 0.0,
+          (long)depthMax);
+   printf("classify  %llu permitted, %llu blocked, %llu pended, %llu held, %llu dropped\n",
+          (unsigned long long)gCounters.permitted,
+          (unsigned long long)gCounters.blocked,
+          (unsigned long long)gCounters.absorbed,
+          (unsigned long long)gCounters.held,
+          (unsigned long long)gCounters.dropped);
+   printf("driver    %lld pended, %lld reinjected in %lld calls, %lld reinject failures, %lld shed\n",
+          (long long)snapshot.pendedCount,
+          (long long)snapshot.reinjectCount,
+          (long long)snapshot.injectCalls,
+          (long long)(snapshot.classify[TL_INSPECT_CLASSIFY_CONNECT].reinjectFailures +
+                      snapshot.classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].reinjectFailures +
+                      snapshot.classify[TL_INSPECT_CLASSIFY_TRANSPORT].reinjectFailures),
+          (long long)(snapshot.overload.connects + snapshot.overload.packets));
+   printf("injected  %lld outbound, %lld inbound, %lld bytes in %lld calls, %lld skipped on return\n",
+          (long long)shim.injected[FWP_DIRECTION_OUTBOUND],
+          (long long)shim.injected[FWP_DIRECTION_INBOUND],
+          (long long)shim.injectedBytes,
+          (long long)shim.injectCalls,
+          (long long)snapshot.classify[TL_INSPECT_CLASSIFY_TRANSPORT].selfInjectedSkips);
+   fflush(stdout);
+
+Exit:
+
+   ShimUnloadDriver();
+
+   ReplayFreeFlows();
+   free(packets);
+   free(buffer);
+
+   return isDrained ? 0 : 1;
+}
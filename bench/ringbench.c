@@ -0,0 +1,455 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Throughput benchmark of the packet ring of the driver (sys\pktring.h),
+   built in user mode on Linux:
+
+      cc -O2 -pthread -iquote sys -iquote inc -o ringbench bench/ringbench.c
+      ./ringbench [descriptors]
+
+   The main thread stands for the driver, keeping 1024 descriptors
+   waiting in the ring of the verdict channel (sys\verdict.h): it writes
+   each descriptor to the partition of its flow in the packet ring with the
+   first bytes of a 1500-byte packet, reads the verdicts back from the
+   completion rings and applies them from the head of the ring, as the
+   driver does. A thread per
+   partition stands for a thread of the daemon: it polls its partition,
+   decides the descriptors by their remote port after reading their
+   frame, and writes the verdicts to its completion ring. No side makes a
+   system call while descriptors keep coming.
+
+   The ring is run with 1, 2 and 4 partitions and a snap length of 64
+   bytes, then with 4 partitions and whole packets. For each run it prints
+   the decisions per second, the share of each partition, the descriptors
+   decided by the default verdict because their partition was full, and
+   the percentiles of the time from submission to application.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t LONG64;
+typedef int32_t LONG;
+typedef unsigned long ULONG;
+typedef unsigned long SIZE_T;
+typedef unsigned char BOOLEAN;
+typedef struct MDL MDL;
+typedef void* PEPROCESS;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _Out_writes_(count)
+
+#define __inline static inline
+
+#define PAGE_SIZE 4096
+#define RtlZeroMemory(destination, length) memset((destination), 0, (length))
+#define ReadULong64Acquire(source) __atomic_load_n((source), __ATOMIC_ACQUIRE)
+#define WriteULong64Release(destination, value) \
+   __atomic_store_n((destination), (value), __ATOMIC_RELEASE)
+
+#define TL_INSPECT_VERDICT_USER_MODE
+#define TL_INSPECT_PKTRING_USER_MODE
+#include "verdict.h"
+#include "pktring.h"
+
+//
+// Times are in 100ns units.
+//
+#define RINGBENCH_MS 10000
+#define RINGBENCH_TIMEOUT (100 * RINGBENCH_MS)
+
+#define RINGBENCH_FLOWS 1024
+#define RINGBENCH_PACKET_SIZE 1500
+
+//
+// Most descriptors waiting in the ring at once, standing for the packets
+// pended by the classify functions meanwhile.
+//
+#define RINGBENCH_WINDOW 1024
+
+//
+// RINGBENCH_CONSUMER is a thread of the daemon, polling one partition.
+//
+typedef struct RINGBENCH_CONSUMER_
+{
+   pthread_t thread;
+   TL_INSPECT_PACKET_RING_MAPPING layout;
+   UINT8* base;
+   volatile int* stop;
+   UINT64 decided;
+   UINT64 checksum;
+} RINGBENCH_CONSUMER;
+
+UINT64
+RingBenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 10000000 + (UINT64)now.tv_nsec / 100;
+}
+
+int
+RingBenchCompare(
+   const void* first,
+   const void* second
+   )
+{
+   UINT64 a = *(const UINT64*)first;
+   UINT64 b = *(const UINT64*)second;
+
+   return (a > b) - (a < b);
+}
+
+ULONG
+RingBenchFlowHash(
+   _In_ UINT32 flow
+   )
+{
+   ULONG hash = flow;
+
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6b;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35;
+   hash ^= hash >> 16;
+
+   return hash;
+}
+
+void*
+RingBenchConsumer(
+   void* parameter
+   )
+/* ++
+
+   Runs a thread of the daemon, as inspectctl ring does: it permits the
+   descriptors whose remote port is even and blocks the others, and sums
+   the first byte of each frame so that the frames are read.
+
+-- */
+{
+   RINGBENCH_CONSUMER* consumer = parameter;
+   TL_INSPECT_PACKET_RING_HEADER* header =
+      (TL_INSPECT_PACKET_RING_HEADER*)consumer->base;
+   const TL_INSPECT_PACKET_DESCRIPTOR* descriptors =
+      (const TL_INSPECT_PACKET_DESCRIPTOR*)(consumer->base +
+                                            consumer->layout.descriptorOffset);
+   TL_INSPECT_VERDICT* completions =
+      (TL_INSPECT_VERDICT*)(consumer->base + consumer->layout.completionOffset);
+   const UINT8* frames = consumer->base + consumer->layout.frameOffset;
+   UINT64 mask = consumer->layout.size - 1;
+   UINT64 descriptorConsumer = 0;
+   UINT64 completionProducer = 0;
+
+   while (!__atomic_load_n(consumer->stop, __ATOMIC_RELAXED))
+   {
+      UINT64 available = __atomic_load_n(&header->descriptorProducer, __ATOMIC_ACQUIRE) -
+                         descriptorConsumer;
+      UINT64 space = consumer->layout.size -
+                     (completionProducer -
+                      __atomic_load_n(&header->completionConsumer, __ATOMIC_ACQUIRE));
+      UINT64 count = (available < space) ? available : space;
+      UINT64 i;
+
+      if (count == 0)
+      {
+         sched_yield();
+         continue;
+      }
+
+      for (i = 0; i < count; i++)
+      {
+         UINT64 index = (descriptorConsumer + i) & mask;
+         const TL_INSPECT_PACKET_DESCRIPTOR* descriptor = &descriptors[index];
+         TL_INSPECT_VERDICT* verdict = &completions[(completionProducer + i) & mask];
+
+         if (descriptor->capturedLength != 0)
+         {
+            consumer->checksum += frames[index * consumer->layout.frameSize];
+         }
+
+         verdict->id = descriptor->request.id;
+         verdict->verdict = ((descriptor->request.remotePort & 1) == 0) ?
+                               TL_INSPECT_VERDICT_PERMIT :
+                               TL_INSPECT_VERDICT_BLOCK;
+         verdict->reserved = 0;
+      }
+
+      completionProducer += count;
+      descriptorConsumer += count;
+      consumer->decided += count;
+
+      __atomic_store_n(&header->completionProducer, completionProducer, __ATOMIC_RELEASE);
+      __atomic_store_n(&header->descriptorConsumer, descriptorConsumer, __ATOMIC_RELEASE);
+   }
+
+   return NULL;
+}
+
+BOOLEAN
+RingBenchRun(
+   _In_ const char* name,
+   _In_ UINT32 descriptors,
+   _In_ UINT32 partitions,
+   _In_ UINT32 snapLength
+   )
+{
+   TL_INSPECT_VERDICT_RING ring;
+   TL_INSPECT_PACKET_RING packetRing;
+   TL_INSPECT_PACKET_RING_SETUP setup;
+   TL_INSPECT_VERDICT_REQUEST request;
+   RINGBENCH_CONSUMER consumers[TL_INSPECT_PACKET_RING_MAX_PARTITIONS];
+   UINT8 packet[RINGBENCH_PACKET_SIZE];
+   UINT64* submitTimes = NULL;
+   UINT64* latencies = NULL;
+   UINT64 start;
+   UINT64 end;
+   UINT32 submitted = 0;
+   UINT32 applied = 0;
+   UINT32 defaulted = 0;
+   UINT32 full = 0;
+   UINT32 started = 0;
+   volatile int stop = 0;
+   BOOLEAN result = FALSE;
+   UINT32 i;
+
+   memset(&ring, 0, sizeof(ring));
+   memset(&packetRing, 0, sizeof(packetRing));
+   memset(&request, 0, sizeof(request));
+
+   for (i = 0; i < sizeof(packet); i++)
+   {
+      packet[i] = (UINT8)i;
+   }
+
+   setup.partitions = partitions;
+   setup.snapLength = snapLength;
+
+   if (!TLInspectPacketRingLayout(&setup, &packetRing.layout))
+   {
+      fprintf(stderr, "invalid setup\n");
+      return FALSE;
+   }
+
+   ring.size = TL_INSPECT_VERDICT_RING_SIZE;
+   ring.slots = calloc(ring.size, sizeof(TL_INSPECT_VERDICT_SLOT));
+   submitTimes = malloc(descriptors * sizeof(UINT64));
+   latencies = malloc(descriptors * sizeof(UINT64));
+   packetRing.base = aligned_alloc(
+                        PAGE_SIZE,
+                        (SIZE_T)partitions * packetRing.layout.partitionSize
+                        );
+
+   if ((ring.slots == NULL) || (submitTimes == NULL) || (latencies == NULL) ||
+       (packetRing.base == NULL))
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   memset(packetRing.base, 0, (SIZE_T)partitions * packetRing.layout.partitionSize);
+   TLInspectPacketRingSetBase(&packetRing, packetRing.base);
+
+   for (i = 0; i < partitions; i++)
+   {
+      memset(&consumers[i], 0, sizeof(consumers[i]));
+      consumers[i].layout = packetRing.layout;
+      consumers[i].base = (UINT8*)packetRing.partitions[i].header;
+      consumers[i].stop = &stop;
+
+      if (pthread_create(&consumers[i].thread, NULL, RingBenchConsumer, &consumers[i]) != 0)
+      {
+         fprintf(stderr, "cannot start a consumer\n");
+         goto Exit;
+      }
+
+      started++;
+   }
+
+   request.type = 1;
+   request.protocol = 6;
+   request.addressFamily = 4;
+
+   start = RingBenchNow();
+
+   while (applied < descriptors)
+   {
+      const TL_INSPECT_VERDICT_SLOT* slot;
+      TL_INSPECT_VERDICT verdict;
+      UINT64 now = RingBenchNow();
+      UINT32 before = applied;
+
+      while ((submitted < descriptors) &&
+             (ring.tail - ring.head < RINGBENCH_WINDOW))
+      {
+         TL_INSPECT_VERDICT_SLOT* added;
+         TL_INSPECT_PACKET_RING_PARTITION* partition;
+         TL_INSPECT_PACKET_DESCRIPTOR* descriptor;
+         UINT8* frame;
+         UINT32 flow = submitted % RINGBENCH_FLOWS;
+
+         request.localPort = (UINT16)(49152 + flow);
+         request.remotePort = (UINT16)submitted;
+
+         added = TLInspectVerdictRingAdd(&ring, &request, NULL, now + RINGBENCH_TIMEOUT);
+         ring.sent = ring.tail;
+         submitTimes[added->request.id] = now;
+         submitted++;
+
+         partition = TLInspectPacketRingPartition(&packetRing, RingBenchFlowHash(flow));
+
+         descriptor = TLInspectPacketRingReserve(&packetRing, partition, &frame);
+         if (descriptor == NULL)
+         {
+            added->verdict = TL_INSPECT_VERDICT_DEFAULT;
+            full++;
+            continue;
+         }
+
+         memcpy(frame, packet, snapLength);
+
+         descriptor->request = added->request;
+         descriptor->packetLength = sizeof(packet);
+         descriptor->capturedLength = snapLength;
+         descriptor->reserved = 0;
+
+         TLInspectPacketRingPublish(partition);
+      }
+
+      for (i = 0; i < partitions; i++)
+      {
+         TL_INSPECT_PACKET_RING_PARTITION* partition = &packetRing.partitions[i];
+
+         if (!TLInspectPacketRingNextCompletion(&packetRing, partition, &verdict))
+         {
+            continue;
+         }
+
+         do
+         {
+            TLInspectVerdictRingDecide(&ring, verdict.id, verdict.verdict);
+         } while (TLInspectPacketRingNextCompletion(&packetRing, partition, &verdict));
+
+         TLInspectPacketRingReleaseCompletions(partition);
+      }
+
+      now = RingBenchNow();
+      defaulted += TLInspectVerdictRingExpire(&ring, now);
+
+      while ((slot = TLInspectVerdictRingTake(&ring)) != NULL)
+      {
+         latencies[applied++] = now - submitTimes[slot->request.id];
+      }
+
+      //
+      // Lets the daemon run when the processors are all busy, as the
+      // worker does when it runs out of work.
+      //
+      if (applied == before)
+      {
+         sched_yield();
+      }
+   }
+
+   end = RingBenchNow();
+
+   stop = 1;
+
+   qsort(latencies, descriptors, sizeof(UINT64), RingBenchCompare);
+
+   printf("%-28s %9.0f decisions/s, %u full, %u defaulted, "
+          "latency p50 %7.3f ms, p99 %7.3f ms, shares",
+          name,
+          (double)descriptors * 1e7 / (double)(end - start),
+          full,
+          defaulted,
+          (double)latencies[descriptors / 2] / RINGBENCH_MS,
+          (double)latencies[(UINT64)descriptors * 99 / 100] / RINGBENCH_MS);
+
+   for (i = 0; i < started; i++)
+   {
+      pthread_join(consumers[i].thread, NULL);
+      printf(" %.0f%%", 100.0 * (double)consumers[i].decided / (double)descriptors);
+   }
+
+   printf("\n");
+
+   started = 0;
+   result = TRUE;
+
+Exit:
+
+   stop = 1;
+
+   for (i = 0; i < started; i++)
+   {
+      pthread_join(consumers[i].thread, NULL);
+   }
+
+   free(ring.slots);
+   free(submitTimes);
+   free(latencies);
+   free(packetRing.base);
+
+   return result;
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   UINT32 descriptors = 4000000;
+
+   if (argc > 1)
+   {
+      descriptors = (UINT32)strtoul(argv[1], NULL, 0);
+   }
+
+   if (descriptors == 0)
+   {
+      return 1;
+   }
+
+   printf("%u descriptors of %u flows, %u waiting, timeout %u ms\n",
+          descriptors,
+          RINGBENCH_FLOWS,
+          RINGBENCH_WINDOW,
+          RINGBENCH_TIMEOUT / RINGBENCH_MS);
+
+   if (!RingBenchRun("1 partition, snap 64", descriptors, 1, 64) ||
+       !RingBenchRun("2 partitions, snap 64", descriptors, 2, 64) ||
+       !RingBenchRun("4 partitions, snap 64", descriptors, 4, 64) ||
+       !RingBenchRun("4 partitions, snap 1500", descriptors, 4, RINGBENCH_PACKET_SIZE))
+   {
+      return 1;
+   }
+
+   return 0;
+}
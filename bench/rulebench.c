@@ -0,0 +1,427 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Lookup-rate benchmark of the inspection rule sets of the driver
+   (sys\rules.c), built in user mode on Linux:
+
+      cc -O2 -I sys -o rulebench bench/rulebench.c
+      ./rulebench [lookups]
+
+   For 1k, 10k and 50k random IPv4 rules it prints the build time, the size
+   of the classifier and the lookup rate. Rules mostly restrict the remote
+   address and port, some the local address and port, the protocol or the
+   direction; ports are mostly exact, ranges mostly well-known ones. Half
+   of the looked up packets are taken within a rule. The lookups are first
+   checked against a linear search of the rules.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef size_t SIZE_T;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXUINT32 UINT32_MAX
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_(count)
+#define _Inout_updates_(count)
+
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+#define NT_ASSERT(expression) assert(expression)
+
+#define RtlZeroMemory(destination, length) memset((destination), 0, (length))
+#define RtlCopyMemory(destination, source, length) \
+   memcpy((destination), (source), (length))
+#define RtlCompareMemory(source1, source2, length) \
+   ((memcmp((source1), (source2), (length)) == 0) ? (length) : 0)
+
+#define TL_INSPECT_RULES_USER_MODE
+#include "rules.c"
+
+#define RULEBENCH_PACKETS (1 << 20)
+#define RULEBENCH_CHECKED_LOOKUPS 20000
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+RuleBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+double
+RuleBenchSeconds(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+void
+RuleBenchPrefix(
+   _Inout_ TL_INSPECT_RULE* rule,
+   _In_ TL_INSPECT_RULE_FIELD field,
+   _In_ UINT32 minimumLength
+   )
+{
+   UINT32 address = (UINT32)RuleBenchRandom();
+   UINT8 bytes[4];
+
+   bytes[0] = (UINT8)(address >> 24);
+   bytes[1] = (UINT8)(address >> 16);
+   bytes[2] = (UINT8)(address >> 8);
+   bytes[3] = (UINT8)address;
+
+   TLInspectRuleSetPrefix(
+      rule,
+      field,
+      bytes,
+      32,
+      minimumLength + (UINT32)(RuleBenchRandom() % (33 - minimumLength))
+      );
+}
+
+void
+RuleBenchPorts(
+   _Inout_ TL_INSPECT_RULE* rule,
+   _In_ TL_INSPECT_RULE_FIELD field
+   )
+/* ++
+
+   Like in ACLs, ports are mostly exact; ranges are mostly the well-known
+   ones, and some arbitrary.
+
+-- */
+{
+   static const UINT64 ranges[][2] =
+      { { 0, 1023 }, { 1024, 65535 }, { 49152, 65535 }, { 6000, 6063 } };
+   UINT64 draw = RuleBenchRandom() % 100;
+   UINT64 first = RuleBenchRandom() % 65536;
+   UINT64 last = first;
+
+   if (draw < 2)
+   {
+      last = first + RuleBenchRandom() % (65536 - first);
+   }
+   else if (draw < 20)
+   {
+      first = ranges[draw % 4][0];
+      last = ranges[draw % 4][1];
+   }
+
+   rule->first[field].high = 0;
+   rule->first[field].low = first;
+   rule->last[field].high = 0;
+   rule->last[field].low = last;
+}
+
+void
+RuleBenchGenerateRules(
+   _Out_ TL_INSPECT_RULE* rules,
+   _In_ UINT32 count
+   )
+{
+   UINT32 i;
+
+   for (i = 0; i < count; i++)
+   {
+      TL_INSPECT_RULE* rule = &rules[i];
+
+      TLInspectRuleInitialize(rule);
+
+      if (RuleBenchRandom() % 10 < 9)
+      {
+         RuleBenchPrefix(rule, TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS, 8);
+      }
+      if (RuleBenchRandom() % 10 < 2)
+      {
+         RuleBenchPrefix(rule, TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS, 16);
+      }
+      if (RuleBenchRandom() % 10 < 6)
+      {
+         RuleBenchPorts(rule, TL_INSPECT_RULE_FIELD_REMOTE_PORT);
+      }
+      if (RuleBenchRandom() % 10 < 2)
+      {
+         RuleBenchPorts(rule, TL_INSPECT_RULE_FIELD_LOCAL_PORT);
+      }
+      if (RuleBenchRandom() % 10 < 7)
+      {
+         rule->first[TL_INSPECT_RULE_FIELD_PROTOCOL].high = 0;
+         rule->first[TL_INSPECT_RULE_FIELD_PROTOCOL].low =
+            (RuleBenchRandom() % 2) ? 6 : 17;
+         rule->last[TL_INSPECT_RULE_FIELD_PROTOCOL] =
+            rule->first[TL_INSPECT_RULE_FIELD_PROTOCOL];
+      }
+      if (RuleBenchRandom() % 10 < 3)
+      {
+         rule->first[TL_INSPECT_RULE_FIELD_DIRECTION].high = 0;
+         rule->first[TL_INSPECT_RULE_FIELD_DIRECTION].low = RuleBenchRandom() % 2;
+         rule->last[TL_INSPECT_RULE_FIELD_DIRECTION] =
+            rule->first[TL_INSPECT_RULE_FIELD_DIRECTION];
+      }
+
+      rule->priority = (UINT32)(RuleBenchRandom() % 100);
+      rule->action = (TL_INSPECT_RULE_ACTION)(RuleBenchRandom() % 3);
+   }
+}
+
+void
+RuleBenchGeneratePackets(
+   _Out_ TL_INSPECT_RULE_VALUE* packets,
+   _In_ const TL_INSPECT_RULE* rules,
+   _In_ UINT32 ruleCount
+   )
+/* ++
+
+   Every other packet is taken within a random rule, the others are
+   random.
+
+-- */
+{
+   UINT32 i;
+   UINT32 field;
+
+   for (i = 0; i < RULEBENCH_PACKETS; i++)
+   {
+      TL_INSPECT_RULE_VALUE* packet = &packets[i * TL_INSPECT_RULE_FIELD_COUNT];
+      const TL_INSPECT_RULE* rule = &rules[RuleBenchRandom() % ruleCount];
+      static const UINT64 limits[TL_INSPECT_RULE_FIELD_COUNT] =
+         { 1ull << 32, 1ull << 32, 65536, 65536, 256, 2 };
+
+      for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+      {
+         UINT64 first = rule->first[field].low;
+         UINT64 last = (rule->last[field].low < limits[field]) ?
+                       rule->last[field].low : limits[field] - 1;
+
+         packet[field].high = 0;
+
+         if (i & 1)
+         {
+            packet[field].low = first + RuleBenchRandom() % (last - first + 1);
+         }
+         else
+         {
+            packet[field].low = RuleBenchRandom() % limits[field];
+         }
+      }
+
+      if ((i & 1) == 0)
+      {
+         packet[TL_INSPECT_RULE_FIELD_PROTOCOL].low =
+            (RuleBenchRandom() % 2) ? 6 : 17;
+      }
+   }
+}
+
+BOOLEAN
+RuleBenchLinearLookup(
+   _In_ const TL_INSPECT_RULE* rules,
+   _In_ UINT32 ruleCount,
+   _In_ const TL_INSPECT_RULE_VALUE* packet,
+   _Out_ TL_INSPECT_RULE_ACTION* action
+   )
+{
+   const TL_INSPECT_RULE* best = NULL;
+   UINT32 i;
+   UINT32 field;
+
+   for (i = 0; i < ruleCount; i++)
+   {
+      const TL_INSPECT_RULE* rule = &rules[i];
+
+      for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+      {
+         if (TLInspectRuleValueBefore(&packet[field], &rule->first[field]) ||
+             TLInspectRuleValueBefore(&rule->last[field], &packet[field]))
+         {
+            break;
+         }
+      }
+
+      if ((field == TL_INSPECT_RULE_FIELD_COUNT) &&
+          ((best == NULL) || (rule->priority < best->priority)))
+      {
+         best = rule;
+      }
+   }
+
+   if (best == NULL)
+   {
+      return FALSE;
+   }
+
+   *action = best->action;
+
+   return TRUE;
+}
+
+int
+RuleBenchRun(
+   _In_ UINT32 ruleCount,
+   _In_ UINT64 lookups
+   )
+{
+   TL_INSPECT_RULE* rules;
+   TL_INSPECT_RULE_VALUE* packets;
+   TL_INSPECT_RULE_SET set;
+   SIZE_T size = 0;
+   double start;
+   double buildTime;
+   double lookupTime;
+   UINT64 matches = 0;
+   UINT64 i;
+   UINT32 field;
+   int result = 1;
+
+   TLInspectRulesInitialize(&set, 32);
+
+   rules = calloc(ruleCount, sizeof(*rules));
+   packets = calloc((SIZE_T)RULEBENCH_PACKETS * TL_INSPECT_RULE_FIELD_COUNT,
+                    sizeof(*packets));
+
+   if ((rules == NULL) || (packets == NULL))
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   RuleBenchGenerateRules(rules, ruleCount);
+   RuleBenchGeneratePackets(packets, rules, ruleCount);
+
+   start = RuleBenchSeconds();
+
+   for (i = 0; i < ruleCount; i++)
+   {
+      if (!TLInspectRulesAdd(&set, &rules[i]))
+      {
+         fprintf(stderr, "add failed\n");
+         goto Exit;
+      }
+   }
+
+   if (!TLInspectRulesBuild(&set))
+   {
+      fprintf(stderr, "build failed\n");
+      goto Exit;
+   }
+
+   buildTime = RuleBenchSeconds() - start;
+
+   for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+   {
+      const TL_INSPECT_RULE_FIELD_TABLE* table = &set.fields[field];
+
+      size += ((SIZE_T)table->fine.intervalCount + table->coarse.intervalCount) *
+              (sizeof(TL_INSPECT_RULE_VALUE) + sizeof(UINT32)) +
+              (SIZE_T)table->poolSize * sizeof(UINT64);
+   }
+
+   for (i = 0; i < RULEBENCH_CHECKED_LOOKUPS; i++)
+   {
+      const TL_INSPECT_RULE_VALUE* packet =
+         &packets[(i % RULEBENCH_PACKETS) * TL_INSPECT_RULE_FIELD_COUNT];
+      TL_INSPECT_RULE_ACTION expected = TL_INSPECT_RULE_ACTION_INSPECT;
+      TL_INSPECT_RULE_ACTION action = TL_INSPECT_RULE_ACTION_INSPECT;
+      BOOLEAN expectedFound =
+         RuleBenchLinearLookup(rules, ruleCount, packet, &expected);
+      BOOLEAN found = TLInspectRulesLookup(&set, packet, &action);
+
+      if ((found != expectedFound) || (found && (action != expected)))
+      {
+         fprintf(stderr, "lookup %llu: got %u/%u, expected %u/%u\n",
+                 (unsigned long long)i, found, action, expectedFound, expected);
+         goto Exit;
+      }
+   }
+
+   start = RuleBenchSeconds();
+
+   for (i = 0; i < lookups; i++)
+   {
+      TL_INSPECT_RULE_ACTION action;
+
+      matches += TLInspectRulesLookup(
+                    &set,
+                    &packets[(i & (RULEBENCH_PACKETS - 1)) * TL_INSPECT_RULE_FIELD_COUNT],
+                    &action
+                    );
+   }
+
+   lookupTime = RuleBenchSeconds() - start;
+
+   printf("%6u rules: build %8.1f ms, %8.1f MB, "
+          "%6.1f M lookups/s (%6.1f ns), %4.1f%% matched\n",
+          ruleCount,
+          buildTime * 1e3,
+          (double)size / 1e6,
+          (double)lookups / lookupTime / 1e6,
+          lookupTime * 1e9 / (double)lookups,
+          100.0 * (double)matches / (double)lookups);
+
+   result = 0;
+
+Exit:
+
+   TLInspectRulesFree(&set);
+   free(packets);
+   free(rules);
+
+   return result;
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   static const UINT32 ruleCounts[] = { 1000, 10000, 50000 };
+   UINT64 lookups = 10000000;
+   UINT32 i;
+
+   if (argc > 1)
+   {
+      lookups = strtoull(argv[1], NULL, 0);
+   }
+
+   for (i = 0; i < sizeof(ruleCounts) / sizeof(ruleCounts[0]); i++)
+   {
+      if (RuleBenchRun(ruleCounts[i], lookups) != 0)
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,389 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Scheduling benchmark of the worker scheduler of the driver
+   (sys\sched.h), built in user mode on Linux:
+
+      cc -O2 -I sys -I inc -o schedbench bench/schedbench.c -lm
+      ./schedbench [seconds]
+
+   It simulates worker 0, the only one to take connects, fed with data
+   packets of established flows at half of what it can serve, bursts of
+   connects as in a SYN flood, and a policy change that re-authorizes the
+   existing connections at once. The work is served first the way the
+   worker did before the scheduler, every undecided connect ahead of the
+   packet queue, and then as picked by the scheduler with the default
+   weights and deadlines of the driver. For each class it prints the
+   percentiles of the time the work waited before being dequeued.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t LONG64;
+typedef int32_t LONG;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_opt_
+
+#define __inline static inline
+
+#include "sched.h"
+
+//
+// Times are in 100ns units.
+//
+#define SCHEDBENCH_MS 10000
+
+#define SCHEDBENCH_DATA_RATE 100000             // packets per second
+#define SCHEDBENCH_BURST_INTERVAL (250 * SCHEDBENCH_MS)
+#define SCHEDBENCH_BURST_LENGTH (10 * SCHEDBENCH_MS)
+#define SCHEDBENCH_BURST_CONNECTS 5000
+#define SCHEDBENCH_REAUTH_TIME (1000 * SCHEDBENCH_MS)
+#define SCHEDBENCH_REAUTHS 2000
+
+static const UINT64 gServiceTime[TL_INSPECT_SCHED_CLASS_MAX] =
+{
+   200,                    // connect, 20us
+   100,                    // re-auth, 10us
+   50                      // data, 5us
+};
+
+static const char* gClassNames[TL_INSPECT_SCHED_CLASS_MAX] =
+{
+   "connect",
+   "re-auth",
+   "data"
+};
+
+typedef struct SCHEDBENCH_CLASS_
+{
+   UINT64* arrivals;
+   UINT64* waits;
+   UINT32 count;
+   UINT32 head;
+} SCHEDBENCH_CLASS;
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+SchedBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+double
+SchedBenchUniform(void)
+{
+   return (double)((SchedBenchRandom() >> 11) + 1) / 9007199254740993.0;
+}
+
+int
+SchedBenchCompare(
+   const void* first,
+   const void* second
+   )
+{
+   UINT64 a = *(const UINT64*)first;
+   UINT64 b = *(const UINT64*)second;
+
+   return (a > b) - (a < b);
+}
+
+BOOLEAN
+SchedBenchGenerate(
+   _Out_ SCHEDBENCH_CLASS* classes,
+   _In_ UINT64 duration
+   )
+/* ++
+
+   Fills the arrival times of each class, in increasing order.
+
+-- */
+{
+   UINT32 capacity = (UINT32)(duration / 10000000 + 1) * SCHEDBENCH_DATA_RATE * 2;
+   SCHEDBENCH_CLASS* data = &classes[TL_INSPECT_SCHED_CLASS_DATA];
+   SCHEDBENCH_CLASS* connects = &classes[TL_INSPECT_SCHED_CLASS_CONNECT];
+   SCHEDBENCH_CLASS* reauths = &classes[TL_INSPECT_SCHED_CLASS_REAUTH];
+   double now = 0;
+   UINT64 burst;
+   UINT32 i;
+
+   memset(classes, 0, TL_INSPECT_SCHED_CLASS_MAX * sizeof(SCHEDBENCH_CLASS));
+
+   data->arrivals = malloc(capacity * sizeof(UINT64));
+   connects->arrivals = malloc(
+                           (size_t)(duration / SCHEDBENCH_BURST_INTERVAL + 1) *
+                           SCHEDBENCH_BURST_CONNECTS * sizeof(UINT64)
+                           );
+   reauths->arrivals = malloc(SCHEDBENCH_REAUTHS * sizeof(UINT64));
+
+   if ((data->arrivals == NULL) || (connects->arrivals == NULL) ||
+       (reauths->arrivals == NULL))
+   {
+      return FALSE;
+   }
+
+   for (;;)
+   {
+      now += -log(SchedBenchUniform()) * 1e7 / SCHEDBENCH_DATA_RATE;
+      if ((now >= (double)duration) || (data->count == capacity))
+      {
+         break;
+      }
+      data->arrivals[data->count++] = (UINT64)now;
+   }
+
+   for (burst = SCHEDBENCH_BURST_INTERVAL / 2;
+        burst < duration;
+        burst += SCHEDBENCH_BURST_INTERVAL)
+   {
+      for (i = 0; i < SCHEDBENCH_BURST_CONNECTS; i++)
+      {
+         connects->arrivals[connects->count++] =
+            burst + (UINT64)i * SCHEDBENCH_BURST_LENGTH / SCHEDBENCH_BURST_CONNECTS;
+      }
+   }
+
+   if (SCHEDBENCH_REAUTH_TIME < duration)
+   {
+      for (i = 0; i < SCHEDBENCH_REAUTHS; i++)
+      {
+         reauths->arrivals[reauths->count++] = SCHEDBENCH_REAUTH_TIME;
+      }
+   }
+
+   for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+   {
+      classes[i].waits = malloc((classes[i].count + 1) * sizeof(UINT64));
+      if (classes[i].waits == NULL)
+      {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+TL_INSPECT_SCHED_CLASS
+SchedBenchPickConnectsFirst(
+   _In_ const SCHEDBENCH_CLASS* classes,
+   _In_ ULONG pending
+   )
+/* ++
+
+   Picks the work the way the worker did before the scheduler: connects
+   first, then the packet queue in arrival order.
+
+-- */
+{
+   const SCHEDBENCH_CLASS* reauths = &classes[TL_INSPECT_SCHED_CLASS_REAUTH];
+   const SCHEDBENCH_CLASS* data = &classes[TL_INSPECT_SCHED_CLASS_DATA];
+
+   if (pending & TL_INSPECT_SCHED_CLASS_BIT(TL_INSPECT_SCHED_CLASS_CONNECT))
+   {
+      return TL_INSPECT_SCHED_CLASS_CONNECT;
+   }
+
+   if ((pending & TL_INSPECT_SCHED_CLASS_BIT(TL_INSPECT_SCHED_CLASS_REAUTH)) &&
+       (((pending & TL_INSPECT_SCHED_CLASS_BIT(TL_INSPECT_SCHED_CLASS_DATA)) == 0) ||
+        (reauths->arrivals[reauths->head] <= data->arrivals[data->head])))
+   {
+      return TL_INSPECT_SCHED_CLASS_REAUTH;
+   }
+
+   return (pending != 0) ? TL_INSPECT_SCHED_CLASS_DATA :
+                           TL_INSPECT_SCHED_CLASS_MAX;
+}
+
+void
+SchedBenchRun(
+   _Inout_ SCHEDBENCH_CLASS* classes,
+   _In_opt_ const TL_INSPECT_SCHED_CONFIG* config,
+   _In_ const char* name
+   )
+/* ++
+
+   Serves all the work, with the scheduler if config is given and connects
+   first otherwise, and prints the waits of each class.
+
+-- */
+{
+   TL_INSPECT_SCHEDULER scheduler;
+   UINT64 now = 0;
+   UINT32 i;
+
+   memset(&scheduler, 0, sizeof(scheduler));
+
+   for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+   {
+      classes[i].head = 0;
+   }
+
+   for (;;)
+   {
+      TL_INSPECT_SCHED_CLASS schedClass;
+      SCHEDBENCH_CLASS* picked;
+      UINT64 next = UINT64_MAX;
+      ULONG pending = 0;
+      BOOLEAN overdue;
+
+      for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+      {
+         if (classes[i].head == classes[i].count)
+         {
+            continue;
+         }
+
+         if (classes[i].arrivals[classes[i].head] <= now)
+         {
+            pending |= TL_INSPECT_SCHED_CLASS_BIT(i);
+         }
+         else if (classes[i].arrivals[classes[i].head] < next)
+         {
+            next = classes[i].arrivals[classes[i].head];
+         }
+      }
+
+      if (config != NULL)
+      {
+         schedClass = TLInspectSchedulerPick(
+                         config,
+                         &scheduler,
+                         pending,
+                         now,
+                         &overdue
+                         );
+      }
+      else
+      {
+         schedClass = SchedBenchPickConnectsFirst(classes, pending);
+      }
+
+      if (schedClass == TL_INSPECT_SCHED_CLASS_MAX)
+      {
+         if (next == UINT64_MAX)
+         {
+            break;
+         }
+
+         //
+         // The worker sleeps until the next arrival.
+         //
+         now = next;
+         continue;
+      }
+
+      picked = &classes[schedClass];
+      picked->waits[picked->head] = now - picked->arrivals[picked->head];
+      picked->head++;
+
+      if (config != NULL)
+      {
+         TLInspectSchedulerServed(&scheduler, schedClass, now);
+      }
+
+      now += gServiceTime[schedClass];
+   }
+
+   printf("%s\n", name);
+
+   for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+   {
+      SCHEDBENCH_CLASS* schedClass = &classes[i];
+
+      if (schedClass->count == 0)
+      {
+         continue;
+      }
+
+      qsort(schedClass->waits, schedClass->count, sizeof(UINT64), SchedBenchCompare);
+
+      printf("   %-8s %7u waited p50 %8.3f ms, p99 %8.3f ms, max %8.3f ms\n",
+             gClassNames[i],
+             schedClass->count,
+             (double)schedClass->waits[schedClass->count / 2] / SCHEDBENCH_MS,
+             (double)schedClass->waits[(UINT64)schedClass->count * 99 / 100] /
+                SCHEDBENCH_MS,
+             (double)schedClass->waits[schedClass->count - 1] / SCHEDBENCH_MS);
+   }
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   //
+   // The defaults of the driver (see TL_drv.c).
+   //
+   static const TL_INSPECT_SCHED_CONFIG config =
+   {
+      { 1, 2, 8 },
+      { 50 * SCHEDBENCH_MS, 20 * SCHEDBENCH_MS, 5 * SCHEDBENCH_MS }
+   };
+   SCHEDBENCH_CLASS classes[TL_INSPECT_SCHED_CLASS_MAX];
+   UINT64 seconds = 2;
+   int result = 1;
+   UINT32 i;
+
+   if (argc > 1)
+   {
+      seconds = strtoull(argv[1], NULL, 0);
+   }
+
+   if (!SchedBenchGenerate(classes, seconds * 10000000))
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   printf("%u data packets/s, %u connects every %u ms, %u re-auths at %u ms\n",
+          SCHEDBENCH_DATA_RATE,
+          SCHEDBENCH_BURST_CONNECTS,
+          SCHEDBENCH_BURST_INTERVAL / SCHEDBENCH_MS,
+          SCHEDBENCH_REAUTHS,
+          SCHEDBENCH_REAUTH_TIME / SCHEDBENCH_MS);
+
+   SchedBenchRun(classes, NULL, "connects first");
+   SchedBenchRun(classes, &config, "scheduler");
+
+   result = 0;
+
+Exit:
+
+   for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+   {
+      free(classes[i].arrivals);
+      free(classes[i].waits);
+   }
+
+   return result;
+}
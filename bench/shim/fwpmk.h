@@ -0,0 +1,118 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the header of the management API of the Windows
+   Filtering Platform, see shim.c. A callout added to a layer is what the
+   replay classifies the packets of that layer with.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_FWPMK_H_
+#define _SHIM_FWPMK_H_
+
+#include "fwpsk.h"
+
+typedef struct FWPM_DISPLAY_DATA0_
+{
+   wchar_t* name;
+   wchar_t* description;
+} FWPM_DISPLAY_DATA0, FWPM_DISPLAY_DATA;
+
+typedef struct FWPM_FILTER_CONDITION0_
+{
+   GUID fieldKey;
+   FWP_MATCH_TYPE matchType;
+   FWP_CONDITION_VALUE0 conditionValue;
+} FWPM_FILTER_CONDITION0, FWPM_FILTER_CONDITION;
+
+typedef struct FWPM_ACTION0_
+{
+   FWP_ACTION_TYPE type;
+   union
+   {
+      GUID filterType;
+      GUID calloutKey;
+   };
+} FWPM_ACTION0;
+
+typedef struct FWPM_FILTER0_
+{
+   GUID filterKey;
+   FWPM_DISPLAY_DATA0 displayData;
+   UINT32 flags;
+   GUID* providerKey;
+   FWP_BYTE_BLOB providerData;
+   GUID layerKey;
+   GUID subLayerKey;
+   FWP_VALUE0 weight;
+   UINT32 numFilterConditions;
+   FWPM_FILTER_CONDITION0* filterCondition;
+   FWPM_ACTION0 action;
+   union
+   {
+      UINT64 rawContext;
+      GUID providerContextKey;
+   };
+} FWPM_FILTER0, FWPM_FILTER;
+
+typedef struct FWPM_CALLOUT0_
+{
+   GUID calloutKey;
+   FWPM_DISPLAY_DATA0 displayData;
+   UINT32 flags;
+   GUID applicableLayer;
+} FWPM_CALLOUT0, FWPM_CALLOUT;
+
+typedef struct FWPM_SUBLAYER0_
+{
+   GUID subLayerKey;
+   FWPM_DISPLAY_DATA0 displayData;
+   UINT16 flags;
+   UINT16 weight;
+} FWPM_SUBLAYER0, FWPM_SUBLAYER;
+
+typedef struct FWPM_SESSION0_
+{
+   UINT32 flags;
+} FWPM_SESSION0, FWPM_SESSION;
+
+#define FWPM_FILTER_FLAG_NONE 0
+#define FWPM_SESSION_FLAG_DYNAMIC 1
+#define RPC_C_AUTHN_WINNT 10
+
+extern const GUID FWPM_CONDITION_IP_LOCAL_ADDRESS;
+extern const GUID FWPM_CONDITION_IP_REMOTE_ADDRESS;
+extern const GUID FWPM_CONDITION_IP_LOCAL_PORT;
+extern const GUID FWPM_CONDITION_IP_REMOTE_PORT;
+extern const GUID FWPM_CONDITION_IP_PROTOCOL;
+
+extern const GUID FWPM_LAYER_INBOUND_IPPACKET_V4;
+extern const GUID FWPM_LAYER_INBOUND_IPPACKET_V6;
+extern const GUID FWPM_LAYER_OUTBOUND_IPPACKET_V4;
+extern const GUID FWPM_LAYER_OUTBOUND_IPPACKET_V6;
+extern const GUID FWPM_LAYER_INBOUND_TRANSPORT_V4;
+extern const GUID FWPM_LAYER_INBOUND_TRANSPORT_V6;
+extern const GUID FWPM_LAYER_OUTBOUND_TRANSPORT_V4;
+extern const GUID FWPM_LAYER_OUTBOUND_TRANSPORT_V6;
+extern const GUID FWPM_LAYER_ALE_AUTH_CONNECT_V4;
+extern const GUID FWPM_LAYER_ALE_AUTH_CONNECT_V6;
+extern const GUID FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V4;
+extern const GUID FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V6;
+
+NTSTATUS FwpmEngineOpen(const wchar_t* serverName, UINT32 authnService, void* authIdentity, const FWPM_SESSION0* session, HANDLE* engineHandle);
+NTSTATUS FwpmEngineClose(HANDLE engineHandle);
+NTSTATUS FwpmTransactionBegin(HANDLE engineHandle, UINT32 flags);
+NTSTATUS FwpmTransactionCommit(HANDLE engineHandle);
+NTSTATUS FwpmTransactionAbort(HANDLE engineHandle);
+NTSTATUS FwpmSubLayerAdd(HANDLE engineHandle, const FWPM_SUBLAYER0* subLayer, void* sd);
+NTSTATUS FwpmCalloutAdd(HANDLE engineHandle, const FWPM_CALLOUT0* callout, void* sd, UINT32* id);
+NTSTATUS FwpmFilterAdd(HANDLE engineHandle, const FWPM_FILTER0* filter, void* sd, UINT64* id);
+
+#endif // _SHIM_FWPMK_H_
@@ -0,0 +1,465 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the header of the callout API of the Windows
+   Filtering Platform and for the NDIS net buffers the driver is given,
+   with which the files of the sys folder are built on Linux (see shim.c).
+
+   The net buffer lists carry a few fields of the shim after those of NDIS:
+   their reference count, the list they were cloned from, whether they were
+   injected by the driver, and a context of the replay that indicated them.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_FWPSK_H_
+#define _SHIM_FWPSK_H_
+
+#include "ntddk.h"
+
+#define NTDDI_WIN7 0x06010000
+#define NTDDI_VERSION 0x0A000000
+
+#define AF_UNSPEC 0
+#define AF_INET 2
+#define AF_INET6 23
+
+#define IPPROTO_HOPOPTS 0
+#define IPPROTO_ICMP 1
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+#define IPPROTO_ROUTING 43
+#define IPPROTO_FRAGMENT 44
+#define IPPROTO_ESP 50
+#define IPPROTO_AH 51
+#define IPPROTO_ICMPV6 58
+#define IPPROTO_NONE 59
+#define IPPROTO_DSTOPTS 60
+
+typedef ULONG COMPARTMENT_ID;
+typedef ULONG IF_INDEX;
+
+typedef struct _SCOPE_ID
+{
+   union
+   {
+      struct
+      {
+         ULONG Zone : 28;
+         ULONG Level : 4;
+      };
+      ULONG Value;
+   };
+} SCOPE_ID;
+
+typedef struct _WSACMSGHDR
+{
+   SIZE_T cmsg_len;
+   INT cmsg_level;
+   INT cmsg_type;
+} WSACMSGHDR;
+
+typedef struct in_addr
+{
+   union
+   {
+      struct
+      {
+         UCHAR s_b1, s_b2, s_b3, s_b4;
+      } S_un_b;
+      ULONG S_addr;
+   } S_un;
+} IN_ADDR;
+
+typedef struct in6_addr
+{
+   union
+   {
+      UCHAR Byte[16];
+      USHORT Word[8];
+   } u;
+} IN6_ADDR;
+
+//
+// Values of the classify.
+//
+
+typedef struct FWP_BYTE_ARRAY16_
+{
+   UINT8 byteArray16[16];
+} FWP_BYTE_ARRAY16;
+
+typedef struct FWP_BYTE_BLOB_
+{
+   UINT32 size;
+   UINT8* data;
+} FWP_BYTE_BLOB;
+
+typedef struct FWP_V4_ADDR_AND_MASK_
+{
+   UINT32 addr;
+   UINT32 mask;
+} FWP_V4_ADDR_AND_MASK;
+
+typedef struct FWP_V6_ADDR_AND_MASK_
+{
+   UINT8 addr[16];
+   UINT8 prefixLength;
+} FWP_V6_ADDR_AND_MASK;
+
+typedef enum FWP_DATA_TYPE_
+{
+   FWP_EMPTY,
+   FWP_UINT8,
+   FWP_UINT16,
+   FWP_UINT32,
+   FWP_UINT64,
+   FWP_BYTE_ARRAY16_TYPE,
+   FWP_BYTE_BLOB_TYPE,
+   FWP_V4_ADDR_MASK,
+   FWP_V6_ADDR_MASK,
+   FWP_RANGE_TYPE
+} FWP_DATA_TYPE;
+
+typedef struct FWP_VALUE0_
+{
+   FWP_DATA_TYPE type;
+   union
+   {
+      UINT8 uint8;
+      UINT16 uint16;
+      UINT32 uint32;
+      UINT64* uint64;
+      FWP_BYTE_ARRAY16* byteArray16;
+      FWP_BYTE_BLOB* byteBlob;
+   };
+} FWP_VALUE0, FWP_VALUE;
+
+typedef struct FWP_RANGE0_
+{
+   FWP_VALUE0 valueLow;
+   FWP_VALUE0 valueHigh;
+} FWP_RANGE0;
+
+typedef struct FWP_CONDITION_VALUE0_
+{
+   FWP_DATA_TYPE type;
+   union
+   {
+      UINT8 uint8;
+      UINT16 uint16;
+      UINT32 uint32;
+      UINT64* uint64;
+      FWP_BYTE_ARRAY16* byteArray16;
+      FWP_V4_ADDR_AND_MASK* v4AddrMask;
+      FWP_V6_ADDR_AND_MASK* v6AddrMask;
+      FWP_RANGE0* rangeValue;
+   };
+} FWP_CONDITION_VALUE0;
+
+typedef enum FWP_DIRECTION_
+{
+   FWP_DIRECTION_OUTBOUND,
+   FWP_DIRECTION_INBOUND,
+   FWP_DIRECTION_MAX
+} FWP_DIRECTION;
+
+typedef enum FWP_MATCH_TYPE_
+{
+   FWP_MATCH_EQUAL,
+   FWP_MATCH_GREATER,
+   FWP_MATCH_LESS,
+   FWP_MATCH_GREATER_OR_EQUAL,
+   FWP_MATCH_LESS_OR_EQUAL,
+   FWP_MATCH_RANGE
+} FWP_MATCH_TYPE;
+
+typedef UINT32 FWP_ACTION_TYPE;
+
+#define FWP_ACTION_FLAG_TERMINATING 0x1000
+#define FWP_ACTION_BLOCK (0x1 | FWP_ACTION_FLAG_TERMINATING)
+#define FWP_ACTION_PERMIT (0x2 | FWP_ACTION_FLAG_TERMINATING)
+#define FWP_ACTION_CALLOUT_TERMINATING (0x3 | 0x4000 | FWP_ACTION_FLAG_TERMINATING)
+#define FWP_ACTION_CONTINUE 0x2002
+
+#define FWPS_RIGHT_ACTION_WRITE 0x1
+#define FWPS_CLASSIFY_OUT_FLAG_ABSORB 0x1
+#define FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT 0x1
+
+#define FWP_CONDITION_FLAG_IS_IPSEC_SECURED 0x2
+#define FWP_CONDITION_FLAG_IS_REAUTHORIZE 0x4
+
+typedef struct FWPS_FILTER_
+{
+   UINT64 filterId;
+   UINT32 flags;
+   UINT64 context;
+} FWPS_FILTER, FWPS_FILTER0, FWPS_FILTER1, FWPS_FILTER2;
+
+typedef struct FWPS_INCOMING_VALUE0_
+{
+   FWP_VALUE0 value;
+} FWPS_INCOMING_VALUE0, FWPS_INCOMING_VALUE;
+
+typedef struct FWPS_INCOMING_VALUES0_
+{
+   UINT16 layerId;
+   UINT32 valueCount;
+   FWPS_INCOMING_VALUE0* incomingValue;
+} FWPS_INCOMING_VALUES0, FWPS_INCOMING_VALUES;
+
+typedef struct FWPS_INCOMING_METADATA_VALUES0_
+{
+   UINT32 currentMetadataValues;
+   UINT32 flags;
+   UINT64 reserved;
+   void* discardMetadata;
+   UINT64 flowHandle;
+   UINT32 ipHeaderSize;
+   UINT32 transportHeaderSize;
+   FWP_BYTE_BLOB* processPath;
+   UINT64 token;
+   UINT64 processId;
+   UINT32 sourceInterfaceIndex;
+   UINT32 destinationInterfaceIndex;
+   ULONG compartmentId;
+   void* fragmentMetadata;
+   ULONG pathMtu;
+   HANDLE completionHandle;
+   UINT64 transportEndpointHandle;
+   SCOPE_ID remoteScopeId;
+   WSACMSGHDR* controlData;
+   ULONG controlDataLength;
+   FWP_DIRECTION packetDirection;
+} FWPS_INCOMING_METADATA_VALUES0, FWPS_INCOMING_METADATA_VALUES;
+
+#define FWPS_IS_METADATA_FIELD_PRESENT(m, f) \
+   (((m)->currentMetadataValues & (f)) == (f))
+
+#define FWPS_METADATA_FIELD_COMPLETION_HANDLE 0x1
+#define FWPS_METADATA_FIELD_PACKET_DIRECTION 0x2
+#define FWPS_METADATA_FIELD_COMPARTMENT_ID 0x4
+#define FWPS_METADATA_FIELD_TRANSPORT_ENDPOINT_HANDLE 0x8
+#define FWPS_METADATA_FIELD_TRANSPORT_CONTROL_DATA 0x10
+#define FWPS_METADATA_FIELD_IP_HEADER_SIZE 0x20
+#define FWPS_METADATA_FIELD_TRANSPORT_HEADER_SIZE 0x40
+#define FWPS_METADATA_FIELD_ALE_CLASSIFY_REQUIRED 0x80
+#define FWPS_METADATA_FIELD_PROCESS_PATH 0x100
+#define FWPS_METADATA_FIELD_PROCESS_ID 0x200
+#define FWPS_METADATA_FIELD_FLOW_HANDLE 0x400
+
+typedef struct FWPS_CLASSIFY_OUT0_
+{
+   FWP_ACTION_TYPE actionType;
+   UINT64 outContext;
+   UINT64 filterId;
+   UINT32 rights;
+   UINT32 flags;
+   UINT32 reserved;
+} FWPS_CLASSIFY_OUT0, FWPS_CLASSIFY_OUT;
+
+typedef enum FWPS_CALLOUT_NOTIFY_TYPE_
+{
+   FWPS_CALLOUT_NOTIFY_ADD_FILTER,
+   FWPS_CALLOUT_NOTIFY_DELETE_FILTER
+} FWPS_CALLOUT_NOTIFY_TYPE;
+
+typedef enum FWPS_PACKET_INJECTION_STATE_
+{
+   FWPS_PACKET_NOT_INJECTED,
+   FWPS_PACKET_INJECTED_BY_SELF,
+   FWPS_PACKET_INJECTED_BY_OTHER,
+   FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF,
+   FWPS_PACKET_INJECTION_STATE_MAX
+} FWPS_PACKET_INJECTION_STATE;
+
+typedef struct FWPS_PACKET_LIST_INFORMATION0_
+{
+   struct
+   {
+      struct
+      {
+         UINT32 isTunnelMode : 1;
+         UINT32 isDeTunneled : 1;
+         UINT32 isSecure : 1;
+      } inbound;
+   } ipsecInformation;
+} FWPS_PACKET_LIST_INFORMATION0, FWPS_PACKET_LIST_INFORMATION;
+
+#define FWPS_PACKET_LIST_INFORMATION_QUERY_IPSEC 0x1
+#define FWPS_PACKET_LIST_INFORMATION_QUERY_INBOUND 0x2
+
+typedef struct FWPS_TRANSPORT_SEND_PARAMS0_
+{
+   UINT8* remoteAddress;
+   SCOPE_ID remoteScopeId;
+   WSACMSGHDR* controlData;
+   ULONG controlDataLength;
+} FWPS_TRANSPORT_SEND_PARAMS0, FWPS_TRANSPORT_SEND_PARAMS;
+
+#define FWPS_INJECTION_TYPE_TRANSPORT 0x4
+
+//
+// Layers, and the fields of their values.
+//
+
+enum
+{
+   FWPS_LAYER_INBOUND_IPPACKET_V4,
+   FWPS_LAYER_INBOUND_IPPACKET_V6,
+   FWPS_LAYER_OUTBOUND_IPPACKET_V4,
+   FWPS_LAYER_OUTBOUND_IPPACKET_V6,
+   FWPS_LAYER_INBOUND_TRANSPORT_V4,
+   FWPS_LAYER_INBOUND_TRANSPORT_V6,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V4,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V6,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V4,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V6,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6,
+   FWPS_BUILTIN_LAYER_MAX
+};
+
+#define SHIM_TRANSPORT_FIELDS(l)                      \
+   enum                                               \
+   {                                                  \
+      FWPS_FIELD_##l##_IP_LOCAL_ADDRESS,              \
+      FWPS_FIELD_##l##_IP_REMOTE_ADDRESS,             \
+      FWPS_FIELD_##l##_IP_LOCAL_PORT,                 \
+      FWPS_FIELD_##l##_IP_REMOTE_PORT,                \
+      FWPS_FIELD_##l##_IP_PROTOCOL,                   \
+      FWPS_FIELD_##l##_FLAGS,                         \
+      FWPS_FIELD_##l##_INTERFACE_INDEX,               \
+      FWPS_FIELD_##l##_SUB_INTERFACE_INDEX,           \
+      FWPS_FIELD_##l##_ALE_APP_ID,                    \
+      FWPS_FIELD_##l##_IP_LOCAL_ADDRESS_TYPE,         \
+      FWPS_FIELD_##l##_MAX                            \
+   }
+
+#define SHIM_IPPACKET_FIELDS(l)                       \
+   enum                                               \
+   {                                                  \
+      FWPS_FIELD_##l##_IP_LOCAL_ADDRESS,              \
+      FWPS_FIELD_##l##_IP_REMOTE_ADDRESS,             \
+      FWPS_FIELD_##l##_FLAGS,                         \
+      FWPS_FIELD_##l##_INTERFACE_INDEX,               \
+      FWPS_FIELD_##l##_SUB_INTERFACE_INDEX,           \
+      FWPS_FIELD_##l##_MAX                            \
+   }
+
+SHIM_TRANSPORT_FIELDS(ALE_AUTH_CONNECT_V4);
+SHIM_TRANSPORT_FIELDS(ALE_AUTH_CONNECT_V6);
+SHIM_TRANSPORT_FIELDS(ALE_AUTH_RECV_ACCEPT_V4);
+SHIM_TRANSPORT_FIELDS(ALE_AUTH_RECV_ACCEPT_V6);
+SHIM_TRANSPORT_FIELDS(OUTBOUND_TRANSPORT_V4);
+SHIM_TRANSPORT_FIELDS(OUTBOUND_TRANSPORT_V6);
+SHIM_TRANSPORT_FIELDS(INBOUND_TRANSPORT_V4);
+SHIM_TRANSPORT_FIELDS(INBOUND_TRANSPORT_V6);
+SHIM_IPPACKET_FIELDS(INBOUND_IPPACKET_V4);
+SHIM_IPPACKET_FIELDS(INBOUND_IPPACKET_V6);
+SHIM_IPPACKET_FIELDS(OUTBOUND_IPPACKET_V4);
+SHIM_IPPACKET_FIELDS(OUTBOUND_IPPACKET_V6);
+
+//
+// Net buffers.
+//
+
+typedef struct _NET_BUFFER
+{
+   struct _NET_BUFFER* Next;
+   PMDL CurrentMdl;
+   ULONG CurrentMdlOffset;
+   ULONG DataLength;
+   PMDL MdlChain;
+   ULONG DataOffset;
+} NET_BUFFER, *PNET_BUFFER;
+
+typedef struct _NET_BUFFER_LIST
+{
+   struct _NET_BUFFER_LIST* Next;
+   NET_BUFFER* FirstNetBuffer;
+   PVOID ProtocolReserved[4];
+   NTSTATUS Status;
+
+   volatile LONG ShimReferences;
+   struct _NET_BUFFER_LIST* ShimParent;
+   BOOLEAN ShimInjected;
+   PVOID ShimContext;
+} NET_BUFFER_LIST, *PNET_BUFFER_LIST;
+
+#define NET_BUFFER_LIST_FIRST_NB(n) ((n)->FirstNetBuffer)
+#define NET_BUFFER_LIST_NEXT_NBL(n) ((n)->Next)
+#define NET_BUFFER_LIST_STATUS(n) ((n)->Status)
+#define NET_BUFFER_NEXT_NB(n) ((n)->Next)
+#define NET_BUFFER_DATA_OFFSET(n) ((n)->DataOffset)
+#define NET_BUFFER_DATA_LENGTH(n) ((n)->DataLength)
+#define NET_BUFFER_CURRENT_MDL(n) ((n)->CurrentMdl)
+#define NET_BUFFER_CURRENT_MDL_OFFSET(n) ((n)->CurrentMdlOffset)
+#define NET_BUFFER_FIRST_MDL(n) ((n)->MdlChain)
+#define NDIS_MDL_LINKAGE(m) ((m)->Next)
+#define NDIS_STATUS_SUCCESS 0
+#define NDIS_STATUS_FAILURE ((NDIS_STATUS)0xC0000001L)
+
+//
+// The MDLs of the shim map their whole buffer: MappedSystemVa is the
+// address of its first byte.
+//
+#define NdisQueryMdl(m, v, l, p) \
+   (*(v) = (m)->MappedSystemVa, *(l) = (m)->ByteCount)
+
+PVOID NdisGetDataBuffer(NET_BUFFER* netBuffer, ULONG bytesNeeded, PVOID storage, UINT alignMultiple, UINT alignOffset);
+NDIS_STATUS NdisRetreatNetBufferDataStart(NET_BUFFER* netBuffer, ULONG dataOffsetDelta, ULONG dataBackFill, PVOID allocateMdlHandler);
+void NdisAdvanceNetBufferDataStart(NET_BUFFER* netBuffer, ULONG dataOffsetDelta, BOOLEAN freeMdl, PVOID freeMdlHandler);
+
+//
+// Callouts, pending, cloning and injection.
+//
+
+typedef void FWPS_INJECT_COMPLETE0(void* context, NET_BUFFER_LIST* netBufferList, BOOLEAN dispatchLevel);
+typedef FWPS_INJECT_COMPLETE0 FWPS_INJECT_COMPLETE;
+
+typedef void (*FWPS_CALLOUT_CLASSIFY_FN)(
+   const FWPS_INCOMING_VALUES* inFixedValues,
+   const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+   void* layerData,
+   const void* classifyContext,
+   const FWPS_FILTER* filter,
+   UINT64 flowContext,
+   FWPS_CLASSIFY_OUT* classifyOut
+   );
+
+typedef NTSTATUS (*FWPS_CALLOUT_NOTIFY_FN)(FWPS_CALLOUT_NOTIFY_TYPE notifyType, const GUID* filterKey, const FWPS_FILTER* filter);
+typedef void (*FWPS_CALLOUT_FLOW_DELETE_NOTIFY_FN)(UINT16 layerId, UINT32 calloutId, UINT64 flowContext);
+
+typedef struct FWPS_CALLOUT_
+{
+   GUID calloutKey;
+   UINT32 flags;
+   FWPS_CALLOUT_CLASSIFY_FN classifyFn;
+   FWPS_CALLOUT_NOTIFY_FN notifyFn;
+   FWPS_CALLOUT_FLOW_DELETE_NOTIFY_FN flowDeleteFn;
+} FWPS_CALLOUT, FWPS_CALLOUT0, FWPS_CALLOUT1, FWPS_CALLOUT2;
+
+NTSTATUS FwpsCalloutRegister(void* deviceObject, const FWPS_CALLOUT* callout, UINT32* calloutId);
+NTSTATUS FwpsCalloutUnregisterById(UINT32 calloutId);
+FWPS_PACKET_INJECTION_STATE FwpsQueryPacketInjectionState(HANDLE injectionHandle, const NET_BUFFER_LIST* netBufferList, HANDLE* injectionContext);
+NTSTATUS FwpsPendOperation(HANDLE completionHandle, HANDLE* completionContext);
+void FwpsCompleteOperation(HANDLE completionContext, NET_BUFFER_LIST* netBufferList);
+NTSTATUS FwpsAllocateCloneNetBufferList(NET_BUFFER_LIST* original, HANDLE poolHandle, HANDLE bufferPoolHandle, ULONG flags, NET_BUFFER_LIST** clone);
+void FwpsFreeCloneNetBufferList(NET_BUFFER_LIST* clone, ULONG flags);
+void FwpsReferenceNetBufferList(NET_BUFFER_LIST* netBufferList, BOOLEAN intendToModify);
+void FwpsDereferenceNetBufferList(NET_BUFFER_LIST* netBufferList, BOOLEAN dispatchLevel);
+NTSTATUS FwpsInjectTransportSendAsync(HANDLE injectionHandle, HANDLE injectionContext, UINT64 endpointHandle, UINT32 flags, FWPS_TRANSPORT_SEND_PARAMS* sendArgs, ADDRESS_FAMILY addressFamily, COMPARTMENT_ID compartmentId, NET_BUFFER_LIST* netBufferList, FWPS_INJECT_COMPLETE* completionFn, HANDLE completionContext);
+NTSTATUS FwpsInjectTransportReceiveAsync(HANDLE injectionHandle, HANDLE injectionContext, void* reserved, UINT32 flags, ADDRESS_FAMILY addressFamily, COMPARTMENT_ID compartmentId, IF_INDEX interfaceIndex, IF_INDEX subInterfaceIndex, NET_BUFFER_LIST* netBufferList, FWPS_INJECT_COMPLETE* completionFn, HANDLE completionContext);
+NTSTATUS FwpsConstructIpHeaderForTransportPacket(NET_BUFFER_LIST* netBufferList, ULONG headerIncludeHeaderLength, ADDRESS_FAMILY addressFamily, const UCHAR* sourceAddress, const UCHAR* remoteAddress, UINT8 nextProtocol, UINT64 endpointHandle, const WSACMSGHDR* controlData, ULONG controlDataLength, UINT32 flags, void* reserved, IF_INDEX interfaceIndex, IF_INDEX subInterfaceIndex);
+NTSTATUS FwpsGetPacketListSecurityInformation(NET_BUFFER_LIST* netBufferList, UINT32 queryFlags, FWPS_PACKET_LIST_INFORMATION* packetInformation);
+NTSTATUS FwpsInjectionHandleCreate(ADDRESS_FAMILY addressFamily, UINT32 flags, HANDLE* injectionHandle);
+NTSTATUS FwpsInjectionHandleDestroy(HANDLE injectionHandle);
+
+#endif // _SHIM_FWPSK_H_
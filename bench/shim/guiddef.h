@@ -0,0 +1,26 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the GUID header, see shim.c.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_GUIDDEF_H_
+#define _SHIM_GUIDDEF_H_
+
+#include "ntddk.h"
+
+#undef DEFINE_GUID
+#define DEFINE_GUID(n, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+   const GUID n = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+
+#define IsEqualGUID(a, b) (memcmp((a), (b), sizeof(GUID)) == 0)
+
+#endif // _SHIM_GUIDDEF_H_
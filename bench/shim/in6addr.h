@@ -0,0 +1,21 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the IPv6 address header, see shim.c. IN6_ADDR
+   is declared by fwpsk.h.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_IN6ADDR_H_
+#define _SHIM_IN6ADDR_H_
+
+#include "fwpsk.h"
+
+#endif // _SHIM_IN6ADDR_H_
@@ -0,0 +1,25 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the address conversion header, see shim.c.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_IP2STRING_H_
+#define _SHIM_IP2STRING_H_
+
+#include "fwpsk.h"
+
+NTSTATUS RtlIpv4StringToAddressW(PCWSTR string, BOOLEAN strict, PWSTR* terminator, IN_ADDR* address);
+NTSTATUS RtlIpv6StringToAddressW(PCWSTR string, PWSTR* terminator, IN6_ADDR* address);
+PSTR RtlIpv4AddressToStringA(const IN_ADDR* address, PSTR string);
+PSTR RtlIpv6AddressToStringA(const IN6_ADDR* address, PSTR string);
+
+#endif // _SHIM_IP2STRING_H_
@@ -0,0 +1,873 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the kernel header of the driver, with which the
+   files of the sys folder are built on Linux (see shim.c). It declares
+   the types, routines and macros of the kernel that the driver uses; the
+   routines are implemented on POSIX threads by shim.c, and the small ones
+   are inlined here.
+
+   Spin locks are spin locks, and raising the IRQL to DISPATCH_LEVEL takes
+   the virtual processor of the thread for itself, so that the per-processor
+   data of the driver are only touched by one thread at a time, as in the
+   kernel. Build with -fshort-wchar, so that L"" strings are WCHAR strings.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_NTDDK_H_
+#define _SHIM_NTDDK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(x)
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_reads_bytes_(x)
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_opt_(x)
+#define _Out_writes_bytes_to_(x,y)
+#define _Out_writes_to_(x,y)
+#define _Outptr_
+#define _Outptr_result_maybenull_
+#define _Success_(x)
+#define _Ret_maybenull_
+#define _Must_inspect_result_
+#define _When_(a,b)
+#define _Requires_lock_held_(x)
+#define _Requires_lock_not_held_(x)
+#define _Acquires_lock_(x)
+#define _Releases_lock_(x)
+#define _Guarded_by_(x)
+#define _Interlocked_
+#define _Function_class_(x)
+#define _IRQL_requires_same_
+#define _IRQL_requires_max_(x)
+#define _IRQL_requires_(x)
+#define _IRQL_raises_(x)
+#define _IRQL_saves_
+#define _IRQL_restores_
+#define _Analysis_assume_(x) ((void)sizeof(x))
+#define _Analysis_assume_lock_not_held_(x)
+#define _Field_size_(x)
+#define _Field_size_bytes_(x)
+#define _Use_decl_annotations_
+#define _Post_invalid_
+#define _Frees_ptr_
+#define _Frees_ptr_opt_
+#define __drv_allocatesMem(x)
+#define __drv_freesMem(x)
+#define __drv_aliasesMem
+
+#define __inline static inline
+#define __forceinline static inline __attribute__((always_inline))
+#define FORCEINLINE static inline
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(64)
+#define DECLSPEC_SELECTANY __attribute__((weak))
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+
+#define UNREFERENCED_PARAMETER(x) (void)(x)
+#define C_ASSERT(e) _Static_assert(e, #e)
+
+void
+ShimAssertFailed(
+   const char* expression,
+   const char* file,
+   int line
+   );
+
+#define NT_ASSERT(e) \
+   ((e) ? (void)0 : ShimAssertFailed(#e, __FILE__, __LINE__))
+#define NT_VERIFY(e) \
+   ((e) ? 1 : (ShimAssertFailed(#e, __FILE__, __LINE__), 0))
+#define ASSERT(e) NT_ASSERT(e)
+
+#define FIELD_OFFSET(t,f) offsetof(t,f)
+#define RTL_FIELD_SIZE(t,f) sizeof(((t*)0)->f)
+#define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
+#define RTL_NUMBER_OF(a) ARRAYSIZE(a)
+#define CONTAINING_RECORD(a,t,f) ((t*)((char*)(a)-offsetof(t,f)))
+#define ALIGN_UP_BY(l,a) ((((ULONG_PTR)(l))+(a)-1)&~((ULONG_PTR)(a)-1))
+#define ALIGN_DOWN_BY(l,a) (((ULONG_PTR)(l))&~((ULONG_PTR)(a)-1))
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
+#endif
+#define TRUE 1
+#define FALSE 0
+#define VOID void
+#define CONST const
+#define NTAPI
+#define WINAPI
+
+#define MAXUINT32 0xffffffffu
+#define MAXLONG 0x7fffffff
+#define MAXULONG 0xffffffffUL
+#define MAXUINT8 0xff
+#define MAXUINT16 0xffff
+
+#define REG_SZ 1
+#define REG_DWORD 4
+#define REG_DWORD_LITTLE_ENDIAN 4
+#define REG_DWORD_BIG_ENDIAN 5
+#define REG_MULTI_SZ 7
+
+typedef uint8_t UINT8, UCHAR, BYTE, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef int8_t INT8, CHAR, *PCHAR;
+typedef uint16_t UINT16, USHORT, WORD, *PUSHORT;
+typedef int16_t INT16, SHORT;
+typedef uint32_t UINT32, ULONG, UINT, DWORD, *PULONG, *PUINT32;
+typedef int32_t INT32, LONG, INT, BOOL, NTSTATUS, NDIS_STATUS, *PLONG;
+typedef uint64_t UINT64, ULONG64, ULONGLONG, DWORD64, *PUINT64;
+typedef int64_t INT64, LONG64, LONGLONG, *PLONG64;
+typedef uintptr_t ULONG_PTR, SIZE_T, UINT_PTR, *PULONG_PTR;
+typedef intptr_t LONG_PTR, INT_PTR;
+typedef void *PVOID, *HANDLE, **PHANDLE;
+typedef uint16_t WCHAR, *PWSTR, *PWCH;
+typedef const uint16_t *PCWSTR;
+typedef char *PSTR;
+typedef const char *PCSTR;
+typedef UCHAR KIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef ULONG_PTR KAFFINITY;
+typedef USHORT ADDRESS_FAMILY;
+typedef ULONG ACCESS_MASK;
+typedef ULONG LOGICAL;
+typedef LONG EX_SPIN_LOCK;
+
+typedef union _LARGE_INTEGER
+{
+   struct
+   {
+      ULONG LowPart;
+      LONG HighPart;
+   };
+   LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS;
+
+typedef union _ULARGE_INTEGER
+{
+   ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _LIST_ENTRY
+{
+   struct _LIST_ENTRY* Flink;
+   struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _SINGLE_LIST_ENTRY
+{
+   struct _SINGLE_LIST_ENTRY* Next;
+} SINGLE_LIST_ENTRY, *PSINGLE_LIST_ENTRY;
+
+typedef struct _UNICODE_STRING
+{
+   USHORT Length;
+   USHORT MaximumLength;
+   PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+typedef struct _GUID
+{
+   ULONG Data1;
+   USHORT Data2;
+   USHORT Data3;
+   UCHAR Data4[8];
+} GUID;
+
+typedef struct _GROUP_AFFINITY
+{
+   KAFFINITY Mask;
+   USHORT Group;
+   USHORT Reserved[3];
+} GROUP_AFFINITY;
+
+typedef struct _PROCESSOR_NUMBER
+{
+   USHORT Group;
+   UCHAR Number;
+   UCHAR Reserved;
+} PROCESSOR_NUMBER;
+
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define STATUS_WAIT_0 ((NTSTATUS)0)
+#define STATUS_WAIT_1 ((NTSTATUS)1)
+#define STATUS_TIMEOUT ((NTSTATUS)0x102L)
+#define STATUS_PENDING ((NTSTATUS)0x103L)
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+#define STATUS_DEVICE_BUSY ((NTSTATUS)0x80000011L)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034L)
+#define STATUS_DELETE_PENDING ((NTSTATUS)0xC0000056L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_READY ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED ((NTSTATUS)0xC0000120L)
+#define STATUS_DEVICE_CONFIGURATION_ERROR ((NTSTATUS)0xC0000182L)
+#define STATUS_INVALID_DEVICE_STATE ((NTSTATUS)0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE ((NTSTATUS)0xC0000206L)
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#define STATUS_ALREADY_REGISTERED ((NTSTATUS)0xC0000718L)
+#define NT_SUCCESS(s) (((NTSTATUS)(s)) >= 0)
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+
+#define THREAD_ALL_ACCESS 0x1fffff
+#define EVENT_ALL_ACCESS 0x1F0003
+#define KEY_READ 0x20019
+#define KEY_NOTIFY 0x10
+#define OBJ_KERNEL_HANDLE 0x200
+#define REG_NOTIFY_CHANGE_LAST_SET 4
+#define IO_NO_INCREMENT 0
+#define UNICODE_NULL ((WCHAR)0)
+#define PAGE_SIZE 4096
+#define ALL_PROCESSOR_GROUPS 0xffff
+#define MAXIMUM_PROC_PER_GROUP 64
+#define FILE_DEVICE_NETWORK 0x12
+#define FILE_DEVICE_SECURE_OPEN 0x100
+#define FILE_AUTOGENERATED_DEVICE_NAME 0x80
+#define METHOD_BUFFERED 0
+#define METHOD_IN_DIRECT 1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER 3
+#define FILE_ANY_ACCESS 0
+#define FILE_READ_ACCESS 1
+#define FILE_WRITE_ACCESS 2
+#define CTL_CODE(d,f,m,a) (((d)<<16)|((a)<<14)|((f)<<2)|(m))
+#define POOL_NX_ALLOCATION 512
+#define LOOKASIDE_MINIMUM_BLOCK_SIZE 16
+#define EX_LOOKASIDE_LIST_EX_FLAGS_RAISE_ON_FAIL 1
+#define EX_LOOKASIDE_LIST_EX_FLAGS_FAIL_NO_RAISE 2
+#define MM_ALLOCATE_FULLY_REQUIRED 0x4
+#define MdlMappingNoWrite 0x80000000
+#define MdlMappingNoExecute 0x40000000
+#define NotificationTimer 0
+#define SynchronizationTimer 1
+#define THREAD_WAIT_OBJECTS 3
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define DPFLTR_IHVNETWORK_ID 0
+#define DPFLTR_ERROR_LEVEL 0
+#define DPFLTR_INFO_LEVEL 3
+#define BYTES_TO_PAGES(s) (((s)+PAGE_SIZE-1)/PAGE_SIZE)
+#define ROUND_TO_PAGES(s) (((s)+PAGE_SIZE-1)&~(PAGE_SIZE-1))
+
+#define RTL_CONSTANT_STRING(s) \
+   { sizeof(s)-sizeof((s)[0]), sizeof(s), (PWSTR)(s) }
+#define DECLARE_CONST_UNICODE_STRING(n,s) \
+   const UNICODE_STRING n = RTL_CONSTANT_STRING(s)
+#define DECLARE_UNICODE_STRING_SIZE(n,sz) \
+   WCHAR n##_buffer[sz]; UNICODE_STRING n = { 0, sz*sizeof(WCHAR), n##_buffer }
+
+typedef enum { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum { Executive } KWAIT_REASON;
+typedef enum { KernelMode, UserMode } KPROCESSOR_MODE, MODE;
+typedef enum { WaitAll, WaitAny } WAIT_TYPE;
+typedef enum { NonPagedPool, NonPagedPoolNx, PagedPool } POOL_TYPE;
+typedef enum { MmNonCached, MmCached } MEMORY_CACHING_TYPE;
+typedef enum { LowPagePriority, NormalPagePriority = 16, HighPagePriority = 32 } MM_PAGE_PRIORITY;
+typedef enum { DrvRtPoolNxOptIn = 1 } DRV_RT_POOL;
+typedef ULONG64 POOL_FLAGS;
+
+#define POOL_FLAG_NON_PAGED 0x40ULL
+#define POOL_FLAG_UNINITIALIZED 0x2ULL
+
+//
+// Interlocked operations and fenced reads and writes.
+//
+
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64 InterlockedIncrement
+#define InterlockedDecrement64 InterlockedDecrement
+#define InterlockedIncrementNoFence(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define InterlockedIncrementNoFence64 InterlockedIncrementNoFence
+#define InterlockedIncrementAcquire(p) __atomic_add_fetch((p), 1, __ATOMIC_ACQUIRE)
+#define InterlockedIncrementRelease(p) __atomic_add_fetch((p), 1, __ATOMIC_RELEASE)
+#define InterlockedAdd(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64 InterlockedAdd
+#define InterlockedAddNoFence64(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define InterlockedExchangeAdd(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64 InterlockedExchangeAdd
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64 InterlockedExchange
+#define InterlockedExchangeAcquire(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define InterlockedExchangePointer(p, v) \
+   ((PVOID)__atomic_exchange_n((PVOID volatile*)(p), (PVOID)(v), __ATOMIC_SEQ_CST))
+#define InterlockedOr(p, v) __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOrRelease(p, v) __atomic_fetch_or((p), (v), __ATOMIC_RELEASE)
+#define InterlockedAnd(p, v) __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+
+#define SHIM_COMPARE_EXCHANGE(type, name, order)                          \
+   static inline type                                                   \
+   name(                                                                \
+      volatile type* target,                                            \
+      type exchange,                                                    \
+      type comparand                                                    \
+      )                                                                 \
+   {                                                                    \
+      __atomic_compare_exchange_n(                                      \
+         target, &comparand, exchange, FALSE, order, __ATOMIC_RELAXED); \
+      return comparand;                                                 \
+   }
+
+SHIM_COMPARE_EXCHANGE(LONG, InterlockedCompareExchange, __ATOMIC_SEQ_CST)
+SHIM_COMPARE_EXCHANGE(LONG, InterlockedCompareExchangeAcquire, __ATOMIC_ACQUIRE)
+SHIM_COMPARE_EXCHANGE(LONG, InterlockedCompareExchangeRelease, __ATOMIC_RELEASE)
+SHIM_COMPARE_EXCHANGE(LONG64, InterlockedCompareExchange64, __ATOMIC_SEQ_CST)
+SHIM_COMPARE_EXCHANGE(PVOID, InterlockedCompareExchangePointer, __ATOMIC_SEQ_CST)
+
+#define ReadNoFence(p) __atomic_load_n((volatile LONG*)(p), __ATOMIC_RELAXED)
+#define ReadULongNoFence(p) __atomic_load_n((volatile ULONG*)(p), __ATOMIC_RELAXED)
+#define ReadULong64NoFence(p) __atomic_load_n((volatile ULONG64*)(p), __ATOMIC_RELAXED)
+#define ReadNoFence64(p) __atomic_load_n((volatile LONG64*)(p), __ATOMIC_RELAXED)
+#define ReadPointerNoFence(p) __atomic_load_n((PVOID volatile*)(p), __ATOMIC_RELAXED)
+#define ReadBooleanNoFence(p) __atomic_load_n((volatile BOOLEAN*)(p), __ATOMIC_RELAXED)
+#define ReadAcquire(p) __atomic_load_n((volatile LONG*)(p), __ATOMIC_ACQUIRE)
+#define ReadULongAcquire(p) __atomic_load_n((volatile ULONG*)(p), __ATOMIC_ACQUIRE)
+#define ReadULong64Acquire(p) __atomic_load_n((volatile ULONG64*)(p), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(p) __atomic_load_n((volatile LONG64*)(p), __ATOMIC_ACQUIRE)
+#define ReadPointerAcquire(p) __atomic_load_n((PVOID volatile*)(p), __ATOMIC_ACQUIRE)
+#define ReadBooleanAcquire(p) __atomic_load_n((volatile BOOLEAN*)(p), __ATOMIC_ACQUIRE)
+#define WriteNoFence(p,v) __atomic_store_n((volatile LONG*)(p), (v), __ATOMIC_RELAXED)
+#define WriteULongNoFence(p,v) __atomic_store_n((volatile ULONG*)(p), (v), __ATOMIC_RELAXED)
+#define WriteULong64NoFence(p,v) __atomic_store_n((volatile ULONG64*)(p), (v), __ATOMIC_RELAXED)
+#define WriteNoFence64(p,v) __atomic_store_n((volatile LONG64*)(p), (v), __ATOMIC_RELAXED)
+#define WritePointerNoFence(p,v) __atomic_store_n((PVOID volatile*)(p), (v), __ATOMIC_RELAXED)
+#define WriteBooleanNoFence(p,v) __atomic_store_n((volatile BOOLEAN*)(p), (v), __ATOMIC_RELAXED)
+#define WriteRelease(p,v) __atomic_store_n((volatile LONG*)(p), (v), __ATOMIC_RELEASE)
+#define WriteULongRelease(p,v) __atomic_store_n((volatile ULONG*)(p), (v), __ATOMIC_RELEASE)
+#define WriteULong64Release(p,v) __atomic_store_n((volatile ULONG64*)(p), (v), __ATOMIC_RELEASE)
+#define WriteRelease64(p,v) __atomic_store_n((volatile LONG64*)(p), (v), __ATOMIC_RELEASE)
+#define WritePointerRelease(p,v) __atomic_store_n((PVOID volatile*)(p), (v), __ATOMIC_RELEASE)
+#define WriteBooleanRelease(p,v) __atomic_store_n((volatile BOOLEAN*)(p), (v), __ATOMIC_RELEASE)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+//
+// Structured exceptions are never raised in the shim.
+//
+#define __try if (1)
+#define __except(x) else if (x)
+#define GetExceptionCode() STATUS_UNSUCCESSFUL
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define _ReadWriteBarrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define PAGED_CODE() ((void)0)
+
+//
+// A spinning thread gives way to the others, which may be running on the
+// same processor of the host.
+//
+void
+YieldProcessor(void);
+
+static inline BOOLEAN
+BitScanForward(ULONG* index, ULONG mask)
+{
+   if (mask == 0) return FALSE;
+   *index = (ULONG)__builtin_ctz(mask);
+   return TRUE;
+}
+
+static inline BOOLEAN
+BitScanReverse(ULONG* index, ULONG mask)
+{
+   if (mask == 0) return FALSE;
+   *index = 31 - (ULONG)__builtin_clz(mask);
+   return TRUE;
+}
+
+static inline BOOLEAN
+BitScanForward64(ULONG* index, ULONG64 mask)
+{
+   if (mask == 0) return FALSE;
+   *index = (ULONG)__builtin_ctzll(mask);
+   return TRUE;
+}
+
+static inline BOOLEAN
+BitScanReverse64(ULONG* index, ULONG64 mask)
+{
+   if (mask == 0) return FALSE;
+   *index = 63 - (ULONG)__builtin_clzll(mask);
+   return TRUE;
+}
+
+#define RtlNumberOfSetBits(v) ((ULONG)__builtin_popcount(v))
+#define __popcnt64(v) ((ULONG64)__builtin_popcountll(v))
+#define RtlUshortByteSwap(v) __builtin_bswap16(v)
+#define RtlUlongByteSwap(v) __builtin_bswap32(v)
+#define RtlUlonglongByteSwap(v) __builtin_bswap64(v)
+
+static inline SIZE_T
+RtlCompareMemory(const void* a, const void* b, SIZE_T length)
+{
+   SIZE_T i;
+
+   for (i = 0; (i < length) && (((const UCHAR*)a)[i] == ((const UCHAR*)b)[i]); i++)
+   {
+   }
+
+   return i;
+}
+
+#define RtlEqualMemory(a,b,l) (memcmp((a),(b),(l))==0)
+#define RtlCopyMemory(a,b,l) memcpy((a),(b),(l))
+#define RtlMoveMemory(a,b,l) memmove((a),(b),(l))
+#define RtlZeroMemory(a,l) memset((a),0,(l))
+#define RtlFillMemory(a,l,v) memset((a),(v),(l))
+
+void RtlInitUnicodeString(UNICODE_STRING* string, PCWSTR source);
+NTSTATUS RtlUnicodeStringToInteger(const UNICODE_STRING* string, ULONG base, ULONG* value);
+NTSTATUS RtlStringCbPrintfA(char* buffer, SIZE_T size, const char* format, ...);
+int _wcsicmp(PCWSTR a, PCWSTR b);
+PWSTR wcschr(PCWSTR string, WCHAR c);
+
+//
+// Doubly and singly linked lists.
+//
+
+static inline void
+InitializeListHead(LIST_ENTRY* head)
+{
+   head->Flink = head->Blink = head;
+}
+
+static inline BOOLEAN
+IsListEmpty(const LIST_ENTRY* head)
+{
+   return head->Flink == head;
+}
+
+static inline BOOLEAN
+RemoveEntryList(LIST_ENTRY* entry)
+{
+   LIST_ENTRY* flink = entry->Flink;
+   LIST_ENTRY* blink = entry->Blink;
+
+   blink->Flink = flink;
+   flink->Blink = blink;
+
+   return flink == blink;
+}
+
+static inline LIST_ENTRY*
+RemoveHeadList(LIST_ENTRY* head)
+{
+   LIST_ENTRY* entry = head->Flink;
+
+   RemoveEntryList(entry);
+
+   return entry;
+}
+
+static inline LIST_ENTRY*
+RemoveTailList(LIST_ENTRY* head)
+{
+   LIST_ENTRY* entry = head->Blink;
+
+   RemoveEntryList(entry);
+
+   return entry;
+}
+
+static inline void
+InsertTailList(LIST_ENTRY* head, LIST_ENTRY* entry)
+{
+   entry->Flink = head;
+   entry->Blink = head->Blink;
+   head->Blink->Flink = entry;
+   head->Blink = entry;
+}
+
+static inline void
+InsertHeadList(LIST_ENTRY* head, LIST_ENTRY* entry)
+{
+   entry->Flink = head->Flink;
+   entry->Blink = head;
+   head->Flink->Blink = entry;
+   head->Flink = entry;
+}
+
+static inline void
+AppendTailList(LIST_ENTRY* head, LIST_ENTRY* list)
+{
+   LIST_ENTRY* end = head->Blink;
+
+   head->Blink->Flink = list;
+   head->Blink = list->Blink;
+   list->Blink->Flink = head;
+   list->Blink = end;
+}
+
+static inline void
+PushEntryList(SINGLE_LIST_ENTRY* head, SINGLE_LIST_ENTRY* entry)
+{
+   entry->Next = head->Next;
+   head->Next = entry;
+}
+
+static inline SINGLE_LIST_ENTRY*
+PopEntryList(SINGLE_LIST_ENTRY* head)
+{
+   SINGLE_LIST_ENTRY* entry = head->Next;
+
+   if (entry != NULL)
+   {
+      head->Next = entry->Next;
+   }
+
+   return entry;
+}
+
+//
+// Processors, IRQL and spin locks.
+//
+
+typedef struct _KLOCK_QUEUE_HANDLE
+{
+   KSPIN_LOCK* Lock;
+   KIRQL OldIrql;
+} KLOCK_QUEUE_HANDLE;
+
+ULONG KeQueryActiveProcessorCountEx(USHORT group);
+ULONG KeQueryMaximumProcessorCountEx(USHORT group);
+ULONG KeGetCurrentProcessorNumberEx(PROCESSOR_NUMBER* processor);
+ULONG KeGetProcessorIndexFromNumber(PROCESSOR_NUMBER* processor);
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG index, PROCESSOR_NUMBER* processor);
+void KeSetSystemGroupAffinityThread(GROUP_AFFINITY* affinity, GROUP_AFFINITY* previous);
+void KeRevertToUserGroupAffinityThread(GROUP_AFFINITY* previous);
+
+#define KeGetCurrentProcessorNumber() KeGetCurrentProcessorNumberEx(NULL)
+#define KeGetCurrentProcessorIndex() KeGetCurrentProcessorNumberEx(NULL)
+
+KIRQL KeGetCurrentIrql(void);
+void KeRaiseIrql(KIRQL newIrql, KIRQL* oldIrql);
+void KeLowerIrql(KIRQL newIrql);
+KIRQL KeRaiseIrqlToDpcLevel(void);
+
+void ShimSpinLockAcquire(KSPIN_LOCK* lock);
+
+static inline void
+KeInitializeSpinLock(KSPIN_LOCK* lock)
+{
+   *lock = 0;
+}
+
+static inline BOOLEAN
+KeTryToAcquireSpinLockAtDpcLevel(KSPIN_LOCK* lock)
+{
+   return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void
+KeAcquireSpinLockAtDpcLevel(KSPIN_LOCK* lock)
+{
+   if (!KeTryToAcquireSpinLockAtDpcLevel(lock))
+   {
+      ShimSpinLockAcquire(lock);
+   }
+}
+
+static inline void
+KeReleaseSpinLockFromDpcLevel(KSPIN_LOCK* lock)
+{
+   __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void
+KeAcquireSpinLock(KSPIN_LOCK* lock, KIRQL* oldIrql)
+{
+   KeRaiseIrql(DISPATCH_LEVEL, oldIrql);
+   KeAcquireSpinLockAtDpcLevel(lock);
+}
+
+static inline void
+KeReleaseSpinLock(KSPIN_LOCK* lock, KIRQL oldIrql)
+{
+   KeReleaseSpinLockFromDpcLevel(lock);
+   KeLowerIrql(oldIrql);
+}
+
+static inline void
+KeAcquireInStackQueuedSpinLock(KSPIN_LOCK* lock, KLOCK_QUEUE_HANDLE* handle)
+{
+   handle->Lock = lock;
+   KeAcquireSpinLock(lock, &handle->OldIrql);
+}
+
+static inline void
+KeReleaseInStackQueuedSpinLock(KLOCK_QUEUE_HANDLE* handle)
+{
+   KeReleaseSpinLock(handle->Lock, handle->OldIrql);
+}
+
+static inline void
+KeAcquireInStackQueuedSpinLockAtDpcLevel(KSPIN_LOCK* lock, KLOCK_QUEUE_HANDLE* handle)
+{
+   handle->Lock = lock;
+   KeAcquireSpinLockAtDpcLevel(lock);
+}
+
+static inline void
+KeReleaseInStackQueuedSpinLockFromDpcLevel(KLOCK_QUEUE_HANDLE* handle)
+{
+   KeReleaseSpinLockFromDpcLevel(handle->Lock);
+}
+
+void ExAcquireSpinLockSharedAtDpcLevel(EX_SPIN_LOCK* lock);
+void ExReleaseSpinLockSharedFromDpcLevel(EX_SPIN_LOCK* lock);
+void ExAcquireSpinLockExclusiveAtDpcLevel(EX_SPIN_LOCK* lock);
+void ExReleaseSpinLockExclusiveFromDpcLevel(EX_SPIN_LOCK* lock);
+
+static inline KIRQL
+ExAcquireSpinLockShared(EX_SPIN_LOCK* lock)
+{
+   KIRQL oldIrql;
+
+   KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+   ExAcquireSpinLockSharedAtDpcLevel(lock);
+
+   return oldIrql;
+}
+
+static inline void
+ExReleaseSpinLockShared(EX_SPIN_LOCK* lock, KIRQL oldIrql)
+{
+   ExReleaseSpinLockSharedFromDpcLevel(lock);
+   KeLowerIrql(oldIrql);
+}
+
+static inline KIRQL
+ExAcquireSpinLockExclusive(EX_SPIN_LOCK* lock)
+{
+   KIRQL oldIrql;
+
+   KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+   ExAcquireSpinLockExclusiveAtDpcLevel(lock);
+
+   return oldIrql;
+}
+
+static inline void
+ExReleaseSpinLockExclusive(EX_SPIN_LOCK* lock, KIRQL oldIrql)
+{
+   ExReleaseSpinLockExclusiveFromDpcLevel(lock);
+   KeLowerIrql(oldIrql);
+}
+
+//
+// Dispatcher objects: events and threads can be waited on.
+//
+
+typedef struct _DISPATCHER_HEADER
+{
+   LONG Type;
+   volatile LONG SignalState;
+   LIST_ENTRY WaitListHead;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT
+{
+   DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KTHREAD *PKTHREAD, *PETHREAD;
+typedef struct _EPROCESS *PEPROCESS;
+
+typedef struct _KDPC KDPC, *PKDPC, *PRKDPC;
+typedef void KDEFERRED_ROUTINE(KDPC*, PVOID, PVOID, PVOID);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+struct _KDPC
+{
+   PKDEFERRED_ROUTINE DeferredRoutine;
+   PVOID DeferredContext;
+};
+
+typedef struct _KTIMER
+{
+   struct _SHIM_TIMER* Shim;
+} KTIMER, *PKTIMER;
+
+void KeInitializeEvent(KEVENT* event, EVENT_TYPE type, BOOLEAN state);
+LONG KeSetEvent(KEVENT* event, LONG increment, BOOLEAN wait);
+void KeClearEvent(KEVENT* event);
+LONG KeResetEvent(KEVENT* event);
+LONG KeReadStateEvent(KEVENT* event);
+NTSTATUS KeWaitForSingleObject(PVOID object, KWAIT_REASON reason, KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER* timeout);
+NTSTATUS KeWaitForMultipleObjects(ULONG count, PVOID* objects, WAIT_TYPE waitType, KWAIT_REASON reason, KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER* timeout, PVOID waitBlocks);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE mode, BOOLEAN alertable, LARGE_INTEGER* interval);
+
+void KeInitializeTimer(KTIMER* timer);
+void KeInitializeTimerEx(KTIMER* timer, int type);
+BOOLEAN KeSetTimer(KTIMER* timer, LARGE_INTEGER dueTime, KDPC* dpc);
+BOOLEAN KeSetTimerEx(KTIMER* timer, LARGE_INTEGER dueTime, LONG period, KDPC* dpc);
+BOOLEAN KeSetCoalescableTimer(KTIMER* timer, LARGE_INTEGER dueTime, ULONG period, ULONG tolerance, KDPC* dpc);
+BOOLEAN KeCancelTimer(KTIMER* timer);
+void KeInitializeDpc(KDPC* dpc, PKDEFERRED_ROUTINE routine, PVOID context);
+BOOLEAN KeInsertQueueDpc(KDPC* dpc, PVOID argument1, PVOID argument2);
+void KeFlushQueuedDpcs(void);
+
+ULONGLONG KeQueryInterruptTime(void);
+ULONGLONG KeQueryInterruptTimePrecise(ULONGLONG* performanceCounter);
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER* frequency);
+void KeQuerySystemTime(LARGE_INTEGER* time);
+void KeQuerySystemTimePrecise(LARGE_INTEGER* time);
+
+//
+// Threads, processes and objects.
+//
+
+typedef void KSTART_ROUTINE(PVOID);
+typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+
+typedef struct _OBJECT_ATTRIBUTES
+{
+   ULONG Attributes;
+} OBJECT_ATTRIBUTES;
+
+typedef struct _KAPC_STATE
+{
+   PVOID Process;
+} KAPC_STATE;
+
+typedef struct _IO_STATUS_BLOCK
+{
+   NTSTATUS Status;
+   ULONG_PTR Information;
+} IO_STATUS_BLOCK;
+
+typedef struct _OBJECT_TYPE* POBJECT_TYPE;
+
+extern POBJECT_TYPE* ExEventObjectType;
+
+#define InitializeObjectAttributes(a, n, attributes, r, s) \
+   ((a)->Attributes = (attributes))
+
+NTSTATUS PsCreateSystemThread(HANDLE* threadHandle, ULONG access, PVOID attributes, HANDLE process, PVOID clientId, PKSTART_ROUTINE startRoutine, PVOID startContext);
+NTSTATUS PsTerminateSystemThread(NTSTATUS status) __attribute__((noreturn));
+PKTHREAD KeGetCurrentThread(void);
+PEPROCESS PsGetCurrentProcess(void);
+HANDLE PsGetCurrentProcessId(void);
+void KeStackAttachProcess(PEPROCESS process, KAPC_STATE* state);
+void KeUnstackDetachProcess(KAPC_STATE* state);
+NTSTATUS ObReferenceObjectByHandle(HANDLE handle, ACCESS_MASK access, PVOID type, KPROCESSOR_MODE mode, PVOID* object, PVOID information);
+void ObfReferenceObject(PVOID object);
+void ObDereferenceObject(PVOID object);
+#define ObReferenceObject(o) ObfReferenceObject(o)
+NTSTATUS ZwClose(HANDLE handle);
+NTSTATUS ZwCreateEvent(HANDLE* handle, ACCESS_MASK access, OBJECT_ATTRIBUTES* attributes, EVENT_TYPE type, BOOLEAN state);
+NTSTATUS ZwNotifyChangeKey(HANDLE key, HANDLE event, PVOID apcRoutine, PVOID apcContext, IO_STATUS_BLOCK* ioStatus, ULONG filter, BOOLEAN watchTree, PVOID buffer, ULONG length, BOOLEAN asynchronous);
+
+//
+// Memory.
+//
+
+typedef struct _MDL
+{
+   struct _MDL* Next;
+   ULONG ByteCount;
+   ULONG ByteOffset;
+   PVOID MappedSystemVa;
+   USHORT MdlFlags;
+} MDL, *PMDL;
+
+typedef struct _LOOKASIDE_LIST_EX
+{
+   KSPIN_LOCK Lock;
+   SINGLE_LIST_ENTRY FreeList;
+   SIZE_T Size;
+   ULONG Depth;
+   ULONG MaximumDepth;
+   ULONG Tag;
+   volatile LONG64 TotalAllocates;
+   volatile LONG64 AllocateMisses;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX, NPAGED_LOOKASIDE_LIST;
+
+typedef struct _EX_RUNDOWN_REF_CACHE_AWARE* PEX_RUNDOWN_REF_CACHE_AWARE;
+
+typedef struct _FAST_MUTEX
+{
+   pthread_mutex_t Mutex;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+PVOID ExAllocatePoolZero(POOL_TYPE type, SIZE_T size, ULONG tag);
+PVOID ExAllocatePoolUninitialized(POOL_TYPE type, SIZE_T size, ULONG tag);
+PVOID ExAllocatePool2(POOL_FLAGS flags, SIZE_T size, ULONG tag);
+void ExFreePoolWithTag(PVOID p, ULONG tag);
+void ExFreePool(PVOID p);
+void ExInitializeDriverRuntime(ULONG flags);
+
+NTSTATUS ExInitializeLookasideListEx(LOOKASIDE_LIST_EX* lookaside, PVOID allocate, PVOID free, POOL_TYPE type, ULONG flags, SIZE_T size, ULONG tag, USHORT depth);
+void ExDeleteLookasideListEx(LOOKASIDE_LIST_EX* lookaside);
+PVOID ExAllocateFromLookasideListEx(LOOKASIDE_LIST_EX* lookaside);
+void ExFreeToLookasideListEx(LOOKASIDE_LIST_EX* lookaside, PVOID entry);
+void ExFlushLookasideListEx(LOOKASIDE_LIST_EX* lookaside);
+
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE type, ULONG tag);
+void ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE rundown);
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown);
+void ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown);
+void ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE rundown);
+
+void ExInitializeFastMutex(FAST_MUTEX* mutex);
+void ExAcquireFastMutex(FAST_MUTEX* mutex);
+void ExReleaseFastMutex(FAST_MUTEX* mutex);
+
+PMDL IoAllocateMdl(PVOID address, ULONG length, BOOLEAN secondary, BOOLEAN chargeQuota, PVOID irp);
+void IoFreeMdl(PMDL mdl);
+void MmBuildMdlForNonPagedPool(PMDL mdl);
+PVOID MmMapLockedPagesSpecifyCache(PMDL mdl, KPROCESSOR_MODE mode, MEMORY_CACHING_TYPE cache, PVOID address, ULONG bugCheck, ULONG priority);
+void MmUnmapLockedPages(PVOID address, PMDL mdl);
+PVOID MmGetSystemAddressForMdlSafe(PMDL mdl, ULONG priority);
+PMDL MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS low, PHYSICAL_ADDRESS high, PHYSICAL_ADDRESS skip, SIZE_T size, MEMORY_CACHING_TYPE cache, ULONG flags);
+void MmFreePagesFromMdl(PMDL mdl);
+
+#define MmGetMdlByteCount(m) ((m)->ByteCount)
+#define MmGetMdlByteOffset(m) ((m)->ByteOffset)
+#define MmGetMdlVirtualAddress(m) ((m)->MappedSystemVa)
+
+//
+// Debug output.
+//
+
+ULONG DbgPrint(const char* format, ...);
+ULONG DbgPrintEx(ULONG component, ULONG level, const char* format, ...);
+ULONG vDbgPrintEx(ULONG component, ULONG level, const char* format, va_list arguments);
+
+#define _snprintf snprintf
+
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef NTSTATUS DRIVER_INITIALIZE(DRIVER_OBJECT*, UNICODE_STRING*);
+typedef struct _IRP IRP, *PIRP;
+
+#endif // _SHIM_NTDDK_H_
@@ -0,0 +1,3894 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode shim of the kernel, of the callout API of WFP and of WDF, on
+   which the files of the sys folder are built and run on Linux, so that a
+   program (see replay.c) can load the driver and push packets through its
+   classify functions and worker threads:
+
+      cc -O2 -pthread -fshort-wchar -I bench/shim -iquote sys -iquote inc \
+         -o replay bench/replay.c bench/shim/shim.c sys/[A-Za-z]*.c
+
+   The driver runs on its own threads: system threads are POSIX threads,
+   and each timer gets a thread that runs its DPC. The processors are
+   virtual; each thread runs on one of them, the one its affinity was set
+   to, or one given round-robin at its creation. A thread at DISPATCH_LEVEL
+   holds its processor, so that, as in the kernel, the per-processor data
+   of the driver are only used by one thread at a time, and a spin lock is
+   never taken twice on the same processor.
+
+   The injections and the completions of pended classifies are handed to a
+   thread of the shim, which calls back the program and then completes the
+   injections, as the TCP/IP stack would.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntddk.h"
+#include "wdf.h"
+#include "fwpsk.h"
+#include "fwpmk.h"
+#include "guiddef.h"
+#include "ws2ipdef.h"
+#include "ip2string.h"
+#include "shim.h"
+
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005L)
+#define STATUS_OBJECT_TYPE_MISMATCH ((NTSTATUS)0xC0000024L)
+
+#define SHIM_MAX_PROCESSORS 64
+#define SHIM_MAX_CALLOUTS 32
+#define SHIM_MAX_REGISTRY_VALUES 64
+#define SHIM_LAYER_GUID_TAG 0x5348494d
+
+//
+// The socket headers of the host cannot be included with those of the
+// shim, which define the same structures.
+//
+#define SHIM_HOST_AF_INET 2
+#define SHIM_HOST_AF_INET6 10
+
+int inet_pton(int family, const char* string, void* address);
+const char* inet_ntop(int family, const void* address, char* string, unsigned int size);
+
+//
+// Dispatcher objects: KEVENTs, and the events and threads the driver has
+// handles to. A handle is the address of its object.
+//
+
+enum
+{
+   SHIM_NOTIFICATION_EVENT = NotificationEvent,
+   SHIM_SYNCHRONIZATION_EVENT = SynchronizationEvent,
+   SHIM_THREAD
+};
+
+typedef struct SHIM_OBJECT_
+{
+   DISPATCHER_HEADER Header;
+   volatile LONG References;
+} SHIM_OBJECT;
+
+struct _KTHREAD
+{
+   SHIM_OBJECT Object;
+   PKSTART_ROUTINE StartRoutine;
+   PVOID StartContext;
+   ULONG Processor;
+   KIRQL Irql;
+};
+
+struct _EPROCESS
+{
+   SHIM_OBJECT Object;
+};
+
+struct _EX_RUNDOWN_REF_CACHE_AWARE
+{
+   volatile LONG64 Count;
+   volatile LONG Waiting;
+};
+
+typedef struct _SHIM_TIMER
+{
+   pthread_mutex_t Lock;
+   pthread_cond_t Condition;
+   BOOLEAN Started;
+   BOOLEAN Armed;
+   UINT64 DueTime;
+   UINT64 Period;
+   KDPC* Dpc;
+} SHIM_TIMER;
+
+typedef struct SHIM_NET_BUFFER_LIST_
+{
+   NET_BUFFER_LIST NetBufferList;
+   NET_BUFFER NetBuffer;
+   ULONG MdlCount;
+   MDL Mdls[];
+} SHIM_NET_BUFFER_LIST;
+
+//
+// SHIM_WORK is an injection or a completed operation handed to the
+// completion thread.
+//
+typedef struct SHIM_WORK_
+{
+   struct SHIM_WORK_* next;
+   BOOLEAN inject;
+   FWP_DIRECTION direction;
+   NET_BUFFER_LIST* netBufferList;
+   FWPS_INJECT_COMPLETE* completionFn;
+   HANDLE context;
+} SHIM_WORK;
+
+typedef struct SHIM_CALLOUT_
+{
+   BOOLEAN registered;
+   BOOLEAN added;
+   BOOLEAN filtered;
+   UINT16 layerId;
+   GUID calloutKey;
+   FWPS_CALLOUT_CLASSIFY_FN classifyFn;
+   FWPS_FILTER filter;
+} SHIM_CALLOUT;
+
+typedef struct SHIM_REGISTRY_VALUE_
+{
+   char name[64];
+   ULONG type;
+   ULONG dword;
+   WCHAR* data;
+   ULONG length;
+} SHIM_REGISTRY_VALUE;
+
+//
+// WDF objects are SHIM_WDF_OBJECTs, followed by their context.
+//
+typedef struct SHIM_WDF_OBJECT_
+{
+   LIST_ENTRY link;
+   EVT_WDF_OBJECT_CONTEXT_CLEANUP* cleanup;
+   pthread_mutex_t lock;
+   PVOID buffer;
+   size_t bufferSize;
+   EVT_WDF_DRIVER_UNLOAD* unload;
+   DECLSPEC_ALIGN(16) UCHAR context[];
+} SHIM_WDF_OBJECT;
+
+struct WDFDEVICE_INIT
+{
+   ULONG unused;
+};
+
+struct _DRIVER_OBJECT
+{
+   ULONG unused;
+};
+
+ULONG gShimProcessorCount;
+pthread_mutex_t gShimProcessors[SHIM_MAX_PROCESSORS];
+volatile LONG gShimNextProcessor;
+__thread struct _KTHREAD* tShimThread;
+pthread_key_t gShimForeignThreadKey;
+
+pthread_mutex_t gShimDispatcherLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gShimDispatcherCondition;
+LONG gShimDpcsRunning;
+
+struct _EPROCESS gShimProcess = { { { 0, 1, { NULL, NULL } }, 1 } };
+struct _OBJECT_TYPE* gShimEventObjectType;
+POBJECT_TYPE* ExEventObjectType = &gShimEventObjectType;
+
+pthread_mutex_t gShimWorkLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gShimWorkCondition;
+SHIM_WORK* gShimWorkHead;
+SHIM_WORK* gShimWorkTail;
+LONG gShimWorkOutstanding;
+LONG gShimInjectionsOutstanding;
+
+SHIM_COMPLETE_OPERATION_FN* gShimCompleteOperation;
+SHIM_INJECT_FN* gShimInject;
+SHIM_COUNTERS gShimCounters;
+
+SHIM_CALLOUT gShimCallouts[SHIM_MAX_CALLOUTS];
+UINT64 gShimNextFilterId;
+
+SHIM_REGISTRY_VALUE gShimRegistry[SHIM_MAX_REGISTRY_VALUES];
+ULONG gShimRegistryCount;
+
+SHIM_WDF_OBJECT* gShimDriver;
+DRIVER_OBJECT gShimDriverObject;
+
+//
+// Every WDF object is parented to the driver, as it is by default in WDF,
+// and the objects the driver has not deleted are deleted with it.
+//
+LIST_ENTRY gShimWdfObjects = { &gShimWdfObjects, &gShimWdfObjects };
+pthread_mutex_t gShimWdfObjectsLock = PTHREAD_MUTEX_INITIALIZER;
+
+const UNICODE_STRING SDDL_DEVOBJ_KERNEL_ONLY = RTL_CONSTANT_STRING(L"D:P");
+const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_ALL =
+   RTL_CONSTANT_STRING(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)");
+
+//
+// The layer GUIDs of the shim carry their FWPS layer identifier.
+//
+#define SHIM_LAYER_GUID(n, id) \
+   const GUID n = { SHIM_LAYER_GUID_TAG, 0, (id), { 0, 0, 0, 0, 0, 0, 0, 0 } }
+
+SHIM_LAYER_GUID(FWPM_LAYER_INBOUND_IPPACKET_V4, FWPS_LAYER_INBOUND_IPPACKET_V4);
+SHIM_LAYER_GUID(FWPM_LAYER_INBOUND_IPPACKET_V6, FWPS_LAYER_INBOUND_IPPACKET_V6);
+SHIM_LAYER_GUID(FWPM_LAYER_OUTBOUND_IPPACKET_V4, FWPS_LAYER_OUTBOUND_IPPACKET_V4);
+SHIM_LAYER_GUID(FWPM_LAYER_OUTBOUND_IPPACKET_V6, FWPS_LAYER_OUTBOUND_IPPACKET_V6);
+SHIM_LAYER_GUID(FWPM_LAYER_INBOUND_TRANSPORT_V4, FWPS_LAYER_INBOUND_TRANSPORT_V4);
+SHIM_LAYER_GUID(FWPM_LAYER_INBOUND_TRANSPORT_V6, FWPS_LAYER_INBOUND_TRANSPORT_V6);
+SHIM_LAYER_GUID(FWPM_LAYER_OUTBOUND_TRANSPORT_V4, FWPS_LAYER_OUTBOUND_TRANSPORT_V4);
+SHIM_LAYER_GUID(FWPM_LAYER_OUTBOUND_TRANSPORT_V6, FWPS_LAYER_OUTBOUND_TRANSPORT_V6);
+SHIM_LAYER_GUID(FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWPS_LAYER_ALE_AUTH_CONNECT_V4);
+SHIM_LAYER_GUID(FWPM_LAYER_ALE_AUTH_CONNECT_V6, FWPS_LAYER_ALE_AUTH_CONNECT_V6);
+SHIM_LAYER_GUID(FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V4, FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4);
+SHIM_LAYER_GUID(FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V6, FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6);
+
+const GUID FWPM_CONDITION_IP_LOCAL_ADDRESS = { 0x5348494e, 0, 1, { 0 } };
+const GUID FWPM_CONDITION_IP_REMOTE_ADDRESS = { 0x5348494e, 0, 2, { 0 } };
+const GUID FWPM_CONDITION_IP_LOCAL_PORT = { 0x5348494e, 0, 3, { 0 } };
+const GUID FWPM_CONDITION_IP_REMOTE_PORT = { 0x5348494e, 0, 4, { 0 } };
+const GUID FWPM_CONDITION_IP_PROTOCOL = { 0x5348494e, 0, 5, { 0 } };
+
+void
+ShimAssertFailed(
+   const char* expression,
+   const char* file,
+   int line
+   )
+{
+   fprintf(stderr, "%s:%d: assertion failed: %s\n", file, line, expression);
+   abort();
+}
+
+//
+// Debug output. The format strings of the driver are those of the kernel,
+// with I64 for 64-bit integers and w for wide strings.
+//
+
+size_t
+ShimNarrow(
+   _Out_writes_(size) char* buffer,
+   _In_ size_t size,
+   _In_opt_ PCWSTR string,
+   _In_ size_t length
+   )
+{
+   size_t i;
+
+   if (string == NULL)
+   {
+      return (size_t)snprintf(buffer, size, "(null)");
+   }
+
+   for (i = 0; (i < length) && (string[i] != 0) && (i + 1 < size); i++)
+   {
+      buffer[i] = (string[i] < 0x80) ? (char)string[i] : '?';
+   }
+
+   buffer[i] = '\0';
+
+   return i;
+}
+
+void
+ShimFormat(
+   _Out_writes_(size) char* out,
+   _In_ size_t size,
+   _In_ const char* format,
+   _In_ va_list arguments
+   )
+{
+   size_t used = 0;
+   const char* next = format;
+
+   while ((*next != '\0') && (used + 1 < size))
+   {
+      char spec[32];
+      char text[512];
+      size_t length = 0;
+      BOOLEAN wide = FALSE;
+      int bits = 32;
+      int written;
+
+      if (*next != '%')
+      {
+         out[used++] = *next++;
+         continue;
+      }
+
+      spec[length++] = *next++;
+
+      if (*next == '%')
+      {
+         out[used++] = *next++;
+         continue;
+      }
+
+      while ((*next != '\0') && (strchr("-+ #0.123456789*", *next) != NULL) &&
+             (length < 16))
+      {
+         if (*next == '*')
+         {
+            length += (size_t)snprintf(spec + length, 12, "%d", va_arg(arguments, int));
+            next++;
+         }
+         else
+         {
+            spec[length++] = *next++;
+         }
+      }
+
+      if (strncmp(next, "I64", 3) == 0)
+      {
+         next += 3;
+         bits = 64;
+      }
+      else if (strncmp(next, "ll", 2) == 0)
+      {
+         next += 2;
+         bits = 64;
+      }
+      else if ((*next == 'I') || (*next == 'z') || (*next == 'l'))
+      {
+         bits = (*next == 'l') ? 32 : 64;
+         next++;
+      }
+      else if (*next == 'h')
+      {
+         next++;
+      }
+      else if (*next == 'w')
+      {
+         wide = TRUE;
+         next++;
+      }
+
+      switch (*next)
+      {
+      case 'd':
+      case 'i':
+         spec[length++] = 'l';
+         spec[length++] = 'l';
+         spec[length++] = 'd';
+         spec[length] = '\0';
+         written = snprintf(out + used, size - used, spec,
+                            (bits == 64) ? va_arg(arguments, long long) :
+                                           (long long)va_arg(arguments, int));
+         break;
+
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+         spec[length++] = 'l';
+         spec[length++] = 'l';
+         spec[length++] = *next;
+         spec[length] = '\0';
+         written = snprintf(out + used, size - used, spec,
+                            (bits == 64) ? va_arg(arguments, unsigned long long) :
+                                           (unsigned long long)va_arg(arguments, unsigned int));
+         break;
+
+      case 'c':
+         spec[length++] = 'c';
+         spec[length] = '\0';
+         written = snprintf(out + used, size - used, spec, va_arg(arguments, int));
+         break;
+
+      case 'p':
+         spec[length++] = 'p';
+         spec[length] = '\0';
+         written = snprintf(out + used, size - used, spec, va_arg(arguments, void*));
+         break;
+
+      case 'S':
+      case 's':
+         spec[length++] = 's';
+         spec[length] = '\0';
+         if (wide || (*next == 'S'))
+         {
+            ShimNarrow(text, sizeof(text), va_arg(arguments, PCWSTR), sizeof(text));
+            written = snprintf(out + used, size - used, spec, text);
+         }
+         else
+         {
+            written = snprintf(out + used, size - used, spec, va_arg(arguments, const char*));
+         }
+         break;
+
+      case 'Z':
+         {
+            const UNICODE_STRING* string = va_arg(arguments, const UNICODE_STRING*);
+
+            spec[length++] = 's';
+            spec[length] = '\0';
+            ShimNarrow(text,
+                       sizeof(text),
+                       (string != NULL) ? string->Buffer : NULL,
+                       (string != NULL) ? string->Length / sizeof(WCHAR) : 0);
+            written = snprintf(out + used, size - used, spec, text);
+         }
+         break;
+
+      default:
+         written = 0;
+         break;
+      }
+
+      if (*next != '\0')
+      {
+         next++;
+      }
+
+      if (written > 0)
+      {
+         used = min(used + (size_t)written, size - 1);
+      }
+   }
+
+   out[used] = '\0';
+}
+
+ULONG
+vDbgPrintEx(
+   ULONG component,
+   ULONG level,
+   const char* format,
+   va_list arguments
+   )
+{
+   char line[2048];
+
+   UNREFERENCED_PARAMETER(component);
+   UNREFERENCED_PARAMETER(level);
+
+   ShimFormat(line, sizeof(line), format, arguments);
+   fputs(line, stderr);
+
+   return 0;
+}
+
+ULONG
+DbgPrint(
+   const char* format,
+   ...
+   )
+{
+   va_list arguments;
+
+   va_start(arguments, format);
+   vDbgPrintEx(0, 0, format, arguments);
+   va_end(arguments);
+
+   return 0;
+}
+
+ULONG
+DbgPrintEx(
+   ULONG component,
+   ULONG level,
+   const char* format,
+   ...
+   )
+{
+   va_list arguments;
+
+   va_start(arguments, format);
+   vDbgPrintEx(component, level, format, arguments);
+   va_end(arguments);
+
+   return 0;
+}
+
+//
+// Strings and addresses.
+//
+
+void
+RtlInitUnicodeString(
+   UNICODE_STRING* string,
+   PCWSTR source
+   )
+{
+   size_t length = 0;
+
+   if (source != NULL)
+   {
+      while (source[length] != 0)
+      {
+         length++;
+      }
+   }
+
+   string->Buffer = (PWSTR)source;
+   string->Length = (USHORT)(length * sizeof(WCHAR));
+   string->MaximumLength = (USHORT)((source != NULL) ? string->Length + sizeof(WCHAR) : 0);
+}
+
+int
+_wcsicmp(
+   PCWSTR a,
+   PCWSTR b
+   )
+{
+   for (;; a++, b++)
+   {
+      int ca = ((*a < 0x80) ? tolower(*a) : *a);
+      int cb = ((*b < 0x80) ? tolower(*b) : *b);
+
+      if ((ca != cb) || (ca == 0))
+      {
+         return ca - cb;
+      }
+   }
+}
+
+PWSTR
+wcschr(
+   PCWSTR string,
+   WCHAR c
+   )
+{
+   for (;; string++)
+   {
+      if (*string == c)
+      {
+         return (PWSTR)string;
+      }
+
+      if (*string == 0)
+      {
+         return NULL;
+      }
+   }
+}
+
+NTSTATUS
+RtlUnicodeStringToInteger(
+   const UNICODE_STRING* string,
+   ULONG base,
+   ULONG* value
+   )
+{
+   char text[64];
+   char* end;
+
+   ShimNarrow(text, sizeof(text), string->Buffer, string->Length / sizeof(WCHAR));
+   *value = (ULONG)strtoul(text, &end, (int)base);
+
+   return ((end == text) || (*end != '\0')) ? STATUS_INVALID_PARAMETER : STATUS_SUCCESS;
+}
+
+NTSTATUS
+RtlStringCbPrintfA(
+   char* buffer,
+   SIZE_T size,
+   const char* format,
+   ...
+   )
+{
+   va_list arguments;
+
+   va_start(arguments, format);
+   ShimFormat(buffer, size, format, arguments);
+   va_end(arguments);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RtlIpv4StringToAddressW(
+   PCWSTR string,
+   BOOLEAN strict,
+   PWSTR* terminator,
+   IN_ADDR* address
+   )
+{
+   UCHAR bytes[4];
+   ULONG i;
+
+   UNREFERENCED_PARAMETER(strict);
+
+   for (i = 0; i < 4; i++)
+   {
+      ULONG value = 0;
+      ULONG digits = 0;
+
+      if ((i != 0) && (*string++ != L'.'))
+      {
+         return STATUS_INVALID_PARAMETER;
+      }
+
+      while ((*string >= L'0') && (*string <= L'9') && (digits < 3))
+      {
+         value = value * 10 + (*string++ - L'0');
+         digits++;
+      }
+
+      if ((digits == 0) || (value > 255))
+      {
+         return STATUS_INVALID_PARAMETER;
+      }
+
+      bytes[i] = (UCHAR)value;
+   }
+
+   if ((*string == L'.') || ((*string >= L'0') && (*string <= L'9')))
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   memcpy(address, bytes, sizeof(bytes));
+   *terminator = (PWSTR)string;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RtlIpv6StringToAddressW(
+   PCWSTR string,
+   PWSTR* terminator,
+   IN6_ADDR* address
+   )
+{
+   char text[64];
+   size_t length = 0;
+
+   while ((length + 1 < sizeof(text)) &&
+          (isxdigit(string[length] < 0x80 ? string[length] : 'g') ||
+           (string[length] == L':') || (string[length] == L'.')))
+   {
+      text[length] = (char)string[length];
+      length++;
+   }
+
+   text[length] = '\0';
+
+   if (inet_pton(SHIM_HOST_AF_INET6, text, address) != 1)
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   *terminator = (PWSTR)string + length;
+
+   return STATUS_SUCCESS;
+}
+
+PSTR
+RtlIpv4AddressToStringA(
+   const IN_ADDR* address,
+   PSTR string
+   )
+{
+   inet_ntop(SHIM_HOST_AF_INET, address, string, INET_ADDRSTRLEN);
+
+   return string + strlen(string);
+}
+
+PSTR
+RtlIpv6AddressToStringA(
+   const IN6_ADDR* address,
+   PSTR string
+   )
+{
+   inet_ntop(SHIM_HOST_AF_INET6, address, string, INET6_ADDRSTRLEN);
+
+   return string + strlen(string);
+}
+
+//
+// Time, in 100ns units.
+//
+
+UINT64
+ShimNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 10000000 + (UINT64)now.tv_nsec / 100;
+}
+
+struct timespec
+ShimDeadline(
+   _In_ UINT64 time
+   )
+{
+   struct timespec deadline;
+
+   deadline.tv_sec = (time_t)(time / 10000000);
+   deadline.tv_nsec = (long)(time % 10000000) * 100;
+
+   return deadline;
+}
+
+ULONGLONG
+KeQueryInterruptTime(void)
+{
+   return ShimNow();
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+   LARGE_INTEGER* frequency
+   )
+{
+   LARGE_INTEGER counter;
+
+   if (frequency != NULL)
+   {
+      frequency->QuadPart = 10000000;
+   }
+
+   counter.QuadPart = (LONGLONG)ShimNow();
+
+   return counter;
+}
+
+ULONGLONG
+KeQueryInterruptTimePrecise(
+   ULONGLONG* performanceCounter
+   )
+{
+   ULONGLONG now = ShimNow();
+
+   if (performanceCounter != NULL)
+   {
+      *performanceCounter = now;
+   }
+
+   return now;
+}
+
+void
+KeQuerySystemTime(
+   LARGE_INTEGER* time
+   )
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+
+   time->QuadPart = 116444736000000000LL +
+                    (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+void
+KeQuerySystemTimePrecise(
+   LARGE_INTEGER* time
+   )
+{
+   KeQuerySystemTime(time);
+}
+
+UINT64
+ShimDueTime(
+   _In_ LONGLONG dueTime
+   )
+/* ++
+
+   Returns the interrupt time of a due time of the kernel: relative if
+   negative, else an absolute system time.
+
+-- */
+{
+   LARGE_INTEGER now;
+
+   if (dueTime <= 0)
+   {
+      return ShimNow() + (UINT64)(-dueTime);
+   }
+
+   KeQuerySystemTime(&now);
+
+   return ShimNow() + ((dueTime > now.QuadPart) ? (UINT64)(dueTime - now.QuadPart) : 0);
+}
+
+//
+// Processors and IRQL.
+//
+
+void
+ShimInitialize(
+   _In_ ULONG processorCount
+   )
+{
+   static BOOLEAN initialized;
+   pthread_condattr_t attributes;
+   ULONG i;
+
+   if (initialized)
+   {
+      return;
+   }
+
+   initialized = TRUE;
+
+   if (processorCount == 0)
+   {
+      long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+      processorCount = (online > 0) ? (ULONG)online : 1;
+   }
+
+   gShimProcessorCount = min(processorCount, SHIM_MAX_PROCESSORS);
+
+   for (i = 0; i < SHIM_MAX_PROCESSORS; i++)
+   {
+      pthread_mutex_init(&gShimProcessors[i], NULL);
+   }
+
+   pthread_key_create(&gShimForeignThreadKey, ObDereferenceObject);
+
+   pthread_condattr_init(&attributes);
+   pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+   pthread_cond_init(&gShimDispatcherCondition, &attributes);
+   pthread_cond_init(&gShimWorkCondition, &attributes);
+   pthread_condattr_destroy(&attributes);
+}
+
+struct _KTHREAD*
+ShimAllocateThread(void)
+{
+   struct _KTHREAD* thread;
+
+   ShimInitialize(0);
+
+   thread = calloc(1, sizeof(*thread));
+   if (thread == NULL)
+   {
+      abort();
+   }
+
+   thread->Object.Header.Type = SHIM_THREAD;
+   thread->Object.References = 1;
+   InitializeListHead(&thread->Object.Header.WaitListHead);
+   thread->Processor =
+      (ULONG)InterlockedIncrement(&gShimNextProcessor) % gShimProcessorCount;
+   thread->Irql = PASSIVE_LEVEL;
+
+   return thread;
+}
+
+PKTHREAD
+KeGetCurrentThread(void)
+{
+   if (tShimThread == NULL)
+   {
+      //
+      // A thread the shim did not start, such as a replay thread, gets its
+      // KTHREAD on first use and drops it when the pthread exits.
+      //
+      tShimThread = ShimAllocateThread();
+      pthread_setspecific(gShimForeignThreadKey, tShimThread);
+   }
+
+   return tShimThread;
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(
+   USHORT group
+   )
+{
+   UNREFERENCED_PARAMETER(group);
+
+   ShimInitialize(0);
+
+   return gShimProcessorCount;
+}
+
+ULONG
+KeQueryMaximumProcessorCountEx(
+   USHORT group
+   )
+{
+   return KeQueryActiveProcessorCountEx(group);
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+   PROCESSOR_NUMBER* processor
+   )
+{
+   ULONG index = KeGetCurrentThread()->Processor;
+
+   if (processor != NULL)
+   {
+      processor->Group = (USHORT)(index / MAXIMUM_PROC_PER_GROUP);
+      processor->Number = (UCHAR)(index % MAXIMUM_PROC_PER_GROUP);
+      processor->Reserved = 0;
+   }
+
+   return index;
+}
+
+ULONG
+KeGetProcessorIndexFromNumber(
+   PROCESSOR_NUMBER* processor
+   )
+{
+   return (ULONG)processor->Group * MAXIMUM_PROC_PER_GROUP + processor->Number;
+}
+
+NTSTATUS
+KeGetProcessorNumberFromIndex(
+   ULONG index,
+   PROCESSOR_NUMBER* processor
+   )
+{
+   if (index >= KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS))
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   processor->Group = (USHORT)(index / MAXIMUM_PROC_PER_GROUP);
+   processor->Number = (UCHAR)(index % MAXIMUM_PROC_PER_GROUP);
+   processor->Reserved = 0;
+
+   return STATUS_SUCCESS;
+}
+
+void
+KeSetSystemGroupAffinityThread(
+   GROUP_AFFINITY* affinity,
+   GROUP_AFFINITY* previous
+   )
+{
+   struct _KTHREAD* thread = KeGetCurrentThread();
+   ULONG number;
+
+   NT_ASSERT(thread->Irql < DISPATCH_LEVEL);
+
+   if (previous != NULL)
+   {
+      memset(previous, 0, sizeof(*previous));
+      previous->Group = (USHORT)(thread->Processor / MAXIMUM_PROC_PER_GROUP);
+      previous->Mask = (KAFFINITY)1 << (thread->Processor % MAXIMUM_PROC_PER_GROUP);
+   }
+
+   if (BitScanForward64(&number, affinity->Mask))
+   {
+      thread->Processor =
+         ((ULONG)affinity->Group * MAXIMUM_PROC_PER_GROUP + number) % gShimProcessorCount;
+   }
+}
+
+void
+KeRevertToUserGroupAffinityThread(
+   GROUP_AFFINITY* previous
+   )
+{
+   KeSetSystemGroupAffinityThread(previous, NULL);
+}
+
+KIRQL
+KeGetCurrentIrql(void)
+{
+   return KeGetCurrentThread()->Irql;
+}
+
+void
+KeRaiseIrql(
+   KIRQL newIrql,
+   KIRQL* oldIrql
+   )
+{
+   struct _KTHREAD* thread = KeGetCurrentThread();
+
+   *oldIrql = thread->Irql;
+
+   NT_ASSERT(newIrql >= thread->Irql);
+
+   if ((thread->Irql < DISPATCH_LEVEL) && (newIrql >= DISPATCH_LEVEL))
+   {
+      pthread_mutex_lock(&gShimProcessors[thread->Processor]);
+   }
+
+   thread->Irql = newIrql;
+}
+
+void
+KeLowerIrql(
+   KIRQL newIrql
+   )
+{
+   struct _KTHREAD* thread = KeGetCurrentThread();
+
+   NT_ASSERT(newIrql <= thread->Irql);
+
+   if ((thread->Irql >= DISPATCH_LEVEL) && (newIrql < DISPATCH_LEVEL))
+   {
+      pthread_mutex_unlock(&gShimProcessors[thread->Processor]);
+   }
+
+   thread->Irql = newIrql;
+}
+
+KIRQL
+KeRaiseIrqlToDpcLevel(void)
+{
+   KIRQL oldIrql;
+
+   KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+   return oldIrql;
+}
+
+//
+// Spin locks. A waiting thread yields, as the thread holding the lock may
+// be running on the same processor of the host.
+//
+
+void
+YieldProcessor(void)
+{
+   sched_yield();
+}
+
+void
+ShimSpinLockAcquire(
+   KSPIN_LOCK* lock
+   )
+{
+   for (;;)
+   {
+      while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+      {
+         YieldProcessor();
+      }
+
+      if (KeTryToAcquireSpinLockAtDpcLevel(lock))
+      {
+         return;
+      }
+   }
+}
+
+#define SHIM_EXCLUSIVE ((LONG)0x40000000)
+
+void
+ExAcquireSpinLockSharedAtDpcLevel(
+   EX_SPIN_LOCK* lock
+   )
+{
+   for (;;)
+   {
+      LONG value = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+      if ((value & SHIM_EXCLUSIVE) == 0)
+      {
+         if (__atomic_compare_exchange_n(lock, &value, value + 1, FALSE,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+         {
+            return;
+         }
+      }
+      else
+      {
+         YieldProcessor();
+      }
+   }
+}
+
+void
+ExReleaseSpinLockSharedFromDpcLevel(
+   EX_SPIN_LOCK* lock
+   )
+{
+   __atomic_sub_fetch(lock, 1, __ATOMIC_RELEASE);
+}
+
+void
+ExAcquireSpinLockExclusiveAtDpcLevel(
+   EX_SPIN_LOCK* lock
+   )
+{
+   //
+   // The writer first keeps new readers out, then waits for the readers
+   // in to leave.
+   //
+   for (;;)
+   {
+      LONG value = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+      if (((value & SHIM_EXCLUSIVE) == 0) &&
+          __atomic_compare_exchange_n(lock, &value, value | SHIM_EXCLUSIVE, FALSE,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+         break;
+      }
+
+      YieldProcessor();
+   }
+
+   while (__atomic_load_n(lock, __ATOMIC_ACQUIRE) != SHIM_EXCLUSIVE)
+   {
+      YieldProcessor();
+   }
+}
+
+void
+ExReleaseSpinLockExclusiveFromDpcLevel(
+   EX_SPIN_LOCK* lock
+   )
+{
+   __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+//
+// Dispatcher objects and waits. All of them are guarded by the dispatcher
+// lock, and waiters are woken by a broadcast of its condition.
+//
+
+void
+ShimSignal(
+   _Inout_ DISPATCHER_HEADER* header,
+   _In_ LONG state
+   )
+{
+   pthread_mutex_lock(&gShimDispatcherLock);
+   header->SignalState = state;
+   pthread_cond_broadcast(&gShimDispatcherCondition);
+   pthread_mutex_unlock(&gShimDispatcherLock);
+}
+
+void
+KeInitializeEvent(
+   KEVENT* event,
+   EVENT_TYPE type,
+   BOOLEAN state
+   )
+{
+   event->Header.Type = type;
+   event->Header.SignalState = state;
+   InitializeListHead(&event->Header.WaitListHead);
+}
+
+LONG
+KeSetEvent(
+   KEVENT* event,
+   LONG increment,
+   BOOLEAN wait
+   )
+{
+   LONG previous;
+
+   UNREFERENCED_PARAMETER(increment);
+   UNREFERENCED_PARAMETER(wait);
+
+   pthread_mutex_lock(&gShimDispatcherLock);
+   previous = event->Header.SignalState;
+   event->Header.SignalState = 1;
+   pthread_cond_broadcast(&gShimDispatcherCondition);
+   pthread_mutex_unlock(&gShimDispatcherLock);
+
+   return previous;
+}
+
+void
+KeClearEvent(
+   KEVENT* event
+   )
+{
+   __atomic_store_n(&event->Header.SignalState, 0, __ATOMIC_SEQ_CST);
+}
+
+LONG
+KeResetEvent(
+   KEVENT* event
+   )
+{
+   return __atomic_exchange_n(&event->Header.SignalState, 0, __ATOMIC_SEQ_CST);
+}
+
+LONG
+KeReadStateEvent(
+   KEVENT* event
+   )
+{
+   return __atomic_load_n(&event->Header.SignalState, __ATOMIC_SEQ_CST);
+}
+
+NTSTATUS
+KeWaitForMultipleObjects(
+   ULONG count,
+   PVOID* objects,
+   WAIT_TYPE waitType,
+   KWAIT_REASON reason,
+   KPROCESSOR_MODE mode,
+   BOOLEAN alertable,
+   LARGE_INTEGER* timeout,
+   PVOID waitBlocks
+   )
+/* ++
+
+   Waits for any or all of the objects, and consumes the signal of the
+   synchronization events it was satisfied by.
+
+-- */
+{
+   NTSTATUS status = STATUS_TIMEOUT;
+   struct timespec deadline = { 0 };
+   BOOLEAN timedOut = FALSE;
+   ULONG i;
+
+   UNREFERENCED_PARAMETER(reason);
+   UNREFERENCED_PARAMETER(mode);
+   UNREFERENCED_PARAMETER(alertable);
+   UNREFERENCED_PARAMETER(waitBlocks);
+
+   NT_ASSERT((KeGetCurrentIrql() < DISPATCH_LEVEL) ||
+             ((timeout != NULL) && (timeout->QuadPart == 0)));
+
+   if (timeout != NULL)
+   {
+      deadline = ShimDeadline(ShimDueTime(timeout->QuadPart));
+   }
+
+   pthread_mutex_lock(&gShimDispatcherLock);
+
+   for (;;)
+   {
+      ULONG signalled = 0;
+
+      for (i = 0; i < count; i++)
+      {
+         DISPATCHER_HEADER* header = objects[i];
+
+         if (header->SignalState > 0)
+         {
+            if (waitType == WaitAny)
+            {
+               if (header->Type == SHIM_SYNCHRONIZATION_EVENT)
+               {
+                  header->SignalState = 0;
+               }
+
+               status = STATUS_WAIT_0 + (NTSTATUS)i;
+               goto Exit;
+            }
+
+            signalled++;
+         }
+      }
+
+      if ((waitType == WaitAll) && (signalled == count))
+      {
+         for (i = 0; i < count; i++)
+         {
+            DISPATCHER_HEADER* header = objects[i];
+
+            if (header->Type == SHIM_SYNCHRONIZATION_EVENT)
+            {
+               header->SignalState = 0;
+            }
+         }
+
+         status = STATUS_WAIT_0;
+         goto Exit;
+      }
+
+      if (timedOut)
+      {
+         status = STATUS_TIMEOUT;
+         goto Exit;
+      }
+
+      if (timeout == NULL)
+      {
+         pthread_cond_wait(&gShimDispatcherCondition, &gShimDispatcherLock);
+      }
+      else if (pthread_cond_timedwait(&gShimDispatcherCondition,
+                                      &gShimDispatcherLock,
+                                      &deadline) == ETIMEDOUT)
+      {
+         timedOut = TRUE;
+      }
+   }
+
+Exit:
+
+   pthread_mutex_unlock(&gShimDispatcherLock);
+
+   return status;
+}
+
+NTSTATUS
+KeWaitForSingleObject(
+   PVOID object,
+   KWAIT_REASON reason,
+   KPROCESSOR_MODE mode,
+   BOOLEAN alertable,
+   LARGE_INTEGER* timeout
+   )
+{
+   return KeWaitForMultipleObjects(
+             1, &object, WaitAny, reason, mode, alertable, timeout, NULL);
+}
+
+NTSTATUS
+KeDelayExecutionThread(
+   KPROCESSOR_MODE mode,
+   BOOLEAN alertable,
+   LARGE_INTEGER* interval
+   )
+{
+   struct timespec deadline = ShimDeadline(ShimDueTime(interval->QuadPart));
+
+   UNREFERENCED_PARAMETER(mode);
+   UNREFERENCED_PARAMETER(alertable);
+
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+   {
+   }
+
+   return STATUS_SUCCESS;
+}
+
+void
+ObfReferenceObject(
+   PVOID object
+   )
+{
+   InterlockedIncrement(&((SHIM_OBJECT*)object)->References);
+}
+
+void
+ObDereferenceObject(
+   PVOID object
+   )
+{
+   if (InterlockedDecrement(&((SHIM_OBJECT*)object)->References) == 0)
+   {
+      free(object);
+   }
+}
+
+NTSTATUS
+ObReferenceObjectByHandle(
+   HANDLE handle,
+   ACCESS_MASK access,
+   PVOID type,
+   KPROCESSOR_MODE mode,
+   PVOID* object,
+   PVOID information
+   )
+{
+   UNREFERENCED_PARAMETER(access);
+   UNREFERENCED_PARAMETER(type);
+   UNREFERENCED_PARAMETER(mode);
+   UNREFERENCED_PARAMETER(information);
+
+   if (handle == NULL)
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   ObfReferenceObject(handle);
+   *object = handle;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwClose(
+   HANDLE handle
+   )
+{
+   ObDereferenceObject(handle);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwCreateEvent(
+   HANDLE* handle,
+   ACCESS_MASK access,
+   OBJECT_ATTRIBUTES* attributes,
+   EVENT_TYPE type,
+   BOOLEAN state
+   )
+{
+   SHIM_OBJECT* object = calloc(1, sizeof(*object));
+
+   UNREFERENCED_PARAMETER(access);
+   UNREFERENCED_PARAMETER(attributes);
+
+   if (object == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   KeInitializeEvent((KEVENT*)&object->Header, type, state);
+   object->References = 1;
+   *handle = object;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwNotifyChangeKey(
+   HANDLE key,
+   HANDLE event,
+   PVOID apcRoutine,
+   PVOID apcContext,
+   IO_STATUS_BLOCK* ioStatus,
+   ULONG filter,
+   BOOLEAN watchTree,
+   PVOID buffer,
+   ULONG length,
+   BOOLEAN asynchronous
+   )
+{
+   //
+   // The registry of the shim does not change once the driver is loaded.
+   //
+   UNREFERENCED_PARAMETER(key);
+   UNREFERENCED_PARAMETER(event);
+   UNREFERENCED_PARAMETER(apcRoutine);
+   UNREFERENCED_PARAMETER(apcContext);
+   UNREFERENCED_PARAMETER(filter);
+   UNREFERENCED_PARAMETER(watchTree);
+   UNREFERENCED_PARAMETER(buffer);
+   UNREFERENCED_PARAMETER(length);
+   UNREFERENCED_PARAMETER(asynchronous);
+
+   ioStatus->Status = STATUS_PENDING;
+
+   return STATUS_PENDING;
+}
+
+//
+// Threads and processes.
+//
+
+void
+ShimExitThread(void)
+{
+   struct _KTHREAD* thread = tShimThread;
+
+   if (thread->Irql >= DISPATCH_LEVEL)
+   {
+      KeLowerIrql(PASSIVE_LEVEL);
+   }
+
+   ShimSignal(&thread->Object.Header, 1);
+   ObDereferenceObject(thread);
+   tShimThread = NULL;
+}
+
+void*
+ShimThreadStart(
+   void* context
+   )
+{
+   struct _KTHREAD* thread = context;
+
+   tShimThread = thread;
+
+   thread->StartRoutine(thread->StartContext);
+
+   ShimExitThread();
+
+   return NULL;
+}
+
+NTSTATUS
+PsCreateSystemThread(
+   HANDLE* threadHandle,
+   ULONG access,
+   PVOID attributes,
+   HANDLE process,
+   PVOID clientId,
+   PKSTART_ROUTINE startRoutine,
+   PVOID startContext
+   )
+{
+   struct _KTHREAD* thread = ShimAllocateThread();
+   pthread_attr_t threadAttributes;
+   pthread_t handle;
+   int error;
+
+   UNREFERENCED_PARAMETER(access);
+   UNREFERENCED_PARAMETER(attributes);
+   UNREFERENCED_PARAMETER(process);
+   UNREFERENCED_PARAMETER(clientId);
+
+   thread->StartRoutine = startRoutine;
+   thread->StartContext = startContext;
+
+   //
+   // One reference for the handle, one for the thread while it runs.
+   //
+   thread->Object.References = 2;
+
+   pthread_attr_init(&threadAttributes);
+   pthread_attr_setdetachstate(&threadAttributes, PTHREAD_CREATE_DETACHED);
+   error = pthread_create(&handle, &threadAttributes, ShimThreadStart, thread);
+   pthread_attr_destroy(&threadAttributes);
+
+   if (error != 0)
+   {
+      free(thread);
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   *threadHandle = thread;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+PsTerminateSystemThread(
+   NTSTATUS status
+   )
+{
+   UNREFERENCED_PARAMETER(status);
+
+   ShimExitThread();
+   pthread_exit(NULL);
+}
+
+PEPROCESS
+PsGetCurrentProcess(void)
+{
+   return &gShimProcess;
+}
+
+HANDLE
+PsGetCurrentProcessId(void)
+{
+   return (HANDLE)(ULONG_PTR)getpid();
+}
+
+void
+KeStackAttachProcess(
+   PEPROCESS process,
+   KAPC_STATE* state
+   )
+{
+   state->Process = process;
+}
+
+void
+KeUnstackDetachProcess(
+   KAPC_STATE* state
+   )
+{
+   state->Process = NULL;
+}
+
+//
+// Timers and DPCs. Each timer has a thread of its own that runs its DPC at
+// DISPATCH_LEVEL. A timer is never freed, as its thread may still wait on
+// it once the driver has freed the KTIMER.
+//
+
+void
+ShimTimerThread(
+   PVOID context
+   )
+{
+   SHIM_TIMER* timer = context;
+
+   pthread_mutex_lock(&timer->Lock);
+
+   for (;;)
+   {
+      KDPC* dpc;
+      KIRQL oldIrql;
+
+      if (!timer->Armed)
+      {
+         pthread_cond_wait(&timer->Condition, &timer->Lock);
+         continue;
+      }
+
+      if (ShimNow() < timer->DueTime)
+      {
+         struct timespec deadline = ShimDeadline(timer->DueTime);
+
+         pthread_cond_timedwait(&timer->Condition, &timer->Lock, &deadline);
+         continue;
+      }
+
+      dpc = timer->Dpc;
+
+      if (timer->Period != 0)
+      {
+         timer->DueTime += timer->Period;
+      }
+      else
+      {
+         timer->Armed = FALSE;
+      }
+
+      pthread_mutex_lock(&gShimDispatcherLock);
+      gShimDpcsRunning++;
+      pthread_mutex_unlock(&gShimDispatcherLock);
+
+      pthread_mutex_unlock(&timer->Lock);
+
+      if (dpc != NULL)
+      {
+         KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+         dpc->DeferredRoutine(dpc, dpc->DeferredContext, NULL, NULL);
+         KeLowerIrql(oldIrql);
+      }
+
+      pthread_mutex_lock(&gShimDispatcherLock);
+      gShimDpcsRunning--;
+      pthread_cond_broadcast(&gShimDispatcherCondition);
+      pthread_mutex_unlock(&gShimDispatcherLock);
+
+      pthread_mutex_lock(&timer->Lock);
+   }
+}
+
+void
+KeInitializeTimerEx(
+   KTIMER* timer,
+   int type
+   )
+{
+   SHIM_TIMER* shim = calloc(1, sizeof(*shim));
+   pthread_condattr_t attributes;
+
+   UNREFERENCED_PARAMETER(type);
+
+   if (shim == NULL)
+   {
+      abort();
+   }
+
+   pthread_mutex_init(&shim->Lock, NULL);
+   pthread_condattr_init(&attributes);
+   pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+   pthread_cond_init(&shim->Condition, &attributes);
+   pthread_condattr_destroy(&attributes);
+
+   timer->Shim = shim;
+}
+
+void
+KeInitializeTimer(
+   KTIMER* timer
+   )
+{
+   KeInitializeTimerEx(timer, NotificationTimer);
+}
+
+BOOLEAN
+KeSetTimerEx(
+   KTIMER* timer,
+   LARGE_INTEGER dueTime,
+   LONG period,
+   KDPC* dpc
+   )
+{
+   SHIM_TIMER* shim = timer->Shim;
+   BOOLEAN wasArmed;
+
+   pthread_mutex_lock(&shim->Lock);
+
+   if (!shim->Started)
+   {
+      HANDLE thread;
+
+      if (!NT_SUCCESS(PsCreateSystemThread(
+                         &thread, THREAD_ALL_ACCESS, NULL, NULL, NULL,
+                         ShimTimerThread, shim)))
+      {
+         abort();
+      }
+
+      ZwClose(thread);
+      shim->Started = TRUE;
+   }
+
+   wasArmed = shim->Armed;
+   shim->Armed = TRUE;
+   shim->DueTime = ShimDueTime(dueTime.QuadPart);
+   shim->Period = (UINT64)period * 10000;
+   shim->Dpc = dpc;
+
+   pthread_cond_signal(&shim->Condition);
+   pthread_mutex_unlock(&shim->Lock);
+
+   return wasArmed;
+}
+
+BOOLEAN
+KeSetTimer(
+   KTIMER* timer,
+   LARGE_INTEGER dueTime,
+   KDPC* dpc
+   )
+{
+   return KeSetTimerEx(timer, dueTime, 0, dpc);
+}
+
+BOOLEAN
+KeSetCoalescableTimer(
+   KTIMER* timer,
+   LARGE_INTEGER dueTime,
+   ULONG period,
+   ULONG tolerance,
+   KDPC* dpc
+   )
+{
+   UNREFERENCED_PARAMETER(tolerance);
+
+   return KeSetTimerEx(timer, dueTime, (LONG)period, dpc);
+}
+
+BOOLEAN
+KeCancelTimer(
+   KTIMER* timer
+   )
+{
+   SHIM_TIMER* shim = timer->Shim;
+   BOOLEAN wasArmed;
+
+   pthread_mutex_lock(&shim->Lock);
+   wasArmed = shim->Armed;
+   shim->Armed = FALSE;
+   shim->Dpc = NULL;
+   pthread_mutex_unlock(&shim->Lock);
+
+   return wasArmed;
+}
+
+void
+KeInitializeDpc(
+   KDPC* dpc,
+   PKDEFERRED_ROUTINE routine,
+   PVOID context
+   )
+{
+   dpc->DeferredRoutine = routine;
+   dpc->DeferredContext = context;
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+   KDPC* dpc,
+   PVOID argument1,
+   PVOID argument2
+   )
+{
+   KIRQL oldIrql;
+
+   KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+   dpc->DeferredRoutine(dpc, dpc->DeferredContext, argument1, argument2);
+   KeLowerIrql(oldIrql);
+
+   return TRUE;
+}
+
+void
+KeFlushQueuedDpcs(void)
+{
+   pthread_mutex_lock(&gShimDispatcherLock);
+
+   while (gShimDpcsRunning != 0)
+   {
+      pthread_cond_wait(&gShimDispatcherCondition, &gShimDispatcherLock);
+   }
+
+   pthread_mutex_unlock(&gShimDispatcherLock);
+}
+
+//
+// Memory. Pool blocks are aligned on a cache line, as the per-processor
+// data of the driver expect.
+//
+
+PVOID
+ExAllocatePoolUninitialized(
+   POOL_TYPE type,
+   SIZE_T size,
+   ULONG tag
+   )
+{
+   void* block;
+
+   UNREFERENCED_PARAMETER(type);
+   UNREFERENCED_PARAMETER(tag);
+
+   if (posix_memalign(&block, SYSTEM_CACHE_ALIGNMENT_SIZE, (size != 0) ? size : 1) != 0)
+   {
+      return NULL;
+   }
+
+   return block;
+}
+
+PVOID
+ExAllocatePoolZero(
+   POOL_TYPE type,
+   SIZE_T size,
+   ULONG tag
+   )
+{
+   PVOID block = ExAllocatePoolUninitialized(type, size, tag);
+
+   if (block != NULL)
+   {
+      memset(block, 0, size);
+   }
+
+   return block;
+}
+
+PVOID
+ExAllocatePool2(
+   POOL_FLAGS flags,
+   SIZE_T size,
+   ULONG tag
+   )
+{
+   return (flags & POOL_FLAG_UNINITIALIZED) ?
+             ExAllocatePoolUninitialized(NonPagedPoolNx, size, tag) :
+             ExAllocatePoolZero(NonPagedPoolNx, size, tag);
+}
+
+void
+ExFreePoolWithTag(
+   PVOID p,
+   ULONG tag
+   )
+{
+   UNREFERENCED_PARAMETER(tag);
+
+   free(p);
+}
+
+void
+ExFreePool(
+   PVOID p
+   )
+{
+   free(p);
+}
+
+void
+ExInitializeDriverRuntime(
+   ULONG flags
+   )
+{
+   UNREFERENCED_PARAMETER(flags);
+}
+
+NTSTATUS
+ExInitializeLookasideListEx(
+   LOOKASIDE_LIST_EX* lookaside,
+   PVOID allocate,
+   PVOID free,
+   POOL_TYPE type,
+   ULONG flags,
+   SIZE_T size,
+   ULONG tag,
+   USHORT depth
+   )
+{
+   UNREFERENCED_PARAMETER(allocate);
+   UNREFERENCED_PARAMETER(free);
+   UNREFERENCED_PARAMETER(type);
+   UNREFERENCED_PARAMETER(flags);
+
+   memset(lookaside, 0, sizeof(*lookaside));
+   lookaside->Size = max(size, sizeof(SINGLE_LIST_ENTRY));
+   lookaside->Tag = tag;
+   lookaside->MaximumDepth = (depth != 0) ? depth : 256;
+
+   return STATUS_SUCCESS;
+}
+
+void
+ExFlushLookasideListEx(
+   LOOKASIDE_LIST_EX* lookaside
+   )
+{
+   SINGLE_LIST_ENTRY* entry;
+
+   KeAcquireSpinLockAtDpcLevel(&lookaside->Lock);
+
+   while ((entry = PopEntryList(&lookaside->FreeList)) != NULL)
+   {
+      free(entry);
+   }
+
+   lookaside->Depth = 0;
+
+   KeReleaseSpinLockFromDpcLevel(&lookaside->Lock);
+}
+
+void
+ExDeleteLookasideListEx(
+   LOOKASIDE_LIST_EX* lookaside
+   )
+{
+   ExFlushLookasideListEx(lookaside);
+}
+
+PVOID
+ExAllocateFromLookasideListEx(
+   LOOKASIDE_LIST_EX* lookaside
+   )
+{
+   SINGLE_LIST_ENTRY* entry;
+
+   InterlockedIncrementNoFence64(&lookaside->TotalAllocates);
+
+   KeAcquireSpinLockAtDpcLevel(&lookaside->Lock);
+
+   entry = PopEntryList(&lookaside->FreeList);
+   if (entry != NULL)
+   {
+      lookaside->Depth--;
+   }
+
+   KeReleaseSpinLockFromDpcLevel(&lookaside->Lock);
+
+   if (entry == NULL)
+   {
+      InterlockedIncrementNoFence64(&lookaside->AllocateMisses);
+      entry = ExAllocatePoolUninitialized(NonPagedPoolNx, lookaside->Size, lookaside->Tag);
+   }
+
+   return entry;
+}
+
+void
+ExFreeToLookasideListEx(
+   LOOKASIDE_LIST_EX* lookaside,
+   PVOID entry
+   )
+{
+   KeAcquireSpinLockAtDpcLevel(&lookaside->Lock);
+
+   if (lookaside->Depth < lookaside->MaximumDepth)
+   {
+      PushEntryList(&lookaside->FreeList, entry);
+      lookaside->Depth++;
+      entry = NULL;
+   }
+
+   KeReleaseSpinLockFromDpcLevel(&lookaside->Lock);
+
+   free(entry);
+}
+
+PEX_RUNDOWN_REF_CACHE_AWARE
+ExAllocateCacheAwareRundownProtection(
+   POOL_TYPE type,
+   ULONG tag
+   )
+{
+   return ExAllocatePoolZero(type, sizeof(struct _EX_RUNDOWN_REF_CACHE_AWARE), tag);
+}
+
+void
+ExFreeCacheAwareRundownProtection(
+   PEX_RUNDOWN_REF_CACHE_AWARE rundown
+   )
+{
+   free(rundown);
+}
+
+BOOLEAN
+ExAcquireRundownProtectionCacheAware(
+   PEX_RUNDOWN_REF_CACHE_AWARE rundown
+   )
+{
+   if (__atomic_load_n(&rundown->Waiting, __ATOMIC_SEQ_CST))
+   {
+      return FALSE;
+   }
+
+   __atomic_add_fetch(&rundown->Count, 1, __ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&rundown->Waiting, __ATOMIC_SEQ_CST))
+   {
+      __atomic_sub_fetch(&rundown->Count, 1, __ATOMIC_SEQ_CST);
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void
+ExReleaseRundownProtectionCacheAware(
+   PEX_RUNDOWN_REF_CACHE_AWARE rundown
+   )
+{
+   __atomic_sub_fetch(&rundown->Count, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+ExWaitForRundownProtectionReleaseCacheAware(
+   PEX_RUNDOWN_REF_CACHE_AWARE rundown
+   )
+{
+   __atomic_store_n(&rundown->Waiting, 1, __ATOMIC_SEQ_CST);
+
+   while (__atomic_load_n(&rundown->Count, __ATOMIC_SEQ_CST) != 0)
+   {
+      YieldProcessor();
+   }
+}
+
+void
+ExInitializeFastMutex(
+   FAST_MUTEX* mutex
+   )
+{
+   pthread_mutex_init(&mutex->Mutex, NULL);
+}
+
+void
+ExAcquireFastMutex(
+   FAST_MUTEX* mutex
+   )
+{
+   pthread_mutex_lock(&mutex->Mutex);
+}
+
+void
+ExReleaseFastMutex(
+   FAST_MUTEX* mutex
+   )
+{
+   pthread_mutex_unlock(&mutex->Mutex);
+}
+
+PMDL
+IoAllocateMdl(
+   PVOID address,
+   ULONG length,
+   BOOLEAN secondary,
+   BOOLEAN chargeQuota,
+   PVOID irp
+   )
+{
+   MDL* mdl = calloc(1, sizeof(*mdl));
+
+   UNREFERENCED_PARAMETER(secondary);
+   UNREFERENCED_PARAMETER(chargeQuota);
+   UNREFERENCED_PARAMETER(irp);
+
+   if (mdl != NULL)
+   {
+      mdl->MappedSystemVa = address;
+      mdl->ByteCount = length;
+      mdl->ByteOffset = (ULONG)((ULONG_PTR)address & (PAGE_SIZE - 1));
+   }
+
+   return mdl;
+}
+
+void
+IoFreeMdl(
+   PMDL mdl
+   )
+{
+   free(mdl);
+}
+
+void
+MmBuildMdlForNonPagedPool(
+   PMDL mdl
+   )
+{
+   UNREFERENCED_PARAMETER(mdl);
+}
+
+PVOID
+MmMapLockedPagesSpecifyCache(
+   PMDL mdl,
+   KPROCESSOR_MODE mode,
+   MEMORY_CACHING_TYPE cache,
+   PVOID address,
+   ULONG bugCheck,
+   ULONG priority
+   )
+{
+   //
+   // The program and the driver share one address space.
+   //
+   UNREFERENCED_PARAMETER(mode);
+   UNREFERENCED_PARAMETER(cache);
+   UNREFERENCED_PARAMETER(address);
+   UNREFERENCED_PARAMETER(bugCheck);
+   UNREFERENCED_PARAMETER(priority);
+
+   return mdl->MappedSystemVa;
+}
+
+void
+MmUnmapLockedPages(
+   PVOID address,
+   PMDL mdl
+   )
+{
+   UNREFERENCED_PARAMETER(address);
+   UNREFERENCED_PARAMETER(mdl);
+}
+
+PVOID
+MmGetSystemAddressForMdlSafe(
+   PMDL mdl,
+   ULONG priority
+   )
+{
+   UNREFERENCED_PARAMETER(priority);
+
+   return mdl->MappedSystemVa;
+}
+
+PMDL
+MmAllocatePagesForMdlEx(
+   PHYSICAL_ADDRESS low,
+   PHYSICAL_ADDRESS high,
+   PHYSICAL_ADDRESS skip,
+   SIZE_T size,
+   MEMORY_CACHING_TYPE cache,
+   ULONG flags
+   )
+{
+   MDL* mdl;
+   void* pages;
+
+   UNREFERENCED_PARAMETER(low);
+   UNREFERENCED_PARAMETER(high);
+   UNREFERENCED_PARAMETER(skip);
+   UNREFERENCED_PARAMETER(cache);
+   UNREFERENCED_PARAMETER(flags);
+
+   if (posix_memalign(&pages, PAGE_SIZE, ROUND_TO_PAGES(size)) != 0)
+   {
+      return NULL;
+   }
+
+   memset(pages, 0, ROUND_TO_PAGES(size));
+
+   mdl = IoAllocateMdl(pages, (ULONG)size, FALSE, FALSE, NULL);
+   if (mdl == NULL)
+   {
+      free(pages);
+   }
+
+   return mdl;
+}
+
+void
+MmFreePagesFromMdl(
+   PMDL mdl
+   )
+{
+   free(mdl->MappedSystemVa);
+   mdl->MappedSystemVa = NULL;
+}
+
+//
+// Net buffer lists. Those the program allocates hold a copy of the packet,
+// split in MDLs of mdlSize bytes; clones share the MDLs of their parent.
+//
+
+void
+ShimLocateCurrentMdl(
+   _Inout_ NET_BUFFER* netBuffer
+   )
+{
+   MDL* mdl = netBuffer->MdlChain;
+   ULONG offset = netBuffer->DataOffset;
+
+   while ((mdl != NULL) && (offset >= mdl->ByteCount) && (mdl->Next != NULL))
+   {
+      offset -= mdl->ByteCount;
+      mdl = mdl->Next;
+   }
+
+   netBuffer->CurrentMdl = mdl;
+   netBuffer->CurrentMdlOffset = offset;
+}
+
+NET_BUFFER_LIST*
+ShimAllocateNetBufferList(
+   _In_reads_bytes_(length) const void* data,
+   _In_ ULONG length,
+   _In_ ULONG dataOffset,
+   _In_ ULONG mdlSize,
+   _In_opt_ PVOID context
+   )
+{
+   SHIM_NET_BUFFER_LIST* shim;
+   ULONG mdlCount;
+   UCHAR* copy;
+   ULONG i;
+
+   if ((mdlSize == 0) || (mdlSize > length))
+   {
+      mdlSize = max(length, 1);
+   }
+
+   mdlCount = max((length + mdlSize - 1) / mdlSize, 1);
+
+   shim = malloc(sizeof(*shim) + mdlCount * sizeof(MDL) + length);
+   if (shim == NULL)
+   {
+      return NULL;
+   }
+
+   memset(shim, 0, sizeof(*shim) + mdlCount * sizeof(MDL));
+   copy = (UCHAR*)&shim->Mdls[mdlCount];
+   memcpy(copy, data, length);
+
+   shim->MdlCount = mdlCount;
+
+   for (i = 0; i < mdlCount; i++)
+   {
+      shim->Mdls[i].MappedSystemVa = copy + i * mdlSize;
+      shim->Mdls[i].ByteCount = min(mdlSize, length - i * mdlSize);
+      shim->Mdls[i].Next = (i + 1 < mdlCount) ? &shim->Mdls[i + 1] : NULL;
+   }
+
+   shim->NetBuffer.MdlChain = &shim->Mdls[0];
+   shim->NetBuffer.DataOffset = min(dataOffset, length);
+   shim->NetBuffer.DataLength = length - shim->NetBuffer.DataOffset;
+   ShimLocateCurrentMdl(&shim->NetBuffer);
+
+   shim->NetBufferList.FirstNetBuffer = &shim->NetBuffer;
+   shim->NetBufferList.ShimReferences = 1;
+   shim->NetBufferList.ShimContext = context;
+
+   return &shim->NetBufferList;
+}
+
+void
+FwpsReferenceNetBufferList(
+   NET_BUFFER_LIST* netBufferList,
+   BOOLEAN intendToModify
+   )
+{
+   UNREFERENCED_PARAMETER(intendToModify);
+
+   InterlockedIncrement(&netBufferList->ShimReferences);
+}
+
+void
+FwpsDereferenceNetBufferList(
+   NET_BUFFER_LIST* netBufferList,
+   BOOLEAN dispatchLevel
+   )
+{
+   UNREFERENCED_PARAMETER(dispatchLevel);
+
+   if (InterlockedDecrement(&netBufferList->ShimReferences) == 0)
+   {
+      NT_ASSERT(netBufferList->ShimParent == NULL);
+      free(netBufferList);
+   }
+}
+
+NTSTATUS
+FwpsAllocateCloneNetBufferList(
+   NET_BUFFER_LIST* original,
+   HANDLE poolHandle,
+   HANDLE bufferPoolHandle,
+   ULONG flags,
+   NET_BUFFER_LIST** clone
+   )
+{
+   SHIM_NET_BUFFER_LIST* shim = calloc(1, sizeof(*shim));
+
+   UNREFERENCED_PARAMETER(poolHandle);
+   UNREFERENCED_PARAMETER(bufferPoolHandle);
+   UNREFERENCED_PARAMETER(flags);
+
+   if (shim == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   shim->NetBuffer = *original->FirstNetBuffer;
+   shim->NetBuffer.Next = NULL;
+   shim->NetBufferList.FirstNetBuffer = &shim->NetBuffer;
+   shim->NetBufferList.ShimReferences = 1;
+   shim->NetBufferList.ShimParent = original;
+   shim->NetBufferList.ShimContext = original->ShimContext;
+
+   FwpsReferenceNetBufferList(original, FALSE);
+   InterlockedIncrement64(&gShimCounters.clones);
+
+   *clone = &shim->NetBufferList;
+
+   return STATUS_SUCCESS;
+}
+
+void
+FwpsFreeCloneNetBufferList(
+   NET_BUFFER_LIST* clone,
+   ULONG flags
+   )
+{
+   NET_BUFFER_LIST* parent = clone->ShimParent;
+
+   UNREFERENCED_PARAMETER(flags);
+
+   NT_ASSERT(parent != NULL);
+
+   free(clone);
+   FwpsDereferenceNetBufferList(parent, FALSE);
+   InterlockedDecrement64(&gShimCounters.clones);
+}
+
+PVOID
+NdisGetDataBuffer(
+   NET_BUFFER* netBuffer,
+   ULONG bytesNeeded,
+   PVOID storage,
+   UINT alignMultiple,
+   UINT alignOffset
+   )
+{
+   MDL* mdl = netBuffer->CurrentMdl;
+   ULONG offset = netBuffer->CurrentMdlOffset;
+   UCHAR* copy = storage;
+   ULONG copied = 0;
+
+   UNREFERENCED_PARAMETER(alignMultiple);
+   UNREFERENCED_PARAMETER(alignOffset);
+
+   if ((bytesNeeded > netBuffer->DataLength) || (mdl == NULL))
+   {
+      return NULL;
+   }
+
+   if (mdl->ByteCount - offset >= bytesNeeded)
+   {
+      return (UCHAR*)mdl->MappedSystemVa + offset;
+   }
+
+   if (storage == NULL)
+   {
+      return NULL;
+   }
+
+   while ((copied < bytesNeeded) && (mdl != NULL))
+   {
+      ULONG chunk = min(mdl->ByteCount - offset, bytesNeeded - copied);
+
+      memcpy(copy + copied, (UCHAR*)mdl->MappedSystemVa + offset, chunk);
+      copied += chunk;
+      mdl = mdl->Next;
+      offset = 0;
+   }
+
+   return (copied == bytesNeeded) ? storage : NULL;
+}
+
+NDIS_STATUS
+NdisRetreatNetBufferDataStart(
+   NET_BUFFER* netBuffer,
+   ULONG dataOffsetDelta,
+   ULONG dataBackFill,
+   PVOID allocateMdlHandler
+   )
+{
+   UNREFERENCED_PARAMETER(dataBackFill);
+   UNREFERENCED_PARAMETER(allocateMdlHandler);
+
+   if (dataOffsetDelta > netBuffer->DataOffset)
+   {
+      return NDIS_STATUS_FAILURE;
+   }
+
+   netBuffer->DataOffset -= dataOffsetDelta;
+   netBuffer->DataLength += dataOffsetDelta;
+   ShimLocateCurrentMdl(netBuffer);
+
+   return NDIS_STATUS_SUCCESS;
+}
+
+void
+NdisAdvanceNetBufferDataStart(
+   NET_BUFFER* netBuffer,
+   ULONG dataOffsetDelta,
+   BOOLEAN freeMdl,
+   PVOID freeMdlHandler
+   )
+{
+   UNREFERENCED_PARAMETER(freeMdl);
+   UNREFERENCED_PARAMETER(freeMdlHandler);
+
+   NT_ASSERT(dataOffsetDelta <= netBuffer->DataLength);
+
+   netBuffer->DataOffset += dataOffsetDelta;
+   netBuffer->DataLength -= dataOffsetDelta;
+   ShimLocateCurrentMdl(netBuffer);
+}
+
+//
+// Pended classifies and injections, which the completion thread hands back
+// to the program.
+//
+
+void
+ShimQueueWork(
+   _In_ SHIM_WORK* work
+   )
+{
+   pthread_mutex_lock(&gShimWorkLock);
+
+   work->next = NULL;
+
+   if (gShimWorkTail != NULL)
+   {
+      gShimWorkTail->next = work;
+   }
+   else
+   {
+      gShimWorkHead = work;
+   }
+
+   gShimWorkTail = work;
+   gShimWorkOutstanding++;
+
+   pthread_cond_broadcast(&gShimWorkCondition);
+   pthread_mutex_unlock(&gShimWorkLock);
+}
+
+void
+ShimCompletionThread(
+   PVOID context
+   )
+{
+   UNREFERENCED_PARAMETER(context);
+
+   for (;;)
+   {
+      SHIM_WORK* work;
+
+      pthread_mutex_lock(&gShimWorkLock);
+
+      while (gShimWorkHead == NULL)
+      {
+         pthread_cond_wait(&gShimWorkCondition, &gShimWorkLock);
+      }
+
+      work = gShimWorkHead;
+      gShimWorkHead = work->next;
+      if (gShimWorkHead == NULL)
+      {
+         gShimWorkTail = NULL;
+      }
+
+      pthread_mutex_unlock(&gShimWorkLock);
+
+      if (work->inject)
+      {
+         NET_BUFFER_LIST* netBufferList;
+         KIRQL oldIrql;
+
+         KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+         for (netBufferList = work->netBufferList;
+              netBufferList != NULL;
+              netBufferList = netBufferList->Next)
+         {
+            if (gShimInject != NULL)
+            {
+               gShimInject(work->direction, netBufferList);
+            }
+         }
+
+         work->completionFn(work->context, work->netBufferList, TRUE);
+
+         KeLowerIrql(oldIrql);
+
+         InterlockedDecrement(&gShimInjectionsOutstanding);
+      }
+      else
+      {
+         if (gShimCompleteOperation != NULL)
+         {
+            gShimCompleteOperation(work->context, work->netBufferList);
+         }
+      }
+
+      free(work);
+
+      pthread_mutex_lock(&gShimWorkLock);
+      gShimWorkOutstanding--;
+      pthread_cond_broadcast(&gShimWorkCondition);
+      pthread_mutex_unlock(&gShimWorkLock);
+   }
+}
+
+void
+ShimWaitForCompletions(void)
+{
+   pthread_mutex_lock(&gShimWorkLock);
+
+   while (gShimWorkOutstanding != 0)
+   {
+      pthread_cond_wait(&gShimWorkCondition, &gShimWorkLock);
+   }
+
+   pthread_mutex_unlock(&gShimWorkLock);
+}
+
+NTSTATUS
+FwpsPendOperation(
+   HANDLE completionHandle,
+   HANDLE* completionContext
+   )
+{
+   if (completionHandle == NULL)
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   InterlockedIncrement64(&gShimCounters.pendedOperations);
+   *completionContext = completionHandle;
+
+   return STATUS_SUCCESS;
+}
+
+void
+FwpsCompleteOperation(
+   HANDLE completionContext,
+   NET_BUFFER_LIST* netBufferList
+   )
+{
+   SHIM_WORK* work = calloc(1, sizeof(*work));
+
+   if (work == NULL)
+   {
+      abort();
+   }
+
+   InterlockedIncrement64(&gShimCounters.completedOperations);
+
+   work->context = completionContext;
+   work->netBufferList = netBufferList;
+
+   ShimQueueWork(work);
+}
+
+NTSTATUS
+ShimInject(
+   _In_ FWP_DIRECTION direction,
+   _In_ NET_BUFFER_LIST* netBufferList,
+   _In_ FWPS_INJECT_COMPLETE* completionFn,
+   _In_opt_ HANDLE completionContext
+   )
+{
+   SHIM_WORK* work = calloc(1, sizeof(*work));
+   NET_BUFFER_LIST* next;
+
+   if (work == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   InterlockedIncrement64(&gShimCounters.injectCalls);
+
+   for (next = netBufferList; next != NULL; next = next->Next)
+   {
+      next->ShimInjected = TRUE;
+      next->Status = STATUS_SUCCESS;
+
+      InterlockedIncrement64(&gShimCounters.injected[direction]);
+      InterlockedAdd64(&gShimCounters.injectedBytes,
+                       (LONG64)NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(next)));
+   }
+
+   InterlockedIncrement(&gShimInjectionsOutstanding);
+
+   work->inject = TRUE;
+   work->direction = direction;
+   work->netBufferList = netBufferList;
+   work->completionFn = completionFn;
+   work->context = completionContext;
+
+   ShimQueueWork(work);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpsInjectTransportSendAsync(
+   HANDLE injectionHandle,
+   HANDLE injectionContext,
+   UINT64 endpointHandle,
+   UINT32 flags,
+   FWPS_TRANSPORT_SEND_PARAMS* sendArgs,
+   ADDRESS_FAMILY addressFamily,
+   COMPARTMENT_ID compartmentId,
+   NET_BUFFER_LIST* netBufferList,
+   FWPS_INJECT_COMPLETE* completionFn,
+   HANDLE completionContext
+   )
+{
+   UNREFERENCED_PARAMETER(injectionHandle);
+   UNREFERENCED_PARAMETER(injectionContext);
+   UNREFERENCED_PARAMETER(endpointHandle);
+   UNREFERENCED_PARAMETER(flags);
+   UNREFERENCED_PARAMETER(sendArgs);
+   UNREFERENCED_PARAMETER(addressFamily);
+   UNREFERENCED_PARAMETER(compartmentId);
+
+   return ShimInject(FWP_DIRECTION_OUTBOUND, netBufferList, completionFn, completionContext);
+}
+
+NTSTATUS
+FwpsInjectTransportReceiveAsync(
+   HANDLE injectionHandle,
+   HANDLE injectionContext,
+   void* reserved,
+   UINT32 flags,
+   ADDRESS_FAMILY addressFamily,
+   COMPARTMENT_ID compartmentId,
+   IF_INDEX interfaceIndex,
+   IF_INDEX subInterfaceIndex,
+   NET_BUFFER_LIST* netBufferList,
+   FWPS_INJECT_COMPLETE* completionFn,
+   HANDLE completionContext
+   )
+{
+   UNREFERENCED_PARAMETER(injectionHandle);
+   UNREFERENCED_PARAMETER(injectionContext);
+   UNREFERENCED_PARAMETER(reserved);
+   UNREFERENCED_PARAMETER(flags);
+   UNREFERENCED_PARAMETER(addressFamily);
+   UNREFERENCED_PARAMETER(compartmentId);
+   UNREFERENCED_PARAMETER(interfaceIndex);
+   UNREFERENCED_PARAMETER(subInterfaceIndex);
+
+   return ShimInject(FWP_DIRECTION_INBOUND, netBufferList, completionFn, completionContext);
+}
+
+FWPS_PACKET_INJECTION_STATE
+FwpsQueryPacketInjectionState(
+   HANDLE injectionHandle,
+   const NET_BUFFER_LIST* netBufferList,
+   HANDLE* injectionContext
+   )
+{
+   UNREFERENCED_PARAMETER(injectionHandle);
+
+   if (injectionContext != NULL)
+   {
+      *injectionContext = NULL;
+   }
+
+   return netBufferList->ShimInjected ? FWPS_PACKET_INJECTED_BY_SELF :
+                                        FWPS_PACKET_NOT_INJECTED;
+}
+
+NTSTATUS
+FwpsGetPacketListSecurityInformation(
+   NET_BUFFER_LIST* netBufferList,
+   UINT32 queryFlags,
+   FWPS_PACKET_LIST_INFORMATION* packetInformation
+   )
+{
+   //
+   // The replayed traffic is never protected by IPsec.
+   //
+   UNREFERENCED_PARAMETER(netBufferList);
+   UNREFERENCED_PARAMETER(queryFlags);
+
+   memset(packetInformation, 0, sizeof(*packetInformation));
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpsConstructIpHeaderForTransportPacket(
+   NET_BUFFER_LIST* netBufferList,
+   ULONG headerIncludeHeaderLength,
+   ADDRESS_FAMILY addressFamily,
+   const UCHAR* sourceAddress,
+   const UCHAR* remoteAddress,
+   UINT8 nextProtocol,
+   UINT64 endpointHandle,
+   const WSACMSGHDR* controlData,
+   ULONG controlDataLength,
+   UINT32 flags,
+   void* reserved,
+   IF_INDEX interfaceIndex,
+   IF_INDEX subInterfaceIndex
+   )
+{
+   //
+   // Only called for packets protected by IPsec, which are not replayed.
+   //
+   UNREFERENCED_PARAMETER(netBufferList);
+   UNREFERENCED_PARAMETER(headerIncludeHeaderLength);
+   UNREFERENCED_PARAMETER(addressFamily);
+   UNREFERENCED_PARAMETER(sourceAddress);
+   UNREFERENCED_PARAMETER(remoteAddress);
+   UNREFERENCED_PARAMETER(nextProtocol);
+   UNREFERENCED_PARAMETER(endpointHandle);
+   UNREFERENCED_PARAMETER(controlData);
+   UNREFERENCED_PARAMETER(controlDataLength);
+   UNREFERENCED_PARAMETER(flags);
+   UNREFERENCED_PARAMETER(reserved);
+   UNREFERENCED_PARAMETER(interfaceIndex);
+   UNREFERENCED_PARAMETER(subInterfaceIndex);
+
+   return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS
+FwpsInjectionHandleCreate(
+   ADDRESS_FAMILY addressFamily,
+   UINT32 flags,
+   HANDLE* injectionHandle
+   )
+{
+   UNREFERENCED_PARAMETER(addressFamily);
+   UNREFERENCED_PARAMETER(flags);
+
+   *injectionHandle = &gShimInjectionsOutstanding;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpsInjectionHandleDestroy(
+   HANDLE injectionHandle
+   )
+{
+   UNREFERENCED_PARAMETER(injectionHandle);
+
+   //
+   // As in WFP, the injections in progress are completed first.
+   //
+   while (ReadAcquire(&gShimInjectionsOutstanding) != 0)
+   {
+      YieldProcessor();
+   }
+
+   return STATUS_SUCCESS;
+}
+
+//
+// Callouts and filters: the classify function of a layer is the one of the
+// callout a filter of the layer was added for.
+//
+
+SHIM_CALLOUT*
+ShimFindCallout(
+   _In_ const GUID* calloutKey
+   )
+{
+   ULONG i;
+
+   for (i = 0; i < SHIM_MAX_CALLOUTS; i++)
+   {
+      if (gShimCallouts[i].registered &&
+          IsEqualGUID(&gShimCallouts[i].calloutKey, calloutKey))
+      {
+         return &gShimCallouts[i];
+      }
+   }
+
+   return NULL;
+}
+
+NTSTATUS
+FwpsCalloutRegister(
+   void* deviceObject,
+   const FWPS_CALLOUT* callout,
+   UINT32* calloutId
+   )
+{
+   ULONG i;
+
+   UNREFERENCED_PARAMETER(deviceObject);
+
+   if (ShimFindCallout(&callout->calloutKey) != NULL)
+   {
+      return STATUS_ALREADY_REGISTERED;
+   }
+
+   for (i = 0; i < SHIM_MAX_CALLOUTS; i++)
+   {
+      if (!gShimCallouts[i].registered)
+      {
+         memset(&gShimCallouts[i], 0, sizeof(gShimCallouts[i]));
+         gShimCallouts[i].calloutKey = callout->calloutKey;
+         gShimCallouts[i].classifyFn = callout->classifyFn;
+         __atomic_store_n(&gShimCallouts[i].registered, TRUE, __ATOMIC_RELEASE);
+
+         if (calloutId != NULL)
+         {
+            *calloutId = i + 1;
+         }
+
+         return STATUS_SUCCESS;
+      }
+   }
+
+   return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS
+FwpsCalloutUnregisterById(
+   UINT32 calloutId
+   )
+{
+   if ((calloutId == 0) || (calloutId > SHIM_MAX_CALLOUTS))
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   __atomic_store_n(&gShimCallouts[calloutId - 1].registered, FALSE, __ATOMIC_RELEASE);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmEngineOpen(
+   const wchar_t* serverName,
+   UINT32 authnService,
+   void* authIdentity,
+   const FWPM_SESSION0* session,
+   HANDLE* engineHandle
+   )
+{
+   UNREFERENCED_PARAMETER(serverName);
+   UNREFERENCED_PARAMETER(authnService);
+   UNREFERENCED_PARAMETER(authIdentity);
+   UNREFERENCED_PARAMETER(session);
+
+   *engineHandle = gShimCallouts;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmEngineClose(
+   HANDLE engineHandle
+   )
+{
+   UNREFERENCED_PARAMETER(engineHandle);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmTransactionBegin(
+   HANDLE engineHandle,
+   UINT32 flags
+   )
+{
+   UNREFERENCED_PARAMETER(engineHandle);
+   UNREFERENCED_PARAMETER(flags);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmTransactionCommit(
+   HANDLE engineHandle
+   )
+{
+   UNREFERENCED_PARAMETER(engineHandle);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmTransactionAbort(
+   HANDLE engineHandle
+   )
+{
+   UNREFERENCED_PARAMETER(engineHandle);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmSubLayerAdd(
+   HANDLE engineHandle,
+   const FWPM_SUBLAYER0* subLayer,
+   void* sd
+   )
+{
+   UNREFERENCED_PARAMETER(engineHandle);
+   UNREFERENCED_PARAMETER(subLayer);
+   UNREFERENCED_PARAMETER(sd);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmCalloutAdd(
+   HANDLE engineHandle,
+   const FWPM_CALLOUT0* callout,
+   void* sd,
+   UINT32* id
+   )
+{
+   SHIM_CALLOUT* shim = ShimFindCallout(&callout->calloutKey);
+
+   UNREFERENCED_PARAMETER(engineHandle);
+   UNREFERENCED_PARAMETER(sd);
+
+   if ((shim == NULL) || (callout->applicableLayer.Data1 != SHIM_LAYER_GUID_TAG))
+   {
+      return STATUS_NOT_FOUND;
+   }
+
+   shim->layerId = callout->applicableLayer.Data3;
+   shim->added = TRUE;
+
+   if (id != NULL)
+   {
+      *id = (UINT32)(shim - gShimCallouts) + 1;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FwpmFilterAdd(
+   HANDLE engineHandle,
+   const FWPM_FILTER0* filter,
+   void* sd,
+   UINT64* id
+   )
+{
+   SHIM_CALLOUT* shim = ShimFindCallout(&filter->action.calloutKey);
+
+   UNREFERENCED_PARAMETER(engineHandle);
+   UNREFERENCED_PARAMETER(sd);
+
+   if ((shim == NULL) || !shim->added)
+   {
+      return STATUS_NOT_FOUND;
+   }
+
+   shim->filter.filterId = ++gShimNextFilterId;
+   shim->filter.flags = FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT;
+   shim->filtered = TRUE;
+
+   if (id != NULL)
+   {
+      *id = shim->filter.filterId;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+SHIM_CALLOUT*
+ShimCalloutForLayer(
+   _In_ UINT16 layerId
+   )
+{
+   ULONG i;
+
+   for (i = 0; i < SHIM_MAX_CALLOUTS; i++)
+   {
+      SHIM_CALLOUT* callout = &gShimCallouts[i];
+
+      if (__atomic_load_n(&callout->registered, __ATOMIC_ACQUIRE) &&
+          callout->filtered &&
+          (callout->layerId == layerId))
+      {
+         return callout;
+      }
+   }
+
+   return NULL;
+}
+
+BOOLEAN
+ShimLayerRegistered(
+   _In_ UINT16 layerId
+   )
+{
+   return ShimCalloutForLayer(layerId) != NULL;
+}
+
+void
+ShimClassify(
+   _In_ UINT16 layerId,
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+   _Inout_opt_ void* layerData,
+   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
+   )
+/* ++
+
+   Classifies with the callout of the layer, which permits when there is
+   none. The callout is called at DISPATCH_LEVEL, as the TCP/IP stack
+   would call it.
+
+-- */
+{
+   SHIM_CALLOUT* callout = ShimCalloutForLayer(layerId);
+   KIRQL oldIrql;
+
+   memset(classifyOut, 0, sizeof(*classifyOut));
+   classifyOut->actionType = FWP_ACTION_PERMIT;
+   classifyOut->rights = FWPS_RIGHT_ACTION_WRITE;
+
+   if (callout != NULL)
+   {
+      classifyOut->filterId = callout->filter.filterId;
+
+      KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+      callout->classifyFn(inFixedValues,
+                          inMetaValues,
+                          layerData,
+                          NULL,
+                          &callout->filter,
+                          0,
+                          classifyOut);
+      KeLowerIrql(oldIrql);
+   }
+}
+
+//
+// WDF.
+//
+
+SHIM_WDF_OBJECT*
+ShimWdfCreate(
+   _In_opt_ WDF_OBJECT_ATTRIBUTES* attributes
+   )
+{
+   size_t contextSize = 0;
+   SHIM_WDF_OBJECT* object;
+
+   if (attributes != NULL)
+   {
+      if (attributes->ContextTypeInfo != NULL)
+      {
+         contextSize = attributes->ContextTypeInfo->ContextSize;
+      }
+
+      contextSize = max(contextSize, attributes->ContextSizeOverride);
+   }
+
+   object = calloc(1, sizeof(*object) + contextSize);
+   if (object == NULL)
+   {
+      return NULL;
+   }
+
+   pthread_mutex_init(&object->lock, NULL);
+
+   if (attributes != NULL)
+   {
+      object->cleanup = attributes->EvtCleanupCallback;
+   }
+
+   pthread_mutex_lock(&gShimWdfObjectsLock);
+   InsertTailList(&gShimWdfObjects, &object->link);
+   pthread_mutex_unlock(&gShimWdfObjectsLock);
+
+   return object;
+}
+
+PVOID
+ShimWdfObjectGetContext(
+   PVOID handle
+   )
+{
+   return ((SHIM_WDF_OBJECT*)handle)->context;
+}
+
+void
+WdfObjectDelete(
+   PVOID object
+   )
+{
+   SHIM_WDF_OBJECT* shim = object;
+
+   if (shim == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&gShimWdfObjectsLock);
+   RemoveEntryList(&shim->link);
+   pthread_mutex_unlock(&gShimWdfObjectsLock);
+
+   if (shim->cleanup != NULL)
+   {
+      shim->cleanup((WDFOBJECT)shim);
+   }
+
+   free(shim->buffer);
+   free(shim);
+}
+
+NTSTATUS
+WdfDriverCreate(
+   DRIVER_OBJECT* driverObject,
+   const UNICODE_STRING* registryPath,
+   WDF_OBJECT_ATTRIBUTES* attributes,
+   WDF_DRIVER_CONFIG* config,
+   WDFDRIVER* driver
+   )
+{
+   UNREFERENCED_PARAMETER(driverObject);
+   UNREFERENCED_PARAMETER(registryPath);
+
+   gShimDriver = ShimWdfCreate(attributes);
+   if (gShimDriver == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   gShimDriver->unload = config->EvtDriverUnload;
+
+   if (driver != NULL)
+   {
+      *driver = (WDFDRIVER)gShimDriver;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDriverOpenParametersRegistryKey(
+   WDFDRIVER driver,
+   ACCESS_MASK access,
+   WDF_OBJECT_ATTRIBUTES* attributes,
+   WDFKEY* key
+   )
+{
+   UNREFERENCED_PARAMETER(driver);
+   UNREFERENCED_PARAMETER(access);
+
+   *key = (WDFKEY)ShimWdfCreate(attributes);
+
+   return (*key != NULL) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+PWDFDEVICE_INIT
+WdfControlDeviceInitAllocate(
+   WDFDRIVER driver,
+   const UNICODE_STRING* sddl
+   )
+{
+   UNREFERENCED_PARAMETER(driver);
+   UNREFERENCED_PARAMETER(sddl);
+
+   return calloc(1, sizeof(struct WDFDEVICE_INIT));
+}
+
+void
+WdfDeviceInitFree(
+   PWDFDEVICE_INIT deviceInit
+   )
+{
+   free(deviceInit);
+}
+
+void
+WdfDeviceInitSetDeviceType(
+   PWDFDEVICE_INIT deviceInit,
+   ULONG type
+   )
+{
+   UNREFERENCED_PARAMETER(deviceInit);
+   UNREFERENCED_PARAMETER(type);
+}
+
+void
+WdfDeviceInitSetCharacteristics(
+   PWDFDEVICE_INIT deviceInit,
+   ULONG characteristics,
+   BOOLEAN orInValues
+   )
+{
+   UNREFERENCED_PARAMETER(deviceInit);
+   UNREFERENCED_PARAMETER(characteristics);
+   UNREFERENCED_PARAMETER(orInValues);
+}
+
+NTSTATUS
+WdfDeviceInitAssignName(
+   PWDFDEVICE_INIT deviceInit,
+   const UNICODE_STRING* name
+   )
+{
+   UNREFERENCED_PARAMETER(deviceInit);
+   UNREFERENCED_PARAMETER(name);
+
+   return STATUS_SUCCESS;
+}
+
+void
+WdfDeviceInitSetFileObjectConfig(
+   PWDFDEVICE_INIT deviceInit,
+   WDF_FILEOBJECT_CONFIG* config,
+   WDF_OBJECT_ATTRIBUTES* attributes
+   )
+{
+   UNREFERENCED_PARAMETER(deviceInit);
+   UNREFERENCED_PARAMETER(config);
+   UNREFERENCED_PARAMETER(attributes);
+}
+
+void
+WdfDeviceInitSetExclusive(
+   PWDFDEVICE_INIT deviceInit,
+   BOOLEAN exclusive
+   )
+{
+   UNREFERENCED_PARAMETER(deviceInit);
+   UNREFERENCED_PARAMETER(exclusive);
+}
+
+void
+WdfDeviceInitSetIoInCallerContextCallback(
+   PWDFDEVICE_INIT deviceInit,
+   EVT_WDF_IO_IN_CALLER_CONTEXT* callback
+   )
+{
+   UNREFERENCED_PARAMETER(deviceInit);
+   UNREFERENCED_PARAMETER(callback);
+}
+
+NTSTATUS
+WdfDeviceCreate(
+   PWDFDEVICE_INIT* deviceInit,
+   WDF_OBJECT_ATTRIBUTES* attributes,
+   WDFDEVICE* device
+   )
+{
+   *device = (WDFDEVICE)ShimWdfCreate(attributes);
+   if (*device == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   free(*deviceInit);
+   *deviceInit = NULL;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceCreateSymbolicLink(
+   WDFDEVICE device,
+   const UNICODE_STRING* name
+   )
+{
+   UNREFERENCED_PARAMETER(device);
+   UNREFERENCED_PARAMETER(name);
+
+   return STATUS_SUCCESS;
+}
+
+void
+WdfControlFinishInitializing(
+   WDFDEVICE device
+   )
+{
+   UNREFERENCED_PARAMETER(device);
+}
+
+DEVICE_OBJECT*
+WdfDeviceWdmGetDeviceObject(
+   WDFDEVICE device
+   )
+{
+   return (DEVICE_OBJECT*)device;
+}
+
+NTSTATUS
+WdfDeviceEnqueueRequest(
+   WDFDEVICE device,
+   WDFREQUEST request
+   )
+{
+   UNREFERENCED_PARAMETER(device);
+   UNREFERENCED_PARAMETER(request);
+
+   return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+//
+// No request is ever sent to the control device of the driver, so its
+// queues are always empty.
+//
+
+NTSTATUS
+WdfIoQueueCreate(
+   WDFDEVICE device,
+   WDF_IO_QUEUE_CONFIG* config,
+   WDF_OBJECT_ATTRIBUTES* attributes,
+   WDFQUEUE* queue
+   )
+{
+   WDFQUEUE created;
+
+   UNREFERENCED_PARAMETER(device);
+   UNREFERENCED_PARAMETER(config);
+
+   created = (WDFQUEUE)ShimWdfCreate(attributes);
+   if (created == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   if (queue != NULL)
+   {
+      *queue = created;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfIoQueueRetrieveNextRequest(
+   WDFQUEUE queue,
+   WDFREQUEST* request
+   )
+{
+   UNREFERENCED_PARAMETER(queue);
+
+   *request = NULL;
+
+   return STATUS_NO_MORE_ENTRIES;
+}
+
+NTSTATUS
+WdfIoQueueRetrieveRequestByFileObject(
+   WDFQUEUE queue,
+   WDFFILEOBJECT fileObject,
+   WDFREQUEST* request
+   )
+{
+   UNREFERENCED_PARAMETER(queue);
+   UNREFERENCED_PARAMETER(fileObject);
+
+   *request = NULL;
+
+   return STATUS_NO_MORE_ENTRIES;
+}
+
+NTSTATUS
+WdfRequestForwardToIoQueue(
+   WDFREQUEST request,
+   WDFQUEUE queue
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+   UNREFERENCED_PARAMETER(queue);
+
+   return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+void
+WdfRequestComplete(
+   WDFREQUEST request,
+   NTSTATUS status
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+   UNREFERENCED_PARAMETER(status);
+}
+
+void
+WdfRequestCompleteWithInformation(
+   WDFREQUEST request,
+   NTSTATUS status,
+   ULONG_PTR information
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+   UNREFERENCED_PARAMETER(status);
+   UNREFERENCED_PARAMETER(information);
+}
+
+NTSTATUS
+WdfRequestRetrieveInputBuffer(
+   WDFREQUEST request,
+   size_t minimumLength,
+   PVOID* buffer,
+   size_t* length
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+   UNREFERENCED_PARAMETER(minimumLength);
+
+   *buffer = NULL;
+   if (length != NULL)
+   {
+      *length = 0;
+   }
+
+   return STATUS_BUFFER_TOO_SMALL;
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputBuffer(
+   WDFREQUEST request,
+   size_t minimumLength,
+   PVOID* buffer,
+   size_t* length
+   )
+{
+   return WdfRequestRetrieveInputBuffer(request, minimumLength, buffer, length);
+}
+
+WDFFILEOBJECT
+WdfRequestGetFileObject(
+   WDFREQUEST request
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+
+   return NULL;
+}
+
+KPROCESSOR_MODE
+WdfRequestGetRequestorMode(
+   WDFREQUEST request
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+
+   return UserMode;
+}
+
+void
+WdfRequestGetParameters(
+   WDFREQUEST request,
+   WDF_REQUEST_PARAMETERS* parameters
+   )
+{
+   UNREFERENCED_PARAMETER(request);
+
+   WDF_REQUEST_PARAMETERS_INIT(parameters);
+}
+
+NTSTATUS
+WdfWaitLockCreate(
+   WDF_OBJECT_ATTRIBUTES* attributes,
+   WDFWAITLOCK* lock
+   )
+{
+   *lock = (WDFWAITLOCK)ShimWdfCreate(attributes);
+
+   return (*lock != NULL) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS
+WdfWaitLockAcquire(
+   WDFWAITLOCK lock,
+   LONGLONG* timeout
+   )
+{
+   if ((timeout != NULL) && (*timeout == 0))
+   {
+      return (pthread_mutex_trylock(&((SHIM_WDF_OBJECT*)lock)->lock) == 0) ?
+                STATUS_SUCCESS : STATUS_TIMEOUT;
+   }
+
+   pthread_mutex_lock(&((SHIM_WDF_OBJECT*)lock)->lock);
+
+   return STATUS_SUCCESS;
+}
+
+void
+WdfWaitLockRelease(
+   WDFWAITLOCK lock
+   )
+{
+   pthread_mutex_unlock(&((SHIM_WDF_OBJECT*)lock)->lock);
+}
+
+PVOID
+WdfMemoryGetBuffer(
+   WDFMEMORY memory,
+   size_t* bufferSize
+   )
+{
+   SHIM_WDF_OBJECT* shim = (SHIM_WDF_OBJECT*)memory;
+
+   if (bufferSize != NULL)
+   {
+      *bufferSize = shim->bufferSize;
+   }
+
+   return shim->buffer;
+}
+
+//
+// The registry: the values of the Parameters key of the driver, set by the
+// program before it loads the driver.
+//
+
+SHIM_REGISTRY_VALUE*
+ShimRegistryFind(
+   _In_ PCSTR name,
+   _In_ BOOLEAN create
+   )
+{
+   ULONG i;
+
+   for (i = 0; i < gShimRegistryCount; i++)
+   {
+      if (strcasecmp(gShimRegistry[i].name, name) == 0)
+      {
+         return &gShimRegistry[i];
+      }
+   }
+
+   if (!create || (gShimRegistryCount == SHIM_MAX_REGISTRY_VALUES))
+   {
+      return NULL;
+   }
+
+   snprintf(gShimRegistry[i].name, sizeof(gShimRegistry[i].name), "%s", name);
+   gShimRegistryCount++;
+
+   return &gShimRegistry[i];
+}
+
+SHIM_REGISTRY_VALUE*
+ShimRegistryFindUnicode(
+   _In_ const UNICODE_STRING* name
+   )
+{
+   char text[64];
+
+   ShimNarrow(text, sizeof(text), name->Buffer, name->Length / sizeof(WCHAR));
+
+   return ShimRegistryFind(text, FALSE);
+}
+
+void
+ShimRegistrySetULong(
+   _In_ PCSTR name,
+   _In_ ULONG value
+   )
+{
+   SHIM_REGISTRY_VALUE* entry = ShimRegistryFind(name, TRUE);
+
+   if (entry != NULL)
+   {
+      free(entry->data);
+      entry->data = NULL;
+      entry->length = 0;
+      entry->type = REG_DWORD;
+      entry->dword = value;
+   }
+}
+
+void
+ShimRegistryAppend(
+   _In_ PCSTR name,
+   _In_ PCSTR value,
+   _In_ ULONG type
+   )
+{
+   SHIM_REGISTRY_VALUE* entry = ShimRegistryFind(name, TRUE);
+   ULONG characters = (ULONG)strlen(value) + 1;
+   ULONG kept;
+   WCHAR* data;
+   ULONG i;
+
+   if (entry == NULL)
+   {
+      return;
+   }
+
+   //
+   // A REG_MULTI_SZ keeps the strings it has, but not its final null.
+   //
+   kept = ((type == REG_MULTI_SZ) && (entry->type == REG_MULTI_SZ) && (entry->length != 0)) ?
+             entry->length / sizeof(WCHAR) - 1 : 0;
+
+   data = malloc((kept + characters + 1) * sizeof(WCHAR));
+   if (data == NULL)
+   {
+      return;
+   }
+
+   if (kept != 0)
+   {
+      memcpy(data, entry->data, kept * sizeof(WCHAR));
+   }
+
+   for (i = 0; i < characters; i++)
+   {
+      data[kept + i] = (UCHAR)value[i];
+   }
+
+   data[kept + characters] = 0;
+
+   free(entry->data);
+   entry->data = data;
+   entry->type = type;
+   entry->length = (kept + characters + ((type == REG_MULTI_SZ) ? 1 : 0)) * sizeof(WCHAR);
+}
+
+void
+ShimRegistrySetString(
+   _In_ PCSTR name,
+   _In_ PCSTR value
+   )
+{
+   ShimRegistryAppend(name, value, REG_SZ);
+}
+
+void
+ShimRegistryAddString(
+   _In_ PCSTR name,
+   _In_ PCSTR value
+   )
+{
+   ShimRegistryAppend(name, value, REG_MULTI_SZ);
+}
+
+NTSTATUS
+WdfRegistryQueryULong(
+   WDFKEY key,
+   const UNICODE_STRING* valueName,
+   ULONG* value
+   )
+{
+   SHIM_REGISTRY_VALUE* entry = ShimRegistryFindUnicode(valueName);
+
+   UNREFERENCED_PARAMETER(key);
+
+   if (entry == NULL)
+   {
+      return STATUS_OBJECT_NAME_NOT_FOUND;
+   }
+
+   if (entry->type != REG_DWORD)
+   {
+      return STATUS_OBJECT_TYPE_MISMATCH;
+   }
+
+   *value = entry->dword;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRegistryQueryUnicodeString(
+   WDFKEY key,
+   const UNICODE_STRING* valueName,
+   USHORT* valueByteLength,
+   UNICODE_STRING* value
+   )
+{
+   SHIM_REGISTRY_VALUE* entry = ShimRegistryFindUnicode(valueName);
+   ULONG length;
+
+   UNREFERENCED_PARAMETER(key);
+
+   if (entry == NULL)
+   {
+      return STATUS_OBJECT_NAME_NOT_FOUND;
+   }
+
+   if (entry->type != REG_SZ)
+   {
+      return STATUS_OBJECT_TYPE_MISMATCH;
+   }
+
+   length = entry->length - sizeof(WCHAR);
+
+   if (valueByteLength != NULL)
+   {
+      *valueByteLength = (USHORT)length;
+   }
+
+   if ((value == NULL) || (value->MaximumLength < length))
+   {
+      return STATUS_BUFFER_OVERFLOW;
+   }
+
+   memcpy(value->Buffer, entry->data, length);
+   value->Length = (USHORT)length;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRegistryQueryMemory(
+   WDFKEY key,
+   const UNICODE_STRING* valueName,
+   POOL_TYPE poolType,
+   WDF_OBJECT_ATTRIBUTES* attributes,
+   WDFMEMORY* memory,
+   ULONG* valueType
+   )
+{
+   SHIM_REGISTRY_VALUE* entry = ShimRegistryFindUnicode(valueName);
+   SHIM_WDF_OBJECT* object;
+   size_t length;
+
+   UNREFERENCED_PARAMETER(key);
+   UNREFERENCED_PARAMETER(poolType);
+
+   if (entry == NULL)
+   {
+      return STATUS_OBJECT_NAME_NOT_FOUND;
+   }
+
+   object = ShimWdfCreate(attributes);
+   if (object == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   length = (entry->type == REG_DWORD) ? sizeof(ULONG) : entry->length;
+
+   object->buffer = malloc(max(length, 1));
+   if (object->buffer == NULL)
+   {
+      free(object);
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   memcpy(object->buffer, (entry->type == REG_DWORD) ? (void*)&entry->dword : entry->data, length);
+   object->bufferSize = length;
+
+   *memory = (WDFMEMORY)object;
+
+   if (valueType != NULL)
+   {
+      *valueType = entry->type;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+HANDLE
+WdfRegistryWdmGetHandle(
+   WDFKEY key
+   )
+{
+   return key;
+}
+
+void
+WdfRegistryClose(
+   WDFKEY key
+   )
+{
+   WdfObjectDelete(key);
+}
+
+//
+// Loading and unloading the driver.
+//
+
+void
+ShimSetCallbacks(
+   _In_opt_ SHIM_COMPLETE_OPERATION_FN* completeOperation,
+   _In_opt_ SHIM_INJECT_FN* inject
+   )
+{
+   gShimCompleteOperation = completeOperation;
+   gShimInject = inject;
+}
+
+NTSTATUS
+ShimLoadDriver(
+   _In_ DRIVER_INITIALIZE* driverEntry
+   )
+{
+   static BOOLEAN completionThreadStarted;
+   UNICODE_STRING registryPath;
+
+   ShimInitialize(0);
+
+   if (!completionThreadStarted)
+   {
+      HANDLE thread;
+      NTSTATUS status = PsCreateSystemThread(
+                           &thread, THREAD_ALL_ACCESS, NULL, NULL, NULL,
+                           ShimCompletionThread, NULL);
+
+      if (!NT_SUCCESS(status))
+      {
+         return status;
+      }
+
+      ZwClose(thread);
+      completionThreadStarted = TRUE;
+   }
+
+   RtlInitUnicodeString(
+      &registryPath,
+      L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\Inspect");
+
+   return driverEntry(&gShimDriverObject, &registryPath);
+}
+
+void
+ShimUnloadDriver(void)
+{
+   if ((gShimDriver != NULL) && (gShimDriver->unload != NULL))
+   {
+      gShimDriver->unload((WDFDRIVER)gShimDriver);
+   }
+
+   ShimWaitForCompletions();
+
+   for (;;)
+   {
+      SHIM_WDF_OBJECT* object = NULL;
+
+      pthread_mutex_lock(&gShimWdfObjectsLock);
+      if (gShimWdfObjects.Blink != &gShimWdfObjects)
+      {
+         object = CONTAINING_RECORD(gShimWdfObjects.Blink, SHIM_WDF_OBJECT, link);
+      }
+      pthread_mutex_unlock(&gShimWdfObjectsLock);
+
+      if ((object == NULL) || (object == gShimDriver))
+      {
+         break;
+      }
+
+      WdfObjectDelete(object);
+   }
+
+   WdfObjectDelete(gShimDriver);
+   gShimDriver = NULL;
+}
+
+void
+ShimQueryCounters(
+   _Out_ SHIM_COUNTERS* counters
+   )
+{
+   ULONG i;
+
+   counters->injectCalls = ReadNoFence64(&gShimCounters.injectCalls);
+   for (i = 0; i < FWP_DIRECTION_MAX; i++)
+   {
+      counters->injected[i] = ReadNoFence64(&gShimCounters.injected[i]);
+   }
+   counters->injectedBytes = ReadNoFence64(&gShimCounters.injectedBytes);
+   counters->pendedOperations = ReadNoFence64(&gShimCounters.pendedOperations);
+   counters->completedOperations = ReadNoFence64(&gShimCounters.completedOperations);
+   counters->clones = ReadNoFence64(&gShimCounters.clones);
+}
@@ -0,0 +1,136 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares what the user-mode shim of the kernel, WFP
+   and WDF (see shim.c) offers to the programs that load the driver in it:
+   the registry the driver reads its parameters from, the loading and the
+   unloading of the driver, the classify of a packet by the callout
+   registered at a layer, the net buffer lists the packets are indicated
+   in, and the counters of what the driver injected.
+
+   The operations the driver completes and the clones it injects are
+   handed back to the program on a thread of the shim, the way the TCP/IP
+   stack would later continue a pended classify or send an injected packet.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_H_
+#define _SHIM_H_
+
+#include "ntddk.h"
+#include "wdf.h"
+#include "fwpsk.h"
+
+//
+// SHIM_COMPLETE_OPERATION_FN is called, at PASSIVE_LEVEL, for each
+// FwpsCompleteOperation of the driver, with the completion handle the
+// classify was pended with and the net buffer list it was completed with,
+// if any.
+//
+typedef void SHIM_COMPLETE_OPERATION_FN(
+   _In_ HANDLE completionHandle,
+   _In_opt_ NET_BUFFER_LIST* netBufferList
+   );
+
+//
+// SHIM_INJECT_FN is called, at DISPATCH_LEVEL, for each net buffer list the
+// driver injects, before its injection is completed.
+//
+typedef void SHIM_INJECT_FN(
+   _In_ FWP_DIRECTION direction,
+   _In_ NET_BUFFER_LIST* netBufferList
+   );
+
+//
+// SHIM_COUNTERS counts the injections of the driver: injectCalls the calls
+// to FwpsInjectTransportSendAsync and FwpsInjectTransportReceiveAsync,
+// injected the net buffer lists they carried, by direction, and bytes their
+// data. completedOperations counts the pended classifies completed, and
+// clones the clones allocated and not yet freed.
+//
+typedef struct SHIM_COUNTERS_
+{
+   LONG64 injectCalls;
+   LONG64 injected[FWP_DIRECTION_MAX];
+   LONG64 injectedBytes;
+   LONG64 pendedOperations;
+   LONG64 completedOperations;
+   LONG64 clones;
+} SHIM_COUNTERS;
+
+void
+ShimInitialize(
+   _In_ ULONG processorCount
+   );
+
+void
+ShimRegistrySetULong(
+   _In_ PCSTR name,
+   _In_ ULONG value
+   );
+
+void
+ShimRegistrySetString(
+   _In_ PCSTR name,
+   _In_ PCSTR value
+   );
+
+void
+ShimRegistryAddString(
+   _In_ PCSTR name,
+   _In_ PCSTR value
+   );
+
+void
+ShimSetCallbacks(
+   _In_opt_ SHIM_COMPLETE_OPERATION_FN* completeOperation,
+   _In_opt_ SHIM_INJECT_FN* inject
+   );
+
+NTSTATUS
+ShimLoadDriver(
+   _In_ DRIVER_INITIALIZE* driverEntry
+   );
+
+void
+ShimUnloadDriver(void);
+
+BOOLEAN
+ShimLayerRegistered(
+   _In_ UINT16 layerId
+   );
+
+void
+ShimClassify(
+   _In_ UINT16 layerId,
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+   _Inout_opt_ void* layerData,
+   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
+   );
+
+NET_BUFFER_LIST*
+ShimAllocateNetBufferList(
+   _In_reads_bytes_(length) const void* data,
+   _In_ ULONG length,
+   _In_ ULONG dataOffset,
+   _In_ ULONG mdlSize,
+   _In_opt_ PVOID context
+   );
+
+void
+ShimWaitForCompletions(void);
+
+void
+ShimQueryCounters(
+   _Out_ SHIM_COUNTERS* counters
+   );
+
+#endif // _SHIM_H_
@@ -0,0 +1,249 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the header of the Kernel-Mode Driver Framework,
+   with which the files of the sys folder are built on Linux (see shim.c).
+
+   The framework objects are blocks of the shim, each with a context area
+   for WDF_DECLARE_CONTEXT_TYPE_WITH_NAME. The registry is a table in
+   memory that the replay fills in before it loads the driver. No I/O
+   requests are ever sent to the control device.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_WDF_H_
+#define _SHIM_WDF_H_
+
+#include "ntddk.h"
+
+typedef struct WDFDRIVER__* WDFDRIVER;
+typedef struct WDFDEVICE__* WDFDEVICE;
+typedef struct WDFKEY__* WDFKEY;
+typedef struct WDFQUEUE__* WDFQUEUE;
+typedef struct WDFREQUEST__* WDFREQUEST;
+typedef struct WDFFILEOBJECT__* WDFFILEOBJECT;
+typedef struct WDFMEMORY__* WDFMEMORY;
+typedef struct WDFOBJECT__* WDFOBJECT;
+typedef struct WDFWAITLOCK__* WDFWAITLOCK;
+typedef struct WDFDEVICE_INIT* PWDFDEVICE_INIT;
+
+#define WDF_NO_EVENT_CALLBACK NULL
+#define WDF_NO_OBJECT_ATTRIBUTES NULL
+#define WDF_NO_HANDLE NULL
+#define WdfDriverInitNonPnpDriver 1
+
+typedef void EVT_WDF_DRIVER_UNLOAD(WDFDRIVER driver);
+typedef void EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE queue, WDFREQUEST request, size_t outputBufferLength, size_t inputBufferLength, ULONG ioControlCode);
+typedef void EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE(WDFQUEUE queue, WDFREQUEST request);
+typedef void EVT_WDF_DEVICE_FILE_CREATE(WDFDEVICE device, WDFREQUEST request, WDFFILEOBJECT fileObject);
+typedef void EVT_WDF_FILE_CLOSE(WDFFILEOBJECT fileObject);
+typedef void EVT_WDF_FILE_CLEANUP(WDFFILEOBJECT fileObject);
+typedef void EVT_WDF_IO_IN_CALLER_CONTEXT(WDFDEVICE device, WDFREQUEST request);
+typedef void EVT_WDF_OBJECT_CONTEXT_CLEANUP(WDFOBJECT object);
+
+typedef struct _WDF_DRIVER_CONFIG
+{
+   ULONG Size;
+   PVOID EvtDriverDeviceAdd;
+   EVT_WDF_DRIVER_UNLOAD* EvtDriverUnload;
+   ULONG DriverInitFlags;
+} WDF_DRIVER_CONFIG;
+
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE
+{
+   WdfIoQueueDispatchSequential = 1,
+   WdfIoQueueDispatchParallel,
+   WdfIoQueueDispatchManual
+} WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef enum _WDF_TRI_STATE
+{
+   WdfFalse,
+   WdfTrue,
+   WdfUseDefault
+} WDF_TRI_STATE;
+
+typedef struct _WDF_IO_QUEUE_CONFIG
+{
+   ULONG Size;
+   WDF_IO_QUEUE_DISPATCH_TYPE DispatchType;
+   WDF_TRI_STATE PowerManaged;
+   BOOLEAN DefaultQueue;
+   EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL* EvtIoDeviceControl;
+   EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE* EvtIoCanceledOnQueue;
+} WDF_IO_QUEUE_CONFIG;
+
+typedef struct _WDF_FILEOBJECT_CONFIG
+{
+   ULONG Size;
+   EVT_WDF_DEVICE_FILE_CREATE* EvtDeviceFileCreate;
+   EVT_WDF_FILE_CLOSE* EvtFileClose;
+   EVT_WDF_FILE_CLEANUP* EvtFileCleanup;
+} WDF_FILEOBJECT_CONFIG;
+
+typedef struct _WDF_OBJECT_CONTEXT_TYPE_INFO
+{
+   const char* ContextName;
+   size_t ContextSize;
+} WDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES
+{
+   ULONG Size;
+   EVT_WDF_OBJECT_CONTEXT_CLEANUP* EvtCleanupCallback;
+   PVOID EvtDestroyCallback;
+   ULONG ExecutionLevel;
+   ULONG SynchronizationScope;
+   WDFOBJECT ParentObject;
+   size_t ContextSizeOverride;
+   const WDF_OBJECT_CONTEXT_TYPE_INFO* ContextTypeInfo;
+} WDF_OBJECT_ATTRIBUTES;
+
+typedef enum _WDF_REQUEST_TYPE
+{
+   WdfRequestTypeCreate,
+   WdfRequestTypeDeviceControl = 14
+} WDF_REQUEST_TYPE;
+
+typedef struct _WDF_REQUEST_PARAMETERS
+{
+   USHORT Size;
+   UCHAR MinorFunction;
+   WDF_REQUEST_TYPE Type;
+   union
+   {
+      struct
+      {
+         size_t OutputBufferLength;
+         size_t InputBufferLength;
+         ULONG IoControlCode;
+         PVOID Type3InputBuffer;
+      } DeviceIoControl;
+   } Parameters;
+} WDF_REQUEST_PARAMETERS;
+
+static inline void
+WDF_DRIVER_CONFIG_INIT(WDF_DRIVER_CONFIG* config, PVOID deviceAdd)
+{
+   memset(config, 0, sizeof(*config));
+   config->Size = sizeof(*config);
+   config->EvtDriverDeviceAdd = deviceAdd;
+}
+
+static inline void
+WDF_IO_QUEUE_CONFIG_INIT(WDF_IO_QUEUE_CONFIG* config, WDF_IO_QUEUE_DISPATCH_TYPE type)
+{
+   memset(config, 0, sizeof(*config));
+   config->Size = sizeof(*config);
+   config->DispatchType = type;
+   config->PowerManaged = WdfUseDefault;
+}
+
+static inline void
+WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(WDF_IO_QUEUE_CONFIG* config, WDF_IO_QUEUE_DISPATCH_TYPE type)
+{
+   WDF_IO_QUEUE_CONFIG_INIT(config, type);
+   config->DefaultQueue = TRUE;
+}
+
+static inline void
+WDF_FILEOBJECT_CONFIG_INIT(
+   WDF_FILEOBJECT_CONFIG* config,
+   EVT_WDF_DEVICE_FILE_CREATE* create,
+   EVT_WDF_FILE_CLOSE* close,
+   EVT_WDF_FILE_CLEANUP* cleanup
+   )
+{
+   memset(config, 0, sizeof(*config));
+   config->Size = sizeof(*config);
+   config->EvtDeviceFileCreate = create;
+   config->EvtFileClose = close;
+   config->EvtFileCleanup = cleanup;
+}
+
+static inline void
+WDF_OBJECT_ATTRIBUTES_INIT(WDF_OBJECT_ATTRIBUTES* attributes)
+{
+   memset(attributes, 0, sizeof(*attributes));
+   attributes->Size = sizeof(*attributes);
+}
+
+static inline void
+WDF_REQUEST_PARAMETERS_INIT(WDF_REQUEST_PARAMETERS* parameters)
+{
+   memset(parameters, 0, sizeof(*parameters));
+   parameters->Size = sizeof(*parameters);
+}
+
+//
+// The context of an object is allocated along with it, of the size given
+// by the attributes it was created with.
+//
+PVOID ShimWdfObjectGetContext(PVOID handle);
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(type, function)               \
+   static const WDF_OBJECT_CONTEXT_TYPE_INFO ShimContextType_##type =    \
+      { #type, sizeof(type) };                                           \
+   static inline type*                                                   \
+   function(PVOID handle)                                                \
+   {                                                                     \
+      return (type*)ShimWdfObjectGetContext(handle);                     \
+   }
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(attributes, type)        \
+   (WDF_OBJECT_ATTRIBUTES_INIT(attributes),                              \
+    (attributes)->ContextTypeInfo = &ShimContextType_##type)
+
+extern const UNICODE_STRING SDDL_DEVOBJ_KERNEL_ONLY;
+extern const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_ALL;
+
+NTSTATUS WdfDriverCreate(DRIVER_OBJECT* driverObject, const UNICODE_STRING* registryPath, WDF_OBJECT_ATTRIBUTES* attributes, WDF_DRIVER_CONFIG* config, WDFDRIVER* driver);
+NTSTATUS WdfDriverOpenParametersRegistryKey(WDFDRIVER driver, ACCESS_MASK access, WDF_OBJECT_ATTRIBUTES* attributes, WDFKEY* key);
+
+PWDFDEVICE_INIT WdfControlDeviceInitAllocate(WDFDRIVER driver, const UNICODE_STRING* sddl);
+void WdfDeviceInitFree(PWDFDEVICE_INIT deviceInit);
+void WdfDeviceInitSetDeviceType(PWDFDEVICE_INIT deviceInit, ULONG type);
+void WdfDeviceInitSetCharacteristics(PWDFDEVICE_INIT deviceInit, ULONG characteristics, BOOLEAN orInValues);
+NTSTATUS WdfDeviceInitAssignName(PWDFDEVICE_INIT deviceInit, const UNICODE_STRING* name);
+void WdfDeviceInitSetFileObjectConfig(PWDFDEVICE_INIT deviceInit, WDF_FILEOBJECT_CONFIG* config, WDF_OBJECT_ATTRIBUTES* attributes);
+void WdfDeviceInitSetExclusive(PWDFDEVICE_INIT deviceInit, BOOLEAN exclusive);
+void WdfDeviceInitSetIoInCallerContextCallback(PWDFDEVICE_INIT deviceInit, EVT_WDF_IO_IN_CALLER_CONTEXT* callback);
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT* deviceInit, WDF_OBJECT_ATTRIBUTES* attributes, WDFDEVICE* device);
+NTSTATUS WdfDeviceCreateSymbolicLink(WDFDEVICE device, const UNICODE_STRING* name);
+void WdfControlFinishInitializing(WDFDEVICE device);
+DEVICE_OBJECT* WdfDeviceWdmGetDeviceObject(WDFDEVICE device);
+NTSTATUS WdfDeviceEnqueueRequest(WDFDEVICE device, WDFREQUEST request);
+
+NTSTATUS WdfIoQueueCreate(WDFDEVICE device, WDF_IO_QUEUE_CONFIG* config, WDF_OBJECT_ATTRIBUTES* attributes, WDFQUEUE* queue);
+NTSTATUS WdfIoQueueRetrieveNextRequest(WDFQUEUE queue, WDFREQUEST* request);
+NTSTATUS WdfIoQueueRetrieveRequestByFileObject(WDFQUEUE queue, WDFFILEOBJECT fileObject, WDFREQUEST* request);
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST request, WDFQUEUE queue);
+void WdfRequestComplete(WDFREQUEST request, NTSTATUS status);
+void WdfRequestCompleteWithInformation(WDFREQUEST request, NTSTATUS status, ULONG_PTR information);
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST request, size_t minimumLength, PVOID* buffer, size_t* length);
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST request, size_t minimumLength, PVOID* buffer, size_t* length);
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST request);
+KPROCESSOR_MODE WdfRequestGetRequestorMode(WDFREQUEST request);
+void WdfRequestGetParameters(WDFREQUEST request, WDF_REQUEST_PARAMETERS* parameters);
+
+NTSTATUS WdfRegistryQueryULong(WDFKEY key, const UNICODE_STRING* valueName, ULONG* value);
+NTSTATUS WdfRegistryQueryUnicodeString(WDFKEY key, const UNICODE_STRING* valueName, USHORT* valueByteLength, UNICODE_STRING* value);
+NTSTATUS WdfRegistryQueryMemory(WDFKEY key, const UNICODE_STRING* valueName, POOL_TYPE poolType, WDF_OBJECT_ATTRIBUTES* attributes, WDFMEMORY* memory, ULONG* valueType);
+HANDLE WdfRegistryWdmGetHandle(WDFKEY key);
+void WdfRegistryClose(WDFKEY key);
+
+PVOID WdfMemoryGetBuffer(WDFMEMORY memory, size_t* bufferSize);
+void WdfObjectDelete(PVOID object);
+
+NTSTATUS WdfWaitLockCreate(WDF_OBJECT_ATTRIBUTES* attributes, WDFWAITLOCK* lock);
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK lock, LONGLONG* timeout);
+void WdfWaitLockRelease(WDFWAITLOCK lock);
+
+#endif // _SHIM_WDF_H_
@@ -0,0 +1,23 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   User-mode stand-in for the IP definitions header, see shim.c.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _SHIM_WS2IPDEF_H_
+#define _SHIM_WS2IPDEF_H_
+
+#include "fwpsk.h"
+
+#define INET_ADDRSTRLEN 22
+#define INET6_ADDRSTRLEN 65
+
+#endif // _SHIM_WS2IPDEF_H_
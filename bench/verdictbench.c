@@ -0,0 +1,398 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Throughput benchmark of the verdict channel of the driver
+   (sys\verdict.h), built in user mode on Linux:
+
+      cc -O2 -iquote sys -iquote inc -o verdictbench bench/verdictbench.c
+      ./verdictbench [descriptors]
+
+   The benchmark stands for the driver, keeping 256 descriptors waiting in
+   the ring of the channel, and forks a stand-in for the policy daemon, to
+   which it is connected by a pair of sockets. Every exchange request the
+   daemon keeps outstanding is a credit of the driver; completing it with
+   descriptors is one message to the daemon, and the daemon answers with
+   one message of verdicts, which sends the request again. The verdicts
+   are applied from the head of the ring, as the driver does.
+
+   The channel is run with a single request outstanding holding a single
+   descriptor, a round trip per descriptor, and then with several requests
+   outstanding holding up to 64 descriptors each. A last run stalls the
+   daemon, which reads the descriptors but never answers, so that every
+   descriptor is decided by the default verdict after the timeout. For
+   each run it prints the decisions per second, the descriptors per round
+   trip, and the percentiles of the time from submission to application.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t LONG64;
+typedef int32_t LONG;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _Out_writes_(count)
+
+#define __inline static inline
+
+#define TL_INSPECT_VERDICT_USER_MODE
+#include "verdict.h"
+
+//
+// Times are in 100ns units.
+//
+#define VERDICTBENCH_MS 10000
+
+#define VERDICTBENCH_BATCH 64
+#define VERDICTBENCH_OUTSTANDING 8
+#define VERDICTBENCH_TIMEOUT (10 * VERDICTBENCH_MS)
+
+//
+// Most descriptors waiting in the ring at once, standing for the packets
+// pended by the classify functions meanwhile.
+//
+#define VERDICTBENCH_WINDOW 256
+
+//
+// VERDICTBENCH_MESSAGE is a message between the driver and the daemon:
+// descriptors one way, verdicts the other. A message of no descriptors
+// ends the daemon.
+//
+typedef struct VERDICTBENCH_MESSAGE_
+{
+   UINT32 count;
+   UINT32 reserved;
+
+   union
+   {
+      TL_INSPECT_VERDICT_REQUEST requests[VERDICTBENCH_BATCH];
+      TL_INSPECT_VERDICT verdicts[VERDICTBENCH_BATCH];
+   };
+} VERDICTBENCH_MESSAGE;
+
+UINT64
+VerdictBenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 10000000 + (UINT64)now.tv_nsec / 100;
+}
+
+int
+VerdictBenchCompare(
+   const void* first,
+   const void* second
+   )
+{
+   UINT64 a = *(const UINT64*)first;
+   UINT64 b = *(const UINT64*)second;
+
+   return (a > b) - (a < b);
+}
+
+void
+VerdictBenchDaemon(
+   _In_ int socket,
+   _In_ BOOLEAN stalled
+   )
+/* ++
+
+   Runs the stand-in daemon: it permits the descriptors whose remote port
+   is even and blocks the others, one message of verdicts per message of
+   descriptors, until told to end.
+
+-- */
+{
+   VERDICTBENCH_MESSAGE message;
+   UINT32 i;
+
+   for (;;)
+   {
+      if (recv(socket, &message, sizeof(message), 0) <= 0)
+      {
+         break;
+      }
+
+      if (message.count == 0)
+      {
+         break;
+      }
+
+      if (stalled)
+      {
+         continue;
+      }
+
+      for (i = 0; i < message.count; i++)
+      {
+         TL_INSPECT_VERDICT verdict;
+
+         verdict.id = message.requests[i].id;
+         verdict.verdict = ((message.requests[i].remotePort & 1) == 0) ?
+                              TL_INSPECT_VERDICT_PERMIT :
+                              TL_INSPECT_VERDICT_BLOCK;
+         verdict.reserved = 0;
+
+         message.verdicts[i] = verdict;
+      }
+
+      if (send(socket, &message, sizeof(message), 0) < 0)
+      {
+         break;
+      }
+   }
+
+   close(socket);
+}
+
+BOOLEAN
+VerdictBenchRun(
+   _In_ const char* name,
+   _In_ UINT32 descriptors,
+   _In_ UINT32 outstanding,
+   _In_ UINT32 batch,
+   _In_ BOOLEAN stalled
+   )
+{
+   TL_INSPECT_VERDICT_RING ring;
+   TL_INSPECT_VERDICT_REQUEST request;
+   VERDICTBENCH_MESSAGE message;
+   UINT64* submitTimes = NULL;
+   UINT64* latencies = NULL;
+   UINT64 start;
+   UINT64 end;
+   UINT64 exchanges = 0;
+   UINT64 delivered = 0;
+   UINT32 submitted = 0;
+   UINT32 applied = 0;
+   UINT32 defaulted = 0;
+   UINT32 credits = outstanding;
+   int sockets[2] = { -1, -1 };
+   BOOLEAN result = FALSE;
+   pid_t daemon;
+   UINT32 i;
+
+   memset(&ring, 0, sizeof(ring));
+   memset(&request, 0, sizeof(request));
+
+   ring.size = TL_INSPECT_VERDICT_RING_SIZE;
+   ring.slots = calloc(ring.size, sizeof(TL_INSPECT_VERDICT_SLOT));
+   submitTimes = malloc(descriptors * sizeof(UINT64));
+   latencies = malloc(descriptors * sizeof(UINT64));
+
+   if ((ring.slots == NULL) || (submitTimes == NULL) || (latencies == NULL))
+   {
+      fprintf(stderr, "out of memory\n");
+      goto Exit;
+   }
+
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0)
+   {
+      perror("socketpair");
+      goto Exit;
+   }
+
+   fflush(stdout);
+
+   daemon = fork();
+   if (daemon < 0)
+   {
+      perror("fork");
+      goto Exit;
+   }
+
+   if (daemon == 0)
+   {
+      close(sockets[0]);
+      VerdictBenchDaemon(sockets[1], stalled);
+      exit(0);
+   }
+
+   close(sockets[1]);
+   sockets[1] = -1;
+
+   request.type = 1;
+   request.protocol = 6;
+   request.addressFamily = 4;
+
+   start = VerdictBenchNow();
+
+   while (applied < descriptors)
+   {
+      const TL_INSPECT_VERDICT_SLOT* slot;
+      struct pollfd pollFd;
+      UINT64 now = VerdictBenchNow();
+
+      while ((submitted < descriptors) &&
+             (ring.tail - ring.head < VERDICTBENCH_WINDOW))
+      {
+         request.localPort = (UINT16)(49152 + (submitted & 0x3fff));
+         request.remotePort = (UINT16)submitted;
+
+         slot = TLInspectVerdictRingAdd(
+                   &ring,
+                   &request,
+                   NULL,
+                   now + VERDICTBENCH_TIMEOUT
+                   );
+         submitTimes[slot->request.id] = now;
+         submitted++;
+      }
+
+      //
+      // The parked requests are completed with the descriptors not sent.
+      //
+      while (credits > 0)
+      {
+         message.count = TLInspectVerdictRingFill(&ring, message.requests, batch);
+         message.reserved = 0;
+
+         if (message.count == 0)
+         {
+            break;
+         }
+
+         if (send(sockets[0], &message, sizeof(message), 0) < 0)
+         {
+            perror("send");
+            goto Exit;
+         }
+
+         delivered += message.count;
+         credits--;
+      }
+
+      pollFd.fd = sockets[0];
+      pollFd.events = POLLIN;
+      pollFd.revents = 0;
+
+      while (poll(&pollFd, 1, (credits == 0) ? 1 : 0) > 0)
+      {
+         if (recv(sockets[0], &message, sizeof(message), 0) <= 0)
+         {
+            perror("recv");
+            goto Exit;
+         }
+
+         for (i = 0; i < message.count; i++)
+         {
+            TLInspectVerdictRingDecide(
+               &ring,
+               message.verdicts[i].id,
+               message.verdicts[i].verdict
+               );
+         }
+
+         exchanges++;
+         credits++;
+      }
+
+      now = VerdictBenchNow();
+      defaulted += TLInspectVerdictRingExpire(&ring, now);
+
+      while ((slot = TLInspectVerdictRingTake(&ring)) != NULL)
+      {
+         latencies[applied++] = now - submitTimes[slot->request.id];
+      }
+   }
+
+   end = VerdictBenchNow();
+
+   qsort(latencies, descriptors, sizeof(UINT64), VerdictBenchCompare);
+
+   printf("%-28s %9.0f decisions/s, %5.1f per round trip, %u defaulted, "
+          "latency p50 %7.3f ms, p99 %7.3f ms\n",
+          name,
+          (double)descriptors * 1e7 / (double)(end - start),
+          (exchanges != 0) ? (double)delivered / (double)exchanges : 0.0,
+          defaulted,
+          (double)latencies[descriptors / 2] / VERDICTBENCH_MS,
+          (double)latencies[(UINT64)descriptors * 99 / 100] / VERDICTBENCH_MS);
+
+   result = TRUE;
+
+   message.count = 0;
+   send(sockets[0], &message, sizeof(message), 0);
+   waitpid(daemon, NULL, 0);
+
+Exit:
+
+   if (sockets[0] >= 0)
+   {
+      close(sockets[0]);
+   }
+   if (sockets[1] >= 0)
+   {
+      close(sockets[1]);
+   }
+
+   free(ring.slots);
+   free(submitTimes);
+   free(latencies);
+
+   return result;
+}
+
+int
+main(
+   int argc,
+   char* argv[]
+   )
+{
+   UINT32 descriptors = 200000;
+
+   if (argc > 1)
+   {
+      descriptors = (UINT32)strtoul(argv[1], NULL, 0);
+   }
+
+   if (descriptors == 0)
+   {
+      return 1;
+   }
+
+   printf("%u descriptors, %u waiting, timeout %u ms\n",
+          descriptors,
+          VERDICTBENCH_WINDOW,
+          VERDICTBENCH_TIMEOUT / VERDICTBENCH_MS);
+
+   if (!VerdictBenchRun("1 outstanding, batch 1", descriptors, 1, 1, FALSE) ||
+       !VerdictBenchRun("8 outstanding, batch 64", descriptors,
+                        VERDICTBENCH_OUTSTANDING, VERDICTBENCH_BATCH, FALSE) ||
+       !VerdictBenchRun("stalled daemon", descriptors / 10,
+                        VERDICTBENCH_OUTSTANDING, VERDICTBENCH_BATCH, TRUE))
+   {
+      return 1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,278 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Benchmark of the timer wheel of the driver (sys\wheel.h), built in user
+   mode on Linux:
+
+      cc -O2 -I sys -I inc -o wheelbench bench/wheelbench.c
+      ./wheelbench
+
+   For 10k, 100k and 1M timers, it arms each timer for a random tick of
+   the next 10 minutes, cancels every other one, and advances the wheel
+   tick by tick until all have fired. It prints the time to arm and to
+   cancel a timer and the time per fired timer of advancing the wheel,
+   and fails if a timer fired at any other tick than its own, or if a
+   cancelled timer fired.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t UINT8;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef unsigned long ULONG;
+typedef unsigned char BOOLEAN;
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Out_
+#define _Inout_
+
+#define __inline static inline
+
+typedef struct LIST_ENTRY_
+{
+   struct LIST_ENTRY_* Flink;
+   struct LIST_ENTRY_* Blink;
+} LIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field) \
+   ((type*)((char*)(address) - offsetof(type, field)))
+
+static inline void
+InitializeListHead(
+   _Out_ LIST_ENTRY* head
+   )
+{
+   head->Flink = head->Blink = head;
+}
+
+static inline BOOLEAN
+IsListEmpty(
+   _In_ const LIST_ENTRY* head
+   )
+{
+   return head->Flink == head;
+}
+
+static inline void
+InsertTailList(
+   _Inout_ LIST_ENTRY* head,
+   _Inout_ LIST_ENTRY* entry
+   )
+{
+   entry->Flink = head;
+   entry->Blink = head->Blink;
+   head->Blink->Flink = entry;
+   head->Blink = entry;
+}
+
+static inline void
+RemoveEntryList(
+   _Inout_ LIST_ENTRY* entry
+   )
+{
+   entry->Blink->Flink = entry->Flink;
+   entry->Flink->Blink = entry->Blink;
+}
+
+static inline LIST_ENTRY*
+RemoveHeadList(
+   _Inout_ LIST_ENTRY* head
+   )
+{
+   LIST_ENTRY* entry = head->Flink;
+
+   RemoveEntryList(entry);
+
+   return entry;
+}
+
+#define TL_INSPECT_WHEEL_USER_MODE
+#include "wheel.h"
+
+//
+// Timers are armed for up to 10 minutes of ticks.
+//
+#define WHEELBENCH_HORIZON (10 * 60 * 1000 / TL_INSPECT_WHEEL_TICK)
+
+//
+// WHEELBENCH_TIMER stands for an object that is timed; fired is the tick
+// at which its timer fired, 0 while it has not.
+//
+typedef struct WHEELBENCH_TIMER_
+{
+   TL_INSPECT_TIMER timer;
+   UINT64 expires;
+   UINT64 fired;
+   BOOLEAN cancelled;
+} WHEELBENCH_TIMER;
+
+UINT64 gRandomState = 0x9e3779b97f4a7c15ull;
+
+UINT64
+WheelBenchRandom(void)
+{
+   gRandomState ^= gRandomState << 13;
+   gRandomState ^= gRandomState >> 7;
+   gRandomState ^= gRandomState << 17;
+   return gRandomState;
+}
+
+UINT64
+WheelBenchNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (UINT64)now.tv_sec * 1000000000 + (UINT64)now.tv_nsec;
+}
+
+int
+WheelBenchRun(
+   _In_ UINT32 count
+   )
+/* ++
+
+   Arms, cancels and fires count timers, and returns the number of timers
+   that fired at the wrong tick or should not have fired.
+
+-- */
+{
+   static TL_INSPECT_TIMER_WHEEL wheel;
+   WHEELBENCH_TIMER* timers;
+   LIST_ENTRY expired;
+   TL_INSPECT_TIMER* timer;
+   UINT64 start = 1000;
+   UINT64 armTime;
+   UINT64 cancelTime;
+   UINT64 advanceTime;
+   UINT64 now;
+   UINT64 fired = 0;
+   UINT32 errors = 0;
+   UINT32 i;
+
+   timers = calloc(count, sizeof(WHEELBENCH_TIMER));
+   if (timers == NULL)
+   {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      timers[i].expires = start + 1 + WheelBenchRandom() % WHEELBENCH_HORIZON;
+   }
+
+   TLInspectWheelInitialize(&wheel, start);
+   InitializeListHead(&expired);
+
+   now = WheelBenchNow();
+   for (i = 0; i < count; i++)
+   {
+      TLInspectWheelArm(&wheel, &timers[i].timer, timers[i].expires);
+   }
+   armTime = WheelBenchNow() - now;
+
+   now = WheelBenchNow();
+   for (i = 0; i < count; i += 2)
+   {
+      TLInspectWheelCancel(&wheel, &timers[i].timer);
+      timers[i].cancelled = TRUE;
+   }
+   cancelTime = WheelBenchNow() - now;
+
+   if (wheel.count != count / 2)
+   {
+      errors++;
+   }
+
+   advanceTime = 0;
+
+   for (now = start + 1; now <= start + WHEELBENCH_HORIZON; now++)
+   {
+      UINT64 before = WheelBenchNow();
+
+      fired += TLInspectWheelAdvance(&wheel, now, &expired);
+
+      advanceTime += WheelBenchNow() - before;
+
+      while ((timer = TLInspectWheelNextExpired(&wheel, &expired)) != NULL)
+      {
+         WHEELBENCH_TIMER* object = CONTAINING_RECORD(
+                                       timer,
+                                       WHEELBENCH_TIMER,
+                                       timer
+                                       );
+
+         if (object->fired != 0)
+         {
+            errors++;
+         }
+
+         object->fired = now;
+      }
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      if (timers[i].cancelled ? (timers[i].fired != 0) :
+                                (timers[i].fired != timers[i].expires))
+      {
+         errors++;
+      }
+   }
+
+   if ((wheel.count != 0) || (fired != count - count / 2))
+   {
+      errors++;
+   }
+
+   printf("%8u timers: arm %6.1f ns, cancel %6.1f ns, advance %6.1f ns per fired timer, "
+          "%u errors\n",
+          count,
+          (double)armTime / count,
+          (double)cancelTime / (count / 2),
+          (double)advanceTime / (double)(fired != 0 ? fired : 1),
+          errors);
+
+   free(timers);
+
+   return errors;
+}
+
+int
+main(void)
+{
+   static const UINT32 counts[] = { 10000, 100000, 1000000 };
+   int errors = 0;
+   ULONG i;
+
+   printf("wheel of %u ticks of %u ms, timers armed for up to %u ticks\n",
+          (UINT32)TL_INSPECT_WHEEL_SPAN,
+          TL_INSPECT_WHEEL_TICK,
+          WHEELBENCH_HORIZON);
+
+   for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+   {
+      errors += WheelBenchRun(counts[i]);
+   }
+
+   return (errors == 0) ? 0 : 1;
+}
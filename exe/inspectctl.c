@@ -0,0 +1,1700 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   Control tool for the Transport Inspect sample callout driver.
+
+   inspectctl trace [-json]   streams the binary event trace of the driver
+                              to the console, as text or as one JSON object
+                              per line, until Ctrl+C is pressed.
+   inspectctl level <n>       sets the trace level (0 - 4).
+   inspectctl info            shows the trace configuration.
+   inspectctl stats           maps the statistics page of the driver and
+                              prints the counter rates every second until
+                              Ctrl+C is pressed.
+   inspectctl latency         prints the latency percentiles of the pended
+                              packets, per packet type, direction and stage.
+   inspectctl reload [n]      reloads the policy from the registry, n times
+                              in a row, and prints the last policy loaded.
+                              Run under load, it reports the reload rate and
+                              the packets pended and dropped meanwhile.
+   inspectctl daemon [n] [port ...]
+                              decides the pended traffic as the policy
+                              daemon, with n exchange requests outstanding
+                              (4, default): blocks the traffic to or from
+                              the remote ports given and permits the rest,
+                              and prints the decision rate every second
+                              until Ctrl+C is pressed.
+   inspectctl ring [n] [snap] [port ...]
+                              decides the pended traffic as the policy
+                              daemon through the packet ring, with n
+                              threads polling a partition each (4,
+                              default) and snap bytes of each packet
+                              (64, default); otherwise as daemon.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inspectioctl.h"
+
+//
+// Number of records fetched from one processor by a single read.
+//
+#define INSPECTCTL_READ_RECORDS 256
+
+#define INSPECTCTL_POLL_INTERVAL 100 // milliseconds
+
+//
+// The statistics page is sampled at every poll, so that the peak queue
+// depth of each report is seen, and the rates are printed every that many
+// polls.
+//
+#define INSPECTCTL_STATS_REPORT_POLLS 10
+
+//
+// Most exchange requests the daemon keeps outstanding, the most
+// descriptors each returns, and the most remote ports it blocks.
+//
+#define INSPECTCTL_DAEMON_MAX_OUTSTANDING 64
+#define INSPECTCTL_DAEMON_BATCH 256
+#define INSPECTCTL_DAEMON_MAX_PORTS 64
+
+//
+// Times a thread of the daemon polls an empty partition of the packet ring
+// before it waits for the driver to write to it.
+//
+#define INSPECTCTL_RING_SPINS 4096
+
+const char* InspectCtlFunctionNames[TL_INSPECT_CLASSIFY_FUNCTION_MAX] =
+{
+   "connect",
+   "recv-accept",
+   "transport",
+   "ip"
+};
+
+const char* InspectCtlPacketTypeNames[TL_INSPECT_LATENCY_PACKET_TYPES] =
+{
+   "connect",
+   "data",
+   "reauth"
+};
+
+//
+// Indexed by FWP_DIRECTION.
+//
+const char* InspectCtlDirectionNames[TL_INSPECT_LATENCY_DIRECTIONS] =
+{
+   "out",
+   "in"
+};
+
+const char* InspectCtlStageNames[TL_INSPECT_LATENCY_STAGE_MAX] =
+{
+   "queue",
+   "process",
+   "inject",
+   "total"
+};
+
+volatile BOOL gStop = FALSE;
+
+BOOL WINAPI
+InspectCtlConsoleHandler(
+   _In_ DWORD ctrlType
+   )
+{
+   UNREFERENCED_PARAMETER(ctrlType);
+
+   gStop = TRUE;
+   return TRUE;
+}
+
+const char*
+InspectCtlProtocolName(
+   _In_ UINT8 protocol
+   )
+{
+   switch (protocol)
+   {
+   case 1:
+      return "Icmp";
+   case 2:
+      return "Igmp";
+   case 6:
+      return "Tcp";
+   case 17:
+      return "Udp";
+   case 41:
+      return "IPv6";
+   case 47:
+      return "Gre";
+   case 50:
+      return "Esp";
+   case 51:
+      return "Ah";
+   case 58:
+      return "IcmpV6";
+   case 132:
+      return "Sctp";
+   default:
+      return NULL;
+   }
+}
+
+const char*
+InspectCtlEventName(
+   _In_ UINT8 event
+   )
+{
+   switch (event)
+   {
+   case TL_INSPECT_TRACE_EVENT_CLASSIFY:
+      return "classify";
+   case TL_INSPECT_TRACE_EVENT_VERDICT:
+      return "verdict";
+   case TL_INSPECT_TRACE_EVENT_INJECT_FAILURE:
+      return "inject-failure";
+   default:
+      return "unknown";
+   }
+}
+
+const char*
+InspectCtlVerdictName(
+   _In_ UINT8 verdict
+   )
+{
+   switch (verdict)
+   {
+   case TL_INSPECT_TRACE_VERDICT_PERMIT:
+      return "permit";
+   case TL_INSPECT_TRACE_VERDICT_BLOCK:
+      return "block";
+   case TL_INSPECT_TRACE_VERDICT_PEND:
+      return "pend";
+   default:
+      return "none";
+   }
+}
+
+void
+InspectCtlFormatAddress(
+   _In_ UINT8 addressFamily,
+   _In_reads_(16) const UINT8* address,
+   _Out_writes_(length) char* buffer,
+   _In_ size_t length
+   )
+{
+   if (InetNtopA(
+          (addressFamily == 4) ? AF_INET : AF_INET6,
+          address,
+          buffer,
+          length
+          ) == NULL)
+   {
+      strcpy_s(buffer, length, "?");
+   }
+}
+
+void
+InspectCtlPrintRecord(
+   _In_ const TL_INSPECT_TRACE_RECORD* record,
+   _In_ BOOL json
+   )
+{
+   char localAddress[INET6_ADDRSTRLEN];
+   char remoteAddress[INET6_ADDRSTRLEN];
+   char protocolNumber[4];
+   const char* protocol;
+   const char* direction;
+
+   InspectCtlFormatAddress(
+      record->addressFamily,
+      record->localAddress,
+      localAddress,
+      sizeof(localAddress)
+      );
+   InspectCtlFormatAddress(
+      record->addressFamily,
+      record->remoteAddress,
+      remoteAddress,
+      sizeof(remoteAddress)
+      );
+
+   protocol = InspectCtlProtocolName(record->protocol);
+   if (protocol == NULL)
+   {
+      sprintf_s(protocolNumber, sizeof(protocolNumber), "%u", record->protocol);
+      protocol = protocolNumber;
+   }
+
+   direction = (record->direction == 0) ? "out" : "in";
+
+   if (json)
+   {
+      printf("{\"time\":%.7f,\"cpu\":%u,\"layer\":%u,\"event\":\"%s\","
+             "\"direction\":\"%s\",\"protocol\":\"%s\","
+             "\"local\":\"%s\",\"localPort\":%u,"
+             "\"remote\":\"%s\",\"remotePort\":%u,"
+             "\"verdict\":\"%s\",\"count\":%u}\n",
+             record->timestamp / 1e7,
+             record->processor,
+             record->layerId,
+             InspectCtlEventName(record->event),
+             direction,
+             protocol,
+             localAddress,
+             record->localPort,
+             remoteAddress,
+             record->remotePort,
+             InspectCtlVerdictName(record->verdict),
+             record->count);
+   }
+   else
+   {
+      printf("%14.7f cpu%-3u L%-3u %-14s %-3s %-6s %s:%u -> %s:%u %s",
+             record->timestamp / 1e7,
+             record->processor,
+             record->layerId,
+             InspectCtlEventName(record->event),
+             direction,
+             protocol,
+             localAddress,
+             record->localPort,
+             remoteAddress,
+             record->remotePort,
+             InspectCtlVerdictName(record->verdict));
+
+      if (record->count > 1)
+      {
+         printf(" (x%u)", record->count);
+      }
+      printf("\n");
+   }
+}
+
+int __cdecl
+InspectCtlCompareRecords(
+   _In_ const void* first,
+   _In_ const void* second
+   )
+{
+   const TL_INSPECT_TRACE_RECORD* record1 = first;
+   const TL_INSPECT_TRACE_RECORD* record2 = second;
+
+   if (record1->timestamp < record2->timestamp)
+   {
+      return -1;
+   }
+   return (record1->timestamp > record2->timestamp) ? 1 : 0;
+}
+
+BOOL
+InspectCtlQueryTraceInfo(
+   _In_ HANDLE device,
+   _Out_ TL_INSPECT_TRACE_INFO* info
+   )
+{
+   DWORD bytesReturned;
+
+   return DeviceIoControl(
+             device,
+             IOCTL_TL_INSPECT_QUERY_TRACE_INFO,
+             NULL,
+             0,
+             info,
+             sizeof(*info),
+             &bytesReturned,
+             NULL
+             );
+}
+
+DWORD
+InspectCtlTrace(
+   _In_ HANDLE device,
+   _In_ BOOL json
+   )
+/* ++
+
+   Polls the ring of every processor and prints the records read in each
+   round in timestamp order.
+
+-- */
+{
+   DWORD result = ERROR_SUCCESS;
+   TL_INSPECT_TRACE_INFO info;
+   UINT64* sequences = NULL;
+   TL_INSPECT_TRACE_READ_OUTPUT* output = NULL;
+   TL_INSPECT_TRACE_RECORD* records = NULL;
+   DWORD outputLength;
+   size_t recordCapacity;
+   UINT32 i;
+
+   if (!InspectCtlQueryTraceInfo(device, &info))
+   {
+      result = GetLastError();
+      goto Exit;
+   }
+
+   outputLength = FIELD_OFFSET(TL_INSPECT_TRACE_READ_OUTPUT, records) +
+                  INSPECTCTL_READ_RECORDS * sizeof(TL_INSPECT_TRACE_RECORD);
+   recordCapacity = (size_t)info.processorCount * INSPECTCTL_READ_RECORDS;
+
+   sequences = calloc(info.processorCount, sizeof(UINT64));
+   output = malloc(outputLength);
+   records = malloc(recordCapacity * sizeof(TL_INSPECT_TRACE_RECORD));
+
+   if ((sequences == NULL) || (output == NULL) || (records == NULL))
+   {
+      result = ERROR_NOT_ENOUGH_MEMORY;
+      goto Exit;
+   }
+
+   SetConsoleCtrlHandler(InspectCtlConsoleHandler, TRUE);
+
+   while (!gStop)
+   {
+      size_t recordCount = 0;
+
+      for (i = 0; i < info.processorCount; i++)
+      {
+         TL_INSPECT_TRACE_READ_INPUT input = { 0 };
+         DWORD bytesReturned;
+
+         input.processor = i;
+         input.sequence = sequences[i];
+
+         if (!DeviceIoControl(
+                device,
+                IOCTL_TL_INSPECT_READ_TRACE,
+                &input,
+                sizeof(input),
+                output,
+                outputLength,
+                &bytesReturned,
+                NULL
+                ))
+         {
+            result = GetLastError();
+            goto Exit;
+         }
+
+         if (output->lost != 0)
+         {
+            if (json)
+            {
+               printf("{\"cpu\":%u,\"lost\":%llu}\n", i, output->lost);
+            }
+            else
+            {
+               fprintf(stderr, "cpu%u: %llu records lost\n", i, output->lost);
+            }
+         }
+
+         memcpy(
+            &records[recordCount],
+            output->records,
+            output->recordCount * sizeof(TL_INSPECT_TRACE_RECORD)
+            );
+         recordCount += output->recordCount;
+
+         sequences[i] = output->nextSequence;
+      }
+
+      qsort(
+         records,
+         recordCount,
+         sizeof(TL_INSPECT_TRACE_RECORD),
+         InspectCtlCompareRecords
+         );
+
+      for (i = 0; i < recordCount; i++)
+      {
+         InspectCtlPrintRecord(&records[i], json);
+      }
+      fflush(stdout);
+
+      Sleep(INSPECTCTL_POLL_INTERVAL);
+   }
+
+Exit:
+
+   free(records);
+   free(output);
+   free(sequences);
+
+   return result;
+}
+
+DWORD
+InspectCtlSetTraceLevel(
+   _In_ HANDLE device,
+   _In_ ULONG level
+   )
+{
+   DWORD bytesReturned;
+
+   if (!DeviceIoControl(
+          device,
+          IOCTL_TL_INSPECT_SET_TRACE_LEVEL,
+          &level,
+          sizeof(level),
+          NULL,
+          0,
+          &bytesReturned,
+          NULL
+          ))
+   {
+      return GetLastError();
+   }
+
+   return ERROR_SUCCESS;
+}
+
+DWORD
+InspectCtlInfo(
+   _In_ HANDLE device
+   )
+{
+   TL_INSPECT_TRACE_INFO info;
+
+   if (!InspectCtlQueryTraceInfo(device, &info))
+   {
+      return GetLastError();
+   }
+
+   printf("trace level:       %u\n", info.level);
+   printf("processors:        %u\n", info.processorCount);
+   printf("records per ring:  %u\n", info.ringSize);
+   printf("dedup window (ms): %u\n", info.dedupWindow);
+
+   return ERROR_SUCCESS;
+}
+
+void
+InspectCtlReadStatsPage(
+   _In_ const volatile TL_INSPECT_STATS_PAGE* page,
+   _Out_ TL_INSPECT_STATS_PAGE* snapshot
+   )
+/* ++
+
+   Copies a consistent snapshot of the statistics page: the copy is retried
+   while the driver is updating the page, as told by an odd or changed
+   sequence.
+
+-- */
+{
+   for (;;)
+   {
+      UINT32 sequence = page->sequence;
+
+      if ((sequence & 1) == 0)
+      {
+         MemoryBarrier();
+         memcpy(snapshot, (const void*)page, sizeof(*snapshot));
+         MemoryBarrier();
+
+         if (page->sequence == sequence)
+         {
+            return;
+         }
+      }
+
+      YieldProcessor();
+   }
+}
+
+double
+InspectCtlRate(
+   _In_ LONG64 current,
+   _In_ LONG64 previous,
+   _In_ double seconds
+   )
+{
+   return (double)(current - previous) / seconds;
+}
+
+void
+InspectCtlPrintStats(
+   _In_ const TL_INSPECT_STATS_PAGE* previous,
+   _In_ const TL_INSPECT_STATS_PAGE* current,
+   _In_ INT32 packetQueueDepthMax
+   )
+{
+   double seconds = (current->timestamp - previous->timestamp) / 1e7;
+   LONG64 lookups = current->flowCache.lookups - previous->flowCache.lookups;
+   LONG64 hits = current->flowCache.hits - previous->flowCache.hits;
+   LONG64 connectLookups = current->connectCache.lookups -
+                           previous->connectCache.lookups;
+   LONG64 connectHits = current->connectCache.hits - previous->connectCache.hits;
+   LONG64 connectBlockHits = current->connectCache.blockHits -
+                             previous->connectCache.blockHits;
+   LONG64 dequeued = 0;
+   LONG64 connects = current->sched.served[TL_INSPECT_SCHED_CLASS_CONNECT] -
+                     previous->sched.served[TL_INSPECT_SCHED_CLASS_CONNECT];
+   LONG64 coalesced = current->sched.coalesced - previous->sched.coalesced;
+   LONG64 locks = current->dequeue.lockAcquisitions -
+                  previous->dequeue.lockAcquisitions;
+   LONG64 splices = current->dequeue.splices - previous->dequeue.splices;
+   LONG64 spliced = current->dequeue.splicedPackets -
+                    previous->dequeue.splicedPackets;
+   LONG64 exchanges = current->verdict.exchanges - previous->verdict.exchanges;
+   LONG64 delivered = current->verdict.delivered - previous->verdict.delivered;
+   UINT32 i;
+
+   if (seconds <= 0)
+   {
+      return;
+   }
+
+   for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+   {
+      dequeued += current->sched.served[i] - previous->sched.served[i];
+   }
+
+   printf("%-12s %10s %10s %10s %10s %10s %10s %10s %12s\n",
+          "",
+          "calls/s",
+          "permits/s",
+          "blocks/s",
+          "absorbs/s",
+          "self/s",
+          "skipped/s",
+          "nomem/s",
+          "reinjfail/s");
+
+   for (i = 0; i < TL_INSPECT_CLASSIFY_FUNCTION_MAX; i++)
+   {
+      const TL_INSPECT_CLASSIFY_COUNTERS* now = &current->classify[i];
+      const TL_INSPECT_CLASSIFY_COUNTERS* then = &previous->classify[i];
+
+      printf("%-12s %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %12.0f\n",
+             InspectCtlFunctionNames[i],
+             InspectCtlRate(now->calls, then->calls, seconds),
+             InspectCtlRate(now->permits, then->permits, seconds),
+             InspectCtlRate(now->blocks, then->blocks, seconds),
+             InspectCtlRate(now->absorbs, then->absorbs, seconds),
+             InspectCtlRate(now->selfInjectedSkips, then->selfInjectedSkips, seconds),
+             InspectCtlRate(now->notInspected, then->notInspected, seconds),
+             InspectCtlRate(now->allocationFailures, then->allocationFailures, seconds),
+             InspectCtlRate(now->reinjectFailures, then->reinjectFailures, seconds));
+   }
+
+   printf("pended/s %.0f, reinjected/s %.0f in %.0f inject calls/s, "
+          "connection list %d, packet queue %d (peak %d)\n",
+          InspectCtlRate(current->pendedCount, previous->pendedCount, seconds),
+          InspectCtlRate(current->reinjectCount, previous->reinjectCount, seconds),
+          InspectCtlRate(current->injectCalls, previous->injectCalls, seconds),
+          current->connListDepth,
+          current->packetQueueDepth,
+          packetQueueDepthMax);
+   printf("flow cache: %.0f lookups/s, hit rate %.1f%%, %.0f inserts/s, "
+          "%.0f full/s, %.0f expired/s, %d of %u entries\n",
+          InspectCtlRate(current->flowCache.lookups, previous->flowCache.lookups, seconds),
+          (lookups != 0) ? 100.0 * (double)hits / (double)lookups : 0.0,
+          InspectCtlRate(current->flowCache.inserts, previous->flowCache.inserts, seconds),
+          InspectCtlRate(current->flowCache.insertFailures, previous->flowCache.insertFailures, seconds),
+          InspectCtlRate(current->flowCache.expirations, previous->flowCache.expirations, seconds),
+          current->flowCacheEntries,
+          current->flowCacheCapacity);
+   printf("connect cache: %.0f lookups/s, hit rate %.1f%% (%.1f%% blocked), "
+          "%.0f inserts/s, %.0f full/s, %.0f expired/s, %d of %u entries\n",
+          InspectCtlRate(current->connectCache.lookups, previous->connectCache.lookups, seconds),
+          (connectLookups != 0) ? 100.0 * (double)connectHits / (double)connectLookups : 0.0,
+          (connectHits != 0) ? 100.0 * (double)connectBlockHits / (double)connectHits : 0.0,
+          InspectCtlRate(current->connectCache.inserts, previous->connectCache.inserts, seconds),
+          InspectCtlRate(current->connectCache.insertFailures,
+                         previous->connectCache.insertFailures, seconds),
+          InspectCtlRate(current->connectCache.expirations,
+                         previous->connectCache.expirations, seconds),
+          current->connectCacheEntries,
+          current->connectCacheCapacity);
+   printf("overload: %.0f connects/s and %.0f packets/s shed (depth %.0f/s, "
+          "bytes %.0f/s, delay %.0f/s, connects %.0f/s, memory %.0f/s), "
+          "pended %lld of %lld KB, fail-%s\n",
+          InspectCtlRate(current->overload.connects, previous->overload.connects, seconds),
+          InspectCtlRate(current->overload.packets, previous->overload.packets, seconds),
+          InspectCtlRate(current->overload.shed[TL_INSPECT_OVERLOAD_QUEUE_DEPTH],
+                         previous->overload.shed[TL_INSPECT_OVERLOAD_QUEUE_DEPTH], seconds),
+          InspectCtlRate(current->overload.shed[TL_INSPECT_OVERLOAD_QUEUE_BYTES],
+                         previous->overload.shed[TL_INSPECT_OVERLOAD_QUEUE_BYTES], seconds),
+          InspectCtlRate(current->overload.shed[TL_INSPECT_OVERLOAD_QUEUE_DELAY],
+                         previous->overload.shed[TL_INSPECT_OVERLOAD_QUEUE_DELAY], seconds),
+          InspectCtlRate(current->overload.shed[TL_INSPECT_OVERLOAD_CONNECTS],
+                         previous->overload.shed[TL_INSPECT_OVERLOAD_CONNECTS], seconds),
+          InspectCtlRate(current->overload.shed[TL_INSPECT_OVERLOAD_MEMORY],
+                         previous->overload.shed[TL_INSPECT_OVERLOAD_MEMORY], seconds),
+          current->pendedMemory / 1024,
+          current->memoryBudget / 1024,
+          current->overloadFailOpen ? "open" : "closed");
+   printf("scheduler: %.0f connects/s (%.0f overdue/s, %.0f coalesced/s, "
+          "%.2f completed/inspection), %.0f re-auths/s (%.0f overdue/s), "
+          "%.0f data/s (%.0f overdue/s)\n",
+          InspectCtlRate(current->sched.served[TL_INSPECT_SCHED_CLASS_CONNECT],
+                         previous->sched.served[TL_INSPECT_SCHED_CLASS_CONNECT], seconds),
+          InspectCtlRate(current->sched.overdue[TL_INSPECT_SCHED_CLASS_CONNECT],
+                         previous->sched.overdue[TL_INSPECT_SCHED_CLASS_CONNECT], seconds),
+          InspectCtlRate(current->sched.coalesced, previous->sched.coalesced, seconds),
+          (connects != 0) ? (double)(connects + coalesced) / (double)connects : 0.0,
+          InspectCtlRate(current->sched.served[TL_INSPECT_SCHED_CLASS_REAUTH],
+                         previous->sched.served[TL_INSPECT_SCHED_CLASS_REAUTH], seconds),
+          InspectCtlRate(current->sched.overdue[TL_INSPECT_SCHED_CLASS_REAUTH],
+                         previous->sched.overdue[TL_INSPECT_SCHED_CLASS_REAUTH], seconds),
+          InspectCtlRate(current->sched.served[TL_INSPECT_SCHED_CLASS_DATA],
+                         previous->sched.served[TL_INSPECT_SCHED_CLASS_DATA], seconds),
+          InspectCtlRate(current->sched.overdue[TL_INSPECT_SCHED_CLASS_DATA],
+                         previous->sched.overdue[TL_INSPECT_SCHED_CLASS_DATA], seconds));
+   printf("dequeue: %.2f locks/item, %.1f packets/splice, %.0f wakeups/s "
+          "(%.0f coalesced/s)\n",
+          (dequeued != 0) ? (double)locks / (double)dequeued : 0.0,
+          (splices != 0) ? (double)spliced / (double)splices : 0.0,
+          InspectCtlRate(current->dequeue.wakeups, previous->dequeue.wakeups, seconds),
+          InspectCtlRate(current->dequeue.wakeupsCoalesced,
+                         previous->dequeue.wakeupsCoalesced, seconds));
+   printf("verdicts: daemon %s, %.0f submitted/s, %.1f descriptors/exchange, "
+          "%.0f decided/s, %.0f unknown/s, %.0f timeouts/s, %.0f overflows/s, "
+          "%d pending\n",
+          current->verdictDaemon ? "attached" : "detached",
+          InspectCtlRate(current->verdict.submitted, previous->verdict.submitted, seconds),
+          (exchanges != 0) ? (double)delivered / (double)exchanges : 0.0,
+          InspectCtlRate(current->verdict.verdicts, previous->verdict.verdicts, seconds),
+          InspectCtlRate(current->verdict.unknown, previous->verdict.unknown, seconds),
+          InspectCtlRate(current->verdict.timeouts, previous->verdict.timeouts, seconds),
+          InspectCtlRate(current->verdict.overflows, previous->verdict.overflows, seconds),
+          current->verdictPending);
+   printf("packet ring: %u partitions, snap %u, %.0f published/s (%.0f KB/s), "
+          "%.0f full/s, %.0f completions/s, %.0f waits/s, %.0f wakeups/s\n",
+          current->packetRingPartitions,
+          current->packetRingSnapLength,
+          InspectCtlRate(current->packetRing.published, previous->packetRing.published, seconds),
+          InspectCtlRate(current->packetRing.capturedBytes,
+                         previous->packetRing.capturedBytes, seconds) / 1024,
+          InspectCtlRate(current->packetRing.full, previous->packetRing.full, seconds),
+          InspectCtlRate(current->packetRing.completions,
+                         previous->packetRing.completions, seconds),
+          InspectCtlRate(current->packetRing.waits, previous->packetRing.waits, seconds),
+          InspectCtlRate(current->packetRing.wakeups, previous->packetRing.wakeups, seconds));
+   printf("timers: connect timeout %u ms, %.0f connect timeouts/s, "
+          "%.0f re-auth timeouts/s, %.0f fired/s (%.0f re-armed/s), %d armed\n\n",
+          current->connectTimeout,
+          InspectCtlRate(current->timers.connectTimeouts,
+                         previous->timers.connectTimeouts, seconds),
+          InspectCtlRate(current->timers.reauthTimeouts,
+                         previous->timers.reauthTimeouts, seconds),
+          InspectCtlRate(current->timers.fired, previous->timers.fired, seconds),
+          InspectCtlRate(current->timers.rearmed, previous->timers.rearmed, seconds),
+          current->timersArmed);
+   fflush(stdout);
+}
+
+DWORD
+InspectCtlStats(
+   _In_ HANDLE device
+   )
+/* ++
+
+   Maps the statistics page and reads it directly; no request is sent to
+   the driver after the mapping. The page stays mapped until the device
+   handle is closed.
+
+-- */
+{
+   TL_INSPECT_STATS_MAPPING mapping;
+   const volatile TL_INSPECT_STATS_PAGE* page;
+   TL_INSPECT_STATS_PAGE previous;
+   TL_INSPECT_STATS_PAGE current;
+   INT32 packetQueueDepthMax = 0;
+   UINT32 polls = 0;
+   DWORD bytesReturned;
+
+   if (!DeviceIoControl(
+          device,
+          IOCTL_TL_INSPECT_MAP_STATS,
+          NULL,
+          0,
+          &mapping,
+          sizeof(mapping),
+          &bytesReturned,
+          NULL
+          ))
+   {
+      return GetLastError();
+   }
+
+   page = (const volatile TL_INSPECT_STATS_PAGE*)(ULONG_PTR)mapping.address;
+
+   InspectCtlReadStatsPage(page, &previous);
+
+   SetConsoleCtrlHandler(InspectCtlConsoleHandler, TRUE);
+
+   while (!gStop)
+   {
+      Sleep(INSPECTCTL_POLL_INTERVAL);
+
+      InspectCtlReadStatsPage(page, &current);
+
+      if (current.packetQueueDepth > packetQueueDepthMax)
+      {
+         packetQueueDepthMax = current.packetQueueDepth;
+      }
+
+      if (++polls < INSPECTCTL_STATS_REPORT_POLLS)
+      {
+         continue;
+      }
+
+      InspectCtlPrintStats(&previous, &current, packetQueueDepthMax);
+
+      previous = current;
+      packetQueueDepthMax = 0;
+      polls = 0;
+   }
+
+   return ERROR_SUCCESS;
+}
+
+double
+InspectCtlMicroseconds(
+   _In_ UINT64 latency
+   )
+{
+   return (double)latency / 10.0;
+}
+
+DWORD
+InspectCtlLatency(
+   _In_ HANDLE device
+   )
+{
+   TL_INSPECT_LATENCY_INFO info;
+   DWORD bytesReturned;
+   ULONG type;
+   ULONG direction;
+   ULONG stage;
+
+   if (!DeviceIoControl(
+          device,
+          IOCTL_TL_INSPECT_QUERY_LATENCY,
+          NULL,
+          0,
+          &info,
+          sizeof(info),
+          &bytesReturned,
+          NULL
+          ))
+   {
+      return GetLastError();
+   }
+
+   printf("%-8s %-3s %-8s %12s %10s %10s %10s %10s\n",
+          "type", "dir", "stage", "count",
+          "p50 us", "p99 us", "p99.9 us", "max us");
+
+   for (type = 0; type < TL_INSPECT_LATENCY_PACKET_TYPES; type++)
+   {
+      for (direction = 0; direction < TL_INSPECT_LATENCY_DIRECTIONS; direction++)
+      {
+         for (stage = 0; stage < TL_INSPECT_LATENCY_STAGE_MAX; stage++)
+         {
+            const TL_INSPECT_LATENCY_PERCENTILES* latency =
+               &info.latency[type][direction][stage];
+
+            if (latency->count == 0)
+            {
+               continue;
+            }
+
+            printf("%-8s %-3s %-8s %12llu %10.1f %10.1f %10.1f %10.1f\n",
+                   InspectCtlPacketTypeNames[type],
+                   InspectCtlDirectionNames[direction],
+                   InspectCtlStageNames[stage],
+                   latency->count,
+                   InspectCtlMicroseconds(latency->p50),
+                   InspectCtlMicroseconds(latency->p99),
+                   InspectCtlMicroseconds(latency->p999),
+                   InspectCtlMicroseconds(latency->max));
+         }
+      }
+   }
+
+   return ERROR_SUCCESS;
+}
+
+LONG64
+InspectCtlFailures(
+   _In_ const TL_INSPECT_STATS_PAGE* page
+   )
+{
+   LONG64 failures = 0;
+   UINT32 i;
+
+   for (i = 0; i < TL_INSPECT_CLASSIFY_FUNCTION_MAX; i++)
+   {
+      failures += page->classify[i].allocationFailures +
+                  page->classify[i].reinjectFailures;
+   }
+
+   return failures;
+}
+
+DWORD
+InspectCtlReload(
+   _In_ HANDLE device,
+   _In_ ULONG count
+   )
+/* ++
+
+   Reloads the policy count times. The statistics page is mapped to report
+   the traffic handled while reloading: a policy swap must not lose pended
+   packets, so the failures should not move.
+
+-- */
+{
+   TL_INSPECT_STATS_MAPPING mapping;
+   const volatile TL_INSPECT_STATS_PAGE* page;
+   TL_INSPECT_STATS_PAGE before;
+   TL_INSPECT_STATS_PAGE after;
+   TL_INSPECT_POLICY_INFO info;
+   LARGE_INTEGER frequency;
+   LARGE_INTEGER start;
+   LARGE_INTEGER end;
+   double seconds;
+   DWORD bytesReturned;
+   ULONG i;
+
+   if (!DeviceIoControl(
+          device,
+          IOCTL_TL_INSPECT_MAP_STATS,
+          NULL,
+          0,
+          &mapping,
+          sizeof(mapping),
+          &bytesReturned,
+          NULL
+          ))
+   {
+      return GetLastError();
+   }
+
+   page = (const volatile TL_INSPECT_STATS_PAGE*)(ULONG_PTR)mapping.address;
+
+   InspectCtlReadStatsPage(page, &before);
+
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&start);
+
+   for (i = 0; i < count; i++)
+   {
+      if (!DeviceIoControl(
+             device,
+             IOCTL_TL_INSPECT_RELOAD_POLICY,
+             NULL,
+             0,
+             &info,
+             sizeof(info),
+             &bytesReturned,
+             NULL
+             ))
+      {
+         return GetLastError();
+      }
+   }
+
+   QueryPerformanceCounter(&end);
+
+   InspectCtlReadStatsPage(page, &after);
+
+   seconds = (double)(end.QuadPart - start.QuadPart) /
+             (double)frequency.QuadPart;
+
+   printf("policy version:    %u\n", info.version);
+   printf("traffic:           %s\n", info.permitTraffic ? "permit" : "block");
+   printf("prefixes:          %u\n", info.prefixCount);
+   printf("rules:             %u\n", info.ruleCount);
+   printf("load time (us):    %.1f\n", InspectCtlMicroseconds(info.loadTime));
+
+   if ((count > 1) && (seconds > 0))
+   {
+      printf("reloads/s:         %.0f\n", (double)count / seconds);
+   }
+
+   printf("pended:            %lld\n", after.pendedCount - before.pendedCount);
+   printf("reinjected:        %lld\n", after.reinjectCount - before.reinjectCount);
+   printf("failures:          %lld\n",
+          InspectCtlFailures(&after) - InspectCtlFailures(&before));
+
+   return ERROR_SUCCESS;
+}
+
+//
+// INSPECTCTL_EXCHANGE is one outstanding exchange request of the daemon:
+// the verdicts it returns and the descriptors it is completed with.
+//
+typedef struct INSPECTCTL_EXCHANGE_
+{
+   OVERLAPPED overlapped;
+   BOOL pending;
+
+   union
+   {
+      TL_INSPECT_VERDICT_BATCH batch;
+      BYTE input[FIELD_OFFSET(TL_INSPECT_VERDICT_BATCH, verdicts) +
+                 INSPECTCTL_DAEMON_BATCH * sizeof(TL_INSPECT_VERDICT)];
+   };
+   union
+   {
+      TL_INSPECT_VERDICT_REQUESTS requests;
+      BYTE output[FIELD_OFFSET(TL_INSPECT_VERDICT_REQUESTS, requests) +
+                  INSPECTCTL_DAEMON_BATCH * sizeof(TL_INSPECT_VERDICT_REQUEST)];
+   };
+} INSPECTCTL_EXCHANGE;
+
+DWORD
+InspectCtlSendExchange(
+   _In_ HANDLE device,
+   _Inout_ INSPECTCTL_EXCHANGE* exchange
+   )
+/* ++
+
+   Sends the verdicts of the exchange and waits for descriptors in the
+   background; the completion is posted to the completion port of the
+   device handle.
+
+-- */
+{
+   DWORD error = ERROR_SUCCESS;
+
+   ZeroMemory(&exchange->overlapped, sizeof(exchange->overlapped));
+
+   if (!DeviceIoControl(
+          device,
+          IOCTL_TL_INSPECT_EXCHANGE_VERDICTS,
+          exchange->input,
+          FIELD_OFFSET(TL_INSPECT_VERDICT_BATCH, verdicts) +
+             exchange->batch.count * sizeof(TL_INSPECT_VERDICT),
+          exchange->output,
+          sizeof(exchange->output),
+          NULL,
+          &exchange->overlapped
+          ))
+   {
+      error = GetLastError();
+      if (error == ERROR_IO_PENDING)
+      {
+         error = ERROR_SUCCESS;
+      }
+   }
+
+   exchange->pending = (error == ERROR_SUCCESS);
+
+   return error;
+}
+
+BOOL
+InspectCtlDaemonBlocks(
+   _In_ const TL_INSPECT_VERDICT_REQUEST* request,
+   _In_reads_(portCount) const UINT16* ports,
+   _In_ ULONG portCount
+   )
+{
+   ULONG i;
+
+   for (i = 0; i < portCount; i++)
+   {
+      if (request->remotePort == ports[i])
+      {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+DWORD
+InspectCtlDaemon(
+   _In_ HANDLE device,
+   _In_ ULONG outstanding,
+   _In_reads_(portCount) const UINT16* ports,
+   _In_ ULONG portCount
+   )
+/* ++
+
+   Runs as the policy daemon of the driver. Each completed exchange is
+   answered at once with the verdicts on its descriptors, which sends it
+   again, so that outstanding requests stay parked in the driver. The
+   device handle must have been opened for overlapped I/O.
+
+-- */
+{
+   INSPECTCTL_EXCHANGE* exchanges;
+   HANDLE port;
+   DWORD error = ERROR_SUCCESS;
+   DWORD bytesReturned;
+   ULONG_PTR key;
+   OVERLAPPED* overlapped;
+   ULONGLONG lastReport;
+   ULONG64 permits = 0;
+   ULONG64 blocks = 0;
+   ULONG64 roundTrips = 0;
+   ULONG i;
+
+   exchanges = calloc(outstanding, sizeof(INSPECTCTL_EXCHANGE));
+   if (exchanges == NULL)
+   {
+      return ERROR_NOT_ENOUGH_MEMORY;
+   }
+
+   port = CreateIoCompletionPort(device, NULL, 0, 1);
+   if (port == NULL)
+   {
+      error = GetLastError();
+      goto Exit;
+   }
+
+   SetConsoleCtrlHandler(InspectCtlConsoleHandler, TRUE);
+
+   for (i = 0; i < outstanding; i++)
+   {
+      error = InspectCtlSendExchange(device, &exchanges[i]);
+      if (error != ERROR_SUCCESS)
+      {
+         goto Exit;
+      }
+   }
+
+   lastReport = GetTickCount64();
+
+   while (!gStop)
+   {
+      INSPECTCTL_EXCHANGE* exchange;
+      UINT32 count;
+
+      if (GetTickCount64() - lastReport >= 1000)
+      {
+         printf("%llu decided (%llu permitted, %llu blocked) in %llu round trips\n",
+                permits + blocks, permits, blocks, roundTrips);
+         fflush(stdout);
+
+         permits = 0;
+         blocks = 0;
+         roundTrips = 0;
+         lastReport = GetTickCount64();
+      }
+
+      if (!GetQueuedCompletionStatus(
+             port,
+             &bytesReturned,
+             &key,
+             &overlapped,
+             INSPECTCTL_POLL_INTERVAL
+             ))
+      {
+         if (overlapped == NULL)
+         {
+            continue;
+         }
+
+         CONTAINING_RECORD(overlapped, INSPECTCTL_EXCHANGE, overlapped)->pending = FALSE;
+         error = GetLastError();
+         goto Exit;
+      }
+
+      exchange = CONTAINING_RECORD(overlapped, INSPECTCTL_EXCHANGE, overlapped);
+      exchange->pending = FALSE;
+      roundTrips++;
+
+      count = (bytesReturned != 0) ? exchange->requests.count : 0;
+
+      for (i = 0; i < count; i++)
+      {
+         const TL_INSPECT_VERDICT_REQUEST* request = &exchange->requests.requests[i];
+         TL_INSPECT_VERDICT* verdict = &exchange->batch.verdicts[i];
+
+         verdict->id = request->id;
+         verdict->reserved = 0;
+
+         if (InspectCtlDaemonBlocks(request, ports, portCount))
+         {
+            verdict->verdict = TL_INSPECT_VERDICT_BLOCK;
+            blocks++;
+         }
+         else
+         {
+            verdict->verdict = TL_INSPECT_VERDICT_PERMIT;
+            permits++;
+         }
+      }
+
+      exchange->batch.count = count;
+      exchange->batch.reserved = 0;
+
+      error = InspectCtlSendExchange(device, exchange);
+      if (error != ERROR_SUCCESS)
+      {
+         goto Exit;
+      }
+   }
+
+Exit:
+
+   if (port != NULL)
+   {
+      //
+      // The buffers are freed once every request has completed.
+      //
+      CancelIoEx(device, NULL);
+
+      for (i = 0; i < outstanding; i++)
+      {
+         while (exchanges[i].pending)
+         {
+            if (GetQueuedCompletionStatus(port, &bytesReturned, &key, &overlapped, INFINITE) ||
+                (overlapped != NULL))
+            {
+               CONTAINING_RECORD(overlapped, INSPECTCTL_EXCHANGE, overlapped)->pending = FALSE;
+            }
+         }
+      }
+
+      CloseHandle(port);
+   }
+
+   free(exchanges);
+
+   return (error == ERROR_OPERATION_ABORTED) ? ERROR_SUCCESS : error;
+}
+
+DWORD
+InspectCtlDaemonCommand(
+   _In_ HANDLE device,
+   _In_ int argc,
+   _In_reads_(argc) char* argv[]
+   )
+{
+   UINT16 ports[INSPECTCTL_DAEMON_MAX_PORTS];
+   ULONG portCount = 0;
+   ULONG outstanding = 4;
+   int i;
+
+   if (argc > 2)
+   {
+      outstanding = strtoul(argv[2], NULL, 0);
+   }
+
+   if ((outstanding == 0) || (outstanding > INSPECTCTL_DAEMON_MAX_OUTSTANDING))
+   {
+      return ERROR_INVALID_PARAMETER;
+   }
+
+   for (i = 3; i < argc; i++)
+   {
+      if (portCount == INSPECTCTL_DAEMON_MAX_PORTS)
+      {
+         return ERROR_INVALID_PARAMETER;
+      }
+
+      ports[portCount++] = (UINT16)strtoul(argv[i], NULL, 0);
+   }
+
+   return InspectCtlDaemon(device, outstanding, ports, portCount);
+}
+
+//
+// INSPECTCTL_RING_THREAD is a thread of the daemon, which polls one
+// partition of the packet ring. The counters are read by the main thread.
+//
+typedef struct INSPECTCTL_RING_THREAD_
+{
+   HANDLE device;
+   HANDLE thread;
+   UINT32 partition;
+   const TL_INSPECT_PACKET_RING_MAPPING* mapping;
+   const UINT16* ports;
+   ULONG portCount;
+   DWORD error;
+
+   volatile LONG64 permits;
+   volatile LONG64 blocks;
+   volatile LONG64 capturedBytes;
+   volatile LONG64 waits;
+} INSPECTCTL_RING_THREAD;
+
+DWORD
+InspectCtlRingWait(
+   _Inout_ INSPECTCTL_RING_THREAD* ringThread,
+   _Inout_ OVERLAPPED* overlapped
+   )
+/* ++
+
+   Waits until the driver writes to the partition of the thread, or Ctrl+C
+   is pressed.
+
+-- */
+{
+   DWORD error = ERROR_SUCCESS;
+   DWORD bytesReturned;
+
+   ResetEvent(overlapped->hEvent);
+
+   if (!DeviceIoControl(
+          ringThread->device,
+          IOCTL_TL_INSPECT_WAIT_PACKET_RING,
+          &ringThread->partition,
+          sizeof(ringThread->partition),
+          NULL,
+          0,
+          NULL,
+          overlapped
+          ))
+   {
+      error = GetLastError();
+      if (error != ERROR_IO_PENDING)
+      {
+         return error;
+      }
+      error = ERROR_SUCCESS;
+   }
+
+   ringThread->waits++;
+
+   while (WaitForSingleObject(overlapped->hEvent, INSPECTCTL_POLL_INTERVAL) ==
+             WAIT_TIMEOUT)
+   {
+      if (gStop)
+      {
+         CancelIoEx(ringThread->device, overlapped);
+         break;
+      }
+   }
+
+   if (!GetOverlappedResult(ringThread->device, overlapped, &bytesReturned, TRUE))
+   {
+      error = GetLastError();
+   }
+
+   return (error == ERROR_OPERATION_ABORTED) ? ERROR_SUCCESS : error;
+}
+
+DWORD WINAPI
+InspectCtlRingThread(
+   _In_ void* parameter
+   )
+/* ++
+
+   Decides the descriptors written to one partition of the packet ring, as
+   InspectCtlDaemon does, and writes the verdicts to its completion ring.
+   The indices are only written once per run of descriptors. The thread
+   waits in the driver once it polled the partition empty for a while, or
+   once the completion ring is full, which the wait request drains.
+
+-- */
+{
+   INSPECTCTL_RING_THREAD* ringThread = parameter;
+   const TL_INSPECT_PACKET_RING_MAPPING* mapping = ringThread->mapping;
+   BYTE* base = (BYTE*)(ULONG_PTR)mapping->address +
+                (SIZE_T)ringThread->partition * mapping->partitionSize;
+   TL_INSPECT_PACKET_RING_HEADER* header = (TL_INSPECT_PACKET_RING_HEADER*)base;
+   const TL_INSPECT_PACKET_DESCRIPTOR* descriptors =
+      (const TL_INSPECT_PACKET_DESCRIPTOR*)(base + mapping->descriptorOffset);
+   TL_INSPECT_VERDICT* completions =
+      (TL_INSPECT_VERDICT*)(base + mapping->completionOffset);
+   UINT64 mask = mapping->size - 1;
+   UINT64 consumer = header->descriptorConsumer;
+   UINT64 producer = header->completionProducer;
+   OVERLAPPED overlapped;
+   ULONG idle = 0;
+
+   ZeroMemory(&overlapped, sizeof(overlapped));
+
+   overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+   if (overlapped.hEvent == NULL)
+   {
+      ringThread->error = GetLastError();
+      return ringThread->error;
+   }
+
+   while (!gStop)
+   {
+      UINT64 available = (UINT64)ReadAcquire64((volatile LONG64*)&header->descriptorProducer) -
+                         consumer;
+      UINT64 space = mapping->size -
+                     (producer - (UINT64)ReadAcquire64((volatile LONG64*)&header->completionConsumer));
+      UINT64 count = min(available, space);
+      UINT64 i;
+
+      if (count == 0)
+      {
+         if (++idle < INSPECTCTL_RING_SPINS)
+         {
+            YieldProcessor();
+            continue;
+         }
+
+         idle = 0;
+
+         ringThread->error = InspectCtlRingWait(ringThread, &overlapped);
+         if (ringThread->error != ERROR_SUCCESS)
+         {
+            break;
+         }
+
+         continue;
+      }
+
+      idle = 0;
+
+      for (i = 0; i < count; i++)
+      {
+         const TL_INSPECT_PACKET_DESCRIPTOR* descriptor =
+            &descriptors[(consumer + i) & mask];
+         TL_INSPECT_VERDICT* verdict = &completions[(producer + i) & mask];
+
+         verdict->id = descriptor->request.id;
+         verdict->reserved = 0;
+
+         if (InspectCtlDaemonBlocks(&descriptor->request,
+                                    ringThread->ports,
+                                    ringThread->portCount))
+         {
+            verdict->verdict = TL_INSPECT_VERDICT_BLOCK;
+            ringThread->blocks++;
+         }
+         else
+         {
+            verdict->verdict = TL_INSPECT_VERDICT_PERMIT;
+            ringThread->permits++;
+         }
+
+         ringThread->capturedBytes += descriptor->capturedLength;
+      }
+
+      //
+      // The frames are not looked at once the descriptors are released.
+      //
+      producer += count;
+      consumer += count;
+
+      WriteRelease64((volatile LONG64*)&header->completionProducer, (LONG64)producer);
+      WriteRelease64((volatile LONG64*)&header->descriptorConsumer, (LONG64)consumer);
+   }
+
+   CloseHandle(overlapped.hEvent);
+
+   return ringThread->error;
+}
+
+DWORD
+InspectCtlRing(
+   _In_ HANDLE device,
+   _In_ ULONG threads,
+   _In_ ULONG snapLength,
+   _In_reads_(portCount) const UINT16* ports,
+   _In_ ULONG portCount
+   )
+/* ++
+
+   Runs as the policy daemon of the driver through the packet ring, with a
+   thread per partition. The device handle must have been opened for
+   overlapped I/O.
+
+-- */
+{
+   TL_INSPECT_PACKET_RING_SETUP setup;
+   TL_INSPECT_PACKET_RING_MAPPING mapping;
+   INSPECTCTL_RING_THREAD* ringThreads;
+   OVERLAPPED overlapped;
+   DWORD error = ERROR_SUCCESS;
+   DWORD bytesReturned;
+   LONG64 lastPermits = 0;
+   LONG64 lastBlocks = 0;
+   LONG64 lastWaits = 0;
+   LONG64 lastBytes = 0;
+   ULONG started = 0;
+   ULONG i;
+
+   ringThreads = calloc(threads, sizeof(INSPECTCTL_RING_THREAD));
+   if (ringThreads == NULL)
+   {
+      return ERROR_NOT_ENOUGH_MEMORY;
+   }
+
+   ZeroMemory(&overlapped, sizeof(overlapped));
+
+   overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+   if (overlapped.hEvent == NULL)
+   {
+      error = GetLastError();
+      goto Exit;
+   }
+
+   setup.partitions = threads;
+   setup.snapLength = snapLength;
+
+   if (!DeviceIoControl(
+          device,
+          IOCTL_TL_INSPECT_MAP_PACKET_RING,
+          &setup,
+          sizeof(setup),
+          &mapping,
+          sizeof(mapping),
+          NULL,
+          &overlapped
+          ) &&
+       (GetLastError() != ERROR_IO_PENDING))
+   {
+      error = GetLastError();
+      goto Exit;
+   }
+
+   if (!GetOverlappedResult(device, &overlapped, &bytesReturned, TRUE))
+   {
+      error = GetLastError();
+      goto Exit;
+   }
+
+   printf("packet ring mapped at %p: %u partitions of %u KB, %u descriptors "
+          "each, snap %u\n",
+          (void*)(ULONG_PTR)mapping.address,
+          mapping.partitions,
+          mapping.partitionSize / 1024,
+          mapping.size,
+          mapping.snapLength);
+
+   SetConsoleCtrlHandler(InspectCtlConsoleHandler, TRUE);
+
+   for (i = 0; i < threads; i++)
+   {
+      ringThreads[i].device = device;
+      ringThreads[i].partition = i;
+      ringThreads[i].mapping = &mapping;
+      ringThreads[i].ports = ports;
+      ringThreads[i].portCount = portCount;
+
+      ringThreads[i].thread = CreateThread(
+                                 NULL,
+                                 0,
+                                 InspectCtlRingThread,
+                                 &ringThreads[i],
+                                 0,
+                                 NULL
+                                 );
+      if (ringThreads[i].thread == NULL)
+      {
+         error = GetLastError();
+         gStop = TRUE;
+         goto Exit;
+      }
+
+      started++;
+   }
+
+   while (!gStop)
+   {
+      LONG64 permits = 0;
+      LONG64 blocks = 0;
+      LONG64 waits = 0;
+      LONG64 bytes = 0;
+
+      Sleep(1000);
+
+      for (i = 0; i < threads; i++)
+      {
+         permits += ringThreads[i].permits;
+         blocks += ringThreads[i].blocks;
+         waits += ringThreads[i].waits;
+         bytes += ringThreads[i].capturedBytes;
+      }
+
+      printf("%lld decided (%lld permitted, %lld blocked), %lld waits, %lld KB captured\n",
+             (permits - lastPermits) + (blocks - lastBlocks),
+             permits - lastPermits,
+             blocks - lastBlocks,
+             waits - lastWaits,
+             (bytes - lastBytes) / 1024);
+      fflush(stdout);
+
+      lastPermits = permits;
+      lastBlocks = blocks;
+      lastWaits = waits;
+      lastBytes = bytes;
+   }
+
+Exit:
+
+   for (i = 0; i < started; i++)
+   {
+      WaitForSingleObject(ringThreads[i].thread, INFINITE);
+      CloseHandle(ringThreads[i].thread);
+
+      if ((error == ERROR_SUCCESS) && (ringThreads[i].error != ERROR_SUCCESS))
+      {
+         error = ringThreads[i].error;
+      }
+   }
+
+   if (overlapped.hEvent != NULL)
+   {
+      CloseHandle(overlapped.hEvent);
+   }
+
+   free(ringThreads);
+
+   return error;
+}
+
+DWORD
+InspectCtlRingCommand(
+   _In_ HANDLE device,
+   _In_ int argc,
+   _In_reads_(argc) char* argv[]
+   )
+{
+   UINT16 ports[INSPECTCTL_DAEMON_MAX_PORTS];
+   ULONG portCount = 0;
+   ULONG threads = 4;
+   ULONG snapLength = 64;
+   int i;
+
+   if (argc > 2)
+   {
+      threads = strtoul(argv[2], NULL, 0);
+   }
+
+   if (argc > 3)
+   {
+      snapLength = strtoul(argv[3], NULL, 0);
+   }
+
+   if ((threads == 0) || (threads > TL_INSPECT_PACKET_RING_MAX_PARTITIONS) ||
+       (snapLength > TL_INSPECT_PACKET_RING_MAX_SNAP_LENGTH))
+   {
+      return ERROR_INVALID_PARAMETER;
+   }
+
+   for (i = 4; i < argc; i++)
+   {
+      if (portCount == INSPECTCTL_DAEMON_MAX_PORTS)
+      {
+         return ERROR_INVALID_PARAMETER;
+      }
+
+      ports[portCount++] = (UINT16)strtoul(argv[i], NULL, 0);
+   }
+
+   return InspectCtlRing(device, threads, snapLength, ports, portCount);
+}
+
+void
+InspectCtlUsage(void)
+{
+   fprintf(stderr,
+           "usage: inspectctl trace [-json]\n"
+           "       inspectctl level <0-4>\n"
+           "       inspectctl info\n"
+           "       inspectctl stats\n"
+           "       inspectctl latency\n"
+           "       inspectctl reload [count]\n"
+           "       inspectctl daemon [outstanding] [blocked remote port ...]\n"
+           "       inspectctl ring [threads] [snap length] [blocked remote port ...]\n");
+}
+
+int __cdecl
+main(
+   _In_ int argc,
+   _In_reads_(argc) char* argv[]
+   )
+{
+   DWORD result;
+   HANDLE device;
+
+   if (argc < 2)
+   {
+      InspectCtlUsage();
+      return 1;
+   }
+
+   device = CreateFileW(
+               TL_INSPECT_USER_DEVICE_NAME,
+               GENERIC_READ | GENERIC_WRITE,
+               0,
+               NULL,
+               OPEN_EXISTING,
+               ((strcmp(argv[1], "daemon") == 0) || (strcmp(argv[1], "ring") == 0)) ?
+                  FILE_FLAG_OVERLAPPED : 0,
+               NULL
+               );
+   if (device == INVALID_HANDLE_VALUE)
+   {
+      fprintf(stderr, "Cannot open the Inspect control device (%lu).\n",
+              GetLastError());
+      return 1;
+   }
+
+   if (strcmp(argv[1], "trace") == 0)
+   {
+      result = InspectCtlTrace(
+                  device,
+                  (argc > 2) && (strcmp(argv[2], "-json") == 0)
+                  );
+   }
+   else if ((strcmp(argv[1], "level") == 0) && (argc > 2))
+   {
+      result = InspectCtlSetTraceLevel(device, strtoul(argv[2], NULL, 0));
+   }
+   else if (strcmp(argv[1], "info") == 0)
+   {
+      result = InspectCtlInfo(device);
+   }
+   else if (strcmp(argv[1], "stats") == 0)
+   {
+      result = InspectCtlStats(device);
+   }
+   else if (strcmp(argv[1], "latency") == 0)
+   {
+      result = InspectCtlLatency(device);
+   }
+   else if (strcmp(argv[1], "reload") == 0)
+   {
+      ULONG count = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1;
+
+      result = (count != 0) ? InspectCtlReload(device, count) :
+                              ERROR_INVALID_PARAMETER;
+   }
+   else if (strcmp(argv[1], "daemon") == 0)
+   {
+      result = InspectCtlDaemonCommand(device, argc, argv);
+   }
+   else if (strcmp(argv[1], "ring") == 0)
+   {
+      result = InspectCtlRingCommand(device, argc, argv);
+   }
+   else
+   {
+      InspectCtlUsage();
+      result = ERROR_INVALID_PARAMETER;
+   }
+
+   CloseHandle(device);
+
+   if (result != ERROR_SUCCESS)
+   {
+      fprintf(stderr, "inspectctl failed (%lu).\n", result);
+      return 1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,685 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the control device interface of the Transport
+   Inspect sample: the device name, the IOCTL codes and the structures
+   exchanged through them. It is shared by the driver and the user-mode
+   tools.
+
+Environment:
+
+    Kernel mode and user mode
+
+--*/
+
+#ifndef _TL_INSPECT_IOCTL_H_
+#define _TL_INSPECT_IOCTL_H_
+
+#define TL_INSPECT_DEVICE_NAME L"\\Device\\TLInspect"
+#define TL_INSPECT_SYMBOLIC_LINK_NAME L"\\DosDevices\\Global\\TLInspect"
+#define TL_INSPECT_USER_DEVICE_NAME L"\\\\.\\TLInspect"
+
+#define TL_INSPECT_IOCTL(function, access) \
+   CTL_CODE(FILE_DEVICE_NETWORK, 0x800 + (function), METHOD_BUFFERED, (access))
+
+//
+// Input: TL_INSPECT_TRACE_READ_INPUT
+// Output: TL_INSPECT_TRACE_READ_OUTPUT, followed by the records
+//
+#define IOCTL_TL_INSPECT_READ_TRACE \
+   TL_INSPECT_IOCTL(0, FILE_READ_ACCESS)
+
+//
+// Output: TL_INSPECT_TRACE_INFO
+//
+#define IOCTL_TL_INSPECT_QUERY_TRACE_INFO \
+   TL_INSPECT_IOCTL(1, FILE_READ_ACCESS)
+
+//
+// Input: ULONG, the new TL_INSPECT_TRACE_LEVEL
+//
+#define IOCTL_TL_INSPECT_SET_TRACE_LEVEL \
+   TL_INSPECT_IOCTL(2, FILE_WRITE_ACCESS)
+
+//
+// Maps the statistics page (TL_INSPECT_STATS_PAGE) read-only into the
+// calling process; the mapping lasts until the handle is closed. Mapping
+// again through the same handle returns the same address.
+//
+// Output: TL_INSPECT_STATS_MAPPING
+//
+#define IOCTL_TL_INSPECT_MAP_STATS \
+   TL_INSPECT_IOCTL(3, FILE_READ_ACCESS)
+
+//
+// Output: TL_INSPECT_LATENCY_INFO
+//
+#define IOCTL_TL_INSPECT_QUERY_LATENCY \
+   TL_INSPECT_IOCTL(4, FILE_READ_ACCESS)
+
+//
+// Reloads the inspection policy from the Parameters key of the driver; the
+// current policy is kept if the new one cannot be loaded.
+//
+// Output (optional): TL_INSPECT_POLICY_INFO
+//
+#define IOCTL_TL_INSPECT_RELOAD_POLICY \
+   TL_INSPECT_IOCTL(5, FILE_WRITE_ACCESS)
+
+//
+// Exchanges verdicts for descriptors of pended traffic with the policy
+// daemon (see verdict.c). The first handle to send it becomes the daemon
+// until it is closed; the requests of other handles fail with
+// STATUS_DEVICE_BUSY. The request returns the verdicts it carries, then
+// completes once descriptors are waiting to be decided; the daemon keeps
+// several requests outstanding so that the driver always has one to
+// complete.
+//
+// Input: TL_INSPECT_VERDICT_BATCH, followed by the verdicts
+// Output: TL_INSPECT_VERDICT_REQUESTS, followed by the descriptors
+//
+#define IOCTL_TL_INSPECT_EXCHANGE_VERDICTS \
+   TL_INSPECT_IOCTL(6, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+//
+// Maps the packet ring (TL_INSPECT_PACKET_RING_MAPPING) into the calling
+// process and makes the handle the policy daemon, which then receives the
+// descriptors of the pended traffic, and the first bytes of the packets,
+// through the ring instead of exchange requests, and writes its verdicts
+// back to the completion rings. It fails with STATUS_DEVICE_BUSY if
+// another handle is the daemon, and with STATUS_INVALID_DEVICE_STATE if
+// this one exchanged verdicts or mapped the ring already. The mapping
+// lasts until the handle is closed.
+//
+// Input: TL_INSPECT_PACKET_RING_SETUP
+// Output: TL_INSPECT_PACKET_RING_MAPPING
+//
+#define IOCTL_TL_INSPECT_MAP_PACKET_RING \
+   TL_INSPECT_IOCTL(7, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+//
+// Consumes the completion rings, then waits until a partition of the
+// packet ring holds descriptors the daemon has not consumed. The daemon
+// only sends it once it found the partition empty; while descriptors keep
+// coming, neither side makes a system call.
+//
+// Input: UINT32, the partition
+//
+#define IOCTL_TL_INSPECT_WAIT_PACKET_RING \
+   TL_INSPECT_IOCTL(8, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+//
+// An event is recorded when its level is at or below the current trace
+// level.
+//
+typedef enum TL_INSPECT_TRACE_LEVEL_
+{
+   TL_INSPECT_TRACE_LEVEL_NONE,
+   TL_INSPECT_TRACE_LEVEL_ERROR,     // failures to re-inject packets
+   TL_INSPECT_TRACE_LEVEL_VERDICT,   // inspection verdicts
+   TL_INSPECT_TRACE_LEVEL_PACKET,    // every classified packet
+   TL_INSPECT_TRACE_LEVEL_VERBOSE,   // also packets injected by the driver
+   TL_INSPECT_TRACE_LEVEL_MAX
+} TL_INSPECT_TRACE_LEVEL;
+
+typedef enum TL_INSPECT_TRACE_EVENT_
+{
+   TL_INSPECT_TRACE_EVENT_CLASSIFY = 1,
+   TL_INSPECT_TRACE_EVENT_VERDICT,
+   TL_INSPECT_TRACE_EVENT_INJECT_FAILURE
+} TL_INSPECT_TRACE_EVENT;
+
+typedef enum TL_INSPECT_TRACE_VERDICT_
+{
+   TL_INSPECT_TRACE_VERDICT_NONE,
+   TL_INSPECT_TRACE_VERDICT_PERMIT,
+   TL_INSPECT_TRACE_VERDICT_BLOCK,
+   TL_INSPECT_TRACE_VERDICT_PEND
+} TL_INSPECT_TRACE_VERDICT;
+
+//
+// TL_INSPECT_TRACE_RECORD is one trace event. Identical events (same fields
+// from layerId on) that follow each other on a processor within the
+// deduplication window are merged into one record, and count is the number
+// of occurrences.
+//
+// timestamp is the interrupt time, in 100ns units, of the first occurrence.
+// Addresses are in network order, ports in host order; addressFamily is 4
+// or 6.
+//
+typedef struct TL_INSPECT_TRACE_RECORD_
+{
+   UINT64 timestamp;
+   UINT32 count;
+   UINT16 processor;
+   UINT16 reserved0;
+
+   UINT16 layerId;
+   UINT8 event;
+   UINT8 direction;
+   UINT8 protocol;
+   UINT8 verdict;
+   UINT8 addressFamily;
+   UINT8 reserved1;
+   UINT16 localPort;
+   UINT16 remotePort;
+   UINT32 reserved2;
+
+   UINT8 localAddress[16];
+   UINT8 remoteAddress[16];
+} TL_INSPECT_TRACE_RECORD;
+
+typedef struct TL_INSPECT_TRACE_INFO_
+{
+   UINT32 processorCount;
+   UINT32 ringSize;
+   UINT32 level;
+   UINT32 dedupWindow;    // in milliseconds
+} TL_INSPECT_TRACE_INFO;
+
+//
+// Each processor has its own ring of records, numbered by a sequence that
+// starts at 0. A read returns the records of one processor from sequence
+// on; pass nextSequence to the next read. Records that were overwritten
+// before they could be read are counted in lost.
+//
+typedef struct TL_INSPECT_TRACE_READ_INPUT_
+{
+   UINT32 processor;
+   UINT32 reserved;
+   UINT64 sequence;
+} TL_INSPECT_TRACE_READ_INPUT;
+
+typedef struct TL_INSPECT_TRACE_READ_OUTPUT_
+{
+   UINT64 nextSequence;
+   UINT64 lost;
+   UINT32 recordCount;
+   UINT32 reserved;
+
+   TL_INSPECT_TRACE_RECORD records[1];
+} TL_INSPECT_TRACE_READ_OUTPUT;
+
+//
+// Classify functions of the driver, as indexed in the statistics page; each
+// is shared by the classifyFn functions of its layers.
+//
+typedef enum TL_INSPECT_CLASSIFY_FUNCTION_
+{
+   TL_INSPECT_CLASSIFY_CONNECT,        // TLInspectALEConnectClassifyLayer
+   TL_INSPECT_CLASSIFY_RECV_ACCEPT,    // TLInspectALERecvAcceptClassifyLayer
+   TL_INSPECT_CLASSIFY_TRANSPORT,      // TLInspectTransportClassifyLayer
+   TL_INSPECT_CLASSIFY_IP,             // TLInspectIpClassifyLayer
+   TL_INSPECT_CLASSIFY_FUNCTION_MAX
+} TL_INSPECT_CLASSIFY_FUNCTION;
+
+//
+// TL_INSPECT_CLASSIFY_COUNTERS counts the calls of one classify function
+// and how they ended: permitted, blocked, or absorbed and pended for the
+// worker threads. selfInjectedSkips counts the packets injected by the
+// driver itself that were permitted without inspection, and notInspected
+// the ones decided without inspection because their remote address is not
+// to be inspected or an inspection rule permits or blocks them.
+// reinjectFailures counts the pended packets of the function that could
+// not be re-injected. The structure fills a 64-byte cache line.
+//
+typedef struct TL_INSPECT_CLASSIFY_COUNTERS_
+{
+   LONG64 calls;
+   LONG64 permits;
+   LONG64 blocks;
+   LONG64 absorbs;
+   LONG64 selfInjectedSkips;
+   LONG64 allocationFailures;
+   LONG64 reinjectFailures;
+   LONG64 notInspected;
+} TL_INSPECT_CLASSIFY_COUNTERS;
+
+//
+// TL_INSPECT_FLOW_CACHE_COUNTERS counts the use of a verdict cache: the
+// flow cache, whose lookups are made by the transport and IP packet
+// classifies, or the connect cache, whose lookups are made by the ALE
+// classifies. hits are the lookups decided inline, and blockHits those of
+// them blocked. insertFailures counts the verdicts not cached because the
+// cache was full. expirations counts the entries freed or reused once
+// expired, and flushes the changes of the traffic policy that expired all
+// of them.
+//
+typedef struct TL_INSPECT_FLOW_CACHE_COUNTERS_
+{
+   LONG64 lookups;
+   LONG64 hits;
+   LONG64 blockHits;
+   LONG64 inserts;
+   LONG64 insertFailures;
+   LONG64 expirations;
+   LONG64 flushes;
+   LONG64 reserved;
+} TL_INSPECT_FLOW_CACHE_COUNTERS;
+
+//
+// Limits of the overload control; a classify that would exceed one of them
+// decides inline instead of pending (see overload.h).
+//
+typedef enum TL_INSPECT_OVERLOAD_REASON_
+{
+   TL_INSPECT_OVERLOAD_QUEUE_DEPTH,    // packets in the packet queue
+   TL_INSPECT_OVERLOAD_QUEUE_BYTES,    // bytes in the packet queue
+   TL_INSPECT_OVERLOAD_QUEUE_DELAY,    // time waited in the packet queue
+   TL_INSPECT_OVERLOAD_CONNECTS,       // connects in the connection list
+   TL_INSPECT_OVERLOAD_MEMORY,         // memory of all pended packets
+   TL_INSPECT_OVERLOAD_REASON_MAX
+} TL_INSPECT_OVERLOAD_REASON;
+
+//
+// TL_INSPECT_OVERLOAD_COUNTERS counts the classifies decided inline by the
+// overload control. shed counts them by the limit they would have
+// exceeded; connects and packets count the initial authorizations of
+// connections and the other packets among them. The structure fills a
+// 64-byte cache line.
+//
+typedef struct TL_INSPECT_OVERLOAD_COUNTERS_
+{
+   LONG64 shed[TL_INSPECT_OVERLOAD_REASON_MAX];
+   LONG64 connects;
+   LONG64 packets;
+   LONG64 reserved;
+} TL_INSPECT_OVERLOAD_COUNTERS;
+
+//
+// Classes of the work pended for the worker threads, which the scheduler
+// of each worker serves in weighted shares (see sched.h).
+//
+typedef enum TL_INSPECT_SCHED_CLASS_
+{
+   TL_INSPECT_SCHED_CLASS_CONNECT,     // initial authorization of connects
+   TL_INSPECT_SCHED_CLASS_REAUTH,      // re-authorization of connections
+   TL_INSPECT_SCHED_CLASS_DATA,        // packets of established flows
+   TL_INSPECT_SCHED_CLASS_MAX
+} TL_INSPECT_SCHED_CLASS;
+
+//
+// TL_INSPECT_SCHED_COUNTERS counts the work dequeued by the workers per
+// class; overdue counts the work of a class that was served ahead of its
+// share because the class had waited past its deadline. coalesced counts
+// the connects that were not dequeued, but decided along with a connect
+// waiting for the same decision, so that each connect served completes
+// (served + coalesced) / served connects on average. The structure fills
+// a 64-byte cache line.
+//
+typedef struct TL_INSPECT_SCHED_COUNTERS_
+{
+   LONG64 served[TL_INSPECT_SCHED_CLASS_MAX];
+   LONG64 overdue[TL_INSPECT_SCHED_CLASS_MAX];
+   LONG64 coalesced;
+   LONG64 reserved;
+} TL_INSPECT_SCHED_COUNTERS;
+
+//
+// TL_INSPECT_DEQUEUE_COUNTERS counts the cost of the dequeues of the
+// workers. lockAcquisitions counts the acquisitions of the locks of the
+// packet queues and of the connection list made to dequeue the work
+// counted by TL_INSPECT_SCHED_COUNTERS; splices counts the data packets
+// dequeued in bulk, splicedPackets. wakeups counts the work events set by
+// the classify functions, and wakeupsCoalesced those not set because the
+// worker had a wakeup pending already. The structure fills a 64-byte
+// cache line.
+//
+typedef struct TL_INSPECT_DEQUEUE_COUNTERS_
+{
+   LONG64 lockAcquisitions;
+   LONG64 splices;
+   LONG64 splicedPackets;
+   LONG64 wakeups;
+   LONG64 wakeupsCoalesced;
+   LONG64 reserved[3];
+} TL_INSPECT_DEQUEUE_COUNTERS;
+
+//
+// TL_INSPECT_VERDICT_COUNTERS counts the traffic decided by the policy
+// daemon. submitted counts the descriptors queued for it and delivered
+// those returned by an exchange; exchanges counts the requests of the
+// daemon, and verdicts the verdicts they returned. unknown counts the
+// verdicts for descriptors that were already decided or never were, and
+// those of no known value. timeouts counts the descriptors decided by the
+// default verdict because the daemon did not answer in time, and overflows
+// those that were because too many were waiting. The structure fills a
+// 64-byte cache line.
+//
+typedef struct TL_INSPECT_VERDICT_COUNTERS_
+{
+   LONG64 submitted;
+   LONG64 delivered;
+   LONG64 exchanges;
+   LONG64 verdicts;
+   LONG64 unknown;
+   LONG64 timeouts;
+   LONG64 overflows;
+   LONG64 reserved;
+} TL_INSPECT_VERDICT_COUNTERS;
+
+//
+// TL_INSPECT_PACKET_RING_COUNTERS counts the traffic decided through the
+// packet ring. published counts the descriptors written to the ring, and
+// capturedBytes the packet bytes copied along; full counts those decided
+// by the default verdict because their partition was full. completions
+// counts the entries read from the completion rings. waits counts the
+// wait requests of the daemon, and wakeups those completed by a
+// descriptor published after they were parked. The structure fills a
+// 64-byte cache line.
+//
+typedef struct TL_INSPECT_PACKET_RING_COUNTERS_
+{
+   LONG64 published;
+   LONG64 capturedBytes;
+   LONG64 full;
+   LONG64 completions;
+   LONG64 waits;
+   LONG64 wakeups;
+   LONG64 reserved[2];
+} TL_INSPECT_PACKET_RING_COUNTERS;
+
+//
+// TL_INSPECT_TIMER_COUNTERS counts the timers of the timer wheels.
+// connectTimeouts counts the pended connects decided by the default
+// verdict because they stayed undecided for the connect timeout, and
+// reauthTimeouts the decided ones freed because their re-auth did not
+// come in time. fired counts the timers that fired, and rearmed those of
+// the verdict caches armed again because their entry was still live. The
+// structure fills a 64-byte cache line.
+//
+typedef struct TL_INSPECT_TIMER_COUNTERS_
+{
+   LONG64 connectTimeouts;
+   LONG64 reauthTimeouts;
+   LONG64 fired;
+   LONG64 rearmed;
+   LONG64 reserved[4];
+} TL_INSPECT_TIMER_COUNTERS;
+
+//
+// TL_INSPECT_STATS_PAGE is the statistics page. The driver sums the
+// counters of all processors into it every updateInterval milliseconds.
+//
+// sequence is odd while the page is being updated. A reader copies the
+// page, and retries if sequence was odd or changed across the copy.
+// timestamp and startTime are interrupt times, in 100ns units, of the last
+// update and of the driver load. The depths are sampled at each update;
+// packetQueueDepthMax is the highest depth sampled so far.
+// flowCacheEntries is the number of flows in the flow verdict cache, and
+// flowCacheCapacity the most it may hold (0 when the cache is disabled).
+// pendedMemory is the memory, in bytes, held by the pended packets, and
+// memoryBudget the most they may hold (0 when it is not limited);
+// overloadFailOpen is 1 if the classifies shed by the overload control are
+// permitted, 0 if they are blocked. sched counts the work dequeued by the
+// worker schedulers, and dequeue what dequeuing it cost. verdict counts
+// the traffic decided by the policy daemon; verdictDaemon is 1 while one
+// is attached. packetRing counts the part of it decided through the
+// packet ring; packetRingPartitions and packetRingSnapLength are those of
+// the ring, 0 when none is mapped. connectCache, connectCacheEntries and
+// connectCacheCapacity are the same as for the flow cache, for the
+// connect cache. timers counts the timers of the timer wheels;
+// timersArmed is the number armed, and connectTimeout the connect
+// timeout, in milliseconds (0 when the connects are not timed out).
+//
+typedef struct TL_INSPECT_STATS_PAGE_
+{
+   volatile UINT32 sequence;
+   UINT32 processorCount;
+   UINT64 timestamp;
+   UINT64 startTime;
+   UINT32 updateInterval;
+   UINT32 reserved0;
+
+   LONG64 pendedCount;
+   LONG64 reinjectCount;
+   LONG64 injectCalls;
+
+   INT32 connListDepth;
+   INT32 packetQueueDepth;
+   INT32 packetQueueDepthMax;
+   UINT32 reserved1;
+
+   TL_INSPECT_CLASSIFY_COUNTERS classify[TL_INSPECT_CLASSIFY_FUNCTION_MAX];
+
+   TL_INSPECT_FLOW_CACHE_COUNTERS flowCache;
+   INT32 flowCacheEntries;
+   UINT32 flowCacheCapacity;
+
+   TL_INSPECT_OVERLOAD_COUNTERS overload;
+   LONG64 pendedMemory;
+   LONG64 memoryBudget;
+   UINT32 overloadFailOpen;
+   UINT32 reserved2;
+
+   TL_INSPECT_SCHED_COUNTERS sched;
+   TL_INSPECT_DEQUEUE_COUNTERS dequeue;
+
+   TL_INSPECT_VERDICT_COUNTERS verdict;
+   INT32 verdictPending;
+   UINT32 verdictDaemon;
+
+   TL_INSPECT_PACKET_RING_COUNTERS packetRing;
+   UINT32 packetRingPartitions;
+   UINT32 packetRingSnapLength;
+
+   TL_INSPECT_FLOW_CACHE_COUNTERS connectCache;
+   INT32 connectCacheEntries;
+   UINT32 connectCacheCapacity;
+
+   TL_INSPECT_TIMER_COUNTERS timers;
+   INT32 timersArmed;
+   UINT32 connectTimeout;
+} TL_INSPECT_STATS_PAGE;
+
+typedef struct TL_INSPECT_STATS_MAPPING_
+{
+   UINT64 address;
+} TL_INSPECT_STATS_MAPPING;
+
+//
+// Stages of the life of a pended packet whose latency is measured. The
+// verdict is applied by injecting a clone of the packet, by completing a
+// pended connect, or by discarding the packet.
+//
+typedef enum TL_INSPECT_LATENCY_STAGE_
+{
+   TL_INSPECT_LATENCY_QUEUE,     // queued until dequeued by a worker
+   TL_INSPECT_LATENCY_PROCESS,   // dequeued until the verdict is applied
+   TL_INSPECT_LATENCY_INJECT,    // injected until the injection completes
+   TL_INSPECT_LATENCY_TOTAL,     // queued until done with
+   TL_INSPECT_LATENCY_STAGE_MAX
+} TL_INSPECT_LATENCY_STAGE;
+
+//
+// The latencies are kept per packet type (connect, data, re-auth) and per
+// direction (outbound, inbound), in the order of TL_INSPECT_PACKET_TYPE
+// and FWP_DIRECTION.
+//
+#define TL_INSPECT_LATENCY_PACKET_TYPES 3
+#define TL_INSPECT_LATENCY_DIRECTIONS 2
+
+//
+// Percentiles are upper bounds, within 1/8 of the value, of the latencies
+// recorded since the driver was loaded; all times are in 100ns units.
+//
+typedef struct TL_INSPECT_LATENCY_PERCENTILES_
+{
+   UINT64 count;
+   UINT64 p50;
+   UINT64 p99;
+   UINT64 p999;
+   UINT64 max;
+} TL_INSPECT_LATENCY_PERCENTILES;
+
+typedef struct TL_INSPECT_LATENCY_INFO_
+{
+   TL_INSPECT_LATENCY_PERCENTILES
+      latency[TL_INSPECT_LATENCY_PACKET_TYPES]
+             [TL_INSPECT_LATENCY_DIRECTIONS]
+             [TL_INSPECT_LATENCY_STAGE_MAX];
+} TL_INSPECT_LATENCY_INFO;
+
+//
+// TL_INSPECT_POLICY_INFO describes the current inspection policy. version
+// counts the policies loaded since the driver was; loadTime is the time,
+// in 100ns units, taken to read and build the policy.
+//
+typedef struct TL_INSPECT_POLICY_INFO_
+{
+   UINT32 version;
+   UINT32 permitTraffic;
+   UINT32 prefixCount;
+   UINT32 ruleCount;
+   UINT64 loadTime;
+} TL_INSPECT_POLICY_INFO;
+
+//
+// Verdicts of the policy daemon. Any other value is counted as unknown and
+// the descriptor is decided by the default verdict, the one of the policy
+// of the driver.
+//
+typedef enum TL_INSPECT_VERDICT_VALUE_
+{
+   TL_INSPECT_VERDICT_PERMIT = 1,
+   TL_INSPECT_VERDICT_BLOCK
+} TL_INSPECT_VERDICT_VALUE;
+
+//
+// TL_INSPECT_VERDICT_REQUEST describes pended traffic to decide. id
+// identifies it in the verdict. type is the TL_INSPECT_PACKET_TYPE of the
+// traffic (connect, data, re-auth), and direction the FWP_DIRECTION.
+// processId and appId are the process and the hash of the ALE application
+// id of the traffic, 0 when its layer does not tell them. Addresses are in
+// network order, ports in host order; addressFamily is 4 or 6. The
+// structure fills a 64-byte cache line.
+//
+typedef struct TL_INSPECT_VERDICT_REQUEST_
+{
+   UINT64 id;
+   UINT64 processId;
+   UINT64 appId;
+
+   UINT8 type;
+   UINT8 direction;
+   UINT8 protocol;
+   UINT8 addressFamily;
+   UINT16 localPort;
+   UINT16 remotePort;
+
+   UINT8 localAddress[16];
+   UINT8 remoteAddress[16];
+} TL_INSPECT_VERDICT_REQUEST;
+
+typedef struct TL_INSPECT_VERDICT_
+{
+   UINT64 id;
+   UINT32 verdict;
+   UINT32 reserved;
+} TL_INSPECT_VERDICT;
+
+typedef struct TL_INSPECT_VERDICT_BATCH_
+{
+   UINT32 count;
+   UINT32 reserved;
+
+   TL_INSPECT_VERDICT verdicts[1];
+} TL_INSPECT_VERDICT_BATCH;
+
+typedef struct TL_INSPECT_VERDICT_REQUESTS_
+{
+   UINT32 count;
+   UINT32 reserved;
+
+   TL_INSPECT_VERDICT_REQUEST requests[1];
+} TL_INSPECT_VERDICT_REQUESTS;
+
+//
+// The packet ring is split in partitions, one per thread of the daemon;
+// the traffic of a flow always goes to the same partition. A partition is
+// laid out as follows, from the start of the partition (all offsets are in
+// TL_INSPECT_PACKET_RING_MAPPING):
+//
+//    TL_INSPECT_PACKET_RING_HEADER
+//    size descriptors (TL_INSPECT_PACKET_DESCRIPTOR)
+//    size completions (TL_INSPECT_VERDICT)
+//    size frames of frameSize bytes
+//
+// The driver writes descriptors at descriptorProducer and the daemon
+// consumes them at descriptorConsumer; the daemon writes its verdicts at
+// completionProducer and the driver consumes them at completionConsumer.
+// The indices only grow; the entry of an index is the index modulo size.
+// The frame of a descriptor holds the first bytes of its packet; it has
+// the index of the descriptor, and is reused once the daemon moves
+// descriptorConsumer past it. Each index is written by one side only, with
+// release semantics, after the entries it covers.
+//
+// A partition has as many entries as the ring of the verdict channel, so
+// that it cannot fill up before that ring does. The ring is at most
+// TL_INSPECT_PACKET_RING_MAX_LENGTH bytes, which bounds the snap length
+// of many partitions.
+//
+#define TL_INSPECT_PACKET_RING_MAX_PARTITIONS 16
+#define TL_INSPECT_PACKET_RING_SIZE 4096
+#define TL_INSPECT_PACKET_RING_MAX_SNAP_LENGTH 2048
+#define TL_INSPECT_PACKET_RING_MAX_LENGTH (64 * 1024 * 1024)
+
+//
+// The snap length is the number of bytes of a packet copied to its frame;
+// 0 copies none.
+//
+typedef struct TL_INSPECT_PACKET_RING_SETUP_
+{
+   UINT32 partitions;
+   UINT32 snapLength;
+} TL_INSPECT_PACKET_RING_SETUP;
+
+typedef struct TL_INSPECT_PACKET_RING_MAPPING_
+{
+   UINT64 address;               // of partition 0
+   UINT32 partitions;
+   UINT32 partitionSize;         // bytes from one partition to the next
+   UINT32 size;                  // entries per ring, a power of 2
+   UINT32 frameSize;             // bytes from one frame to the next
+   UINT32 descriptorOffset;
+   UINT32 completionOffset;
+   UINT32 frameOffset;
+   UINT32 snapLength;
+} TL_INSPECT_PACKET_RING_MAPPING;
+
+//
+// The indices of a partition sit on their own cache lines, so that the
+// two sides do not write to the same line.
+//
+typedef struct TL_INSPECT_PACKET_RING_HEADER_
+{
+   volatile UINT64 descriptorProducer;    // written by the driver
+   UINT64 reserved0[7];
+   volatile UINT64 descriptorConsumer;    // written by the daemon
+   UINT64 reserved1[7];
+   volatile UINT64 completionProducer;    // written by the daemon
+   UINT64 reserved2[7];
+   volatile UINT64 completionConsumer;    // written by the driver
+   UINT64 reserved3[7];
+} TL_INSPECT_PACKET_RING_HEADER;
+
+//
+// TL_INSPECT_PACKET_DESCRIPTOR describes pended traffic in the packet
+// ring. packetLength is the length of the packet from where its layer
+// indicated it (the transport header of outbound packets, the payload of
+// inbound ones), 0 for the connects and re-auths that carry none;
+// capturedLength is the number of its first bytes copied to the frame of
+// the descriptor, at most the snap length.
+//
+typedef struct TL_INSPECT_PACKET_DESCRIPTOR_
+{
+   TL_INSPECT_VERDICT_REQUEST request;
+   UINT32 packetLength;
+   UINT32 capturedLength;
+   UINT64 reserved;
+} TL_INSPECT_PACKET_DESCRIPTOR;
+
+#endif // _TL_INSPECT_IOCTL_H_
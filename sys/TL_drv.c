@@ -20,8 +20,80 @@ Abstract:
    HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Services\Inspect\Parameters
       
     o  BlockTraffic (REG_DWORD) : 0 (permit, default); 1 (block)
-    o  RemoteAddressToInspect (REG_SZ) : literal IPv4/IPv6 string 
-                                                (e.g. 10.0.0.1)
+    o  RemoteAddressToInspect (REG_SZ) : literal IPv4/IPv6 string, or
+                                         prefix (e.g. 10.0.0.0/8)
+    o  RemotePrefixesToInspect (REG_MULTI_SZ) : IPv4/IPv6 prefixes; a
+                                         leading ! excludes a prefix from
+                                         a shorter one
+    o  InspectRules (REG_MULTI_SZ) : rules that inspect, permit or block
+                                     traffic by address, port, protocol
+                                     and direction (see TLInspectAddRule)
+    o  WorkerThreadCount (REG_DWORD) : 0 (one worker thread per processor,
+                                       default); n (n worker threads)
+    o  InjectBatchSize (REG_DWORD) : maximum number of packets re-injected
+                                     with a single call; 1 - 64 (16, default)
+    o  InjectBatchLatency (REG_DWORD) : maximum time, in microseconds, a
+                                        packet waits for its batch to fill
+                                        up (100, default)
+    o  TraceLevel (REG_DWORD) : initial level of the binary event trace;
+                                0 (none) - 4 (verbose) (1, errors, default)
+    o  QueueMaxDepth (REG_DWORD) : most packets pended per processor queue
+                                   (4096, default)
+    o  QueueMaxBytes (REG_DWORD) : most kilobytes pended per processor
+                                   queue (8192, default)
+    o  QueueDelaySlo (REG_DWORD) : most milliseconds a packet should wait
+                                   in a queue (100, default)
+    o  MaxPendedConnects (REG_DWORD) : most connects pended at once
+                                       (4096, default)
+    o  MemoryBudget (REG_DWORD) : most kilobytes held by all pended
+                                  packets (65536, default)
+    o  OverloadFailOpen (REG_DWORD) : 1 (permit, default); 0 (block) the
+                                      traffic decided inline while one of
+                                      the limits above is exceeded
+   
+   A limit of 0 is not enforced.
+
+    o  ConnectWeight (REG_DWORD) : connects a worker takes in a row while
+                                   it has other work (1, default)
+    o  ReauthWeight (REG_DWORD) : re-authorizations taken in a row (2,
+                                  default)
+    o  DataWeight (REG_DWORD) : data packets taken in a row (8, default)
+    o  ConnectDeadline (REG_DWORD) : milliseconds after which waiting
+                                     connects are taken first (50, default)
+    o  ReauthDeadline (REG_DWORD) : the same for re-authorizations (20,
+                                    default)
+    o  DataDeadline (REG_DWORD) : the same for data packets (5, default)
+
+   A weight of 0 counts as 1, and a deadline of 0 is not enforced.
+
+    o  VerdictTimeout (REG_DWORD) : milliseconds the policy daemon has to
+                                    decide pended traffic before the
+                                    driver applies its own policy (100,
+                                    default; see verdict.c)
+    o  ConnectCacheMaxEntries (REG_DWORD) : most connections whose verdict
+                                            is cached (16384, default; 0
+                                            disables the connect cache)
+    o  ConnectCacheTtl (REG_DWORD) : seconds a permit is cached (10,
+                                     default; 0 does not cache permits)
+    o  ConnectCacheBlockTtl (REG_DWORD) : seconds a block is cached (5,
+                                          default; 0 does not cache
+                                          blocks)
+    o  CoalesceConnects (REG_DWORD) : 1 (default); 0 inspects each pended
+                                      connect, rather than deciding the
+                                      connects of an application to the
+                                      same service pended meanwhile along
+                                      with the first (see coalesce.h)
+    o  ConnectTimeout (REG_DWORD) : milliseconds a pended connect may wait
+                                    for its decision, and then for its
+                                    re-auth (5000, default; 0 waits
+                                    forever)
+    o  ConnectTimeoutVerdict (REG_DWORD) : 1 (default) permits the pended
+                                           connects still undecided after
+                                           ConnectTimeout; 0 blocks them
+
+   The first four values are the inspection policy, which is reloaded
+   while the driver runs when the key changes (see policy.c).
+
    The sample is IP version agnostic. It performs inspection for 
    both IPv4 and IPv6 traffic.
 
@@ -51,6 +123,18 @@ Environment:
 #include <ip2string.h>
 
 #include "inspect.h"
+#include "stats.h"
+#include "latency.h"
+#include "queue.h"
+#include "conntable.h"
+#include "flowcache.h"
+#include "policy.h"
+#include "alloc.h"
+#include "parse.h"
+#include "trace.h"
+#include "control.h"
+#include "overload.h"
+#include "verdict.h"
 
 #define INITGUID
 #include <guiddef.h>
@@ -62,13 +146,31 @@ BOOLEAN gInspectAllByDefault = TRUE;
 // Configurable parameters (addresses and ports are in host order)
 //
 
-BOOLEAN configPermitTraffic = TRUE;
-
-UINT8*   configInspectRemoteAddrV4 = NULL;
-UINT8*   configInspectRemoteAddrV6 = NULL;
-
-IN_ADDR  remoteAddrStorageV4;
-IN6_ADDR remoteAddrStorageV6;
+ULONG configWorkerThreadCount = 0;
+ULONG configInjectBatchSize = 16;
+ULONG configInjectBatchLatency = 100; // microseconds
+ULONG configFlowCacheMaxEntries = 65536;
+ULONG configFlowCacheIdleTimeout = 60; // seconds
+ULONG configTraceLevel = TL_INSPECT_TRACE_LEVEL_ERROR;
+ULONG configQueueMaxDepth = 4096;
+ULONG configQueueMaxBytes = 8192; // kilobytes
+ULONG configQueueDelaySlo = 100; // milliseconds
+ULONG configMaxPendedConnects = 4096;
+ULONG configMemoryBudget = 65536; // kilobytes
+ULONG configOverloadFailOpen = 1;
+ULONG configConnectWeight = 1;
+ULONG configReauthWeight = 2;
+ULONG configDataWeight = 8;
+ULONG configConnectDeadline = 50; // milliseconds
+ULONG configReauthDeadline = 20; // milliseconds
+ULONG configDataDeadline = 5; // milliseconds
+ULONG configVerdictTimeout = 100; // milliseconds
+ULONG configConnectCacheMaxEntries = 16384;
+ULONG configConnectCacheTtl = 10; // seconds
+ULONG configConnectCacheBlockTtl = 5; // seconds
+ULONG configCoalesceConnects = 1;
+ULONG configConnectTimeout = 5000; // milliseconds
+ULONG configConnectTimeoutVerdict = 1;
 
 // 
 // Callout and sublayer GUIDs
@@ -89,6 +191,22 @@ DEFINE_GUID(
    0x4a49,
    0x97, 0x92, 0x6f, 0xaf, 0x9e, 0x2a, 0xf8, 0xd0
 );
+// b9d21401-0c8b-4f51-9882-c1c823619fc7
+DEFINE_GUID(
+   TL_INSPECT_OUTBOUND_IP_CALLOUT_V6,
+   0xb9d21401,
+   0x0c8b,
+   0x4f51,
+   0x98, 0x82, 0xc1, 0xc8, 0x23, 0x61, 0x9f, 0xc7
+);
+// f31b8e66-215a-4ab6-8855-4131cad709d7
+DEFINE_GUID(
+   TL_INSPECT_INBOUND_IP_CALLOUT_V6,
+   0xf31b8e66,
+   0x215a,
+   0x4ab6,
+   0x88, 0x55, 0x41, 0x31, 0xca, 0xd7, 0x09, 0xd7
+);
 
 // bb6e405b-19f4-4ff3-b501-1a3dc01aae01
 DEFINE_GUID(
@@ -176,6 +294,7 @@ WDFKEY gParametersKey;
 
 HANDLE gEngineHandle;
 UINT32 gIpOutboundTlCalloutIdV4, gIpInboundTlCalloutIdV4;
+UINT32 gIpOutboundTlCalloutIdV6, gIpInboundTlCalloutIdV6;
 UINT32 gAleConnectCalloutIdV4, gOutboundTlCalloutIdV4;
 UINT32 gAleRecvAcceptCalloutIdV4, gInboundTlCalloutIdV4;
 UINT32 gAleConnectCalloutIdV6, gOutboundTlCalloutIdV6;
@@ -185,13 +304,10 @@ HANDLE gInjectionHandle;
 
 LIST_ENTRY gConnList;
 KSPIN_LOCK gConnListLock;
-LIST_ENTRY gPacketQueue;
-KSPIN_LOCK gPacketQueueLock;
 
 KEVENT gWorkerEvent;
 
 BOOLEAN gDriverUnloading = FALSE;
-void* gThreadObj;
 
 // 
 // Callout driver implementation
@@ -200,60 +316,232 @@ void* gThreadObj;
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_UNLOAD TLInspectEvtDriverUnload;
 
+ULONG
+TLInspectQueryOptionalULong(
+   _In_ const WDFKEY key,
+   _In_ PCWSTR name,
+   _In_ ULONG defaultValue
+   )
+/* ++
+
+   This function returns the REG_DWORD value of the given name, or
+   defaultValue if it is absent.
+
+-- */
+{
+   UNICODE_STRING valueName;
+   ULONG value;
+
+   RtlInitUnicodeString(&valueName, name);
+
+   if (!NT_SUCCESS(WdfRegistryQueryULong(key, &valueName, &value)))
+   {
+      value = defaultValue;
+   }
+
+   return value;
+}
+
 NTSTATUS
 TLInspectLoadConfig(
    _In_ const WDFKEY key
    )
 {
-   NTSTATUS status;
-   DECLARE_CONST_UNICODE_STRING(valueName, L"RemoteAddressToInspect");
-   DECLARE_UNICODE_STRING_SIZE(value, INET6_ADDRSTRLEN);
-   
-   status = WdfRegistryQueryUnicodeString(key, &valueName, NULL, &value);
+   configWorkerThreadCount = TLInspectQueryOptionalULong(
+                                key,
+                                L"WorkerThreadCount",
+                                configWorkerThreadCount
+                                );
+
+   configInjectBatchSize = TLInspectQueryOptionalULong(
+                              key,
+                              L"InjectBatchSize",
+                              configInjectBatchSize
+                              );
+   configInjectBatchSize = max(configInjectBatchSize, 1);
+   configInjectBatchSize = min(configInjectBatchSize, TL_INSPECT_MAX_INJECT_BATCH);
+
+   configInjectBatchLatency = TLInspectQueryOptionalULong(
+                                 key,
+                                 L"InjectBatchLatency",
+                                 configInjectBatchLatency
+                                 );
+
+   configFlowCacheMaxEntries = TLInspectQueryOptionalULong(
+                                  key,
+                                  L"FlowCacheMaxEntries",
+                                  configFlowCacheMaxEntries
+                                  );
+
+   configFlowCacheIdleTimeout = TLInspectQueryOptionalULong(
+                                   key,
+                                   L"FlowCacheIdleTimeout",
+                                   configFlowCacheIdleTimeout
+                                   );
+
+   configConnectCacheMaxEntries = TLInspectQueryOptionalULong(
+                                     key,
+                                     L"ConnectCacheMaxEntries",
+                                     configConnectCacheMaxEntries
+                                     );
+
+   configConnectCacheTtl = TLInspectQueryOptionalULong(
+                              key,
+                              L"ConnectCacheTtl",
+                              configConnectCacheTtl
+                              );
+
+   configConnectCacheBlockTtl = TLInspectQueryOptionalULong(
+                                   key,
+                                   L"ConnectCacheBlockTtl",
+                                   configConnectCacheBlockTtl
+                                   );
+
+   configCoalesceConnects = TLInspectQueryOptionalULong(
+                               key,
+                               L"CoalesceConnects",
+                               configCoalesceConnects
+                               );
+
+   configConnectTimeout = TLInspectQueryOptionalULong(
+                             key,
+                             L"ConnectTimeout",
+                             configConnectTimeout
+                             );
+
+   configConnectTimeoutVerdict = TLInspectQueryOptionalULong(
+                                    key,
+                                    L"ConnectTimeoutVerdict",
+                                    configConnectTimeoutVerdict
+                                    );
+
+   configTraceLevel = TLInspectQueryOptionalULong(
+                         key,
+                         L"TraceLevel",
+                         configTraceLevel
+                         );
+
+   configQueueMaxDepth = TLInspectQueryOptionalULong(
+                            key,
+                            L"QueueMaxDepth",
+                            configQueueMaxDepth
+                            );
+   configQueueMaxBytes = TLInspectQueryOptionalULong(
+                            key,
+                            L"QueueMaxBytes",
+                            configQueueMaxBytes
+                            );
+   configQueueDelaySlo = TLInspectQueryOptionalULong(
+                            key,
+                            L"QueueDelaySlo",
+                            configQueueDelaySlo
+                            );
+   configMaxPendedConnects = TLInspectQueryOptionalULong(
+                                key,
+                                L"MaxPendedConnects",
+                                configMaxPendedConnects
+                                );
+   configMemoryBudget = TLInspectQueryOptionalULong(
+                           key,
+                           L"MemoryBudget",
+                           configMemoryBudget
+                           );
+   configOverloadFailOpen = TLInspectQueryOptionalULong(
+                               key,
+                               L"OverloadFailOpen",
+                               configOverloadFailOpen
+                               );
+
+   configConnectWeight = TLInspectQueryOptionalULong(
+                            key,
+                            L"ConnectWeight",
+                            configConnectWeight
+                            );
+   configReauthWeight = TLInspectQueryOptionalULong(
+                           key,
+                           L"ReauthWeight",
+                           configReauthWeight
+                           );
+   configDataWeight = TLInspectQueryOptionalULong(
+                         key,
+                         L"DataWeight",
+                         configDataWeight
+                         );
+   configConnectDeadline = TLInspectQueryOptionalULong(
+                              key,
+                              L"ConnectDeadline",
+                              configConnectDeadline
+                              );
+   configReauthDeadline = TLInspectQueryOptionalULong(
+                             key,
+                             L"ReauthDeadline",
+                             configReauthDeadline
+                             );
+   configDataDeadline = TLInspectQueryOptionalULong(
+                           key,
+                           L"DataDeadline",
+                           configDataDeadline
+                           );
+   configVerdictTimeout = TLInspectQueryOptionalULong(
+                             key,
+                             L"VerdictTimeout",
+                             configVerdictTimeout
+                             );
+
+   return STATUS_SUCCESS;
+}
 
-   if (NT_SUCCESS(status))
-   {
-      PWSTR terminator;
-      // Defensively null-terminate the string
-      value.Length = min(value.Length, value.MaximumLength - sizeof(WCHAR));
-      value.Buffer[value.Length/sizeof(WCHAR)] = UNICODE_NULL;
-
-      status = RtlIpv4StringToAddressW(
-                  value.Buffer,
-                  TRUE,
-                  &terminator,
-                  &remoteAddrStorageV4
-                  );
+void
+TLInspectConfigureOverload(void)
+/* ++
 
-      if (NT_SUCCESS(status))
-      {
-         remoteAddrStorageV4.S_un.S_addr = 
-            RtlUlongByteSwap(remoteAddrStorageV4.S_un.S_addr);
-         configInspectRemoteAddrV4 = &remoteAddrStorageV4.S_un.S_un_b.s_b1;
-      }
-      else
-      {
-         status = RtlIpv6StringToAddressW(
-                     value.Buffer,
-                     &terminator,
-                     &remoteAddrStorageV6
-                     );
+   This function sets the limits of the overload control from the
+   configuration, whose sizes are in kilobytes and delays in milliseconds.
 
-         if (NT_SUCCESS(status))
-         {
-            configInspectRemoteAddrV6 = (UINT8*)(&remoteAddrStorageV6.u.Byte[0]);
-         }
-      }
-   }
+-- */
+{
+   TL_INSPECT_OVERLOAD_LIMITS limits;
 
-   return status;
+   limits.queueDepth = (LONG)min(configQueueMaxDepth, MAXLONG);
+   limits.pendedConnects = (LONG)min(configMaxPendedConnects, MAXLONG);
+   limits.queueBytes = (LONG64)configQueueMaxBytes * 1024;
+   limits.memory = (LONG64)configMemoryBudget * 1024;
+   limits.queueDelay = (UINT64)configQueueDelaySlo * 10000;
+   limits.failOpen = (configOverloadFailOpen != 0);
+
+   TLInspectOverloadInitialize(&limits);
+}
+
+void
+TLInspectGetSchedConfig(
+   _Out_ TL_INSPECT_SCHED_CONFIG* schedConfig
+   )
+/* ++
+
+   This function fills the configuration of the worker schedulers, whose
+   deadlines are configured in milliseconds.
+
+-- */
+{
+   schedConfig->weight[TL_INSPECT_SCHED_CLASS_CONNECT] =
+      max(configConnectWeight, 1);
+   schedConfig->weight[TL_INSPECT_SCHED_CLASS_REAUTH] =
+      max(configReauthWeight, 1);
+   schedConfig->weight[TL_INSPECT_SCHED_CLASS_DATA] =
+      max(configDataWeight, 1);
+
+   schedConfig->deadline[TL_INSPECT_SCHED_CLASS_CONNECT] =
+      (UINT64)configConnectDeadline * 10000;
+   schedConfig->deadline[TL_INSPECT_SCHED_CLASS_REAUTH] =
+      (UINT64)configReauthDeadline * 10000;
+   schedConfig->deadline[TL_INSPECT_SCHED_CLASS_DATA] =
+      (UINT64)configDataDeadline * 10000;
 }
 
 NTSTATUS
 TLInspectAddFilter(
    _In_ const wchar_t* filterName,
    _In_ const wchar_t* filterDesc,
-   _In_reads_opt_(16) const UINT8* remoteAddr,
    _In_ UINT64 context,
    _In_ const GUID* layerKey,
    _In_ const GUID* calloutKey,
@@ -263,7 +551,6 @@ TLInspectAddFilter(
    NTSTATUS status = STATUS_SUCCESS;
    if (isInspectAll)
    {
-      UNREFERENCED_PARAMETER(remoteAddr);
       FWPM_FILTER0 filter = { 0 };
       filter.displayData.name = (wchar_t*)filterName;
       filter.displayData.description = (wchar_t*)filterDesc;
@@ -285,8 +572,6 @@ TLInspectAddFilter(
    else
    {
       FWPM_FILTER filter = { 0 };
-      FWPM_FILTER_CONDITION filterConditions[3] = { 0 };
-      UINT conditionIndex;
 
       filter.layerKey = *layerKey;
       filter.displayData.name = (wchar_t*)filterName;
@@ -294,40 +579,15 @@ TLInspectAddFilter(
 
       filter.action.type = FWP_ACTION_CALLOUT_TERMINATING;
       filter.action.calloutKey = *calloutKey;
-      filter.filterCondition = filterConditions;
       filter.subLayerKey = TL_INSPECT_SUBLAYER;
       filter.weight.type = FWP_EMPTY; // auto-weight.
       filter.rawContext = context;
 
-      conditionIndex = 0;
-
-      if (remoteAddr != NULL)
-      {
-         filterConditions[conditionIndex].fieldKey =
-            FWPM_CONDITION_IP_REMOTE_ADDRESS;
-         filterConditions[conditionIndex].matchType = FWP_MATCH_EQUAL;
-
-         if (IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_CONNECT_V4) ||
-            IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V4) ||
-            IsEqualGUID(layerKey, &FWPM_LAYER_INBOUND_TRANSPORT_V4) ||
-            IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_TRANSPORT_V4))
-         {
-            filterConditions[conditionIndex].conditionValue.type = FWP_UINT32;
-            filterConditions[conditionIndex].conditionValue.uint32 =
-               *(UINT32*)remoteAddr;
-         }
-         else
-         {
-            filterConditions[conditionIndex].conditionValue.type =
-               FWP_BYTE_ARRAY16_TYPE;
-            filterConditions[conditionIndex].conditionValue.byteArray16 =
-               (FWP_BYTE_ARRAY16*)remoteAddr;
-         }
-
-         conditionIndex++;
-      }
-
-      filter.numFilterConditions = conditionIndex;
+      //
+      // The remote addresses are matched by the classify functions, see
+      // IsRemoteAddressInspected.
+      //
+      filter.numFilterConditions = 0;
 
       status = FwpmFilterAdd(
          gEngineHandle,
@@ -368,15 +628,24 @@ TLInspectRegisterALEClassifyCallouts(
 
    sCallout.calloutKey = *calloutKey;
 
-   if (IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_CONNECT_V4) ||
-       IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_CONNECT_V6))
+   if (IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_CONNECT_V4))
+   {
+      sCallout.classifyFn = TLInspectALEConnectClassifyV4;
+      sCallout.notifyFn = TLInspectALEConnectNotify;
+   }
+   else if (IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_CONNECT_V6))
    {
-      sCallout.classifyFn = TLInspectALEConnectClassify;
+      sCallout.classifyFn = TLInspectALEConnectClassifyV6;
       sCallout.notifyFn = TLInspectALEConnectNotify;
    }
+   else if (IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V4))
+   {
+      sCallout.classifyFn = TLInspectALERecvAcceptClassifyV4;
+      sCallout.notifyFn = TLInspectALERecvAcceptNotify;
+   }
    else
    {
-      sCallout.classifyFn = TLInspectALERecvAcceptClassify;
+      sCallout.classifyFn = TLInspectALERecvAcceptClassifyV6;
       sCallout.notifyFn = TLInspectALERecvAcceptNotify;
    }
 
@@ -415,9 +684,6 @@ TLInspectRegisterALEClassifyCallouts(
    status = TLInspectAddFilter(
       L"Transport Inspect ALE Classify",
       L"Intercepts inbound or outbound connect attempts",
-      (IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_CONNECT_V4) ||
-         IsEqualGUID(layerKey, &FWPM_LAYER_ALE_AUTH_RECV_ACCEPT_V4)) ?
-      configInspectRemoteAddrV4 : configInspectRemoteAddrV6,
       0,
       layerKey,
       calloutKey,
@@ -461,7 +727,23 @@ NTSTATUS TLInspectRegisterIpCallouts(
       BOOLEAN calloutRegistered = FALSE;
 
       sCallout.calloutKey = *calloutKey;
-      sCallout.classifyFn = TLInspectIpClassify;
+
+      if (IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_IPPACKET_V4))
+      {
+         sCallout.classifyFn = TLInspectOutboundIpClassifyV4;
+      }
+      else if (IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_IPPACKET_V6))
+      {
+         sCallout.classifyFn = TLInspectOutboundIpClassifyV6;
+      }
+      else if (IsEqualGUID(layerKey, &FWPM_LAYER_INBOUND_IPPACKET_V4))
+      {
+         sCallout.classifyFn = TLInspectInboundIpClassifyV4;
+      }
+      else
+      {
+         sCallout.classifyFn = TLInspectInboundIpClassifyV6;
+      }
       sCallout.notifyFn = TLInspectIpNotify;
 
       status = FwpsCalloutRegister(
@@ -499,9 +781,6 @@ NTSTATUS TLInspectRegisterIpCallouts(
       status = TLInspectAddFilter(
          L"Transport Inspect Filter (Outbound)",
          L"Inspect inbound/outbound transport traffic",
-         (IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_TRANSPORT_V4) ||
-            IsEqualGUID(layerKey, &FWPM_LAYER_INBOUND_TRANSPORT_V4)) ?
-         configInspectRemoteAddrV4 : configInspectRemoteAddrV6,
          0,
          layerKey,
          calloutKey,
@@ -561,7 +840,23 @@ TLInspectRegisterTransportCallouts(
    BOOLEAN calloutRegistered = FALSE;
 
    sCallout.calloutKey = *calloutKey;
-   sCallout.classifyFn = TLInspectTransportClassify;
+
+   if (IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_TRANSPORT_V4))
+   {
+      sCallout.classifyFn = TLInspectOutboundTransportClassifyV4;
+   }
+   else if (IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_TRANSPORT_V6))
+   {
+      sCallout.classifyFn = TLInspectOutboundTransportClassifyV6;
+   }
+   else if (IsEqualGUID(layerKey, &FWPM_LAYER_INBOUND_TRANSPORT_V4))
+   {
+      sCallout.classifyFn = TLInspectInboundTransportClassifyV4;
+   }
+   else
+   {
+      sCallout.classifyFn = TLInspectInboundTransportClassifyV6;
+   }
    sCallout.notifyFn = TLInspectTransportNotify;
 
    status = FwpsCalloutRegister(
@@ -599,9 +894,6 @@ TLInspectRegisterTransportCallouts(
    status = TLInspectAddFilter(
       L"Transport Inspect Filter (Outbound)",
       L"Inspect inbound/outbound transport traffic",
-      (IsEqualGUID(layerKey, &FWPM_LAYER_OUTBOUND_TRANSPORT_V4) ||
-         IsEqualGUID(layerKey, &FWPM_LAYER_INBOUND_TRANSPORT_V4)) ?
-      configInspectRemoteAddrV4 : configInspectRemoteAddrV6,
       0,
       layerKey,
       calloutKey,
@@ -718,6 +1010,30 @@ TLInspectRegisterCallouts(
       {
          goto Exit;
       }
+
+      DbgPrint("Ip outbound V6 layer registration.\n");
+      status = TLInspectRegisterIpCallouts(
+         &FWPM_LAYER_OUTBOUND_IPPACKET_V6,
+         &TL_INSPECT_OUTBOUND_IP_CALLOUT_V6,
+         deviceObject,
+         &gIpOutboundTlCalloutIdV6
+      );
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
+
+      DbgPrint("Ip inbound V6 layer registration.\n");
+      status = TLInspectRegisterIpCallouts(
+         &FWPM_LAYER_INBOUND_IPPACKET_V6,
+         &TL_INSPECT_INBOUND_IP_CALLOUT_V6,
+         deviceObject,
+         &gIpInboundTlCalloutIdV6
+      );
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
 #if 0
       DbgPrint("Transport outbound layer registration.\n");
       status = TLInspectRegisterTransportCallouts(
@@ -746,7 +1062,7 @@ TLInspectRegisterCallouts(
    }
    else /* if an IP address was given, and "gInspectAll" is off, then inspect the given address. */
    {
-      if (configInspectRemoteAddrV4 != NULL)
+      if (gInspectPolicy->prefixesV4.prefixCount != 0)
       {
          status = TLInspectRegisterALEClassifyCallouts(
             &FWPM_LAYER_ALE_AUTH_CONNECT_V4,
@@ -792,7 +1108,7 @@ TLInspectRegisterCallouts(
             goto Exit;
          }
       }
-      if (configInspectRemoteAddrV6 != NULL)
+      if (gInspectPolicy->prefixesV6.prefixCount != 0)
       {
          status = TLInspectRegisterALEClassifyCallouts(
             &FWPM_LAYER_ALE_AUTH_CONNECT_V6,
@@ -874,6 +1190,8 @@ TLInspectUnregisterCallouts(void)
 
    FwpsCalloutUnregisterById(gIpOutboundTlCalloutIdV4);
    FwpsCalloutUnregisterById(gIpInboundTlCalloutIdV4);
+   FwpsCalloutUnregisterById(gIpOutboundTlCalloutIdV6);
+   FwpsCalloutUnregisterById(gIpInboundTlCalloutIdV6);
 
    FwpsCalloutUnregisterById(gOutboundTlCalloutIdV6);
    FwpsCalloutUnregisterById(gOutboundTlCalloutIdV4);
@@ -886,58 +1204,99 @@ TLInspectUnregisterCallouts(void)
    FwpsCalloutUnregisterById(gAleRecvAcceptCalloutIdV4);
 }
 
-_Function_class_(EVT_WDF_DRIVER_UNLOAD)
-_IRQL_requires_same_
-_IRQL_requires_max_(PASSIVE_LEVEL)
 void
-TLInspectEvtDriverUnload(
-   _In_ WDFDRIVER driverObject
-   )
-{
+TLInspectStopWorkers(void)
+/* ++
 
-   KLOCK_QUEUE_HANDLE connListLockHandle;
-   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
+   This function signals every worker thread to exit and waits for them to
+   do so. No packet is queued, and no connect pended, once it returns; the
+   classifies that still come until the callouts are unregistered are
+   decided inline.
 
-   UNREFERENCED_PARAMETER(driverObject);
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+   ULONG i;
 
    KeAcquireInStackQueuedSpinLock(
       &gConnListLock,
       &connListLockHandle
       );
-   KeAcquireInStackQueuedSpinLock(
-      &gPacketQueueLock,
-      &packetQueueLockHandle
-      );
 
    gDriverUnloading = TRUE;
 
-   KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
    KeReleaseInStackQueuedSpinLock(&connListLockHandle);
 
-   if (IsListEmpty(&gConnList) && IsListEmpty(&gPacketQueue))
+   TLInspectQuiesceQueues();
+   TLInspectWakeWorkers();
+
+   for (i = 0; i < gWorkerCount; i++)
    {
-      KeSetEvent(
-         &gWorkerEvent,
-         IO_NO_INCREMENT, 
-         FALSE
+      if (gWorkers[i].threadObj == NULL)
+      {
+         continue;
+      }
+
+      KeWaitForSingleObject(
+         gWorkers[i].threadObj,
+         Executive,
+         KernelMode,
+         FALSE,
+         NULL
          );
+
+      ObDereferenceObject(gWorkers[i].threadObj);
+      gWorkers[i].threadObj = NULL;
    }
+}
 
-   NT_ASSERT(gThreadObj != NULL);
+_Function_class_(EVT_WDF_DRIVER_UNLOAD)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+void
+TLInspectEvtDriverUnload(
+   _In_ WDFDRIVER driverObject
+   )
+{
+   UNREFERENCED_PARAMETER(driverObject);
 
-   KeWaitForSingleObject(
-      gThreadObj,
-      Executive,
-      KernelMode,
-      FALSE,
-      NULL
-      );
+   TLInspectStopWorkers();
+
+   TLInspectVerdictFree();
+
+   TLInspectDrainQueues();
 
-   ObDereferenceObject(gThreadObj);
+   TLInspectWheelStop();
 
    TLInspectUnregisterCallouts();
 
+   TLInspectStatsReport();
+
+   TLInspectLatencyReport();
+
+   TLInspectStatsFree();
+
+   TLInspectLatencyFree();
+
+   TLInspectFreeQueues();
+
+   TLInspectConnTableFree();
+
+   TLInspectFlowCacheFree();
+
+   TLInspectConnectCacheFree();
+
+   TLInspectPolicyFree();
+
    FwpsInjectionHandleDestroy(gInjectionHandle);
+
+   //
+   // Injection completions free their pended packet; they have all run
+   // once the injection handle is destroyed.
+   //
+   TLInspectFreePacketAllocator();
+
+   TLInspectTraceFree();
 }
 
 NTSTATUS
@@ -951,6 +1310,8 @@ TLInspectInitDriverObjects(
    NTSTATUS status;
    WDF_DRIVER_CONFIG config;
    PWDFDEVICE_INIT pInit = NULL;
+   DECLARE_CONST_UNICODE_STRING(deviceName, TL_INSPECT_DEVICE_NAME);
+   DECLARE_CONST_UNICODE_STRING(symbolicLinkName, TL_INSPECT_SYMBOLIC_LINK_NAME);
 
    WDF_DRIVER_CONFIG_INIT(&config, WDF_NO_EVENT_CALLBACK);
 
@@ -970,7 +1331,11 @@ TLInspectInitDriverObjects(
       goto Exit;
    }
 
-   pInit = WdfControlDeviceInitAllocate(*pDriver, &SDDL_DEVOBJ_KERNEL_ONLY);
+   //
+   // The control device is named so that the user-mode tool can open it;
+   // only the system and administrators are granted access.
+   //
+   pInit = WdfControlDeviceInitAllocate(*pDriver, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL);
 
    if (!pInit)
    {
@@ -980,7 +1345,15 @@ TLInspectInitDriverObjects(
 
    WdfDeviceInitSetDeviceType(pInit, FILE_DEVICE_NETWORK);
    WdfDeviceInitSetCharacteristics(pInit, FILE_DEVICE_SECURE_OPEN, FALSE);
-   WdfDeviceInitSetCharacteristics(pInit, FILE_AUTOGENERATED_DEVICE_NAME, TRUE);
+
+   status = WdfDeviceInitAssignName(pInit, &deviceName);
+   if (!NT_SUCCESS(status))
+   {
+      WdfDeviceInitFree(pInit);
+      goto Exit;
+   }
+
+   TLInspectInitControlDevice(pInit);
 
    status = WdfDeviceCreate(&pInit, WDF_NO_OBJECT_ATTRIBUTES, pDevice);
    if (!NT_SUCCESS(status))
@@ -989,6 +1362,18 @@ TLInspectInitDriverObjects(
       goto Exit;
    }
 
+   status = WdfDeviceCreateSymbolicLink(*pDevice, &symbolicLinkName);
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   status = TLInspectCreateControlQueue(*pDevice);
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
    WdfControlFinishInitializing(*pDevice);
 
 Exit:
@@ -1005,6 +1390,8 @@ DriverEntry(
    WDFDRIVER driver;
    WDFDEVICE device;
    HANDLE threadHandle;
+   TL_INSPECT_SCHED_CONFIG schedConfig;
+   ULONG i;
 
    // Request NX Non-Paged Pool when available
    ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
@@ -1041,17 +1428,27 @@ DriverEntry(
       goto Exit;
    }
 
+   status = TLInspectPolicyInitialize(driver);
+
+   if (!NT_SUCCESS(status))
+   {
+      status = STATUS_DEVICE_CONFIGURATION_ERROR;
+      goto Exit;
+   }
+
+   //
+   // The layers registered are chosen from the first policy; a reload
+   // changes what is inspected within them.
+   //
    if (gInspectAllByDefault)
    {
       DbgPrint("Build option gInspectAllByDefault set, inspecting all addresses.\n");
-      configInspectRemoteAddrV4 = NULL;
-      configInspectRemoteAddrV6 = NULL;
       gInspectAll = TRUE;
    }
    else
    {
-      if ((configInspectRemoteAddrV4 == NULL) &&
-         (configInspectRemoteAddrV6 == NULL))
+      if ((gInspectPolicy->prefixesV4.prefixCount == 0) &&
+         (gInspectPolicy->prefixesV6.prefixCount == 0))
       {
          DbgPrint("No remote address set, inspecting all addresses.\n");
          gInspectAll = TRUE;
@@ -1072,8 +1469,36 @@ DriverEntry(
    InitializeListHead(&gConnList);
    KeInitializeSpinLock(&gConnListLock);   
 
-   InitializeListHead(&gPacketQueue);
-   KeInitializeSpinLock(&gPacketQueueLock);  
+   status = TLInspectConnTableInitialize(
+               configCoalesceConnects != 0,
+               configConnectTimeout
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   status = TLInspectFlowCacheInitialize(
+               configFlowCacheMaxEntries,
+               configFlowCacheIdleTimeout
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   status = TLInspectConnectCacheInitialize(
+               configConnectCacheMaxEntries,
+               configConnectCacheTtl,
+               configConnectCacheBlockTtl
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
 
    KeInitializeEvent(
       &gWorkerEvent,
@@ -1081,54 +1506,128 @@ DriverEntry(
       FALSE
       );
 
-   gWdmDevice = WdfDeviceWdmGetDeviceObject(device);
+   status = TLInspectTraceInitialize(configTraceLevel);
 
-   status = TLInspectRegisterCallouts(gWdmDevice);
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   TLInspectConfigureOverload();
+
+   status = TLInspectInitializePacketAllocator();
 
    if (!NT_SUCCESS(status))
    {
       goto Exit;
    }
 
-   status = PsCreateSystemThread(
-               &threadHandle,
-               THREAD_ALL_ACCESS,
-               NULL,
-               NULL,
-               NULL,
-               TLInspectWorker,
-               NULL
-               );
+   TLInspectGetSchedConfig(&schedConfig);
+
+   status = TLInspectInitializeQueues(configWorkerThreadCount, &schedConfig);
 
    if (!NT_SUCCESS(status))
    {
       goto Exit;
    }
 
-   status = ObReferenceObjectByHandle(
-               threadHandle,
-               0,
-               NULL,
-               KernelMode,
-               &gThreadObj,
-               NULL
-               );
-   NT_ASSERT(NT_SUCCESS(status));
+   status = TLInspectStatsInitialize();
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   status = TLInspectLatencyInitialize();
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
 
-   ZwClose(threadHandle);
+   status = TLInspectVerdictInitialize(device, configVerdictTimeout);
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   TLInspectWheelStart();
+
+   gWdmDevice = WdfDeviceWdmGetDeviceObject(device);
+
+   status = TLInspectRegisterCallouts(gWdmDevice);
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   for (i = 0; i < gWorkerCount; i++)
+   {
+      status = PsCreateSystemThread(
+                  &threadHandle,
+                  THREAD_ALL_ACCESS,
+                  NULL,
+                  NULL,
+                  NULL,
+                  TLInspectWorker,
+                  &gWorkers[i]
+                  );
+
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
+
+      status = ObReferenceObjectByHandle(
+                  threadHandle,
+                  0,
+                  NULL,
+                  KernelMode,
+                  &gWorkers[i].threadObj,
+                  NULL
+                  );
+      NT_ASSERT(NT_SUCCESS(status));
+
+      ZwClose(threadHandle);
+   }
+
+   status = TLInspectPolicyStartWatch();
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
 
 Exit:
    
    if (!NT_SUCCESS(status))
    {
+      if (gWorkers != NULL)
+      {
+         TLInspectStopWorkers();
+         TLInspectVerdictFree();
+         TLInspectDrainQueues();
+      }
+      TLInspectWheelStop();
       if (gEngineHandle != NULL)
       {
          TLInspectUnregisterCallouts();
       }
+      TLInspectStatsFree();
+      TLInspectLatencyFree();
+      TLInspectFreeQueues();
+      TLInspectConnTableFree();
+      TLInspectFlowCacheFree();
+      TLInspectConnectCacheFree();
+      TLInspectPolicyFree();
       if (gInjectionHandle != NULL)
       {
          FwpsInjectionHandleDestroy(gInjectionHandle);
       }
+      TLInspectFreePacketAllocator();
+      TLInspectTraceFree();
    }
 
    return status;
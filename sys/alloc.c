@@ -0,0 +1,212 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the allocator for pended packets.
+
+   Pended packets are taken from per-processor lookaside lists, so that the
+   classify functions on different processors neither contend on a common
+   list nor go to the pool for every packet. Control data that fits into
+   the inline buffer of the pended packet is stored there; only larger
+   control data is allocated from the pool.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "alloc.h"
+#include "stats.h"
+
+typedef struct DECLSPEC_CACHEALIGN TL_INSPECT_PACKET_LOOKASIDE_
+{
+   LOOKASIDE_LIST_EX list;
+} TL_INSPECT_PACKET_LOOKASIDE;
+
+TL_INSPECT_PACKET_LOOKASIDE* gPacketLookaside;
+ULONG gPacketLookasideCount;
+
+NTSTATUS
+TLInspectInitializePacketAllocator(void)
+/* ++
+
+   This function creates one pended packet lookaside list per active
+   processor.
+
+-- */
+{
+   NTSTATUS status = STATUS_SUCCESS;
+   ULONG processorCount;
+   ULONG i;
+
+   processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+   gPacketLookaside = ExAllocatePoolZero(
+                        NonPagedPool,
+                        processorCount * sizeof(TL_INSPECT_PACKET_LOOKASIDE),
+                        TL_INSPECT_PENDED_PACKET_POOL_TAG
+                        );
+
+   if (gPacketLookaside == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   for (i = 0; i < processorCount; i++)
+   {
+      status = ExInitializeLookasideListEx(
+                  &gPacketLookaside[i].list,
+                  NULL,
+                  NULL,
+                  NonPagedPool,
+                  EX_LOOKASIDE_LIST_EX_FLAGS_FAIL_NO_RAISE,
+                  sizeof(TL_INSPECT_PENDED_PACKET),
+                  TL_INSPECT_PENDED_PACKET_POOL_TAG,
+                  0
+                  );
+
+      if (!NT_SUCCESS(status))
+      {
+         break;
+      }
+
+      gPacketLookasideCount++;
+   }
+
+   if (!NT_SUCCESS(status))
+   {
+      TLInspectFreePacketAllocator();
+   }
+
+   return status;
+}
+
+void
+TLInspectFreePacketAllocator(void)
+{
+   ULONG i;
+
+   for (i = 0; i < gPacketLookasideCount; i++)
+   {
+      ExDeleteLookasideListEx(&gPacketLookaside[i].list);
+   }
+   gPacketLookasideCount = 0;
+
+   if (gPacketLookaside != NULL)
+   {
+      ExFreePoolWithTag(gPacketLookaside, TL_INSPECT_PENDED_PACKET_POOL_TAG);
+      gPacketLookaside = NULL;
+   }
+}
+
+__drv_allocatesMem(Mem)
+TL_INSPECT_PENDED_PACKET*
+TLInspectAllocatePendedPacket(void)
+/* ++
+
+   This function returns a pended packet zeroed up to its inline control
+   data buffer, or NULL.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet;
+   ULONG index = KeGetCurrentProcessorNumberEx(NULL) % gPacketLookasideCount;
+
+   packet = ExAllocateFromLookasideListEx(&gPacketLookaside[index].list);
+
+   if (packet == NULL)
+   {
+      TLInspectStatsPoolFailure(&gStats.packetPool);
+      return NULL;
+   }
+
+   RtlZeroMemory(
+      packet,
+      FIELD_OFFSET(TL_INSPECT_PENDED_PACKET, inlineControlData)
+      );
+
+   TLInspectStatsPoolAllocated(&gStats.packetPool);
+
+   return packet;
+}
+
+void
+TLInspectFreePendedPacketMemory(
+   _Inout_ __drv_freesMem(Mem) TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   ULONG index = KeGetCurrentProcessorNumberEx(NULL) % gPacketLookasideCount;
+
+   NT_ASSERT(packet->controlData == NULL);
+
+   ExFreeToLookasideListEx(&gPacketLookaside[index].list, packet);
+
+   TLInspectStatsPoolFreed(&gStats.packetPool);
+}
+
+WSACMSGHDR*
+TLInspectAllocateControlData(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ ULONG controlDataLength
+   )
+/* ++
+
+   This function sets packet->controlData to a buffer of controlDataLength
+   bytes, inline in the packet if it fits, and returns it (NULL on failure).
+
+-- */
+{
+   NT_ASSERT(packet->controlData == NULL);
+
+   if (controlDataLength <= sizeof(packet->inlineControlData))
+   {
+      packet->controlData = (WSACMSGHDR*)packet->inlineControlData;
+   }
+   else
+   {
+      packet->controlData = ExAllocatePoolZero(
+                              NonPagedPool,
+                              controlDataLength,
+                              TL_INSPECT_CONTROL_DATA_POOL_TAG
+                              );
+
+      if (packet->controlData == NULL)
+      {
+         TLInspectStatsPoolFailure(&gStats.controlDataPool);
+         return NULL;
+      }
+
+      TLInspectStatsPoolAllocated(&gStats.controlDataPool);
+   }
+
+   return packet->controlData;
+}
+
+void
+TLInspectFreeControlData(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   if ((packet->controlData != NULL) &&
+       (packet->controlData != (WSACMSGHDR*)packet->inlineControlData))
+   {
+      ExFreePoolWithTag(packet->controlData, TL_INSPECT_CONTROL_DATA_POOL_TAG);
+
+      TLInspectStatsPoolFreed(&gStats.controlDataPool);
+   }
+
+   packet->controlData = NULL;
+}
@@ -0,0 +1,45 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the allocator for pended packets and their
+   control data.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_ALLOC_H_
+#define _TL_INSPECT_ALLOC_H_
+
+NTSTATUS
+TLInspectInitializePacketAllocator(void);
+
+void
+TLInspectFreePacketAllocator(void);
+
+__drv_allocatesMem(Mem)
+TL_INSPECT_PENDED_PACKET*
+TLInspectAllocatePendedPacket(void);
+
+void
+TLInspectFreePendedPacketMemory(
+   _Inout_ __drv_freesMem(Mem) TL_INSPECT_PENDED_PACKET* packet
+   );
+
+WSACMSGHDR*
+TLInspectAllocateControlData(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ ULONG controlDataLength
+   );
+
+void
+TLInspectFreeControlData(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   );
+
+#endif // _TL_INSPECT_ALLOC_H_
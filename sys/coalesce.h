@@ -0,0 +1,165 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the index through which the pended connects
+   of an application to the same service are coalesced, so that a single
+   inspection decides all of them.
+
+   The first connect pended for a key leads; it is queued for inspection
+   and linked into the index. The connects pended for the key while the
+   leader waits for its decision follow it: they are linked to the leader
+   instead of being queued. When the leader is decided, it is removed from
+   the index with its followers, which are completed with its verdict one
+   by one; a connect pended for the key after that leads again.
+
+   A connect is keyed by the connect form of TL_INSPECT_FLOW_KEY, as in
+   the connect cache. The functions of the index are called with
+   gConnListLock held; bench\coalescebench.c measures it.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_COALESCE_H_
+#define _TL_INSPECT_COALESCE_H_
+
+#include "flowkey.h"
+
+//
+// Number of hash buckets; must be a power of 2.
+//
+#define TL_INSPECT_COALESCE_TABLE_SIZE 1024
+
+//
+// TL_INSPECT_COALESCE_ENTRY is embedded in a pended connect. link is in a
+// bucket of the index while the connect leads, and in the followers of its
+// leader while it follows. followers is only valid while leader is set.
+//
+typedef struct TL_INSPECT_COALESCE_ENTRY_
+{
+   LIST_ENTRY link;
+   LIST_ENTRY followers;
+   TL_INSPECT_FLOW_KEY key;
+   BOOLEAN leader;
+   BOOLEAN follower;
+} TL_INSPECT_COALESCE_ENTRY;
+
+typedef struct TL_INSPECT_COALESCE_TABLE_
+{
+   LIST_ENTRY* buckets;
+   ULONG seed;
+} TL_INSPECT_COALESCE_TABLE;
+
+__inline
+LIST_ENTRY*
+TLInspectCoalesceBucket(
+   _In_ const TL_INSPECT_COALESCE_TABLE* table,
+   _In_ const TL_INSPECT_FLOW_KEY* key
+   )
+{
+   ULONG hash = TLInspectFlowKeyHash(key, table->seed);
+
+   return &table->buckets[hash & (TL_INSPECT_COALESCE_TABLE_SIZE - 1)];
+}
+
+__inline
+TL_INSPECT_COALESCE_ENTRY*
+TLInspectCoalesceJoin(
+   _In_ const TL_INSPECT_COALESCE_TABLE* table,
+   _Inout_ TL_INSPECT_COALESCE_ENTRY* entry
+   )
+/* ++
+
+   Makes a connect whose key is set follow the leader of its key, and
+   returns the leader; if there is none, the connect leads, and NULL is
+   returned.
+
+-- */
+{
+   LIST_ENTRY* bucket = TLInspectCoalesceBucket(table, &entry->key);
+   LIST_ENTRY* listEntry;
+
+   for (listEntry = bucket->Flink;
+        listEntry != bucket;
+        listEntry = listEntry->Flink)
+   {
+      TL_INSPECT_COALESCE_ENTRY* leader = CONTAINING_RECORD(
+                                             listEntry,
+                                             TL_INSPECT_COALESCE_ENTRY,
+                                             link
+                                             );
+
+      if (RtlEqualMemory(&leader->key, &entry->key, sizeof(entry->key)))
+      {
+         entry->leader = FALSE;
+         entry->follower = TRUE;
+         InsertTailList(&leader->followers, &entry->link);
+         return leader;
+      }
+   }
+
+   entry->leader = TRUE;
+   InitializeListHead(&entry->followers);
+   InsertTailList(bucket, &entry->link);
+
+   return NULL;
+}
+
+__inline
+ULONG
+TLInspectCoalesceTakeFollowers(
+   _Inout_ TL_INSPECT_COALESCE_ENTRY* entry,
+   _Inout_ LIST_ENTRY* followers
+   )
+/* ++
+
+   Removes a decided leader from the index, moves its followers, linked by
+   their link, to the tail of followers, and returns their number. A
+   connect that does not lead has none.
+
+-- */
+{
+   ULONG count = 0;
+
+   if (!entry->leader)
+   {
+      return 0;
+   }
+
+   RemoveEntryList(&entry->link);
+   entry->leader = FALSE;
+
+   while (!IsListEmpty(&entry->followers))
+   {
+      LIST_ENTRY* link = RemoveHeadList(&entry->followers);
+
+      CONTAINING_RECORD(link, TL_INSPECT_COALESCE_ENTRY, link)->follower = FALSE;
+      InsertTailList(followers, link);
+      count++;
+   }
+
+   return count;
+}
+
+__inline
+void
+TLInspectCoalesceLeave(
+   _Inout_ TL_INSPECT_COALESCE_ENTRY* entry
+   )
+/* ++
+
+   Removes a connect that follows from the followers of its leader, which
+   will be decided without it.
+
+-- */
+{
+   RemoveEntryList(&entry->link);
+   entry->follower = FALSE;
+}
+
+#endif // _TL_INSPECT_COALESCE_H_
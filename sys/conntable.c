@@ -0,0 +1,604 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the pended connection table of the Transport
+   Inspect sample.
+
+   Every pended ALE connect is linked into a hash bucket selected by its
+   5-tuple, so that the re-auth triggered by FwpsCompleteOperation finds
+   its pended connect without walking all of them. Pended connects that
+   still wait for an inspection decision are additionally linked, in
+   arrival order, into gConnList from which the worker takes them.
+
+   When coalescing is enabled, a pended connect whose decision is already
+   awaited by an undecided connect of the same application to the same
+   service follows it instead (see coalesce.h): it is linked into the hash
+   index, for its re-auth, but not into gConnList, and is decided along
+   with its leader.
+
+   Every pended connect is also armed on a timer wheel (see wheel.h) for
+   the connect timeout, until a worker dequeues it, and again once it is
+   decided, until its re-auth. A connect still undecided when its timer
+   fires is taken off gConnList, or off its leader, and decided by the
+   default verdict (see TLInspectExpireConnects); a decided connect whose
+   re-auth never came is removed from the table and freed. A re-auth that
+   comes later finds no pended connect, as after a policy change.
+
+   The table, gConnList, the coalescing index and the timer wheel are all
+   protected by gConnListLock.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "utils.h"
+#include "conntable.h"
+#include "flowcache.h"
+#include "stats.h"
+#include "latency.h"
+
+LIST_ENTRY* gConnTable;
+
+//
+// Seed of the hash of the table (see flowkey.h).
+//
+ULONG gConnTableSeed;
+
+//
+// Number of pended connects in the table; guarded by gConnListLock.
+//
+ULONG gConnTableCount;
+
+//
+// Index of the undecided connects by decision; its buckets are NULL when
+// coalescing is disabled.
+//
+TL_INSPECT_COALESCE_TABLE gCoalesceTable;
+
+//
+// Timer wheel of the pended connects, and the connect timeout in ticks; 0
+// when the connects are not timed out.
+//
+TL_INSPECT_TIMER_WHEEL gConnWheel;
+UINT64 gConnTimeout;
+
+ULONG
+TLInspectConnHash(
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ UINT8 protocol,
+   _In_ UINT16 localPort,
+   _In_ UINT16 remotePort,
+   _In_reads_(16) const UINT8* localAddr,
+   _In_reads_(16) const UINT8* remoteAddr
+   )
+/* ++
+
+   Hash of the 5-tuple, as stored in TL_INSPECT_PENDED_PACKET.
+
+-- */
+{
+   ULONG addrLength = (addressFamily == AF_INET) ? sizeof(UINT32) :
+                                                   sizeof(FWP_BYTE_ARRAY16);
+   ULONG hash = TLInspectHashStart(gConnTableSeed);
+
+   hash = TLInspectHashBytes(hash, localAddr, addrLength);
+   hash = TLInspectHashBytes(hash, remoteAddr, addrLength);
+   hash = TLInspectHashBytes(hash, &protocol, sizeof(protocol));
+   hash = TLInspectHashBytes(hash, &localPort, sizeof(localPort));
+   hash = TLInspectHashBytes(hash, &remotePort, sizeof(remotePort));
+
+   return hash;
+}
+
+LIST_ENTRY*
+TLInspectConnBucketForPacket(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   ULONG hash = TLInspectConnHash(
+                  packet->addressFamily,
+                  packet->protocol,
+                  packet->localPort,
+                  packet->remotePort,
+                  (const UINT8*)&packet->localAddr,
+                  (const UINT8*)&packet->remoteAddr
+                  );
+
+   return &gConnTable[hash & (TL_INSPECT_CONN_TABLE_SIZE - 1)];
+}
+
+LIST_ENTRY*
+TLInspectConnBucketForValues(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer
+   )
+/* ++
+
+   Same as TLInspectConnBucketForPacket, for the classify of the re-auth.
+   The fields go through the same conversions as in FillNetwork5Tuple.
+
+-- */
+{
+   UINT32 ipv4LocalAddr;
+   UINT32 ipv4RemoteAddr;
+   const UINT8* localAddr;
+   const UINT8* remoteAddr;
+   ULONG hash;
+
+   if (layer->localAddress == TL_INSPECT_LAYER_NO_FIELD)
+   {
+      return NULL;
+   }
+
+   if (layer->addressFamily == AF_INET)
+   {
+      ipv4LocalAddr =
+         RtlUlongByteSwap(
+            inFixedValues->incomingValue[layer->localAddress].value.uint32
+            );
+      ipv4RemoteAddr =
+         RtlUlongByteSwap(
+            inFixedValues->incomingValue[layer->remoteAddress].value.uint32
+            );
+      localAddr = (const UINT8*)&ipv4LocalAddr;
+      remoteAddr = (const UINT8*)&ipv4RemoteAddr;
+   }
+   else
+   {
+      localAddr =
+         inFixedValues->incomingValue[layer->localAddress].value.byteArray16->byteArray16;
+      remoteAddr =
+         inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16->byteArray16;
+   }
+
+   hash = TLInspectConnHash(
+            layer->addressFamily,
+            inFixedValues->incomingValue[layer->protocol].value.uint8,
+            RtlUshortByteSwap(
+               inFixedValues->incomingValue[layer->localPort].value.uint16
+               ),
+            RtlUshortByteSwap(
+               inFixedValues->incomingValue[layer->remotePort].value.uint16
+               ),
+            localAddr,
+            remoteAddr
+            );
+
+   return &gConnTable[hash & (TL_INSPECT_CONN_TABLE_SIZE - 1)];
+}
+
+NTSTATUS
+TLInspectConnTableInitialize(
+   _In_ BOOLEAN coalesce,
+   _In_ ULONG timeout
+   )
+/* ++
+
+   This function allocates the table, and the coalescing index if coalesce
+   is set. timeout is the connect timeout, in milliseconds; 0 disables it.
+
+-- */
+{
+   ULONG i;
+
+   gConnTable = ExAllocatePoolZero(
+                  NonPagedPool,
+                  TL_INSPECT_CONN_TABLE_SIZE * sizeof(LIST_ENTRY),
+                  TL_INSPECT_CONNECTION_POOL_TAG
+                  );
+
+   if (gConnTable == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   for (i = 0; i < TL_INSPECT_CONN_TABLE_SIZE; i++)
+   {
+      InitializeListHead(&gConnTable[i]);
+   }
+
+   gConnTableSeed = (ULONG)KeQueryPerformanceCounter(NULL).QuadPart;
+   gConnTableCount = 0;
+
+   TLInspectWheelInitialize(&gConnWheel, TLInspectWheelNow());
+   gConnTimeout = ((UINT64)timeout + TL_INSPECT_WHEEL_TICK - 1) / TL_INSPECT_WHEEL_TICK;
+
+   if (coalesce)
+   {
+      gCoalesceTable.buckets = ExAllocatePoolZero(
+                                 NonPagedPool,
+                                 TL_INSPECT_COALESCE_TABLE_SIZE * sizeof(LIST_ENTRY),
+                                 TL_INSPECT_CONNECTION_POOL_TAG
+                                 );
+
+      if (gCoalesceTable.buckets == NULL)
+      {
+         ExFreePoolWithTag(gConnTable, TL_INSPECT_CONNECTION_POOL_TAG);
+         gConnTable = NULL;
+         return STATUS_INSUFFICIENT_RESOURCES;
+      }
+
+      for (i = 0; i < TL_INSPECT_COALESCE_TABLE_SIZE; i++)
+      {
+         InitializeListHead(&gCoalesceTable.buckets[i]);
+      }
+
+      gCoalesceTable.seed = gConnTableSeed * 16777619;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectConnTableFree(void)
+{
+   NT_ASSERT(gConnTableCount == 0);
+
+   if (gConnTable != NULL)
+   {
+      ExFreePoolWithTag(gConnTable, TL_INSPECT_CONNECTION_POOL_TAG);
+      gConnTable = NULL;
+   }
+
+   if (gCoalesceTable.buckets != NULL)
+   {
+      ExFreePoolWithTag(gCoalesceTable.buckets, TL_INSPECT_CONNECTION_POOL_TAG);
+      gCoalesceTable.buckets = NULL;
+   }
+}
+
+BOOLEAN
+TLInspectConnTableInsert(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect
+   )
+/* ++
+
+   This function adds a newly pended connect to the table and to the tail
+   of the undecided FIFO, and returns TRUE; or, if it is coalesced with an
+   undecided connect, to the table and to the followers of that connect,
+   and returns FALSE.
+
+-- */
+{
+   BOOLEAN queued = TRUE;
+
+   NT_ASSERT(pendedConnect->type == TL_INSPECT_CONNECT_PACKET);
+   NT_ASSERT(pendedConnect->authConnectDecision == 0);
+
+   pendedConnect->enqueueTime = TLInspectLatencyNow();
+
+   InsertTailList(
+      TLInspectConnBucketForPacket(pendedConnect),
+      &pendedConnect->hashEntry
+      );
+
+   if (gConnTimeout != 0)
+   {
+      TLInspectWheelArm(
+         &gConnWheel,
+         &pendedConnect->timer,
+         TLInspectWheelNow() + gConnTimeout
+         );
+   }
+
+   if (gCoalesceTable.buckets != NULL)
+   {
+      TLInspectConnectKeyFromPacket(pendedConnect, &pendedConnect->coalesce.key);
+
+      if (TLInspectCoalesceJoin(&gCoalesceTable, &pendedConnect->coalesce) != NULL)
+      {
+         TLInspectStatsIncrement(sched.coalesced);
+         queued = FALSE;
+      }
+   }
+
+   if (queued)
+   {
+      InsertTailList(&gConnList, &pendedConnect->listEntry);
+   }
+
+   gConnTableCount++;
+   gStats.connListDepth++;
+
+   return queued;
+}
+
+void
+TLInspectConnTableRemove(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect
+   )
+/* ++
+
+   This function removes a pended connect from the table, and cancels its
+   timer. The connect must already have been taken off the undecided FIFO.
+
+-- */
+{
+   RemoveEntryList(&pendedConnect->hashEntry);
+   TLInspectWheelCancel(&gConnWheel, &pendedConnect->timer);
+
+   gConnTableCount--;
+   gStats.connListDepth--;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectConnTableLookupDecided(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ FWP_DIRECTION direction
+   )
+/* ++
+
+   This function returns the pended connect matching the classify whose
+   inspection decision has been recorded, or NULL if there is none.
+
+-- */
+{
+   LIST_ENTRY* bucket;
+   LIST_ENTRY* listEntry;
+
+   bucket = TLInspectConnBucketForValues(inFixedValues, layer);
+
+   if (bucket == NULL)
+   {
+      return NULL;
+   }
+
+   for (listEntry = bucket->Flink;
+        listEntry != bucket;
+        listEntry = listEntry->Flink)
+   {
+      TL_INSPECT_PENDED_PACKET* connEntry = CONTAINING_RECORD(
+                                               listEntry,
+                                               TL_INSPECT_PENDED_PACKET,
+                                               hashEntry
+                                               );
+
+      if ((connEntry->authConnectDecision != 0) &&
+          IsMatchingConnectPacket(
+             inFixedValues,
+             layer,
+             direction,
+             connEntry
+             ))
+      {
+         return connEntry;
+      }
+   }
+
+   return NULL;
+}
+
+ULONG
+TLInspectConnTableTakeCoalesced(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect,
+   _Inout_ LIST_ENTRY* followers
+   )
+/* ++
+
+   This function ends the coalescing of a connect about to be decided:
+   the connects that follow it are moved, linked by their listEntry, to
+   the tail of followers, and their number is returned. Connects pended
+   for the same decision from now on are queued again. As in
+   TLInspectDequeueConnect, the inbound followers are removed from the
+   table; the outbound ones are left in it for their re-auth.
+
+-- */
+{
+   LIST_ENTRY taken;
+   ULONG count;
+
+   InitializeListHead(&taken);
+
+   count = TLInspectCoalesceTakeFollowers(&pendedConnect->coalesce, &taken);
+
+   while (!IsListEmpty(&taken))
+   {
+      TL_INSPECT_PENDED_PACKET* follower = CONTAINING_RECORD(
+                                              RemoveHeadList(&taken),
+                                              TL_INSPECT_PENDED_PACKET,
+                                              coalesce.link
+                                              );
+
+      TLInspectWheelCancel(&gConnWheel, &follower->timer);
+
+      if (follower->direction == FWP_DIRECTION_INBOUND)
+      {
+         TLInspectConnTableRemove(follower);
+      }
+
+      InsertTailList(followers, &follower->listEntry);
+   }
+
+   return count;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectConnTableDequeueUndecided(void)
+/* ++
+
+   This function removes the oldest pended connect from the undecided FIFO
+   and returns it, or returns NULL if the FIFO is empty. The connect stays
+   in the hash index; its timer is cancelled, the worker now deciding it.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* pendedConnect;
+
+   if (IsListEmpty(&gConnList))
+   {
+      return NULL;
+   }
+
+   pendedConnect = CONTAINING_RECORD(
+                      RemoveHeadList(&gConnList),
+                      TL_INSPECT_PENDED_PACKET,
+                      listEntry
+                      );
+
+   NT_ASSERT(pendedConnect->authConnectDecision == 0);
+
+   TLInspectWheelCancel(&gConnWheel, &pendedConnect->timer);
+
+   return pendedConnect;
+}
+
+void
+TLInspectConnTableDecide(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect,
+   _In_ UINT32 decision
+   )
+/* ++
+
+   This function records the decision of an outbound connect about to be
+   completed, and arms its timer until its re-auth.
+
+-- */
+{
+   NT_ASSERT(pendedConnect->direction == FWP_DIRECTION_OUTBOUND);
+   NT_ASSERT(!TLInspectTimerArmed(&pendedConnect->timer));
+
+   pendedConnect->authConnectDecision = decision;
+
+   if (gConnTimeout != 0)
+   {
+      TLInspectWheelArm(
+         &gConnWheel,
+         &pendedConnect->timer,
+         TLInspectWheelNow() + gConnTimeout
+         );
+   }
+}
+
+void
+TLInspectConnTableExpire(
+   _In_ UINT64 now,
+   _Inout_ LIST_ENTRY* undecided,
+   _Inout_ LIST_ENTRY* decided
+   )
+/* ++
+
+   This function advances the timer wheel to now. The connects whose timer
+   fired undecided are taken off gConnList, along with the connects that
+   follow them, or off their leader, and moved to undecided; as in
+   TLInspectDequeueConnect, the inbound ones are removed from the table.
+   The connects whose timer fired while they waited for their re-auth are
+   removed from the table and moved to decided. Both lists are linked by
+   listEntry.
+
+-- */
+{
+   LIST_ENTRY expired;
+   TL_INSPECT_TIMER* timer;
+   ULONG count;
+
+   InitializeListHead(&expired);
+
+   count = TLInspectWheelAdvance(&gConnWheel, now, &expired);
+   if (count == 0)
+   {
+      return;
+   }
+
+   TLInspectStatsAdd(timers.fired, count);
+
+   while ((timer = TLInspectWheelNextExpired(&gConnWheel, &expired)) != NULL)
+   {
+      TL_INSPECT_PENDED_PACKET* pendedConnect = CONTAINING_RECORD(
+                                                   timer,
+                                                   TL_INSPECT_PENDED_PACKET,
+                                                   timer
+                                                   );
+
+      if (pendedConnect->authConnectDecision != 0)
+      {
+         TLInspectConnTableRemove(pendedConnect);
+         InsertTailList(decided, &pendedConnect->listEntry);
+         continue;
+      }
+
+      if (pendedConnect->coalesce.follower)
+      {
+         TLInspectCoalesceLeave(&pendedConnect->coalesce);
+      }
+      else
+      {
+         RemoveEntryList(&pendedConnect->listEntry);
+      }
+
+      if (pendedConnect->direction == FWP_DIRECTION_INBOUND)
+      {
+         TLInspectConnTableRemove(pendedConnect);
+      }
+
+      InsertTailList(undecided, &pendedConnect->listEntry);
+
+      TLInspectConnTableTakeCoalesced(pendedConnect, undecided);
+   }
+}
+
+void
+TLInspectConnTableTakeDecided(
+   _Inout_ LIST_ENTRY* decided
+   )
+/* ++
+
+   This function removes from the table all the connects whose decision
+   has been recorded and that wait for their re-auth, and moves them to
+   decided, linked by their listEntry. Called during unload, so that these
+   connects need not wait for their re-auth or their timer.
+
+-- */
+{
+   ULONG i;
+
+   for (i = 0; i < TL_INSPECT_CONN_TABLE_SIZE; i++)
+   {
+      LIST_ENTRY* bucket = &gConnTable[i];
+      LIST_ENTRY* listEntry = bucket->Flink;
+
+      while (listEntry != bucket)
+      {
+         TL_INSPECT_PENDED_PACKET* connEntry = CONTAINING_RECORD(
+                                                  listEntry,
+                                                  TL_INSPECT_PENDED_PACKET,
+                                                  hashEntry
+                                                  );
+
+         listEntry = listEntry->Flink;
+
+         if (connEntry->authConnectDecision != 0)
+         {
+            TLInspectConnTableRemove(connEntry);
+            InsertTailList(decided, &connEntry->listEntry);
+         }
+      }
+   }
+}
+
+ULONG
+TLInspectConnTableTimers(void)
+{
+   return ReadULongNoFence(&gConnWheel.count);
+}
+
+BOOLEAN
+TLInspectConnTableIsEmpty(void)
+{
+   return (gConnTableCount == 0);
+}
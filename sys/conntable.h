@@ -0,0 +1,92 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the pended connection table: a hash index of
+   the pended ALE connects keyed by their 5-tuple, plus the FIFO of pended
+   connects that are waiting for an inspection decision (gConnList) and
+   the index through which connects waiting for the same decision are
+   coalesced, and the timer wheel that times them out.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_CONNTABLE_H_
+#define _TL_INSPECT_CONNTABLE_H_
+
+#include "layer.h"
+
+//
+// Number of hash buckets; must be a power of 2.
+//
+#define TL_INSPECT_CONN_TABLE_SIZE 4096
+
+NTSTATUS
+TLInspectConnTableInitialize(
+   _In_ BOOLEAN coalesce,
+   _In_ ULONG timeout
+   );
+
+void
+TLInspectConnTableFree(void);
+
+//
+// The functions below must be called with gConnListLock held.
+//
+
+BOOLEAN
+TLInspectConnTableInsert(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect
+   );
+
+void
+TLInspectConnTableRemove(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect
+   );
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectConnTableLookupDecided(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ FWP_DIRECTION direction
+   );
+
+ULONG
+TLInspectConnTableTakeCoalesced(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect,
+   _Inout_ LIST_ENTRY* followers
+   );
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectConnTableDequeueUndecided(void);
+
+void
+TLInspectConnTableDecide(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect,
+   _In_ UINT32 decision
+   );
+
+void
+TLInspectConnTableExpire(
+   _In_ UINT64 now,
+   _Inout_ LIST_ENTRY* undecided,
+   _Inout_ LIST_ENTRY* decided
+   );
+
+void
+TLInspectConnTableTakeDecided(
+   _Inout_ LIST_ENTRY* decided
+   );
+
+BOOLEAN
+TLInspectConnTableIsEmpty(void);
+
+ULONG
+TLInspectConnTableTimers(void);
+
+#endif // _TL_INSPECT_CONNTABLE_H_
@@ -0,0 +1,517 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the I/O handling of the control device of the
+   Transport Inspect sample. The IOCTLs are declared in inspectioctl.h.
+
+   IOCTL_TL_INSPECT_MAP_STATS is handled in the context of the calling
+   thread, since it maps the statistics page into the calling process;
+   the other requests go through the default queue. The mapping is kept in
+   the context of the file object and removed when its handle is closed.
+   IOCTL_TL_INSPECT_MAP_PACKET_RING is handled in the context of the
+   calling thread as well, by the verdict channel, which keeps the mapping
+   of the packet ring until the handle is closed.
+   IOCTL_TL_INSPECT_EXCHANGE_VERDICTS and IOCTL_TL_INSPECT_WAIT_PACKET_RING
+   are handed to the verdict channel, which parks the requests until it has
+   descriptors to complete them with (see verdict.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "parse.h"
+#include "trace.h"
+#include "stats.h"
+#include "latency.h"
+#include "policy.h"
+#include "verdict.h"
+#include "control.h"
+
+//
+// TL_INSPECT_FILE_CONTEXT holds the mapping of the statistics page made
+// through a handle, and the process it was made into.
+//
+typedef struct TL_INSPECT_FILE_CONTEXT_
+{
+   MDL* statsMdl;
+   void* statsAddress;
+   PEPROCESS statsProcess;
+} TL_INSPECT_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TL_INSPECT_FILE_CONTEXT, TLInspectGetFileContext)
+
+//
+// Serializes the mapping of the statistics page; it is only taken by the
+// (rare) map requests.
+//
+FAST_MUTEX gStatsMapLock;
+
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL TLInspectEvtIoDeviceControl;
+EVT_WDF_IO_IN_CALLER_CONTEXT TLInspectEvtIoInCallerContext;
+EVT_WDF_FILE_CLEANUP TLInspectEvtFileCleanup;
+
+NTSTATUS
+TLInspectControlReadTrace(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   )
+{
+   NTSTATUS status;
+   TL_INSPECT_TRACE_READ_INPUT* inputBuffer;
+   TL_INSPECT_TRACE_READ_INPUT input;
+   TL_INSPECT_TRACE_READ_OUTPUT* output;
+   SIZE_T outputLength;
+
+   status = WdfRequestRetrieveInputBuffer(
+               request,
+               sizeof(TL_INSPECT_TRACE_READ_INPUT),
+               (PVOID*)&inputBuffer,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   //
+   // The input and output buffers are the same system buffer; keep a copy
+   // of the input.
+   //
+   input = *inputBuffer;
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               FIELD_OFFSET(TL_INSPECT_TRACE_READ_OUTPUT, records),
+               (PVOID*)&output,
+               &outputLength
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   return TLInspectTraceRead(
+             &input,
+             output,
+             outputLength,
+             bytesReturned
+             );
+}
+
+NTSTATUS
+TLInspectControlQueryTraceInfo(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   )
+{
+   NTSTATUS status;
+   TL_INSPECT_TRACE_INFO* info;
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               sizeof(TL_INSPECT_TRACE_INFO),
+               (PVOID*)&info,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   TLInspectTraceQueryInfo(info);
+   *bytesReturned = sizeof(TL_INSPECT_TRACE_INFO);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectControlSetTraceLevel(
+   _In_ WDFREQUEST request
+   )
+{
+   NTSTATUS status;
+   ULONG* level;
+
+   status = WdfRequestRetrieveInputBuffer(
+               request,
+               sizeof(ULONG),
+               (PVOID*)&level,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   if (*level >= TL_INSPECT_TRACE_LEVEL_MAX)
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   TLInspectTraceSetLevel(*level);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectControlQueryLatency(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   )
+{
+   NTSTATUS status;
+   TL_INSPECT_LATENCY_INFO* info;
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               sizeof(TL_INSPECT_LATENCY_INFO),
+               (PVOID*)&info,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   status = TLInspectLatencyQuery(info);
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   *bytesReturned = sizeof(TL_INSPECT_LATENCY_INFO);
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectControlReloadPolicy(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   )
+/* ++
+
+   Reloads the policy. The requests of the default queue are presented at
+   PASSIVE_LEVEL, in which the reload waits for the readers of the previous
+   policy. The output buffer is optional.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_POLICY_INFO* info = NULL;
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               sizeof(TL_INSPECT_POLICY_INFO),
+               (PVOID*)&info,
+               NULL
+               );
+   if (status == STATUS_BUFFER_TOO_SMALL)
+   {
+      info = NULL;
+   }
+   else if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   status = TLInspectPolicyReload(info);
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   if (info != NULL)
+   {
+      *bytesReturned = sizeof(TL_INSPECT_POLICY_INFO);
+   }
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectControlMapStats(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   )
+/* ++
+
+   This function maps the statistics page into the calling process, unless
+   it was already mapped through the same handle. It runs in the context of
+   the caller.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_STATS_MAPPING* mapping;
+   TL_INSPECT_FILE_CONTEXT* context;
+
+   *bytesReturned = 0;
+
+   if (WdfRequestGetRequestorMode(request) != UserMode)
+   {
+      return STATUS_INVALID_DEVICE_REQUEST;
+   }
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               sizeof(TL_INSPECT_STATS_MAPPING),
+               (PVOID*)&mapping,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   context = TLInspectGetFileContext(WdfRequestGetFileObject(request));
+
+   ExAcquireFastMutex(&gStatsMapLock);
+
+   if (context->statsAddress == NULL)
+   {
+      status = TLInspectStatsMapPage(
+                  &context->statsMdl,
+                  &context->statsAddress
+                  );
+      if (NT_SUCCESS(status))
+      {
+         context->statsProcess = PsGetCurrentProcess();
+         ObReferenceObject(context->statsProcess);
+      }
+   }
+   else if (context->statsProcess != PsGetCurrentProcess())
+   {
+      //
+      // The handle was shared with another process; the page is mapped
+      // into the first process only.
+      //
+      status = STATUS_ACCESS_DENIED;
+   }
+
+   if (NT_SUCCESS(status))
+   {
+      mapping->address = (UINT64)(ULONG_PTR)context->statsAddress;
+      *bytesReturned = sizeof(TL_INSPECT_STATS_MAPPING);
+   }
+
+   ExReleaseFastMutex(&gStatsMapLock);
+
+   return status;
+}
+
+void
+TLInspectEvtIoInCallerContext(
+   _In_ WDFDEVICE device,
+   _In_ WDFREQUEST request
+   )
+{
+   NTSTATUS status;
+   WDF_REQUEST_PARAMETERS parameters;
+   SIZE_T bytesReturned;
+
+   WDF_REQUEST_PARAMETERS_INIT(&parameters);
+   WdfRequestGetParameters(request, &parameters);
+
+   if ((parameters.Type == WdfRequestTypeDeviceControl) &&
+       (parameters.Parameters.DeviceIoControl.IoControlCode ==
+          IOCTL_TL_INSPECT_MAP_STATS))
+   {
+      status = TLInspectControlMapStats(request, &bytesReturned);
+      WdfRequestCompleteWithInformation(request, status, bytesReturned);
+      return;
+   }
+
+   if ((parameters.Type == WdfRequestTypeDeviceControl) &&
+       (parameters.Parameters.DeviceIoControl.IoControlCode ==
+          IOCTL_TL_INSPECT_MAP_PACKET_RING))
+   {
+      status = TLInspectVerdictMapPacketRing(request, &bytesReturned);
+      WdfRequestCompleteWithInformation(request, status, bytesReturned);
+      return;
+   }
+
+   status = WdfDeviceEnqueueRequest(device, request);
+   if (!NT_SUCCESS(status))
+   {
+      WdfRequestComplete(request, status);
+   }
+}
+
+void
+TLInspectEvtFileCleanup(
+   _In_ WDFFILEOBJECT fileObject
+   )
+/* ++
+
+   This function detaches the policy daemon if the handle being closed is
+   its own, unmapping its packet ring, and removes the mapping of the
+   statistics page made through the handle. Cleanup normally runs in the
+   process that made the mapping; if the handle was duplicated into another
+   process that closed it last, we attach to the mapping process to unmap.
+
+-- */
+{
+   TL_INSPECT_FILE_CONTEXT* context = TLInspectGetFileContext(fileObject);
+   KAPC_STATE apcState;
+   BOOLEAN attached = FALSE;
+
+   TLInspectVerdictFileCleanup(fileObject);
+
+   if (context->statsAddress == NULL)
+   {
+      return;
+   }
+
+   if (context->statsProcess != PsGetCurrentProcess())
+   {
+      KeStackAttachProcess(context->statsProcess, &apcState);
+      attached = TRUE;
+   }
+
+   TLInspectStatsUnmapPage(context->statsMdl, context->statsAddress);
+
+   if (attached)
+   {
+      KeUnstackDetachProcess(&apcState);
+   }
+
+   ObDereferenceObject(context->statsProcess);
+
+   context->statsMdl = NULL;
+   context->statsAddress = NULL;
+   context->statsProcess = NULL;
+}
+
+void
+TLInspectEvtIoDeviceControl(
+   _In_ WDFQUEUE queue,
+   _In_ WDFREQUEST request,
+   _In_ size_t outputBufferLength,
+   _In_ size_t inputBufferLength,
+   _In_ ULONG ioControlCode
+   )
+{
+   NTSTATUS status;
+   SIZE_T bytesReturned = 0;
+
+   UNREFERENCED_PARAMETER(queue);
+   UNREFERENCED_PARAMETER(outputBufferLength);
+   UNREFERENCED_PARAMETER(inputBufferLength);
+
+   switch (ioControlCode)
+   {
+   case IOCTL_TL_INSPECT_READ_TRACE:
+      status = TLInspectControlReadTrace(request, &bytesReturned);
+      break;
+   case IOCTL_TL_INSPECT_QUERY_TRACE_INFO:
+      status = TLInspectControlQueryTraceInfo(request, &bytesReturned);
+      break;
+   case IOCTL_TL_INSPECT_SET_TRACE_LEVEL:
+      status = TLInspectControlSetTraceLevel(request);
+      break;
+   case IOCTL_TL_INSPECT_QUERY_LATENCY:
+      status = TLInspectControlQueryLatency(request, &bytesReturned);
+      break;
+   case IOCTL_TL_INSPECT_RELOAD_POLICY:
+      status = TLInspectControlReloadPolicy(request, &bytesReturned);
+      break;
+   case IOCTL_TL_INSPECT_EXCHANGE_VERDICTS:
+      //
+      // The request is completed by the verdict channel, possibly later.
+      //
+      TLInspectVerdictExchange(request);
+      return;
+   case IOCTL_TL_INSPECT_WAIT_PACKET_RING:
+      TLInspectVerdictWaitPacketRing(request);
+      return;
+   default:
+      status = STATUS_INVALID_DEVICE_REQUEST;
+      break;
+   }
+
+   WdfRequestCompleteWithInformation(request, status, bytesReturned);
+}
+
+void
+TLInspectInitControlDevice(
+   _Inout_ PWDFDEVICE_INIT deviceInit
+   )
+/* ++
+
+   This function sets up the file objects of the control device, which
+   carry the statistics page mappings, and the in-caller-context handling
+   of the map request. It is called before the device is created.
+
+-- */
+{
+   WDF_FILEOBJECT_CONFIG fileConfig;
+   WDF_OBJECT_ATTRIBUTES fileAttributes;
+
+   ExInitializeFastMutex(&gStatsMapLock);
+
+   WDF_FILEOBJECT_CONFIG_INIT(
+      &fileConfig,
+      WDF_NO_EVENT_CALLBACK,
+      WDF_NO_EVENT_CALLBACK,
+      TLInspectEvtFileCleanup
+      );
+   WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
+      &fileAttributes,
+      TL_INSPECT_FILE_CONTEXT
+      );
+
+   WdfDeviceInitSetFileObjectConfig(
+      deviceInit,
+      &fileConfig,
+      &fileAttributes
+      );
+
+   WdfDeviceInitSetIoInCallerContextCallback(
+      deviceInit,
+      TLInspectEvtIoInCallerContext
+      );
+}
+
+NTSTATUS
+TLInspectCreateControlQueue(
+   _In_ WDFDEVICE device
+   )
+/* ++
+
+   This function creates the default queue of the control device; requests
+   are dispatched in parallel.
+
+-- */
+{
+   WDF_IO_QUEUE_CONFIG queueConfig;
+
+   WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
+      &queueConfig,
+      WdfIoQueueDispatchParallel
+      );
+   queueConfig.EvtIoDeviceControl = TLInspectEvtIoDeviceControl;
+
+   return WdfIoQueueCreate(
+             device,
+             &queueConfig,
+             WDF_NO_OBJECT_ATTRIBUTES,
+             WDF_NO_HANDLE
+             );
+}
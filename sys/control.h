@@ -0,0 +1,29 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the I/O handling of the control device of the
+   Transport Inspect sample.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_CONTROL_H_
+#define _TL_INSPECT_CONTROL_H_
+
+void
+TLInspectInitControlDevice(
+   _Inout_ PWDFDEVICE_INIT deviceInit
+   );
+
+NTSTATUS
+TLInspectCreateControlQueue(
+   _In_ WDFDEVICE device
+   );
+
+#endif // _TL_INSPECT_CONTROL_H_
@@ -0,0 +1,274 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the cursor used to read headers and payload out of
+   the MDL chain of a NET_BUFFER.
+
+   Data that lies within a single MDL is returned in place, without a
+   copy. Only a header that straddles two or more MDLs is copied into the
+   scratch buffer of the cursor. Unlike NdisGetDataBuffer with no storage,
+   such a header is still returned instead of being skipped.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "cursor.h"
+
+#define TL_INSPECT_MDL_PRIORITY (LowPagePriority | MdlMappingNoExecute)
+
+void
+TLInspectCursorSkipEmptyMdls(
+   _Inout_ TL_INSPECT_CURSOR* cursor
+   )
+{
+   while ((cursor->mdl != NULL) &&
+          (cursor->mdlOffset >= MmGetMdlByteCount(cursor->mdl)))
+   {
+      cursor->mdlOffset -= MmGetMdlByteCount(cursor->mdl);
+      cursor->mdl = NDIS_MDL_LINKAGE(cursor->mdl);
+   }
+}
+
+const UINT8*
+TLInspectCursorMapCurrent(
+   _In_ const TL_INSPECT_CURSOR* cursor,
+   _Out_ ULONG* available
+   )
+/* ++
+
+   This function returns the system address of the cursor position and the
+   number of bytes, bounded by the remaining length, that follow it in the
+   current MDL.
+
+-- */
+{
+   UINT8* va;
+   ULONG length;
+
+   *available = 0;
+
+   NdisQueryMdl(cursor->mdl, &va, &length, TL_INSPECT_MDL_PRIORITY);
+
+   if (va == NULL)
+   {
+      return NULL;
+   }
+
+   *available = min(length - cursor->mdlOffset, cursor->remaining);
+
+   return va + cursor->mdlOffset;
+}
+
+BOOLEAN
+TLInspectCursorInitialize(
+   _Out_ TL_INSPECT_CURSOR* cursor,
+   _In_ NET_BUFFER* netBuffer,
+   _In_ ULONG retreat
+   )
+/* ++
+
+   This function positions the cursor retreat bytes before the current data
+   start of the net buffer, e.g. to read the IP header of an inbound packet
+   at a layer that has already advanced past it. It fails if those bytes
+   are not in the current MDL.
+
+-- */
+{
+   cursor->mdl = NET_BUFFER_CURRENT_MDL(netBuffer);
+   cursor->mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer);
+   cursor->remaining = NET_BUFFER_DATA_LENGTH(netBuffer);
+
+   if (retreat > cursor->mdlOffset)
+   {
+      cursor->remaining = 0;
+      return FALSE;
+   }
+
+   cursor->mdlOffset -= retreat;
+   cursor->remaining += retreat;
+
+   TLInspectCursorSkipEmptyMdls(cursor);
+
+   return TRUE;
+}
+
+const void*
+TLInspectCursorPeek(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ULONG length
+   )
+/* ++
+
+   This function returns a pointer to the next length bytes without moving
+   the cursor, or NULL if the packet is shorter, the bytes straddle MDLs
+   and do not fit into the scratch buffer, or an MDL cannot be mapped. The
+   pointer is valid until the cursor is used again.
+
+-- */
+{
+   const UINT8* data;
+   ULONG available;
+   ULONG copied;
+   MDL* mdl;
+   ULONG mdlOffset;
+
+   if ((length == 0) || (length > cursor->remaining) || (cursor->mdl == NULL))
+   {
+      return NULL;
+   }
+
+   data = TLInspectCursorMapCurrent(cursor, &available);
+
+   if (data == NULL)
+   {
+      return NULL;
+   }
+
+   if (length <= available)
+   {
+      return data;
+   }
+
+   if (length > sizeof(cursor->scratch))
+   {
+      return NULL;
+   }
+
+   //
+   // The bytes straddle MDLs; gather them into the scratch buffer.
+   //
+   RtlCopyMemory(cursor->scratch, data, available);
+   copied = available;
+
+   mdl = NDIS_MDL_LINKAGE(cursor->mdl);
+   mdlOffset = 0;
+
+   while (copied < length)
+   {
+      UINT8* va;
+      ULONG mdlLength;
+      ULONG chunk;
+
+      if (mdl == NULL)
+      {
+         return NULL;
+      }
+
+      NdisQueryMdl(mdl, &va, &mdlLength, TL_INSPECT_MDL_PRIORITY);
+
+      if (va == NULL)
+      {
+         return NULL;
+      }
+
+      chunk = min(mdlLength - mdlOffset, length - copied);
+
+      RtlCopyMemory(cursor->scratch + copied, va + mdlOffset, chunk);
+      copied += chunk;
+
+      mdl = NDIS_MDL_LINKAGE(mdl);
+   }
+
+   return cursor->scratch;
+}
+
+BOOLEAN
+TLInspectCursorAdvance(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ULONG length
+   )
+/* ++
+
+   This function moves the cursor past length bytes. It fails if the data
+   or the MDL chain ends before them; the cursor is then left at the end.
+
+-- */
+{
+   if (length > cursor->remaining)
+   {
+      return FALSE;
+   }
+
+   cursor->remaining -= length;
+   cursor->mdlOffset += length;
+
+   TLInspectCursorSkipEmptyMdls(cursor);
+
+   if ((cursor->mdl == NULL) && (cursor->mdlOffset != 0))
+   {
+      cursor->remaining = 0;
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+const void*
+TLInspectCursorPull(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ULONG length
+   )
+/* ++
+
+   Same as TLInspectCursorPeek, and moves the cursor past the bytes on
+   success.
+
+-- */
+{
+   const void* data = TLInspectCursorPeek(cursor, length);
+
+   if (data != NULL)
+   {
+      TLInspectCursorAdvance(cursor, length);
+   }
+
+   return data;
+}
+
+const UINT8*
+TLInspectCursorNextSpan(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Out_ ULONG* spanLength
+   )
+/* ++
+
+   This function returns the contiguous bytes from the cursor to the end of
+   the current MDL, in place, and moves the cursor past them. It is used to
+   walk the payload without copying; NULL marks the end of the data (or an
+   MDL that cannot be mapped).
+
+-- */
+{
+   const UINT8* data;
+
+   *spanLength = 0;
+
+   if ((cursor->remaining == 0) || (cursor->mdl == NULL))
+   {
+      return NULL;
+   }
+
+   data = TLInspectCursorMapCurrent(cursor, spanLength);
+
+   if (data != NULL)
+   {
+      TLInspectCursorAdvance(cursor, *spanLength);
+   }
+
+   return data;
+}
@@ -0,0 +1,80 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the cursor used to read headers and payload
+   out of the MDL chain of a NET_BUFFER.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_CURSOR_H_
+#define _TL_INSPECT_CURSOR_H_
+
+//
+// Largest header that can be read when it straddles MDLs; it has to be
+// copied into the scratch buffer of the cursor then. Covers an IPv4 header
+// or a TCP header with the maximum amount of options.
+//
+#define TL_INSPECT_CURSOR_SCRATCH_SIZE 64
+
+//
+// TL_INSPECT_CURSOR is a read position in the data of a NET_BUFFER. It is
+// meant to live on the stack of the caller, which also makes the scratch
+// buffer private to the caller.
+//
+typedef struct TL_INSPECT_CURSOR_
+{
+   MDL* mdl;
+   ULONG mdlOffset;
+   ULONG remaining;
+
+   UINT8 scratch[TL_INSPECT_CURSOR_SCRATCH_SIZE];
+} TL_INSPECT_CURSOR;
+
+BOOLEAN
+TLInspectCursorInitialize(
+   _Out_ TL_INSPECT_CURSOR* cursor,
+   _In_ NET_BUFFER* netBuffer,
+   _In_ ULONG retreat
+   );
+
+const void*
+TLInspectCursorPeek(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ULONG length
+   );
+
+BOOLEAN
+TLInspectCursorAdvance(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ULONG length
+   );
+
+const void*
+TLInspectCursorPull(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ULONG length
+   );
+
+const UINT8*
+TLInspectCursorNextSpan(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Out_ ULONG* spanLength
+   );
+
+__inline
+ULONG
+TLInspectCursorRemaining(
+   _In_ const TL_INSPECT_CURSOR* cursor
+   )
+{
+   return cursor->remaining;
+}
+
+#endif // _TL_INSPECT_CURSOR_H_
@@ -0,0 +1,1075 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the verdict caches of the Transport Inspect
+   sample: the flow cache and the connect cache.
+
+   Once a worker thread has decided a pended connect or packet, the
+   verdict is stored under the 5-tuple of its flow. The transport classify
+   looks the flow up first, and applies a cached verdict inline instead of
+   pending the packet, so that only the first packets of a flow take the
+   out-of-band path.
+
+   Once a worker thread has decided a pended connect, the verdict is also
+   stored under the application that made the connection, its remote
+   address, its protocol and the port of the service, which is the remote
+   port of an outbound connection and the local port of an inbound one.
+   The application is identified by the hash of its ALE application id,
+   as in the descriptors handed to the policy daemon. The ALE classifies
+   look the connection up once the inspection rules did not decide it, and
+   apply a cached verdict inline instead of pending it: the connections an
+   application keeps making to the same service only take the out-of-band
+   path once per time to live. Blocks are cached as well, usually for less
+   long, so that an application retrying a blocked connection does not
+   pend every attempt.
+
+   Both caches are hash tables of the same kind. Each bucket has a
+   reader/writer spin lock: classifies on all processors look entries up
+   concurrently under the shared lock, and the workers take it
+   exclusively to add or refresh entries. An entry expires at a time set
+   when it is stored; a hit on a flow pushes the time back, so that flows
+   expire once unused for the idle timeout, while a hit on a connection
+   does not, so that a verdict is never applied for longer than its time
+   to live. The number of entries of each cache is capped; once the cap
+   is reached new entries are not cached, and keep being pended, until
+   entries expire.
+
+   Each cache has a timer wheel (see wheel.h), advanced by the periodic
+   timer, on which every entry is armed for the time it expires at when it
+   is created. A hit or a new verdict that pushes the time back does not
+   touch the wheel: when the timer of an entry fires, an entry still live
+   is armed again for its current time, and an expired one is freed (see
+   TLInspectFlowTableExpire). A flow is thus armed about once per idle
+   timeout, however many packets hit it, and the caches are never walked.
+   The lock of the wheel is only taken under the lock of a bucket.
+
+   Changing the traffic policy flushes both caches by bumping their
+   generation: entries of an older generation are treated as expired.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "utils.h"
+#include "flowcache.h"
+#include "stats.h"
+
+//
+// TL_INSPECT_FLOW_ENTRY is an entry of a cache; bucket is the bucket it is
+// linked into, for the whole life of the entry.
+//
+typedef struct TL_INSPECT_FLOW_ENTRY_
+{
+   LIST_ENTRY link;
+   TL_INSPECT_TIMER timer;
+   struct TL_INSPECT_FLOW_BUCKET_* bucket;
+   TL_INSPECT_FLOW_KEY key;
+   FWP_ACTION_TYPE action;
+   LONG generation;
+   volatile LONG64 expires;
+} TL_INSPECT_FLOW_ENTRY;
+
+typedef struct TL_INSPECT_FLOW_BUCKET_
+{
+   EX_SPIN_LOCK lock;
+   LIST_ENTRY flows;
+} TL_INSPECT_FLOW_BUCKET;
+
+//
+// TL_INSPECT_FLOW_TABLE is one of the caches; buckets is NULL when it is
+// disabled. The lifetimes of the entries are in 100ns units, 0 for a
+// verdict that is not cached. When refresh is set, a hit pushes the
+// expiry of its entry back by its lifetime. wheel holds the timers of the
+// entries, under wheelLock. counters is the offset of the counters of the
+// cache in TL_INSPECT_CPU_STATS.
+//
+typedef struct TL_INSPECT_FLOW_TABLE_
+{
+   TL_INSPECT_FLOW_BUCKET* buckets;
+   ULONG size;                         // a power of 2
+   ULONG seed;
+
+   LONG maxEntries;
+   volatile LONG count;
+
+   UINT64 permitLifetime;
+   UINT64 blockLifetime;
+   BOOLEAN refresh;
+
+   KSPIN_LOCK wheelLock;
+   TL_INSPECT_TIMER_WHEEL wheel;
+
+   SIZE_T counters;
+} TL_INSPECT_FLOW_TABLE;
+
+TL_INSPECT_FLOW_TABLE gFlowCache;
+TL_INSPECT_FLOW_TABLE gConnectCache;
+
+volatile LONG gFlowCacheGeneration;
+
+void
+TLInspectFlowKeyAddress(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ UINT8 field,
+   _Out_writes_bytes_(16) UINT8* address
+   )
+/* ++
+
+   Copies an address field of a classify to a key, converted as in
+   FillNetwork5Tuple.
+
+-- */
+{
+   if (layer->addressFamily == AF_INET)
+   {
+      UINT32 ipv4Addr =
+         RtlUlongByteSwap(inFixedValues->incomingValue[field].value.uint32);
+
+      RtlCopyMemory(address, &ipv4Addr, sizeof(UINT32));
+   }
+   else
+   {
+      RtlCopyMemory(
+         address,
+         inFixedValues->incomingValue[field].value.byteArray16,
+         sizeof(FWP_BYTE_ARRAY16)
+         );
+   }
+}
+
+void
+TLInspectFlowKeyFromPacket(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   )
+{
+   ULONG addrLength = (packet->addressFamily == AF_INET) ?
+                         sizeof(UINT32) : sizeof(FWP_BYTE_ARRAY16);
+
+   RtlZeroMemory(key, sizeof(*key));
+
+   key->addressFamily = packet->addressFamily;
+   key->protocol = packet->protocol;
+   key->direction = (UINT8)packet->direction;
+   key->localPort = packet->localPort;
+   key->remotePort = packet->remotePort;
+   RtlCopyMemory(key->localAddr, &packet->localAddr, addrLength);
+   RtlCopyMemory(key->remoteAddr, &packet->remoteAddr, addrLength);
+}
+
+BOOLEAN
+TLInspectFlowKeyFromValues(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   )
+/* ++
+
+   Same as TLInspectFlowKeyFromPacket, for the classify of a packet. The
+   fields go through the same conversions as in FillNetwork5Tuple.
+
+-- */
+{
+   RtlZeroMemory(key, sizeof(*key));
+
+   if (layer->localAddress == TL_INSPECT_LAYER_NO_FIELD)
+   {
+      return FALSE;
+   }
+
+   TLInspectFlowKeyAddress(inFixedValues, layer, layer->localAddress, key->localAddr);
+   TLInspectFlowKeyAddress(inFixedValues, layer, layer->remoteAddress, key->remoteAddr);
+
+   key->addressFamily = layer->addressFamily;
+   key->protocol = inFixedValues->incomingValue[layer->protocol].value.uint8;
+   key->direction = layer->direction;
+   key->localPort =
+      RtlUshortByteSwap(
+         inFixedValues->incomingValue[layer->localPort].value.uint16
+         );
+   key->remotePort =
+      RtlUshortByteSwap(
+         inFixedValues->incomingValue[layer->remotePort].value.uint16
+         );
+
+   return TRUE;
+}
+
+void
+TLInspectFlowKeyFromPacketInfo(
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   )
+/* ++
+
+   Same as TLInspectFlowKeyFromPacket, for a packet parsed at an IP packet
+   layer, whose addresses are in network order and ports in host order.
+
+-- */
+{
+   ULONG addrLength = (info->addressFamily == AF_INET) ?
+                         sizeof(UINT32) : sizeof(FWP_BYTE_ARRAY16);
+   BOOLEAN outbound = (layer->direction == FWP_DIRECTION_OUTBOUND);
+
+   RtlZeroMemory(key, sizeof(*key));
+
+   key->addressFamily = info->addressFamily;
+   key->protocol = info->protocol;
+   key->direction = layer->direction;
+   key->localPort = RtlUshortByteSwap(
+                       outbound ? info->sourcePort : info->destinationPort
+                       );
+   key->remotePort = RtlUshortByteSwap(
+                        outbound ? info->destinationPort : info->sourcePort
+                        );
+   RtlCopyMemory(
+      key->localAddr,
+      outbound ? &info->sourceAddress : &info->destinationAddress,
+      addrLength
+      );
+   RtlCopyMemory(
+      key->remoteAddr,
+      outbound ? &info->destinationAddress : &info->sourceAddress,
+      addrLength
+      );
+}
+
+void
+TLInspectConnectKeyFromPacket(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   )
+{
+   ULONG addrLength = (packet->addressFamily == AF_INET) ?
+                         sizeof(UINT32) : sizeof(FWP_BYTE_ARRAY16);
+
+   RtlZeroMemory(key, sizeof(*key));
+
+   key->appId = packet->appId;
+   key->addressFamily = packet->addressFamily;
+   key->protocol = packet->protocol;
+   key->direction = (UINT8)packet->direction;
+
+   if (packet->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      key->remotePort = packet->remotePort;
+   }
+   else
+   {
+      key->localPort = packet->localPort;
+   }
+
+   RtlCopyMemory(key->remoteAddr, &packet->remoteAddr, addrLength);
+}
+
+void
+TLInspectConnectKeyFromValues(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   )
+/* ++
+
+   Same as TLInspectConnectKeyFromPacket, for the classify of an ALE
+   layer.
+
+-- */
+{
+   RtlZeroMemory(key, sizeof(*key));
+
+   if (layer->appId != TL_INSPECT_LAYER_NO_FIELD)
+   {
+      key->appId = TLInspectHashAppId(
+                      &inFixedValues->incomingValue[layer->appId].value
+                      );
+   }
+
+   key->addressFamily = layer->addressFamily;
+   key->protocol = inFixedValues->incomingValue[layer->protocol].value.uint8;
+   key->direction = layer->direction;
+
+   if (layer->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      key->remotePort =
+         RtlUshortByteSwap(
+            inFixedValues->incomingValue[layer->remotePort].value.uint16
+            );
+   }
+   else
+   {
+      key->localPort =
+         RtlUshortByteSwap(
+            inFixedValues->incomingValue[layer->localPort].value.uint16
+            );
+   }
+
+   TLInspectFlowKeyAddress(inFixedValues, layer, layer->remoteAddress, key->remoteAddr);
+}
+
+TL_INSPECT_FLOW_BUCKET*
+TLInspectFlowBucket(
+   _In_ const TL_INSPECT_FLOW_TABLE* table,
+   _In_ const TL_INSPECT_FLOW_KEY* key
+   )
+{
+   ULONG hash = TLInspectFlowKeyHash(key, table->seed);
+
+   return &table->buckets[hash & (table->size - 1)];
+}
+
+__inline
+TL_INSPECT_FLOW_CACHE_COUNTERS*
+TLInspectFlowTableCounters(
+   _In_ const TL_INSPECT_FLOW_TABLE* table
+   )
+{
+   return (TL_INSPECT_FLOW_CACHE_COUNTERS*)
+             ((UINT8*)TLInspectStatsCurrentCpu() + table->counters);
+}
+
+__inline
+UINT64
+TLInspectFlowTableLifetime(
+   _In_ const TL_INSPECT_FLOW_TABLE* table,
+   _In_ FWP_ACTION_TYPE action
+   )
+{
+   return (action == FWP_ACTION_BLOCK) ? table->blockLifetime :
+                                         table->permitLifetime;
+}
+
+__inline
+BOOLEAN
+TLInspectFlowEntryIsLive(
+   _In_ const TL_INSPECT_FLOW_ENTRY* entry,
+   _In_ UINT64 now
+   )
+{
+   return (entry->generation == ReadNoFence(&gFlowCacheGeneration)) &&
+          (now < (UINT64)ReadNoFence64(&entry->expires));
+}
+
+NTSTATUS
+TLInspectFlowTableInitialize(
+   _Out_ TL_INSPECT_FLOW_TABLE* table,
+   _In_ ULONG size,
+   _In_ ULONG maxEntries,
+   _In_ UINT64 permitLifetime,
+   _In_ UINT64 blockLifetime,
+   _In_ BOOLEAN refresh,
+   _In_ SIZE_T counters
+   )
+/* ++
+
+   This function allocates the buckets of a cache, unless maxEntries is 0
+   or no verdict is cached, which disables it.
+
+-- */
+{
+   ULONG i;
+
+   RtlZeroMemory(table, sizeof(*table));
+
+   table->size = size;
+   table->maxEntries = (LONG)min(maxEntries, MAXLONG);
+   table->permitLifetime = permitLifetime;
+   table->blockLifetime = blockLifetime;
+   table->refresh = refresh;
+   table->counters = counters;
+
+   if ((maxEntries == 0) || ((permitLifetime == 0) && (blockLifetime == 0)))
+   {
+      return STATUS_SUCCESS;
+   }
+
+   table->buckets = ExAllocatePoolZero(
+                       NonPagedPool,
+                       size * sizeof(TL_INSPECT_FLOW_BUCKET),
+                       TL_INSPECT_FLOW_POOL_TAG
+                       );
+
+   if (table->buckets == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   for (i = 0; i < size; i++)
+   {
+      InitializeListHead(&table->buckets[i].flows);
+   }
+
+   table->seed = (ULONG)KeQueryPerformanceCounter(NULL).QuadPart;
+
+   KeInitializeSpinLock(&table->wheelLock);
+   TLInspectWheelInitialize(&table->wheel, TLInspectWheelNow());
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectFlowTableFree(
+   _Inout_ TL_INSPECT_FLOW_TABLE* table
+   )
+/* ++
+
+   This function frees all the entries and the buckets of a cache, once
+   the periodic timer is stopped; the wheel goes with the entries.
+
+-- */
+{
+   ULONG i;
+
+   if (table->buckets == NULL)
+   {
+      return;
+   }
+
+   for (i = 0; i < table->size; i++)
+   {
+      while (!IsListEmpty(&table->buckets[i].flows))
+      {
+         TL_INSPECT_FLOW_ENTRY* entry = CONTAINING_RECORD(
+                                           RemoveHeadList(&table->buckets[i].flows),
+                                           TL_INSPECT_FLOW_ENTRY,
+                                           link
+                                           );
+
+         ExFreePoolWithTag(entry, TL_INSPECT_FLOW_POOL_TAG);
+         table->count--;
+      }
+   }
+
+   NT_ASSERT(table->count == 0);
+
+   ExFreePoolWithTag(table->buckets, TL_INSPECT_FLOW_POOL_TAG);
+   table->buckets = NULL;
+}
+
+BOOLEAN
+TLInspectFlowTableLookup(
+   _In_ TL_INSPECT_FLOW_TABLE* table,
+   _In_ const TL_INSPECT_FLOW_KEY* key,
+   _Out_ FWP_ACTION_TYPE* action
+   )
+/* ++
+
+   This function returns TRUE, and the cached verdict in action, if the
+   key has a live entry in the cache.
+
+-- */
+{
+   TL_INSPECT_FLOW_BUCKET* bucket = TLInspectFlowBucket(table, key);
+   LIST_ENTRY* listEntry;
+   UINT64 now = KeQueryInterruptTime();
+   KIRQL oldIrql;
+   BOOLEAN found = FALSE;
+
+   oldIrql = ExAcquireSpinLockShared(&bucket->lock);
+
+   for (listEntry = bucket->flows.Flink;
+        listEntry != &bucket->flows;
+        listEntry = listEntry->Flink)
+   {
+      TL_INSPECT_FLOW_ENTRY* entry = CONTAINING_RECORD(
+                                        listEntry,
+                                        TL_INSPECT_FLOW_ENTRY,
+                                        link
+                                        );
+
+      if (!RtlEqualMemory(&entry->key, key, sizeof(*key)))
+      {
+         continue;
+      }
+
+      if (TLInspectFlowEntryIsLive(entry, now))
+      {
+         *action = entry->action;
+
+         if (table->refresh)
+         {
+            UINT64 expires = now + TLInspectFlowTableLifetime(table, entry->action);
+
+            //
+            // The shared lock does not order this store against other
+            // readers; any of the racing times is good enough.
+            //
+            if (expires - (UINT64)ReadNoFence64(&entry->expires) >
+                TL_INSPECT_FLOW_CACHE_TOUCH_INTERVAL)
+            {
+               WriteNoFence64(&entry->expires, (LONG64)expires);
+            }
+         }
+
+         found = TRUE;
+      }
+
+      break;
+   }
+
+   ExReleaseSpinLockShared(&bucket->lock, oldIrql);
+
+   if (found)
+   {
+      InterlockedIncrementNoFence64(&TLInspectFlowTableCounters(table)->hits);
+
+      if (*action == FWP_ACTION_BLOCK)
+      {
+         InterlockedIncrementNoFence64(&TLInspectFlowTableCounters(table)->blockHits);
+      }
+   }
+
+   return found;
+}
+
+void
+TLInspectFlowTableInsert(
+   _Inout_ TL_INSPECT_FLOW_TABLE* table,
+   _In_ const TL_INSPECT_FLOW_KEY* key,
+   _In_ FWP_ACTION_TYPE action,
+   _In_ LONG generation
+   )
+/* ++
+
+   This function caches a verdict, in the entry of the key if it has one,
+   else in an expired entry of the bucket, else in a new entry if the cap
+   allows it. A verdict that is not cached expires the entry of the key.
+
+-- */
+{
+   TL_INSPECT_FLOW_BUCKET* bucket = TLInspectFlowBucket(table, key);
+   TL_INSPECT_FLOW_ENTRY* entry = NULL;
+   TL_INSPECT_FLOW_ENTRY* expired = NULL;
+   LIST_ENTRY* listEntry;
+   UINT64 lifetime = TLInspectFlowTableLifetime(table, action);
+   UINT64 now = KeQueryInterruptTime();
+   KIRQL oldIrql;
+
+   oldIrql = ExAcquireSpinLockExclusive(&bucket->lock);
+
+   for (listEntry = bucket->flows.Flink;
+        listEntry != &bucket->flows;
+        listEntry = listEntry->Flink)
+   {
+      TL_INSPECT_FLOW_ENTRY* current = CONTAINING_RECORD(
+                                          listEntry,
+                                          TL_INSPECT_FLOW_ENTRY,
+                                          link
+                                          );
+
+      if (RtlEqualMemory(&current->key, key, sizeof(*key)))
+      {
+         entry = current;
+         break;
+      }
+
+      if ((expired == NULL) && !TLInspectFlowEntryIsLive(current, now))
+      {
+         expired = current;
+      }
+   }
+
+   if ((entry == NULL) && (lifetime == 0))
+   {
+      goto Exit;
+   }
+
+   if (entry == NULL)
+   {
+      if (expired != NULL)
+      {
+         entry = expired;
+         entry->key = *key;
+         InterlockedIncrementNoFence64(&TLInspectFlowTableCounters(table)->expirations);
+      }
+      else if (InterlockedIncrement(&table->count) <= table->maxEntries)
+      {
+         entry = ExAllocatePoolZero(
+                    NonPagedPool,
+                    sizeof(TL_INSPECT_FLOW_ENTRY),
+                    TL_INSPECT_FLOW_POOL_TAG
+                    );
+         if (entry != NULL)
+         {
+            KLOCK_QUEUE_HANDLE wheelLockHandle;
+
+            entry->key = *key;
+            entry->bucket = bucket;
+            InsertHeadList(&bucket->flows, &entry->link);
+
+            //
+            // An entry that is reused keeps the timer it has.
+            //
+            KeAcquireInStackQueuedSpinLockAtDpcLevel(
+               &table->wheelLock,
+               &wheelLockHandle
+               );
+
+            TLInspectWheelArm(
+               &table->wheel,
+               &entry->timer,
+               TLInspectWheelTicks(now + lifetime)
+               );
+
+            KeReleaseInStackQueuedSpinLockFromDpcLevel(&wheelLockHandle);
+         }
+         else
+         {
+            InterlockedDecrement(&table->count);
+         }
+      }
+      else
+      {
+         InterlockedDecrement(&table->count);
+      }
+
+      if (entry == NULL)
+      {
+         InterlockedIncrementNoFence64(&TLInspectFlowTableCounters(table)->insertFailures);
+         goto Exit;
+      }
+
+      InterlockedIncrementNoFence64(&TLInspectFlowTableCounters(table)->inserts);
+   }
+
+   entry->action = action;
+   entry->generation = generation;
+   WriteNoFence64(&entry->expires, (LONG64)(now + lifetime));
+
+Exit:
+
+   ExReleaseSpinLockExclusive(&bucket->lock, oldIrql);
+}
+
+void
+TLInspectFlowTableExpire(
+   _Inout_ TL_INSPECT_FLOW_TABLE* table,
+   _In_ UINT64 tick
+   )
+/* ++
+
+   This function advances the wheel of a cache to tick, at DISPATCH_LEVEL.
+   The entries whose timer fired are freed, after releasing the lock of
+   their bucket, unless they are still live, in which case they are armed
+   again for the time they now expire at.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE wheelLockHandle;
+   LIST_ENTRY fired;
+   LIST_ENTRY expiredList;
+   TL_INSPECT_TIMER* timer;
+   UINT64 now = KeQueryInterruptTime();
+   LONG64 expirations = 0;
+   LONG64 rearmed = 0;
+   ULONG count;
+
+   if (table->buckets == NULL)
+   {
+      return;
+   }
+
+   InitializeListHead(&fired);
+   InitializeListHead(&expiredList);
+
+   KeAcquireInStackQueuedSpinLockAtDpcLevel(&table->wheelLock, &wheelLockHandle);
+   count = TLInspectWheelAdvance(&table->wheel, tick, &fired);
+   KeReleaseInStackQueuedSpinLockFromDpcLevel(&wheelLockHandle);
+
+   if (count == 0)
+   {
+      return;
+   }
+
+   for (;;)
+   {
+      TL_INSPECT_FLOW_ENTRY* entry;
+      TL_INSPECT_FLOW_BUCKET* bucket;
+
+      //
+      // Only this function takes the timers that fired, and the entries are
+      // only freed here, so the entry outlives the lock of the wheel.
+      //
+      KeAcquireInStackQueuedSpinLockAtDpcLevel(
+         &table->wheelLock,
+         &wheelLockHandle
+         );
+
+      timer = TLInspectWheelNextExpired(&table->wheel, &fired);
+
+      KeReleaseInStackQueuedSpinLockFromDpcLevel(&wheelLockHandle);
+
+      if (timer == NULL)
+      {
+         break;
+      }
+
+      entry = CONTAINING_RECORD(timer, TL_INSPECT_FLOW_ENTRY, timer);
+      bucket = entry->bucket;
+
+      ExAcquireSpinLockExclusiveAtDpcLevel(&bucket->lock);
+
+      if (TLInspectFlowEntryIsLive(entry, now))
+      {
+         KeAcquireInStackQueuedSpinLockAtDpcLevel(
+            &table->wheelLock,
+            &wheelLockHandle
+            );
+
+         TLInspectWheelArm(
+            &table->wheel,
+            &entry->timer,
+            TLInspectWheelTicks((UINT64)ReadNoFence64(&entry->expires))
+            );
+
+         KeReleaseInStackQueuedSpinLockFromDpcLevel(&wheelLockHandle);
+
+         rearmed++;
+      }
+      else
+      {
+         RemoveEntryList(&entry->link);
+         InsertTailList(&expiredList, &entry->link);
+      }
+
+      ExReleaseSpinLockExclusiveFromDpcLevel(&bucket->lock);
+   }
+
+   while (!IsListEmpty(&expiredList))
+   {
+      TL_INSPECT_FLOW_ENTRY* entry = CONTAINING_RECORD(
+                                        RemoveHeadList(&expiredList),
+                                        TL_INSPECT_FLOW_ENTRY,
+                                        link
+                                        );
+
+      ExFreePoolWithTag(entry, TL_INSPECT_FLOW_POOL_TAG);
+      InterlockedDecrement(&table->count);
+      expirations++;
+   }
+
+   TLInspectStatsAdd(timers.fired, count);
+
+   if (rearmed != 0)
+   {
+      TLInspectStatsAdd(timers.rearmed, rearmed);
+   }
+
+   if (expirations != 0)
+   {
+      InterlockedAddNoFence64(
+         &TLInspectFlowTableCounters(table)->expirations,
+         expirations
+         );
+   }
+}
+
+NTSTATUS
+TLInspectFlowCacheInitialize(
+   _In_ ULONG maxEntries,
+   _In_ ULONG idleTimeout
+   )
+/* ++
+
+   This function allocates the buckets of the flow cache. maxEntries caps
+   the number of cached flows, 0 disabling the cache; idleTimeout is in
+   seconds. It is called before TLInspectConnectCacheInitialize.
+
+-- */
+{
+   UINT64 idleTime = (UINT64)max(idleTimeout, 1) * 10000000;
+
+   gFlowCacheGeneration = 0;
+
+   return TLInspectFlowTableInitialize(
+             &gFlowCache,
+             TL_INSPECT_FLOW_CACHE_SIZE,
+             maxEntries,
+             idleTime,
+             idleTime,
+             TRUE,
+             FIELD_OFFSET(TL_INSPECT_CPU_STATS, flowCache)
+             );
+}
+
+void
+TLInspectFlowCacheFree(void)
+/* ++
+
+   This function frees all the entries and the buckets of the flow cache.
+   It is called once no classify can run anymore, and the worker threads
+   and the periodic timer have stopped.
+
+-- */
+{
+   TLInspectFlowTableFree(&gFlowCache);
+}
+
+BOOLEAN
+TLInspectFlowCacheLookup(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ FWP_ACTION_TYPE* action
+   )
+/* ++
+
+   This function returns TRUE, and the cached verdict in action, if the
+   flow of the classified packet has a live entry.
+
+-- */
+{
+   TL_INSPECT_FLOW_KEY key;
+
+   if (gFlowCache.buckets == NULL)
+   {
+      return FALSE;
+   }
+
+   TLInspectStatsIncrement(flowCache.lookups);
+
+   if (!TLInspectFlowKeyFromValues(inFixedValues, layer, &key))
+   {
+      return FALSE;
+   }
+
+   return TLInspectFlowTableLookup(&gFlowCache, &key, action);
+}
+
+BOOLEAN
+TLInspectFlowCacheLookupPacketInfo(
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ FWP_ACTION_TYPE* action
+   )
+/* ++
+
+   Same as TLInspectFlowCacheLookup, for a packet parsed at an IP packet
+   layer.
+
+-- */
+{
+   TL_INSPECT_FLOW_KEY key;
+
+   if (gFlowCache.buckets == NULL)
+   {
+      return FALSE;
+   }
+
+   TLInspectStatsIncrement(flowCache.lookups);
+
+   TLInspectFlowKeyFromPacketInfo(info, layer, &key);
+
+   return TLInspectFlowTableLookup(&gFlowCache, &key, action);
+}
+
+LONG
+TLInspectFlowCacheGeneration(void)
+/* ++
+
+   Returns the current generation of the caches. A worker reads it before
+   reading the traffic policy it takes a verdict from, and passes it to
+   TLInspectFlowCacheInsert and TLInspectConnectCacheInsert: a verdict
+   taken under a policy that has changed since is then inserted as
+   already expired.
+
+-- */
+{
+   return InterlockedCompareExchange(&gFlowCacheGeneration, 0, 0);
+}
+
+void
+TLInspectFlowCacheInsert(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ FWP_ACTION_TYPE action,
+   _In_ LONG generation
+   )
+/* ++
+
+   This function caches the verdict taken for the flow of the packet.
+
+-- */
+{
+   TL_INSPECT_FLOW_KEY key;
+
+   if (gFlowCache.buckets == NULL)
+   {
+      return;
+   }
+
+   TLInspectFlowKeyFromPacket(packet, &key);
+   TLInspectFlowTableInsert(&gFlowCache, &key, action, generation);
+}
+
+void
+TLInspectFlowCacheFlush(void)
+/* ++
+
+   Expires all the entries of both caches at once; they are freed as their
+   timers fire.
+
+-- */
+{
+   InterlockedIncrement(&gFlowCacheGeneration);
+
+   if (gFlowCache.buckets != NULL)
+   {
+      TLInspectStatsIncrement(flowCache.flushes);
+   }
+
+   if (gConnectCache.buckets != NULL)
+   {
+      TLInspectStatsIncrement(connectCache.flushes);
+   }
+}
+
+void
+TLInspectFlowCacheExpire(
+   _In_ UINT64 now
+   )
+/* ++
+
+   This function frees the expired entries of both caches whose timers
+   fire by the tick now. It is called by the periodic timer, at
+   DISPATCH_LEVEL.
+
+-- */
+{
+   TLInspectFlowTableExpire(&gFlowCache, now);
+   TLInspectFlowTableExpire(&gConnectCache, now);
+}
+
+ULONG
+TLInspectFlowCacheTimers(void)
+/* ++
+
+   Returns the number of entries armed on the wheels of both caches.
+
+-- */
+{
+   return ReadULongNoFence(&gFlowCache.wheel.count) +
+          ReadULongNoFence(&gConnectCache.wheel.count);
+}
+
+LONG
+TLInspectFlowCacheCount(void)
+{
+   return ReadNoFence(&gFlowCache.count);
+}
+
+NTSTATUS
+TLInspectConnectCacheInitialize(
+   _In_ ULONG maxEntries,
+   _In_ ULONG permitTtl,
+   _In_ ULONG blockTtl
+   )
+/* ++
+
+   This function allocates the buckets of the connect cache. maxEntries
+   caps the number of cached connections, 0 disabling the cache; permitTtl
+   and blockTtl are the times to live, in seconds, of the permits and the
+   blocks, 0 for verdicts that are not cached.
+
+-- */
+{
+   return TLInspectFlowTableInitialize(
+             &gConnectCache,
+             TL_INSPECT_CONNECT_CACHE_SIZE,
+             maxEntries,
+             (UINT64)permitTtl * 10000000,
+             (UINT64)blockTtl * 10000000,
+             FALSE,
+             FIELD_OFFSET(TL_INSPECT_CPU_STATS, connectCache)
+             );
+}
+
+void
+TLInspectConnectCacheFree(void)
+{
+   TLInspectFlowTableFree(&gConnectCache);
+}
+
+BOOLEAN
+TLInspectConnectCacheLookup(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ FWP_ACTION_TYPE* action
+   )
+/* ++
+
+   This function returns TRUE, and the cached verdict in action, if the
+   connection classified at an ALE layer has a live entry.
+
+-- */
+{
+   TL_INSPECT_FLOW_KEY key;
+
+   if (gConnectCache.buckets == NULL)
+   {
+      return FALSE;
+   }
+
+   TLInspectStatsIncrement(connectCache.lookups);
+
+   TLInspectConnectKeyFromValues(inFixedValues, layer, &key);
+
+   return TLInspectFlowTableLookup(&gConnectCache, &key, action);
+}
+
+void
+TLInspectConnectCacheInsert(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ FWP_ACTION_TYPE action,
+   _In_ LONG generation
+   )
+/* ++
+
+   This function caches the verdict taken for a pended connect.
+
+-- */
+{
+   TL_INSPECT_FLOW_KEY key;
+
+   NT_ASSERT(packet->type == TL_INSPECT_CONNECT_PACKET);
+
+   if (gConnectCache.buckets == NULL)
+   {
+      return;
+   }
+
+   TLInspectConnectKeyFromPacket(packet, &key);
+   TLInspectFlowTableInsert(&gConnectCache, &key, action, generation);
+}
+
+LONG
+TLInspectConnectCacheCount(void)
+{
+   return ReadNoFence(&gConnectCache.count);
+}
+
+ULONG
+TLInspectConnectCacheCapacity(void)
+/* ++
+
+   Returns the most connections the connect cache may hold, 0 when it is
+   disabled.
+
+-- */
+{
+   return (gConnectCache.buckets != NULL) ? (ULONG)gConnectCache.maxEntries : 0;
+}
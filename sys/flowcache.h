@@ -0,0 +1,125 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the verdict caches: the verdicts taken by the
+   worker threads, keyed by 5-tuple, so that the transport classify can
+   decide the later packets of a flow without pending them, and keyed by
+   application and remote endpoint, so that the ALE classifies can decide
+   the later connections of an application without pending them.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_FLOWCACHE_H_
+#define _TL_INSPECT_FLOWCACHE_H_
+
+#include "layer.h"
+#include "parse.h"
+
+//
+// Number of hash buckets; must be a power of 2.
+//
+#define TL_INSPECT_FLOW_CACHE_SIZE 8192
+
+//
+// Number of hash buckets of the connect cache; must be a power of 2.
+//
+#define TL_INSPECT_CONNECT_CACHE_SIZE 4096
+
+//
+// A hit only refreshes the last use time of an entry once it is that old
+// (100ns units), so that the flows of a busy server do not keep writing
+// to entries shared by all processors.
+//
+#define TL_INSPECT_FLOW_CACHE_TOUCH_INTERVAL (100 * 10000)
+
+NTSTATUS
+TLInspectFlowCacheInitialize(
+   _In_ ULONG maxEntries,
+   _In_ ULONG idleTimeout
+   );
+
+void
+TLInspectFlowCacheFree(void);
+
+BOOLEAN
+TLInspectFlowCacheLookup(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ FWP_ACTION_TYPE* action
+   );
+
+BOOLEAN
+TLInspectFlowCacheLookupPacketInfo(
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ FWP_ACTION_TYPE* action
+   );
+
+LONG
+TLInspectFlowCacheGeneration(void);
+
+void
+TLInspectFlowCacheInsert(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ FWP_ACTION_TYPE action,
+   _In_ LONG generation
+   );
+
+void
+TLInspectFlowCacheFlush(void);
+
+void
+TLInspectFlowCacheExpire(
+   _In_ UINT64 now
+   );
+
+ULONG
+TLInspectFlowCacheTimers(void);
+
+LONG
+TLInspectFlowCacheCount(void);
+
+NTSTATUS
+TLInspectConnectCacheInitialize(
+   _In_ ULONG maxEntries,
+   _In_ ULONG permitTtl,
+   _In_ ULONG blockTtl
+   );
+
+void
+TLInspectConnectCacheFree(void);
+
+BOOLEAN
+TLInspectConnectCacheLookup(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ FWP_ACTION_TYPE* action
+   );
+
+void
+TLInspectConnectCacheInsert(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ FWP_ACTION_TYPE action,
+   _In_ LONG generation
+   );
+
+LONG
+TLInspectConnectCacheCount(void);
+
+void
+TLInspectConnectKeyFromPacket(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _Out_ TL_INSPECT_FLOW_KEY* key
+   );
+
+ULONG
+TLInspectConnectCacheCapacity(void);
+
+#endif // _TL_INSPECT_FLOWCACHE_H_
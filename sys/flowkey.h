@@ -0,0 +1,90 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the key shared by the verdict caches and the
+   coalescing index of the pended connects, and the hash their buckets are
+   picked by.
+
+   The hash is FNV-1a, started from a random per-boot seed so that remote
+   peers cannot pick 5-tuples which all fall into the same bucket.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_FLOWKEY_H_
+#define _TL_INSPECT_FLOWKEY_H_
+
+//
+// TL_INSPECT_FLOW_KEY is the key of a flow or of a connection, in the
+// representation of TL_INSPECT_PENDED_PACKET. A flow is keyed by its
+// 5-tuple and by the direction of its layer, with appId 0, so that the
+// verdict of inbound packets is never applied to the outbound ones. A
+// connection is keyed by its application, direction, protocol and remote
+// address, and by the port of the service, in remotePort for outbound
+// connections and in localPort for inbound ones; the other fields are 0.
+// IPv4 addresses only use the first 4 bytes; the rest of the key is
+// zeroed so keys can be compared as memory.
+//
+typedef struct TL_INSPECT_FLOW_KEY_
+{
+   UINT64 appId;
+   UINT16 addressFamily;
+   UINT8 protocol;
+   UINT8 direction;
+   UINT16 localPort;
+   UINT16 remotePort;
+   UINT8 localAddr[16];
+   UINT8 remoteAddr[16];
+} TL_INSPECT_FLOW_KEY;
+
+__inline
+ULONG
+TLInspectHashStart(
+   _In_ ULONG seed
+   )
+{
+   return 2166136261 ^ seed;
+}
+
+__inline
+ULONG
+TLInspectHashBytes(
+   _In_ ULONG hash,
+   _In_reads_bytes_(length) const void* bytes,
+   _In_ ULONG length
+   )
+/* ++
+
+   Adds length bytes to a hash started by TLInspectHashStart, and returns
+   the new hash.
+
+-- */
+{
+   const UINT8* next = (const UINT8*)bytes;
+   ULONG i;
+
+   for (i = 0; i < length; i++)
+   {
+      hash = (hash ^ next[i]) * 16777619;
+   }
+
+   return hash;
+}
+
+__inline
+ULONG
+TLInspectFlowKeyHash(
+   _In_ const TL_INSPECT_FLOW_KEY* key,
+   _In_ ULONG seed
+   )
+{
+   return TLInspectHashBytes(TLInspectHashStart(seed), key, sizeof(*key));
+}
+
+#endif // _TL_INSPECT_FLOWKEY_H_
@@ -14,7 +14,9 @@ Abstract:
    using the reference-drop-clone-reinject as well as ALE pend/complete
    mechanism. Therefore the sample can serve as a base in scenarios where
    filtering decision cannot be made within the classifyFn() callout and
-   instead must be made, for example, by an user-mode application.
+   instead must be made, for example, by an user-mode application; the
+   verdict channel (see verdict.c) hands the decisions to such a policy
+   daemon while one is attached.
 
 Environment:
 
@@ -24,6 +26,7 @@ Environment:
 
 #define POOL_ZERO_DOWN_LEVEL_SUPPORT
 #include <ntddk.h>
+#include <wdf.h>
 
 #pragma warning(push)
 #pragma warning(disable:4201)       // unnamed struct/union
@@ -36,148 +39,21 @@ Environment:
 
 #include "inspect.h"
 #include "utils.h"
-#include <stdio.h>
-#include <stdlib.h>
+#include "stats.h"
+#include "queue.h"
+#include "conntable.h"
+#include "flowcache.h"
 #include "extra.h"
+#include "parse.h"
+#include "trace.h"
+#include "latency.h"
+#include "overload.h"
+#include "verdict.h"
 
-/*from: wireguard-nt\driver\arithmetic.h */
-typedef  UINT16 UINT16_BE;
-typedef  UINT16 UINT16_LE;
-typedef  UINT32 UINT32_BE;
-typedef  UINT32 UINT32_LE;
-typedef  UINT64 UINT64_BE;
-typedef  UINT64 UINT64_LE;
-
-/*from: wireguard-nt\driver\messages.h */
-typedef struct _IPV4HDR
-{
-#if REG_DWORD == REG_DWORD_LITTLE_ENDIAN
-   UINT8 Ihl : 4, Version : 4;
-#elif REG_DWORD == REG_DWORD_BIG_ENDIAN
-   UINT8 Version : 4, Ihl : 4;
-#endif
-   UINT8 Tos;
-   UINT16_BE TotLen;
-   UINT16_BE Id;
-   UINT16_BE FragOff;
-   UINT8 Ttl;
-   UINT8 Protocol;
-   UINT16_BE Check;
-   UINT32_BE Saddr;
-   UINT32_BE Daddr;
-} IPV4HDR;
-
-typedef struct _IPV6HDR
-{
-#if REG_DWORD == REG_DWORD_LITTLE_ENDIAN
-   UINT8 Priority : 4, Version : 4;
-#elif REG_DWORD == REG_DWORD_BIG_ENDIAN
-   UINT8 Version : 4, Priority : 4;
-#endif
-   UINT8 FlowLbl[3];
-   UINT16_BE PayloadLen;
-   UINT8 Nexthdr;
-   UINT8 HopLimit;
-   IN6_ADDR Saddr;
-   IN6_ADDR Daddr;
-} IPV6HDR;
-
-const char* protocol_to_str(UCHAR protocol)
-{
-   // source: https://learn.microsoft.com/en-us/graph/api/resources/securitynetworkprotocol?view=graph-rest-1.0
-   const char* protocol_str = "Error";
-   switch (protocol)
-   {
-   case 3:
-      protocol_str = "Ggp";
-      break;
-   case 1:
-      protocol_str = "Icmp";
-      break;
-   case 58:
-      protocol_str = "IcmpV6";
-      break;
-   case 22:
-      protocol_str = "Idp";
-      break;
-   case 2:
-      protocol_str = "Igmp";
-      break;
-   case 0:
-      protocol_str = "IP/IPv6HopByHopOptions/Unspecified";
-      break;
-   case 51:
-      protocol_str = "IPSecAuthenticationHeader";
-      break;
-   case 50:
-      protocol_str = "IPSecEncapsulatingSecurityPayload";
-      break;
-   case 4:
-      protocol_str = "IPv4";
-      break;
-   case 41:
-      protocol_str = "IPv6";
-      break;
-   case 60:
-      protocol_str = "IPv6DestinationOptions";
-      break;
-   case 44:
-      protocol_str = "IPv6FragmentHeader";
-      break;
-   case 59:
-      protocol_str = "IPv6NoNextHeader";
-      break;
-   case 43:
-      protocol_str = "IPv6RoutingHeader";
-      break;
-   case 1000:
-      protocol_str = "Ipx";
-      break;
-   case 77:
-      protocol_str = "ND";
-      break;
-   case 12:
-      protocol_str = "Pup";
-      break;
-   case 255:
-      protocol_str = "Raw";
-      break;
-   case 1256:
-      protocol_str = "Spx";
-      break;
-   case 1257:
-      protocol_str = "SpxII";
-      break;
-   case 6:
-      protocol_str = "Tcp";
-      break;
-   case 17:
-      protocol_str = "Udp";
-      break;
-   case -1:
-      protocol_str = "Unknown";
-      break;
-   }
-   return protocol_str;
-}
-
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-
-void
-TLInspectALEConnectClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-)
-
-#else
-
+__forceinline
 void
-TLInspectALEConnectClassify(
+TLInspectALEConnectClassifyLayer(
+   _In_ const TL_INSPECT_LAYER* layer,
    _In_ const FWPS_INCOMING_VALUES* inFixedValues,
    _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
    _Inout_opt_ void* layerData,
@@ -185,42 +61,42 @@ TLInspectALEConnectClassify(
    _In_ UINT64 flowContext,
    _Inout_ FWPS_CLASSIFY_OUT* classifyOut
 )
-
-#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
-
 /* ++
 
-   This is the classifyFn function for the ALE connect (v4 and v6) callout.
+   This is the classify function of the ALE connect (v4 and v6) layers.
    For an initial classify (where the FWP_CONDITION_FLAG_IS_REAUTHORIZE flag
    is not set), it is queued to the connection list for inspection by the
-   worker thread. For re-auth, we first check if it is triggered by an ealier
-   FwpsCompleteOperation call by looking for an pended connect that has been
-   inspected. If found, we remove it from the connect list and return the
-   inspection result; otherwise we can conclude that the re-auth is triggered
-   by policy change so we queue it to the packet queue to be process by the
-   worker thread like any other regular packets.
+   worker thread, unless the connect cache holds the verdict of the same
+   connection from the same application. For re-auth, we first check if it
+   is triggered by an ealier FwpsCompleteOperation call by looking for an
+   pended connect that has been inspected. If found, we remove it from the
+   connect list and return the inspection result; otherwise we can conclude
+   that the re-auth is triggered by policy change so we queue it to the
+   packet queue to be process by the worker thread like any other regular
+   packets.
 
 -- */
 {
    NTSTATUS status;
 
    KLOCK_QUEUE_HANDLE connListLockHandle;
-   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
 
    TL_INSPECT_PENDED_PACKET* pendedConnect = NULL;
    TL_INSPECT_PENDED_PACKET* connEntry;
    TL_INSPECT_PENDED_PACKET* pendedPacket = NULL;
 
-   ADDRESS_FAMILY addressFamily;
    FWPS_PACKET_INJECTION_STATE packetState;
+   TL_INSPECT_RULE_ACTION ruleAction;
+   TL_INSPECT_OVERLOAD_REASON overloadReason;
+   FWP_ACTION_TYPE cachedAction;
    BOOLEAN signalWorkerThread;
+   BOOLEAN countResult = FALSE;
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-   UNREFERENCED_PARAMETER(classifyContext);
-#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
    UNREFERENCED_PARAMETER(filter);
    UNREFERENCED_PARAMETER(flowContext);
 
+   TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_CONNECT].calls);
+
    //
    // We don't have the necessary right to alter the classify, exit.
    //
@@ -229,6 +105,8 @@ TLInspectALEConnectClassify(
       goto Exit;
    }
 
+   countResult = TRUE;
+
    if (layerData != NULL)
    {
       //
@@ -249,23 +127,88 @@ TLInspectALEConnectClassify(
             classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          }
 
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_CONNECT].selfInjectedSkips);
+
          goto Exit;
       }
    }
 
-   addressFamily = GetAddressFamilyForLayer(inFixedValues->layerId);
+   if (!IsRemoteAddressInspected(inFixedValues, layer))
+   {
+      classifyOut->actionType = FWP_ACTION_PERMIT;
+      if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+      {
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_CONNECT].notInspected);
+
+      goto Exit;
+   }
 
-   if (!IsAleReauthorize(inFixedValues))
+   if (!IsAleReauthorize(inFixedValues, layer))
    {
+      ruleAction = GetRuleActionForClassify(inFixedValues, layer);
+
+      if (ruleAction != TL_INSPECT_RULE_ACTION_INSPECT)
+      {
+         //
+         // Connections that an inspection rule permits or blocks are decided
+         // here. Rules are only applied to the initial authorization, so that
+         // the re-auth of a pended connect always finds it; the worker applies
+         // them to the re-auths triggered by policy changes.
+         //
+         if (ruleAction == TL_INSPECT_RULE_ACTION_BLOCK)
+         {
+            classifyOut->actionType = FWP_ACTION_BLOCK;
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         else
+         {
+            classifyOut->actionType = FWP_ACTION_PERMIT;
+            if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+            {
+               classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            }
+         }
+
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_CONNECT].notInspected);
+
+         goto Exit;
+      }
+
       //
-      // If the classify is the initial authorization for a connection, we 
-      // queue it to the pended connection list and notify the worker thread
-      // for out-of-band processing.
+      // The application connected to the same service a moment ago; apply
+      // the verdict it got inline.
+      //
+      if (TLInspectConnectCacheLookup(inFixedValues, layer, &cachedAction))
+      {
+         classifyOut->actionType = cachedAction;
+         if (cachedAction == FWP_ACTION_BLOCK)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         else if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         goto Exit;
+      }
+
+      //
+      // When the connection list or the pended packets are over their
+      // limits, the connect is decided here rather than pended.
       //
+      if (!TLInspectOverloadAdmitConnect(layerData, &overloadReason))
+      {
+         TLInspectOverloadShed(overloadReason, TRUE, filter, classifyOut);
+         goto Exit;
+      }
+
       pendedConnect = AllocateAndInitializePendedPacket(
          inFixedValues,
          inMetaValues,
-         addressFamily,
+         layer,
          layerData,
          TL_INSPECT_CONNECT_PACKET,
          FWP_DIRECTION_OUTBOUND
@@ -273,6 +216,8 @@ TLInspectALEConnectClassify(
 
       if (pendedConnect == NULL)
       {
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_CONNECT].allocationFailures);
+
          classifyOut->actionType = FWP_ACTION_BLOCK;
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          goto Exit;
@@ -281,6 +226,29 @@ TLInspectALEConnectClassify(
       NT_ASSERT(FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
          FWPS_METADATA_FIELD_COMPLETION_HANDLE));
 
+      KeAcquireInStackQueuedSpinLock(
+         &gConnListLock,
+         &connListLockHandle
+      );
+
+      //
+      // Once the driver is unloading, the connection table is drained and
+      // no longer timed out, so the connect is not pended; gDriverUnloading
+      // is set under gConnListLock, so a connect inserted here is seen by
+      // the drain.
+      //
+      if (gDriverUnloading)
+      {
+         KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
+         classifyOut->actionType = FWP_ACTION_PERMIT;
+         if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         goto Exit;
+      }
+
       //
       // Pend the ALE_AUTH_CONNECT classify.
       //
@@ -291,27 +259,31 @@ TLInspectALEConnectClassify(
 
       if (!NT_SUCCESS(status))
       {
+         KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
          classifyOut->actionType = FWP_ACTION_BLOCK;
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          goto Exit;
       }
 
-      KeAcquireInStackQueuedSpinLock(
-         &gConnListLock,
-         &connListLockHandle
-      );
-      KeAcquireInStackQueuedSpinLock(
-         &gPacketQueueLock,
-         &packetQueueLockHandle
-      );
-
-      signalWorkerThread = IsListEmpty(&gConnList) &&
-         IsListEmpty(&gPacketQueue);
+      //
+      // If the classify is the initial authorization for a connection, we 
+      // queue it to the pended connection list and notify the worker thread
+      // for out-of-band processing.
+      //
+      signalWorkerThread = IsListEmpty(&gConnList);
 
-      InsertTailList(&gConnList, &pendedConnect->listEntry);
+      //
+      // A connect coalesced with one waiting for the same decision is not
+      // queued; the worker is not told of it.
+      //
+      if (!TLInspectConnTableInsert(pendedConnect))
+      {
+         signalWorkerThread = FALSE;
+      }
+      TLInspectStatsIncrement(pendedCount);
       pendedConnect = NULL; // ownership transferred
 
-      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
       KeReleaseInStackQueuedSpinLock(&connListLockHandle);
 
       classifyOut->actionType = FWP_ACTION_BLOCK;
@@ -348,14 +320,13 @@ TLInspectALEConnectClassify(
 
       if (packetDirection == FWP_DIRECTION_OUTBOUND)
       {
-         LIST_ENTRY* listEntry;
          BOOLEAN authComplete = FALSE;
 
          //
          // We first check whether this is a FwpsCompleteOperation-triggered
          // reauth by looking for a pended connect that has the inspection
          // decision recorded. If found, we return that decision and remove
-         // the pended connect from the list.
+         // the pended connect from the connection table.
          //
 
          KeAcquireInStackQueuedSpinLock(
@@ -363,76 +334,48 @@ TLInspectALEConnectClassify(
             &connListLockHandle
          );
 
-         for (listEntry = gConnList.Flink;
-            listEntry != &gConnList;
-            listEntry = listEntry->Flink)
-         {
-            connEntry = CONTAINING_RECORD(
-               listEntry,
-               TL_INSPECT_PENDED_PACKET,
-               listEntry
-            );
+         connEntry = TLInspectConnTableLookupDecided(
+                        inFixedValues,
+                        layer,
+                        packetDirection
+                        );
 
-            if (IsMatchingConnectPacket(
-               inFixedValues,
-               addressFamily,
-               packetDirection,
-               connEntry
-            ) && (connEntry->authConnectDecision != 0))
-            {
-               // We found a match.
-               pendedConnect = connEntry;
+         if (connEntry != NULL)
+         {
+            // We found a match.
+            pendedConnect = connEntry;
 
-               NT_ASSERT((pendedConnect->authConnectDecision == FWP_ACTION_PERMIT) ||
-                  (pendedConnect->authConnectDecision == FWP_ACTION_BLOCK));
+            NT_ASSERT((pendedConnect->authConnectDecision == FWP_ACTION_PERMIT) ||
+               (pendedConnect->authConnectDecision == FWP_ACTION_BLOCK));
 
-               classifyOut->actionType = pendedConnect->authConnectDecision;
-               if (classifyOut->actionType == FWP_ACTION_BLOCK ||
-                  filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-               {
-                  classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-               }
+            classifyOut->actionType = pendedConnect->authConnectDecision;
+            if (classifyOut->actionType == FWP_ACTION_BLOCK ||
+               filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+            {
+               classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            }
 
-               RemoveEntryList(&pendedConnect->listEntry);
+            TLInspectConnTableRemove(pendedConnect);
 
-               if (!gDriverUnloading &&
-                  (pendedConnect->netBufferList != NULL) &&
-                  (pendedConnect->authConnectDecision == FWP_ACTION_PERMIT))
+            if (!gDriverUnloading &&
+               (pendedConnect->netBufferList != NULL) &&
+               (pendedConnect->authConnectDecision == FWP_ACTION_PERMIT))
+            {
+               //
+               // Now the outbound connection has been authorized. If the
+               // pended connect has a net buffer list in it, we need it
+               // morph it into a data packet and queue it to the packet
+               // queue for send injecition.
+               //
+               pendedConnect->type = TL_INSPECT_DATA_PACKET;
+
+               if (TLInspectQueuePacket(pendedConnect))
                {
-                  //
-                  // Now the outbound connection has been authorized. If the
-                  // pended connect has a net buffer list in it, we need it
-                  // morph it into a data packet and queue it to the packet
-                  // queue for send injecition.
-                  //
-                  pendedConnect->type = TL_INSPECT_DATA_PACKET;
-
-                  KeAcquireInStackQueuedSpinLock(
-                     &gPacketQueueLock,
-                     &packetQueueLockHandle
-                  );
-
-                  signalWorkerThread = IsListEmpty(&gPacketQueue) &&
-                     IsListEmpty(&gConnList);
-
-                  InsertTailList(&gPacketQueue, &pendedConnect->listEntry);
                   pendedConnect = NULL; // ownership transferred
-
-                  KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
-
-                  if (signalWorkerThread)
-                  {
-                     KeSetEvent(
-                        &gWorkerEvent,
-                        0,
-                        FALSE
-                     );
-                  }
                }
-
-               authComplete = TRUE;
-               break;
             }
+
+            authComplete = TRUE;
          }
 
          KeReleaseInStackQueuedSpinLock(&connListLockHandle);
@@ -452,10 +395,20 @@ TLInspectALEConnectClassify(
 
       NT_ASSERT(layerData != NULL);
 
+      if (!TLInspectOverloadAdmitPacket(
+              TLInspectFlowHash(inFixedValues, layer),
+              layerData,
+              &overloadReason
+              ))
+      {
+         TLInspectOverloadShed(overloadReason, FALSE, filter, classifyOut);
+         goto Exit;
+      }
+
       pendedPacket = AllocateAndInitializePendedPacket(
          inFixedValues,
          inMetaValues,
-         addressFamily,
+         layer,
          layerData,
          TL_INSPECT_REAUTH_PACKET,
          packetDirection
@@ -463,6 +416,8 @@ TLInspectALEConnectClassify(
 
       if (pendedPacket == NULL)
       {
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_CONNECT].allocationFailures);
+
          classifyOut->actionType = FWP_ACTION_BLOCK;
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          goto Exit;
@@ -470,24 +425,12 @@ TLInspectALEConnectClassify(
 
       if (packetDirection == FWP_DIRECTION_INBOUND)
       {
-         pendedPacket->ipSecProtected = IsSecureConnection(inFixedValues);
+         pendedPacket->ipSecProtected = IsSecureConnection(inFixedValues, layer);
       }
 
-      KeAcquireInStackQueuedSpinLock(
-         &gConnListLock,
-         &connListLockHandle
-      );
-      KeAcquireInStackQueuedSpinLock(
-         &gPacketQueueLock,
-         &packetQueueLockHandle
-      );
-
-      if (!gDriverUnloading)
+      if (TLInspectQueuePacket(pendedPacket))
       {
-         signalWorkerThread = IsListEmpty(&gPacketQueue) &&
-            IsListEmpty(&gConnList);
-
-         InsertTailList(&gPacketQueue, &pendedPacket->listEntry);
+         TLInspectStatsIncrement(pendedCount);
          pendedPacket = NULL; // ownership transferred
 
          classifyOut->actionType = FWP_ACTION_BLOCK;
@@ -499,7 +442,6 @@ TLInspectALEConnectClassify(
          //
          // Driver is being unloaded, permit any connect classify.
          //
-         signalWorkerThread = FALSE;
 
          classifyOut->actionType = FWP_ACTION_PERMIT;
          if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
@@ -508,22 +450,15 @@ TLInspectALEConnectClassify(
          }
       }
 
-      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
-      KeReleaseInStackQueuedSpinLock(&connListLockHandle);
-
-      if (signalWorkerThread)
-      {
-         KeSetEvent(
-            &gWorkerEvent,
-            0,
-            FALSE
-         );
-      }
-
    }
 
 Exit:
 
+   if (countResult)
+   {
+      TLInspectStatsClassifyResult(TL_INSPECT_CLASSIFY_CONNECT, classifyOut);
+   }
+
    if (pendedPacket != NULL)
    {
       FreePendedPacket(pendedPacket);
@@ -536,23 +471,10 @@ Exit:
    return;
 }
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-
-void
-TLInspectALERecvAcceptClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-)
-
-#else
-
+__forceinline
 void
-TLInspectALERecvAcceptClassify(
+TLInspectALERecvAcceptClassifyLayer(
+   _In_ const TL_INSPECT_LAYER* layer,
    _In_ const FWPS_INCOMING_VALUES* inFixedValues,
    _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
    _Inout_opt_ void* layerData,
@@ -560,36 +482,37 @@ TLInspectALERecvAcceptClassify(
    _In_ UINT64 flowContext,
    _Inout_ FWPS_CLASSIFY_OUT* classifyOut
 )
-
-#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
 /* ++
 
-   This is the classifyFn function for the ALE Recv-Accept (v4 and v6) callout.
+   This is the classify function of the ALE Recv-Accept (v4 and v6) layers.
    For an initial classify (where the FWP_CONDITION_FLAG_IS_REAUTHORIZE flag
    is not set), it is queued to the connection list for inspection by the
-   worker thread. For re-auth, it is queued to the packet queue to be process
-   by the worker thread like any other regular packets.
+   worker thread, unless the connect cache holds the verdict of the same
+   connection to the same application. For re-auth, it is queued to the
+   packet queue to be process by the worker thread like any other regular
+   packets.
 
 -- */
 {
    NTSTATUS status;
 
    KLOCK_QUEUE_HANDLE connListLockHandle;
-   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
 
    TL_INSPECT_PENDED_PACKET* pendedRecvAccept = NULL;
    TL_INSPECT_PENDED_PACKET* pendedPacket = NULL;
 
-   ADDRESS_FAMILY addressFamily;
    FWPS_PACKET_INJECTION_STATE packetState;
+   TL_INSPECT_RULE_ACTION ruleAction;
+   TL_INSPECT_OVERLOAD_REASON overloadReason;
+   FWP_ACTION_TYPE cachedAction;
    BOOLEAN signalWorkerThread;
+   BOOLEAN countResult = FALSE;
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-   UNREFERENCED_PARAMETER(classifyContext);
-#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
    UNREFERENCED_PARAMETER(filter);
    UNREFERENCED_PARAMETER(flowContext);
 
+   TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].calls);
+
    //
    // We don't have the necessary right to alter the classify, exit.
    //
@@ -598,6 +521,8 @@ TLInspectALERecvAcceptClassify(
       goto Exit;
    }
 
+   countResult = TRUE;
+
    NT_ASSERT(layerData != NULL);
    _Analysis_assume_(layerData != NULL);
 
@@ -619,22 +544,86 @@ TLInspectALERecvAcceptClassify(
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
       }
 
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].selfInjectedSkips);
+
       goto Exit;
    }
 
-   addressFamily = GetAddressFamilyForLayer(inFixedValues->layerId);
+   if (!IsRemoteAddressInspected(inFixedValues, layer))
+   {
+      classifyOut->actionType = FWP_ACTION_PERMIT;
+      if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+      {
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].notInspected);
+
+      goto Exit;
+   }
 
-   if (!IsAleReauthorize(inFixedValues))
+   if (!IsAleReauthorize(inFixedValues, layer))
    {
+      ruleAction = GetRuleActionForClassify(inFixedValues, layer);
+
+      if (ruleAction != TL_INSPECT_RULE_ACTION_INSPECT)
+      {
+         //
+         // Connections that an inspection rule permits or blocks are decided
+         // here. The worker applies the rules to the re-auths, which are
+         // pended like any other packet.
+         //
+         if (ruleAction == TL_INSPECT_RULE_ACTION_BLOCK)
+         {
+            classifyOut->actionType = FWP_ACTION_BLOCK;
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         else
+         {
+            classifyOut->actionType = FWP_ACTION_PERMIT;
+            if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+            {
+               classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            }
+         }
+
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].notInspected);
+
+         goto Exit;
+      }
+
       //
-      // If the classify is the initial authorization for a connection, we 
-      // queue it to the pended connection list and notify the worker thread
-      // for out-of-band processing.
+      // The same peer connected to the application a moment ago; apply
+      // the verdict it got inline.
+      //
+      if (TLInspectConnectCacheLookup(inFixedValues, layer, &cachedAction))
+      {
+         classifyOut->actionType = cachedAction;
+         if (cachedAction == FWP_ACTION_BLOCK)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         else if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         goto Exit;
+      }
+
       //
+      // When the connection list or the pended packets are over their
+      // limits, the connect is decided here rather than pended.
+      //
+      if (!TLInspectOverloadAdmitConnect(layerData, &overloadReason))
+      {
+         TLInspectOverloadShed(overloadReason, TRUE, filter, classifyOut);
+         goto Exit;
+      }
+
       pendedRecvAccept = AllocateAndInitializePendedPacket(
          inFixedValues,
          inMetaValues,
-         addressFamily,
+         layer,
          layerData,
          TL_INSPECT_CONNECT_PACKET,
          FWP_DIRECTION_INBOUND
@@ -642,6 +631,8 @@ TLInspectALERecvAcceptClassify(
 
       if (pendedRecvAccept == NULL)
       {
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].allocationFailures);
+
          classifyOut->actionType = FWP_ACTION_BLOCK;
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          goto Exit;
@@ -650,6 +641,29 @@ TLInspectALERecvAcceptClassify(
       NT_ASSERT(FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
          FWPS_METADATA_FIELD_COMPLETION_HANDLE));
 
+      KeAcquireInStackQueuedSpinLock(
+         &gConnListLock,
+         &connListLockHandle
+      );
+
+      //
+      // Once the driver is unloading, the connection table is drained and
+      // no longer timed out, so the connect is not pended; gDriverUnloading
+      // is set under gConnListLock, so a connect inserted here is seen by
+      // the drain.
+      //
+      if (gDriverUnloading)
+      {
+         KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
+         classifyOut->actionType = FWP_ACTION_PERMIT;
+         if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+         goto Exit;
+      }
+
       //
       // Pend the ALE_AUTH_RECV_ACCEPT classify.
       //
@@ -660,27 +674,31 @@ TLInspectALERecvAcceptClassify(
 
       if (!NT_SUCCESS(status))
       {
+         KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
          classifyOut->actionType = FWP_ACTION_BLOCK;
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          goto Exit;
       }
 
-      KeAcquireInStackQueuedSpinLock(
-         &gConnListLock,
-         &connListLockHandle
-      );
-      KeAcquireInStackQueuedSpinLock(
-         &gPacketQueueLock,
-         &packetQueueLockHandle
-      );
-
-      signalWorkerThread = IsListEmpty(&gConnList) &&
-         IsListEmpty(&gPacketQueue);
+      //
+      // If the classify is the initial authorization for a connection, we 
+      // queue it to the pended connection list and notify the worker thread
+      // for out-of-band processing.
+      //
+      signalWorkerThread = IsListEmpty(&gConnList);
 
-      InsertTailList(&gConnList, &pendedRecvAccept->listEntry);
+      //
+      // A connect coalesced with one waiting for the same decision is not
+      // queued; the worker is not told of it.
+      //
+      if (!TLInspectConnTableInsert(pendedRecvAccept))
+      {
+         signalWorkerThread = FALSE;
+      }
+      TLInspectStatsIncrement(pendedCount);
       pendedRecvAccept = NULL; // ownership transferred
 
-      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
       KeReleaseInStackQueuedSpinLock(&connListLockHandle);
 
       classifyOut->actionType = FWP_ACTION_BLOCK;
@@ -714,10 +732,20 @@ TLInspectALERecvAcceptClassify(
          FWPS_METADATA_FIELD_PACKET_DIRECTION));
       packetDirection = inMetaValues->packetDirection;
 
+      if (!TLInspectOverloadAdmitPacket(
+              TLInspectFlowHash(inFixedValues, layer),
+              layerData,
+              &overloadReason
+              ))
+      {
+         TLInspectOverloadShed(overloadReason, FALSE, filter, classifyOut);
+         goto Exit;
+      }
+
       pendedPacket = AllocateAndInitializePendedPacket(
          inFixedValues,
          inMetaValues,
-         addressFamily,
+         layer,
          layerData,
          TL_INSPECT_REAUTH_PACKET,
          packetDirection
@@ -725,6 +753,8 @@ TLInspectALERecvAcceptClassify(
 
       if (pendedPacket == NULL)
       {
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_RECV_ACCEPT].allocationFailures);
+
          classifyOut->actionType = FWP_ACTION_BLOCK;
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          goto Exit;
@@ -732,24 +762,12 @@ TLInspectALERecvAcceptClassify(
 
       if (packetDirection == FWP_DIRECTION_INBOUND)
       {
-         pendedPacket->ipSecProtected = IsSecureConnection(inFixedValues);
+         pendedPacket->ipSecProtected = IsSecureConnection(inFixedValues, layer);
       }
 
-      KeAcquireInStackQueuedSpinLock(
-         &gConnListLock,
-         &connListLockHandle
-      );
-      KeAcquireInStackQueuedSpinLock(
-         &gPacketQueueLock,
-         &packetQueueLockHandle
-      );
-
-      if (!gDriverUnloading)
+      if (TLInspectQueuePacket(pendedPacket))
       {
-         signalWorkerThread = IsListEmpty(&gPacketQueue) &&
-            IsListEmpty(&gConnList);
-
-         InsertTailList(&gPacketQueue, &pendedPacket->listEntry);
+         TLInspectStatsIncrement(pendedCount);
          pendedPacket = NULL; // ownership transferred
 
          classifyOut->actionType = FWP_ACTION_BLOCK;
@@ -761,7 +779,6 @@ TLInspectALERecvAcceptClassify(
          //
          // Driver is being unloaded, permit any connect classify.
          //
-         signalWorkerThread = FALSE;
 
          classifyOut->actionType = FWP_ACTION_PERMIT;
          if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
@@ -769,22 +786,15 @@ TLInspectALERecvAcceptClassify(
             classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
          }
       }
-
-      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
-      KeReleaseInStackQueuedSpinLock(&connListLockHandle);
-
-      if (signalWorkerThread)
-      {
-         KeSetEvent(
-            &gWorkerEvent,
-            0,
-            FALSE
-         );
-      }
    }
 
 Exit:
 
+   if (countResult)
+   {
+      TLInspectStatsClassifyResult(TL_INSPECT_CLASSIFY_RECV_ACCEPT, classifyOut);
+   }
+
    if (pendedPacket != NULL)
    {
       FreePendedPacket(pendedPacket);
@@ -797,103 +807,171 @@ Exit:
    return;
 }
 
-void
-TLInspectIpClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
+TL_INSPECT_TRACE_VERDICT
+TLInspectTraceVerdict(
+   _In_ const FWPS_CLASSIFY_OUT* classifyOut
 )
 {
-   KLOCK_QUEUE_HANDLE connListLockHandle;
-   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
-
-   TL_INSPECT_PENDED_PACKET* pendedPacket = NULL;
-   FWP_DIRECTION packetDirection;
+   if (classifyOut->flags & FWPS_CLASSIFY_OUT_FLAG_ABSORB)
+   {
+      return TL_INSPECT_TRACE_VERDICT_PEND;
+   }
 
-   ADDRESS_FAMILY addressFamily;
-   FWPS_PACKET_INJECTION_STATE packetState;
-   BOOLEAN signalWorkerThread;
+   switch (classifyOut->actionType)
+   {
+   case FWP_ACTION_PERMIT:
+      return TL_INSPECT_TRACE_VERDICT_PERMIT;
+   case FWP_ACTION_BLOCK:
+      return TL_INSPECT_TRACE_VERDICT_BLOCK;
+   default:
+      return TL_INSPECT_TRACE_VERDICT_NONE;
+   }
+}
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-   UNREFERENCED_PARAMETER(classifyContext);
-#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
-   UNREFERENCED_PARAMETER(filter);
-   UNREFERENCED_PARAMETER(flowContext);
-   UNREFERENCED_PARAMETER(classifyOut);
-   UNREFERENCED_PARAMETER(packetQueueLockHandle);
-   UNREFERENCED_PARAMETER(signalWorkerThread);
-   UNREFERENCED_PARAMETER(packetState);
-   UNREFERENCED_PARAMETER(pendedPacket);
-   UNREFERENCED_PARAMETER(connListLockHandle);
+void
+TLInspectTraceClassify(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+   _In_opt_ void* layerData,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ FWP_DIRECTION packetDirection,
+   _In_ TL_INSPECT_TRACE_VERDICT verdict
+)
+/* ++
 
+   This function traces the classified net buffer lists. At the IP packet
+   layers the IP and transport headers are parsed; at the transport layers
+   the addresses and protocol are taken from the classify values and only
+   the transport header is parsed.
 
-   addressFamily = GetAddressFamilyForLayer(inFixedValues->layerId);
+-- */
+{
+   TL_INSPECT_CURSOR cursor;
+   TL_INSPECT_PACKET_INFO packetInfo;
+   TL_INSPECT_PACKET_INFO transportInfo = { 0 };
+   BOOLEAN isIpPacketLayer = (layer->function == TL_INSPECT_CLASSIFY_IP);
+   ULONG retreat = 0;
 
-   packetDirection =
-      GetPacketDirectionForLayer(inFixedValues->layerId);
-   char debugAddressFamily[24] = { 0 };
-   char debugPacketDirection[24] = { 0 };
-   if (addressFamily == AF_INET)
-   {
-      _snprintf(debugAddressFamily, sizeof(debugAddressFamily), "%s", "IPv4");
-   }
-   else if (addressFamily == AF_INET6)
-   {
-      _snprintf(debugAddressFamily, sizeof(debugAddressFamily), "%s", "IPv6");
-   }
-   else
-   {
-      _snprintf(debugAddressFamily, sizeof(debugAddressFamily), "Unparsed %d", addressFamily);
-   }
-   if (packetDirection == FWP_DIRECTION_OUTBOUND)
+   if (isIpPacketLayer)
    {
-      _snprintf(debugPacketDirection, sizeof(debugPacketDirection), "%s", "OUT");
+      //
+      // Inbound packets are indicated to the IP packet layer past their IP
+      // header.
+      //
+      if ((packetDirection == FWP_DIRECTION_INBOUND) &&
+         FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
+            FWPS_METADATA_FIELD_IP_HEADER_SIZE))
+      {
+         retreat = inMetaValues->ipHeaderSize;
+      }
    }
    else
    {
-      _snprintf(debugPacketDirection, sizeof(debugPacketDirection), "%s", "IN");
+      FWP_BYTE_ARRAY16 localAddr = { 0 };
+      FWP_BYTE_ARRAY16 remoteAddr = { 0 };
+
+      if (layer->addressFamily == AF_INET)
+      {
+         *(UINT32*)&localAddr = RtlUlongByteSwap(
+            inFixedValues->incomingValue[layer->localAddress].value.uint32);
+         *(UINT32*)&remoteAddr = RtlUlongByteSwap(
+            inFixedValues->incomingValue[layer->remoteAddress].value.uint32);
+      }
+      else
+      {
+         RtlCopyMemory(&localAddr,
+            inFixedValues->incomingValue[layer->localAddress].value.byteArray16,
+            sizeof(FWP_BYTE_ARRAY16));
+         RtlCopyMemory(&remoteAddr,
+            inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16,
+            sizeof(FWP_BYTE_ARRAY16));
+      }
+
+      transportInfo.addressFamily = layer->addressFamily;
+      transportInfo.protocol =
+         inFixedValues->incomingValue[layer->protocol].value.uint8;
+      transportInfo.sourceAddress =
+         (packetDirection == FWP_DIRECTION_OUTBOUND) ? localAddr : remoteAddr;
+      transportInfo.destinationAddress =
+         (packetDirection == FWP_DIRECTION_OUTBOUND) ? remoteAddr : localAddr;
+
+      //
+      // Inbound packets are indicated to the transport layer past their
+      // transport header.
+      //
+      if (packetDirection == FWP_DIRECTION_INBOUND)
+      {
+         retreat = inMetaValues->transportHeaderSize;
+      }
    }
 
-   const char* debugPacketProtocol = NULL;
-   IPV4HDR* header4 = NULL;
-   //IPV6HDR* header6 = NULL;
-   VOID* header = NULL;
    for (NET_BUFFER_LIST* nbl = (NET_BUFFER_LIST*)layerData; nbl; nbl = nbl->Next) {
       NET_BUFFER* nb = NET_BUFFER_LIST_FIRST_NB(nbl);
-      header = NdisGetDataBuffer(nb, inMetaValues->ipHeaderSize + inMetaValues->transportHeaderSize, NULL, 1, 0);
 
-      if (!header)
-         continue;
-      if (addressFamily != AF_INET)
-         /*TODO: support IPv6*/
+      if (!TLInspectCursorInitialize(&cursor, nb, retreat))
          continue;
 
-      header4 = (IPV4HDR*)header;
-      if (header4)
+      if (isIpPacketLayer)
       {
-         debugPacketProtocol = protocol_to_str(((UCHAR*)header)[inMetaValues->ipHeaderSize + 9]);
-
-         DbgPrint("T[%p] [%s] [%s] [%5s]\n",
-            KeGetCurrentThread(),
-            debugAddressFamily,
-            debugPacketDirection,
-            debugPacketProtocol
-         );
+         if (!TLInspectParseIpHeader(&cursor, layer->addressFamily, &packetInfo))
+            continue;
       }
+      else
+      {
+         packetInfo = transportInfo;
+      }
+
+      TLInspectParseTransportHeader(&cursor, &packetInfo);
 
-      /*
-      DbgPrint("MAC address: %02x-%02x-%02x-%02x-%02x-%02x\n",
-         header[0], header[1], header[2],
-         header[3], header[4], header[5]);
-      */
+      TLInspectTracePacket(
+         TL_INSPECT_TRACE_EVENT_CLASSIFY,
+         inFixedValues->layerId,
+         packetDirection,
+         &packetInfo,
+         verdict
+      );
    }
+}
+
+__forceinline
+void
+TLInspectIpClassifyLayer(
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+   _Inout_opt_ void* layerData,
+   _In_ const FWPS_FILTER* filter,
+   _In_ UINT64 flowContext,
+   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
+)
+/* ++
 
-#if 0
+   This is the classify function of the IP packet (v4 and v6) layers. The
+   IP header, the IPv6 extension headers and the transport header of the
+   packet are parsed, and the packet is decided inline, without being
+   pended: by the inspection rule that matches it, else by the cached
+   verdict of its flow, else by the traffic verdict. A packet whose headers
+   cannot be parsed gets the traffic verdict.
 
+-- */
+{
+   FWP_DIRECTION packetDirection;
+   FWPS_PACKET_INJECTION_STATE packetState;
+   TL_INSPECT_CURSOR cursor;
+   TL_INSPECT_PACKET_INFO packetInfo;
+   TL_INSPECT_RULE_ACTION ruleAction;
+   FWP_ACTION_TYPE cachedAction;
+   TL_INSPECT_TRACE_LEVEL traceLevel = TL_INSPECT_TRACE_LEVEL_PACKET;
+   NET_BUFFER* netBuffer;
+   ULONG retreat = 0;
+   BOOLEAN countResult = FALSE;
+   BOOLEAN permitTraffic;
+
+   UNREFERENCED_PARAMETER(flowContext);
+
+   TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_IP].calls);
+
+   packetDirection = (FWP_DIRECTION)layer->direction;
 
    //
    // We don't have the necessary right to alter the classify, exit.
@@ -903,6 +981,8 @@ TLInspectIpClassify(
       goto Exit;
    }
 
+   countResult = TRUE;
+
    NT_ASSERT(layerData != NULL);
    _Analysis_assume_(layerData != NULL);
 
@@ -918,24 +998,36 @@ TLInspectIpClassify(
    if ((packetState == FWPS_PACKET_INJECTED_BY_SELF) ||
       (packetState == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF))
    {
+      traceLevel = TL_INSPECT_TRACE_LEVEL_VERBOSE;
+
       classifyOut->actionType = FWP_ACTION_PERMIT;
       if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
       {
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
       }
 
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_IP].selfInjectedSkips);
+
       goto Exit;
    }
 
    if (packetDirection == FWP_DIRECTION_INBOUND)
    {
-      if (IsAleClassifyRequired(inFixedValues, inMetaValues))
+      //
+      // To be compatible with Vista's IpSec implementation, we must not
+      // intercept not-yet-detunneled IpSec traffic.
+      //
+      FWPS_PACKET_LIST_INFORMATION listInfo = { 0 };
+      FwpsGetPacketListSecurityInformation(
+         layerData,
+         FWPS_PACKET_LIST_INFORMATION_QUERY_IPSEC |
+         FWPS_PACKET_LIST_INFORMATION_QUERY_INBOUND,
+         &listInfo
+      );
+
+      if (listInfo.ipsecInformation.inbound.isTunnelMode &&
+         !listInfo.ipsecInformation.inbound.isDeTunneled)
       {
-         //
-         // Inbound transport packets that are destined to ALE Recv-Accept 
-         // layers, for initial authorization or reauth, should be inspected 
-         // at the ALE layer. We permit it from Tranport here.
-         //
          classifyOut->actionType = FWP_ACTION_PERMIT;
          if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
          {
@@ -943,124 +1035,98 @@ TLInspectIpClassify(
          }
          goto Exit;
       }
-      else
-      {
-         //
-         // To be compatible with Vista's IpSec implementation, we must not
-         // intercept not-yet-detunneled IpSec traffic.
-         //
-         FWPS_PACKET_LIST_INFORMATION packetInfo = { 0 };
-         FwpsGetPacketListSecurityInformation(
-            layerData,
-            FWPS_PACKET_LIST_INFORMATION_QUERY_IPSEC |
-            FWPS_PACKET_LIST_INFORMATION_QUERY_INBOUND,
-            &packetInfo
-         );
 
-         if (packetInfo.ipsecInformation.inbound.isTunnelMode &&
-            !packetInfo.ipsecInformation.inbound.isDeTunneled)
-         {
-            classifyOut->actionType = FWP_ACTION_PERMIT;
-            if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
-            {
-               classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-            }
-            goto Exit;
-         }
+      //
+      // Inbound packets are indicated to the IP packet layer past their IP
+      // header.
+      //
+      if (FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
+            FWPS_METADATA_FIELD_IP_HEADER_SIZE))
+      {
+         retreat = inMetaValues->ipHeaderSize;
       }
    }
 
-   pendedPacket = AllocateAndInitializePendedPacket(
-      inFixedValues,
-      inMetaValues,
-      addressFamily,
-      layerData,
-      TL_INSPECT_DATA_PACKET,
-      packetDirection
-   );
+   netBuffer = NET_BUFFER_LIST_FIRST_NB((NET_BUFFER_LIST*)layerData);
 
-   if (pendedPacket == NULL)
+   if (!TLInspectCursorInitialize(&cursor, netBuffer, retreat) ||
+       !TLInspectParseIpHeader(&cursor, layer->addressFamily, &packetInfo))
    {
-      classifyOut->actionType = FWP_ACTION_BLOCK;
-      classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-      goto Exit;
+      permitTraffic = IsTrafficPermitted();
    }
+   else
+   {
+      TLInspectParseTransportHeader(&cursor, &packetInfo);
 
-   KeAcquireInStackQueuedSpinLock(
-      &gConnListLock,
-      &connListLockHandle
-   );
-   KeAcquireInStackQueuedSpinLock(
-      &gPacketQueueLock,
-      &packetQueueLockHandle
-   );
+      if (!IsPacketInfoInspected(&packetInfo, layer))
+      {
+         classifyOut->actionType = FWP_ACTION_PERMIT;
+         if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
 
-   if (!gDriverUnloading)
-   {
-      signalWorkerThread = IsListEmpty(&gPacketQueue) &&
-         IsListEmpty(&gConnList);
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_IP].notInspected);
 
-      InsertTailList(&gPacketQueue, &pendedPacket->listEntry);
-      pendedPacket = NULL; // ownership transferred
+         goto Exit;
+      }
 
-      classifyOut->actionType = FWP_ACTION_BLOCK;
-      classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
-      classifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
-   }
-   else
-   {
       //
-      // Driver is being unloaded, permit any connect classify.
+      // The rules come first, as in the transport classify, then the
+      // verdict taken for the flow by the worker threads.
       //
-      signalWorkerThread = FALSE;
+      permitTraffic = IsPacketInfoPermitted(&packetInfo, layer, &ruleAction);
+
+      if (ruleAction != TL_INSPECT_RULE_ACTION_INSPECT)
+      {
+         TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_IP].notInspected);
+      }
+      else if (TLInspectFlowCacheLookupPacketInfo(&packetInfo, layer, &cachedAction))
+      {
+         permitTraffic = (cachedAction == FWP_ACTION_PERMIT);
+      }
+   }
 
+   if (permitTraffic)
+   {
       classifyOut->actionType = FWP_ACTION_PERMIT;
       if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
       {
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
       }
    }
-
-   KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
-   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
-
-   if (signalWorkerThread)
+   else
    {
-      KeSetEvent(
-         &gWorkerEvent,
-         0,
-         FALSE
-      );
+      classifyOut->actionType = FWP_ACTION_BLOCK;
+      classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
    }
 
 Exit:
 
-   if (pendedPacket != NULL)
+   if (countResult)
    {
-      FreePendedPacket(pendedPacket);
+      TLInspectStatsClassifyResult(TL_INSPECT_CLASSIFY_IP, classifyOut);
+   }
+
+   if (TLInspectTraceEnabled(traceLevel))
+   {
+      TLInspectTraceClassify(
+         inFixedValues,
+         inMetaValues,
+         layerData,
+         layer,
+         packetDirection,
+         TLInspectTraceVerdict(classifyOut)
+      );
    }
 
    return;
-#endif
 }
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-
-void
-TLInspectTransportClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-)
-
-#else
-
+__forceinline
 void
-TLInspectTransportClassify(
+TLInspectTransportClassifyLayer(
+   _In_ const TL_INSPECT_LAYER* layer,
    _In_ const FWPS_INCOMING_VALUES* inFixedValues,
    _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
    _Inout_opt_ void* layerData,
@@ -1068,103 +1134,42 @@ TLInspectTransportClassify(
    _In_ UINT64 flowContext,
    _Inout_ FWPS_CLASSIFY_OUT* classifyOut
 )
-
-#endif
 /* ++
 
-   This is the classifyFn function for the Transport (v4 and v6) callout.
+   This is the classify function of the Transport (v4 and v6) layers.
    packets (inbound or outbound) are queued to the packet queue to be processed
    by the worker thread.
 
 -- */ 
 {
-   KLOCK_QUEUE_HANDLE connListLockHandle;
-   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
 
    TL_INSPECT_PENDED_PACKET* pendedPacket = NULL;
    FWP_DIRECTION packetDirection;
 
-   ADDRESS_FAMILY addressFamily;
    FWPS_PACKET_INJECTION_STATE packetState;
-   BOOLEAN signalWorkerThread;
+   FWP_ACTION_TYPE cachedAction;
+   TL_INSPECT_RULE_ACTION ruleAction;
+   TL_INSPECT_OVERLOAD_REASON overloadReason;
+   TL_INSPECT_TRACE_LEVEL traceLevel = TL_INSPECT_TRACE_LEVEL_PACKET;
+   BOOLEAN countResult = FALSE;
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
-   UNREFERENCED_PARAMETER(classifyContext);
-#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
    UNREFERENCED_PARAMETER(filter);
    UNREFERENCED_PARAMETER(flowContext);
 
+   TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_TRANSPORT].calls);
 
-   addressFamily = GetAddressFamilyForLayer(inFixedValues->layerId);
 
-   packetDirection =
-      GetPacketDirectionForLayer(inFixedValues->layerId);
-   char debugAddressFamily[24] = { 0 };
-   char debugPacketDirection[24] = { 0 };
-   if (addressFamily == AF_INET)
-   {
-      _snprintf(debugAddressFamily, sizeof(debugAddressFamily), "%s", "IPv4");
-   }
-   else if (addressFamily == AF_INET6)
-   {
-      _snprintf(debugAddressFamily, sizeof(debugAddressFamily), "%s", "IPv6");
-   }
-   else
-   {
-      _snprintf(debugAddressFamily, sizeof(debugAddressFamily), "Unparsed %d", addressFamily);
-   }
-   if (packetDirection == FWP_DIRECTION_OUTBOUND)
-   {
-      _snprintf(debugPacketDirection, sizeof(debugPacketDirection), "%s", "OUT");
-   }
-   else
+   packetDirection = (FWP_DIRECTION)layer->direction;
+
+   //
+   // We don't have the necessary right to alter the classify, exit.
+   //
+   if ((classifyOut->rights & FWPS_RIGHT_ACTION_WRITE) == 0)
    {
-      _snprintf(debugPacketDirection, sizeof(debugPacketDirection), "%s", "IN");
+      goto Exit;
    }
 
-   const char* debugPacketProtocol = NULL;
-   IPV4HDR* header4 = NULL;
-   //IPV6HDR* header6 = NULL;
-   VOID* header = NULL;
-   for (NET_BUFFER_LIST* nbl = (NET_BUFFER_LIST*)layerData; nbl; nbl = nbl->Next) {
-      NET_BUFFER* nb = NET_BUFFER_LIST_FIRST_NB(nbl);
-      header = NdisGetDataBuffer(nb, inMetaValues->transportHeaderSize, NULL, 1, 0);
-      
-      if (!header)
-         continue;
-      if (addressFamily != AF_INET)
-         continue;
-
-      header4 = (IPV4HDR*)header;
-      if (header4)
-      {
-         debugPacketProtocol = protocol_to_str(((UCHAR*)header)[9]);
-         
-         DbgPrint("T[%p] [%s] [%s] [%5s]\n",
-            KeGetCurrentThread(),
-            debugAddressFamily,
-            debugPacketDirection,
-            debugPacketProtocol
-         );
-      }
-      
-      /*
-      DbgPrint("MAC address: %02x-%02x-%02x-%02x-%02x-%02x\n",
-         header[0], header[1], header[2],
-         header[3], header[4], header[5]);
-      */
-   }
-
-
-
-
-   //
-   // We don't have the necessary right to alter the classify, exit.
-   //
-   if ((classifyOut->rights & FWPS_RIGHT_ACTION_WRITE) == 0)
-   {
-      goto Exit;
-   }
+   countResult = TRUE;
 
    NT_ASSERT(layerData != NULL);
    _Analysis_assume_(layerData != NULL);
@@ -1180,6 +1185,21 @@ TLInspectTransportClassify(
 
    if ((packetState == FWPS_PACKET_INJECTED_BY_SELF) ||
       (packetState == FWPS_PACKET_PREVIOUSLY_INJECTED_BY_SELF))
+   {
+      traceLevel = TL_INSPECT_TRACE_LEVEL_VERBOSE;
+
+      classifyOut->actionType = FWP_ACTION_PERMIT;
+      if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+      {
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_TRANSPORT].selfInjectedSkips);
+
+      goto Exit;
+   }
+
+   if (!IsRemoteAddressInspected(inFixedValues, layer))
    {
       classifyOut->actionType = FWP_ACTION_PERMIT;
       if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
@@ -1187,6 +1207,8 @@ TLInspectTransportClassify(
          classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
       }
 
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_TRANSPORT].notInspected);
+
       goto Exit;
    }
 
@@ -1233,10 +1255,70 @@ TLInspectTransportClassify(
       }
    }
 
+   ruleAction = GetRuleActionForClassify(inFixedValues, layer);
+
+   if (ruleAction != TL_INSPECT_RULE_ACTION_INSPECT)
+   {
+      //
+      // Packets that an inspection rule permits or blocks are decided
+      // here.
+      //
+      if (ruleAction == TL_INSPECT_RULE_ACTION_BLOCK)
+      {
+         classifyOut->actionType = FWP_ACTION_BLOCK;
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+      else
+      {
+         classifyOut->actionType = FWP_ACTION_PERMIT;
+         if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+         {
+            classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+         }
+      }
+
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_TRANSPORT].notInspected);
+
+      goto Exit;
+   }
+
+   //
+   // The flow has already been inspected; apply its verdict inline. The
+   // rules come first, so that no cached verdict overrides a rule that
+   // decides the packet.
+   //
+   if (TLInspectFlowCacheLookup(inFixedValues, layer, &cachedAction))
+   {
+      classifyOut->actionType = cachedAction;
+      if (cachedAction == FWP_ACTION_BLOCK)
+      {
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+      else if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+      {
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+      goto Exit;
+   }
+
+   //
+   // When the packet queue or the pended packets are over their limits,
+   // the packet is decided here rather than pended.
+   //
+   if (!TLInspectOverloadAdmitPacket(
+           TLInspectFlowHash(inFixedValues, layer),
+           layerData,
+           &overloadReason
+           ))
+   {
+      TLInspectOverloadShed(overloadReason, FALSE, filter, classifyOut);
+      goto Exit;
+   }
+
    pendedPacket = AllocateAndInitializePendedPacket(
       inFixedValues,
       inMetaValues,
-      addressFamily,
+      layer,
       layerData,
       TL_INSPECT_DATA_PACKET,
       packetDirection
@@ -1244,26 +1326,16 @@ TLInspectTransportClassify(
 
    if (pendedPacket == NULL)
    {
+      TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_TRANSPORT].allocationFailures);
+
       classifyOut->actionType = FWP_ACTION_BLOCK;
       classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
       goto Exit;
    }
 
-   KeAcquireInStackQueuedSpinLock(
-      &gConnListLock,
-      &connListLockHandle
-   );
-   KeAcquireInStackQueuedSpinLock(
-      &gPacketQueueLock,
-      &packetQueueLockHandle
-   );
-
-   if (!gDriverUnloading)
+   if (TLInspectQueuePacket(pendedPacket))
    {
-      signalWorkerThread = IsListEmpty(&gPacketQueue) &&
-         IsListEmpty(&gConnList);
-
-      InsertTailList(&gPacketQueue, &pendedPacket->listEntry);
+      TLInspectStatsIncrement(pendedCount);
       pendedPacket = NULL; // ownership transferred
 
       classifyOut->actionType = FWP_ACTION_BLOCK;
@@ -1275,7 +1347,6 @@ TLInspectTransportClassify(
       //
       // Driver is being unloaded, permit any connect classify.
       //
-      signalWorkerThread = FALSE;
 
       classifyOut->actionType = FWP_ACTION_PERMIT;
       if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
@@ -1284,19 +1355,28 @@ TLInspectTransportClassify(
       }
    }
 
-   KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
-   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+Exit:
 
-   if (signalWorkerThread)
+   if (countResult)
    {
-      KeSetEvent(
-         &gWorkerEvent,
-         0,
-         FALSE
-      );
+      TLInspectStatsClassifyResult(TL_INSPECT_CLASSIFY_TRANSPORT, classifyOut);
    }
 
-Exit:
+   //
+   // The net buffer lists belong to the caller until we return, even if
+   // they were absorbed and queued.
+   //
+   if (TLInspectTraceEnabled(traceLevel))
+   {
+      TLInspectTraceClassify(
+         inFixedValues,
+         inMetaValues,
+         layerData,
+         layer,
+         packetDirection,
+         TLInspectTraceVerdict(classifyOut)
+      );
+   }
 
    if (pendedPacket != NULL)
    {
@@ -1306,6 +1386,141 @@ Exit:
    return;
 }
 
+//
+// The classifyFn functions, one per layer. Each passes the constant entry of
+// its layer to the classify function of the layer kind, which is inlined, so
+// that the field indexes, the address family and the direction are folded
+// into its code.
+//
+
+#if(NTDDI_VERSION >= NTDDI_WIN7)
+
+#define TL_INSPECT_DEFINE_CLASSIFY(name, classifyLayer, id)              \
+   void                                                                 \
+   name(                                                                \
+      _In_ const FWPS_INCOMING_VALUES* inFixedValues,                   \
+      _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,           \
+      _Inout_opt_ void* layerData,                                      \
+      _In_opt_ const void* classifyContext,                             \
+      _In_ const FWPS_FILTER* filter,                                   \
+      _In_ UINT64 flowContext,                                          \
+      _Inout_ FWPS_CLASSIFY_OUT* classifyOut                            \
+   )                                                                    \
+   {                                                                    \
+      UNREFERENCED_PARAMETER(classifyContext);                          \
+      NT_ASSERT(inFixedValues->layerId == (id));                        \
+                                                                        \
+      classifyLayer(                                                    \
+         &gInspectLayers[id],                                           \
+         inFixedValues,                                                 \
+         inMetaValues,                                                  \
+         layerData,                                                     \
+         filter,                                                        \
+         flowContext,                                                   \
+         classifyOut                                                    \
+         );                                                             \
+   }
+
+#else
+
+#define TL_INSPECT_DEFINE_CLASSIFY(name, classifyLayer, id)              \
+   void                                                                 \
+   name(                                                                \
+      _In_ const FWPS_INCOMING_VALUES* inFixedValues,                   \
+      _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,           \
+      _Inout_opt_ void* layerData,                                      \
+      _In_ const FWPS_FILTER* filter,                                   \
+      _In_ UINT64 flowContext,                                          \
+      _Inout_ FWPS_CLASSIFY_OUT* classifyOut                            \
+   )                                                                    \
+   {                                                                    \
+      NT_ASSERT(inFixedValues->layerId == (id));                        \
+                                                                        \
+      classifyLayer(                                                    \
+         &gInspectLayers[id],                                           \
+         inFixedValues,                                                 \
+         inMetaValues,                                                  \
+         layerData,                                                     \
+         filter,                                                        \
+         flowContext,                                                   \
+         classifyOut                                                    \
+         );                                                             \
+   }
+
+#endif /// (NTDDI_VERSION >= NTDDI_WIN7)
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectALEConnectClassifyV4,
+   TLInspectALEConnectClassifyLayer,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V4
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectALEConnectClassifyV6,
+   TLInspectALEConnectClassifyLayer,
+   FWPS_LAYER_ALE_AUTH_CONNECT_V6
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectALERecvAcceptClassifyV4,
+   TLInspectALERecvAcceptClassifyLayer,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectALERecvAcceptClassifyV6,
+   TLInspectALERecvAcceptClassifyLayer,
+   FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectOutboundTransportClassifyV4,
+   TLInspectTransportClassifyLayer,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V4
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectOutboundTransportClassifyV6,
+   TLInspectTransportClassifyLayer,
+   FWPS_LAYER_OUTBOUND_TRANSPORT_V6
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectInboundTransportClassifyV4,
+   TLInspectTransportClassifyLayer,
+   FWPS_LAYER_INBOUND_TRANSPORT_V4
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectInboundTransportClassifyV6,
+   TLInspectTransportClassifyLayer,
+   FWPS_LAYER_INBOUND_TRANSPORT_V6
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectOutboundIpClassifyV4,
+   TLInspectIpClassifyLayer,
+   FWPS_LAYER_OUTBOUND_IPPACKET_V4
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectOutboundIpClassifyV6,
+   TLInspectIpClassifyLayer,
+   FWPS_LAYER_OUTBOUND_IPPACKET_V6
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectInboundIpClassifyV4,
+   TLInspectIpClassifyLayer,
+   FWPS_LAYER_INBOUND_IPPACKET_V4
+   )
+
+TL_INSPECT_DEFINE_CLASSIFY(
+   TLInspectInboundIpClassifyV6,
+   TLInspectIpClassifyLayer,
+   FWPS_LAYER_INBOUND_IPPACKET_V6
+   )
+
 NTSTATUS
 TLInspectALEConnectNotify(
    _In_  FWPS_CALLOUT_NOTIFY_TYPE notifyType,
@@ -1362,97 +1577,99 @@ TLInspectIpNotify(
    return STATUS_SUCCESS;
 }
 
+void
+TLInspectFreeBatch(
+   _Inout_ __drv_freesMem(Mem) TL_INSPECT_INJECT_BATCH* batch
+)
+{
+   ULONG i;
+
+   for (i = 0; i < batch->count; i++)
+   {
+      FreePendedPacket(batch->packets[i]);
+   }
+
+   ExFreePoolWithTag(batch, TL_INSPECT_BATCH_POOL_TAG);
+}
+
+void
+TLInspectFreeCloneChain(
+   _Inout_opt_ NET_BUFFER_LIST* netBufferList,
+   _Out_ LONG* count
+)
+{
+   NET_BUFFER_LIST* nextNetBufferList;
+
+   *count = 0;
+
+   while (netBufferList != NULL)
+   {
+      nextNetBufferList = NET_BUFFER_LIST_NEXT_NBL(netBufferList);
+      NET_BUFFER_LIST_NEXT_NBL(netBufferList) = NULL;
+
+      FwpsFreeCloneNetBufferList(netBufferList, 0);
+
+      netBufferList = nextNetBufferList;
+      (*count)++;
+   }
+}
+
 void TLInspectInjectComplete(
    _Inout_ void* context,
    _Inout_ NET_BUFFER_LIST* netBufferList,
    _In_ BOOLEAN dispatchLevel
 )
 {
-   TL_INSPECT_PENDED_PACKET* packet = context;
+   TL_INSPECT_INJECT_BATCH* batch = context;
+   LONG completed;
 
    UNREFERENCED_PARAMETER(dispatchLevel);
 
-   FwpsFreeCloneNetBufferList(netBufferList, 0);
+   //
+   // The chain may be completed all at once or in parts; the pended
+   // packets are only released with the last clone of the batch.
+   //
+   TLInspectFreeCloneChain(netBufferList, &completed);
 
-   FreePendedPacket(packet);
+   if (InterlockedAdd(&batch->pendingCount, -completed) == 0)
+   {
+      TLInspectLatencyRecordBatch(batch, TL_INSPECT_LATENCY_INJECT);
+      TLInspectFreeBatch(batch);
+   }
 }
 
 NTSTATUS
-TLInspectCloneReinjectOutbound(
-   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+TLInspectCloneOutbound(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet,
+   _Outptr_ NET_BUFFER_LIST** clone
 )
 /* ++
 
-   This function clones the outbound net buffer list and reinject it back.
+   This function clones the outbound net buffer list for send-injection.
 
 -- */
 {
-   NTSTATUS status = STATUS_SUCCESS;
-
-   NET_BUFFER_LIST* clonedNetBufferList = NULL;
-   FWPS_TRANSPORT_SEND_PARAMS sendArgs = { 0 };
+   *clone = NULL;
 
-   status = FwpsAllocateCloneNetBufferList(
+   return FwpsAllocateCloneNetBufferList(
       packet->netBufferList,
       NULL,
       NULL,
       0,
-      &clonedNetBufferList
-   );
-   if (!NT_SUCCESS(status))
-   {
-      goto Exit;
-   }
-
-   sendArgs.remoteAddress = (UINT8*)(&packet->remoteAddr);
-   sendArgs.remoteScopeId = packet->remoteScopeId;
-   sendArgs.controlData = packet->controlData;
-   sendArgs.controlDataLength = packet->controlDataLength;
-
-   //
-   // Send-inject the cloned net buffer list.
-   //
-
-   status = FwpsInjectTransportSendAsync(
-      gInjectionHandle,
-      NULL,
-      packet->endpointHandle,
-      0,
-      &sendArgs,
-      packet->addressFamily,
-      packet->compartmentId,
-      clonedNetBufferList,
-      TLInspectInjectComplete,
-      packet
+      clone
    );
-
-   if (!NT_SUCCESS(status))
-   {
-      goto Exit;
-   }
-
-   clonedNetBufferList = NULL; // ownership transferred to the 
-                               // completion function.
-
-Exit:
-
-   if (clonedNetBufferList != NULL)
-   {
-      FwpsFreeCloneNetBufferList(clonedNetBufferList, 0);
-   }
-
-   return status;
 }
 
 NTSTATUS
-TLInspectCloneReinjectInbound(
-   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+TLInspectCloneInbound(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet,
+   _Outptr_ NET_BUFFER_LIST** clone
 )
 /* ++
 
    This function clones the inbound net buffer list and, if needed,
-   rebuild the IP header to remove the IpSec headers and receive-injects
-   the clone back to the tcpip stack.
+   rebuild the IP header to remove the IpSec headers, so that the clone
+   can be receive-injected back to the tcpip stack.
 
 -- */
 {
@@ -1463,6 +1680,8 @@ TLInspectCloneReinjectInbound(
    ULONG nblOffset;
    NDIS_STATUS ndisStatus;
 
+   *clone = NULL;
+
    //
    // For inbound net buffer list, we can assume it contains only one 
    // net buffer.
@@ -1565,27 +1784,8 @@ TLInspectCloneReinjectInbound(
       packet->completionContext = NULL;
    }
 
-   status = FwpsInjectTransportReceiveAsync(
-      gInjectionHandle,
-      NULL,
-      NULL,
-      0,
-      packet->addressFamily,
-      packet->compartmentId,
-      packet->interfaceIndex,
-      packet->subInterfaceIndex,
-      clonedNetBufferList,
-      TLInspectInjectComplete,
-      packet
-   );
-
-   if (!NT_SUCCESS(status))
-   {
-      goto Exit;
-   }
-
-   clonedNetBufferList = NULL; // ownership transferred to the 
-                               // completion function.
+   *clone = clonedNetBufferList;
+   clonedNetBufferList = NULL; // ownership transferred to the caller.
 
 Exit:
 
@@ -1597,297 +1797,971 @@ Exit:
    return status;
 }
 
-void
-TlInspectCompletePendedConnection(
-   _Inout_ TL_INSPECT_PENDED_PACKET** pendedConnect,
-   _In_ BOOLEAN permitTraffic
+BOOLEAN
+TLInspectBatchAccepts(
+   _In_ const TL_INSPECT_INJECT_BATCH* batch,
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
 )
 /* ++
 
-   This function completes the pended connection (inbound or outbound)
-   with the inspection result.
+   This function returns whether the packet can be injected with the same
+   call as the packets already in the batch. Outbound packets must share
+   the endpoint, remote address and scope; inbound packets must share the
+   arrival interface. Packets with control data are always injected alone.
 
 -- */
 {
+   const TL_INSPECT_PENDED_PACKET* first;
 
-   TL_INSPECT_PENDED_PACKET* pendedConnectLocal = *pendedConnect;
-
-   if (pendedConnectLocal->direction == FWP_DIRECTION_OUTBOUND)
+   if (batch->count == 0)
    {
-      HANDLE completionContext = pendedConnectLocal->completionContext;
-
-      pendedConnectLocal->authConnectDecision =
-         permitTraffic ? FWP_ACTION_PERMIT : FWP_ACTION_BLOCK;
+      return TRUE;
+   }
 
-      //
-      // For pended ALE_AUTH_CONNECT, FwpsCompleteOperation will trigger
-      // a re-auth during which the inspection decision is to be returned.
-      // Here we don't remove the pended entry from the list such that the
-      // re-auth can find it along with the recorded inspection result.
-      //
-      pendedConnectLocal->completionContext = NULL;
+   first = batch->packets[0];
 
-      FwpsCompleteOperation(
-         completionContext,
-         NULL
-      );
+   if ((first->direction != packet->direction) ||
+      (first->addressFamily != packet->addressFamily) ||
+      (first->compartmentId != packet->compartmentId))
+   {
+      return FALSE;
+   }
 
-      *pendedConnect = NULL; // ownership transferred to the re-auth path.
+   if (packet->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      return (first->endpointHandle == packet->endpointHandle) &&
+         (first->remoteScopeId.Value == packet->remoteScopeId.Value) &&
+         (first->controlData == NULL) &&
+         (packet->controlData == NULL) &&
+         RtlEqualMemory(
+            &first->remoteAddr,
+            &packet->remoteAddr,
+            sizeof(FWP_BYTE_ARRAY16));
    }
    else
    {
-      if (!configPermitTraffic)
-      {
-         FreePendedPacket(pendedConnectLocal);
-         *pendedConnect = NULL;
-      }
-
-      //
-      // Permitted ALE_RECV_ACCEPT will pass thru and be processed by
-      // TLInspectCloneReinjectInbound. FwpsCompleteOperation will be called
-      // then when the net buffer list is cloned; after which the clone will
-      // be recv-injected.
-      //
+      return (first->interfaceIndex == packet->interfaceIndex) &&
+         (first->subInterfaceIndex == packet->subInterfaceIndex);
    }
 }
 
 void
-TLInspectWorker(
-   _In_ void* StartContext
+TLInspectBatchFlush(
+   _Inout_ TL_INSPECT_INJECT_BATCH** batchPtr
 )
 /* ++
 
-   This worker thread waits for the connect and packet queue event when the
-   queues are empty; and it will be woken up when there are connects/packets
-   queued needing to be inspected. Once awaking, It will run in a loop to
-   complete the pended ALE classifies and/or clone-reinject packets back
-   until both queues are exhausted (and it will go to sleep waiting for more
-   work).
-
-   The worker thread will end once it detected the driver is unloading.
+   This function injects the chain of clones of the batch with a single
+   call; the batch is released by TLInspectInjectComplete.
 
 -- */
 {
    NTSTATUS status;
+   TL_INSPECT_INJECT_BATCH* batch = *batchPtr;
+   TL_INSPECT_PENDED_PACKET* first;
+   ULONG count;
+   LONG freed;
 
-   TL_INSPECT_PENDED_PACKET* packet = NULL;
-   LIST_ENTRY* listEntry;
-
-   KLOCK_QUEUE_HANDLE packetQueueLockHandle;
-   KLOCK_QUEUE_HANDLE connListLockHandle;
+   *batchPtr = NULL;
 
-   BOOLEAN found = FALSE;
+   if (batch == NULL)
+   {
+      return;
+   }
 
-   UNREFERENCED_PARAMETER(StartContext);
+   count = batch->count;
 
-   for (;;)
+   if (count == 0)
    {
-      KeWaitForSingleObject(
-         &gWorkerEvent,
-         Executive,
-         KernelMode,
-         FALSE,
-         NULL
-      );
+      ExFreePoolWithTag(batch, TL_INSPECT_BATCH_POOL_TAG);
+      return;
+   }
 
-      if (gDriverUnloading)
-      {
-         break;
-      }
+   first = batch->packets[0];
+   batch->pendingCount = (LONG)count;
 
-      configPermitTraffic = IsTrafficPermitted();
+   batch->injectTime = TLInspectLatencyNow();
+   TLInspectLatencyRecordBatch(batch, TL_INSPECT_LATENCY_PROCESS);
 
-      listEntry = NULL;
+   if (first->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      FWPS_TRANSPORT_SEND_PARAMS sendArgs = { 0 };
 
-      KeAcquireInStackQueuedSpinLock(
-         &gConnListLock,
-         &connListLockHandle
+      sendArgs.remoteAddress = (UINT8*)(&first->remoteAddr);
+      sendArgs.remoteScopeId = first->remoteScopeId;
+      sendArgs.controlData = first->controlData;
+      sendArgs.controlDataLength = first->controlDataLength;
+
+      //
+      // Send-inject the cloned net buffer lists.
+      //
+
+      status = FwpsInjectTransportSendAsync(
+         gInjectionHandle,
+         NULL,
+         first->endpointHandle,
+         0,
+         &sendArgs,
+         first->addressFamily,
+         first->compartmentId,
+         batch->netBufferListHead,
+         TLInspectInjectComplete,
+         batch
+      );
+   }
+   else
+   {
+      status = FwpsInjectTransportReceiveAsync(
+         gInjectionHandle,
+         NULL,
+         NULL,
+         0,
+         first->addressFamily,
+         first->compartmentId,
+         first->interfaceIndex,
+         first->subInterfaceIndex,
+         batch->netBufferListHead,
+         TLInspectInjectComplete,
+         batch
       );
+   }
+
+   if (NT_SUCCESS(status))
+   {
+      //
+      // The batch may already be gone; only count is used from here on.
+      //
+      TLInspectStatsIncrement(injectCalls);
+      TLInspectStatsAdd(reinjectCount, count);
+   }
+   else
+   {
+      ULONG i;
 
-      if (!IsListEmpty(&gConnList))
+      for (i = 0; i < count; i++)
       {
-         //
-         // Skip pended connections in the list, for which the auth decision is already taken.
-         // They should not be for inbound connections.
-         //
-         _Analysis_assume_(gConnList.Flink != NULL);
-         for (listEntry = gConnList.Flink;
-            listEntry != &gConnList;
-            listEntry = listEntry->Flink)
-         {
-            packet = CONTAINING_RECORD(
-               listEntry,
-               TL_INSPECT_PENDED_PACKET,
-               listEntry
+         TLInspectStatsIncrement(classify[TLInspectStatsFunctionForLayer(
+            batch->packets[i]->layerId)].reinjectFailures);
+         TLInspectLatencyRecord(
+            batch->packets[i],
+            TL_INSPECT_LATENCY_TOTAL,
+            batch->packets[i]->enqueueTime,
+            batch->injectTime
             );
 
-            NT_ASSERT((packet->direction != FWP_DIRECTION_INBOUND) ||
-               (packet->authConnectDecision == 0));
-
-            if (packet->authConnectDecision == 0)
-            {
-               found = TRUE;
-               break;
-            }
-         }
-
-         //
-         // If not found, reset entry and packet
-         //
-         if (!found)
+         if (TLInspectTraceEnabled(TL_INSPECT_TRACE_LEVEL_ERROR))
          {
-            listEntry = NULL;
-            packet = NULL;
+            TLInspectTracePendedPacket(
+               TL_INSPECT_TRACE_EVENT_INJECT_FAILURE,
+               batch->packets[i],
+               TL_INSPECT_TRACE_VERDICT_NONE
+            );
          }
+      }
 
-         //
-         // Completing a pended recv_accept auth does not trigger reauth. 
-         // So the pended entries for AUTH_RECV_ACCEPT are removed here. 
-         //
-         if (packet != NULL && packet->direction == FWP_DIRECTION_INBOUND)
-         {
-            RemoveEntryList(&packet->listEntry);
-         }
+      TLInspectFreeCloneChain(batch->netBufferListHead, &freed);
+      TLInspectFreeBatch(batch);
+   }
+}
 
-         //
-         // Leave the pended ALE_AUTH_CONNECT in the connection list, it will
-         // be processed and removed from the list during re-auth.
-         //
+NTSTATUS
+TLInspectBatchAdd(
+   _Inout_ TL_INSPECT_INJECT_BATCH** batchPtr,
+   _In_ TL_INSPECT_PENDED_PACKET* packet
+)
+/* ++
+
+   This function clones the packet and appends the clone to the batch, or
+   to a new batch if the packet cannot join the current one. The batch is
+   flushed once it holds configInjectBatchSize packets or its first packet
+   has waited configInjectBatchLatency microseconds. On success the batch
+   owns the packet.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_INJECT_BATCH* batch = *batchPtr;
+   NET_BUFFER_LIST* clonedNetBufferList;
+
+   if ((batch != NULL) && !TLInspectBatchAccepts(batch, packet))
+   {
+      TLInspectBatchFlush(batchPtr);
+      batch = NULL;
+   }
+
+   if (batch == NULL)
+   {
+      batch = ExAllocatePoolZero(
+                 NonPagedPool,
+                 sizeof(TL_INSPECT_INJECT_BATCH),
+                 TL_INSPECT_BATCH_POOL_TAG
+                 );
+      if (batch == NULL)
+      {
+         return STATUS_INSUFFICIENT_RESOURCES;
       }
 
+      batch->startTime = KeQueryInterruptTime();
+      *batchPtr = batch;
+   }
+
+   if (packet->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      status = TLInspectCloneOutbound(packet, &clonedNetBufferList);
+   }
+   else
+   {
+      status = TLInspectCloneInbound(packet, &clonedNetBufferList);
+   }
+
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   if (batch->netBufferListHead == NULL)
+   {
+      batch->netBufferListHead = clonedNetBufferList;
+   }
+   else
+   {
+      NET_BUFFER_LIST_NEXT_NBL(batch->netBufferListTail) = clonedNetBufferList;
+   }
+   batch->netBufferListTail = clonedNetBufferList;
+
+   batch->packets[batch->count++] = packet;
+
+   if ((batch->count >= configInjectBatchSize) ||
+      (packet->controlData != NULL) ||
+      (KeQueryInterruptTime() - batch->startTime >=
+         (UINT64)configInjectBatchLatency * 10))
+   {
+      TLInspectBatchFlush(batchPtr);
+   }
+
+   return STATUS_SUCCESS;
+}
+
+void
+TlInspectCompletePendedConnection(
+   _Inout_ TL_INSPECT_PENDED_PACKET** pendedConnect,
+   _In_ BOOLEAN permitTraffic
+)
+/* ++
+
+   This function completes the pended connection (inbound or outbound)
+   with the inspection result.
+
+-- */
+{
+
+   TL_INSPECT_PENDED_PACKET* pendedConnectLocal = *pendedConnect;
+
+   if (pendedConnectLocal->direction == FWP_DIRECTION_OUTBOUND)
+   {
+      HANDLE completionContext = pendedConnectLocal->completionContext;
+      KLOCK_QUEUE_HANDLE connListLockHandle;
+
+      //
+      // Once decided, the connect belongs to the connection table: its
+      // re-auth timer or a re-auth on another processor may free it as soon
+      // as gConnListLock is released, so it is done with before that and
+      // only the completion handle is used afterwards.
+      //
+      pendedConnectLocal->completionContext = NULL;
+
+      TLInspectLatencyRecordDone(pendedConnectLocal);
+
+      //
+      // For pended ALE_AUTH_CONNECT, FwpsCompleteOperation will trigger
+      // a re-auth during which the inspection decision is to be returned.
+      // Here we don't remove the pended entry from the list such that the
+      // re-auth can find it along with the recorded inspection result; it
+      // is timed out if the re-auth never comes.
+      //
+      KeAcquireInStackQueuedSpinLock(
+         &gConnListLock,
+         &connListLockHandle
+      );
+
+      TLInspectConnTableDecide(
+         pendedConnectLocal,
+         permitTraffic ? FWP_ACTION_PERMIT : FWP_ACTION_BLOCK
+         );
+
       KeReleaseInStackQueuedSpinLock(&connListLockHandle);
 
-      if (listEntry == NULL)
+      FwpsCompleteOperation(
+         completionContext,
+         NULL
+      );
+
+      *pendedConnect = NULL; // ownership transferred to the re-auth path.
+   }
+   else
+   {
+      if (!permitTraffic)
       {
-         NT_ASSERT(!IsListEmpty(&gPacketQueue));
+         TLInspectLatencyRecordDone(pendedConnectLocal);
+         FreePendedPacket(pendedConnectLocal);
+         *pendedConnect = NULL;
+      }
 
-         KeAcquireInStackQueuedSpinLock(
-            &gPacketQueueLock,
-            &packetQueueLockHandle
-         );
+      //
+      // Permitted ALE_RECV_ACCEPT will pass thru and be processed by
+      // TLInspectCloneInbound. FwpsCompleteOperation will be called
+      // then when the net buffer list is cloned; after which the clone will
+      // be recv-injected.
+      //
+   }
+}
 
-         listEntry = RemoveHeadList(&gPacketQueue);
+void
+TLInspectTakeCoalescedConnects(
+   _Inout_ TL_INSPECT_PENDED_PACKET* pendedConnect,
+   _Inout_ LIST_ENTRY* followers
+)
+/* ++
 
-         packet = CONTAINING_RECORD(
-            listEntry,
-            TL_INSPECT_PENDED_PACKET,
-            listEntry
-         );
+   This function moves the connects coalesced with a connect about to be
+   decided to followers, linked by their listEntry. The connect only leads
+   once it was queued, and only stops leading here, so the lock is not
+   taken for a connect that does not lead.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+
+   if (!pendedConnect->coalesce.leader)
+   {
+      return;
+   }
+
+   KeAcquireInStackQueuedSpinLock(
+      &gConnListLock,
+      &connListLockHandle
+   );
+
+   TLInspectConnTableTakeCoalesced(pendedConnect, followers);
+
+   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeueConnect(void)
+/* ++
+
+   This function returns the oldest pended connect for which no inspection
+   decision has been taken yet, or NULL if there is none. It is only called
+   by worker 0 so that the decisions are taken in arrival order. Pended
+   inbound connects are removed from the connection table here since
+   completing a pended recv_accept auth does not trigger a reauth; pended
+   outbound connects are left in the table, they will be removed during the
+   re-auth.
+
+   gWorkerEvent is cleared, under gConnListLock, once no undecided connect
+   is left.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+   TL_INSPECT_PENDED_PACKET* packet;
+
+   KeAcquireInStackQueuedSpinLock(
+      &gConnListLock,
+      &connListLockHandle
+   );
+   TLInspectStatsIncrement(dequeue.lockAcquisitions);
+
+   packet = TLInspectConnTableDequeueUndecided();
+
+   if ((packet != NULL) && (packet->direction == FWP_DIRECTION_INBOUND))
+   {
+      TLInspectConnTableRemove(packet);
+   }
+
+   if (IsListEmpty(&gConnList) && !gDriverUnloading)
+   {
+      KeClearEvent(&gWorkerEvent);
+   }
+
+   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
+
+   return packet;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeueShardPacket(
+   _Inout_ TL_INSPECT_WORKER* worker,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass,
+   _Inout_ TL_INSPECT_INJECT_BATCH** batch
+)
+/* ++
+
+   This function returns the next packet of the class for the worker. When
+   the shard the worker holds has no more packets for it, the packets
+   dequeued from the shard are injected and the shard is released before
+   another is claimed, so that the next worker to claim it injects the
+   packets of its flows after these. The shard is kept while the worker
+   still has data packets spliced from it.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet;
+
+   packet = TLInspectDequeuePacket(worker, schedClass);
+
+   if ((packet == NULL) && (worker->shard != NULL) &&
+       IsListEmpty(&worker->spliced))
+   {
+      TLInspectBatchFlush(batch);
+      TLInspectReleaseShard(worker);
+
+      packet = TLInspectDequeuePacket(worker, schedClass);
+   }
 
-         KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
+   return packet;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeueNext(
+   _Inout_ TL_INSPECT_WORKER* worker,
+   _Inout_ TL_INSPECT_INJECT_BATCH** batch
+)
+/* ++
+
+   This function returns the next connect or packet for the worker, of the
+   class picked by its scheduler, or NULL when the worker has no work left.
+   Only worker 0 takes connects; it is told of them by gWorkerEvent, which
+   stays set while any is undecided. Re-authorizations are only looked for
+   while some are queued, and data packets always.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet = NULL;
+   TL_INSPECT_SCHED_CLASS schedClass;
+   UINT64 now = TLInspectLatencyNow();
+   ULONG pending = TL_INSPECT_SCHED_CLASS_BIT(TL_INSPECT_SCHED_CLASS_DATA);
+   BOOLEAN overdue;
+
+   if ((worker->index == 0) && (KeReadStateEvent(&gWorkerEvent) != 0))
+   {
+      pending |= TL_INSPECT_SCHED_CLASS_BIT(TL_INSPECT_SCHED_CLASS_CONNECT);
+   }
+
+   if (ReadNoFence(&gPacketQueueReauthDepth) > 0)
+   {
+      pending |= TL_INSPECT_SCHED_CLASS_BIT(TL_INSPECT_SCHED_CLASS_REAUTH);
+   }
+
+   for (;;)
+   {
+      schedClass = TLInspectSchedulerPick(
+                      &gSchedConfig,
+                      &worker->scheduler,
+                      pending,
+                      now,
+                      &overdue
+                      );
+
+      if (schedClass == TL_INSPECT_SCHED_CLASS_MAX)
+      {
+         break;
       }
 
-      if (packet->type == TL_INSPECT_CONNECT_PACKET)
+      if (schedClass == TL_INSPECT_SCHED_CLASS_CONNECT)
       {
-         TlInspectCompletePendedConnection(
-            &packet,
-            configPermitTraffic);
+         packet = TLInspectDequeueConnect();
+      }
+      else
+      {
+         packet = TLInspectDequeueShardPacket(worker, schedClass, batch);
       }
 
-      if ((packet != NULL) && configPermitTraffic)
+      if (packet != NULL)
       {
-         if (packet->direction == FWP_DIRECTION_OUTBOUND)
+         TLInspectSchedulerServed(&worker->scheduler, schedClass, now);
+
+         TLInspectStatsIncrement(sched.served[schedClass]);
+         if (overdue)
          {
-            status = TLInspectCloneReinjectOutbound(packet);
+            TLInspectStatsIncrement(sched.overdue[schedClass]);
          }
-         else
+         break;
+      }
+
+      pending &= ~TL_INSPECT_SCHED_CLASS_BIT(schedClass);
+   }
+
+   return packet;
+}
+
+void
+TLInspectCompleteVerdict(
+   _In_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ BOOLEAN permitTraffic,
+   _Inout_ TL_INSPECT_INJECT_BATCH** batch
+)
+/* ++
+
+   This function completes a pended connect, or clones a pended packet into
+   the injection batch, with a verdict; it consumes the packet.
+
+-- */
+{
+   NTSTATUS status;
+
+   if (TLInspectTraceEnabled(TL_INSPECT_TRACE_LEVEL_VERDICT))
+   {
+      TLInspectTracePendedPacket(
+         TL_INSPECT_TRACE_EVENT_VERDICT,
+         packet,
+         permitTraffic ? TL_INSPECT_TRACE_VERDICT_PERMIT :
+                         TL_INSPECT_TRACE_VERDICT_BLOCK
+      );
+   }
+
+   if (packet->type == TL_INSPECT_CONNECT_PACKET)
+   {
+      TlInspectCompletePendedConnection(
+         &packet,
+         permitTraffic);
+   }
+
+   if ((packet != NULL) && permitTraffic)
+   {
+      status = TLInspectBatchAdd(batch, packet);
+
+      if (NT_SUCCESS(status))
+      {
+         packet = NULL; // ownership transferred.
+      }
+      else
+      {
+         TLInspectStatsIncrement(classify[TLInspectStatsFunctionForLayer(
+            packet->layerId)].reinjectFailures);
+
+         if (TLInspectTraceEnabled(TL_INSPECT_TRACE_LEVEL_ERROR))
          {
-            status = TLInspectCloneReinjectInbound(packet);
+            TLInspectTracePendedPacket(
+               TL_INSPECT_TRACE_EVENT_INJECT_FAILURE,
+               packet,
+               TL_INSPECT_TRACE_VERDICT_NONE
+            );
          }
+      }
+
+   }
+
+   if (packet != NULL)
+   {
+      TLInspectLatencyRecordDone(packet);
+      FreePendedPacket(packet);
+   }
+}
+
+void
+TLInspectApplyVerdict(
+   _In_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ BOOLEAN permitTraffic,
+   _In_ LONG generation,
+   _Inout_ TL_INSPECT_INJECT_BATCH** batch
+)
+/* ++
+
+   This function caches the inspection result of a pended connect or
+   packet, and completes it with the result; it consumes the packet.
+   generation is the generation of the flow cache from before the result
+   was taken. The connects coalesced with a connect get the same result,
+   each completed on its own.
+
+-- */
+{
+   LIST_ENTRY followers;
+   UINT64 dequeueTime = packet->dequeueTime;
+
+   InitializeListHead(&followers);
+
+   //
+   // Later packets of the flow are decided by the transport classify.
+   //
+   if (packet->type != TL_INSPECT_REAUTH_PACKET)
+   {
+      TLInspectFlowCacheInsert(
+         packet,
+         permitTraffic ? FWP_ACTION_PERMIT : FWP_ACTION_BLOCK,
+         generation
+         );
+   }
+
+   if (packet->type == TL_INSPECT_CONNECT_PACKET)
+   {
+      //
+      // And the later connections of the application to the same service.
+      //
+      TLInspectConnectCacheInsert(
+         packet,
+         permitTraffic ? FWP_ACTION_PERMIT : FWP_ACTION_BLOCK,
+         generation
+         );
+
+      //
+      // Taken before the connect is completed, which may free it.
+      //
+      TLInspectTakeCoalescedConnects(packet, &followers);
+   }
+
+   TLInspectCompleteVerdict(packet, permitTraffic, batch);
+
+   //
+   // The followers waited in the queue until their leader was dequeued.
+   //
+   while (!IsListEmpty(&followers))
+   {
+      packet = CONTAINING_RECORD(
+                  RemoveHeadList(&followers),
+                  TL_INSPECT_PENDED_PACKET,
+                  listEntry
+                  );
+
+      packet->dequeueTime = dequeueTime;
+      TLInspectLatencyRecord(
+         packet,
+         TL_INSPECT_LATENCY_QUEUE,
+         packet->enqueueTime,
+         packet->dequeueTime
+         );
 
-         if (NT_SUCCESS(status))
+      TLInspectApplyVerdict(packet, permitTraffic, generation, batch);
+   }
+}
+
+void
+TLInspectProcessPacket(
+   _In_ TL_INSPECT_PENDED_PACKET* packet,
+   _Inout_ TL_INSPECT_INJECT_BATCH** batch
+)
+/* ++
+
+   This function decides a dequeued connect or packet and consumes it. It
+   is handed over to the policy daemon while one is in use (see verdict.c);
+   otherwise the result is the verdict of the current policy on it.
+
+-- */
+{
+   LONG generation = TLInspectFlowCacheGeneration();
+
+   packet->dequeueTime = TLInspectLatencyNow();
+   TLInspectLatencyRecord(
+      packet,
+      TL_INSPECT_LATENCY_QUEUE,
+      packet->enqueueTime,
+      packet->dequeueTime
+      );
+
+   if (TLInspectVerdictSubmit(packet, generation))
+   {
+      return;
+   }
+
+   TLInspectApplyVerdict(
+      packet,
+      IsPacketPermitted(packet),
+      generation,
+      batch
+      );
+}
+
+void
+TLInspectWorker(
+   _In_ void* StartContext
+)
+/* ++
+
+   Each worker thread is affinitized to one processor and waits for the
+   queues it owns to become non-empty; worker 0 additionally waits for
+   pended connects. Once awaking, It will run in a loop to complete the
+   pended ALE classifies and/or clone-reinject packets back until there is
+   no work left, taking over the queues of the other workers when its own
+   are empty (and it will go to sleep waiting for more work). Connects,
+   re-authorizations and data packets are taken in the order picked by the
+   scheduler of the worker (see sched.h), so that a connect storm does not
+   hold up the packets of established flows. Clones are injected in
+   batches; the pending batch is flushed before sleeping.
+
+   The packet queues are the shards of the flows (see shard.h): a worker
+   holds a shard while it dequeues from it, and injects what it dequeued
+   before releasing it, so that the packets of a flow are injected in the
+   order they were queued. The order is kept among the data packets and
+   among the re-authorizations of a flow, not between the two classes. The
+   verdicts of the policy daemon are applied in the order the packets were
+   handed to it, which keeps the order of the shards; the worker collects
+   those the daemon wrote to the packet ring once it runs out of work.
+
+   The worker thread will end once it detected the driver is unloading; the
+   remaining connects and packets are discarded by TLInspectDrainQueues.
+
+-- */
+{
+   TL_INSPECT_WORKER* worker = (TL_INSPECT_WORKER*)StartContext;
+   TL_INSPECT_PENDED_PACKET* packet;
+   TL_INSPECT_INJECT_BATCH* batch = NULL;
+   PROCESSOR_NUMBER processor;
+   GROUP_AFFINITY affinity;
+   void* waitObjects[2];
+
+   if (NT_SUCCESS(KeGetProcessorNumberFromIndex(worker->index, &processor)))
+   {
+      RtlZeroMemory(&affinity, sizeof(affinity));
+      affinity.Group = processor.Group;
+      affinity.Mask = (KAFFINITY)1 << processor.Number;
+
+      KeSetSystemGroupAffinityThread(&affinity, NULL);
+   }
+
+   waitObjects[0] = &worker->workEvent;
+   waitObjects[1] = &gWorkerEvent;
+
+   for (;;)
+   {
+      InterlockedExchange(&worker->idle, TRUE);
+
+      if (worker->index == 0)
+      {
+         KeWaitForMultipleObjects(
+            2,
+            waitObjects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL,
+            NULL
+         );
+      }
+      else
+      {
+         KeWaitForSingleObject(
+            &worker->workEvent,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+         );
+      }
+
+      InterlockedExchange(&worker->idle, FALSE);
+      InterlockedExchange(&worker->wakePending, FALSE);
+
+      if (gDriverUnloading)
+      {
+         break;
+      }
+
+      while (!gDriverUnloading)
+      {
+         packet = TLInspectDequeueNext(worker, &batch);
+
+         if (packet == NULL)
          {
-            packet = NULL; // ownership transferred.
+            break;
          }
 
+         TLInspectProcessPacket(packet, &batch);
       }
 
-      if (packet != NULL)
+      TLInspectBatchFlush(&batch);
+      TLInspectReleaseShard(worker);
+
+      TLInspectVerdictPoll();
+   }
+
+   PsTerminateSystemThread(STATUS_SUCCESS);
+
+}
+
+void
+TLInspectExpireConnects(
+   _In_ UINT64 now
+)
+/* ++
+
+   Called by the periodic timer (see wheel.c) at DISPATCH_LEVEL. The
+   pended connects left undecided for the connect timeout are completed
+   with the default verdict of configConnectTimeoutVerdict, or blocked
+   during unload; they were never inspected, so the verdict is not cached.
+   The decided connects whose re-auth did not come within the timeout are
+   freed.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+   TL_INSPECT_INJECT_BATCH* batch = NULL;
+   TL_INSPECT_PENDED_PACKET* packet;
+   LIST_ENTRY undecided;
+   LIST_ENTRY decided;
+   BOOLEAN permitTraffic;
+
+   InitializeListHead(&undecided);
+   InitializeListHead(&decided);
+
+   KeAcquireInStackQueuedSpinLockAtDpcLevel(
+      &gConnListLock,
+      &connListLockHandle
+   );
+
+   TLInspectConnTableExpire(now, &undecided, &decided);
+
+   permitTraffic = (configConnectTimeoutVerdict != 0) && !gDriverUnloading;
+
+   KeReleaseInStackQueuedSpinLockFromDpcLevel(&connListLockHandle);
+
+   while (!IsListEmpty(&decided))
+   {
+      packet = CONTAINING_RECORD(
+                  RemoveHeadList(&decided),
+                  TL_INSPECT_PENDED_PACKET,
+                  listEntry
+                  );
+
+      TLInspectStatsIncrement(timers.reauthTimeouts);
+      FreePendedPacket(packet);
+   }
+
+   while (!IsListEmpty(&undecided))
+   {
+      packet = CONTAINING_RECORD(
+                  RemoveHeadList(&undecided),
+                  TL_INSPECT_PENDED_PACKET,
+                  listEntry
+                  );
+
+      TLInspectStatsIncrement(timers.connectTimeouts);
+
+      packet->dequeueTime = TLInspectLatencyNow();
+      TLInspectCompleteVerdict(packet, permitTraffic, &batch);
+   }
+
+   TLInspectBatchFlush(&batch);
+}
+
+void
+TLInspectDiscardConnect(
+   _In_ TL_INSPECT_PENDED_PACKET* pendedConnect
+)
+/* ++
+
+   Called during unload for an undecided connect, which must no longer be
+   queued. The connect, and the connects coalesced with it, are completed
+   with a block decision.
+
+-- */
+{
+   LIST_ENTRY connects;
+   TL_INSPECT_PENDED_PACKET* packet;
+
+   InitializeListHead(&connects);
+
+   TLInspectTakeCoalescedConnects(pendedConnect, &connects);
+   InsertHeadList(&connects, &pendedConnect->listEntry);
+
+   while (!IsListEmpty(&connects))
+   {
+      packet = CONTAINING_RECORD(
+                  RemoveHeadList(&connects),
+                  TL_INSPECT_PENDED_PACKET,
+                  listEntry
+                  );
+
+      if (packet->direction == FWP_DIRECTION_INBOUND)
       {
          FreePendedPacket(packet);
       }
-
-      KeAcquireInStackQueuedSpinLock(
-         &gConnListLock,
-         &connListLockHandle
-      );
-      KeAcquireInStackQueuedSpinLock(
-         &gPacketQueueLock,
-         &packetQueueLockHandle
-      );
-
-      if (IsListEmpty(&gConnList) && IsListEmpty(&gPacketQueue) &&
-         !gDriverUnloading)
+      else
       {
-         KeClearEvent(&gWorkerEvent);
+         TlInspectCompletePendedConnection(&packet, FALSE);
+         NT_ASSERT(packet == NULL);
       }
-
-      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
-      KeReleaseInStackQueuedSpinLock(&connListLockHandle);
    }
+}
+
+void
+TLInspectDrainQueues(void)
+/* ++
+
+   Called during unload once every worker thread has exited. Pended
+   connects are completed with a block decision, the decided connects
+   still waiting for their re-auth are freed, and all the pended packets
+   are discarded.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE connListLockHandle;
+   TL_INSPECT_PENDED_PACKET* packet;
+   LIST_ENTRY decided;
 
    NT_ASSERT(gDriverUnloading);
 
-   while (!IsListEmpty(&gConnList))
-   {
-      packet = NULL;
+   InitializeListHead(&decided);
 
+   for (;;)
+   {
       KeAcquireInStackQueuedSpinLock(
          &gConnListLock,
          &connListLockHandle
       );
 
-      if (!IsListEmpty(&gConnList))
+      packet = TLInspectConnTableDequeueUndecided();
+
+      if ((packet != NULL) && (packet->direction == FWP_DIRECTION_INBOUND))
       {
-         listEntry = gConnList.Flink;
-         packet = CONTAINING_RECORD(
-            listEntry,
-            TL_INSPECT_PENDED_PACKET,
-            listEntry
-         );
+         TLInspectConnTableRemove(packet);
       }
 
       KeReleaseInStackQueuedSpinLock(&connListLockHandle);
 
-      if (packet != NULL)
+      if (packet == NULL)
       {
-         TlInspectCompletePendedConnection(&packet, FALSE);
-         NT_ASSERT(packet == NULL);
+         break;
       }
+
+      TLInspectDiscardConnect(packet);
    }
 
    //
-   // Discard all the pended packets if driver is being unloaded.
+   // The outbound connects just completed, and those decided earlier, are
+   // waiting for their re-auth. Rather than wait for it, or for their
+   // timer, they are freed here; a re-auth that comes later finds no
+   // pended connect, as after the connect timeout.
    //
+   KeAcquireInStackQueuedSpinLock(
+      &gConnListLock,
+      &connListLockHandle
+   );
 
-   while (!IsListEmpty(&gPacketQueue))
-   {
-      packet = NULL;
-
-      KeAcquireInStackQueuedSpinLock(
-         &gPacketQueueLock,
-         &packetQueueLockHandle
-      );
+   TLInspectConnTableTakeDecided(&decided);
 
-      if (!IsListEmpty(&gPacketQueue))
-      {
-         listEntry = RemoveHeadList(&gPacketQueue);
+   NT_ASSERT(TLInspectConnTableIsEmpty());
 
-         packet = CONTAINING_RECORD(
-            listEntry,
-            TL_INSPECT_PENDED_PACKET,
-            listEntry
-         );
-      }
+   KeReleaseInStackQueuedSpinLock(&connListLockHandle);
 
-      KeReleaseInStackQueuedSpinLock(&packetQueueLockHandle);
+   while (!IsListEmpty(&decided))
+   {
+      packet = CONTAINING_RECORD(
+                  RemoveHeadList(&decided),
+                  TL_INSPECT_PENDED_PACKET,
+                  listEntry
+                  );
 
-      if (packet != NULL)
-      {
-         FreePendedPacket(packet);
-      }
+      FreePendedPacket(packet);
    }
 
-   PsTerminateSystemThread(STATUS_SUCCESS);
+   //
+   // Discard all the pended packets if driver is being unloaded.
+   //
 
+   while ((packet = TLInspectDequeueAnyPacket()) != NULL)
+   {
+      FreePendedPacket(packet);
+   }
 }
@@ -16,6 +16,9 @@ Environment:
 #ifndef _TL_INSPECT_H_
 #define _TL_INSPECT_H_
 
+#include "coalesce.h"
+#include "wheel.h"
+
 typedef enum TL_INSPECT_PACKET_TYPE_
 {
    TL_INSPECT_CONNECT_PACKET,
@@ -23,6 +26,13 @@ typedef enum TL_INSPECT_PACKET_TYPE_
    TL_INSPECT_REAUTH_PACKET
 } TL_INSPECT_PACKET_TYPE;
 
+//
+// Size of the control data buffer embedded in TL_INSPECT_PENDED_PACKET;
+// large enough for the IP_PKTINFO/IPV6_PKTINFO control messages most
+// packets carry.
+//
+#define TL_INSPECT_INLINE_CONTROL_DATA_SIZE 64
+
 //
 // TL_INSPECT_PENDED_PACKET is the object type we used to store all information
 // needed for out-of-band packet modification and re-injection. This type
@@ -35,9 +45,27 @@ typedef struct TL_INSPECT_PENDED_PACKET_
 {
    LIST_ENTRY listEntry;
 
+   //
+   // Links a pended connect into its bucket of the connection table.
+   //
+   LIST_ENTRY hashEntry;
+
+   //
+   // Links a pended connect to the connects coalesced with it (see
+   // coalesce.h).
+   //
+   TL_INSPECT_COALESCE_ENTRY coalesce;
+
+   //
+   // Times out a pended connect, undecided or waiting for its re-auth (see
+   // conntable.c).
+   //
+   TL_INSPECT_TIMER timer;
+
    ADDRESS_FAMILY addressFamily;
    TL_INSPECT_PACKET_TYPE type;
    FWP_DIRECTION  direction;
+   UINT16 layerId;
    
    UINT32 authConnectDecision;
    HANDLE completionContext;
@@ -87,30 +115,110 @@ typedef struct TL_INSPECT_PENDED_PACKET_
    UINT32 transportHeaderSize;
    IF_INDEX interfaceIndex;
    IF_INDEX subInterfaceIndex;
+
+   //
+   // The hash of the 5-tuple of the packet, which picks the shard it is
+   // queued to (see shard.h).
+   //
+   ULONG flowHash;
+
+   //
+   // The process the packet belongs to, and the hash of its ALE application
+   // id, when the layer tells them; 0 otherwise.
+   //
+   UINT64 processId;
+   UINT64 appId;
+
+   //
+   // The memory the packet is charged against the budget of the overload
+   // control (see overload.c).
+   //
+   ULONG overloadBytes;
+
+   //
+   // When the packet was queued and dequeued by a worker, for the latency
+   // histograms (see latency.c).
+   //
+   UINT64 enqueueTime;
+   UINT64 dequeueTime;
+
+   //
+   // Holds the control data of outbound packets when it fits, to save a
+   // second allocation. Must stay the last field; see
+   // TLInspectAllocatePendedPacket.
+   //
+   UINT64 inlineControlData[TL_INSPECT_INLINE_CONTROL_DATA_SIZE / sizeof(UINT64)];
 } TL_INSPECT_PENDED_PACKET;
 
 #pragma warning(pop)
 
+//
+// Upper bound on the number of packets injected by a single call.
+//
+#define TL_INSPECT_MAX_INJECT_BATCH 64
+
+//
+// Upper bound on the length of a prefix or rule string of the parameters.
+//
+#define TL_INSPECT_MAX_CONFIG_STRING 256
+
+//
+// TL_INSPECT_INJECT_BATCH groups the clones of pended packets that are
+// injected with a single FwpsInjectTransportSendAsync/ReceiveAsync call as
+// a chain of net buffer lists. pendingCount is the number of clones not yet
+// completed; the pended packets are freed when it drops to 0.
+//
+typedef struct TL_INSPECT_INJECT_BATCH_
+{
+   volatile LONG pendingCount;
+   ULONG count;
+   UINT64 startTime;
+   UINT64 injectTime;
+
+   NET_BUFFER_LIST* netBufferListHead;
+   NET_BUFFER_LIST* netBufferListTail;
+
+   TL_INSPECT_PENDED_PACKET* packets[TL_INSPECT_MAX_INJECT_BATCH];
+} TL_INSPECT_INJECT_BATCH;
+
 //
 // Pooltags used by this callout driver.
 //
 #define TL_INSPECT_CONNECTION_POOL_TAG 'olfD'
 #define TL_INSPECT_PENDED_PACKET_POOL_TAG 'kppD'
 #define TL_INSPECT_CONTROL_DATA_POOL_TAG 'dcdD'
+#define TL_INSPECT_QUEUE_POOL_TAG 'uqpD'
+#define TL_INSPECT_BATCH_POOL_TAG 'bipD'
+#define TL_INSPECT_TRACE_POOL_TAG 'rtpD'
+#define TL_INSPECT_STATS_POOL_TAG 'tspD'
+#define TL_INSPECT_LATENCY_POOL_TAG 'tlpD'
+#define TL_INSPECT_FLOW_POOL_TAG 'cfpD'
+#define TL_INSPECT_PREFIX_POOL_TAG 'xfpD'
+#define TL_INSPECT_RULE_POOL_TAG 'lrpD'
+#define TL_INSPECT_POLICY_POOL_TAG 'lopD'
+#define TL_INSPECT_VERDICT_POOL_TAG 'dvpD'
+#define TL_INSPECT_PACKET_RING_POOL_TAG 'rppD'
+
+//
+// Values of the prefixes of the remote addresses to inspect.
+//
+#define TL_INSPECT_PREFIX_EXCLUDE 0
+#define TL_INSPECT_PREFIX_INSPECT 1
 
 //
 // Shared global data.
 //
-extern BOOLEAN configPermitTraffic;
+extern ULONG configInjectBatchSize;
+extern ULONG configInjectBatchLatency;
+extern ULONG configFlowCacheMaxEntries;
+extern ULONG configConnectTimeout;
+extern ULONG configConnectTimeoutVerdict;
 
 extern HANDLE gInjectionHandle;
 
 extern LIST_ENTRY gConnList;
 extern KSPIN_LOCK gConnListLock;
 
-extern LIST_ENTRY gPacketQueue;
-extern KSPIN_LOCK gPacketQueueLock;
-
 extern KEVENT gWorkerEvent;
 
 extern BOOLEAN gDriverUnloading;
@@ -119,85 +227,53 @@ extern BOOLEAN gDriverUnloading;
 // Shared function prototypes
 //
 
-#if(NTDDI_VERSION >= NTDDI_WIN7)
+//
+// The classifyFn functions are specialized per layer (see
+// TL_INSPECT_DEFINE_CLASSIFY in inspect.c).
+//
 
-void
-TLInspectALEConnectClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-   );
+#if(NTDDI_VERSION >= NTDDI_WIN7)
 
-void
-TLInspectALERecvAcceptClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-   );
+#define TL_INSPECT_DECLARE_CLASSIFY(name)                                \
+   void                                                                 \
+   name(                                                                \
+      _In_ const FWPS_INCOMING_VALUES* inFixedValues,                   \
+      _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,           \
+      _Inout_opt_ void* layerData,                                      \
+      _In_opt_ const void* classifyContext,                             \
+      _In_ const FWPS_FILTER* filter,                                   \
+      _In_ UINT64 flowContext,                                          \
+      _Inout_ FWPS_CLASSIFY_OUT* classifyOut                            \
+      )
 
-void
-TLInspectTransportClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-   );
-
-void
-TLInspectIpClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_opt_ const void* classifyContext,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-);
 #else /// (NTDDI_VERSION >= NTDDI_WIN7)
 
-void
-TLInspectALEConnectClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-   );
-
-void
-TLInspectALERecvAcceptClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-   );
-
-void
-TLInspectTransportClassify(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _Inout_opt_ void* layerData,
-   _In_ const FWPS_FILTER* filter,
-   _In_ UINT64 flowContext,
-   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
-   );
+#define TL_INSPECT_DECLARE_CLASSIFY(name)                                \
+   void                                                                 \
+   name(                                                                \
+      _In_ const FWPS_INCOMING_VALUES* inFixedValues,                   \
+      _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,           \
+      _Inout_opt_ void* layerData,                                      \
+      _In_ const FWPS_FILTER* filter,                                   \
+      _In_ UINT64 flowContext,                                          \
+      _Inout_ FWPS_CLASSIFY_OUT* classifyOut                            \
+      )
 
 #endif /// (NTDDI_VERSION >= NTDDI_WIN7)
 
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectALEConnectClassifyV4);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectALEConnectClassifyV6);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectALERecvAcceptClassifyV4);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectALERecvAcceptClassifyV6);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectOutboundTransportClassifyV4);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectOutboundTransportClassifyV6);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectInboundTransportClassifyV4);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectInboundTransportClassifyV6);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectOutboundIpClassifyV4);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectOutboundIpClassifyV6);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectInboundIpClassifyV4);
+TL_INSPECT_DECLARE_CLASSIFY(TLInspectInboundIpClassifyV6);
+
 NTSTATUS
 TLInspectALEConnectNotify(
    _In_ FWPS_CALLOUT_NOTIFY_TYPE notifyType,
@@ -226,6 +302,38 @@ TLInspectIpNotify(
    _Inout_ const FWPS_FILTER* filter
 );
 
+void
+TlInspectCompletePendedConnection(
+   _Inout_ TL_INSPECT_PENDED_PACKET** pendedConnect,
+   _In_ BOOLEAN permitTraffic
+   );
+
+void
+TLInspectBatchFlush(
+   _Inout_ TL_INSPECT_INJECT_BATCH** batchPtr
+   );
+
+void
+TLInspectApplyVerdict(
+   _In_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ BOOLEAN permitTraffic,
+   _In_ LONG generation,
+   _Inout_ TL_INSPECT_INJECT_BATCH** batch
+   );
+
 KSTART_ROUTINE TLInspectWorker;
 
+void
+TLInspectExpireConnects(
+   _In_ UINT64 now
+   );
+
+void
+TLInspectDiscardConnect(
+   _In_ TL_INSPECT_PENDED_PACKET* pendedConnect
+   );
+
+void
+TLInspectDrainQueues(void);
+
 #endif // _TL_INSPECT_H_
@@ -0,0 +1,503 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the latency histograms of the Transport Inspect
+   sample.
+
+   A pended packet is timestamped when it is queued, when a worker thread
+   dequeues it, when its clone is injected and when the injection
+   completes. The time spent in each stage goes into a histogram per
+   packet type, direction and stage. Every processor has its own set of
+   histograms; they are merged when percentiles are queried.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "latency.h"
+
+typedef struct TL_INSPECT_LATENCY_HISTOGRAM_
+{
+   LONG64 buckets[TL_INSPECT_LATENCY_BUCKETS];
+   LONG64 max;
+} TL_INSPECT_LATENCY_HISTOGRAM;
+
+typedef struct TL_INSPECT_LATENCY_HISTOGRAMS_
+{
+   TL_INSPECT_LATENCY_HISTOGRAM
+      histograms[TL_INSPECT_LATENCY_PACKET_TYPES]
+                [TL_INSPECT_LATENCY_DIRECTIONS]
+                [TL_INSPECT_LATENCY_STAGE_MAX];
+} TL_INSPECT_LATENCY_HISTOGRAMS;
+
+TL_INSPECT_LATENCY_HISTOGRAMS** gLatencyHistograms;
+ULONG gLatencyHistogramCount;
+
+NTSTATUS
+TLInspectLatencyInitialize(void)
+/* ++
+
+   This function allocates a set of histograms per active processor.
+
+-- */
+{
+   ULONG i;
+
+   gLatencyHistogramCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+   gLatencyHistograms = ExAllocatePoolZero(
+                          NonPagedPool,
+                          gLatencyHistogramCount *
+                             sizeof(TL_INSPECT_LATENCY_HISTOGRAMS*),
+                          TL_INSPECT_LATENCY_POOL_TAG
+                          );
+   if (gLatencyHistograms == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   for (i = 0; i < gLatencyHistogramCount; i++)
+   {
+      gLatencyHistograms[i] = ExAllocatePoolZero(
+                                NonPagedPool,
+                                sizeof(TL_INSPECT_LATENCY_HISTOGRAMS),
+                                TL_INSPECT_LATENCY_POOL_TAG
+                                );
+      if (gLatencyHistograms[i] == NULL)
+      {
+         TLInspectLatencyFree();
+         return STATUS_INSUFFICIENT_RESOURCES;
+      }
+   }
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectLatencyFree(void)
+{
+   ULONG i;
+
+   if (gLatencyHistograms == NULL)
+   {
+      return;
+   }
+
+   for (i = 0; i < gLatencyHistogramCount; i++)
+   {
+      if (gLatencyHistograms[i] != NULL)
+      {
+         ExFreePoolWithTag(gLatencyHistograms[i], TL_INSPECT_LATENCY_POOL_TAG);
+      }
+   }
+
+   ExFreePoolWithTag(gLatencyHistograms, TL_INSPECT_LATENCY_POOL_TAG);
+   gLatencyHistograms = NULL;
+}
+
+__inline
+ULONG
+TLInspectLatencyBucket(
+   _In_ UINT64 latency
+   )
+/* ++
+
+   Values below 2 * TL_INSPECT_LATENCY_SUB_BUCKETS have a bucket each;
+   above, the bucket is given by the position of the most significant bit
+   and the TL_INSPECT_LATENCY_SUB_BUCKET_BITS bits that follow it.
+
+-- */
+{
+   ULONG msb;
+   ULONG shift;
+
+   if (latency < 2 * TL_INSPECT_LATENCY_SUB_BUCKETS)
+   {
+      return (ULONG)latency;
+   }
+
+   if (latency >= (1ull << TL_INSPECT_LATENCY_MAX_BITS))
+   {
+      return TL_INSPECT_LATENCY_BUCKETS - 1;
+   }
+
+   BitScanReverse64(&msb, latency);
+
+   shift = msb - TL_INSPECT_LATENCY_SUB_BUCKET_BITS;
+
+   return ((shift + 1) << TL_INSPECT_LATENCY_SUB_BUCKET_BITS) +
+          (ULONG)((latency >> shift) - TL_INSPECT_LATENCY_SUB_BUCKETS);
+}
+
+__inline
+UINT64
+TLInspectLatencyBucketLimit(
+   _In_ ULONG bucket
+   )
+/* ++
+
+   Returns the highest latency that falls into the bucket.
+
+-- */
+{
+   ULONG shift;
+   UINT64 mantissa;
+
+   if (bucket < 2 * TL_INSPECT_LATENCY_SUB_BUCKETS)
+   {
+      return bucket;
+   }
+
+   shift = (bucket >> TL_INSPECT_LATENCY_SUB_BUCKET_BITS) - 1;
+   mantissa = (bucket & (TL_INSPECT_LATENCY_SUB_BUCKETS - 1)) +
+              TL_INSPECT_LATENCY_SUB_BUCKETS;
+
+   return ((mantissa + 1) << shift) - 1;
+}
+
+void
+TLInspectLatencyRecord(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ TL_INSPECT_LATENCY_STAGE stage,
+   _In_ UINT64 start,
+   _In_ UINT64 end
+   )
+/* ++
+
+   This function adds the latency from start to end to the histogram of
+   the packet type and direction of the packet, for the given stage.
+
+-- */
+{
+   TL_INSPECT_LATENCY_HISTOGRAM* histogram;
+   UINT64 latency;
+   ULONG processor;
+
+   if ((gLatencyHistograms == NULL) ||
+       ((ULONG)packet->type >= TL_INSPECT_LATENCY_PACKET_TYPES) ||
+       ((ULONG)packet->direction >= TL_INSPECT_LATENCY_DIRECTIONS))
+   {
+      return;
+   }
+
+   latency = (end > start) ? end - start : 0;
+
+   processor = KeGetCurrentProcessorNumberEx(NULL) % gLatencyHistogramCount;
+   histogram = &gLatencyHistograms[processor]->
+                  histograms[packet->type][packet->direction][stage];
+
+   InterlockedIncrementNoFence64(
+      &histogram->buckets[TLInspectLatencyBucket(latency)]);
+
+   //
+   // The maximum is best effort; a racing update may be lost.
+   //
+   if ((LONG64)latency > histogram->max)
+   {
+      histogram->max = (LONG64)latency;
+   }
+}
+
+void
+TLInspectLatencyRecordDone(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   This function records the processing and total latencies of a packet
+   whose verdict is applied without injecting it.
+
+-- */
+{
+   UINT64 now = TLInspectLatencyNow();
+
+   TLInspectLatencyRecord(
+      packet,
+      TL_INSPECT_LATENCY_PROCESS,
+      packet->dequeueTime,
+      now
+      );
+   TLInspectLatencyRecord(
+      packet,
+      TL_INSPECT_LATENCY_TOTAL,
+      packet->enqueueTime,
+      now
+      );
+}
+
+void
+TLInspectLatencyRecordBatch(
+   _In_ const TL_INSPECT_INJECT_BATCH* batch,
+   _In_ TL_INSPECT_LATENCY_STAGE stage
+   )
+/* ++
+
+   This function records the latencies of every packet of the batch. With
+   TL_INSPECT_LATENCY_PROCESS, it is called when the batch is injected;
+   with TL_INSPECT_LATENCY_INJECT, when the injection completes, and the
+   total latencies are recorded as well.
+
+-- */
+{
+   UINT64 now = TLInspectLatencyNow();
+   ULONG i;
+
+   for (i = 0; i < batch->count; i++)
+   {
+      const TL_INSPECT_PENDED_PACKET* packet = batch->packets[i];
+
+      if (stage == TL_INSPECT_LATENCY_PROCESS)
+      {
+         TLInspectLatencyRecord(
+            packet,
+            TL_INSPECT_LATENCY_PROCESS,
+            packet->dequeueTime,
+            batch->injectTime
+            );
+      }
+      else
+      {
+         TLInspectLatencyRecord(
+            packet,
+            TL_INSPECT_LATENCY_INJECT,
+            batch->injectTime,
+            now
+            );
+         TLInspectLatencyRecord(
+            packet,
+            TL_INSPECT_LATENCY_TOTAL,
+            packet->enqueueTime,
+            now
+            );
+      }
+   }
+}
+
+void
+TLInspectLatencyPercentiles(
+   _In_ ULONG type,
+   _In_ ULONG direction,
+   _In_ ULONG stage,
+   _Inout_updates_(TL_INSPECT_LATENCY_BUCKETS) LONG64* merged,
+   _Out_ TL_INSPECT_LATENCY_PERCENTILES* percentiles
+   )
+/* ++
+
+   This function merges the histograms of all processors for the given
+   type, direction and stage into merged, and computes the percentiles.
+
+-- */
+{
+   UINT64 count = 0;
+   UINT64 rank50;
+   UINT64 rank99;
+   UINT64 rank999;
+   UINT64 seen = 0;
+   ULONG processor;
+   ULONG i;
+
+   RtlZeroMemory(merged, TL_INSPECT_LATENCY_BUCKETS * sizeof(LONG64));
+   RtlZeroMemory(percentiles, sizeof(*percentiles));
+
+   for (processor = 0; processor < gLatencyHistogramCount; processor++)
+   {
+      const TL_INSPECT_LATENCY_HISTOGRAM* histogram =
+         &gLatencyHistograms[processor]->histograms[type][direction][stage];
+
+      for (i = 0; i < TL_INSPECT_LATENCY_BUCKETS; i++)
+      {
+         merged[i] += ReadNoFence64(&histogram->buckets[i]);
+      }
+
+      if ((UINT64)histogram->max > percentiles->max)
+      {
+         percentiles->max = (UINT64)histogram->max;
+      }
+   }
+
+   for (i = 0; i < TL_INSPECT_LATENCY_BUCKETS; i++)
+   {
+      count += (UINT64)merged[i];
+   }
+
+   percentiles->count = count;
+
+   if (count == 0)
+   {
+      return;
+   }
+
+   //
+   // Rank of each percentile, rounded up, counting from 1.
+   //
+   rank50 = (count * 500 + 999) / 1000;
+   rank99 = (count * 990 + 999) / 1000;
+   rank999 = (count * 999 + 999) / 1000;
+
+   //
+   // A percentile falls into the first bucket that takes seen to its rank.
+   //
+   for (i = 0; i < TL_INSPECT_LATENCY_BUCKETS; i++)
+   {
+      UINT64 previous = seen;
+      UINT64 limit;
+
+      if (merged[i] == 0)
+      {
+         continue;
+      }
+
+      seen += (UINT64)merged[i];
+      limit = min(TLInspectLatencyBucketLimit(i), percentiles->max);
+
+      if ((previous < rank50) && (seen >= rank50))
+      {
+         percentiles->p50 = limit;
+      }
+      if ((previous < rank99) && (seen >= rank99))
+      {
+         percentiles->p99 = limit;
+      }
+      if (seen >= rank999)
+      {
+         percentiles->p999 = limit;
+         break;
+      }
+   }
+}
+
+NTSTATUS
+TLInspectLatencyQuery(
+   _Out_ TL_INSPECT_LATENCY_INFO* info
+   )
+{
+   LONG64* merged;
+   ULONG type;
+   ULONG direction;
+   ULONG stage;
+
+   RtlZeroMemory(info, sizeof(*info));
+
+   if (gLatencyHistograms == NULL)
+   {
+      return STATUS_DEVICE_NOT_READY;
+   }
+
+   merged = ExAllocatePoolZero(
+              NonPagedPool,
+              TL_INSPECT_LATENCY_BUCKETS * sizeof(LONG64),
+              TL_INSPECT_LATENCY_POOL_TAG
+              );
+   if (merged == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   for (type = 0; type < TL_INSPECT_LATENCY_PACKET_TYPES; type++)
+   {
+      for (direction = 0; direction < TL_INSPECT_LATENCY_DIRECTIONS; direction++)
+      {
+         for (stage = 0; stage < TL_INSPECT_LATENCY_STAGE_MAX; stage++)
+         {
+            TLInspectLatencyPercentiles(
+               type,
+               direction,
+               stage,
+               merged,
+               &info->latency[type][direction][stage]
+               );
+         }
+      }
+   }
+
+   ExFreePoolWithTag(merged, TL_INSPECT_LATENCY_POOL_TAG);
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectLatencyReport(void)
+/* ++
+
+   This function prints, through the debugger, the percentiles of every
+   histogram that recorded at least one latency. Latencies are printed in
+   microseconds.
+
+-- */
+{
+   static const char* typeNames[TL_INSPECT_LATENCY_PACKET_TYPES] =
+   {
+      "connect",
+      "data",
+      "reauth"
+   };
+   static const char* stageNames[TL_INSPECT_LATENCY_STAGE_MAX] =
+   {
+      "queue",
+      "process",
+      "inject",
+      "total"
+   };
+   TL_INSPECT_LATENCY_INFO* info;
+   ULONG type;
+   ULONG direction;
+   ULONG stage;
+
+   info = ExAllocatePoolZero(
+            NonPagedPool,
+            sizeof(TL_INSPECT_LATENCY_INFO),
+            TL_INSPECT_LATENCY_POOL_TAG
+            );
+   if (info == NULL)
+   {
+      return;
+   }
+
+   if (NT_SUCCESS(TLInspectLatencyQuery(info)))
+   {
+      for (type = 0; type < TL_INSPECT_LATENCY_PACKET_TYPES; type++)
+      {
+         for (direction = 0; direction < TL_INSPECT_LATENCY_DIRECTIONS; direction++)
+         {
+            for (stage = 0; stage < TL_INSPECT_LATENCY_STAGE_MAX; stage++)
+            {
+               const TL_INSPECT_LATENCY_PERCENTILES* latency =
+                  &info->latency[type][direction][stage];
+
+               if (latency->count == 0)
+               {
+                  continue;
+               }
+
+               DbgPrint("Inspect latency: %s %s %s: %I64u samples, p50 %I64u us, p99 %I64u us, p999 %I64u us, max %I64u us\n",
+                  typeNames[type],
+                  (direction == FWP_DIRECTION_OUTBOUND) ? "out" : "in",
+                  stageNames[stage],
+                  latency->count,
+                  latency->p50 / 10,
+                  latency->p99 / 10,
+                  latency->p999 / 10,
+                  latency->max / 10
+               );
+            }
+         }
+      }
+   }
+
+   ExFreePoolWithTag(info, TL_INSPECT_LATENCY_POOL_TAG);
+}
@@ -0,0 +1,77 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the latency histograms of the Transport
+   Inspect sample, which measure how long pended packets wait in the
+   queues, in the worker threads and in the injection path.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_LATENCY_H_
+#define _TL_INSPECT_LATENCY_H_
+
+#include "inspectioctl.h"
+
+//
+// The histograms are log-linear: every power of 2 is split into
+// 2^TL_INSPECT_LATENCY_SUB_BUCKET_BITS buckets of equal width, so a
+// bucket spans at most 1/8 of its values. Latencies of
+// 2^TL_INSPECT_LATENCY_MAX_BITS 100ns units (about 1.9 hours) or more go
+// into the last bucket.
+//
+#define TL_INSPECT_LATENCY_SUB_BUCKET_BITS 3
+#define TL_INSPECT_LATENCY_SUB_BUCKETS (1 << TL_INSPECT_LATENCY_SUB_BUCKET_BITS)
+#define TL_INSPECT_LATENCY_MAX_BITS 36
+
+#define TL_INSPECT_LATENCY_BUCKETS \
+   ((TL_INSPECT_LATENCY_MAX_BITS - TL_INSPECT_LATENCY_SUB_BUCKET_BITS + 1) * \
+    TL_INSPECT_LATENCY_SUB_BUCKETS)
+
+__inline
+UINT64
+TLInspectLatencyNow(void)
+{
+   return KeQueryInterruptTimePrecise(NULL);
+}
+
+NTSTATUS
+TLInspectLatencyInitialize(void);
+
+void
+TLInspectLatencyFree(void);
+
+void
+TLInspectLatencyRecord(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ TL_INSPECT_LATENCY_STAGE stage,
+   _In_ UINT64 start,
+   _In_ UINT64 end
+   );
+
+void
+TLInspectLatencyRecordDone(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
+   );
+
+void
+TLInspectLatencyRecordBatch(
+   _In_ const TL_INSPECT_INJECT_BATCH* batch,
+   _In_ TL_INSPECT_LATENCY_STAGE stage
+   );
+
+NTSTATUS
+TLInspectLatencyQuery(
+   _Out_ TL_INSPECT_LATENCY_INFO* info
+   );
+
+void
+TLInspectLatencyReport(void);
+
+#endif // _TL_INSPECT_LATENCY_H_
@@ -0,0 +1,376 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the layer table of the Transport Inspect
+   sample: for each WFP layer the driver classifies at, its address family,
+   its direction and the indexes of the classify values it reads.
+
+   The table is initialized at compile time and indexed by the layer id.
+   Each classifyFn of the driver is bound to a single layer and passes the
+   constant entry of its layer down to the inline functions below, so that
+   the compiler folds the indexes and the address family into the code of
+   each layer (see TL_INSPECT_DEFINE_CLASSIFY in inspect.c). The functions
+   that only have a layer id at hand read the same entries at run time.
+
+   The table and the functions below do not depend on the rest of the
+   driver, so that they can be measured in user mode (see
+   bench\layerbench.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_LAYER_H_
+#define _TL_INSPECT_LAYER_H_
+
+#include "inspectioctl.h"
+
+//
+// Index of a classify value that the layer does not have.
+//
+#define TL_INSPECT_LAYER_NO_FIELD 0xFF
+
+//
+// TL_INSPECT_LAYER describes a layer. addressFamily is AF_UNSPEC at the
+// layers the driver does not classify at. direction is the direction of
+// the packets of the transport and IP packet layers, and of the connection
+// at the ALE layers; function is the TL_INSPECT_CLASSIFY_FUNCTION that
+// handles the layer. The IP packet layers have no 5-tuple or flags index;
+// only the ALE layers have an application id.
+//
+typedef struct TL_INSPECT_LAYER_
+{
+   UINT16 layerId;
+   ADDRESS_FAMILY addressFamily;
+   UINT8 direction;
+   UINT8 function;
+
+   UINT8 localAddress;
+   UINT8 remoteAddress;
+   UINT8 localPort;
+   UINT8 remotePort;
+   UINT8 protocol;
+   UINT8 flags;
+   UINT8 interfaceIndex;
+   UINT8 subInterfaceIndex;
+   UINT8 appId;
+} TL_INSPECT_LAYER;
+
+#define TL_INSPECT_LAYER_TUPLE(layer)                 \
+   FWPS_FIELD_##layer##_IP_LOCAL_ADDRESS,             \
+   FWPS_FIELD_##layer##_IP_REMOTE_ADDRESS,            \
+   FWPS_FIELD_##layer##_IP_LOCAL_PORT,                \
+   FWPS_FIELD_##layer##_IP_REMOTE_PORT,               \
+   FWPS_FIELD_##layer##_IP_PROTOCOL,                  \
+   FWPS_FIELD_##layer##_FLAGS
+
+#define TL_INSPECT_LAYER_INTERFACE(layer)             \
+   FWPS_FIELD_##layer##_INTERFACE_INDEX,              \
+   FWPS_FIELD_##layer##_SUB_INTERFACE_INDEX
+
+#define TL_INSPECT_LAYER_APP_ID(layer)                \
+   FWPS_FIELD_##layer##_ALE_APP_ID
+
+#define TL_INSPECT_LAYER_NO_TUPLE                     \
+   TL_INSPECT_LAYER_NO_FIELD,                         \
+   TL_INSPECT_LAYER_NO_FIELD,                         \
+   TL_INSPECT_LAYER_NO_FIELD,                         \
+   TL_INSPECT_LAYER_NO_FIELD,                         \
+   TL_INSPECT_LAYER_NO_FIELD,                         \
+   TL_INSPECT_LAYER_NO_FIELD
+
+#define TL_INSPECT_LAYER_NO_INTERFACE                 \
+   TL_INSPECT_LAYER_NO_FIELD,                         \
+   TL_INSPECT_LAYER_NO_FIELD
+
+//
+// The definition is visible to every file, and merged by the linker, so
+// that the compiler can read the entries of constant layers.
+//
+DECLSPEC_SELECTANY
+const TL_INSPECT_LAYER gInspectLayers[FWPS_BUILTIN_LAYER_MAX] =
+{
+   [FWPS_LAYER_ALE_AUTH_CONNECT_V4] =
+   {
+      FWPS_LAYER_ALE_AUTH_CONNECT_V4,
+      AF_INET,
+      FWP_DIRECTION_OUTBOUND,
+      TL_INSPECT_CLASSIFY_CONNECT,
+      TL_INSPECT_LAYER_TUPLE(ALE_AUTH_CONNECT_V4),
+      TL_INSPECT_LAYER_INTERFACE(ALE_AUTH_CONNECT_V4),
+      TL_INSPECT_LAYER_APP_ID(ALE_AUTH_CONNECT_V4)
+   },
+   [FWPS_LAYER_ALE_AUTH_CONNECT_V6] =
+   {
+      FWPS_LAYER_ALE_AUTH_CONNECT_V6,
+      AF_INET6,
+      FWP_DIRECTION_OUTBOUND,
+      TL_INSPECT_CLASSIFY_CONNECT,
+      TL_INSPECT_LAYER_TUPLE(ALE_AUTH_CONNECT_V6),
+      TL_INSPECT_LAYER_INTERFACE(ALE_AUTH_CONNECT_V6),
+      TL_INSPECT_LAYER_APP_ID(ALE_AUTH_CONNECT_V6)
+   },
+   [FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4] =
+   {
+      FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V4,
+      AF_INET,
+      FWP_DIRECTION_INBOUND,
+      TL_INSPECT_CLASSIFY_RECV_ACCEPT,
+      TL_INSPECT_LAYER_TUPLE(ALE_AUTH_RECV_ACCEPT_V4),
+      TL_INSPECT_LAYER_INTERFACE(ALE_AUTH_RECV_ACCEPT_V4),
+      TL_INSPECT_LAYER_APP_ID(ALE_AUTH_RECV_ACCEPT_V4)
+   },
+   [FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6] =
+   {
+      FWPS_LAYER_ALE_AUTH_RECV_ACCEPT_V6,
+      AF_INET6,
+      FWP_DIRECTION_INBOUND,
+      TL_INSPECT_CLASSIFY_RECV_ACCEPT,
+      TL_INSPECT_LAYER_TUPLE(ALE_AUTH_RECV_ACCEPT_V6),
+      TL_INSPECT_LAYER_INTERFACE(ALE_AUTH_RECV_ACCEPT_V6),
+      TL_INSPECT_LAYER_APP_ID(ALE_AUTH_RECV_ACCEPT_V6)
+   },
+   [FWPS_LAYER_OUTBOUND_TRANSPORT_V4] =
+   {
+      FWPS_LAYER_OUTBOUND_TRANSPORT_V4,
+      AF_INET,
+      FWP_DIRECTION_OUTBOUND,
+      TL_INSPECT_CLASSIFY_TRANSPORT,
+      TL_INSPECT_LAYER_TUPLE(OUTBOUND_TRANSPORT_V4),
+      TL_INSPECT_LAYER_NO_INTERFACE,
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_OUTBOUND_TRANSPORT_V6] =
+   {
+      FWPS_LAYER_OUTBOUND_TRANSPORT_V6,
+      AF_INET6,
+      FWP_DIRECTION_OUTBOUND,
+      TL_INSPECT_CLASSIFY_TRANSPORT,
+      TL_INSPECT_LAYER_TUPLE(OUTBOUND_TRANSPORT_V6),
+      TL_INSPECT_LAYER_NO_INTERFACE,
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_INBOUND_TRANSPORT_V4] =
+   {
+      FWPS_LAYER_INBOUND_TRANSPORT_V4,
+      AF_INET,
+      FWP_DIRECTION_INBOUND,
+      TL_INSPECT_CLASSIFY_TRANSPORT,
+      TL_INSPECT_LAYER_TUPLE(INBOUND_TRANSPORT_V4),
+      TL_INSPECT_LAYER_INTERFACE(INBOUND_TRANSPORT_V4),
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_INBOUND_TRANSPORT_V6] =
+   {
+      FWPS_LAYER_INBOUND_TRANSPORT_V6,
+      AF_INET6,
+      FWP_DIRECTION_INBOUND,
+      TL_INSPECT_CLASSIFY_TRANSPORT,
+      TL_INSPECT_LAYER_TUPLE(INBOUND_TRANSPORT_V6),
+      TL_INSPECT_LAYER_INTERFACE(INBOUND_TRANSPORT_V6),
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_OUTBOUND_IPPACKET_V4] =
+   {
+      FWPS_LAYER_OUTBOUND_IPPACKET_V4,
+      AF_INET,
+      FWP_DIRECTION_OUTBOUND,
+      TL_INSPECT_CLASSIFY_IP,
+      TL_INSPECT_LAYER_NO_TUPLE,
+      TL_INSPECT_LAYER_NO_INTERFACE,
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_OUTBOUND_IPPACKET_V6] =
+   {
+      FWPS_LAYER_OUTBOUND_IPPACKET_V6,
+      AF_INET6,
+      FWP_DIRECTION_OUTBOUND,
+      TL_INSPECT_CLASSIFY_IP,
+      TL_INSPECT_LAYER_NO_TUPLE,
+      TL_INSPECT_LAYER_NO_INTERFACE,
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_INBOUND_IPPACKET_V4] =
+   {
+      FWPS_LAYER_INBOUND_IPPACKET_V4,
+      AF_INET,
+      FWP_DIRECTION_INBOUND,
+      TL_INSPECT_CLASSIFY_IP,
+      TL_INSPECT_LAYER_NO_TUPLE,
+      TL_INSPECT_LAYER_NO_INTERFACE,
+      TL_INSPECT_LAYER_NO_FIELD
+   },
+   [FWPS_LAYER_INBOUND_IPPACKET_V6] =
+   {
+      FWPS_LAYER_INBOUND_IPPACKET_V6,
+      AF_INET6,
+      FWP_DIRECTION_INBOUND,
+      TL_INSPECT_CLASSIFY_IP,
+      TL_INSPECT_LAYER_NO_TUPLE,
+      TL_INSPECT_LAYER_NO_INTERFACE,
+      TL_INSPECT_LAYER_NO_FIELD
+   }
+};
+
+__forceinline
+const TL_INSPECT_LAYER*
+TLInspectLayerForId(
+   _In_ UINT16 layerId
+   )
+{
+   NT_ASSERT(layerId < FWPS_BUILTIN_LAYER_MAX);
+   NT_ASSERT(gInspectLayers[layerId].addressFamily != AF_UNSPEC);
+
+   return &gInspectLayers[layerId];
+}
+
+__forceinline
+BOOLEAN
+TLInspectLayerHasFlag(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ UINT32 flag
+   )
+{
+   return (layer->flags != TL_INSPECT_LAYER_NO_FIELD) &&
+          ((inFixedValues->incomingValue[layer->flags].value.uint32 & flag) != 0);
+}
+
+__forceinline
+void
+FillNetwork5Tuple(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   NT_ASSERT(layer->localAddress != TL_INSPECT_LAYER_NO_FIELD);
+
+   if (layer->addressFamily == AF_INET)
+   {
+      packet->ipv4LocalAddr =
+         RtlUlongByteSwap( /* host-order -> network-order conversion */
+            inFixedValues->incomingValue[layer->localAddress].value.uint32
+            );
+      packet->ipv4RemoteAddr =
+         RtlUlongByteSwap( /* host-order -> network-order conversion */
+            inFixedValues->incomingValue[layer->remoteAddress].value.uint32
+            );
+   }
+   else
+   {
+      RtlCopyMemory(
+         (UINT8*)&packet->localAddr,
+         inFixedValues->incomingValue[layer->localAddress].value.byteArray16,
+         sizeof(FWP_BYTE_ARRAY16)
+         );
+      RtlCopyMemory(
+         (UINT8*)&packet->remoteAddr,
+         inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16,
+         sizeof(FWP_BYTE_ARRAY16)
+         );
+   }
+
+   packet->localPort =
+      RtlUshortByteSwap(
+         inFixedValues->incomingValue[layer->localPort].value.uint16
+         );
+   packet->remotePort =
+      RtlUshortByteSwap(
+         inFixedValues->incomingValue[layer->remotePort].value.uint16
+         );
+
+   packet->protocol =
+      inFixedValues->incomingValue[layer->protocol].value.uint8;
+}
+
+__forceinline
+BOOLEAN
+IsMatchingConnectPacket(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _In_ FWP_DIRECTION direction,
+   _In_ const TL_INSPECT_PENDED_PACKET* pendedPacket
+   )
+{
+   NT_ASSERT(pendedPacket->type == TL_INSPECT_CONNECT_PACKET);
+
+   if (layer->localAddress == TL_INSPECT_LAYER_NO_FIELD)
+   {
+      return FALSE;
+   }
+
+   if (layer->addressFamily != pendedPacket->addressFamily)
+   {
+      return FALSE;
+   }
+
+   if (direction != pendedPacket->direction)
+   {
+      return FALSE;
+   }
+
+   if (inFixedValues->incomingValue[layer->protocol].value.uint8 !=
+       pendedPacket->protocol)
+   {
+      return FALSE;
+   }
+
+   if (RtlUshortByteSwap(
+         inFixedValues->incomingValue[layer->localPort].value.uint16
+         ) != pendedPacket->localPort)
+   {
+      return FALSE;
+   }
+
+   if (RtlUshortByteSwap(
+         inFixedValues->incomingValue[layer->remotePort].value.uint16
+         ) != pendedPacket->remotePort)
+   {
+      return FALSE;
+   }
+
+   if (layer->addressFamily == AF_INET)
+   {
+      if (RtlUlongByteSwap(
+            inFixedValues->incomingValue[layer->localAddress].value.uint32
+            ) != pendedPacket->ipv4LocalAddr)
+      {
+         return FALSE;
+      }
+
+      if (RtlUlongByteSwap(
+            inFixedValues->incomingValue[layer->remoteAddress].value.uint32
+            ) != pendedPacket->ipv4RemoteAddr)
+      {
+         return FALSE;
+      }
+   }
+   else
+   {
+      if (RtlCompareMemory(
+            inFixedValues->incomingValue[layer->localAddress].value.byteArray16,
+            &pendedPacket->localAddr,
+            sizeof(FWP_BYTE_ARRAY16)) != sizeof(FWP_BYTE_ARRAY16))
+      {
+         return FALSE;
+      }
+
+      if (RtlCompareMemory(
+            inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16,
+            &pendedPacket->remoteAddr,
+            sizeof(FWP_BYTE_ARRAY16)) != sizeof(FWP_BYTE_ARRAY16))
+      {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+#endif // _TL_INSPECT_LAYER_H_
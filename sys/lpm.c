@@ -0,0 +1,624 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the longest-prefix-match tables of the Transport
+   Inspect sample.
+
+   Tables are built once, at PASSIVE_LEVEL, and only looked up afterwards.
+   The node array of an IPv4 trie grows by doubling while prefixes are
+   inserted; a table of n prefixes takes at most one node per prefix and
+   level, and typically much less since prefixes share their upper nodes.
+   IPv6 prefixes are only collected by TLInspectLpmInsert, and sorted and
+   turned into at most 2n + 1 ranges by TLInspectLpmBuild.
+
+   Defining TL_INSPECT_LPM_USER_MODE builds the file for user mode, with
+   the C runtime allocator.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifdef TL_INSPECT_LPM_USER_MODE
+
+#define TLInspectLpmAllocate(size) calloc(1, (size))
+#define TLInspectLpmRelease(memory) free(memory)
+
+#else
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+
+#define TLInspectLpmAllocate(size) \
+   ExAllocatePoolZero(NonPagedPool, (size), TL_INSPECT_PREFIX_POOL_TAG)
+#define TLInspectLpmRelease(memory) \
+   ExFreePoolWithTag((memory), TL_INSPECT_PREFIX_POOL_TAG)
+
+#endif
+
+#include "lpm.h"
+
+BOOLEAN
+TLInspectLpmInitialize(
+   _Out_ TL_INSPECT_LPM_TABLE* table,
+   _In_ UINT32 addressLength
+   )
+/* ++
+
+   This function initializes an empty table for addresses of addressLength
+   bits: 32 or 128. An IPv4 table starts with its root node and room for
+   16 more.
+
+-- */
+{
+   UINT32 capacity = TL_INSPECT_LPM_ROOT_ENTRIES + 16 * TL_INSPECT_LPM_NODE_ENTRIES;
+
+   RtlZeroMemory(table, sizeof(*table));
+
+   table->addressLength = addressLength;
+
+   if (addressLength != 32)
+   {
+      return TRUE;
+   }
+
+   table->entries = TLInspectLpmAllocate(capacity * sizeof(TL_INSPECT_LPM_ENTRY));
+   if (table->entries == NULL)
+   {
+      return FALSE;
+   }
+
+   table->entryCount = TL_INSPECT_LPM_ROOT_ENTRIES;
+   table->entryCapacity = capacity;
+
+   return TRUE;
+}
+
+void
+TLInspectLpmFree(
+   _Inout_ TL_INSPECT_LPM_TABLE* table
+   )
+{
+   if (table->entries != NULL)
+   {
+      TLInspectLpmRelease(table->entries);
+   }
+   if (table->prefixes != NULL)
+   {
+      TLInspectLpmRelease(table->prefixes);
+   }
+   if (table->ranges != NULL)
+   {
+      TLInspectLpmRelease(table->ranges);
+   }
+   if (table->rangeIndex != NULL)
+   {
+      TLInspectLpmRelease(table->rangeIndex);
+   }
+
+   RtlZeroMemory(table, sizeof(*table));
+}
+
+UINT32
+TLInspectLpmAddNode(
+   _Inout_ TL_INSPECT_LPM_TABLE* table
+   )
+/* ++
+
+   Returns the index of the first entry of a new, empty node, or 0 if the
+   node array cannot grow.
+
+-- */
+{
+   UINT32 node;
+
+   if (table->entryCapacity - table->entryCount < TL_INSPECT_LPM_NODE_ENTRIES)
+   {
+      TL_INSPECT_LPM_ENTRY* entries;
+      UINT32 capacity;
+
+      if (table->entryCapacity > MAXUINT32 / 2 / sizeof(TL_INSPECT_LPM_ENTRY))
+      {
+         return 0;
+      }
+
+      capacity = table->entryCapacity * 2;
+
+      entries = TLInspectLpmAllocate((SIZE_T)capacity * sizeof(TL_INSPECT_LPM_ENTRY));
+      if (entries == NULL)
+      {
+         return 0;
+      }
+
+      RtlCopyMemory(
+         entries,
+         table->entries,
+         (SIZE_T)table->entryCount * sizeof(TL_INSPECT_LPM_ENTRY)
+         );
+      TLInspectLpmRelease(table->entries);
+
+      table->entries = entries;
+      table->entryCapacity = capacity;
+   }
+
+   node = table->entryCount;
+   table->entryCount += TL_INSPECT_LPM_NODE_ENTRIES;
+
+   return node;
+}
+
+void
+TLInspectLpmMask(
+   _In_ UINT32 length,
+   _Out_ UINT64* high,
+   _Out_ UINT64* low
+   )
+/* ++
+
+   Returns the mask of a prefix of length bits, out of 128.
+
+-- */
+{
+   *high = (length == 0) ? 0 :
+           (length >= 64) ? ~0ull : ~0ull << (64 - length);
+   *low = (length <= 64) ? 0 : ~0ull << (128 - length);
+}
+
+BOOLEAN
+TLInspectLpmAddPrefix(
+   _Inout_ TL_INSPECT_LPM_TABLE* table,
+   _In_ const UINT8* prefix,
+   _In_ UINT32 length,
+   _In_ UINT16 value
+   )
+/* ++
+
+   Appends an IPv6 prefix to the ones to build, growing their array by
+   doubling.
+
+-- */
+{
+   TL_INSPECT_LPM_PREFIX* entry;
+   UINT64 highMask;
+   UINT64 lowMask;
+
+   if (table->ranges != NULL)
+   {
+      return FALSE;
+   }
+
+   if (table->prefixCount == table->prefixCapacity)
+   {
+      TL_INSPECT_LPM_PREFIX* prefixes;
+      UINT32 capacity = (table->prefixCapacity == 0) ? 64 : table->prefixCapacity * 2;
+
+      if (table->prefixCapacity > MAXUINT32 / 2 / sizeof(TL_INSPECT_LPM_PREFIX))
+      {
+         return FALSE;
+      }
+
+      prefixes = TLInspectLpmAllocate((SIZE_T)capacity * sizeof(TL_INSPECT_LPM_PREFIX));
+      if (prefixes == NULL)
+      {
+         return FALSE;
+      }
+
+      if (table->prefixes != NULL)
+      {
+         RtlCopyMemory(
+            prefixes,
+            table->prefixes,
+            (SIZE_T)table->prefixCount * sizeof(TL_INSPECT_LPM_PREFIX)
+            );
+         TLInspectLpmRelease(table->prefixes);
+      }
+
+      table->prefixes = prefixes;
+      table->prefixCapacity = capacity;
+   }
+
+   TLInspectLpmMask(length, &highMask, &lowMask);
+
+   entry = &table->prefixes[table->prefixCount];
+   entry->high = TLInspectLpmLoad64(prefix) & highMask;
+   entry->low = TLInspectLpmLoad64(prefix + 8) & lowMask;
+   entry->length = length;
+   entry->order = table->prefixCount;
+   entry->value = value;
+
+   table->prefixCount++;
+
+   return TRUE;
+}
+
+BOOLEAN
+TLInspectLpmInsert(
+   _Inout_ TL_INSPECT_LPM_TABLE* table,
+   _In_ const UINT8* prefix,
+   _In_ UINT32 length,
+   _In_ UINT16 value
+   )
+/* ++
+
+   This function adds the prefix of length bits of the address prefix (in
+   network order) with the given value. The prefix is expanded to all the
+   entries of its last node that it covers, unless they are covered by a
+   longer prefix already; inserting a prefix again replaces its value.
+   IPv6 prefixes take effect when the table is built.
+
+-- */
+{
+   UINT32 node = 0;
+   UINT32 start = 0;
+   UINT32 stride = TL_INSPECT_LPM_ROOT_BITS;
+   UINT32 index;
+   UINT32 first;
+   UINT32 count;
+   UINT32 i;
+
+   if (length > table->addressLength)
+   {
+      return FALSE;
+   }
+
+   if (table->addressLength != 32)
+   {
+      return TLInspectLpmAddPrefix(table, prefix, length, value);
+   }
+
+   if (table->entries == NULL)
+   {
+      return FALSE;
+   }
+
+   for (;;)
+   {
+      if (stride == TL_INSPECT_LPM_ROOT_BITS)
+      {
+         index = ((UINT32)prefix[0] << 8) | prefix[1];
+      }
+      else
+      {
+         index = prefix[start / 8];
+      }
+
+      if (length <= start + stride)
+      {
+         break;
+      }
+
+      if (table->entries[node + index].child == 0)
+      {
+         UINT32 child = TLInspectLpmAddNode(table);
+
+         if (child == 0)
+         {
+            return FALSE;
+         }
+
+         table->entries[node + index].child = child;
+      }
+
+      node = table->entries[node + index].child;
+      start += stride;
+      stride = TL_INSPECT_LPM_NODE_BITS;
+   }
+
+   count = 1u << (start + stride - length);
+   first = index & ~(count - 1);
+
+   for (i = first; i < first + count; i++)
+   {
+      TL_INSPECT_LPM_ENTRY* entry = &table->entries[node + i];
+
+      if (entry->match <= length + 1)
+      {
+         entry->match = (UINT8)(length + 1);
+         entry->value = value;
+      }
+   }
+
+   table->prefixCount++;
+
+   return TRUE;
+}
+
+BOOLEAN
+TLInspectLpmPrefixBefore(
+   _In_ const TL_INSPECT_LPM_PREFIX* a,
+   _In_ const TL_INSPECT_LPM_PREFIX* b
+   )
+/* ++
+
+   Orders prefixes by start address, then containing prefixes before the
+   prefixes they contain, then by insertion.
+
+-- */
+{
+   if (a->high != b->high)
+   {
+      return a->high < b->high;
+   }
+   if (a->low != b->low)
+   {
+      return a->low < b->low;
+   }
+   if (a->length != b->length)
+   {
+      return a->length < b->length;
+   }
+   return a->order < b->order;
+}
+
+void
+TLInspectLpmSortPrefixes(
+   _Inout_updates_(count) TL_INSPECT_LPM_PREFIX* prefixes,
+   _In_ UINT32 count
+   )
+/* ++
+
+   Heap sort: in place and without recursion, whatever the input.
+
+-- */
+{
+   TL_INSPECT_LPM_PREFIX swap;
+   UINT32 start = count / 2;
+   UINT32 end = count;
+
+   while (end > 1)
+   {
+      UINT32 root;
+
+      if (start > 0)
+      {
+         start--;
+      }
+      else
+      {
+         end--;
+         swap = prefixes[0];
+         prefixes[0] = prefixes[end];
+         prefixes[end] = swap;
+      }
+
+      root = start;
+
+      for (;;)
+      {
+         UINT32 child = 2 * root + 1;
+
+         if (child >= end)
+         {
+            break;
+         }
+         if ((child + 1 < end) &&
+             TLInspectLpmPrefixBefore(&prefixes[child], &prefixes[child + 1]))
+         {
+            child++;
+         }
+         if (!TLInspectLpmPrefixBefore(&prefixes[root], &prefixes[child]))
+         {
+            break;
+         }
+
+         swap = prefixes[root];
+         prefixes[root] = prefixes[child];
+         prefixes[child] = swap;
+         root = child;
+      }
+   }
+}
+
+void
+TLInspectLpmAddRange(
+   _Inout_ TL_INSPECT_LPM_TABLE* table,
+   _In_ UINT64 high,
+   _In_ UINT64 low,
+   _In_opt_ const TL_INSPECT_LPM_PREFIX* prefix
+   )
+/* ++
+
+   Starts a range at high:low, covered by prefix if not NULL. A range
+   starting at the same address as the last one replaces it.
+
+-- */
+{
+   TL_INSPECT_LPM_RANGE* range = &table->ranges[table->rangeCount];
+
+   if ((table->rangeCount > 0) &&
+       (range[-1].high == high) && (range[-1].low == low))
+   {
+      range--;
+   }
+   else
+   {
+      table->rangeCount++;
+   }
+
+   range->high = high;
+   range->low = low;
+   range->match = (prefix != NULL) ? 1 : 0;
+   range->value = (prefix != NULL) ? prefix->value : 0;
+}
+
+void
+TLInspectLpmClosePrefix(
+   _Inout_ TL_INSPECT_LPM_TABLE* table,
+   _Inout_ UINT32* stack,
+   _Inout_ UINT32* depth
+   )
+/* ++
+
+   Pops the innermost open prefix and starts the range that follows it,
+   covered by the prefix that contains it, if any.
+
+-- */
+{
+   const TL_INSPECT_LPM_PREFIX* prefix = &table->prefixes[stack[--*depth]];
+   UINT64 highMask;
+   UINT64 lowMask;
+   UINT64 high;
+   UINT64 low;
+
+   TLInspectLpmMask(prefix->length, &highMask, &lowMask);
+
+   high = prefix->high | ~highMask;
+   low = prefix->low | ~lowMask;
+
+   //
+   // Nothing follows a prefix that ends the address space.
+   //
+   if ((high == ~0ull) && (low == ~0ull))
+   {
+      return;
+   }
+
+   low++;
+   if (low == 0)
+   {
+      high++;
+   }
+
+   TLInspectLpmAddRange(
+      table,
+      high,
+      low,
+      (*depth > 0) ? &table->prefixes[stack[*depth - 1]] : NULL
+      );
+}
+
+BOOLEAN
+TLInspectLpmBuild(
+   _Inout_ TL_INSPECT_LPM_TABLE* table
+   )
+/* ++
+
+   This function compiles the IPv6 prefixes inserted so far into ranges,
+   after which the table can be looked up but no longer inserted into.
+   Sorted by start address, prefixes either contain the next ones or end
+   before them, so a stack of the open prefixes gives the innermost prefix
+   over each range. An IPv4 table needs no build.
+
+-- */
+{
+   UINT32 stack[129];
+   UINT32 depth = 0;
+   UINT32 block;
+   UINT32 i;
+   UINT32 j;
+
+   if ((table->addressLength == 32) || (table->ranges != NULL))
+   {
+      return TRUE;
+   }
+
+   table->ranges = TLInspectLpmAllocate(
+                      ((SIZE_T)table->prefixCount * 2 + 1) * sizeof(TL_INSPECT_LPM_RANGE)
+                      );
+   table->rangeIndex = TLInspectLpmAllocate(
+                          (TL_INSPECT_LPM_ROOT_ENTRIES + 1) * sizeof(UINT32)
+                          );
+   if ((table->ranges == NULL) || (table->rangeIndex == NULL))
+   {
+      goto Exit;
+   }
+
+   TLInspectLpmSortPrefixes(table->prefixes, table->prefixCount);
+
+   TLInspectLpmAddRange(table, 0, 0, NULL);
+
+   for (i = 0; i < table->prefixCount; i++)
+   {
+      const TL_INSPECT_LPM_PREFIX* prefix = &table->prefixes[i];
+
+      while (depth > 0)
+      {
+         const TL_INSPECT_LPM_PREFIX* open = &table->prefixes[stack[depth - 1]];
+         UINT64 highMask;
+         UINT64 lowMask;
+
+         TLInspectLpmMask(open->length, &highMask, &lowMask);
+
+         if (((prefix->high & highMask) == open->high) &&
+             ((prefix->low & lowMask) == open->low))
+         {
+            break;
+         }
+
+         TLInspectLpmClosePrefix(table, stack, &depth);
+      }
+
+      //
+      // The same prefix inserted again replaces the open one.
+      //
+      if ((depth > 0) &&
+          (table->prefixes[stack[depth - 1]].length == prefix->length))
+      {
+         depth--;
+      }
+
+      TLInspectLpmAddRange(table, prefix->high, prefix->low, prefix);
+      stack[depth++] = i;
+   }
+
+   while (depth > 0)
+   {
+      TLInspectLpmClosePrefix(table, stack, &depth);
+   }
+
+   //
+   // Merge the ranges that continue the previous one.
+   //
+   for (i = 1, j = 1; i < table->rangeCount; i++)
+   {
+      if ((table->ranges[i].match != table->ranges[j - 1].match) ||
+          (table->ranges[i].value != table->ranges[j - 1].value))
+      {
+         table->ranges[j++] = table->ranges[i];
+      }
+   }
+   table->rangeCount = j;
+
+   for (block = 0, i = 0; block <= TL_INSPECT_LPM_ROOT_ENTRIES; block++)
+   {
+      while ((i < table->rangeCount) &&
+             ((UINT32)(table->ranges[i].high >> 48) < block))
+      {
+         i++;
+      }
+      table->rangeIndex[block] = i;
+   }
+
+   TLInspectLpmRelease(table->prefixes);
+   table->prefixes = NULL;
+   table->prefixCapacity = 0;
+
+   return TRUE;
+
+Exit:
+
+   if (table->ranges != NULL)
+   {
+      TLInspectLpmRelease(table->ranges);
+      table->ranges = NULL;
+   }
+   if (table->rangeIndex != NULL)
+   {
+      TLInspectLpmRelease(table->rangeIndex);
+      table->rangeIndex = NULL;
+   }
+
+   return FALSE;
+}
@@ -0,0 +1,249 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the longest-prefix-match tables of the
+   Transport Inspect sample.
+
+   IPv4 tables are multibit tries with a 16-bit root stride and 8-bit
+   strides below it, in which each prefix is expanded to the entries of the
+   node its length ends in; a lookup reads at most 3 entries.
+
+   IPv6 prefixes are too sparse for such a trie, which would take a few
+   mostly empty nodes per prefix. They are compiled instead into the sorted
+   list of the address ranges over which the longest matching prefix does
+   not change, indexed by the first 16 bits of their start; a lookup is a
+   binary search among the ranges that start within those 16 bits.
+
+   The tables do not depend on WFP, so that they can be built and measured
+   in user mode (see bench\lpmbench.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_LPM_H_
+#define _TL_INSPECT_LPM_H_
+
+#define TL_INSPECT_LPM_ROOT_BITS 16
+#define TL_INSPECT_LPM_NODE_BITS 8
+
+#define TL_INSPECT_LPM_ROOT_ENTRIES (1 << TL_INSPECT_LPM_ROOT_BITS)
+#define TL_INSPECT_LPM_NODE_ENTRIES (1 << TL_INSPECT_LPM_NODE_BITS)
+
+//
+// TL_INSPECT_LPM_ENTRY is one slot of a trie node. child is the index of
+// the first entry of the node that indexes the next address bits, or 0 if
+// no longer prefix goes through the slot. match is the length of the
+// longest prefix of this node that covers the slot, plus 1, or 0 if there
+// is none; value is the value of that prefix.
+//
+typedef struct TL_INSPECT_LPM_ENTRY_
+{
+   UINT32 child;
+   UINT16 value;
+   UINT8 match;
+   UINT8 reserved;
+} TL_INSPECT_LPM_ENTRY;
+
+//
+// TL_INSPECT_LPM_PREFIX is an IPv6 prefix waiting for TLInspectLpmBuild.
+// The address is held as two host-order halves; order is the rank of the
+// insertion, so that the last of two identical prefixes wins.
+//
+typedef struct TL_INSPECT_LPM_PREFIX_
+{
+   UINT64 high;
+   UINT64 low;
+   UINT32 length;
+   UINT32 order;
+   UINT16 value;
+} TL_INSPECT_LPM_PREFIX;
+
+//
+// TL_INSPECT_LPM_RANGE starts at the address high:low and ends where the
+// next range starts. match is 1 if a prefix covers the range, in which
+// case value is the value of the longest one.
+//
+typedef struct TL_INSPECT_LPM_RANGE_
+{
+   UINT64 high;
+   UINT64 low;
+   UINT16 value;
+   UINT8 match;
+   UINT8 reserved[5];
+} TL_INSPECT_LPM_RANGE;
+
+//
+// TL_INSPECT_LPM_TABLE is a table for addresses of addressLength bits,
+// 32 or 128. The IPv4 trie holds its nodes in a single array whose first
+// TL_INSPECT_LPM_ROOT_ENTRIES entries are the root node. The ranges of
+// an IPv6 table starting with the 16 bits i are ranges[rangeIndex[i]] to
+// ranges[rangeIndex[i + 1] - 1]; ranges[0] starts at ::.
+//
+// A table matches nothing until it is built, and must not be modified
+// while it is looked up.
+//
+typedef struct TL_INSPECT_LPM_TABLE_
+{
+   UINT32 addressLength; // in bits
+   UINT32 prefixCount;
+
+   TL_INSPECT_LPM_ENTRY* entries;
+   UINT32 entryCount;
+   UINT32 entryCapacity;
+
+   TL_INSPECT_LPM_PREFIX* prefixes;
+   UINT32 prefixCapacity;
+
+   TL_INSPECT_LPM_RANGE* ranges;
+   UINT32 rangeCount;
+   UINT32* rangeIndex;
+} TL_INSPECT_LPM_TABLE;
+
+BOOLEAN
+TLInspectLpmInitialize(
+   _Out_ TL_INSPECT_LPM_TABLE* table,
+   _In_ UINT32 addressLength
+   );
+
+void
+TLInspectLpmFree(
+   _Inout_ TL_INSPECT_LPM_TABLE* table
+   );
+
+BOOLEAN
+TLInspectLpmInsert(
+   _Inout_ TL_INSPECT_LPM_TABLE* table,
+   _In_ const UINT8* prefix,
+   _In_ UINT32 length,
+   _In_ UINT16 value
+   );
+
+BOOLEAN
+TLInspectLpmBuild(
+   _Inout_ TL_INSPECT_LPM_TABLE* table
+   );
+
+__inline
+UINT64
+TLInspectLpmLoad64(
+   _In_reads_bytes_(8) const UINT8* bytes
+   )
+{
+   return ((UINT64)bytes[0] << 56) | ((UINT64)bytes[1] << 48) |
+          ((UINT64)bytes[2] << 40) | ((UINT64)bytes[3] << 32) |
+          ((UINT64)bytes[4] << 24) | ((UINT64)bytes[5] << 16) |
+          ((UINT64)bytes[6] << 8) | (UINT64)bytes[7];
+}
+
+__inline
+BOOLEAN
+TLInspectLpmLookupRange(
+   _In_ const TL_INSPECT_LPM_TABLE* table,
+   _In_reads_bytes_(16) const UINT8* address,
+   _Out_ UINT16* value
+   )
+{
+   const TL_INSPECT_LPM_RANGE* range;
+   UINT64 high = TLInspectLpmLoad64(address);
+   UINT64 low = TLInspectLpmLoad64(address + 8);
+   UINT32 block = (UINT32)(high >> 48);
+   UINT32 first = table->rangeIndex[block];
+   UINT32 last = table->rangeIndex[block + 1];
+
+   //
+   // Find the first range of the block that starts after the address; the
+   // address is in the range before it, which may start in an earlier
+   // block.
+   //
+   while (first < last)
+   {
+      UINT32 middle = first + (last - first) / 2;
+
+      range = &table->ranges[middle];
+
+      if ((range->high < high) ||
+          ((range->high == high) && (range->low <= low)))
+      {
+         first = middle + 1;
+      }
+      else
+      {
+         last = middle;
+      }
+   }
+
+   range = &table->ranges[first - 1];
+
+   if (range->match == 0)
+   {
+      return FALSE;
+   }
+
+   *value = range->value;
+
+   return TRUE;
+}
+
+__inline
+BOOLEAN
+TLInspectLpmLookup(
+   _In_ const TL_INSPECT_LPM_TABLE* table,
+   _In_ const UINT8* address,
+   _Out_ UINT16* value
+   )
+/* ++
+
+   Returns TRUE, and the value of the longest prefix that covers the
+   address (in network order), if there is one. In the trie, the entries
+   met on the way down belong to ever longer prefixes, so the last match
+   wins.
+
+-- */
+{
+   const TL_INSPECT_LPM_ENTRY* entry;
+   UINT32 next = TL_INSPECT_LPM_ROOT_BITS / 8;
+   BOOLEAN found = FALSE;
+
+   if (table->addressLength != 32)
+   {
+      if (table->ranges == NULL)
+      {
+         return FALSE;
+      }
+
+      return TLInspectLpmLookupRange(table, address, value);
+   }
+
+   if (table->entries == NULL)
+   {
+      return FALSE;
+   }
+
+   entry = &table->entries[((UINT32)address[0] << 8) | address[1]];
+
+   for (;;)
+   {
+      if (entry->match != 0)
+      {
+         *value = entry->value;
+         found = TRUE;
+      }
+
+      if (entry->child == 0)
+      {
+         break;
+      }
+
+      entry = &table->entries[entry->child + address[next++]];
+   }
+
+   return found;
+}
+
+#endif // _TL_INSPECT_LPM_H_
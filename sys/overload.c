@@ -0,0 +1,177 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the overload control of the Transport Inspect
+   sample.
+
+   A pended packet is charged its own size, its control data and the data
+   of its net buffer list, which stays referenced until the packet is
+   freed. The charge is added to the memory of all pended packets when the
+   packet is allocated, to the bytes of a packet queue while it is queued,
+   and is released when the packet is freed.
+
+   The samples are read without synchronization; a limit may be exceeded by
+   the packets of the classifies that sampled the load at the same time.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "queue.h"
+#include "stats.h"
+#include "overload.h"
+
+TL_INSPECT_OVERLOAD gOverload;
+
+void
+TLInspectOverloadInitialize(
+   _In_ const TL_INSPECT_OVERLOAD_LIMITS* limits
+   )
+{
+   gOverload.limits = *limits;
+   gOverload.memory = 0;
+}
+
+__inline
+ULONG
+TLInspectOverloadBytes(
+   _In_opt_ const NET_BUFFER_LIST* netBufferList,
+   _In_ ULONG controlDataLength
+   )
+{
+   ULONG bytes = sizeof(TL_INSPECT_PENDED_PACKET) + controlDataLength;
+
+   if (netBufferList != NULL)
+   {
+      bytes += NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(netBufferList));
+   }
+
+   return bytes;
+}
+
+BOOLEAN
+TLInspectOverloadAdmitPacket(
+   _In_ ULONG flowHash,
+   _In_opt_ const NET_BUFFER_LIST* netBufferList,
+   _Out_ TL_INSPECT_OVERLOAD_REASON* reason
+   )
+/* ++
+
+   This function tells whether a packet may be queued to the shard of its
+   flow, given the hash of the flow.
+
+-- */
+{
+   TL_INSPECT_OVERLOAD_SAMPLE sample;
+   const TL_INSPECT_PACKET_QUEUE* queue = TLInspectQueueForFlow(flowHash);
+
+   sample.connect = FALSE;
+   sample.depth = ReadNoFence(&queue->depth);
+   sample.queueBytes = ReadNoFence64(&queue->bytes);
+   sample.delay = (UINT64)ReadNoFence64(&queue->delay);
+   sample.memory = ReadNoFence64(&gOverload.memory);
+   sample.bytes = TLInspectOverloadBytes(netBufferList, 0);
+
+   return TLInspectOverloadAdmit(&gOverload.limits, &sample, reason);
+}
+
+BOOLEAN
+TLInspectOverloadAdmitConnect(
+   _In_opt_ const NET_BUFFER_LIST* netBufferList,
+   _Out_ TL_INSPECT_OVERLOAD_REASON* reason
+   )
+/* ++
+
+   This function tells whether a connect may be pended to the connection
+   list.
+
+-- */
+{
+   TL_INSPECT_OVERLOAD_SAMPLE sample;
+
+   RtlZeroMemory(&sample, sizeof(sample));
+
+   sample.connect = TRUE;
+   sample.depth = ReadNoFence(&gStats.connListDepth);
+   sample.memory = ReadNoFence64(&gOverload.memory);
+   sample.bytes = TLInspectOverloadBytes(netBufferList, 0);
+
+   return TLInspectOverloadAdmit(&gOverload.limits, &sample, reason);
+}
+
+void
+TLInspectOverloadShed(
+   _In_ TL_INSPECT_OVERLOAD_REASON reason,
+   _In_ BOOLEAN connect,
+   _In_ const FWPS_FILTER* filter,
+   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
+   )
+/* ++
+
+   This function decides a classify that was not admitted, according to
+   the configured failure policy, and counts it.
+
+-- */
+{
+   TLInspectStatsIncrement(overload.shed[reason]);
+
+   if (connect)
+   {
+      TLInspectStatsIncrement(overload.connects);
+   }
+   else
+   {
+      TLInspectStatsIncrement(overload.packets);
+   }
+
+   if (gOverload.limits.failOpen)
+   {
+      classifyOut->actionType = FWP_ACTION_PERMIT;
+      if (filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)
+      {
+         classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+      }
+   }
+   else
+   {
+      classifyOut->actionType = FWP_ACTION_BLOCK;
+      classifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+   }
+}
+
+void
+TLInspectOverloadCharge(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   This function charges a newly allocated packet against the memory
+   budget; the charge is released by TLInspectOverloadRelease when the
+   packet is freed.
+
+-- */
+{
+   NT_ASSERT(packet->overloadBytes == 0);
+
+   packet->overloadBytes = TLInspectOverloadBytes(
+                              packet->netBufferList,
+                              packet->controlDataLength
+                              );
+
+   InterlockedAdd64(&gOverload.memory, packet->overloadBytes);
+}
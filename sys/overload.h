@@ -0,0 +1,189 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the overload control of the Transport Inspect
+   sample, which bounds the work pended for the worker threads.
+
+   Before pending a packet, the classify functions sample the packet queue
+   of its flow, or the connection list for the initial authorization
+   of a connection, along with the memory held by all pended packets. If
+   pending would exceed one of the configured limits, the classify decides
+   inline instead, permitting the traffic if the control fails open and
+   blocking it if it fails closed, and counts the limit exceeded.
+
+   The delay of a queue is the time the last packet dequeued from it
+   waited, as measured by the worker; it is only held against a queue that
+   is not empty. A worker that stops dequeuing altogether is caught by the
+   depth and bytes limits instead.
+
+   The admission decision does not depend on WFP, so that it can be run
+   in user mode (see bench\overloadbench.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_OVERLOAD_H_
+#define _TL_INSPECT_OVERLOAD_H_
+
+#include "inspectioctl.h"
+
+//
+// TL_INSPECT_OVERLOAD_LIMITS holds the limits; a limit of 0 is not
+// enforced. queueDepth and queueBytes bound each packet queue, and
+// pendedConnects the connection list. memory bounds the memory, in bytes,
+// of all pended packets, counted with the data of their net buffer list.
+// queueDelay, in 100ns units, is the delay beyond which a queue takes no
+// more packets.
+//
+typedef struct TL_INSPECT_OVERLOAD_LIMITS_
+{
+   LONG queueDepth;
+   LONG pendedConnects;
+   LONG64 queueBytes;
+   LONG64 memory;
+   UINT64 queueDelay;
+   BOOLEAN failOpen;
+} TL_INSPECT_OVERLOAD_LIMITS;
+
+//
+// TL_INSPECT_OVERLOAD_SAMPLE is the load a classify would add to. depth,
+// queueBytes and delay are those of the packet queue of the flow, or
+// depth is the number of pended connects when connect is TRUE. bytes is
+// the memory the new packet would hold.
+//
+typedef struct TL_INSPECT_OVERLOAD_SAMPLE_
+{
+   BOOLEAN connect;
+   LONG depth;
+   LONG64 queueBytes;
+   UINT64 delay;
+   LONG64 memory;
+   ULONG bytes;
+} TL_INSPECT_OVERLOAD_SAMPLE;
+
+__inline
+BOOLEAN
+TLInspectOverloadAdmit(
+   _In_ const TL_INSPECT_OVERLOAD_LIMITS* limits,
+   _In_ const TL_INSPECT_OVERLOAD_SAMPLE* sample,
+   _Out_ TL_INSPECT_OVERLOAD_REASON* reason
+   )
+/* ++
+
+   Returns TRUE if the packet may be pended; otherwise returns FALSE and
+   the first limit it would exceed.
+
+-- */
+{
+   if (sample->connect)
+   {
+      if ((limits->pendedConnects != 0) &&
+          (sample->depth >= limits->pendedConnects))
+      {
+         *reason = TL_INSPECT_OVERLOAD_CONNECTS;
+         return FALSE;
+      }
+   }
+   else
+   {
+      if ((limits->queueDepth != 0) &&
+          (sample->depth >= limits->queueDepth))
+      {
+         *reason = TL_INSPECT_OVERLOAD_QUEUE_DEPTH;
+         return FALSE;
+      }
+
+      if ((limits->queueBytes != 0) &&
+          (sample->queueBytes + (LONG64)sample->bytes > limits->queueBytes))
+      {
+         *reason = TL_INSPECT_OVERLOAD_QUEUE_BYTES;
+         return FALSE;
+      }
+
+      if ((limits->queueDelay != 0) &&
+          (sample->depth > 0) &&
+          (sample->delay > limits->queueDelay))
+      {
+         *reason = TL_INSPECT_OVERLOAD_QUEUE_DELAY;
+         return FALSE;
+      }
+   }
+
+   if ((limits->memory != 0) &&
+       (sample->memory + (LONG64)sample->bytes > limits->memory))
+   {
+      *reason = TL_INSPECT_OVERLOAD_MEMORY;
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+#ifndef TL_INSPECT_OVERLOAD_USER_MODE
+
+//
+// TL_INSPECT_OVERLOAD holds the limits and the memory held by the pended
+// packets, which is updated with interlocked operations from any
+// processor.
+//
+typedef struct TL_INSPECT_OVERLOAD_
+{
+   TL_INSPECT_OVERLOAD_LIMITS limits;
+   DECLSPEC_CACHEALIGN volatile LONG64 memory;
+} TL_INSPECT_OVERLOAD;
+
+extern TL_INSPECT_OVERLOAD gOverload;
+
+void
+TLInspectOverloadInitialize(
+   _In_ const TL_INSPECT_OVERLOAD_LIMITS* limits
+   );
+
+BOOLEAN
+TLInspectOverloadAdmitPacket(
+   _In_ ULONG flowHash,
+   _In_opt_ const NET_BUFFER_LIST* netBufferList,
+   _Out_ TL_INSPECT_OVERLOAD_REASON* reason
+   );
+
+BOOLEAN
+TLInspectOverloadAdmitConnect(
+   _In_opt_ const NET_BUFFER_LIST* netBufferList,
+   _Out_ TL_INSPECT_OVERLOAD_REASON* reason
+   );
+
+void
+TLInspectOverloadShed(
+   _In_ TL_INSPECT_OVERLOAD_REASON reason,
+   _In_ BOOLEAN connect,
+   _In_ const FWPS_FILTER* filter,
+   _Inout_ FWPS_CLASSIFY_OUT* classifyOut
+   );
+
+void
+TLInspectOverloadCharge(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   );
+
+__inline
+void
+TLInspectOverloadRelease(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+{
+   if (packet->overloadBytes != 0)
+   {
+      InterlockedAdd64(&gOverload.memory, -(LONG64)packet->overloadBytes);
+      packet->overloadBytes = 0;
+   }
+}
+
+#endif // TL_INSPECT_OVERLOAD_USER_MODE
+
+#endif // _TL_INSPECT_OVERLOAD_H_
@@ -0,0 +1,287 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the IP and transport header parsers of the
+   Transport Inspect sample. The parsers validate the header lengths
+   against the data that is actually present, so a truncated or malformed
+   packet makes them fail instead of reading past the buffer.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "parse.h"
+
+BOOLEAN
+TLInspectParseIpv4Header(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Inout_ TL_INSPECT_PACKET_INFO* info
+   )
+{
+   const IPV4HDR* header;
+   ULONG headerLength;
+   ULONG totalLength;
+   UINT16 fragment;
+
+   header = TLInspectCursorPeek(cursor, sizeof(IPV4HDR));
+
+   if ((header == NULL) || (header->Version != 4) || (header->Ihl < 5))
+   {
+      return FALSE;
+   }
+
+   headerLength = header->Ihl * 4;
+   totalLength = RtlUshortByteSwap(header->TotLen);
+   fragment = RtlUshortByteSwap(header->FragOff);
+
+   if (totalLength < headerLength)
+   {
+      return FALSE;
+   }
+
+   info->protocol = header->Protocol;
+   info->ipHeaderLength = headerLength;
+   info->isFragment = ((fragment & TL_INSPECT_IPV4_MORE_FRAGMENTS) != 0) ||
+                      ((fragment & TL_INSPECT_IPV4_FRAGMENT_OFFSET_MASK) != 0);
+   info->fragmentOffset =
+      (UINT16)((fragment & TL_INSPECT_IPV4_FRAGMENT_OFFSET_MASK) * 8);
+
+   RtlCopyMemory(&info->sourceAddress, &header->Saddr, sizeof(UINT32));
+   RtlCopyMemory(&info->destinationAddress, &header->Daddr, sizeof(UINT32));
+
+   if (!TLInspectCursorAdvance(cursor, headerLength))
+   {
+      return FALSE;
+   }
+
+   info->payloadLength = min(totalLength - headerLength,
+                             TLInspectCursorRemaining(cursor));
+
+   return TRUE;
+}
+
+__inline
+BOOLEAN
+TLInspectIsIpv6ExtensionHeader(
+   _In_ UINT8 nextHeader
+   )
+{
+   return (nextHeader == IPPROTO_HOPOPTS) ||
+          (nextHeader == IPPROTO_ROUTING) ||
+          (nextHeader == IPPROTO_FRAGMENT) ||
+          (nextHeader == IPPROTO_DSTOPTS);
+}
+
+BOOLEAN
+TLInspectParseIpv6ExtensionHeaders(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Inout_ TL_INSPECT_PACKET_INFO* info
+   )
+/* ++
+
+   This function walks the hop-by-hop, routing, fragment and destination
+   options headers that follow the fixed IPv6 header, and leaves the cursor
+   at the upper-layer header. The walk stops at the first other next header
+   value, or at the fragment header of a fragment that is not the first
+   one, since what follows it is not a header.
+
+   At most TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS headers are walked; a longer
+   chain fails the parse.
+
+-- */
+{
+   UINT count = 0;
+
+   while (TLInspectIsIpv6ExtensionHeader(info->protocol))
+   {
+      ULONG headerLength;
+
+      if (count++ == TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS)
+      {
+         return FALSE;
+      }
+
+      if (info->protocol == IPPROTO_FRAGMENT)
+      {
+         const IPV6FRAGHDR* header =
+            TLInspectCursorPeek(cursor, sizeof(IPV6FRAGHDR));
+         UINT16 fragment;
+
+         if (header == NULL)
+         {
+            return FALSE;
+         }
+
+         fragment = RtlUshortByteSwap(header->FragOff);
+
+         info->protocol = header->Nexthdr;
+         info->isFragment = TRUE;
+         info->fragmentOffset =
+            fragment & TL_INSPECT_IPV6_FRAGMENT_OFFSET_MASK;
+         headerLength = sizeof(IPV6FRAGHDR);
+      }
+      else
+      {
+         const IPV6EXTHDR* header =
+            TLInspectCursorPeek(cursor, sizeof(IPV6EXTHDR));
+
+         if (header == NULL)
+         {
+            return FALSE;
+         }
+
+         info->protocol = header->Nexthdr;
+         headerLength = (header->Length + 1) * 8;
+      }
+
+      if ((headerLength > info->payloadLength) ||
+          !TLInspectCursorAdvance(cursor, headerLength))
+      {
+         return FALSE;
+      }
+
+      info->ipHeaderLength += headerLength;
+      info->payloadLength -= headerLength;
+
+      if (info->fragmentOffset != 0)
+      {
+         break;
+      }
+   }
+
+   return TRUE;
+}
+
+BOOLEAN
+TLInspectParseIpv6Header(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Inout_ TL_INSPECT_PACKET_INFO* info
+   )
+{
+   const IPV6HDR* header;
+
+   header = TLInspectCursorPeek(cursor, sizeof(IPV6HDR));
+
+   if ((header == NULL) || (header->Version != 6))
+   {
+      return FALSE;
+   }
+
+   info->protocol = header->Nexthdr;
+   info->ipHeaderLength = sizeof(IPV6HDR);
+
+   RtlCopyMemory(&info->sourceAddress, &header->Saddr, sizeof(IN6_ADDR));
+   RtlCopyMemory(&info->destinationAddress, &header->Daddr, sizeof(IN6_ADDR));
+
+   info->payloadLength = RtlUshortByteSwap(header->PayloadLen);
+
+   TLInspectCursorAdvance(cursor, sizeof(IPV6HDR));
+
+   info->payloadLength = min(info->payloadLength,
+                             TLInspectCursorRemaining(cursor));
+
+   return TLInspectParseIpv6ExtensionHeaders(cursor, info);
+}
+
+BOOLEAN
+TLInspectParseIpHeader(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _Out_ TL_INSPECT_PACKET_INFO* info
+   )
+/* ++
+
+   This function parses the IP header at the cursor and leaves the cursor
+   at the transport header.
+
+-- */
+{
+   RtlZeroMemory(info, sizeof(*info));
+
+   info->addressFamily = addressFamily;
+
+   if (addressFamily == AF_INET)
+   {
+      return TLInspectParseIpv4Header(cursor, info);
+   }
+   else if (addressFamily == AF_INET6)
+   {
+      return TLInspectParseIpv6Header(cursor, info);
+   }
+
+   return FALSE;
+}
+
+BOOLEAN
+TLInspectParseTransportHeader(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Inout_ TL_INSPECT_PACKET_INFO* info
+   )
+/* ++
+
+   This function parses the TCP or UDP header at the cursor, according to
+   info->protocol, and leaves the cursor at the payload. Other protocols,
+   and fragments that do not carry the transport header, are left alone.
+
+-- */
+{
+   if (info->fragmentOffset != 0)
+   {
+      return TRUE;
+   }
+
+   if (info->protocol == IPPROTO_TCP)
+   {
+      const TCPHDR* header = TLInspectCursorPeek(cursor, sizeof(TCPHDR));
+
+      if ((header == NULL) || (header->Doff < 5))
+      {
+         return FALSE;
+      }
+
+      info->sourcePort = RtlUshortByteSwap(header->Source);
+      info->destinationPort = RtlUshortByteSwap(header->Dest);
+      info->tcpFlags = header->Flags;
+      info->transportHeaderLength = header->Doff * 4;
+   }
+   else if (info->protocol == IPPROTO_UDP)
+   {
+      const UDPHDR* header = TLInspectCursorPeek(cursor, sizeof(UDPHDR));
+
+      if (header == NULL)
+      {
+         return FALSE;
+      }
+
+      info->sourcePort = RtlUshortByteSwap(header->Source);
+      info->destinationPort = RtlUshortByteSwap(header->Dest);
+      info->transportHeaderLength = sizeof(UDPHDR);
+   }
+   else
+   {
+      return TRUE;
+   }
+
+   if (!TLInspectCursorAdvance(cursor, info->transportHeaderLength))
+   {
+      return FALSE;
+   }
+
+   info->payloadLength = TLInspectCursorRemaining(cursor);
+
+   return TRUE;
+}
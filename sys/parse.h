@@ -0,0 +1,157 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the IP and transport header layouts and the
+   parsers that read them through a TL_INSPECT_CURSOR.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_PARSE_H_
+#define _TL_INSPECT_PARSE_H_
+
+#include "cursor.h"
+
+/*from: wireguard-nt\driver\arithmetic.h */
+typedef  UINT16 UINT16_BE;
+typedef  UINT16 UINT16_LE;
+typedef  UINT32 UINT32_BE;
+typedef  UINT32 UINT32_LE;
+typedef  UINT64 UINT64_BE;
+typedef  UINT64 UINT64_LE;
+
+/*from: wireguard-nt\driver\messages.h */
+typedef struct _IPV4HDR
+{
+#if REG_DWORD == REG_DWORD_LITTLE_ENDIAN
+   UINT8 Ihl : 4, Version : 4;
+#elif REG_DWORD == REG_DWORD_BIG_ENDIAN
+   UINT8 Version : 4, Ihl : 4;
+#endif
+   UINT8 Tos;
+   UINT16_BE TotLen;
+   UINT16_BE Id;
+   UINT16_BE FragOff;
+   UINT8 Ttl;
+   UINT8 Protocol;
+   UINT16_BE Check;
+   UINT32_BE Saddr;
+   UINT32_BE Daddr;
+} IPV4HDR;
+
+typedef struct _IPV6HDR
+{
+#if REG_DWORD == REG_DWORD_LITTLE_ENDIAN
+   UINT8 Priority : 4, Version : 4;
+#elif REG_DWORD == REG_DWORD_BIG_ENDIAN
+   UINT8 Version : 4, Priority : 4;
+#endif
+   UINT8 FlowLbl[3];
+   UINT16_BE PayloadLen;
+   UINT8 Nexthdr;
+   UINT8 HopLimit;
+   IN6_ADDR Saddr;
+   IN6_ADDR Daddr;
+} IPV6HDR;
+
+//
+// Common prefix of the hop-by-hop, routing and destination options headers.
+// Their length is in 8-octet units, not counting the first 8 octets.
+//
+typedef struct _IPV6EXTHDR
+{
+   UINT8 Nexthdr;
+   UINT8 Length;
+} IPV6EXTHDR;
+
+typedef struct _IPV6FRAGHDR
+{
+   UINT8 Nexthdr;
+   UINT8 Reserved;
+   UINT16_BE FragOff;
+   UINT32_BE Id;
+} IPV6FRAGHDR;
+
+typedef struct _TCPHDR
+{
+   UINT16_BE Source;
+   UINT16_BE Dest;
+   UINT32_BE Seq;
+   UINT32_BE AckSeq;
+#if REG_DWORD == REG_DWORD_LITTLE_ENDIAN
+   UINT8 Reserved : 4, Doff : 4;
+#elif REG_DWORD == REG_DWORD_BIG_ENDIAN
+   UINT8 Doff : 4, Reserved : 4;
+#endif
+   UINT8 Flags;
+   UINT16_BE Window;
+   UINT16_BE Check;
+   UINT16_BE UrgPtr;
+} TCPHDR;
+
+typedef struct _UDPHDR
+{
+   UINT16_BE Source;
+   UINT16_BE Dest;
+   UINT16_BE Len;
+   UINT16_BE Check;
+} UDPHDR;
+
+#define TL_INSPECT_IPV4_MORE_FRAGMENTS 0x2000
+#define TL_INSPECT_IPV4_FRAGMENT_OFFSET_MASK 0x1fff
+
+#define TL_INSPECT_IPV6_MORE_FRAGMENTS 0x0001
+#define TL_INSPECT_IPV6_FRAGMENT_OFFSET_MASK 0xfff8
+
+//
+// Upper bound on the number of IPv6 extension headers walked before the
+// packet is given up on. Legitimate packets carry a handful at most; the
+// bound keeps a crafted chain from costing more than a few header reads.
+//
+#define TL_INSPECT_IPV6_MAX_EXTENSION_HEADERS 8
+
+//
+// TL_INSPECT_PACKET_INFO receives the fields extracted by the parsers.
+// Ports are in host order; addresses are kept as they appear on the wire.
+// For IPv6, protocol is the upper-layer protocol found past the extension
+// headers, and ipHeaderLength includes those headers.
+//
+typedef struct TL_INSPECT_PACKET_INFO_
+{
+   ADDRESS_FAMILY addressFamily;
+   UINT8 protocol;
+   BOOLEAN isFragment;
+   UINT16 fragmentOffset;
+
+   FWP_BYTE_ARRAY16 sourceAddress;
+   FWP_BYTE_ARRAY16 destinationAddress;
+
+   UINT16 sourcePort;
+   UINT16 destinationPort;
+   UINT8 tcpFlags;
+
+   ULONG ipHeaderLength;
+   ULONG transportHeaderLength;
+   ULONG payloadLength;
+} TL_INSPECT_PACKET_INFO;
+
+BOOLEAN
+TLInspectParseIpHeader(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _Out_ TL_INSPECT_PACKET_INFO* info
+   );
+
+BOOLEAN
+TLInspectParseTransportHeader(
+   _Inout_ TL_INSPECT_CURSOR* cursor,
+   _Inout_ TL_INSPECT_PACKET_INFO* info
+   );
+
+#endif // _TL_INSPECT_PARSE_H_
@@ -0,0 +1,255 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the memory of the packet ring of the Transport
+   Inspect sample, shared with the policy daemon (see pktring.h), and the
+   copy of the first bytes of a packet to its frame.
+
+   The ring is allocated in pages, which are mapped both into system space,
+   where the driver writes it, and into the process of the daemon. The
+   packets themselves are not mapped: their buffers belong to the stack and
+   are reused once the packets are injected, so their first bytes are
+   copied once, to the frame of their descriptor.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "cursor.h"
+#include "pktring.h"
+
+C_ASSERT(sizeof(TL_INSPECT_PACKET_RING_HEADER) == 4 * SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(((TL_INSPECT_PACKET_RING_SIZE - 1) & TL_INSPECT_PACKET_RING_SIZE) == 0);
+
+NTSTATUS
+TLInspectPacketRingCreate(
+   _In_ const TL_INSPECT_PACKET_RING_SETUP* setup,
+   _Outptr_ TL_INSPECT_PACKET_RING** ring
+   )
+/* ++
+
+   This function allocates a packet ring and maps it into the current
+   process; it must be called in the context of that process, at
+   PASSIVE_LEVEL. The ring is freed by TLInspectPacketRingDestroy.
+
+-- */
+{
+   NTSTATUS status = STATUS_SUCCESS;
+   TL_INSPECT_PACKET_RING* newRing;
+   PHYSICAL_ADDRESS lowAddress;
+   PHYSICAL_ADDRESS highAddress;
+   PHYSICAL_ADDRESS skipBytes;
+   UINT8* systemAddress = NULL;
+   void* userAddress = NULL;
+
+   *ring = NULL;
+
+   newRing = ExAllocatePoolZero(
+                NonPagedPool,
+                sizeof(TL_INSPECT_PACKET_RING),
+                TL_INSPECT_PACKET_RING_POOL_TAG
+                );
+   if (newRing == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   if (!TLInspectPacketRingLayout(setup, &newRing->layout))
+   {
+      status = STATUS_INVALID_PARAMETER;
+      goto Exit;
+   }
+
+   newRing->length = (SIZE_T)newRing->layout.partitions *
+                     newRing->layout.partitionSize;
+
+   lowAddress.QuadPart = 0;
+   highAddress.QuadPart = -1;
+   skipBytes.QuadPart = 0;
+
+   //
+   // The pages are zeroed, which sets every index to 0.
+   //
+   newRing->mdl = MmAllocatePagesForMdlEx(
+                     lowAddress,
+                     highAddress,
+                     skipBytes,
+                     newRing->length,
+                     MmCached,
+                     MM_ALLOCATE_FULLY_REQUIRED
+                     );
+   if (newRing->mdl == NULL)
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   systemAddress = MmGetSystemAddressForMdlSafe(
+                      newRing->mdl,
+                      NormalPagePriority | MdlMappingNoExecute
+                      );
+   if (systemAddress == NULL)
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   //
+   // Mapping into user space raises an exception on failure, instead of
+   // returning NULL.
+   //
+   __try
+   {
+      userAddress = MmMapLockedPagesSpecifyCache(
+                       newRing->mdl,
+                       UserMode,
+                       MmCached,
+                       NULL,
+                       FALSE,
+                       NormalPagePriority | MdlMappingNoExecute
+                       );
+   }
+   __except (EXCEPTION_EXECUTE_HANDLER)
+   {
+      status = GetExceptionCode();
+   }
+
+   if (userAddress == NULL)
+   {
+      if (NT_SUCCESS(status))
+      {
+         status = STATUS_INSUFFICIENT_RESOURCES;
+      }
+      goto Exit;
+   }
+
+   TLInspectPacketRingSetBase(newRing, systemAddress);
+
+   newRing->layout.address = (UINT64)(ULONG_PTR)userAddress;
+   newRing->process = PsGetCurrentProcess();
+   ObReferenceObject(newRing->process);
+
+   *ring = newRing;
+   newRing = NULL;
+
+Exit:
+
+   if (newRing != NULL)
+   {
+      if (newRing->mdl != NULL)
+      {
+         if (systemAddress != NULL)
+         {
+            MmUnmapLockedPages(systemAddress, newRing->mdl);
+         }
+
+         MmFreePagesFromMdl(newRing->mdl);
+         ExFreePool(newRing->mdl);
+      }
+
+      ExFreePoolWithTag(newRing, TL_INSPECT_PACKET_RING_POOL_TAG);
+   }
+
+   return status;
+}
+
+void
+TLInspectPacketRingDestroy(
+   _In_ TL_INSPECT_PACKET_RING* ring
+   )
+/* ++
+
+   This function unmaps a packet ring from the process it was mapped into,
+   attaching to it if needed, and frees it. It is called at PASSIVE_LEVEL,
+   once the driver no longer uses the ring.
+
+-- */
+{
+   KAPC_STATE apcState;
+   BOOLEAN attached = FALSE;
+
+   if (ring->process != PsGetCurrentProcess())
+   {
+      KeStackAttachProcess(ring->process, &apcState);
+      attached = TRUE;
+   }
+
+   MmUnmapLockedPages((void*)(ULONG_PTR)ring->layout.address, ring->mdl);
+
+   if (attached)
+   {
+      KeUnstackDetachProcess(&apcState);
+   }
+
+   ObDereferenceObject(ring->process);
+
+   MmUnmapLockedPages(ring->base, ring->mdl);
+   MmFreePagesFromMdl(ring->mdl);
+   ExFreePool(ring->mdl);
+
+   ExFreePoolWithTag(ring, TL_INSPECT_PACKET_RING_POOL_TAG);
+}
+
+ULONG
+TLInspectPacketRingCapture(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _Out_writes_bytes_(snapLength) UINT8* frame,
+   _In_ ULONG snapLength,
+   _Out_ UINT32* packetLength
+   )
+/* ++
+
+   This function copies up to snapLength of the first bytes of the first
+   net buffer of a packet to a frame, and returns the number copied. A
+   buffer that cannot be mapped ends the copy.
+
+-- */
+{
+   TL_INSPECT_CURSOR cursor;
+   const UINT8* data;
+   ULONG spanLength;
+   ULONG captured = 0;
+
+   *packetLength = 0;
+
+   if (packet->netBufferList == NULL)
+   {
+      return 0;
+   }
+
+   if (!TLInspectCursorInitialize(
+           &cursor,
+           NET_BUFFER_LIST_FIRST_NB(packet->netBufferList),
+           0))
+   {
+      return 0;
+   }
+
+   *packetLength = TLInspectCursorRemaining(&cursor);
+
+   while ((captured < snapLength) &&
+          ((data = TLInspectCursorNextSpan(&cursor, &spanLength)) != NULL))
+   {
+      spanLength = min(spanLength, snapLength - captured);
+
+      RtlCopyMemory(frame + captured, data, spanLength);
+      captured += spanLength;
+   }
+
+   return captured;
+}
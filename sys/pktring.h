@@ -0,0 +1,290 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the packet ring of the Transport Inspect
+   sample: memory shared with the policy daemon through which the verdict
+   channel hands it the descriptors of the pended traffic, with the first
+   bytes of the packets, and takes its verdicts back (see verdict.c). The
+   layout of the memory is declared in inspectioctl.h.
+
+   Each partition of the ring is a pair of single-producer, single-consumer
+   rings: descriptors from the driver to one thread of the daemon, and
+   verdicts back. The driver writes and reads the partitions with the lock
+   of the verdict channel held, so that it is the single producer and
+   consumer on its side. It keeps its own copy of the indices it writes,
+   and reads each index written by the daemon once, since the daemon may
+   change the memory at any time.
+
+   bench\ringbench.c runs the ring against a stand-in daemon.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_PKTRING_H_
+#define _TL_INSPECT_PKTRING_H_
+
+#include "inspectioctl.h"
+
+//
+// TL_INSPECT_PACKET_RING_PARTITION is the view of the driver on a
+// partition. descriptorProducer and completionConsumer are the indices it
+// writes; waiting is the number of wait requests of the daemon parked for
+// the partition.
+//
+typedef struct TL_INSPECT_PACKET_RING_PARTITION_
+{
+   TL_INSPECT_PACKET_RING_HEADER* header;
+   TL_INSPECT_PACKET_DESCRIPTOR* descriptors;
+   TL_INSPECT_VERDICT* completions;
+   UINT8* frames;
+
+   UINT64 descriptorProducer;
+   UINT64 completionConsumer;
+   ULONG waiting;
+} TL_INSPECT_PACKET_RING_PARTITION;
+
+//
+// TL_INSPECT_PACKET_RING is the packet ring of the daemon. layout.address
+// is the address of the ring in the daemon, base the one in the driver.
+// The memory is described by mdl, and mapped into process.
+//
+typedef struct TL_INSPECT_PACKET_RING_
+{
+   TL_INSPECT_PACKET_RING_MAPPING layout;
+   TL_INSPECT_PACKET_RING_PARTITION partitions[TL_INSPECT_PACKET_RING_MAX_PARTITIONS];
+
+   UINT8* base;
+   SIZE_T length;
+
+   MDL* mdl;
+   PEPROCESS process;
+} TL_INSPECT_PACKET_RING;
+
+__inline
+BOOLEAN
+TLInspectPacketRingLayout(
+   _In_ const TL_INSPECT_PACKET_RING_SETUP* setup,
+   _Out_ TL_INSPECT_PACKET_RING_MAPPING* layout
+   )
+/* ++
+
+   Lays out the partitions asked for, each starting on a page. Returns
+   FALSE if the setup is not valid, or the ring would be too large.
+
+-- */
+{
+   UINT32 size = TL_INSPECT_PACKET_RING_SIZE;
+
+   RtlZeroMemory(layout, sizeof(*layout));
+
+   if ((setup->partitions == 0) ||
+       (setup->partitions > TL_INSPECT_PACKET_RING_MAX_PARTITIONS) ||
+       (setup->snapLength > TL_INSPECT_PACKET_RING_MAX_SNAP_LENGTH))
+   {
+      return FALSE;
+   }
+
+   layout->partitions = setup->partitions;
+   layout->size = size;
+   layout->snapLength = setup->snapLength;
+   layout->frameSize = (setup->snapLength + 63) & ~63u;
+   layout->descriptorOffset = sizeof(TL_INSPECT_PACKET_RING_HEADER);
+   layout->completionOffset = layout->descriptorOffset +
+                              size * sizeof(TL_INSPECT_PACKET_DESCRIPTOR);
+   layout->frameOffset = layout->completionOffset +
+                         size * sizeof(TL_INSPECT_VERDICT);
+   layout->partitionSize = (layout->frameOffset + size * layout->frameSize +
+                              PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+   return (UINT64)layout->partitions * layout->partitionSize <=
+          TL_INSPECT_PACKET_RING_MAX_LENGTH;
+}
+
+__inline
+void
+TLInspectPacketRingSetBase(
+   _Inout_ TL_INSPECT_PACKET_RING* ring,
+   _In_ UINT8* base
+   )
+/* ++
+
+   Points the partitions of a laid out ring at its memory, which must be
+   zeroed.
+
+-- */
+{
+   UINT32 i;
+
+   ring->base = base;
+   ring->length = (SIZE_T)ring->layout.partitions * ring->layout.partitionSize;
+
+   for (i = 0; i < ring->layout.partitions; i++)
+   {
+      TL_INSPECT_PACKET_RING_PARTITION* partition = &ring->partitions[i];
+      UINT8* start = base + (SIZE_T)i * ring->layout.partitionSize;
+
+      partition->header = (TL_INSPECT_PACKET_RING_HEADER*)start;
+      partition->descriptors = (TL_INSPECT_PACKET_DESCRIPTOR*)
+                                  (start + ring->layout.descriptorOffset);
+      partition->completions = (TL_INSPECT_VERDICT*)
+                                  (start + ring->layout.completionOffset);
+      partition->frames = start + ring->layout.frameOffset;
+      partition->descriptorProducer = 0;
+      partition->completionConsumer = 0;
+      partition->waiting = 0;
+   }
+}
+
+__inline
+TL_INSPECT_PACKET_RING_PARTITION*
+TLInspectPacketRingPartition(
+   _In_ TL_INSPECT_PACKET_RING* ring,
+   _In_ ULONG flowHash
+   )
+/* ++
+
+   Returns the partition of a flow, picked by the hash of its 5-tuple (see
+   shard.h), so that the packets of a flow are inspected by one thread of
+   the daemon, in order.
+
+-- */
+{
+   return &ring->partitions[flowHash % ring->layout.partitions];
+}
+
+__inline
+TL_INSPECT_PACKET_DESCRIPTOR*
+TLInspectPacketRingReserve(
+   _In_ const TL_INSPECT_PACKET_RING* ring,
+   _In_ TL_INSPECT_PACKET_RING_PARTITION* partition,
+   _Out_ UINT8** frame
+   )
+/* ++
+
+   Returns the next descriptor of a partition, and its frame, to be filled
+   then published; returns NULL if the daemon did not consume the
+   descriptors written a ring ago. A consumer index ahead of the producer
+   one reads as a full partition.
+
+-- */
+{
+   UINT64 consumer = ReadULong64Acquire(&partition->header->descriptorConsumer);
+   UINT64 index = partition->descriptorProducer & (ring->layout.size - 1);
+
+   *frame = NULL;
+
+   if ((partition->descriptorProducer - consumer) >= ring->layout.size)
+   {
+      return NULL;
+   }
+
+   *frame = partition->frames + (SIZE_T)index * ring->layout.frameSize;
+
+   return &partition->descriptors[index];
+}
+
+__inline
+void
+TLInspectPacketRingPublish(
+   _Inout_ TL_INSPECT_PACKET_RING_PARTITION* partition
+   )
+{
+   partition->descriptorProducer++;
+
+   WriteULong64Release(
+      &partition->header->descriptorProducer,
+      partition->descriptorProducer
+      );
+}
+
+__inline
+BOOLEAN
+TLInspectPacketRingUnconsumed(
+   _In_ const TL_INSPECT_PACKET_RING_PARTITION* partition
+   )
+{
+   return ReadULong64Acquire(&partition->header->descriptorConsumer) !=
+          partition->descriptorProducer;
+}
+
+__inline
+BOOLEAN
+TLInspectPacketRingNextCompletion(
+   _In_ const TL_INSPECT_PACKET_RING* ring,
+   _Inout_ TL_INSPECT_PACKET_RING_PARTITION* partition,
+   _Out_ TL_INSPECT_VERDICT* verdict
+   )
+/* ++
+
+   Copies the next verdict the daemon wrote to the completion ring of a
+   partition, and returns FALSE if there is none. A producer index more
+   than a ring ahead is ignored, so that the descriptors of a daemon that
+   corrupts it time out. The consumer index is only written back by
+   TLInspectPacketRingReleaseCompletions.
+
+-- */
+{
+   UINT64 available =
+      ReadULong64Acquire(&partition->header->completionProducer) -
+      partition->completionConsumer;
+   const volatile TL_INSPECT_VERDICT* completion;
+
+   if ((available == 0) || (available > ring->layout.size))
+   {
+      return FALSE;
+   }
+
+   completion = &partition->completions[partition->completionConsumer &
+                                        (ring->layout.size - 1)];
+
+   verdict->id = completion->id;
+   verdict->verdict = completion->verdict;
+   verdict->reserved = 0;
+
+   partition->completionConsumer++;
+
+   return TRUE;
+}
+
+__inline
+void
+TLInspectPacketRingReleaseCompletions(
+   _Inout_ TL_INSPECT_PACKET_RING_PARTITION* partition
+   )
+{
+   WriteULong64Release(
+      &partition->header->completionConsumer,
+      partition->completionConsumer
+      );
+}
+
+#ifndef TL_INSPECT_PKTRING_USER_MODE
+
+NTSTATUS
+TLInspectPacketRingCreate(
+   _In_ const TL_INSPECT_PACKET_RING_SETUP* setup,
+   _Outptr_ TL_INSPECT_PACKET_RING** ring
+   );
+
+void
+TLInspectPacketRingDestroy(
+   _In_ TL_INSPECT_PACKET_RING* ring
+   );
+
+ULONG
+TLInspectPacketRingCapture(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _Out_writes_bytes_(snapLength) UINT8* frame,
+   _In_ ULONG snapLength,
+   _Out_ UINT32* packetLength
+   );
+
+#endif // TL_INSPECT_PKTRING_USER_MODE
+
+#endif // _TL_INSPECT_PKTRING_H_
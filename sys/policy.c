@@ -0,0 +1,1171 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the inspection policy of the Transport Inspect
+   sample: it reads policy snapshots from the Parameters key, swaps them in,
+   and reclaims the previous ones.
+
+   Readers hold a snapshot at DISPATCH_LEVEL, so a processor that has run
+   at PASSIVE_LEVEL since a snapshot was swapped out no longer reads it; a
+   reload runs its thread on every processor in turn before freeing the
+   previous snapshot. Reloads are serialized by gPolicyLock.
+
+   A system thread waits for changes of the Parameters key, and reloads
+   the policy once the key has not changed for
+   TL_INSPECT_POLICY_SETTLE_TIME, so that the values written together are
+   read together.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include <ws2ipdef.h>
+#include <in6addr.h>
+#include <ip2string.h>
+
+#include "inspect.h"
+#include "flowcache.h"
+#include "policy.h"
+
+#define TL_INSPECT_POLICY_SETTLE_TIME 100 // milliseconds
+
+extern BOOLEAN gInspectAllByDefault;
+
+TL_INSPECT_POLICY* volatile gInspectPolicy;
+
+WDFKEY gPolicyKey;
+WDFWAITLOCK gPolicyLock;
+ULONG gPolicyVersion;
+
+//
+// Change notifications of the Parameters key. The status block is global
+// since a pending notification completes when the key is closed, after
+// the thread has exited.
+//
+HANDLE gPolicyEventHandle;
+PKEVENT gPolicyChangeEvent;
+KEVENT gPolicyStopEvent;
+PETHREAD gPolicyThread;
+IO_STATUS_BLOCK gPolicyNotifyStatus;
+
+NTSTATUS
+TLInspectParseNumber(
+   _Inout_ PCWSTR* string,
+   _In_ ULONG maximum,
+   _Out_ ULONG* value
+   )
+/* ++
+
+   This function parses the decimal number, of at most maximum, that
+   *string starts with, and advances *string past it.
+
+-- */
+{
+   PCWSTR cursor = *string;
+   ULONG64 number = 0;
+
+   if ((*cursor < L'0') || (*cursor > L'9'))
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   while ((*cursor >= L'0') && (*cursor <= L'9'))
+   {
+      number = number * 10 + (*cursor - L'0');
+
+      if (number > maximum)
+      {
+         return STATUS_INVALID_PARAMETER;
+      }
+
+      cursor++;
+   }
+
+   *value = (ULONG)number;
+   *string = cursor;
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectParseRange(
+   _In_ PCWSTR string,
+   _In_ ULONG maximum,
+   _Out_ ULONG* first,
+   _Out_ ULONG* last
+   )
+/* ++
+
+   This function parses a decimal number, or a range of them (e.g.
+   1024-65535), of at most maximum.
+
+-- */
+{
+   NTSTATUS status;
+
+   status = TLInspectParseNumber(&string, maximum, first);
+
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   *last = *first;
+
+   if (*string == L'-')
+   {
+      string++;
+
+      status = TLInspectParseNumber(&string, maximum, last);
+
+      if (!NT_SUCCESS(status))
+      {
+         return status;
+      }
+   }
+
+   if ((*string != UNICODE_NULL) || (*first > *last))
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectParsePrefix(
+   _In_ PCWSTR string,
+   _Out_writes_bytes_(16) UINT8* address,
+   _Out_ UINT32* addressLength,
+   _Out_ UINT32* length
+   )
+/* ++
+
+   This function parses an IPv4 or IPv6 address (into network order),
+   optionally followed by a prefix length (e.g. 10.0.0.0/8).
+
+-- */
+{
+   NTSTATUS status;
+   PWSTR terminator;
+   PCWSTR cursor;
+   IN_ADDR addressV4;
+   IN6_ADDR addressV6;
+   ULONG value;
+
+   status = RtlIpv4StringToAddressW(string, TRUE, &terminator, &addressV4);
+
+   if (NT_SUCCESS(status))
+   {
+      RtlCopyMemory(address, &addressV4, sizeof(addressV4));
+      *addressLength = 32;
+   }
+   else
+   {
+      status = RtlIpv6StringToAddressW(string, &terminator, &addressV6);
+
+      if (!NT_SUCCESS(status))
+      {
+         return status;
+      }
+
+      RtlCopyMemory(address, &addressV6, sizeof(addressV6));
+      *addressLength = 128;
+   }
+
+   cursor = terminator;
+   *length = *addressLength;
+
+   if (*cursor == L'/')
+   {
+      cursor++;
+
+      status = TLInspectParseNumber(&cursor, *addressLength, &value);
+
+      if (!NT_SUCCESS(status))
+      {
+         return status;
+      }
+
+      *length = value;
+   }
+
+   if (*cursor != UNICODE_NULL)
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TLInspectAddPrefix(
+   _Inout_ TL_INSPECT_POLICY* policy,
+   _In_ PCWSTR string
+   )
+/* ++
+
+   This function parses an IPv4 or IPv6 prefix and adds it to the table of
+   its address family in the policy. A leading ! adds the prefix as
+   excluded, so that the addresses it covers are not inspected even if a
+   shorter prefix covers them too.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_LPM_TABLE* table;
+   UINT8 prefix[16];
+   UINT32 addressLength;
+   UINT32 length;
+   UINT16 value = TL_INSPECT_PREFIX_INSPECT;
+   PCWSTR name = string;
+
+   if (*string == L'!')
+   {
+      value = TL_INSPECT_PREFIX_EXCLUDE;
+      string++;
+   }
+
+   status = TLInspectParsePrefix(string, prefix, &addressLength, &length);
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   table = (addressLength == 32) ? &policy->prefixesV4 : &policy->prefixesV6;
+
+   if ((table->addressLength == 0) &&
+       !TLInspectLpmInitialize(table, addressLength))
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   if (!TLInspectLpmInsert(table, prefix, length, value))
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+Exit:
+
+   if (!NT_SUCCESS(status))
+   {
+      DbgPrint("Cannot add the prefix to inspect %ws (0x%08x).\n", name, status);
+   }
+
+   return status;
+}
+
+NTSTATUS
+TLInspectAddRule(
+   _Inout_ TL_INSPECT_POLICY* policy,
+   _In_ PCWSTR string
+   )
+/* ++
+
+   This function parses an inspection rule and adds it to the rule set of
+   its address family in the policy, or to both if it names no address. A
+   rule is its action, inspect, permit or block, followed by the conditions
+   that the traffic must all meet for the rule to match, separated by
+   spaces:
+
+      priority=n      the matching rule of lowest priority wins (0, default);
+                      of equal ones, the first listed
+      dir=in|out      direction of the packet, or of the connection
+      proto=name|n    tcp, udp, icmp, icmpv6 or protocol number
+      local=prefix    local address or prefix (e.g. 10.0.0.0/8)
+      remote=prefix   remote address or prefix
+      lport=n[-m]     local port or port range
+      rport=n[-m]     remote port or port range
+
+   e.g. "block proto=tcp rport=23" or "permit remote=10.1.0.0/16 rport=443".
+
+-- */
+{
+   NTSTATUS status = STATUS_SUCCESS;
+   TL_INSPECT_RULE rule;
+   WCHAR token[TL_INSPECT_MAX_CONFIG_STRING];
+   PCWSTR cursor = string;
+   PWSTR value;
+   TL_INSPECT_RULE_FIELD field;
+   UINT8 address[16];
+   UINT32 ruleAddressLength = 0; // both families
+   UINT32 addressLength;
+   UINT32 length;
+   ULONG first = 0;
+   ULONG last = 0;
+   BOOLEAN isAction = TRUE;
+
+   TLInspectRuleInitialize(&rule);
+
+   for (;;)
+   {
+      size_t tokenLength = 0;
+
+      while ((*cursor == L' ') || (*cursor == L'\t'))
+      {
+         cursor++;
+      }
+
+      if (*cursor == UNICODE_NULL)
+      {
+         break;
+      }
+
+      while ((cursor[tokenLength] != UNICODE_NULL) &&
+             (cursor[tokenLength] != L' ') &&
+             (cursor[tokenLength] != L'\t'))
+      {
+         tokenLength++;
+      }
+
+      if (tokenLength >= RTL_NUMBER_OF(token))
+      {
+         status = STATUS_INVALID_PARAMETER;
+         goto Exit;
+      }
+
+      RtlCopyMemory(token, cursor, tokenLength * sizeof(WCHAR));
+      token[tokenLength] = UNICODE_NULL;
+      cursor += tokenLength;
+
+      if (isAction)
+      {
+         isAction = FALSE;
+
+         if (_wcsicmp(token, L"inspect") == 0)
+         {
+            rule.action = TL_INSPECT_RULE_ACTION_INSPECT;
+         }
+         else if (_wcsicmp(token, L"permit") == 0)
+         {
+            rule.action = TL_INSPECT_RULE_ACTION_PERMIT;
+         }
+         else if (_wcsicmp(token, L"block") == 0)
+         {
+            rule.action = TL_INSPECT_RULE_ACTION_BLOCK;
+         }
+         else
+         {
+            status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+         }
+
+         continue;
+      }
+
+      value = wcschr(token, L'=');
+
+      if (value == NULL)
+      {
+         status = STATUS_INVALID_PARAMETER;
+         goto Exit;
+      }
+
+      *value++ = UNICODE_NULL;
+
+      if (_wcsicmp(token, L"priority") == 0)
+      {
+         status = TLInspectParseRange(value, MAXULONG, &first, &last);
+
+         if (NT_SUCCESS(status) && (first != last))
+         {
+            status = STATUS_INVALID_PARAMETER;
+         }
+
+         rule.priority = first;
+      }
+      else if (_wcsicmp(token, L"dir") == 0)
+      {
+         if (_wcsicmp(value, L"in") == 0)
+         {
+            first = FWP_DIRECTION_INBOUND;
+         }
+         else if (_wcsicmp(value, L"out") == 0)
+         {
+            first = FWP_DIRECTION_OUTBOUND;
+         }
+         else
+         {
+            status = STATUS_INVALID_PARAMETER;
+         }
+
+         rule.first[TL_INSPECT_RULE_FIELD_DIRECTION].low = first;
+         rule.last[TL_INSPECT_RULE_FIELD_DIRECTION].low = first;
+      }
+      else if (_wcsicmp(token, L"proto") == 0)
+      {
+         if (_wcsicmp(value, L"tcp") == 0)
+         {
+            first = IPPROTO_TCP;
+         }
+         else if (_wcsicmp(value, L"udp") == 0)
+         {
+            first = IPPROTO_UDP;
+         }
+         else if (_wcsicmp(value, L"icmp") == 0)
+         {
+            first = IPPROTO_ICMP;
+         }
+         else if (_wcsicmp(value, L"icmpv6") == 0)
+         {
+            first = IPPROTO_ICMPV6;
+         }
+         else
+         {
+            status = TLInspectParseRange(value, MAXUINT8, &first, &last);
+
+            if (NT_SUCCESS(status) && (first != last))
+            {
+               status = STATUS_INVALID_PARAMETER;
+            }
+         }
+
+         rule.first[TL_INSPECT_RULE_FIELD_PROTOCOL].low = first;
+         rule.last[TL_INSPECT_RULE_FIELD_PROTOCOL].low = first;
+      }
+      else if ((_wcsicmp(token, L"local") == 0) ||
+               (_wcsicmp(token, L"remote") == 0))
+      {
+         field = (_wcsicmp(token, L"local") == 0) ?
+                 TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS :
+                 TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS;
+
+         status = TLInspectParsePrefix(value, address, &addressLength, &length);
+
+         if (NT_SUCCESS(status) &&
+             (ruleAddressLength != 0) && (ruleAddressLength != addressLength))
+         {
+            status = STATUS_INVALID_PARAMETER;
+         }
+
+         if (NT_SUCCESS(status))
+         {
+            ruleAddressLength = addressLength;
+            TLInspectRuleSetPrefix(&rule, field, address, addressLength, length);
+         }
+      }
+      else if ((_wcsicmp(token, L"lport") == 0) ||
+               (_wcsicmp(token, L"rport") == 0))
+      {
+         field = (_wcsicmp(token, L"lport") == 0) ?
+                 TL_INSPECT_RULE_FIELD_LOCAL_PORT :
+                 TL_INSPECT_RULE_FIELD_REMOTE_PORT;
+
+         status = TLInspectParseRange(value, MAXUINT16, &first, &last);
+
+         rule.first[field].low = first;
+         rule.last[field].low = last;
+      }
+      else
+      {
+         status = STATUS_INVALID_PARAMETER;
+      }
+
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
+   }
+
+   if (isAction)
+   {
+      status = STATUS_INVALID_PARAMETER;
+      goto Exit;
+   }
+
+   //
+   // A rule that names no address goes to both sets, whose address fields
+   // it leaves unrestricted.
+   //
+   if ((ruleAddressLength != 128) &&
+       !TLInspectRulesAdd(&policy->rulesV4, &rule))
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   if ((ruleAddressLength != 32) &&
+       !TLInspectRulesAdd(&policy->rulesV6, &rule))
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   policy->ruleCount++;
+
+Exit:
+
+   if (!NT_SUCCESS(status))
+   {
+      DbgPrint("Cannot add the inspection rule %ws (0x%08x).\n", string, status);
+   }
+
+   return status;
+}
+
+typedef
+NTSTATUS
+TL_INSPECT_POLICY_STRING_HANDLER(
+   _Inout_ TL_INSPECT_POLICY* policy,
+   _In_ PCWSTR string
+   );
+
+NTSTATUS
+TLInspectLoadStrings(
+   _In_ const WDFKEY key,
+   _In_ PCWSTR name,
+   _In_ TL_INSPECT_POLICY_STRING_HANDLER* handler,
+   _Inout_ TL_INSPECT_POLICY* policy
+   )
+/* ++
+
+   This function passes each of the strings of the REG_MULTI_SZ value name,
+   if present, to handler.
+
+-- */
+{
+   NTSTATUS status;
+   UNICODE_STRING valueName;
+   WCHAR buffer[TL_INSPECT_MAX_CONFIG_STRING];
+   WDFMEMORY memory;
+   ULONG valueType;
+   size_t size;
+   PCWSTR string;
+   PCWSTR end;
+
+   RtlInitUnicodeString(&valueName, name);
+
+   status = WdfRegistryQueryMemory(
+               key,
+               &valueName,
+               PagedPool,
+               WDF_NO_OBJECT_ATTRIBUTES,
+               &memory,
+               &valueType
+               );
+
+   if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+   {
+      return STATUS_SUCCESS;
+   }
+
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   if (valueType != REG_MULTI_SZ)
+   {
+      status = STATUS_INVALID_PARAMETER;
+      goto Exit;
+   }
+
+   string = WdfMemoryGetBuffer(memory, &size);
+   end = string + size / sizeof(WCHAR);
+
+   //
+   // The strings are copied to a terminated buffer first, since the last
+   // one of the value may not be terminated.
+   //
+   while ((string < end) && (*string != UNICODE_NULL))
+   {
+      size_t length = 0;
+
+      while ((string + length < end) && (string[length] != UNICODE_NULL))
+      {
+         length++;
+      }
+
+      if (length >= RTL_NUMBER_OF(buffer))
+      {
+         status = STATUS_INVALID_PARAMETER;
+         goto Exit;
+      }
+
+      RtlCopyMemory(buffer, string, length * sizeof(WCHAR));
+      buffer[length] = UNICODE_NULL;
+
+      status = handler(policy, buffer);
+
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
+
+      string += length + 1;
+   }
+
+Exit:
+
+   WdfObjectDelete(memory);
+
+   return status;
+}
+
+
+void
+TLInspectPolicyDelete(
+   _In_opt_ _Post_invalid_ TL_INSPECT_POLICY* policy
+   )
+{
+   if (policy == NULL)
+   {
+      return;
+   }
+
+   TLInspectLpmFree(&policy->prefixesV4);
+   TLInspectLpmFree(&policy->prefixesV6);
+   TLInspectRulesFree(&policy->rulesV4);
+   TLInspectRulesFree(&policy->rulesV6);
+
+   ExFreePoolWithTag(policy, TL_INSPECT_POLICY_POOL_TAG);
+}
+
+NTSTATUS
+TLInspectPolicyLoad(
+   _Outptr_ TL_INSPECT_POLICY** snapshot
+   )
+/* ++
+
+   This function reads and builds a new policy snapshot from the
+   Parameters key.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_POLICY* policy;
+   DECLARE_CONST_UNICODE_STRING(blockTrafficName, L"BlockTraffic");
+   DECLARE_CONST_UNICODE_STRING(addressName, L"RemoteAddressToInspect");
+   DECLARE_UNICODE_STRING_SIZE(address, INET6_ADDRSTRLEN);
+   ULONG blockTraffic;
+   UINT64 startTime = KeQueryInterruptTime();
+
+   *snapshot = NULL;
+
+   policy = ExAllocatePoolZero(
+               NonPagedPool,
+               sizeof(TL_INSPECT_POLICY),
+               TL_INSPECT_POLICY_POOL_TAG
+               );
+
+   if (policy == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   TLInspectRulesInitialize(&policy->rulesV4, 32);
+   TLInspectRulesInitialize(&policy->rulesV6, 128);
+
+   policy->permitTraffic = TRUE;
+
+   status = WdfRegistryQueryULong(gPolicyKey, &blockTrafficName, &blockTraffic);
+
+   if (NT_SUCCESS(status) && (blockTraffic != 0))
+   {
+      policy->permitTraffic = FALSE;
+   }
+
+   //
+   // With gInspectAllByDefault, every remote address is inspected whatever
+   // the prefixes.
+   //
+   if (!gInspectAllByDefault)
+   {
+      status = WdfRegistryQueryUnicodeString(
+                  gPolicyKey,
+                  &addressName,
+                  NULL,
+                  &address
+                  );
+
+      if (NT_SUCCESS(status))
+      {
+         // Defensively null-terminate the string
+         address.Length = min(address.Length, address.MaximumLength - sizeof(WCHAR));
+         address.Buffer[address.Length/sizeof(WCHAR)] = UNICODE_NULL;
+
+         status = TLInspectAddPrefix(policy, address.Buffer);
+
+         if (!NT_SUCCESS(status))
+         {
+            goto Exit;
+         }
+      }
+
+      status = TLInspectLoadStrings(
+                  gPolicyKey,
+                  L"RemotePrefixesToInspect",
+                  TLInspectAddPrefix,
+                  policy
+                  );
+
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
+   }
+
+   status = TLInspectLoadStrings(
+               gPolicyKey,
+               L"InspectRules",
+               TLInspectAddRule,
+               policy
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   if (!TLInspectLpmBuild(&policy->prefixesV4) ||
+       !TLInspectLpmBuild(&policy->prefixesV6) ||
+       !TLInspectRulesBuild(&policy->rulesV4) ||
+       !TLInspectRulesBuild(&policy->rulesV6))
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   policy->loadTime = KeQueryInterruptTime() - startTime;
+
+   *snapshot = policy;
+   policy = NULL;
+
+Exit:
+
+   TLInspectPolicyDelete(policy);
+
+   return status;
+}
+
+void
+TLInspectPolicySynchronize(void)
+/* ++
+
+   This function returns once every processor has run at PASSIVE_LEVEL
+   since it was called, by running the calling thread on each of them in
+   turn. A snapshot swapped out before the call is then no longer read.
+
+-- */
+{
+   ULONG processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+   PROCESSOR_NUMBER processor;
+   GROUP_AFFINITY affinity;
+   GROUP_AFFINITY previousAffinity;
+   BOOLEAN affinitized = FALSE;
+   ULONG i;
+
+   for (i = 0; i < processorCount; i++)
+   {
+      if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processor)))
+      {
+         continue;
+      }
+
+      RtlZeroMemory(&affinity, sizeof(affinity));
+      affinity.Group = processor.Group;
+      affinity.Mask = (KAFFINITY)1 << processor.Number;
+
+      KeSetSystemGroupAffinityThread(
+         &affinity,
+         affinitized ? NULL : &previousAffinity
+         );
+      affinitized = TRUE;
+   }
+
+   if (affinitized)
+   {
+      KeRevertToUserGroupAffinityThread(&previousAffinity);
+   }
+}
+
+void
+TLInspectPolicyGetInfo(
+   _In_ const TL_INSPECT_POLICY* policy,
+   _Out_ TL_INSPECT_POLICY_INFO* info
+   )
+{
+   RtlZeroMemory(info, sizeof(*info));
+
+   info->version = policy->version;
+   info->permitTraffic = policy->permitTraffic;
+   info->prefixCount =
+      policy->prefixesV4.prefixCount + policy->prefixesV6.prefixCount;
+   info->ruleCount = policy->ruleCount;
+   info->loadTime = policy->loadTime;
+}
+
+NTSTATUS
+TLInspectPolicyInitialize(
+   _In_ WDFDRIVER driver
+   )
+/* ++
+
+   This function opens the Parameters key and loads the first policy
+   snapshot.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_POLICY* policy;
+
+   status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &gPolicyLock);
+
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   status = WdfDriverOpenParametersRegistryKey(
+               driver,
+               KEY_READ,
+               WDF_NO_OBJECT_ATTRIBUTES,
+               &gPolicyKey
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   status = TLInspectPolicyLoad(&policy);
+
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   policy->version = ++gPolicyVersion;
+   gInspectPolicy = policy;
+
+   return STATUS_SUCCESS;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+TLInspectPolicyReload(
+   _Out_opt_ TL_INSPECT_POLICY_INFO* info
+   )
+/* ++
+
+   This function builds a new policy snapshot and swaps it in; the current
+   one is kept if the new one cannot be built. The previous snapshot is
+   freed once no processor can be reading it.
+
+-- */
+{
+   NTSTATUS status;
+   TL_INSPECT_POLICY* policy;
+   TL_INSPECT_POLICY* previous;
+
+   WdfWaitLockAcquire(gPolicyLock, NULL);
+
+   if (gPolicyKey == NULL)
+   {
+      status = STATUS_DELETE_PENDING;
+      goto Exit;
+   }
+
+   status = TLInspectPolicyLoad(&policy);
+
+   if (!NT_SUCCESS(status))
+   {
+      DbgPrint("Cannot reload the inspection policy, keeping version %u (0x%08x).\n",
+               gPolicyVersion, status);
+      goto Exit;
+   }
+
+   policy->version = ++gPolicyVersion;
+
+   previous = InterlockedExchangePointer(
+                 (PVOID volatile*)&gInspectPolicy,
+                 policy
+                 );
+
+   //
+   // The cached verdicts may have been taken under the previous policy.
+   // The flush is ordered after the swap; see
+   // TLInspectFlowCacheGeneration.
+   //
+   TLInspectFlowCacheFlush();
+
+   TLInspectPolicySynchronize();
+
+   TLInspectPolicyDelete(previous);
+
+   if (info != NULL)
+   {
+      TLInspectPolicyGetInfo(policy, info);
+   }
+
+Exit:
+
+   WdfWaitLockRelease(gPolicyLock);
+
+   return status;
+}
+
+NTSTATUS
+TLInspectPolicyWatchKey(void)
+{
+   return ZwNotifyChangeKey(
+             WdfRegistryWdmGetHandle(gPolicyKey),
+             gPolicyEventHandle,
+             NULL,
+             NULL,
+             &gPolicyNotifyStatus,
+             REG_NOTIFY_CHANGE_LAST_SET,
+             FALSE,
+             NULL,
+             0,
+             TRUE
+             );
+}
+
+KSTART_ROUTINE TLInspectPolicyThread;
+
+void
+TLInspectPolicyThread(
+   _In_ void* StartContext
+   )
+/* ++
+
+   This thread reloads the policy when the Parameters key changes. The
+   notification is re-armed before the reload, so that a change made while
+   reloading triggers another one.
+
+-- */
+{
+   NTSTATUS status;
+   void* waitObjects[2];
+   LARGE_INTEGER settleTime;
+
+   UNREFERENCED_PARAMETER(StartContext);
+
+   waitObjects[0] = &gPolicyStopEvent;
+   waitObjects[1] = gPolicyChangeEvent;
+
+   settleTime.QuadPart = -(LONGLONG)TL_INSPECT_POLICY_SETTLE_TIME * 10000;
+
+   status = TLInspectPolicyWatchKey();
+
+   while (NT_SUCCESS(status))
+   {
+      status = KeWaitForMultipleObjects(
+                  2,
+                  waitObjects,
+                  WaitAny,
+                  Executive,
+                  KernelMode,
+                  FALSE,
+                  NULL,
+                  NULL
+                  );
+
+      if (status != STATUS_WAIT_1)
+      {
+         break;
+      }
+
+      status = KeWaitForSingleObject(
+                  &gPolicyStopEvent,
+                  Executive,
+                  KernelMode,
+                  FALSE,
+                  &settleTime
+                  );
+
+      if (status != STATUS_TIMEOUT)
+      {
+         break;
+      }
+
+      status = TLInspectPolicyWatchKey();
+
+      if (NT_SUCCESS(status))
+      {
+         TLInspectPolicyReload(NULL);
+      }
+   }
+
+   if (!NT_SUCCESS(status))
+   {
+      DbgPrint("Cannot watch the Parameters key for changes (0x%08x).\n", status);
+   }
+
+   PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+TLInspectPolicyStartWatch(void)
+/* ++
+
+   This function starts the thread that reloads the policy when the
+   Parameters key changes.
+
+-- */
+{
+   NTSTATUS status;
+   OBJECT_ATTRIBUTES attributes;
+   HANDLE threadHandle;
+
+   KeInitializeEvent(&gPolicyStopEvent, NotificationEvent, FALSE);
+
+   InitializeObjectAttributes(
+      &attributes,
+      NULL,
+      OBJ_KERNEL_HANDLE,
+      NULL,
+      NULL
+      );
+
+   status = ZwCreateEvent(
+               &gPolicyEventHandle,
+               EVENT_ALL_ACCESS,
+               &attributes,
+               SynchronizationEvent,
+               FALSE
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      gPolicyEventHandle = NULL;
+      goto Exit;
+   }
+
+   status = ObReferenceObjectByHandle(
+               gPolicyEventHandle,
+               EVENT_ALL_ACCESS,
+               *ExEventObjectType,
+               KernelMode,
+               (PVOID*)&gPolicyChangeEvent,
+               NULL
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      gPolicyChangeEvent = NULL;
+      goto Exit;
+   }
+
+   status = PsCreateSystemThread(
+               &threadHandle,
+               THREAD_ALL_ACCESS,
+               NULL,
+               NULL,
+               NULL,
+               TLInspectPolicyThread,
+               NULL
+               );
+
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   status = ObReferenceObjectByHandle(
+               threadHandle,
+               0,
+               NULL,
+               KernelMode,
+               (PVOID*)&gPolicyThread,
+               NULL
+               );
+   NT_ASSERT(NT_SUCCESS(status));
+
+   ZwClose(threadHandle);
+
+Exit:
+
+   if (!NT_SUCCESS(status))
+   {
+      TLInspectPolicyStopWatch();
+   }
+
+   return status;
+}
+
+void
+TLInspectPolicyStopWatch(void)
+/* ++
+
+   This function stops the watch thread. Closing the Parameters key
+   completes the pending notification, which signals the change event; it
+   is released afterwards. No reload starts once it returns.
+
+-- */
+{
+   if (gPolicyThread != NULL)
+   {
+      KeSetEvent(&gPolicyStopEvent, 0, FALSE);
+
+      KeWaitForSingleObject(
+         gPolicyThread,
+         Executive,
+         KernelMode,
+         FALSE,
+         NULL
+         );
+
+      ObDereferenceObject(gPolicyThread);
+      gPolicyThread = NULL;
+   }
+
+   if (gPolicyLock != NULL)
+   {
+      WdfWaitLockAcquire(gPolicyLock, NULL);
+
+      if (gPolicyKey != NULL)
+      {
+         WdfRegistryClose(gPolicyKey);
+         gPolicyKey = NULL;
+      }
+
+      WdfWaitLockRelease(gPolicyLock);
+   }
+
+   if (gPolicyChangeEvent != NULL)
+   {
+      ObDereferenceObject(gPolicyChangeEvent);
+      gPolicyChangeEvent = NULL;
+   }
+
+   if (gPolicyEventHandle != NULL)
+   {
+      ZwClose(gPolicyEventHandle);
+      gPolicyEventHandle = NULL;
+   }
+}
+
+void
+TLInspectPolicyFree(void)
+/* ++
+
+   This function frees the current policy snapshot. It is called once the
+   watch is stopped and the callouts are unregistered.
+
+-- */
+{
+   TLInspectPolicyStopWatch();
+
+   TLInspectPolicyDelete(gInspectPolicy);
+   gInspectPolicy = NULL;
+}
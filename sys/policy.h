@@ -0,0 +1,103 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the inspection policy of the Transport Inspect
+   sample: the traffic verdict, the remote prefixes to inspect and the
+   inspection rules, as read from the Parameters key.
+
+   The policy is held in an immutable snapshot. The classify functions and
+   the worker threads read the current snapshot without a lock, at
+   DISPATCH_LEVEL. A reload builds a new snapshot, swaps it in atomically,
+   and frees the previous one once every processor has run at
+   PASSIVE_LEVEL, which no reader of it can still be doing.
+
+   The policy is reloaded when the Parameters key changes, and on
+   IOCTL_TL_INSPECT_RELOAD_POLICY.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_POLICY_H_
+#define _TL_INSPECT_POLICY_H_
+
+#include "inspectioctl.h"
+#include "lpm.h"
+#include "rules.h"
+
+//
+// TL_INSPECT_POLICY is a snapshot of the policy; it is never modified once
+// it is current. version counts the snapshots made since the driver was
+// loaded, the first one being 1. ruleCount is the number of rules read,
+// each of which may be in both rule sets; loadTime is the time, in 100ns
+// units, taken to read and build the snapshot.
+//
+typedef struct TL_INSPECT_POLICY_
+{
+   ULONG version;
+   BOOLEAN permitTraffic;
+   ULONG ruleCount;
+   UINT64 loadTime;
+
+   TL_INSPECT_LPM_TABLE prefixesV4;
+   TL_INSPECT_LPM_TABLE prefixesV6;
+
+   TL_INSPECT_RULE_SET rulesV4;
+   TL_INSPECT_RULE_SET rulesV6;
+} TL_INSPECT_POLICY;
+
+extern TL_INSPECT_POLICY* volatile gInspectPolicy;
+
+NTSTATUS
+TLInspectPolicyInitialize(
+   _In_ WDFDRIVER driver
+   );
+
+NTSTATUS
+TLInspectPolicyStartWatch(void);
+
+void
+TLInspectPolicyStopWatch(void);
+
+void
+TLInspectPolicyFree(void);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+TLInspectPolicyReload(
+   _Out_opt_ TL_INSPECT_POLICY_INFO* info
+   );
+
+__inline
+const TL_INSPECT_POLICY*
+TLInspectPolicyAcquire(
+   _Out_ KIRQL* oldIrql
+   )
+/* ++
+
+   Returns the current policy snapshot, which stays valid until
+   TLInspectPolicyRelease. The caller must not block in between.
+
+-- */
+{
+   KeRaiseIrql(DISPATCH_LEVEL, oldIrql);
+
+   return (const TL_INSPECT_POLICY*)
+      ReadPointerAcquire((PVOID volatile*)&gInspectPolicy);
+}
+
+__inline
+void
+TLInspectPolicyRelease(
+   _In_ KIRQL oldIrql
+   )
+{
+   KeLowerIrql(oldIrql);
+}
+
+#endif // _TL_INSPECT_POLICY_H_
@@ -0,0 +1,874 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the packet queues shared between the classify
+   functions and the pool of worker threads.
+
+   The queues are the shards of the pended packets: a packet is queued to
+   the shard of its flow (see shard.h), so that the packets of a flow are
+   dequeued, and injected, in order, by one worker at a time. There are
+   more shards than processors, so that classify functions running on
+   different processors seldom contend on a shard. Every shard has an
+   owner worker that is woken when the shard goes from empty to non-empty;
+   a worker that runs out of work of its own takes over the shards of the
+   other workers that no worker holds before it goes back to sleep.
+
+   The producer side of a queue is a bounded lock-free ring: a classify
+   function queues a packet with a single compare-exchange on the ring
+   tail, since classifies on several processors may queue to a shard at a
+   time. Each ring slot carries a sequence number that tells the consumer
+   whether the slot has been published yet. Consumers are serialized by a
+   per-queue spin lock, which a worker takes once to splice up to a quantum
+   of data packets into a list of its own rather than once per packet.
+
+   The owner of a queue is woken when the queue goes from empty to
+   non-empty, unless a wakeup is pending already: the wakeups of a worker
+   are coalesced until it wakes up and looks at its queues again.
+
+   The re-authorizations are queued to a list of their own, under the
+   consumer lock, and dequeued separately from the data packets; the order
+   between the two classes is left to the scheduler of the workers.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "queue.h"
+#include "latency.h"
+#include "stats.h"
+
+TL_INSPECT_PACKET_QUEUE* gPacketQueues;
+ULONG gPacketQueueCount;
+
+TL_INSPECT_QUEUE_SLOT* gQueueRings;
+
+//
+// Protects the producers against TLInspectQuiesceQueues; the cache aware
+// variant keeps a reference count per processor.
+//
+PEX_RUNDOWN_REF_CACHE_AWARE gQueueRundown;
+
+TL_INSPECT_WORKER* gWorkers;
+ULONG gWorkerCount;
+
+TL_INSPECT_SCHED_CONFIG gSchedConfig;
+
+volatile LONG gPacketQueueReauthDepth;
+
+NTSTATUS
+TLInspectInitializeQueues(
+   _In_ ULONG workerCount,
+   _In_ const TL_INSPECT_SCHED_CONFIG* schedConfig
+   )
+/* ++
+
+   This function allocates TL_INSPECT_SHARDS_PER_PROCESSOR packet queues
+   per active processor and the worker descriptors. A workerCount of 0
+   means one worker per processor. The workers schedule their work
+   according to schedConfig.
+
+-- */
+{
+   ULONG processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+   ULONG i;
+   ULONG j;
+
+   gPacketQueueCount = processorCount * TL_INSPECT_SHARDS_PER_PROCESSOR;
+
+   if ((workerCount == 0) || (workerCount > processorCount))
+   {
+      workerCount = processorCount;
+   }
+   if (workerCount > TL_INSPECT_MAX_WORKERS)
+   {
+      workerCount = TL_INSPECT_MAX_WORKERS;
+   }
+
+   gPacketQueues = ExAllocatePoolZero(
+                     NonPagedPool,
+                     gPacketQueueCount * sizeof(TL_INSPECT_PACKET_QUEUE),
+                     TL_INSPECT_QUEUE_POOL_TAG
+                     );
+   gWorkers = ExAllocatePoolZero(
+                NonPagedPool,
+                workerCount * sizeof(TL_INSPECT_WORKER),
+                TL_INSPECT_QUEUE_POOL_TAG
+                );
+   gQueueRings = ExAllocatePoolZero(
+                   NonPagedPool,
+                   (SIZE_T)gPacketQueueCount * TL_INSPECT_QUEUE_RING_SIZE *
+                      sizeof(TL_INSPECT_QUEUE_SLOT),
+                   TL_INSPECT_QUEUE_POOL_TAG
+                   );
+   gQueueRundown = ExAllocateCacheAwareRundownProtection(
+                     NonPagedPool,
+                     TL_INSPECT_QUEUE_POOL_TAG
+                     );
+
+   if ((gPacketQueues == NULL) || (gWorkers == NULL) ||
+       (gQueueRings == NULL) || (gQueueRundown == NULL))
+   {
+      TLInspectFreeQueues();
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   gWorkerCount = workerCount;
+   gSchedConfig = *schedConfig;
+   gPacketQueueReauthDepth = 0;
+
+   for (i = 0; i < gWorkerCount; i++)
+   {
+      gWorkers[i].index = i;
+      InitializeListHead(&gWorkers[i].spliced);
+      KeInitializeEvent(
+         &gWorkers[i].workEvent,
+         SynchronizationEvent,
+         FALSE
+         );
+   }
+
+   for (i = 0; i < gPacketQueueCount; i++)
+   {
+      TL_INSPECT_PACKET_QUEUE* queue = &gPacketQueues[i];
+
+      KeInitializeSpinLock(&queue->consumerLock);
+      InitializeListHead(&queue->overflowList);
+      InitializeListHead(&queue->reauthList);
+      queue->owner = &gWorkers[i % gWorkerCount];
+
+      queue->ring = &gQueueRings[i * TL_INSPECT_QUEUE_RING_SIZE];
+      for (j = 0; j < TL_INSPECT_QUEUE_RING_SIZE; j++)
+      {
+         queue->ring[j].sequence = (LONG)j;
+      }
+   }
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectFreeQueues(void)
+{
+   if (gPacketQueues != NULL)
+   {
+      ExFreePoolWithTag(gPacketQueues, TL_INSPECT_QUEUE_POOL_TAG);
+      gPacketQueues = NULL;
+   }
+   if (gWorkers != NULL)
+   {
+      ExFreePoolWithTag(gWorkers, TL_INSPECT_QUEUE_POOL_TAG);
+      gWorkers = NULL;
+   }
+   if (gQueueRings != NULL)
+   {
+      ExFreePoolWithTag(gQueueRings, TL_INSPECT_QUEUE_POOL_TAG);
+      gQueueRings = NULL;
+   }
+   if (gQueueRundown != NULL)
+   {
+      ExFreeCacheAwareRundownProtection(gQueueRundown);
+      gQueueRundown = NULL;
+   }
+
+   gPacketQueueCount = 0;
+   gWorkerCount = 0;
+}
+
+BOOLEAN
+TLInspectRingPush(
+   _Inout_ TL_INSPECT_PACKET_QUEUE* queue,
+   _In_ TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   This function publishes the packet in a free ring slot. It returns FALSE
+   if the ring is full.
+
+-- */
+{
+   TL_INSPECT_QUEUE_SLOT* slot;
+   LONG position = ReadNoFence(&queue->tail);
+   LONG difference;
+
+   for (;;)
+   {
+      slot = &queue->ring[position & (TL_INSPECT_QUEUE_RING_SIZE - 1)];
+      difference = ReadAcquire(&slot->sequence) - position;
+
+      if (difference == 0)
+      {
+         LONG observed = InterlockedCompareExchange(
+                           &queue->tail,
+                           position + 1,
+                           position
+                           );
+         if (observed == position)
+         {
+            break;
+         }
+         position = observed;
+      }
+      else if (difference < 0)
+      {
+         //
+         // The slot still holds a packet from the previous lap.
+         //
+         return FALSE;
+      }
+      else
+      {
+         position = ReadNoFence(&queue->tail);
+      }
+   }
+
+   slot->packet = packet;
+   WriteRelease(&slot->sequence, position + 1);
+
+   return TRUE;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectRingPop(
+   _Inout_ TL_INSPECT_PACKET_QUEUE* queue
+   )
+/* ++
+
+   This function removes the oldest packet from the ring; the caller holds
+   consumerLock. A slot that has been reserved by a producer but not yet
+   published is waited for (producers publish at DISPATCH_LEVEL right after
+   reserving), so that NULL is only returned when the ring is empty.
+
+-- */
+{
+   TL_INSPECT_QUEUE_SLOT* slot;
+   TL_INSPECT_PENDED_PACKET* packet;
+   LONG position = queue->head;
+
+   slot = &queue->ring[position & (TL_INSPECT_QUEUE_RING_SIZE - 1)];
+
+   while (ReadAcquire(&slot->sequence) != position + 1)
+   {
+      if (ReadNoFence(&queue->tail) == position)
+      {
+         return NULL;
+      }
+      YieldProcessor();
+   }
+
+   packet = slot->packet;
+   slot->packet = NULL;
+   queue->head = position + 1;
+
+   WriteRelease(&slot->sequence, position + TL_INSPECT_QUEUE_RING_SIZE);
+
+   return packet;
+}
+
+__inline
+void
+TLInspectWakeWorker(
+   _Inout_ TL_INSPECT_WORKER* worker
+   )
+/* ++
+
+   This function sets the work event of the worker unless a wakeup is
+   pending already. The worker clears wakePending when it wakes up, before
+   it looks at its queues, so a packet queued while the flag was set is
+   seen by the worker without a wakeup of its own.
+
+-- */
+{
+   if ((ReadNoFence(&worker->wakePending) != FALSE) ||
+       (InterlockedExchange(&worker->wakePending, TRUE) != FALSE))
+   {
+      TLInspectStatsIncrement(dequeue.wakeupsCoalesced);
+      return;
+   }
+
+   TLInspectStatsIncrement(dequeue.wakeups);
+
+   KeSetEvent(&worker->workEvent, 0, FALSE);
+}
+
+BOOLEAN
+TLInspectQueuePacket(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   This function queues a pended packet to the shard of its flow and wakes
+   the owner worker if the shard was empty. It returns FALSE, without
+   queuing the packet, if the driver is being unloaded.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   TL_INSPECT_PACKET_QUEUE* queue;
+   KIRQL oldIrql;
+
+   if (!ExAcquireRundownProtectionCacheAware(gQueueRundown))
+   {
+      return FALSE;
+   }
+
+   packet->enqueueTime = TLInspectLatencyNow();
+
+   //
+   // Keep the window between reserving and publishing a ring slot short.
+   //
+   KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+   queue = TLInspectQueueForFlow(packet->flowHash);
+
+   if (packet->type == TL_INSPECT_REAUTH_PACKET)
+   {
+      KeAcquireInStackQueuedSpinLockAtDpcLevel(
+         &queue->consumerLock,
+         &lockHandle
+         );
+      InsertTailList(&queue->reauthList, &packet->listEntry);
+      queue->reauthDepth++;
+      KeReleaseInStackQueuedSpinLockFromDpcLevel(&lockHandle);
+
+      InterlockedIncrement(&gPacketQueueReauthDepth);
+   }
+   else if ((ReadNoFence(&queue->overflowDepth) != 0) ||
+            !TLInspectRingPush(queue, packet))
+   {
+      //
+      // The ring is full; fall back to the overflow list. Packets in the
+      // overflow list are dequeued after those in the ring, so the ring is
+      // only used again once the overflow list is empty; otherwise a later
+      // packet of a flow would overtake those in the overflow list.
+      //
+      KeAcquireInStackQueuedSpinLockAtDpcLevel(
+         &queue->consumerLock,
+         &lockHandle
+         );
+      InsertTailList(&queue->overflowList, &packet->listEntry);
+      queue->overflowDepth++;
+      KeReleaseInStackQueuedSpinLockFromDpcLevel(&lockHandle);
+   }
+
+   InterlockedAddNoFence64(&queue->bytes, packet->overloadBytes);
+
+   //
+   // depth is only raised once the packet is visible to the consumers, so
+   // exactly one producer sees it go from 0 to 1 after the owner found the
+   // queue empty.
+   //
+   if (InterlockedIncrement(&queue->depth) == 1)
+   {
+      TLInspectWakeWorker(queue->owner);
+   }
+
+   KeLowerIrql(oldIrql);
+
+   ExReleaseRundownProtectionCacheAware(gQueueRundown);
+
+   return TRUE;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectPopPacket(
+   _Inout_ TL_INSPECT_PACKET_QUEUE* queue,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass,
+   _Out_ LONG* remaining
+   )
+/* ++
+
+   This function removes the oldest packet of the class from the queue, or
+   returns NULL if the queue has none. remaining is the number of packets,
+   of both classes, left in the queue.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   TL_INSPECT_PENDED_PACKET* packet;
+
+   *remaining = 0;
+
+   //
+   // Peek without the lock so that scanning idle queues stays cheap. depth
+   // may briefly be <= 0 while a packet is already published; the producer
+   // of that packet then takes depth to 1 and wakes the owner.
+   //
+   if (ReadNoFence(&queue->depth) <= 0)
+   {
+      return NULL;
+   }
+
+   if ((schedClass == TL_INSPECT_SCHED_CLASS_REAUTH) &&
+       (ReadNoFence(&queue->reauthDepth) == 0))
+   {
+      return NULL;
+   }
+
+   KeAcquireInStackQueuedSpinLock(&queue->consumerLock, &lockHandle);
+   TLInspectStatsIncrement(dequeue.lockAcquisitions);
+
+   if (schedClass == TL_INSPECT_SCHED_CLASS_REAUTH)
+   {
+      packet = NULL;
+
+      if (!IsListEmpty(&queue->reauthList))
+      {
+         packet = CONTAINING_RECORD(
+                     RemoveHeadList(&queue->reauthList),
+                     TL_INSPECT_PENDED_PACKET,
+                     listEntry
+                     );
+         queue->reauthDepth--;
+
+         InterlockedDecrement(&gPacketQueueReauthDepth);
+      }
+   }
+   else
+   {
+      packet = TLInspectRingPop(queue);
+
+      if ((packet == NULL) && !IsListEmpty(&queue->overflowList))
+      {
+         packet = CONTAINING_RECORD(
+                     RemoveHeadList(&queue->overflowList),
+                     TL_INSPECT_PENDED_PACKET,
+                     listEntry
+                     );
+         queue->overflowDepth--;
+      }
+   }
+
+   if (packet != NULL)
+   {
+      WriteNoFence64(
+         &queue->delay,
+         (LONG64)(TLInspectLatencyNow() - packet->enqueueTime)
+         );
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   if (packet != NULL)
+   {
+      InterlockedAddNoFence64(&queue->bytes, -(LONG64)packet->overloadBytes);
+      *remaining = InterlockedDecrement(&queue->depth);
+   }
+
+   return packet;
+}
+
+ULONG
+TLInspectSplicePackets(
+   _Inout_ TL_INSPECT_PACKET_QUEUE* queue,
+   _Inout_ LIST_ENTRY* list,
+   _In_ ULONG maxCount
+   )
+/* ++
+
+   This function moves up to maxCount of the oldest data packets of the
+   queue to the tail of list, under a single hold of consumerLock, and
+   returns how many it moved. The delay of the queue is set from the
+   oldest of them.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   TL_INSPECT_PENDED_PACKET* packet;
+   LONG64 bytes = 0;
+   ULONG count = 0;
+
+   //
+   // See TLInspectPopPacket for the peek.
+   //
+   if (ReadNoFence(&queue->depth) <= 0)
+   {
+      return 0;
+   }
+
+   KeAcquireInStackQueuedSpinLock(&queue->consumerLock, &lockHandle);
+   TLInspectStatsIncrement(dequeue.lockAcquisitions);
+
+   while (count < maxCount)
+   {
+      packet = TLInspectRingPop(queue);
+
+      if ((packet == NULL) && !IsListEmpty(&queue->overflowList))
+      {
+         packet = CONTAINING_RECORD(
+                     RemoveHeadList(&queue->overflowList),
+                     TL_INSPECT_PENDED_PACKET,
+                     listEntry
+                     );
+         queue->overflowDepth--;
+      }
+
+      if (packet == NULL)
+      {
+         break;
+      }
+
+      if (count == 0)
+      {
+         WriteNoFence64(
+            &queue->delay,
+            (LONG64)(TLInspectLatencyNow() - packet->enqueueTime)
+            );
+      }
+
+      InsertTailList(list, &packet->listEntry);
+      bytes += packet->overloadBytes;
+      count++;
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   if (count != 0)
+   {
+      InterlockedAddNoFence64(&queue->bytes, -bytes);
+      InterlockedAdd(&queue->depth, -(LONG)count);
+
+      TLInspectStatsIncrement(dequeue.splices);
+      TLInspectStatsAdd(dequeue.splicedPackets, count);
+   }
+
+   return count;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectTakeShardPacket(
+   _Inout_ TL_INSPECT_WORKER* worker,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass
+   )
+/* ++
+
+   This function returns the next packet of the class from the shard the
+   worker holds, or NULL once the shard has none left or the worker has
+   dequeued TL_INSPECT_SHARD_QUANTUM packets from it. Data packets are
+   taken from the list the worker spliced them to, which is refilled from
+   the shard when it is empty.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet = NULL;
+   LONG remaining;
+
+   if (schedClass == TL_INSPECT_SCHED_CLASS_DATA)
+   {
+      if (IsListEmpty(&worker->spliced) && (worker->shardQuantum != 0))
+      {
+         worker->shardQuantum -= TLInspectSplicePackets(
+                                    worker->shard,
+                                    &worker->spliced,
+                                    worker->shardQuantum
+                                    );
+      }
+
+      if (!IsListEmpty(&worker->spliced))
+      {
+         packet = CONTAINING_RECORD(
+                     RemoveHeadList(&worker->spliced),
+                     TL_INSPECT_PENDED_PACKET,
+                     listEntry
+                     );
+      }
+   }
+   else if (worker->shardQuantum != 0)
+   {
+      packet = TLInspectPopPacket(worker->shard, schedClass, &remaining);
+
+      if (packet != NULL)
+      {
+         worker->shardQuantum--;
+      }
+   }
+
+   return packet;
+}
+
+void
+TLInspectKickIdleWorker(
+   _In_ const TL_INSPECT_WORKER* worker
+   )
+/* ++
+
+   This function wakes one idle worker other than the caller so that it
+   takes over the shards the caller has no time for.
+
+-- */
+{
+   ULONG n;
+
+   for (n = 1; n < gWorkerCount; n++)
+   {
+      TL_INSPECT_WORKER* other = &gWorkers[(worker->index + n) % gWorkerCount];
+
+      if (InterlockedCompareExchange(&other->idle, FALSE, TRUE) == TRUE)
+      {
+         KeSetEvent(&other->workEvent, 0, FALSE);
+         break;
+      }
+   }
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectClaimShard(
+   _Inout_ TL_INSPECT_WORKER* worker,
+   _Inout_ TL_INSPECT_PACKET_QUEUE* queue,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass
+   )
+/* ++
+
+   This function claims the shard for the worker if it has packets of the
+   class and no other worker holds it, and returns the first of them. It
+   returns NULL, without holding the shard, otherwise.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet;
+
+   if ((ReadNoFence(&queue->depth) <= 0) ||
+       ((schedClass == TL_INSPECT_SCHED_CLASS_REAUTH) &&
+        (ReadNoFence(&queue->reauthDepth) == 0)))
+   {
+      return NULL;
+   }
+
+   if (!TLInspectShardTryClaim(&queue->claimed))
+   {
+      return NULL;
+   }
+
+   worker->shard = queue;
+   worker->shardQuantum = TL_INSPECT_SHARD_QUANTUM;
+
+   packet = TLInspectTakeShardPacket(worker, schedClass);
+
+   if (packet == NULL)
+   {
+      TLInspectReleaseShard(worker);
+   }
+
+   return packet;
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeuePacket(
+   _Inout_ TL_INSPECT_WORKER* worker,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass
+   )
+/* ++
+
+   This function returns the next packet of the class for the given worker.
+
+   While the worker holds a shard, the packet is taken from that shard, and
+   NULL is returned once the shard has no packet of the class left or the
+   worker has dequeued TL_INSPECT_SHARD_QUANTUM packets from it. Unless it
+   still has spliced packets of the shard to dequeue, the caller then
+   injects the packets it dequeued, releases the shard with
+   TLInspectReleaseShard, and calls again.
+
+   Otherwise the worker claims the first shard with packets of the class
+   that no other worker holds: first among the shards it owns, then among
+   those of the other workers. NULL is returned when there is none.
+
+-- */
+{
+   TL_INSPECT_PACKET_QUEUE* queue;
+   TL_INSPECT_PENDED_PACKET* packet;
+   LONG waiting;
+   ULONG i;
+   ULONG j;
+   ULONG n;
+
+   if (worker->shard != NULL)
+   {
+      return TLInspectTakeShardPacket(worker, schedClass);
+   }
+
+   for (i = worker->index; i < gPacketQueueCount; i += gWorkerCount)
+   {
+      packet = TLInspectClaimShard(worker, &gPacketQueues[i], schedClass);
+
+      if (packet != NULL)
+      {
+         //
+         // The other shards of the worker wait while it drains this one.
+         //
+         waiting = 0;
+         for (j = worker->index; j < gPacketQueueCount; j += gWorkerCount)
+         {
+            if (j != i)
+            {
+               waiting += max(ReadNoFence(&gPacketQueues[j].depth), 0);
+            }
+         }
+
+         if (waiting >= TL_INSPECT_STEAL_THRESHOLD)
+         {
+            TLInspectKickIdleWorker(worker);
+         }
+
+         return packet;
+      }
+   }
+
+   for (n = 1; n < gPacketQueueCount; n++)
+   {
+      queue = &gPacketQueues[(worker->index + n) % gPacketQueueCount];
+
+      if (queue->owner == worker)
+      {
+         continue;
+      }
+
+      packet = TLInspectClaimShard(worker, queue, schedClass);
+
+      if (packet != NULL)
+      {
+         return packet;
+      }
+   }
+
+   return NULL;
+}
+
+void
+TLInspectReleaseShard(
+   _Inout_ TL_INSPECT_WORKER* worker
+   )
+/* ++
+
+   This function releases the shard held by the worker, if any. The packets
+   dequeued from it must have been injected already; only when the driver
+   is being unloaded may spliced packets be left, for
+   TLInspectDequeueAnyPacket to discard.
+
+-- */
+{
+   if (worker->shard != NULL)
+   {
+      TLInspectShardRelease(&worker->shard->claimed);
+      worker->shard = NULL;
+      worker->shardQuantum = 0;
+   }
+}
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeueAnyPacket(void)
+/* ++
+
+   This function returns any queued or spliced packet, or NULL if every
+   queue is empty. It is only called during unload, once every worker
+   thread has exited.
+
+-- */
+{
+   TL_INSPECT_PENDED_PACKET* packet;
+   LONG remaining;
+   ULONG i;
+
+   for (i = 0; i < gWorkerCount; i++)
+   {
+      if (!IsListEmpty(&gWorkers[i].spliced))
+      {
+         return CONTAINING_RECORD(
+                   RemoveHeadList(&gWorkers[i].spliced),
+                   TL_INSPECT_PENDED_PACKET,
+                   listEntry
+                   );
+      }
+   }
+
+   for (i = 0; i < gPacketQueueCount; i++)
+   {
+      packet = TLInspectPopPacket(
+                  &gPacketQueues[i],
+                  TL_INSPECT_SCHED_CLASS_DATA,
+                  &remaining
+                  );
+      if (packet == NULL)
+      {
+         packet = TLInspectPopPacket(
+                     &gPacketQueues[i],
+                     TL_INSPECT_SCHED_CLASS_REAUTH,
+                     &remaining
+                     );
+      }
+
+      if (packet != NULL)
+      {
+         return packet;
+      }
+   }
+
+   return NULL;
+}
+
+LONG
+TLInspectQueueDepth(void)
+/* ++
+
+   This function returns the number of packets queued on all processors.
+   The depths are read without synchronization, so the sum is a sample.
+
+-- */
+{
+   LONG total = 0;
+   ULONG i;
+
+   for (i = 0; i < gPacketQueueCount; i++)
+   {
+      LONG depth = ReadNoFence(&gPacketQueues[i].depth);
+
+      //
+      // See TLInspectPopPacket for why depth may briefly be negative.
+      //
+      if (depth > 0)
+      {
+         total += depth;
+      }
+   }
+
+   return total;
+}
+
+void
+TLInspectQuiesceQueues(void)
+/* ++
+
+   Called during unload. Once it returns every producer that was queuing
+   a packet has finished, and any further TLInspectQueuePacket call fails,
+   so the queues can be drained.
+
+-- */
+{
+   ExWaitForRundownProtectionReleaseCacheAware(gQueueRundown);
+}
+
+void
+TLInspectWakeWorkers(void)
+{
+   ULONG i;
+
+   for (i = 0; i < gWorkerCount; i++)
+   {
+      KeSetEvent(&gWorkers[i].workEvent, IO_NO_INCREMENT, FALSE);
+   }
+
+   KeSetEvent(&gWorkerEvent, IO_NO_INCREMENT, FALSE);
+}
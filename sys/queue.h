@@ -0,0 +1,233 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the packet queues, which are the shards of
+   the pended packets (see shard.h), and the worker thread pool that drains
+   them.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_QUEUE_H_
+#define _TL_INSPECT_QUEUE_H_
+
+#include "layer.h"
+#include "sched.h"
+#include "shard.h"
+
+//
+// Upper bound on the number of worker threads, regardless of the
+// WorkerThreadCount registry value.
+//
+#define TL_INSPECT_MAX_WORKERS 64
+
+//
+// A worker that claims one of its shards and finds at least this many
+// packets queued in its other shards wakes an idle worker to take them
+// over.
+//
+#define TL_INSPECT_STEAL_THRESHOLD 2
+
+//
+// Number of slots in the lock-free ring of each packet queue; must be a
+// power of 2. Packets queued while the ring is full, or while the overflow
+// list of the queue is not empty, go to the overflow list instead.
+//
+#define TL_INSPECT_QUEUE_RING_SIZE 1024
+
+typedef struct TL_INSPECT_WORKER_ TL_INSPECT_WORKER;
+
+typedef struct TL_INSPECT_QUEUE_SLOT_
+{
+   volatile LONG sequence;
+   TL_INSPECT_PENDED_PACKET* packet;
+} TL_INSPECT_QUEUE_SLOT;
+
+//
+// TL_INSPECT_PACKET_QUEUE is a shard of the pended packets. The classify
+// functions push a packet to the shard of its flow, from any processor;
+// each shard is drained by its owner worker, or by any other worker that
+// runs out of work of its own, but by a single worker at a time: the one
+// that set claimed.
+//
+// Producers reserve a ring slot by advancing tail with a compare-exchange
+// and never take a lock unless the ring is full. Consumers are serialized
+// by consumerLock, which also guards head and the overflow list. tail and
+// head are kept on separate cache lines. overflowDepth counts the packets
+// of the overflow list; it is only modified under consumerLock, and may be
+// read without it.
+//
+// Re-authorizations are queued apart from the data packets, to reauthList,
+// so that the workers can schedule them as a class of their own; since
+// they are rare, their producers take consumerLock. depth counts the
+// packets of both classes, reauthDepth those of reauthList; reauthDepth is
+// only modified under consumerLock, and may be read without it.
+//
+// bytes is the memory charged for the queued packets, and delay, in 100ns
+// units, the time the last dequeued packet waited; both are sampled by the
+// overload control.
+//
+typedef struct DECLSPEC_CACHEALIGN TL_INSPECT_PACKET_QUEUE_
+{
+   volatile LONG tail;
+   volatile LONG depth;
+   volatile LONG64 bytes;
+
+   DECLSPEC_CACHEALIGN KSPIN_LOCK consumerLock;
+   LONG head;
+   LIST_ENTRY overflowList;
+   volatile LONG overflowDepth;
+   LIST_ENTRY reauthList;
+   volatile LONG reauthDepth;
+   volatile LONG64 delay;
+   volatile LONG claimed;
+
+   TL_INSPECT_QUEUE_SLOT* ring;
+   TL_INSPECT_WORKER* owner;
+} TL_INSPECT_PACKET_QUEUE;
+
+typedef struct DECLSPEC_CACHEALIGN TL_INSPECT_WORKER_
+{
+   ULONG index;
+
+   //
+   // Auto-reset event set when one of the queues owned by this worker goes
+   // from empty to non-empty, or when another worker asks for help.
+   // wakePending is set by the classify function that sets workEvent, and
+   // cleared by the worker when it wakes up; the classify functions do not
+   // set workEvent again while it is set.
+   //
+   KEVENT workEvent;
+   volatile LONG idle;
+   volatile LONG wakePending;
+
+   //
+   // Only used by the worker thread itself.
+   //
+   TL_INSPECT_SCHEDULER scheduler;
+
+   //
+   // The shard the worker holds, if any, and the number of packets it may
+   // still dequeue from it before releasing it. spliced holds the data
+   // packets taken from the shard in bulk and not yet dequeued.
+   //
+   TL_INSPECT_PACKET_QUEUE* shard;
+   ULONG shardQuantum;
+   LIST_ENTRY spliced;
+
+   void* threadObj;
+} TL_INSPECT_WORKER;
+
+extern TL_INSPECT_PACKET_QUEUE* gPacketQueues;
+extern ULONG gPacketQueueCount;
+
+extern TL_INSPECT_WORKER* gWorkers;
+extern ULONG gWorkerCount;
+
+extern TL_INSPECT_SCHED_CONFIG gSchedConfig;
+
+//
+// Number of re-authorizations queued on all processors, which tells the
+// workers whether to look for them.
+//
+extern volatile LONG gPacketQueueReauthDepth;
+
+__forceinline
+ULONG
+TLInspectFlowHash(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer
+   )
+/* ++
+
+   Returns the hash of the 5-tuple of the classified packet, as filled in
+   by FillNetwork5Tuple, which picks the shard of its flow.
+
+-- */
+{
+   UINT32 localAddr[4] = { 0 };
+   UINT32 remoteAddr[4] = { 0 };
+
+   if (layer->addressFamily == AF_INET)
+   {
+      localAddr[0] =
+         inFixedValues->incomingValue[layer->localAddress].value.uint32;
+      remoteAddr[0] =
+         inFixedValues->incomingValue[layer->remoteAddress].value.uint32;
+   }
+   else
+   {
+      RtlCopyMemory(
+         localAddr,
+         inFixedValues->incomingValue[layer->localAddress].value.byteArray16,
+         sizeof(localAddr)
+         );
+      RtlCopyMemory(
+         remoteAddr,
+         inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16,
+         sizeof(remoteAddr)
+         );
+   }
+
+   return TLInspectShardHash(
+             localAddr,
+             remoteAddr,
+             inFixedValues->incomingValue[layer->localPort].value.uint16,
+             inFixedValues->incomingValue[layer->remotePort].value.uint16,
+             inFixedValues->incomingValue[layer->protocol].value.uint8
+             );
+}
+
+__inline
+TL_INSPECT_PACKET_QUEUE*
+TLInspectQueueForFlow(
+   _In_ ULONG flowHash
+   )
+{
+   return &gPacketQueues[flowHash % gPacketQueueCount];
+}
+
+NTSTATUS
+TLInspectInitializeQueues(
+   _In_ ULONG workerCount,
+   _In_ const TL_INSPECT_SCHED_CONFIG* schedConfig
+   );
+
+void
+TLInspectFreeQueues(void);
+
+BOOLEAN
+TLInspectQueuePacket(
+   _Inout_ TL_INSPECT_PENDED_PACKET* packet
+   );
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeuePacket(
+   _Inout_ TL_INSPECT_WORKER* worker,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass
+   );
+
+void
+TLInspectReleaseShard(
+   _Inout_ TL_INSPECT_WORKER* worker
+   );
+
+TL_INSPECT_PENDED_PACKET*
+TLInspectDequeueAnyPacket(void);
+
+LONG
+TLInspectQueueDepth(void);
+
+void
+TLInspectQuiesceQueues(void);
+
+void
+TLInspectWakeWorkers(void);
+
+#endif // _TL_INSPECT_QUEUE_H_
@@ -0,0 +1,1158 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the inspection rule sets of the Transport Inspect
+   sample.
+
+   Rule sets are built once, at PASSIVE_LEVEL, and only looked up
+   afterwards. A field of n rules has at most 2n + 1 intervals; its vectors
+   are computed by sweeping the intervals in order, setting the bit of a
+   rule at the interval where its range starts and clearing it past the
+   interval where it ends.
+
+   Defining TL_INSPECT_RULES_USER_MODE builds the file for user mode, with
+   the C runtime allocator.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifdef TL_INSPECT_RULES_USER_MODE
+
+#define TLInspectRulesAllocate(size) calloc(1, (size))
+#define TLInspectRulesRelease(memory) free(memory)
+
+#else
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+
+#define TLInspectRulesAllocate(size) \
+   ExAllocatePoolZero(NonPagedPool, (size), TL_INSPECT_RULE_POOL_TAG)
+#define TLInspectRulesRelease(memory) \
+   ExFreePoolWithTag((memory), TL_INSPECT_RULE_POOL_TAG)
+
+#endif
+
+#include "rules.h"
+
+#define TL_INSPECT_RULES_REMOVE 0x80000000
+
+typedef
+BOOLEAN
+TL_INSPECT_RULES_BEFORE(
+   _In_ const void* a,
+   _In_ const void* b
+   );
+
+__inline
+UINT32
+TLInspectRulesPopCount(
+   _In_ UINT64 word
+   )
+{
+   word = word - ((word >> 1) & 0x5555555555555555ull);
+   word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+   word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0full;
+
+   return (UINT32)((word * 0x0101010101010101ull) >> 56);
+}
+
+__inline
+UINT32
+TLInspectRulesLowestBit(
+   _In_ UINT64 word
+   )
+{
+   return TLInspectRulesPopCount((word & (0 - word)) - 1);
+}
+
+__inline
+BOOLEAN
+TLInspectRuleValueBefore(
+   _In_ const TL_INSPECT_RULE_VALUE* a,
+   _In_ const TL_INSPECT_RULE_VALUE* b
+   )
+{
+   return (a->high < b->high) || ((a->high == b->high) && (a->low < b->low));
+}
+
+__inline
+BOOLEAN
+TLInspectRuleValueNext(
+   _In_ const TL_INSPECT_RULE_VALUE* value,
+   _Out_ TL_INSPECT_RULE_VALUE* next
+   )
+/* ++
+
+   Returns FALSE if value is the largest one, which nothing follows.
+
+-- */
+{
+   if ((value->high == ~0ull) && (value->low == ~0ull))
+   {
+      return FALSE;
+   }
+
+   next->high = value->high + ((value->low == ~0ull) ? 1 : 0);
+   next->low = value->low + 1;
+
+   return TRUE;
+}
+
+void
+TLInspectRuleInitialize(
+   _Out_ TL_INSPECT_RULE* rule
+   )
+/* ++
+
+   Makes a rule that matches all traffic, to be inspected.
+
+-- */
+{
+   UINT32 field;
+
+   RtlZeroMemory(rule, sizeof(*rule));
+
+   for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+   {
+      rule->last[field].high = ~0ull;
+      rule->last[field].low = ~0ull;
+   }
+
+   rule->action = TL_INSPECT_RULE_ACTION_INSPECT;
+}
+
+void
+TLInspectRuleValueFromAddress(
+   _Out_ TL_INSPECT_RULE_VALUE* value,
+   _In_ const UINT8* address,
+   _In_ UINT32 addressLength
+   )
+/* ++
+
+   Loads an address (in network order) of addressLength bits, 32 or 128,
+   into a field value.
+
+-- */
+{
+   UINT32 i;
+
+   value->high = 0;
+   value->low = 0;
+
+   if (addressLength == 32)
+   {
+      for (i = 0; i < 4; i++)
+      {
+         value->low = (value->low << 8) | address[i];
+      }
+   }
+   else
+   {
+      for (i = 0; i < 8; i++)
+      {
+         value->high = (value->high << 8) | address[i];
+         value->low = (value->low << 8) | address[8 + i];
+      }
+   }
+}
+
+void
+TLInspectRuleSetPrefix(
+   _Inout_ TL_INSPECT_RULE* rule,
+   _In_ TL_INSPECT_RULE_FIELD field,
+   _In_ const UINT8* address,
+   _In_ UINT32 addressLength,
+   _In_ UINT32 length
+   )
+/* ++
+
+   Restricts an address field of the rule to the prefix of length bits of
+   address (in network order), of addressLength bits: 32 or 128.
+
+-- */
+{
+   TL_INSPECT_RULE_VALUE* first = &rule->first[field];
+   TL_INSPECT_RULE_VALUE* last = &rule->last[field];
+   UINT64 highMask;
+   UINT64 lowMask;
+
+   TLInspectRuleValueFromAddress(first, address, addressLength);
+
+   if (addressLength == 32)
+   {
+      highMask = ~0ull;
+      lowMask = (length == 0) ? 0xffffffff00000000ull : ~0ull << (32 - length);
+   }
+   else
+   {
+      highMask = (length == 0) ? 0 :
+                 (length >= 64) ? ~0ull : ~0ull << (64 - length);
+      lowMask = (length <= 64) ? 0 : ~0ull << (128 - length);
+   }
+
+   first->high &= highMask;
+   first->low &= lowMask;
+   last->high = first->high | (~highMask & ((addressLength == 32) ? 0 : ~0ull));
+   last->low = first->low | (~lowMask & ((addressLength == 32) ? 0xffffffffull : ~0ull));
+}
+
+void
+TLInspectRulesInitialize(
+   _Out_ TL_INSPECT_RULE_SET* set,
+   _In_ UINT32 addressLength
+   )
+{
+   RtlZeroMemory(set, sizeof(*set));
+
+   set->addressLength = addressLength;
+}
+
+UINT32
+TLInspectRulesFieldWidth(
+   _In_ const TL_INSPECT_RULE_SET* set,
+   _In_ TL_INSPECT_RULE_FIELD field
+   )
+{
+   switch (field)
+   {
+   case TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS:
+   case TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS:
+      return set->addressLength;
+   case TL_INSPECT_RULE_FIELD_LOCAL_PORT:
+   case TL_INSPECT_RULE_FIELD_REMOTE_PORT:
+      return 16;
+   case TL_INSPECT_RULE_FIELD_PROTOCOL:
+      return 8;
+   default:
+      return 1;
+   }
+}
+
+__inline
+UINT32
+TLInspectRulesIndexKey(
+   _In_ const TL_INSPECT_RULE_LEVEL* level,
+   _In_ UINT32 width,
+   _In_ const TL_INSPECT_RULE_VALUE* value
+   )
+{
+   return (width > 64) ? (UINT32)(value->high >> (64 - level->indexBits)) :
+                         (UINT32)(value->low >> (width - level->indexBits));
+}
+
+void
+TLInspectRulesFreeLevel(
+   _Inout_ TL_INSPECT_RULE_LEVEL* level
+   )
+{
+   if (level->starts != NULL)
+   {
+      TLInspectRulesRelease(level->starts);
+   }
+   if (level->vectors != NULL)
+   {
+      TLInspectRulesRelease(level->vectors);
+   }
+   if (level->index != NULL)
+   {
+      TLInspectRulesRelease(level->index);
+   }
+
+   RtlZeroMemory(level, sizeof(*level));
+}
+
+void
+TLInspectRulesFreeField(
+   _Inout_ TL_INSPECT_RULE_FIELD_TABLE* table
+   )
+{
+   TLInspectRulesFreeLevel(&table->coarse);
+   TLInspectRulesFreeLevel(&table->fine);
+
+   if (table->pool != NULL)
+   {
+      TLInspectRulesRelease(table->pool);
+   }
+
+   RtlZeroMemory(table, sizeof(*table));
+}
+
+void
+TLInspectRulesFree(
+   _Inout_ TL_INSPECT_RULE_SET* set
+   )
+{
+   UINT32 field;
+
+   for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+   {
+      TLInspectRulesFreeField(&set->fields[field]);
+   }
+
+   if (set->rules != NULL)
+   {
+      TLInspectRulesRelease(set->rules);
+   }
+   if (set->actions != NULL)
+   {
+      TLInspectRulesRelease(set->actions);
+   }
+
+   RtlZeroMemory(set, sizeof(*set));
+}
+
+BOOLEAN
+TLInspectRulesAdd(
+   _Inout_ TL_INSPECT_RULE_SET* set,
+   _In_ const TL_INSPECT_RULE* rule
+   )
+/* ++
+
+   This function adds a copy of the rule to a rule set that is not built
+   yet, growing its rule array by doubling.
+
+-- */
+{
+   if (set->built)
+   {
+      return FALSE;
+   }
+
+   if (set->ruleCount == set->ruleCapacity)
+   {
+      TL_INSPECT_RULE* rules;
+      UINT32 capacity = (set->ruleCapacity == 0) ? 16 : set->ruleCapacity * 2;
+
+      if (set->ruleCapacity > MAXUINT32 / 2 / sizeof(TL_INSPECT_RULE))
+      {
+         return FALSE;
+      }
+
+      rules = TLInspectRulesAllocate((SIZE_T)capacity * sizeof(TL_INSPECT_RULE));
+      if (rules == NULL)
+      {
+         return FALSE;
+      }
+
+      if (set->rules != NULL)
+      {
+         RtlCopyMemory(
+            rules,
+            set->rules,
+            (SIZE_T)set->ruleCount * sizeof(TL_INSPECT_RULE)
+            );
+         TLInspectRulesRelease(set->rules);
+      }
+
+      set->rules = rules;
+      set->ruleCapacity = capacity;
+   }
+
+   set->rules[set->ruleCount] = *rule;
+   set->rules[set->ruleCount].order = set->ruleCount;
+   set->ruleCount++;
+
+   return TRUE;
+}
+
+BOOLEAN
+TLInspectRulesRuleBefore(
+   _In_ const void* a,
+   _In_ const void* b
+   )
+{
+   const TL_INSPECT_RULE* ruleA = a;
+   const TL_INSPECT_RULE* ruleB = b;
+
+   if (ruleA->priority != ruleB->priority)
+   {
+      return ruleA->priority < ruleB->priority;
+   }
+
+   return ruleA->order < ruleB->order;
+}
+
+BOOLEAN
+TLInspectRulesValueBefore(
+   _In_ const void* a,
+   _In_ const void* b
+   )
+{
+   return TLInspectRuleValueBefore(a, b);
+}
+
+void
+TLInspectRulesSort(
+   _Inout_ void* elements,
+   _In_ UINT32 count,
+   _In_ SIZE_T size,
+   _In_ TL_INSPECT_RULES_BEFORE* before
+   )
+/* ++
+
+   Heap sort of count elements of size bytes, at most sizeof(TL_INSPECT_RULE):
+   in place and without recursion, whatever the input.
+
+-- */
+{
+   UINT8* base = elements;
+   UINT8 swap[sizeof(TL_INSPECT_RULE)];
+   UINT32 start = count / 2;
+   UINT32 end = count;
+
+   NT_ASSERT(size <= sizeof(swap));
+
+   while (end > 1)
+   {
+      UINT32 root;
+
+      if (start > 0)
+      {
+         start--;
+      }
+      else
+      {
+         end--;
+         RtlCopyMemory(swap, base, size);
+         RtlCopyMemory(base, base + end * size, size);
+         RtlCopyMemory(base + end * size, swap, size);
+      }
+
+      root = start;
+
+      for (;;)
+      {
+         UINT32 child = 2 * root + 1;
+
+         if (child >= end)
+         {
+            break;
+         }
+         if ((child + 1 < end) &&
+             before(base + child * size, base + (child + 1) * size))
+         {
+            child++;
+         }
+         if (!before(base + root * size, base + child * size))
+         {
+            break;
+         }
+
+         RtlCopyMemory(swap, base + root * size, size);
+         RtlCopyMemory(base + root * size, base + child * size, size);
+         RtlCopyMemory(base + child * size, swap, size);
+         root = child;
+      }
+   }
+}
+
+UINT32
+TLInspectRulesSearchInterval(
+   _In_ const TL_INSPECT_RULE_LEVEL* level,
+   _In_ const TL_INSPECT_RULE_VALUE* value,
+   _In_ UINT32 first,
+   _In_ UINT32 last
+   )
+/* ++
+
+   Returns the index of the interval that contains value, knowing that it
+   is at least first - 1 and that the interval last starts after value.
+
+-- */
+{
+   while (first < last)
+   {
+      UINT32 middle = first + (last - first) / 2;
+
+      if (TLInspectRuleValueBefore(value, &level->starts[middle]))
+      {
+         last = middle;
+      }
+      else
+      {
+         first = middle + 1;
+      }
+   }
+
+   return first - 1;
+}
+
+__inline
+UINT32
+TLInspectRulesFindInterval(
+   _In_ const TL_INSPECT_RULE_LEVEL* level,
+   _In_ UINT32 width,
+   _In_ const TL_INSPECT_RULE_VALUE* value
+   )
+/* ++
+
+   Returns the index of the interval that contains value: the last one
+   that starts before it, among the intervals that start with the same top
+   bits, or else the interval before them.
+
+-- */
+{
+   UINT32 key = TLInspectRulesIndexKey(level, width, value);
+
+   return TLInspectRulesSearchInterval(
+             level,
+             value,
+             max(level->index[key], 1),
+             level->index[key + 1]
+             );
+}
+
+UINT32
+TLInspectRulesCompress(
+   _In_ const TL_INSPECT_RULE_SET* set,
+   _In_reads_(set->vectorWords) const UINT64* dense,
+   _Out_ UINT64* vector
+   )
+/* ++
+
+   Writes the stored form of a vector (see TL_INSPECT_RULE_FIELD_TABLE)
+   and returns its size in words.
+
+-- */
+{
+   UINT32 aggregateWords = set->aggregateWords;
+   UINT32 size = 2 * aggregateWords;
+   UINT32 word;
+
+   RtlZeroMemory(vector, size * sizeof(UINT64));
+
+   for (word = 0; word < set->vectorWords; word++)
+   {
+      if ((word % 64) == 0)
+      {
+         vector[aggregateWords + word / 64] = size - 2 * aggregateWords;
+      }
+
+      if (dense[word] != 0)
+      {
+         vector[word / 64] |= 1ull << (word % 64);
+         vector[size++] = dense[word];
+      }
+   }
+
+   return size;
+}
+
+BOOLEAN
+TLInspectRulesAddVector(
+   _Inout_ TL_INSPECT_RULE_FIELD_TABLE* table,
+   _In_reads_(size) const UINT64* vector,
+   _In_ UINT32 size
+   )
+/* ++
+
+   Appends a vector to the pool of the field, growing it by doubling.
+
+-- */
+{
+   if (table->poolCapacity - table->poolSize < size)
+   {
+      UINT64* pool;
+      UINT32 capacity = max(table->poolCapacity, 1024);
+
+      while (capacity - table->poolSize < size)
+      {
+         if (capacity > MAXUINT32 / 2 / sizeof(UINT64))
+         {
+            return FALSE;
+         }
+         capacity *= 2;
+      }
+
+      pool = TLInspectRulesAllocate((SIZE_T)capacity * sizeof(UINT64));
+      if (pool == NULL)
+      {
+         return FALSE;
+      }
+
+      if (table->pool != NULL)
+      {
+         RtlCopyMemory(pool, table->pool, (SIZE_T)table->poolSize * sizeof(UINT64));
+         TLInspectRulesRelease(table->pool);
+      }
+
+      table->pool = pool;
+      table->poolCapacity = capacity;
+   }
+
+   RtlCopyMemory(&table->pool[table->poolSize], vector, size * sizeof(UINT64));
+   table->poolSize += size;
+
+   return TRUE;
+}
+
+BOOLEAN
+TLInspectRulesNext(
+   _In_ const TL_INSPECT_RULE_SET* set,
+   _In_ TL_INSPECT_RULE_FIELD field,
+   _In_ const TL_INSPECT_RULE* rule,
+   _Out_ TL_INSPECT_RULE_VALUE* next
+   )
+/* ++
+
+   Returns the value that follows the range of the rule in the field, or
+   FALSE if the range ends the values of the field.
+
+-- */
+{
+   UINT32 width = TLInspectRulesFieldWidth(set, field);
+
+   if (!TLInspectRuleValueNext(&rule->last[field], next))
+   {
+      return FALSE;
+   }
+
+   return (width > 64) || ((next->high == 0) && (next->low >> width) == 0);
+}
+
+BOOLEAN
+TLInspectRulesIsAny(
+   _In_ const TL_INSPECT_RULE_SET* set,
+   _In_ TL_INSPECT_RULE_FIELD field,
+   _In_ const TL_INSPECT_RULE* rule
+   )
+/* ++
+
+   Returns TRUE if the range of the rule covers every value of the field.
+
+-- */
+{
+   TL_INSPECT_RULE_VALUE next;
+
+   return (rule->first[field].high == 0) && (rule->first[field].low == 0) &&
+          !TLInspectRulesNext(set, field, rule, &next);
+}
+
+BOOLEAN
+TLInspectRulesBuildLevel(
+   _Inout_ TL_INSPECT_RULE_SET* set,
+   _In_ TL_INSPECT_RULE_FIELD field,
+   _Inout_updates_(set->ruleCount) UINT8* wide,
+   _In_ BOOLEAN coarse
+   )
+/* ++
+
+   This function computes the intervals of a level of a field and their
+   vectors, for the rules of the set sorted by rank. The fine level is
+   built first and delimited by the ranges of all the rules; it marks in
+   wide the rules that belong to the coarse level instead.
+
+-- */
+{
+   TL_INSPECT_RULE_FIELD_TABLE* table = &set->fields[field];
+   TL_INSPECT_RULE_LEVEL* level = coarse ? &table->coarse : &table->fine;
+   UINT32 width = TLInspectRulesFieldWidth(set, field);
+   UINT32 ruleCount = set->ruleCount;
+   UINT32* eventFirst = NULL;
+   UINT32* events = NULL;
+   UINT32* offsets = NULL;
+   UINT32* slots = NULL;
+   UINT64* dense = NULL;
+   UINT64* vector = NULL;
+   UINT32 vectorCount = 0;
+   UINT32 slotMask;
+   UINT32 count;
+   UINT32 key;
+   UINT32 rule;
+   UINT32 i;
+   UINT32 j;
+   BOOLEAN success = FALSE;
+
+   //
+   // Every interval starts at 0, at the start of a range, or right after
+   // the end of one.
+   //
+   level->starts = TLInspectRulesAllocate(
+                      ((SIZE_T)ruleCount * 2 + 1) * sizeof(TL_INSPECT_RULE_VALUE)
+                      );
+   if (level->starts == NULL)
+   {
+      goto Exit;
+   }
+
+   count = 1;
+
+   for (rule = 0; rule < ruleCount; rule++)
+   {
+      if (TLInspectRulesIsAny(set, field, &set->rules[rule]) ||
+          (coarse && !wide[rule]))
+      {
+         continue;
+      }
+
+      level->starts[count++] = set->rules[rule].first[field];
+
+      if (TLInspectRulesNext(set, field, &set->rules[rule], &level->starts[count]))
+      {
+         count++;
+      }
+   }
+
+   TLInspectRulesSort(
+      level->starts,
+      count,
+      sizeof(TL_INSPECT_RULE_VALUE),
+      TLInspectRulesValueBefore
+      );
+
+   for (i = 1, j = 1; i < count; i++)
+   {
+      if (TLInspectRuleValueBefore(&level->starts[j - 1], &level->starts[i]))
+      {
+         level->starts[j++] = level->starts[i];
+      }
+   }
+
+   level->intervalCount = j;
+
+   eventFirst = TLInspectRulesAllocate(
+                   ((SIZE_T)level->intervalCount + 2) * sizeof(UINT32)
+                   );
+   events = TLInspectRulesAllocate(((SIZE_T)ruleCount * 2 + 1) * sizeof(UINT32));
+   level->vectors = TLInspectRulesAllocate(
+                       (SIZE_T)level->intervalCount * sizeof(UINT32)
+                       );
+   offsets = TLInspectRulesAllocate((SIZE_T)level->intervalCount * sizeof(UINT32));
+   dense = TLInspectRulesAllocate(((SIZE_T)set->vectorWords + 1) * sizeof(UINT64));
+   vector = TLInspectRulesAllocate(
+               ((SIZE_T)set->vectorWords + 2 * set->aggregateWords) * sizeof(UINT64)
+               );
+
+   slotMask = 1;
+   while (slotMask < level->intervalCount * 2)
+   {
+      slotMask *= 2;
+   }
+   slots = TLInspectRulesAllocate((SIZE_T)slotMask * sizeof(UINT32));
+   slotMask--;
+
+   if ((eventFirst == NULL) || (events == NULL) || (level->vectors == NULL) ||
+       (offsets == NULL) || (dense == NULL) || (vector == NULL) ||
+       (slots == NULL))
+   {
+      goto Exit;
+   }
+
+   //
+   // Bucket the starts and ends of the ranges of the level by interval.
+   // Bucket i of events is events[eventFirst[i]] to
+   // events[eventFirst[i + 1] - 1].
+   //
+   for (rule = 0; rule < ruleCount; rule++)
+   {
+      TL_INSPECT_RULE_VALUE next;
+      UINT32 first = TLInspectRulesSearchInterval(
+                        level,
+                        &set->rules[rule].first[field],
+                        1,
+                        level->intervalCount
+                        );
+      UINT32 last = level->intervalCount;
+
+      if (TLInspectRulesNext(set, field, &set->rules[rule], &next))
+      {
+         last = TLInspectRulesSearchInterval(level, &next, 1, level->intervalCount);
+      }
+
+      if (!coarse)
+      {
+         wide[rule] = TLInspectRulesIsAny(set, field, &set->rules[rule]) ||
+                      (last - first > TL_INSPECT_RULES_NARROW_INTERVALS);
+      }
+
+      if (wide[rule] != coarse)
+      {
+         continue;
+      }
+
+      eventFirst[first + 2]++;
+
+      if (last < level->intervalCount)
+      {
+         eventFirst[last + 2]++;
+      }
+   }
+
+   for (i = 2; i < level->intervalCount + 2; i++)
+   {
+      eventFirst[i] += eventFirst[i - 1];
+   }
+
+   for (rule = 0; rule < ruleCount; rule++)
+   {
+      TL_INSPECT_RULE_VALUE next;
+
+      if (wide[rule] != coarse)
+      {
+         continue;
+      }
+
+      i = TLInspectRulesSearchInterval(
+             level,
+             &set->rules[rule].first[field],
+             1,
+             level->intervalCount
+             );
+      events[eventFirst[i + 1]++] = rule;
+
+      if (TLInspectRulesNext(set, field, &set->rules[rule], &next))
+      {
+         i = TLInspectRulesSearchInterval(level, &next, 1, level->intervalCount);
+         events[eventFirst[i + 1]++] = rule | TL_INSPECT_RULES_REMOVE;
+      }
+   }
+
+   //
+   // Sweep the intervals, storing each distinct vector once.
+   //
+   for (i = 0; i < level->intervalCount; i++)
+   {
+      UINT64 hash = 0xcbf29ce484222325ull;
+      UINT32 size;
+      UINT32 slot;
+
+      for (j = eventFirst[i]; j < eventFirst[i + 1]; j++)
+      {
+         rule = events[j] & ~TL_INSPECT_RULES_REMOVE;
+
+         if (events[j] & TL_INSPECT_RULES_REMOVE)
+         {
+            dense[rule / 64] &= ~(1ull << (rule % 64));
+         }
+         else
+         {
+            dense[rule / 64] |= 1ull << (rule % 64);
+         }
+      }
+
+      size = TLInspectRulesCompress(set, dense, vector);
+
+      for (j = 0; j < size; j++)
+      {
+         hash = (hash ^ vector[j]) * 0x100000001b3ull;
+      }
+
+      for (slot = (UINT32)hash & slotMask; ; slot = (slot + 1) & slotMask)
+      {
+         UINT64* stored;
+         UINT32 storedSize;
+
+         if (slots[slot] == 0)
+         {
+            offsets[vectorCount] = table->poolSize;
+
+            if (!TLInspectRulesAddVector(table, vector, size))
+            {
+               goto Exit;
+            }
+
+            slots[slot] = ++vectorCount;
+            break;
+         }
+
+         stored = &table->pool[offsets[slots[slot] - 1]];
+         storedSize = 2 * set->aggregateWords +
+                      (UINT32)stored[2 * set->aggregateWords - 1] +
+                      TLInspectRulesPopCount(stored[set->aggregateWords - 1]);
+
+         if ((storedSize == size) &&
+             (RtlCompareMemory(stored, vector, size * sizeof(UINT64)) ==
+              size * sizeof(UINT64)))
+         {
+            break;
+         }
+      }
+
+      level->vectors[i] = offsets[slots[slot] - 1];
+   }
+
+   //
+   // Merge the intervals that have the vector of the one before.
+   //
+   for (i = 1, j = 1; i < level->intervalCount; i++)
+   {
+      if (level->vectors[i] != level->vectors[j - 1])
+      {
+         level->starts[j] = level->starts[i];
+         level->vectors[j] = level->vectors[i];
+         j++;
+      }
+   }
+
+   level->intervalCount = j;
+
+   //
+   // Index the intervals by the top bits of their start.
+   //
+   level->indexBits = min(width, TL_INSPECT_RULES_INDEX_BITS);
+   level->index = TLInspectRulesAllocate(
+                     (((SIZE_T)1 << level->indexBits) + 1) * sizeof(UINT32)
+                     );
+   if (level->index == NULL)
+   {
+      goto Exit;
+   }
+
+   for (key = 0, i = 0; key <= (1u << level->indexBits); key++)
+   {
+      while ((i < level->intervalCount) &&
+             (TLInspectRulesIndexKey(level, width, &level->starts[i]) < key))
+      {
+         i++;
+      }
+      level->index[key] = i;
+   }
+
+   success = TRUE;
+
+Exit:
+
+   if (eventFirst != NULL)
+   {
+      TLInspectRulesRelease(eventFirst);
+   }
+   if (events != NULL)
+   {
+      TLInspectRulesRelease(events);
+   }
+   if (offsets != NULL)
+   {
+      TLInspectRulesRelease(offsets);
+   }
+   if (slots != NULL)
+   {
+      TLInspectRulesRelease(slots);
+   }
+   if (dense != NULL)
+   {
+      TLInspectRulesRelease(dense);
+   }
+   if (vector != NULL)
+   {
+      TLInspectRulesRelease(vector);
+   }
+
+   return success;
+}
+
+BOOLEAN
+TLInspectRulesBuildField(
+   _Inout_ TL_INSPECT_RULE_SET* set,
+   _In_ TL_INSPECT_RULE_FIELD field
+   )
+{
+   UINT8* wide;
+   BOOLEAN success;
+
+   wide = TLInspectRulesAllocate(set->ruleCount);
+   if (wide == NULL)
+   {
+      return FALSE;
+   }
+
+   success = TLInspectRulesBuildLevel(set, field, wide, FALSE) &&
+             TLInspectRulesBuildLevel(set, field, wide, TRUE);
+
+   TLInspectRulesRelease(wide);
+
+   return success;
+}
+
+BOOLEAN
+TLInspectRulesBuild(
+   _Inout_ TL_INSPECT_RULE_SET* set
+   )
+/* ++
+
+   This function compiles the rules added so far, after which the set can
+   be looked up but no longer added to.
+
+-- */
+{
+   UINT32 field;
+   UINT32 rule;
+
+   if (set->built)
+   {
+      return TRUE;
+   }
+
+   if (set->ruleCount == 0)
+   {
+      set->built = TRUE;
+      return TRUE;
+   }
+
+   TLInspectRulesSort(
+      set->rules,
+      set->ruleCount,
+      sizeof(TL_INSPECT_RULE),
+      TLInspectRulesRuleBefore
+      );
+
+   set->vectorWords = (set->ruleCount + 63) / 64;
+   set->aggregateWords = (set->vectorWords + 63) / 64;
+
+   set->actions = TLInspectRulesAllocate(set->ruleCount);
+   if (set->actions == NULL)
+   {
+      goto Exit;
+   }
+
+   for (rule = 0; rule < set->ruleCount; rule++)
+   {
+      set->actions[rule] = (UINT8)set->rules[rule].action;
+   }
+
+   for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+   {
+      if (!TLInspectRulesBuildField(set, (TL_INSPECT_RULE_FIELD)field))
+      {
+         goto Exit;
+      }
+   }
+
+   TLInspectRulesRelease(set->rules);
+   set->rules = NULL;
+   set->ruleCapacity = 0;
+   set->built = TRUE;
+
+   return TRUE;
+
+Exit:
+
+   for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+   {
+      TLInspectRulesFreeField(&set->fields[field]);
+   }
+
+   if (set->actions != NULL)
+   {
+      TLInspectRulesRelease(set->actions);
+      set->actions = NULL;
+   }
+
+   return FALSE;
+}
+
+__inline
+UINT64
+TLInspectRulesWord(
+   _In_ const UINT64* vector,
+   _In_ UINT32 aggregateWords,
+   _In_ UINT32 aggregate,
+   _In_ UINT32 bit
+   )
+/* ++
+
+   Returns the word of a stored vector for the given bit of its aggregate
+   words.
+
+-- */
+{
+   UINT64 mask = 1ull << bit;
+
+   if ((vector[aggregate] & mask) == 0)
+   {
+      return 0;
+   }
+
+   return vector[2 * aggregateWords +
+                 (UINT32)vector[aggregateWords + aggregate] +
+                 TLInspectRulesPopCount(vector[aggregate] & (mask - 1))];
+}
+
+BOOLEAN
+TLInspectRulesLookup(
+   _In_ const TL_INSPECT_RULE_SET* set,
+   _In_reads_(TL_INSPECT_RULE_FIELD_COUNT) const TL_INSPECT_RULE_VALUE* values,
+   _Out_ TL_INSPECT_RULE_ACTION* action
+   )
+/* ++
+
+   Returns TRUE, and the action of the matching rule of highest priority,
+   if a rule matches the field values.
+
+   The aggregate words of the fields are ANDed first: a word of the rule
+   vectors can only have a bit left if every field stores it, in the
+   vector of its fine or of its coarse interval. Words are visited by
+   rank, so the first bit left is the answer.
+
+-- */
+{
+   const UINT64* fineVectors[TL_INSPECT_RULE_FIELD_COUNT];
+   const UINT64* coarseVectors[TL_INSPECT_RULE_FIELD_COUNT];
+   UINT32 aggregateWords = set->aggregateWords;
+   UINT32 field;
+   UINT32 aggregate;
+
+   if (!set->built || (set->ruleCount == 0))
+   {
+      return FALSE;
+   }
+
+   for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+   {
+      const TL_INSPECT_RULE_FIELD_TABLE* table = &set->fields[field];
+      UINT32 width = TLInspectRulesFieldWidth(set, field);
+
+      fineVectors[field] = &table->pool[table->fine.vectors[
+         TLInspectRulesFindInterval(&table->fine, width, &values[field])]];
+      coarseVectors[field] = &table->pool[table->coarse.vectors[
+         TLInspectRulesFindInterval(&table->coarse, width, &values[field])]];
+   }
+
+   for (aggregate = 0; aggregate < aggregateWords; aggregate++)
+   {
+      UINT64 candidates = ~0ull;
+
+      for (field = 0; field < TL_INSPECT_RULE_FIELD_COUNT; field++)
+      {
+         candidates &= fineVectors[field][aggregate] | coarseVectors[field][aggregate];
+      }
+
+      while (candidates != 0)
+      {
+         UINT32 bit = TLInspectRulesLowestBit(candidates);
+         UINT64 word = ~0ull;
+
+         for (field = 0; (field < TL_INSPECT_RULE_FIELD_COUNT) && (word != 0); field++)
+         {
+            word &= TLInspectRulesWord(fineVectors[field], aggregateWords, aggregate, bit) |
+                    TLInspectRulesWord(coarseVectors[field], aggregateWords, aggregate, bit);
+         }
+
+         if (word != 0)
+         {
+            UINT32 rank = (aggregate * 64 + bit) * 64 + TLInspectRulesLowestBit(word);
+
+            *action = (TL_INSPECT_RULE_ACTION)set->actions[rank];
+            return TRUE;
+         }
+
+         candidates &= candidates - 1;
+      }
+   }
+
+   return FALSE;
+}
@@ -0,0 +1,190 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the inspection rule sets of the Transport
+   Inspect sample: prioritized rules over the local and remote address
+   ranges, the local and remote port ranges, the protocol and the
+   direction of the traffic, deciding whether it is inspected, permitted or
+   blocked.
+
+   A rule set is compiled into a bit-vector classifier. Each field splits
+   its value space into the intervals over which the set of matching rules
+   does not change, and holds for each interval the bit vector of these
+   rules, ranked by priority. A lookup searches the interval of each field
+   and ANDs the vectors; the first bit left is the matching rule of highest
+   priority. Identical vectors are stored once, and only their nonzero
+   words are stored, along with an aggregate bit per word, so that the
+   lookup only visits the words set in every field. The rules with wide
+   ranges, such as wildcards, are kept in separate, coarser intervals, so
+   that they do not fill every vector of the field.
+
+   The rule sets do not depend on WFP, so that they can be built and
+   measured in user mode (see bench\rulebench.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_RULES_H_
+#define _TL_INSPECT_RULES_H_
+
+#define TL_INSPECT_RULES_INDEX_BITS 16
+#define TL_INSPECT_RULES_NARROW_INTERVALS 64
+
+typedef enum TL_INSPECT_RULE_FIELD_
+{
+   TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS,
+   TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS,
+   TL_INSPECT_RULE_FIELD_LOCAL_PORT,
+   TL_INSPECT_RULE_FIELD_REMOTE_PORT,
+   TL_INSPECT_RULE_FIELD_PROTOCOL,
+   TL_INSPECT_RULE_FIELD_DIRECTION,
+   TL_INSPECT_RULE_FIELD_COUNT
+} TL_INSPECT_RULE_FIELD;
+
+typedef enum TL_INSPECT_RULE_ACTION_
+{
+   TL_INSPECT_RULE_ACTION_INSPECT,
+   TL_INSPECT_RULE_ACTION_PERMIT,
+   TL_INSPECT_RULE_ACTION_BLOCK
+} TL_INSPECT_RULE_ACTION;
+
+//
+// TL_INSPECT_RULE_VALUE is the value of a field, up to 128 bits. IPv4
+// addresses, ports and the protocol are held in host order in low; the
+// direction is an FWP_DIRECTION.
+//
+typedef struct TL_INSPECT_RULE_VALUE_
+{
+   UINT64 high;
+   UINT64 low;
+} TL_INSPECT_RULE_VALUE;
+
+//
+// TL_INSPECT_RULE matches the traffic whose fields are all within
+// [first, last]. Of the matching rules, the one with the lowest priority
+// number wins, then the first added.
+//
+typedef struct TL_INSPECT_RULE_
+{
+   TL_INSPECT_RULE_VALUE first[TL_INSPECT_RULE_FIELD_COUNT];
+   TL_INSPECT_RULE_VALUE last[TL_INSPECT_RULE_FIELD_COUNT];
+   UINT32 priority;
+   UINT32 order;
+   TL_INSPECT_RULE_ACTION action;
+} TL_INSPECT_RULE;
+
+//
+// TL_INSPECT_RULE_LEVEL holds intervals of a field, sorted by their start,
+// and for each interval the offset of its vector in the pool of the field.
+// The intervals whose start has the top indexBits bits i of the field are
+// starts[index[i]] to starts[index[i + 1] - 1].
+//
+typedef struct TL_INSPECT_RULE_LEVEL_
+{
+   TL_INSPECT_RULE_VALUE* starts;
+   UINT32* vectors;
+   UINT32 intervalCount;
+
+   UINT32* index;
+   UINT32 indexBits;
+} TL_INSPECT_RULE_LEVEL;
+
+//
+// TL_INSPECT_RULE_FIELD_TABLE splits the rules of a field in two levels:
+// the rules whose range covers more than TL_INSPECT_RULES_NARROW_INTERVALS
+// intervals, or all values, are in the coarse level, delimited by their
+// ranges only; the others are in the fine level. The vector of a value is
+// the OR of the vectors of its intervals in both levels.
+//
+// A vector is made of aggregateWords words with a bit per nonzero word of
+// the vector, aggregateWords words with the number of nonzero words before
+// each of them, and the nonzero words.
+//
+typedef struct TL_INSPECT_RULE_FIELD_TABLE_
+{
+   TL_INSPECT_RULE_LEVEL coarse;
+   TL_INSPECT_RULE_LEVEL fine;
+
+   UINT64* pool;
+   UINT32 poolSize;
+   UINT32 poolCapacity;
+} TL_INSPECT_RULE_FIELD_TABLE;
+
+//
+// TL_INSPECT_RULE_SET collects rules for addresses of addressLength bits,
+// 32 or 128, until it is built; rules[] is then freed and actions[] holds
+// the action of each rule by rank.
+//
+typedef struct TL_INSPECT_RULE_SET_
+{
+   UINT32 addressLength;
+
+   TL_INSPECT_RULE* rules;
+   UINT32 ruleCount;
+   UINT32 ruleCapacity;
+
+   UINT8* actions;
+   UINT32 vectorWords;
+   UINT32 aggregateWords;
+   BOOLEAN built;
+
+   TL_INSPECT_RULE_FIELD_TABLE fields[TL_INSPECT_RULE_FIELD_COUNT];
+} TL_INSPECT_RULE_SET;
+
+void
+TLInspectRuleInitialize(
+   _Out_ TL_INSPECT_RULE* rule
+   );
+
+void
+TLInspectRuleValueFromAddress(
+   _Out_ TL_INSPECT_RULE_VALUE* value,
+   _In_ const UINT8* address,
+   _In_ UINT32 addressLength
+   );
+
+void
+TLInspectRuleSetPrefix(
+   _Inout_ TL_INSPECT_RULE* rule,
+   _In_ TL_INSPECT_RULE_FIELD field,
+   _In_ const UINT8* address,
+   _In_ UINT32 addressLength,
+   _In_ UINT32 length
+   );
+
+void
+TLInspectRulesInitialize(
+   _Out_ TL_INSPECT_RULE_SET* set,
+   _In_ UINT32 addressLength
+   );
+
+void
+TLInspectRulesFree(
+   _Inout_ TL_INSPECT_RULE_SET* set
+   );
+
+BOOLEAN
+TLInspectRulesAdd(
+   _Inout_ TL_INSPECT_RULE_SET* set,
+   _In_ const TL_INSPECT_RULE* rule
+   );
+
+BOOLEAN
+TLInspectRulesBuild(
+   _Inout_ TL_INSPECT_RULE_SET* set
+   );
+
+BOOLEAN
+TLInspectRulesLookup(
+   _In_ const TL_INSPECT_RULE_SET* set,
+   _In_reads_(TL_INSPECT_RULE_FIELD_COUNT) const TL_INSPECT_RULE_VALUE* values,
+   _Out_ TL_INSPECT_RULE_ACTION* action
+   );
+
+#endif // _TL_INSPECT_RULES_H_
@@ -0,0 +1,139 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the scheduler of the worker threads of the
+   Transport Inspect sample, which picks the class of the next work a
+   worker dequeues: a pended connect, a re-authorization or a packet of an
+   established flow.
+
+   The classes are served in weighted round robin: while it has work, a
+   class is served weight times in a row before the next class is. So that
+   the latency of a class stays bounded whatever the load of the others, a
+   class that has had work but was not served for longer than its deadline
+   is served first; of several such classes, the one furthest past its
+   deadline is.
+
+   The scheduler does not depend on WFP, so that it can be run in user
+   mode (see bench\schedbench.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_SCHED_H_
+#define _TL_INSPECT_SCHED_H_
+
+#include "inspectioctl.h"
+
+#define TL_INSPECT_SCHED_CLASS_BIT(schedClass) (1UL << (schedClass))
+
+//
+// TL_INSPECT_SCHED_CONFIG holds the weight of each class, at least 1, and
+// its deadline in 100ns units; a deadline of 0 is not enforced. The
+// weights count the work dequeued, not the time spent on it: completing a
+// connect costs several times as much as injecting a data packet.
+//
+typedef struct TL_INSPECT_SCHED_CONFIG_
+{
+   ULONG weight[TL_INSPECT_SCHED_CLASS_MAX];
+   UINT64 deadline[TL_INSPECT_SCHED_CLASS_MAX];
+} TL_INSPECT_SCHED_CONFIG;
+
+//
+// TL_INSPECT_SCHEDULER is the state of the scheduler of one worker.
+// current is the class being served in the round, and credit the number
+// of times it may still be. waitingSince is, for each class, the time it
+// was last served or last found without work.
+//
+typedef struct TL_INSPECT_SCHEDULER_
+{
+   ULONG current;
+   ULONG credit;
+   UINT64 waitingSince[TL_INSPECT_SCHED_CLASS_MAX];
+} TL_INSPECT_SCHEDULER;
+
+__inline
+TL_INSPECT_SCHED_CLASS
+TLInspectSchedulerPick(
+   _In_ const TL_INSPECT_SCHED_CONFIG* config,
+   _Inout_ TL_INSPECT_SCHEDULER* scheduler,
+   _In_ ULONG pending,
+   _In_ UINT64 now,
+   _Out_ BOOLEAN* overdue
+   )
+/* ++
+
+   Returns the class to serve among those whose bit is set in pending, or
+   TL_INSPECT_SCHED_CLASS_MAX if none is. overdue tells whether the class
+   was picked for being past its deadline. If the class turns out to have
+   no work, the caller clears its bit and picks again.
+
+-- */
+{
+   TL_INSPECT_SCHED_CLASS picked = TL_INSPECT_SCHED_CLASS_MAX;
+   UINT64 lateness = 0;
+   ULONG i;
+
+   *overdue = FALSE;
+
+   for (i = 0; i < TL_INSPECT_SCHED_CLASS_MAX; i++)
+   {
+      UINT64 waited;
+
+      if ((pending & TL_INSPECT_SCHED_CLASS_BIT(i)) == 0)
+      {
+         scheduler->waitingSince[i] = now;
+         continue;
+      }
+
+      waited = now - scheduler->waitingSince[i];
+
+      if ((config->deadline[i] != 0) &&
+          (waited > config->deadline[i]) &&
+          (waited - config->deadline[i] > lateness))
+      {
+         picked = (TL_INSPECT_SCHED_CLASS)i;
+         lateness = waited - config->deadline[i];
+      }
+   }
+
+   if (picked != TL_INSPECT_SCHED_CLASS_MAX)
+   {
+      *overdue = TRUE;
+      return picked;
+   }
+
+   if (pending == 0)
+   {
+      return TL_INSPECT_SCHED_CLASS_MAX;
+   }
+
+   while (((pending & TL_INSPECT_SCHED_CLASS_BIT(scheduler->current)) == 0) ||
+          (scheduler->credit == 0))
+   {
+      scheduler->current = (scheduler->current + 1) % TL_INSPECT_SCHED_CLASS_MAX;
+      scheduler->credit = config->weight[scheduler->current];
+   }
+
+   scheduler->credit--;
+
+   return (TL_INSPECT_SCHED_CLASS)scheduler->current;
+}
+
+__inline
+void
+TLInspectSchedulerServed(
+   _Inout_ TL_INSPECT_SCHEDULER* scheduler,
+   _In_ TL_INSPECT_SCHED_CLASS schedClass,
+   _In_ UINT64 now
+   )
+{
+   scheduler->waitingSince[schedClass] = now;
+}
+
+#endif // _TL_INSPECT_SCHED_H_
@@ -0,0 +1,111 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares how the pended packets of the Transport
+   Inspect sample are sharded onto the packet queues so that the packets of
+   a flow are injected in the order they were queued, while the packets of
+   different flows are inspected in parallel.
+
+   A packet is queued to the shard picked by the hash of its 5-tuple, so
+   that all the packets of a flow go through the same shard. A shard is
+   drained by one worker at a time: a worker claims it, dequeues up to
+   TL_INSPECT_SHARD_QUANTUM packets, injects them, and only then releases
+   it. The next worker to claim the shard thus injects after the previous
+   one is done. Workers claim the shards they own first, then any other
+   shard with packets that no other worker holds, so that the shards of a
+   worker held up by a busy shard are taken over by idle workers.
+
+   The hash and the claim do not depend on WFP, so that they can be run in
+   user mode (see bench\orderbench.c).
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_SHARD_H_
+#define _TL_INSPECT_SHARD_H_
+
+//
+// Number of shards per active processor. More shards than workers keep a
+// busy shard from holding up many flows.
+//
+#define TL_INSPECT_SHARDS_PER_PROCESSOR 2
+
+//
+// Most packets a worker dequeues from a shard before it releases it.
+//
+#define TL_INSPECT_SHARD_QUANTUM 64
+
+__inline
+ULONG
+TLInspectShardHash(
+   _In_reads_(4) const UINT32* localAddr,
+   _In_reads_(4) const UINT32* remoteAddr,
+   _In_ UINT16 localPort,
+   _In_ UINT16 remotePort,
+   _In_ UINT8 protocol
+   )
+/* ++
+
+   Returns the hash of a 5-tuple, whose IPv4 addresses are held in the
+   first word of the address arrays and the others left zero. The two ends
+   are folded together with XOR, so that the hash does not change when the
+   local and remote ends are swapped, e.g. for the two directions of a
+   loopback connection. The folded value is then mixed with the finalizer
+   of MurmurHash3.
+
+-- */
+{
+   ULONG hash = (localAddr[0] ^ remoteAddr[0]) ^
+                (localAddr[1] ^ remoteAddr[1]) ^
+                (localAddr[2] ^ remoteAddr[2]) ^
+                (localAddr[3] ^ remoteAddr[3]);
+
+   hash ^= ((ULONG)(localPort ^ remotePort) << 8) ^ protocol;
+
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6b;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35;
+   hash ^= hash >> 16;
+
+   return hash;
+}
+
+__inline
+BOOLEAN
+TLInspectShardTryClaim(
+   _Inout_ volatile LONG* claimed
+   )
+/* ++
+
+   Claims a shard for the calling worker. Returns FALSE if another worker
+   holds it.
+
+-- */
+{
+   return (ReadNoFence(claimed) == 0) &&
+          (InterlockedCompareExchange(claimed, 1, 0) == 0);
+}
+
+__inline
+void
+TLInspectShardRelease(
+   _Inout_ volatile LONG* claimed
+   )
+/* ++
+
+   Releases a shard once the packets dequeued from it have been injected;
+   the release orders the injections before the next claim.
+
+-- */
+{
+   InterlockedExchange(claimed, 0);
+}
+
+#endif // _TL_INSPECT_SHARD_H_
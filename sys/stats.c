@@ -0,0 +1,577 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the run-time counters of the Transport Inspect
+   sample.
+
+   The classify functions and the worker threads count into the counters of
+   the processor they run on. A periodic DPC sums the counters of all
+   processors into the statistics page, which the user-mode tool maps
+   read-only and polls without any I/O. The counters are also reported
+   through the debugger when the driver unloads so that a test run can be
+   summarized without extra tooling.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "queue.h"
+#include "flowcache.h"
+#include "conntable.h"
+#include "stats.h"
+#include "overload.h"
+#include "verdict.h"
+
+C_ASSERT(sizeof(TL_INSPECT_CLASSIFY_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_FLOW_CACHE_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_OVERLOAD_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_SCHED_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_DEQUEUE_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_VERDICT_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_VERDICT_REQUEST) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_PACKET_RING_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_TIMER_COUNTERS) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(TL_INSPECT_STATS_PAGE) <= PAGE_SIZE);
+
+TL_INSPECT_STATS gStats;
+
+void
+TLInspectStatsSumFlowCache(
+   _Inout_ TL_INSPECT_FLOW_CACHE_COUNTERS* to,
+   _In_ const TL_INSPECT_FLOW_CACHE_COUNTERS* from
+   )
+{
+   to->lookups += ReadNoFence64(&from->lookups);
+   to->hits += ReadNoFence64(&from->hits);
+   to->blockHits += ReadNoFence64(&from->blockHits);
+   to->inserts += ReadNoFence64(&from->inserts);
+   to->insertFailures += ReadNoFence64(&from->insertFailures);
+   to->expirations += ReadNoFence64(&from->expirations);
+   to->flushes += ReadNoFence64(&from->flushes);
+}
+
+void
+TLInspectStatsCollect(
+   _Out_ TL_INSPECT_STATS_PAGE* snapshot
+   )
+/* ++
+
+   This function sums the counters of all processors and samples the queue
+   depths. The header fields of the snapshot are left zero.
+
+-- */
+{
+   ULONG i;
+   ULONG j;
+
+   RtlZeroMemory(snapshot, sizeof(*snapshot));
+
+   for (i = 0; i < gStats.cpuCount; i++)
+   {
+      const TL_INSPECT_CPU_STATS* cpu = &gStats.cpu[i];
+
+      for (j = 0; j < TL_INSPECT_CLASSIFY_FUNCTION_MAX; j++)
+      {
+         const TL_INSPECT_CLASSIFY_COUNTERS* from = &cpu->classify[j];
+         TL_INSPECT_CLASSIFY_COUNTERS* to = &snapshot->classify[j];
+
+         to->calls += ReadNoFence64(&from->calls);
+         to->permits += ReadNoFence64(&from->permits);
+         to->blocks += ReadNoFence64(&from->blocks);
+         to->absorbs += ReadNoFence64(&from->absorbs);
+         to->selfInjectedSkips += ReadNoFence64(&from->selfInjectedSkips);
+         to->allocationFailures += ReadNoFence64(&from->allocationFailures);
+         to->reinjectFailures += ReadNoFence64(&from->reinjectFailures);
+         to->notInspected += ReadNoFence64(&from->notInspected);
+      }
+
+      TLInspectStatsSumFlowCache(&snapshot->flowCache, &cpu->flowCache);
+      TLInspectStatsSumFlowCache(&snapshot->connectCache, &cpu->connectCache);
+
+      for (j = 0; j < TL_INSPECT_OVERLOAD_REASON_MAX; j++)
+      {
+         snapshot->overload.shed[j] += ReadNoFence64(&cpu->overload.shed[j]);
+      }
+      snapshot->overload.connects += ReadNoFence64(&cpu->overload.connects);
+      snapshot->overload.packets += ReadNoFence64(&cpu->overload.packets);
+
+      for (j = 0; j < TL_INSPECT_SCHED_CLASS_MAX; j++)
+      {
+         snapshot->sched.served[j] += ReadNoFence64(&cpu->sched.served[j]);
+         snapshot->sched.overdue[j] += ReadNoFence64(&cpu->sched.overdue[j]);
+      }
+      snapshot->sched.coalesced += ReadNoFence64(&cpu->sched.coalesced);
+
+      snapshot->dequeue.lockAcquisitions +=
+         ReadNoFence64(&cpu->dequeue.lockAcquisitions);
+      snapshot->dequeue.splices += ReadNoFence64(&cpu->dequeue.splices);
+      snapshot->dequeue.splicedPackets +=
+         ReadNoFence64(&cpu->dequeue.splicedPackets);
+      snapshot->dequeue.wakeups += ReadNoFence64(&cpu->dequeue.wakeups);
+      snapshot->dequeue.wakeupsCoalesced +=
+         ReadNoFence64(&cpu->dequeue.wakeupsCoalesced);
+
+      snapshot->verdict.submitted += ReadNoFence64(&cpu->verdict.submitted);
+      snapshot->verdict.delivered += ReadNoFence64(&cpu->verdict.delivered);
+      snapshot->verdict.exchanges += ReadNoFence64(&cpu->verdict.exchanges);
+      snapshot->verdict.verdicts += ReadNoFence64(&cpu->verdict.verdicts);
+      snapshot->verdict.unknown += ReadNoFence64(&cpu->verdict.unknown);
+      snapshot->verdict.timeouts += ReadNoFence64(&cpu->verdict.timeouts);
+      snapshot->verdict.overflows += ReadNoFence64(&cpu->verdict.overflows);
+
+      snapshot->packetRing.published +=
+         ReadNoFence64(&cpu->packetRing.published);
+      snapshot->packetRing.capturedBytes +=
+         ReadNoFence64(&cpu->packetRing.capturedBytes);
+      snapshot->packetRing.full += ReadNoFence64(&cpu->packetRing.full);
+      snapshot->packetRing.completions +=
+         ReadNoFence64(&cpu->packetRing.completions);
+      snapshot->packetRing.waits += ReadNoFence64(&cpu->packetRing.waits);
+      snapshot->packetRing.wakeups += ReadNoFence64(&cpu->packetRing.wakeups);
+
+      snapshot->timers.connectTimeouts +=
+         ReadNoFence64(&cpu->timers.connectTimeouts);
+      snapshot->timers.reauthTimeouts +=
+         ReadNoFence64(&cpu->timers.reauthTimeouts);
+      snapshot->timers.fired += ReadNoFence64(&cpu->timers.fired);
+      snapshot->timers.rearmed += ReadNoFence64(&cpu->timers.rearmed);
+
+      snapshot->pendedCount += ReadNoFence64(&cpu->pendedCount);
+      snapshot->reinjectCount += ReadNoFence64(&cpu->reinjectCount);
+      snapshot->injectCalls += ReadNoFence64(&cpu->injectCalls);
+   }
+
+   snapshot->connListDepth = ReadNoFence(&gStats.connListDepth);
+   snapshot->packetQueueDepth = TLInspectQueueDepth();
+   snapshot->flowCacheEntries = TLInspectFlowCacheCount();
+   snapshot->connectCacheEntries = TLInspectConnectCacheCount();
+   snapshot->pendedMemory = ReadNoFence64(&gOverload.memory);
+   snapshot->verdictPending = TLInspectVerdictPending();
+   snapshot->verdictDaemon = TLInspectVerdictAttached();
+   snapshot->timersArmed =
+      (INT32)(TLInspectConnTableTimers() + TLInspectFlowCacheTimers());
+
+   TLInspectVerdictQueryPacketRing(
+      &snapshot->packetRingPartitions,
+      &snapshot->packetRingSnapLength
+      );
+}
+
+KDEFERRED_ROUTINE TLInspectStatsUpdateDpc;
+
+void
+TLInspectStatsUpdateDpc(
+   _In_ KDPC* dpc,
+   _In_opt_ void* deferredContext,
+   _In_opt_ void* systemArgument1,
+   _In_opt_ void* systemArgument2
+   )
+/* ++
+
+   This function refreshes the statistics page. The snapshot is built on
+   the stack and copied into the page between two increments of sequence,
+   so a reader never sees a half-written page as valid.
+
+-- */
+{
+   TL_INSPECT_STATS_PAGE snapshot;
+   TL_INSPECT_STATS_PAGE* page = gStats.page;
+
+   UNREFERENCED_PARAMETER(dpc);
+   UNREFERENCED_PARAMETER(deferredContext);
+   UNREFERENCED_PARAMETER(systemArgument1);
+   UNREFERENCED_PARAMETER(systemArgument2);
+
+   TLInspectStatsCollect(&snapshot);
+
+   KeAcquireSpinLockAtDpcLevel(&gStats.updateLock);
+
+   InterlockedIncrement((volatile LONG*)&page->sequence);
+
+   page->timestamp = KeQueryInterruptTime();
+   page->pendedCount = snapshot.pendedCount;
+   page->reinjectCount = snapshot.reinjectCount;
+   page->injectCalls = snapshot.injectCalls;
+   page->connListDepth = snapshot.connListDepth;
+   page->packetQueueDepth = snapshot.packetQueueDepth;
+   if (snapshot.packetQueueDepth > page->packetQueueDepthMax)
+   {
+      page->packetQueueDepthMax = snapshot.packetQueueDepth;
+   }
+   RtlCopyMemory(page->classify, snapshot.classify, sizeof(page->classify));
+   page->flowCache = snapshot.flowCache;
+   page->flowCacheEntries = snapshot.flowCacheEntries;
+   page->overload = snapshot.overload;
+   page->pendedMemory = snapshot.pendedMemory;
+   page->sched = snapshot.sched;
+   page->dequeue = snapshot.dequeue;
+   page->verdict = snapshot.verdict;
+   page->verdictPending = snapshot.verdictPending;
+   page->verdictDaemon = snapshot.verdictDaemon;
+   page->packetRing = snapshot.packetRing;
+   page->packetRingPartitions = snapshot.packetRingPartitions;
+   page->packetRingSnapLength = snapshot.packetRingSnapLength;
+   page->connectCache = snapshot.connectCache;
+   page->connectCacheEntries = snapshot.connectCacheEntries;
+   page->timers = snapshot.timers;
+   page->timersArmed = snapshot.timersArmed;
+
+   InterlockedIncrement((volatile LONG*)&page->sequence);
+
+   KeReleaseSpinLockFromDpcLevel(&gStats.updateLock);
+}
+
+NTSTATUS
+TLInspectStatsInitialize(void)
+/* ++
+
+   This function allocates the counters of every active processor and the
+   statistics page, and starts the periodic update of the page. It is
+   called once the packet queues exist, since their depth is sampled.
+
+-- */
+{
+   LARGE_INTEGER dueTime;
+
+   RtlZeroMemory(&gStats, sizeof(gStats));
+
+   gStats.packetPool.tag = TL_INSPECT_PENDED_PACKET_POOL_TAG;
+   gStats.controlDataPool.tag = TL_INSPECT_CONTROL_DATA_POOL_TAG;
+
+   gStats.startTime = KeQueryInterruptTime();
+
+   KeInitializeSpinLock(&gStats.updateLock);
+   KeInitializeTimerEx(&gStats.updateTimer, NotificationTimer);
+   KeInitializeDpc(&gStats.updateDpc, TLInspectStatsUpdateDpc, NULL);
+
+   gStats.cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+   gStats.cpu = ExAllocatePoolZero(
+                  NonPagedPool,
+                  gStats.cpuCount * sizeof(TL_INSPECT_CPU_STATS),
+                  TL_INSPECT_STATS_POOL_TAG
+                  );
+
+   //
+   // A page-sized allocation is page aligned, so the page shares no memory
+   // with other allocations once it is mapped into a process.
+   //
+   gStats.page = ExAllocatePoolZero(
+                   NonPagedPool,
+                   PAGE_SIZE,
+                   TL_INSPECT_STATS_POOL_TAG
+                   );
+
+   if ((gStats.cpu == NULL) || (gStats.page == NULL))
+   {
+      TLInspectStatsFree();
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   gStats.page->processorCount = gStats.cpuCount;
+   gStats.page->startTime = gStats.startTime;
+   gStats.page->timestamp = gStats.startTime;
+   gStats.page->updateInterval = TL_INSPECT_STATS_UPDATE_INTERVAL;
+   gStats.page->flowCacheCapacity = configFlowCacheMaxEntries;
+   gStats.page->connectCacheCapacity = TLInspectConnectCacheCapacity();
+   gStats.page->memoryBudget = gOverload.limits.memory;
+   gStats.page->overloadFailOpen = gOverload.limits.failOpen ? 1 : 0;
+   gStats.page->connectTimeout = configConnectTimeout;
+
+   dueTime.QuadPart = -(LONGLONG)TL_INSPECT_STATS_UPDATE_INTERVAL * 10000;
+
+   KeSetTimerEx(
+      &gStats.updateTimer,
+      dueTime,
+      TL_INSPECT_STATS_UPDATE_INTERVAL,
+      &gStats.updateDpc
+      );
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectStatsFree(void)
+/* ++
+
+   This function stops the update of the statistics page and frees it
+   along with the counters. The page can no longer be mapped by then: the
+   driver does not unload while the control device has open handles, and
+   the mappings are removed when the handles are closed.
+
+-- */
+{
+   if (gStats.page != NULL)
+   {
+      KeCancelTimer(&gStats.updateTimer);
+      KeFlushQueuedDpcs();
+
+      ExFreePoolWithTag(gStats.page, TL_INSPECT_STATS_POOL_TAG);
+      gStats.page = NULL;
+   }
+
+   if (gStats.cpu != NULL)
+   {
+      ExFreePoolWithTag(gStats.cpu, TL_INSPECT_STATS_POOL_TAG);
+      gStats.cpu = NULL;
+   }
+}
+
+NTSTATUS
+TLInspectStatsMapPage(
+   _Outptr_ MDL** mdl,
+   _Outptr_ void** userAddress
+   )
+/* ++
+
+   This function maps the statistics page read-only into the current
+   process; it must be called in the context of that process, at
+   PASSIVE_LEVEL. The mapping is removed by TLInspectStatsUnmapPage, in the
+   context of the same process.
+
+-- */
+{
+   NTSTATUS status = STATUS_SUCCESS;
+   MDL* pageMdl;
+   void* address = NULL;
+
+   *mdl = NULL;
+   *userAddress = NULL;
+
+   if (gStats.page == NULL)
+   {
+      return STATUS_DEVICE_NOT_READY;
+   }
+
+   pageMdl = IoAllocateMdl(gStats.page, PAGE_SIZE, FALSE, FALSE, NULL);
+
+   if (pageMdl == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   MmBuildMdlForNonPagedPool(pageMdl);
+
+   //
+   // Mapping into user space raises an exception on failure, instead of
+   // returning NULL.
+   //
+   __try
+   {
+      address = MmMapLockedPagesSpecifyCache(
+                   pageMdl,
+                   UserMode,
+                   MmCached,
+                   NULL,
+                   FALSE,
+                   NormalPagePriority | MdlMappingNoWrite |
+                      MdlMappingNoExecute
+                   );
+   }
+   __except (EXCEPTION_EXECUTE_HANDLER)
+   {
+      status = GetExceptionCode();
+   }
+
+   if (address == NULL)
+   {
+      IoFreeMdl(pageMdl);
+      return NT_SUCCESS(status) ? STATUS_INSUFFICIENT_RESOURCES : status;
+   }
+
+   *mdl = pageMdl;
+   *userAddress = address;
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectStatsUnmapPage(
+   _In_ MDL* mdl,
+   _In_ void* userAddress
+   )
+{
+   MmUnmapLockedPages(userAddress, mdl);
+   IoFreeMdl(mdl);
+}
+
+void
+TLInspectStatsReportPool(
+   _In_ const TL_INSPECT_POOL_STATS* pool
+   )
+{
+   DbgPrint("Inspect stats: pool tag '%.4s': %I64d allocations, %I64d failures, %d in use (max %d)\n",
+      (const char*)&pool->tag,
+      pool->allocations,
+      pool->failures,
+      pool->inUse,
+      pool->inUseMax
+   );
+}
+
+void
+TLInspectStatsReport(void)
+/* ++
+
+   This function prints a summary of the counters collected since the driver
+   was loaded. Rates are computed over the interrupt time elapsed since
+   TLInspectStatsInitialize (100ns units).
+
+-- */
+{
+   static const char* functionNames[TL_INSPECT_CLASSIFY_FUNCTION_MAX] =
+   {
+      "connect",
+      "recv-accept",
+      "transport",
+      "ip"
+   };
+   TL_INSPECT_STATS_PAGE snapshot;
+   UINT64 elapsed = KeQueryInterruptTime() - gStats.startTime;
+   UINT64 elapsedMs = elapsed / 10000;
+   LONG64 classifyCount = 0;
+   LONG64 packetsPerSec = 0;
+   ULONG i;
+
+   if (gStats.cpu == NULL)
+   {
+      return;
+   }
+
+   TLInspectStatsCollect(&snapshot);
+
+   for (i = 0; i < TL_INSPECT_CLASSIFY_FUNCTION_MAX; i++)
+   {
+      classifyCount += snapshot.classify[i].calls;
+   }
+
+   if (elapsedMs != 0)
+   {
+      packetsPerSec = (LONG64)((UINT64)classifyCount * 1000 / elapsedMs);
+   }
+
+   DbgPrint("Inspect stats: %I64d classifies in %I64u ms (%I64d/s)\n",
+      classifyCount,
+      elapsedMs,
+      packetsPerSec
+   );
+
+   for (i = 0; i < TL_INSPECT_CLASSIFY_FUNCTION_MAX; i++)
+   {
+      const TL_INSPECT_CLASSIFY_COUNTERS* counters = &snapshot.classify[i];
+
+      DbgPrint("Inspect stats: %s: %I64d calls, %I64d permits, %I64d blocks, %I64d absorbs, %I64d self-injected, %I64d not inspected, %I64d allocation failures, %I64d reinject failures\n",
+         functionNames[i],
+         counters->calls,
+         counters->permits,
+         counters->blocks,
+         counters->absorbs,
+         counters->selfInjectedSkips,
+         counters->notInspected,
+         counters->allocationFailures,
+         counters->reinjectFailures
+      );
+   }
+
+   DbgPrint("Inspect stats: pended %I64d, reinjected %I64d in %I64d calls\n",
+      snapshot.pendedCount,
+      snapshot.reinjectCount,
+      snapshot.injectCalls
+   );
+   DbgPrint("Inspect stats: connection list depth %d, packet queue depth %d (max sampled %d)\n",
+      snapshot.connListDepth,
+      snapshot.packetQueueDepth,
+      (gStats.page != NULL) ? gStats.page->packetQueueDepthMax : 0
+   );
+   DbgPrint("Inspect stats: flow cache: %I64d lookups, %I64d hits (%I64d blocks), %I64d inserts, %I64d insert failures, %I64d expirations, %I64d flushes, %d entries\n",
+      snapshot.flowCache.lookups,
+      snapshot.flowCache.hits,
+      snapshot.flowCache.blockHits,
+      snapshot.flowCache.inserts,
+      snapshot.flowCache.insertFailures,
+      snapshot.flowCache.expirations,
+      snapshot.flowCache.flushes,
+      snapshot.flowCacheEntries
+   );
+   DbgPrint("Inspect stats: connect cache: %I64d lookups, %I64d hits (%I64d blocks), %I64d inserts, %I64d insert failures, %I64d expirations, %I64d flushes, %d entries\n",
+      snapshot.connectCache.lookups,
+      snapshot.connectCache.hits,
+      snapshot.connectCache.blockHits,
+      snapshot.connectCache.inserts,
+      snapshot.connectCache.insertFailures,
+      snapshot.connectCache.expirations,
+      snapshot.connectCache.flushes,
+      snapshot.connectCacheEntries
+   );
+   DbgPrint("Inspect stats: overload: %I64d connects and %I64d packets shed (%I64d queue depth, %I64d queue bytes, %I64d queue delay, %I64d connects, %I64d memory), %I64d of %I64d bytes pended, fail-%s\n",
+      snapshot.overload.connects,
+      snapshot.overload.packets,
+      snapshot.overload.shed[TL_INSPECT_OVERLOAD_QUEUE_DEPTH],
+      snapshot.overload.shed[TL_INSPECT_OVERLOAD_QUEUE_BYTES],
+      snapshot.overload.shed[TL_INSPECT_OVERLOAD_QUEUE_DELAY],
+      snapshot.overload.shed[TL_INSPECT_OVERLOAD_CONNECTS],
+      snapshot.overload.shed[TL_INSPECT_OVERLOAD_MEMORY],
+      snapshot.pendedMemory,
+      gOverload.limits.memory,
+      gOverload.limits.failOpen ? "open" : "closed"
+   );
+   DbgPrint("Inspect stats: scheduler: %I64d connects (%I64d overdue, %I64d coalesced), %I64d re-auths (%I64d overdue), %I64d data packets (%I64d overdue)\n",
+      snapshot.sched.served[TL_INSPECT_SCHED_CLASS_CONNECT],
+      snapshot.sched.overdue[TL_INSPECT_SCHED_CLASS_CONNECT],
+      snapshot.sched.coalesced,
+      snapshot.sched.served[TL_INSPECT_SCHED_CLASS_REAUTH],
+      snapshot.sched.overdue[TL_INSPECT_SCHED_CLASS_REAUTH],
+      snapshot.sched.served[TL_INSPECT_SCHED_CLASS_DATA],
+      snapshot.sched.overdue[TL_INSPECT_SCHED_CLASS_DATA]
+   );
+   DbgPrint("Inspect stats: dequeue: %I64d lock acquisitions, %I64d splices of %I64d packets, %I64d wakeups (%I64d coalesced)\n",
+      snapshot.dequeue.lockAcquisitions,
+      snapshot.dequeue.splices,
+      snapshot.dequeue.splicedPackets,
+      snapshot.dequeue.wakeups,
+      snapshot.dequeue.wakeupsCoalesced
+   );
+   DbgPrint("Inspect stats: verdicts: %I64d submitted, %I64d delivered in %I64d exchanges, %I64d decided, %I64d unknown, %I64d timed out, %I64d overflowed\n",
+      snapshot.verdict.submitted,
+      snapshot.verdict.delivered,
+      snapshot.verdict.exchanges,
+      snapshot.verdict.verdicts,
+      snapshot.verdict.unknown,
+      snapshot.verdict.timeouts,
+      snapshot.verdict.overflows
+   );
+   DbgPrint("Inspect stats: packet ring: %I64d published (%I64d bytes), %I64d full, %I64d completions, %I64d waits, %I64d wakeups\n",
+      snapshot.packetRing.published,
+      snapshot.packetRing.capturedBytes,
+      snapshot.packetRing.full,
+      snapshot.packetRing.completions,
+      snapshot.packetRing.waits,
+      snapshot.packetRing.wakeups
+   );
+   DbgPrint("Inspect stats: timers: %I64d connect timeouts, %I64d re-auth timeouts, %I64d fired, %I64d re-armed, %d armed\n",
+      snapshot.timers.connectTimeouts,
+      snapshot.timers.reauthTimeouts,
+      snapshot.timers.fired,
+      snapshot.timers.rearmed,
+      snapshot.timersArmed
+   );
+
+   TLInspectStatsReportPool(&gStats.packetPool);
+   TLInspectStatsReportPool(&gStats.controlDataPool);
+}
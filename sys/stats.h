@@ -0,0 +1,216 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the run-time counters kept by the Transport
+   Inspect sample so that the classify functions and the worker thread can
+   be measured on a live target. The counters are summed periodically into
+   the statistics page, which the user-mode tool maps read-only.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_STATS_H_
+#define _TL_INSPECT_STATS_H_
+
+#include "inspectioctl.h"
+#include "layer.h"
+
+//
+// Interval, in milliseconds, at which the statistics page is updated.
+//
+#define TL_INSPECT_STATS_UPDATE_INTERVAL 100
+
+//
+// TL_INSPECT_POOL_STATS tracks the allocations made under one pool tag.
+// inUseMax is the high-water mark of inUse.
+//
+typedef struct TL_INSPECT_POOL_STATS_
+{
+   ULONG tag;
+   volatile LONG64 allocations;
+   volatile LONG64 failures;
+   volatile LONG inUse;
+   LONG inUseMax;
+} TL_INSPECT_POOL_STATS;
+
+//
+// TL_INSPECT_CPU_STATS holds the counters of one processor. Each classify
+// function has a cache line of its own. The counters are only ever
+// incremented on the processor they belong to, so the interlocked
+// operations find the line in the local cache; they are still needed
+// because a classify at PASSIVE_LEVEL may be moved to another processor
+// between picking the counters and updating them.
+//
+typedef struct DECLSPEC_CACHEALIGN TL_INSPECT_CPU_STATS_
+{
+   TL_INSPECT_CLASSIFY_COUNTERS classify[TL_INSPECT_CLASSIFY_FUNCTION_MAX];
+   TL_INSPECT_FLOW_CACHE_COUNTERS flowCache;
+   TL_INSPECT_FLOW_CACHE_COUNTERS connectCache;
+   TL_INSPECT_OVERLOAD_COUNTERS overload;
+   TL_INSPECT_SCHED_COUNTERS sched;
+   TL_INSPECT_DEQUEUE_COUNTERS dequeue;
+   TL_INSPECT_VERDICT_COUNTERS verdict;
+   TL_INSPECT_PACKET_RING_COUNTERS packetRing;
+   TL_INSPECT_TIMER_COUNTERS timers;
+
+   LONG64 pendedCount;
+   LONG64 reinjectCount;
+   LONG64 injectCalls;
+} TL_INSPECT_CPU_STATS;
+
+//
+// TL_INSPECT_STATS holds the driver-wide state of the counters.
+// connListDepth is only modified while holding gConnListLock, and may be
+// read without it. The pool counters are updated with interlocked
+// operations from any processor.
+//
+// The page is updated by the DPC of updateTimer; updateLock keeps two
+// runs of the DPC on different processors from interleaving.
+//
+typedef struct TL_INSPECT_STATS_
+{
+   TL_INSPECT_CPU_STATS* cpu;
+   ULONG cpuCount;
+
+   LONG connListDepth;
+
+   TL_INSPECT_POOL_STATS packetPool;
+   TL_INSPECT_POOL_STATS controlDataPool;
+
+   UINT64 startTime;
+
+   TL_INSPECT_STATS_PAGE* page;
+   KSPIN_LOCK updateLock;
+   KTIMER updateTimer;
+   KDPC updateDpc;
+} TL_INSPECT_STATS;
+
+extern TL_INSPECT_STATS gStats;
+
+__inline
+TL_INSPECT_CPU_STATS*
+TLInspectStatsCurrentCpu(void)
+{
+   return &gStats.cpu[KeGetCurrentProcessorNumberEx(NULL) % gStats.cpuCount];
+}
+
+//
+// counter names a field of TL_INSPECT_CPU_STATS, e.g.
+// TLInspectStatsIncrement(classify[TL_INSPECT_CLASSIFY_IP].calls).
+//
+#define TLInspectStatsIncrement(counter) \
+   InterlockedIncrementNoFence64(&TLInspectStatsCurrentCpu()->counter)
+
+#define TLInspectStatsAdd(counter, value) \
+   InterlockedAddNoFence64(&TLInspectStatsCurrentCpu()->counter, (value))
+
+__inline
+TL_INSPECT_CLASSIFY_FUNCTION
+TLInspectStatsFunctionForLayer(
+   _In_ UINT16 layerId
+   )
+/* ++
+
+   Returns the classify function that handles the layer, e.g. to account a
+   pended packet to the function that pended it.
+
+-- */
+{
+   return (TL_INSPECT_CLASSIFY_FUNCTION)TLInspectLayerForId(layerId)->function;
+}
+
+__inline
+void
+TLInspectStatsClassifyResult(
+   _In_ TL_INSPECT_CLASSIFY_FUNCTION function,
+   _In_ const FWPS_CLASSIFY_OUT* classifyOut
+   )
+/* ++
+
+   Counts how a classify ended. It is only called for classifies that had
+   the right to set the action; the others are only counted in calls.
+
+-- */
+{
+   TL_INSPECT_CLASSIFY_COUNTERS* counters =
+      &TLInspectStatsCurrentCpu()->classify[function];
+
+   if (classifyOut->flags & FWPS_CLASSIFY_OUT_FLAG_ABSORB)
+   {
+      InterlockedIncrementNoFence64(&counters->absorbs);
+   }
+   else if (classifyOut->actionType == FWP_ACTION_PERMIT)
+   {
+      InterlockedIncrementNoFence64(&counters->permits);
+   }
+   else if (classifyOut->actionType == FWP_ACTION_BLOCK)
+   {
+      InterlockedIncrementNoFence64(&counters->blocks);
+   }
+}
+
+__inline
+void
+TLInspectStatsPoolAllocated(
+   _Inout_ TL_INSPECT_POOL_STATS* pool
+   )
+{
+   LONG inUse = InterlockedIncrement(&pool->inUse);
+
+   InterlockedIncrement64(&pool->allocations);
+
+   //
+   // The high-water mark is best effort; a racing update may be lost.
+   //
+   if (inUse > pool->inUseMax)
+   {
+      pool->inUseMax = inUse;
+   }
+}
+
+__inline
+void
+TLInspectStatsPoolFreed(
+   _Inout_ TL_INSPECT_POOL_STATS* pool
+   )
+{
+   InterlockedDecrement(&pool->inUse);
+}
+
+__inline
+void
+TLInspectStatsPoolFailure(
+   _Inout_ TL_INSPECT_POOL_STATS* pool
+   )
+{
+   InterlockedIncrement64(&pool->failures);
+}
+
+NTSTATUS
+TLInspectStatsInitialize(void);
+
+void
+TLInspectStatsFree(void);
+
+void
+TLInspectStatsReport(void);
+
+NTSTATUS
+TLInspectStatsMapPage(
+   _Outptr_ MDL** mdl,
+   _Outptr_ void** userAddress
+   );
+
+void
+TLInspectStatsUnmapPage(
+   _In_ MDL* mdl,
+   _In_ void* userAddress
+   );
+
+#endif // _TL_INSPECT_STATS_H_
@@ -0,0 +1,461 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the binary event trace of the Transport Inspect
+   sample.
+
+   Each processor writes into its own ring at DISPATCH_LEVEL, so a ring has
+   a single writer and needs no lock. When a ring is full the oldest
+   records are overwritten. Readers copy records out without stopping the
+   writer; they check afterwards that the records they copied were not
+   overwritten in the meantime.
+
+   A record that repeats the previous record of the processor within the
+   deduplication window only increments its count.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "parse.h"
+#include "trace.h"
+
+#define TL_INSPECT_TRACE_RING_MASK (TL_INSPECT_TRACE_RING_SIZE - 1)
+
+//
+// head is the sequence of the next record to be written; the record of
+// sequence s is stored in records[s & TL_INSPECT_TRACE_RING_MASK].
+//
+typedef struct TL_INSPECT_TRACE_RING_
+{
+   DECLSPEC_CACHEALIGN volatile LONG64 head;
+
+   DECLSPEC_CACHEALIGN TL_INSPECT_TRACE_RECORD records[TL_INSPECT_TRACE_RING_SIZE];
+} TL_INSPECT_TRACE_RING;
+
+volatile LONG gTraceLevel = TL_INSPECT_TRACE_LEVEL_NONE;
+
+TL_INSPECT_TRACE_RING** gTraceRings;
+ULONG gTraceRingCount;
+
+NTSTATUS
+TLInspectTraceInitialize(
+   _In_ ULONG level
+   )
+/* ++
+
+   This function allocates one trace ring per active processor and sets
+   the initial trace level.
+
+-- */
+{
+   ULONG i;
+
+   gTraceRingCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+   gTraceRings = ExAllocatePoolZero(
+                   NonPagedPool,
+                   gTraceRingCount * sizeof(TL_INSPECT_TRACE_RING*),
+                   TL_INSPECT_TRACE_POOL_TAG
+                   );
+   if (gTraceRings == NULL)
+   {
+      return STATUS_INSUFFICIENT_RESOURCES;
+   }
+
+   for (i = 0; i < gTraceRingCount; i++)
+   {
+      gTraceRings[i] = ExAllocatePoolZero(
+                         NonPagedPool,
+                         sizeof(TL_INSPECT_TRACE_RING),
+                         TL_INSPECT_TRACE_POOL_TAG
+                         );
+      if (gTraceRings[i] == NULL)
+      {
+         TLInspectTraceFree();
+         return STATUS_INSUFFICIENT_RESOURCES;
+      }
+   }
+
+   TLInspectTraceSetLevel(level);
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectTraceFree(void)
+{
+   ULONG i;
+
+   gTraceLevel = TL_INSPECT_TRACE_LEVEL_NONE;
+
+   if (gTraceRings == NULL)
+   {
+      return;
+   }
+
+   for (i = 0; i < gTraceRingCount; i++)
+   {
+      if (gTraceRings[i] != NULL)
+      {
+         ExFreePoolWithTag(gTraceRings[i], TL_INSPECT_TRACE_POOL_TAG);
+      }
+   }
+
+   ExFreePoolWithTag(gTraceRings, TL_INSPECT_TRACE_POOL_TAG);
+   gTraceRings = NULL;
+   gTraceRingCount = 0;
+}
+
+void
+TLInspectTraceSetLevel(
+   _In_ ULONG level
+   )
+{
+   level = min(level, TL_INSPECT_TRACE_LEVEL_MAX - 1);
+
+   InterlockedExchange(&gTraceLevel, (LONG)level);
+}
+
+void
+TLInspectTraceQueryInfo(
+   _Out_ TL_INSPECT_TRACE_INFO* info
+   )
+{
+   info->processorCount = gTraceRingCount;
+   info->ringSize = TL_INSPECT_TRACE_RING_SIZE;
+   info->level = (UINT32)gTraceLevel;
+   info->dedupWindow = TL_INSPECT_TRACE_DEDUP_WINDOW / 10000;
+}
+
+__inline
+BOOLEAN
+TLInspectTraceRecordEqual(
+   _In_ const TL_INSPECT_TRACE_RECORD* record1,
+   _In_ const TL_INSPECT_TRACE_RECORD* record2
+   )
+{
+   return RtlEqualMemory(
+             &record1->layerId,
+             &record2->layerId,
+             sizeof(TL_INSPECT_TRACE_RECORD) -
+                FIELD_OFFSET(TL_INSPECT_TRACE_RECORD, layerId)
+             );
+}
+
+void
+TLInspectTraceWrite(
+   _In_ const TL_INSPECT_TRACE_RECORD* record
+   )
+/* ++
+
+   This function appends the record, of which the fields from layerId on
+   are set, to the ring of the current processor. The fields from layerId
+   on, including the reserved ones, must be zeroed if unused so that
+   identical events compare equal.
+
+-- */
+{
+   KIRQL oldIrql;
+   ULONG processor;
+   TL_INSPECT_TRACE_RING* ring;
+   TL_INSPECT_TRACE_RECORD* slot;
+   LONG64 head;
+   UINT64 now;
+
+   //
+   // Stay on this processor; its ring must have a single writer at a time.
+   //
+   KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+   processor = KeGetCurrentProcessorNumberEx(NULL);
+
+   if ((gTraceRings == NULL) || (processor >= gTraceRingCount))
+   {
+      goto Exit;
+   }
+
+   ring = gTraceRings[processor];
+   head = ring->head;
+   now = KeQueryInterruptTimePrecise(NULL);
+
+   if (head != 0)
+   {
+      slot = &ring->records[(head - 1) & TL_INSPECT_TRACE_RING_MASK];
+
+      if ((now - slot->timestamp < TL_INSPECT_TRACE_DEDUP_WINDOW) &&
+          TLInspectTraceRecordEqual(slot, record))
+      {
+         slot->count++;
+         goto Exit;
+      }
+   }
+
+   slot = &ring->records[head & TL_INSPECT_TRACE_RING_MASK];
+
+   *slot = *record;
+   slot->timestamp = now;
+   slot->count = 1;
+   slot->processor = (UINT16)processor;
+
+   //
+   // Publish the record.
+   //
+   InterlockedExchange64(&ring->head, head + 1);
+
+Exit:
+
+   KeLowerIrql(oldIrql);
+}
+
+__inline
+void
+TLInspectTraceSetAddresses(
+   _Inout_ TL_INSPECT_TRACE_RECORD* record,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ const void* localAddress,
+   _In_ const void* remoteAddress
+   )
+{
+   SIZE_T length;
+
+   if (addressFamily == AF_INET)
+   {
+      record->addressFamily = 4;
+      length = sizeof(UINT32);
+   }
+   else
+   {
+      record->addressFamily = 6;
+      length = sizeof(FWP_BYTE_ARRAY16);
+   }
+
+   RtlCopyMemory(record->localAddress, localAddress, length);
+   RtlCopyMemory(record->remoteAddress, remoteAddress, length);
+}
+
+void
+TLInspectTracePacket(
+   _In_ TL_INSPECT_TRACE_EVENT event,
+   _In_ UINT16 layerId,
+   _In_ FWP_DIRECTION direction,
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ TL_INSPECT_TRACE_VERDICT verdict
+   )
+/* ++
+
+   This function traces a packet described by the header parsers; the
+   source and destination are mapped to local and remote according to the
+   direction.
+
+-- */
+{
+   TL_INSPECT_TRACE_RECORD record = { 0 };
+
+   record.layerId = layerId;
+   record.event = (UINT8)event;
+   record.direction = (UINT8)direction;
+   record.protocol = info->protocol;
+   record.verdict = (UINT8)verdict;
+
+   if (direction == FWP_DIRECTION_OUTBOUND)
+   {
+      record.localPort = info->sourcePort;
+      record.remotePort = info->destinationPort;
+      TLInspectTraceSetAddresses(
+         &record,
+         info->addressFamily,
+         &info->sourceAddress,
+         &info->destinationAddress
+         );
+   }
+   else
+   {
+      record.localPort = info->destinationPort;
+      record.remotePort = info->sourcePort;
+      TLInspectTraceSetAddresses(
+         &record,
+         info->addressFamily,
+         &info->destinationAddress,
+         &info->sourceAddress
+         );
+   }
+
+   TLInspectTraceWrite(&record);
+}
+
+void
+TLInspectTracePendedPacket(
+   _In_ TL_INSPECT_TRACE_EVENT event,
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ TL_INSPECT_TRACE_VERDICT verdict
+   )
+{
+   TL_INSPECT_TRACE_RECORD record = { 0 };
+
+   record.layerId = packet->layerId;
+   record.event = (UINT8)event;
+   record.direction = (UINT8)packet->direction;
+   record.protocol = packet->protocol;
+   record.verdict = (UINT8)verdict;
+   record.localPort = packet->localPort;
+   record.remotePort = packet->remotePort;
+
+   TLInspectTraceSetAddresses(
+      &record,
+      packet->addressFamily,
+      &packet->localAddr,
+      &packet->remoteAddr
+      );
+
+   TLInspectTraceWrite(&record);
+}
+
+__inline
+LONG64
+TLInspectTraceOldestSequence(
+   _In_ LONG64 head
+   )
+/* ++
+
+   Returns the sequence of the oldest record that cannot be overwritten
+   before the next update of head; the writer may be filling the slot of
+   sequence head - TL_INSPECT_TRACE_RING_SIZE.
+
+-- */
+{
+   return (head >= TL_INSPECT_TRACE_RING_SIZE) ?
+             (head - TL_INSPECT_TRACE_RING_SIZE + 1) : 0;
+}
+
+NTSTATUS
+TLInspectTraceRead(
+   _In_ const TL_INSPECT_TRACE_READ_INPUT* input,
+   _Out_writes_bytes_to_(outputLength, *bytesReturned)
+      TL_INSPECT_TRACE_READ_OUTPUT* output,
+   _In_ SIZE_T outputLength,
+   _Out_ SIZE_T* bytesReturned
+   )
+/* ++
+
+   This function copies the records of one processor, from the sequence
+   given in input on, into output. The newest record is held back while
+   it may still be merged with further identical events, so that the
+   count returned for a record is final.
+
+-- */
+{
+   TL_INSPECT_TRACE_RING* ring;
+   LONG64 head;
+   LONG64 oldest;
+   LONG64 sequence;
+   LONG64 end;
+   UINT64 lost = 0;
+   SIZE_T capacity;
+   ULONG count;
+   ULONG i;
+
+   *bytesReturned = 0;
+
+   if (outputLength < FIELD_OFFSET(TL_INSPECT_TRACE_READ_OUTPUT, records))
+   {
+      return STATUS_BUFFER_TOO_SMALL;
+   }
+
+   if ((gTraceRings == NULL) || (input->processor >= gTraceRingCount))
+   {
+      return STATUS_INVALID_PARAMETER;
+   }
+
+   capacity =
+      (outputLength - FIELD_OFFSET(TL_INSPECT_TRACE_READ_OUTPUT, records)) /
+         sizeof(TL_INSPECT_TRACE_RECORD);
+
+   ring = gTraceRings[input->processor];
+
+   head = InterlockedCompareExchange64(&ring->head, 0, 0);
+
+   //
+   // A sequence past head was handed out by a previous instance of the
+   // driver; start over.
+   //
+   sequence = (LONG64)input->sequence;
+   if ((sequence < 0) || (sequence > head))
+   {
+      sequence = 0;
+   }
+
+   oldest = TLInspectTraceOldestSequence(head);
+   if (sequence < oldest)
+   {
+      lost += oldest - sequence;
+      sequence = oldest;
+   }
+
+   end = head;
+   if (end > sequence)
+   {
+      const TL_INSPECT_TRACE_RECORD* newest =
+         &ring->records[(end - 1) & TL_INSPECT_TRACE_RING_MASK];
+
+      if (KeQueryInterruptTime() - newest->timestamp <
+             2 * TL_INSPECT_TRACE_DEDUP_WINDOW)
+      {
+         end--;
+      }
+   }
+
+   count = (ULONG)min((SIZE_T)(end - sequence), capacity);
+
+   for (i = 0; i < count; i++)
+   {
+      output->records[i] =
+         ring->records[(sequence + i) & TL_INSPECT_TRACE_RING_MASK];
+   }
+
+   //
+   // Drop the records that the writer overwrote while they were copied.
+   //
+   head = InterlockedCompareExchange64(&ring->head, 0, 0);
+   oldest = TLInspectTraceOldestSequence(head);
+
+   if (sequence < oldest)
+   {
+      ULONG overwritten = (ULONG)min(oldest - sequence, (LONG64)count);
+
+      RtlMoveMemory(
+         &output->records[0],
+         &output->records[overwritten],
+         (count - overwritten) * sizeof(TL_INSPECT_TRACE_RECORD)
+         );
+
+      count -= overwritten;
+      lost += oldest - sequence;
+      sequence = oldest;
+   }
+
+   output->nextSequence = (UINT64)(sequence + count);
+   output->lost = lost;
+   output->recordCount = count;
+   output->reserved = 0;
+
+   *bytesReturned = FIELD_OFFSET(TL_INSPECT_TRACE_READ_OUTPUT, records) +
+                    count * sizeof(TL_INSPECT_TRACE_RECORD);
+
+   return STATUS_SUCCESS;
+}
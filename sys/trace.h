@@ -0,0 +1,93 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the binary event trace of the Transport
+   Inspect sample. Events are written as fixed-size records into per-
+   processor rings, and read by the user-mode tool through the control
+   device.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_TRACE_H_
+#define _TL_INSPECT_TRACE_H_
+
+#include "inspectioctl.h"
+
+//
+// Number of records in the ring of each processor; must be a power of 2.
+//
+#define TL_INSPECT_TRACE_RING_SIZE 1024
+
+//
+// Identical events that follow each other within this window, in 100ns
+// units, are merged into one record.
+//
+#define TL_INSPECT_TRACE_DEDUP_WINDOW (1000 * 10000)
+
+extern volatile LONG gTraceLevel;
+
+__inline
+BOOLEAN
+TLInspectTraceEnabled(
+   _In_ TL_INSPECT_TRACE_LEVEL level
+   )
+{
+   return (LONG)level <= gTraceLevel;
+}
+
+NTSTATUS
+TLInspectTraceInitialize(
+   _In_ ULONG level
+   );
+
+void
+TLInspectTraceFree(void);
+
+void
+TLInspectTraceSetLevel(
+   _In_ ULONG level
+   );
+
+void
+TLInspectTraceQueryInfo(
+   _Out_ TL_INSPECT_TRACE_INFO* info
+   );
+
+void
+TLInspectTraceWrite(
+   _In_ const TL_INSPECT_TRACE_RECORD* record
+   );
+
+void
+TLInspectTracePacket(
+   _In_ TL_INSPECT_TRACE_EVENT event,
+   _In_ UINT16 layerId,
+   _In_ FWP_DIRECTION direction,
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ TL_INSPECT_TRACE_VERDICT verdict
+   );
+
+void
+TLInspectTracePendedPacket(
+   _In_ TL_INSPECT_TRACE_EVENT event,
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _In_ TL_INSPECT_TRACE_VERDICT verdict
+   );
+
+NTSTATUS
+TLInspectTraceRead(
+   _In_ const TL_INSPECT_TRACE_READ_INPUT* input,
+   _Out_writes_bytes_to_(outputLength, *bytesReturned)
+      TL_INSPECT_TRACE_READ_OUTPUT* output,
+   _In_ SIZE_T outputLength,
+   _Out_ SIZE_T* bytesReturned
+   );
+
+#endif // _TL_INSPECT_TRACE_H_
@@ -28,48 +28,12 @@ Environment:
 
 #include "inspect.h"
 #include "utils.h"
+#include "alloc.h"
+#include "policy.h"
+#include "overload.h"
+#include "queue.h"
 
 
-BOOLEAN IsAleReauthorize(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues
-   )
-{
-   UINT flagsIndex;
-
-   GetFlagsIndexesForLayer(
-      inFixedValues->layerId,
-      &flagsIndex
-      );
-
-   if((flagsIndex != UINT_MAX) && ((inFixedValues->incomingValue\
-      [flagsIndex].value.uint32 & FWP_CONDITION_FLAG_IS_REAUTHORIZE) != 0))
-   {
-      return TRUE;
-   }
-
-   return FALSE;
-}
-
-BOOLEAN IsSecureConnection(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues
-   )
-{
-   UINT flagsIndex;
-
-   GetFlagsIndexesForLayer(
-      inFixedValues->layerId,
-      &flagsIndex
-      );
-
-   if ((flagsIndex != UINT_MAX) && ((inFixedValues->incomingValue\
-       [flagsIndex].value.uint32 & FWP_CONDITION_FLAG_IS_IPSEC_SECURED) != 0))
-   {
-      return TRUE;
-   }
-
-   return FALSE;
-}
-
 BOOLEAN
 IsAleClassifyRequired(
    _In_ const FWPS_INCOMING_VALUES* inFixedValues,
@@ -87,173 +51,6 @@ IsAleClassifyRequired(
              );
 }
 
-BOOLEAN
-IsMatchingConnectPacket(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ ADDRESS_FAMILY addressFamily,
-   _In_ FWP_DIRECTION direction,
-   _Inout_ TL_INSPECT_PENDED_PACKET* pendedPacket
-   )
-{
-   UINT localAddrIndex;
-   UINT remoteAddrIndex;
-   UINT localPortIndex;
-   UINT remotePortIndex;
-   UINT protocolIndex;
-
-   NT_ASSERT(pendedPacket->type == TL_INSPECT_CONNECT_PACKET);
-
-   GetNetwork5TupleIndexesForLayer(
-      inFixedValues->layerId,
-      &localAddrIndex,
-      &remoteAddrIndex,
-      &localPortIndex,
-      &remotePortIndex,
-      &protocolIndex
-      );
-
-   if(localAddrIndex == UINT_MAX)
-   {
-      return FALSE;
-   }
-
-   if (addressFamily != pendedPacket->addressFamily)
-   {
-      return FALSE;
-   }
-
-   if (direction != pendedPacket->direction)
-   {
-      return FALSE;
-   }
-
-   if (inFixedValues->incomingValue[protocolIndex].value.uint8 !=
-       pendedPacket->protocol)
-   {
-      return FALSE;
-   }
-
-   if (RtlUshortByteSwap(
-         inFixedValues->incomingValue[localPortIndex].value.uint16
-         ) != pendedPacket->localPort)
-   {
-      return FALSE;
-   }
-
-   if (RtlUshortByteSwap(
-         inFixedValues->incomingValue[remotePortIndex].value.uint16
-         ) != pendedPacket->remotePort)
-   {
-      return FALSE;
-   }
-
-   if (addressFamily == AF_INET)
-   {
-      UINT32 ipv4LocalAddr =
-         RtlUlongByteSwap(
-            inFixedValues->incomingValue[localAddrIndex].value.uint32
-            );
-      UINT32 ipv4RemoteAddr =
-      // Prefast thinks we are ignoring this return value.
-      // If driver is unloading, we give up and ignore it on purpose.
-      // Otherwise, we put the pointer onto the list, but we make it opaque
-      // by casting it as a UINT64, and this tricks Prefast.
-         RtlUlongByteSwap( /* host-order -> network-order conversion */
-            inFixedValues->incomingValue[remoteAddrIndex].value.uint32
-            );
-      if (ipv4LocalAddr != pendedPacket->ipv4LocalAddr)
-      {
-         return FALSE;
-      }
-
-      if (ipv4RemoteAddr != pendedPacket->ipv4RemoteAddr)
-      {
-         return FALSE;
-      }
-   }
-   else
-   {
-      if (RtlCompareMemory(
-            inFixedValues->incomingValue[localAddrIndex].value.byteArray16,
-            &pendedPacket->localAddr,
-            sizeof(FWP_BYTE_ARRAY16)) !=  sizeof(FWP_BYTE_ARRAY16))
-      {
-         return FALSE;
-      }
-
-      if (RtlCompareMemory(
-            inFixedValues->incomingValue[remoteAddrIndex].value.byteArray16,
-            &pendedPacket->remoteAddr,
-            sizeof(FWP_BYTE_ARRAY16)) !=  sizeof(FWP_BYTE_ARRAY16))
-      {
-         return FALSE;
-      }
-   }
-
-   return TRUE;
-}
-
-void
-FillNetwork5Tuple(
-   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
-   _In_ ADDRESS_FAMILY addressFamily,
-   _Inout_ TL_INSPECT_PENDED_PACKET* packet
-   )
-{
-   UINT localAddrIndex;
-   UINT remoteAddrIndex;
-   UINT localPortIndex;
-   UINT remotePortIndex;
-   UINT protocolIndex;
-
-   GetNetwork5TupleIndexesForLayer(
-      inFixedValues->layerId,
-      &localAddrIndex,
-      &remoteAddrIndex,
-      &localPortIndex,
-      &remotePortIndex,
-      &protocolIndex
-      );
-
-   if (addressFamily == AF_INET)
-   {
-      packet->ipv4LocalAddr =
-         RtlUlongByteSwap( /* host-order -> network-order conversion */
-            inFixedValues->incomingValue[localAddrIndex].value.uint32
-            );
-      packet->ipv4RemoteAddr =
-         RtlUlongByteSwap( /* host-order -> network-order conversion */
-            inFixedValues->incomingValue[remoteAddrIndex].value.uint32
-            );
-   }
-   else
-   {
-      RtlCopyMemory(
-         (UINT8*)&packet->localAddr,
-         inFixedValues->incomingValue[localAddrIndex].value.byteArray16,
-         sizeof(FWP_BYTE_ARRAY16)
-         );
-      RtlCopyMemory(
-         (UINT8*)&packet->remoteAddr,
-         inFixedValues->incomingValue[remoteAddrIndex].value.byteArray16,
-         sizeof(FWP_BYTE_ARRAY16)
-         );
-   }
-
-   packet->localPort =
-      RtlUshortByteSwap(
-         inFixedValues->incomingValue[localPortIndex].value.uint16
-         );
-   packet->remotePort =
-      RtlUshortByteSwap(
-         inFixedValues->incomingValue[remotePortIndex].value.uint16
-         );
-
-   packet->protocol = inFixedValues->incomingValue[protocolIndex].value.uint8;
-
-   return;
-}
-
 void
 FreePendedPacket(
    _Inout_ __drv_freesMem(Mem) TL_INSPECT_PENDED_PACKET* packet
@@ -263,10 +60,8 @@ FreePendedPacket(
    {
       FwpsDereferenceNetBufferList(packet->netBufferList, FALSE);
    }
-   if (packet->controlData != NULL)
-   {
-      ExFreePoolWithTag(packet->controlData, TL_INSPECT_CONTROL_DATA_POOL_TAG);
-   }
+   TLInspectFreeControlData(packet);
+   TLInspectOverloadRelease(packet);
    if (packet->completionContext != NULL)
    {
       NT_ASSERT(packet->type == TL_INSPECT_CONNECT_PACKET);
@@ -275,7 +70,36 @@ FreePendedPacket(
                                                           // of the packet.
       FwpsCompleteOperation(packet->completionContext, NULL);
    }
-   ExFreePoolWithTag(packet, TL_INSPECT_PENDED_PACKET_POOL_TAG);
+   TLInspectFreePendedPacketMemory(packet);
+}
+
+UINT64
+TLInspectHashAppId(
+   _In_ const FWP_VALUE* appId
+   )
+/* ++
+
+   Returns the FNV-1a hash of the ALE application id, the path of the
+   executable, or 0 if the value has none.
+
+-- */
+{
+   UINT64 hash = 0xcbf29ce484222325ull;
+   UINT32 i;
+
+   if ((appId->type != FWP_BYTE_BLOB_TYPE) || (appId->byteBlob == NULL) ||
+       (appId->byteBlob->size == 0))
+   {
+      return 0;
+   }
+
+   for (i = 0; i < appId->byteBlob->size; i++)
+   {
+      hash ^= appId->byteBlob->data[i];
+      hash *= 0x100000001b3ull;
+   }
+
+   return hash;
 }
 
 __drv_allocatesMem(Mem)
@@ -283,7 +107,7 @@ TL_INSPECT_PENDED_PACKET*
 AllocateAndInitializePendedPacket(
    _In_ const FWPS_INCOMING_VALUES* inFixedValues,
    _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
-   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ const TL_INSPECT_LAYER* layer,
    _Inout_opt_ void* layerData,
    _In_ TL_INSPECT_PACKET_TYPE packetType,
    _In_ FWP_DIRECTION packetDirection
@@ -291,11 +115,7 @@ AllocateAndInitializePendedPacket(
 {
    TL_INSPECT_PENDED_PACKET* pendedPacket;
 
-   pendedPacket = ExAllocatePoolZero(
-                        NonPagedPool,
-                        sizeof(TL_INSPECT_PENDED_PACKET),
-                        TL_INSPECT_PENDED_PACKET_POOL_TAG
-                        );
+   pendedPacket = TLInspectAllocatePendedPacket();
 
    if (pendedPacket == NULL)
    {
@@ -304,15 +124,32 @@ AllocateAndInitializePendedPacket(
 
    pendedPacket->type = packetType;
    pendedPacket->direction = packetDirection;
+   pendedPacket->layerId = inFixedValues->layerId;
 
-   pendedPacket->addressFamily = addressFamily;
+   pendedPacket->addressFamily = layer->addressFamily;
 
    FillNetwork5Tuple(
       inFixedValues,
-      addressFamily,
+      layer,
       pendedPacket
       );
 
+   pendedPacket->flowHash = TLInspectFlowHash(inFixedValues, layer);
+
+   if (FWPS_IS_METADATA_FIELD_PRESENT(
+         inMetaValues,
+         FWPS_METADATA_FIELD_PROCESS_ID))
+   {
+      pendedPacket->processId = inMetaValues->processId;
+   }
+
+   if (layer->appId != TL_INSPECT_LAYER_NO_FIELD)
+   {
+      pendedPacket->appId = TLInspectHashAppId(
+                               &inFixedValues->incomingValue[layer->appId].value
+                               );
+   }
+
    if (layerData != NULL)
    {
       pendedPacket->netBufferList = layerData;
@@ -344,12 +181,10 @@ AllocateAndInitializePendedPacket(
       {
          NT_ASSERT(inMetaValues->controlDataLength > 0);
 
-         pendedPacket->controlData = ExAllocatePoolZero(
-                                       NonPagedPool,
-                                       inMetaValues->controlDataLength,
-                                       TL_INSPECT_CONTROL_DATA_POOL_TAG
-                                       );
-         if (pendedPacket->controlData == NULL)
+         if (TLInspectAllocateControlData(
+               pendedPacket,
+               inMetaValues->controlDataLength
+               ) == NULL)
          {
             goto Exit;
          }
@@ -365,19 +200,12 @@ AllocateAndInitializePendedPacket(
    }
    else if (pendedPacket->direction == FWP_DIRECTION_INBOUND)
    {
-      UINT interfaceIndexIndex = 0;
-      UINT subInterfaceIndexIndex = 0;
-
-      GetDeliveryInterfaceIndexesForLayer(
-         inFixedValues->layerId,
-         &interfaceIndexIndex,
-         &subInterfaceIndexIndex
-         );
+      NT_ASSERT(layer->interfaceIndex != TL_INSPECT_LAYER_NO_FIELD);
 
       pendedPacket->interfaceIndex =
-         inFixedValues->incomingValue[interfaceIndexIndex].value.uint32;
+         inFixedValues->incomingValue[layer->interfaceIndex].value.uint32;
       pendedPacket->subInterfaceIndex =
-         inFixedValues->incomingValue[subInterfaceIndexIndex].value.uint32;
+         inFixedValues->incomingValue[layer->subInterfaceIndex].value.uint32;
 
       NT_ASSERT(FWPS_IS_METADATA_FIELD_PRESENT(
                inMetaValues,
@@ -407,6 +235,8 @@ AllocateAndInitializePendedPacket(
       }
    }
 
+   TLInspectOverloadCharge(pendedPacket);
+
    return pendedPacket;
 
 Exit:
@@ -419,27 +249,307 @@ Exit:
    return NULL;
 }
 
-extern WDFKEY gParametersKey;
+BOOLEAN
+IsAddressInspected(
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_ const UINT8* remoteAddr
+   )
+/* ++
+
+   Looks up a remote address, in network order, in the prefixes of the
+   policy for IsRemoteAddressInspected and IsPacketInfoInspected.
+
+-- */
+{
+   const TL_INSPECT_POLICY* policy;
+   const TL_INSPECT_LPM_TABLE* table;
+   UINT16 value;
+   BOOLEAN inspected = TRUE;
+   KIRQL oldIrql;
+
+   policy = TLInspectPolicyAcquire(&oldIrql);
+
+   table = (addressFamily == AF_INET) ? &policy->prefixesV4 :
+                                        &policy->prefixesV6;
+
+   if (table->prefixCount != 0)
+   {
+      inspected = TLInspectLpmLookup(table, remoteAddr, &value) &&
+                  (value != TL_INSPECT_PREFIX_EXCLUDE);
+   }
+
+   TLInspectPolicyRelease(oldIrql);
+
+   return inspected;
+}
 
 BOOLEAN
-IsTrafficPermitted(void)
+IsRemoteAddressInspected(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer
+   )
+/* ++
+
+   This function returns TRUE if the longest prefix of the policy covering
+   the remote address of the classify is not an excluded one. Without any
+   prefix of the address family, every address is inspected.
+
+-- */
+{
+   UINT8 ipv4RemoteAddr[4];
+   const UINT8* remoteAddr;
+
+   if (layer->remoteAddress == TL_INSPECT_LAYER_NO_FIELD)
+   {
+      return TRUE;
+   }
+
+   if (layer->addressFamily == AF_INET)
+   {
+      UINT32 address =
+         inFixedValues->incomingValue[layer->remoteAddress].value.uint32;
+
+      ipv4RemoteAddr[0] = (UINT8)(address >> 24);
+      ipv4RemoteAddr[1] = (UINT8)(address >> 16);
+      ipv4RemoteAddr[2] = (UINT8)(address >> 8);
+      ipv4RemoteAddr[3] = (UINT8)address;
+      remoteAddr = ipv4RemoteAddr;
+   }
+   else
+   {
+      remoteAddr =
+         inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16->byteArray16;
+   }
+
+   return IsAddressInspected(layer->addressFamily, remoteAddr);
+}
+
+BOOLEAN
+IsPacketInfoInspected(
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ const TL_INSPECT_LAYER* layer
+   )
+/* ++
+
+   Same as IsRemoteAddressInspected, for a packet parsed at an IP packet
+   layer.
+
+-- */
+{
+   const FWP_BYTE_ARRAY16* remoteAddr =
+      (layer->direction == FWP_DIRECTION_OUTBOUND) ?
+         &info->destinationAddress : &info->sourceAddress;
+
+   return IsAddressInspected(layer->addressFamily, remoteAddr->byteArray16);
+}
+
+TL_INSPECT_RULE_ACTION
+GetRuleAction(
+   _In_ const TL_INSPECT_POLICY* policy,
+   _In_ ADDRESS_FAMILY addressFamily,
+   _In_reads_(TL_INSPECT_RULE_FIELD_COUNT) const TL_INSPECT_RULE_VALUE* values
+   )
+{
+   const TL_INSPECT_RULE_SET* set;
+   TL_INSPECT_RULE_ACTION action;
+
+   set = (addressFamily == AF_INET) ? &policy->rulesV4 : &policy->rulesV6;
+
+   if (!TLInspectRulesLookup(set, values, &action))
+   {
+      return TL_INSPECT_RULE_ACTION_INSPECT;
+   }
+
+   return action;
+}
+
+TL_INSPECT_RULE_ACTION
+GetRuleActionForClassify(
+   _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+   _In_ const TL_INSPECT_LAYER* layer
+   )
+/* ++
+
+   This function returns the action of the inspection rule of highest
+   priority that matches the classify; traffic that no rule matches is
+   inspected. The direction is the one of the layer, which at the ALE
+   layers is the direction of the connection rather than the one of the
+   packet.
+
+-- */
 {
-   NTSTATUS status;
-   BOOLEAN permitTraffic = TRUE;
-   DECLARE_CONST_UNICODE_STRING(valueName, L"BlockTraffic");
-   ULONG result;
-
-   status = WdfRegistryQueryULong(
-               gParametersKey,
-               &valueName,
-               &result
-               );
-
-   if (NT_SUCCESS(status) && result != 0)
+   TL_INSPECT_RULE_VALUE values[TL_INSPECT_RULE_FIELD_COUNT] = {0};
+   const TL_INSPECT_POLICY* policy;
+   TL_INSPECT_RULE_ACTION action;
+   KIRQL oldIrql;
+
+   if (layer->remoteAddress == TL_INSPECT_LAYER_NO_FIELD)
+   {
+      return TL_INSPECT_RULE_ACTION_INSPECT;
+   }
+
+   if (layer->addressFamily == AF_INET)
+   {
+      values[TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS].low =
+         inFixedValues->incomingValue[layer->localAddress].value.uint32;
+      values[TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS].low =
+         inFixedValues->incomingValue[layer->remoteAddress].value.uint32;
+   }
+   else
    {
-      permitTraffic = FALSE;
+      TLInspectRuleValueFromAddress(
+         &values[TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS],
+         inFixedValues->incomingValue[layer->localAddress].value.byteArray16->byteArray16,
+         128
+         );
+      TLInspectRuleValueFromAddress(
+         &values[TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS],
+         inFixedValues->incomingValue[layer->remoteAddress].value.byteArray16->byteArray16,
+         128
+         );
    }
 
+   values[TL_INSPECT_RULE_FIELD_LOCAL_PORT].low =
+      inFixedValues->incomingValue[layer->localPort].value.uint16;
+   values[TL_INSPECT_RULE_FIELD_REMOTE_PORT].low =
+      inFixedValues->incomingValue[layer->remotePort].value.uint16;
+   values[TL_INSPECT_RULE_FIELD_PROTOCOL].low =
+      inFixedValues->incomingValue[layer->protocol].value.uint8;
+   values[TL_INSPECT_RULE_FIELD_DIRECTION].low = layer->direction;
+
+   policy = TLInspectPolicyAcquire(&oldIrql);
+   action = GetRuleAction(policy, layer->addressFamily, values);
+   TLInspectPolicyRelease(oldIrql);
+
+   return action;
+}
+
+BOOLEAN
+IsPacketPermitted(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   This function returns the verdict of the policy on a pended packet or
+   connection, whose addresses and ports are held in network order: the
+   action of the inspection rule of highest priority that matches it, or
+   the traffic verdict if the rule inspects it or no rule matches it.
+
+-- */
+{
+   TL_INSPECT_RULE_VALUE values[TL_INSPECT_RULE_FIELD_COUNT] = {0};
+   UINT32 addressLength = (packet->addressFamily == AF_INET) ? 32 : 128;
+   const TL_INSPECT_POLICY* policy;
+   TL_INSPECT_RULE_ACTION action;
+   BOOLEAN permitTraffic;
+   KIRQL oldIrql;
+
+   TLInspectRuleValueFromAddress(
+      &values[TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS],
+      (const UINT8*)&packet->localAddr,
+      addressLength
+      );
+   TLInspectRuleValueFromAddress(
+      &values[TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS],
+      (const UINT8*)&packet->remoteAddr,
+      addressLength
+      );
+
+   values[TL_INSPECT_RULE_FIELD_LOCAL_PORT].low =
+      RtlUshortByteSwap(packet->localPort);
+   values[TL_INSPECT_RULE_FIELD_REMOTE_PORT].low =
+      RtlUshortByteSwap(packet->remotePort);
+   values[TL_INSPECT_RULE_FIELD_PROTOCOL].low = packet->protocol;
+   //
+   // Rules match the direction of the layer, as in the classify, rather
+   // than the direction of the packet within its connection.
+   //
+   values[TL_INSPECT_RULE_FIELD_DIRECTION].low =
+      TLInspectLayerForId(packet->layerId)->direction;
+
+   policy = TLInspectPolicyAcquire(&oldIrql);
+
+   action = GetRuleAction(policy, packet->addressFamily, values);
+
+   permitTraffic = (action == TL_INSPECT_RULE_ACTION_INSPECT) ?
+                   policy->permitTraffic :
+                   (action == TL_INSPECT_RULE_ACTION_PERMIT);
+
+   TLInspectPolicyRelease(oldIrql);
+
+   return permitTraffic;
+}
+
+BOOLEAN
+IsPacketInfoPermitted(
+   _In_ const TL_INSPECT_PACKET_INFO* info,
+   _In_ const TL_INSPECT_LAYER* layer,
+   _Out_ TL_INSPECT_RULE_ACTION* ruleAction
+   )
+/* ++
+
+   Same as IsPacketPermitted, for a packet parsed at an IP packet layer.
+   The action of the matching rule, or TL_INSPECT_RULE_ACTION_INSPECT if
+   none decides the packet, is returned in ruleAction.
+
+-- */
+{
+   TL_INSPECT_RULE_VALUE values[TL_INSPECT_RULE_FIELD_COUNT] = {0};
+   UINT32 addressLength = (info->addressFamily == AF_INET) ? 32 : 128;
+   BOOLEAN outbound = (layer->direction == FWP_DIRECTION_OUTBOUND);
+   const TL_INSPECT_POLICY* policy;
+   BOOLEAN permitTraffic;
+   KIRQL oldIrql;
+
+   TLInspectRuleValueFromAddress(
+      &values[TL_INSPECT_RULE_FIELD_LOCAL_ADDRESS],
+      outbound ? info->sourceAddress.byteArray16 :
+                 info->destinationAddress.byteArray16,
+      addressLength
+      );
+   TLInspectRuleValueFromAddress(
+      &values[TL_INSPECT_RULE_FIELD_REMOTE_ADDRESS],
+      outbound ? info->destinationAddress.byteArray16 :
+                 info->sourceAddress.byteArray16,
+      addressLength
+      );
+
+   values[TL_INSPECT_RULE_FIELD_LOCAL_PORT].low =
+      outbound ? info->sourcePort : info->destinationPort;
+   values[TL_INSPECT_RULE_FIELD_REMOTE_PORT].low =
+      outbound ? info->destinationPort : info->sourcePort;
+   values[TL_INSPECT_RULE_FIELD_PROTOCOL].low = info->protocol;
+   values[TL_INSPECT_RULE_FIELD_DIRECTION].low = layer->direction;
+
+   policy = TLInspectPolicyAcquire(&oldIrql);
+
+   *ruleAction = GetRuleAction(policy, info->addressFamily, values);
+
+   permitTraffic = (*ruleAction == TL_INSPECT_RULE_ACTION_INSPECT) ?
+                   policy->permitTraffic :
+                   (*ruleAction == TL_INSPECT_RULE_ACTION_PERMIT);
+
+   TLInspectPolicyRelease(oldIrql);
+
+   return permitTraffic;
+}
+
+BOOLEAN
+IsTrafficPermitted(void)
+/* ++
+
+   This function returns the traffic verdict of the policy.
+
+-- */
+{
+   const TL_INSPECT_POLICY* policy;
+   BOOLEAN permitTraffic;
+   KIRQL oldIrql;
+
+   policy = TLInspectPolicyAcquire(&oldIrql);
+   permitTraffic = policy->permitTraffic;
+   TLInspectPolicyRelease(oldIrql);
+
    return permitTraffic;
 }
 
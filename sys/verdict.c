@@ -0,0 +1,1205 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the verdict channel of the Transport Inspect
+   sample, through which a user-mode policy daemon decides the pended
+   traffic instead of the policy of the driver.
+
+   The daemon sends IOCTL_TL_INSPECT_EXCHANGE_VERDICTS requests, each
+   carrying the verdicts it took since its previous one, and keeps several
+   outstanding. A worker that dequeues a connect or packet while the daemon
+   is attached submits its descriptor to the ring of the channel instead of
+   deciding it, and completes a parked request with it; descriptors that
+   find no parked request wait for the next one. The requests are
+   completed with as many descriptors as they hold, so that under load a
+   round trip of the daemon decides a batch of them.
+
+   A daemon may instead map the packet ring (see pktring.h), split in
+   partitions that its threads poll: the descriptors, with the first bytes
+   of their packets, are then written to the partition of their flow as
+   they are submitted, and the verdicts read back from the completion
+   rings by the workers, each time they submit a descriptor or run out of
+   work, and by the timer. The daemon only sends a request to wait on a
+   partition it found empty, which the next descriptor written to it
+   completes.
+
+   Verdicts are applied from the head of the ring by whichever thread
+   finds it decided, in submission order, and under a claim so that the
+   injections of two threads do not interleave. A descriptor not decided
+   within the verdict timeout, or still waiting when the daemon closes its
+   handle, or pushed out of a full ring, is decided by the default verdict:
+   the one of the policy of the driver.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "utils.h"
+#include "stats.h"
+#include "verdict.h"
+#include "pktring.h"
+
+//
+// TL_INSPECT_VERDICT_CHANNEL is the state of the channel. lock protects
+// the ring, daemon and the arming of the timer; pendingQueue holds the
+// parked requests of the daemon. active is set while the daemon is
+// attached or the ring holds descriptors, so that the workers only take
+// the lock while the channel is in use. retiring is the claim of the
+// thread applying verdicts. timeout is in 100ns units. packetRing is the
+// packet ring of the daemon, if it mapped one, and waitQueues hold its
+// wait requests, per partition; both are protected by lock.
+//
+typedef struct TL_INSPECT_VERDICT_CHANNEL_
+{
+   KSPIN_LOCK lock;
+   TL_INSPECT_VERDICT_RING ring;
+   WDFQUEUE pendingQueue;
+   WDFFILEOBJECT daemon;
+
+   TL_INSPECT_PACKET_RING* packetRing;
+   WDFQUEUE waitQueues[TL_INSPECT_PACKET_RING_MAX_PARTITIONS];
+
+   volatile LONG active;
+   volatile LONG retiring;
+
+   UINT64 timeout;
+   BOOLEAN timerSet;
+   KTIMER timer;
+   KDPC timerDpc;
+} TL_INSPECT_VERDICT_CHANNEL;
+
+//
+// TL_INSPECT_VERDICT_RETIRED holds a verdict taken from the ring, to be
+// applied once the lock is released.
+//
+typedef struct TL_INSPECT_VERDICT_RETIRED_
+{
+   TL_INSPECT_PENDED_PACKET* packet;
+   LONG generation;
+   UINT32 verdict;
+} TL_INSPECT_VERDICT_RETIRED;
+
+C_ASSERT(TL_INSPECT_PACKET_RING_SIZE == TL_INSPECT_VERDICT_RING_SIZE);
+
+TL_INSPECT_VERDICT_CHANNEL gVerdict;
+
+KDEFERRED_ROUTINE TLInspectVerdictTimerDpc;
+
+void
+TLInspectVerdictFillRequest(
+   _In_ const TL_INSPECT_PENDED_PACKET* packet,
+   _Out_ TL_INSPECT_VERDICT_REQUEST* request
+   )
+{
+   SIZE_T length;
+
+   RtlZeroMemory(request, sizeof(*request));
+
+   request->processId = packet->processId;
+   request->appId = packet->appId;
+   request->type = (UINT8)packet->type;
+   request->direction = (UINT8)packet->direction;
+   request->protocol = packet->protocol;
+   request->localPort = RtlUshortByteSwap(packet->localPort);
+   request->remotePort = RtlUshortByteSwap(packet->remotePort);
+
+   if (packet->addressFamily == AF_INET)
+   {
+      request->addressFamily = 4;
+      length = sizeof(UINT32);
+   }
+   else
+   {
+      request->addressFamily = 6;
+      length = sizeof(FWP_BYTE_ARRAY16);
+   }
+
+   RtlCopyMemory(request->localAddress, &packet->localAddr, length);
+   RtlCopyMemory(request->remoteAddress, &packet->remoteAddr, length);
+}
+
+void
+TLInspectVerdictSetTimer(
+   _In_ BOOLEAN set
+   )
+/* ++
+
+   Starts or stops the periodic check of the timeouts; called with the lock
+   held.
+
+-- */
+{
+   LARGE_INTEGER dueTime;
+
+   if (set == gVerdict.timerSet)
+   {
+      return;
+   }
+
+   if (set)
+   {
+      dueTime.QuadPart = -(LONGLONG)TL_INSPECT_VERDICT_TIMER_PERIOD * 10000;
+
+      KeSetTimerEx(
+         &gVerdict.timer,
+         dueTime,
+         TL_INSPECT_VERDICT_TIMER_PERIOD,
+         &gVerdict.timerDpc
+         );
+   }
+   else
+   {
+      KeCancelTimer(&gVerdict.timer);
+   }
+
+   gVerdict.timerSet = set;
+}
+
+void
+TLInspectVerdictUpdateActive(void)
+/* ++
+
+   Clears active, and stops the timer, once the daemon is gone and the ring
+   is empty; called with the lock held.
+
+-- */
+{
+   if ((gVerdict.daemon == NULL) &&
+       TLInspectVerdictRingEmpty(&gVerdict.ring))
+   {
+      InterlockedExchange(&gVerdict.active, FALSE);
+      TLInspectVerdictSetTimer(FALSE);
+   }
+}
+
+BOOLEAN
+TLInspectVerdictHeadDecided(void)
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   const TL_INSPECT_VERDICT_RING* ring = &gVerdict.ring;
+   BOOLEAN decided;
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   decided = !TLInspectVerdictRingEmpty(ring) &&
+             (TLInspectVerdictRingSlot(ring, ring->head)->verdict !=
+                TL_INSPECT_VERDICT_UNDECIDED);
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   return decided;
+}
+
+void
+TLInspectVerdictRetire(void)
+/* ++
+
+   This function applies the verdicts decided at the head of the ring, if
+   no other thread is. The claim is dropped once the head is found
+   undecided and the injections are flushed; since a verdict may have been
+   recorded in between by a thread that found the claim taken, the head is
+   checked again after dropping it.
+
+-- */
+{
+   TL_INSPECT_VERDICT_RETIRED retired[TL_INSPECT_VERDICT_RETIRE_BATCH];
+   TL_INSPECT_INJECT_BATCH* batch = NULL;
+   KLOCK_QUEUE_HANDLE lockHandle;
+   const TL_INSPECT_VERDICT_SLOT* slot;
+   BOOLEAN permitTraffic;
+   ULONG count;
+   ULONG i;
+
+   do
+   {
+      if (InterlockedCompareExchange(&gVerdict.retiring, TRUE, FALSE) != FALSE)
+      {
+         return;
+      }
+
+      for (;;)
+      {
+         count = 0;
+
+         KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+         while ((count < TL_INSPECT_VERDICT_RETIRE_BATCH) &&
+                ((slot = TLInspectVerdictRingTake(&gVerdict.ring)) != NULL))
+         {
+            retired[count].packet = slot->context;
+            retired[count].generation = slot->generation;
+            retired[count].verdict = slot->verdict;
+            count++;
+         }
+
+         TLInspectVerdictUpdateActive();
+
+         KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+         if (count == 0)
+         {
+            break;
+         }
+
+         for (i = 0; i < count; i++)
+         {
+            if (retired[i].verdict == TL_INSPECT_VERDICT_DEFAULT)
+            {
+               permitTraffic = IsPacketPermitted(retired[i].packet);
+            }
+            else
+            {
+               permitTraffic = (retired[i].verdict == TL_INSPECT_VERDICT_PERMIT);
+            }
+
+            TLInspectApplyVerdict(
+               retired[i].packet,
+               permitTraffic,
+               retired[i].generation,
+               &batch
+               );
+         }
+      }
+
+      TLInspectBatchFlush(&batch);
+
+      InterlockedExchange(&gVerdict.retiring, FALSE);
+
+   } while (TLInspectVerdictHeadDecided());
+}
+
+ULONG
+TLInspectVerdictFillOutput(
+   _Inout_ TL_INSPECT_VERDICT_REQUESTS* output,
+   _In_ SIZE_T outputLength
+   )
+/* ++
+
+   Fills the output buffer of a request with the descriptors not yet sent;
+   called with the lock held. Returns the number of bytes filled, or 0 if
+   there was none.
+
+-- */
+{
+   UINT32 maxCount = (UINT32)min(
+                        (outputLength -
+                           FIELD_OFFSET(TL_INSPECT_VERDICT_REQUESTS, requests)) /
+                           sizeof(TL_INSPECT_VERDICT_REQUEST),
+                        TL_INSPECT_VERDICT_RING_SIZE
+                        );
+
+   output->count = TLInspectVerdictRingFill(
+                      &gVerdict.ring,
+                      output->requests,
+                      maxCount
+                      );
+   output->reserved = 0;
+
+   if (output->count == 0)
+   {
+      return 0;
+   }
+
+   return FIELD_OFFSET(TL_INSPECT_VERDICT_REQUESTS, requests) +
+          output->count * sizeof(TL_INSPECT_VERDICT_REQUEST);
+}
+
+BOOLEAN
+TLInspectVerdictConsumeCompletions(void)
+/* ++
+
+   Records the verdicts the daemon wrote to the completion rings of its
+   packet ring; called with the lock held. At most a ring of verdicts is
+   taken from each partition, so that a daemon that keeps writing them
+   cannot hold the lock; the rest are taken on its next exchange. Returns
+   TRUE if there were any.
+
+-- */
+{
+   TL_INSPECT_PACKET_RING* packetRing = gVerdict.packetRing;
+   TL_INSPECT_PACKET_RING_PARTITION* partition;
+   TL_INSPECT_VERDICT verdict;
+   LONG64 verdicts = 0;
+   LONG64 unknown = 0;
+   UINT32 count;
+   UINT32 i;
+
+   for (i = 0; i < packetRing->layout.partitions; i++)
+   {
+      partition = &packetRing->partitions[i];
+
+      for (count = 0; count < packetRing->layout.size; count++)
+      {
+         if (!TLInspectPacketRingNextCompletion(packetRing, partition, &verdict))
+         {
+            break;
+         }
+
+         if (TLInspectVerdictRingDecide(
+                &gVerdict.ring,
+                verdict.id,
+                verdict.verdict))
+         {
+            verdicts++;
+         }
+         else
+         {
+            unknown++;
+         }
+      }
+
+      if (count != 0)
+      {
+         TLInspectPacketRingReleaseCompletions(partition);
+      }
+   }
+
+   if (verdicts + unknown == 0)
+   {
+      return FALSE;
+   }
+
+   TLInspectStatsAdd(packetRing.completions, verdicts + unknown);
+   TLInspectStatsAdd(verdict.verdicts, verdicts);
+   TLInspectStatsAdd(verdict.unknown, unknown);
+
+   return TRUE;
+}
+
+WDFREQUEST
+TLInspectVerdictPublish(
+   _Inout_ TL_INSPECT_VERDICT_SLOT* slot,
+   _In_ const TL_INSPECT_PENDED_PACKET* packet
+   )
+/* ++
+
+   Writes the descriptor of the slot just added to the ring, and the first
+   bytes of its packet, to the partition of its flow in the packet ring;
+   called with the lock held. A descriptor whose partition is full is
+   decided by the default verdict. Returns the wait request parked for the
+   partition, if any, to be completed once the lock is released.
+
+-- */
+{
+   TL_INSPECT_PACKET_RING* packetRing = gVerdict.packetRing;
+   TL_INSPECT_PACKET_RING_PARTITION* partition;
+   TL_INSPECT_PACKET_DESCRIPTOR* descriptor;
+   WDFREQUEST request = NULL;
+   UINT32 packetLength;
+   ULONG captured;
+   UINT8* frame;
+
+   //
+   // Every descriptor is sent as it is submitted.
+   //
+   gVerdict.ring.sent = gVerdict.ring.tail;
+
+   partition = TLInspectPacketRingPartition(packetRing, packet->flowHash);
+
+   descriptor = TLInspectPacketRingReserve(packetRing, partition, &frame);
+   if (descriptor == NULL)
+   {
+      slot->verdict = TL_INSPECT_VERDICT_DEFAULT;
+      TLInspectStatsIncrement(packetRing.full);
+      return NULL;
+   }
+
+   captured = TLInspectPacketRingCapture(
+                 packet,
+                 frame,
+                 packetRing->layout.snapLength,
+                 &packetLength
+                 );
+
+   descriptor->request = slot->request;
+   descriptor->packetLength = packetLength;
+   descriptor->capturedLength = captured;
+   descriptor->reserved = 0;
+
+   TLInspectPacketRingPublish(partition);
+
+   TLInspectStatsIncrement(packetRing.published);
+   TLInspectStatsAdd(packetRing.capturedBytes, captured);
+
+   if (partition->waiting != 0)
+   {
+      if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+                        gVerdict.waitQueues[partition - packetRing->partitions],
+                        &request)))
+      {
+         partition->waiting--;
+         TLInspectStatsIncrement(packetRing.wakeups);
+      }
+      else
+      {
+         //
+         // The parked requests were cancelled.
+         //
+         partition->waiting = 0;
+         request = NULL;
+      }
+   }
+
+   return request;
+}
+
+BOOLEAN
+TLInspectVerdictSubmit(
+   _In_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ LONG generation
+   )
+/* ++
+
+   This function hands a dequeued connect or packet over to the daemon,
+   and returns FALSE if the channel is not in use, in which case the
+   caller decides it. Otherwise the channel owns the packet, and applies
+   the verdict of the daemon or the default one.
+
+   While no daemon is attached but descriptors are still waiting, the
+   packet is queued behind them already decided by the default verdict,
+   so that it is not injected ahead of earlier packets of its flow.
+
+   When the daemon mapped the packet ring, the verdicts it wrote meanwhile
+   are recorded, and applied along with the packet if it was decided.
+
+-- */
+{
+   TL_INSPECT_VERDICT_REQUEST descriptor;
+   TL_INSPECT_VERDICT_SLOT* slot;
+   TL_INSPECT_VERDICT_REQUESTS* output;
+   KLOCK_QUEUE_HANDLE lockHandle;
+   WDFREQUEST request = NULL;
+   SIZE_T outputLength;
+   ULONG bytesReturned = 0;
+   BOOLEAN attached;
+   BOOLEAN retire;
+   NTSTATUS status;
+
+   if (ReadNoFence(&gVerdict.active) == FALSE)
+   {
+      return FALSE;
+   }
+
+   TLInspectVerdictFillRequest(packet, &descriptor);
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   while (TLInspectVerdictRingFull(&gVerdict.ring))
+   {
+      TLInspectVerdictRingDefaultOldest(&gVerdict.ring);
+      TLInspectStatsIncrement(verdict.overflows);
+
+      KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+      TLInspectVerdictRetire();
+
+      KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+   }
+
+   if ((gVerdict.daemon == NULL) && TLInspectVerdictRingEmpty(&gVerdict.ring))
+   {
+      TLInspectVerdictUpdateActive();
+      KeReleaseInStackQueuedSpinLock(&lockHandle);
+      return FALSE;
+   }
+
+   slot = TLInspectVerdictRingAdd(
+             &gVerdict.ring,
+             &descriptor,
+             packet,
+             KeQueryInterruptTime() + gVerdict.timeout
+             );
+   slot->generation = generation;
+
+   attached = (gVerdict.daemon != NULL);
+   retire = !attached;
+
+   if (!attached)
+   {
+      slot->verdict = TL_INSPECT_VERDICT_DEFAULT;
+      gVerdict.ring.sent = gVerdict.ring.tail;
+   }
+   else if (gVerdict.packetRing != NULL)
+   {
+      TLInspectStatsIncrement(verdict.submitted);
+
+      request = TLInspectVerdictPublish(slot, packet);
+
+      retire = TLInspectVerdictConsumeCompletions() ||
+               (slot->verdict != TL_INSPECT_VERDICT_UNDECIDED);
+   }
+   else
+   {
+      TLInspectStatsIncrement(verdict.submitted);
+
+      status = WdfIoQueueRetrieveNextRequest(gVerdict.pendingQueue, &request);
+      if (NT_SUCCESS(status))
+      {
+         status = WdfRequestRetrieveOutputBuffer(
+                     request,
+                     sizeof(TL_INSPECT_VERDICT_REQUESTS),
+                     (PVOID*)&output,
+                     &outputLength
+                     );
+         NT_ASSERT(NT_SUCCESS(status));
+
+         bytesReturned = TLInspectVerdictFillOutput(output, outputLength);
+         TLInspectStatsAdd(verdict.delivered, output->count);
+      }
+      else
+      {
+         request = NULL;
+      }
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   if (request != NULL)
+   {
+      WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, bytesReturned);
+   }
+
+   if (retire)
+   {
+      TLInspectVerdictRetire();
+   }
+
+   return TRUE;
+}
+
+void
+TLInspectVerdictPoll(void)
+/* ++
+
+   This function records the verdicts waiting in the completion rings of
+   the packet ring, if the daemon mapped one, and applies those that can
+   be. The workers call it once they run out of work.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   BOOLEAN consumed = FALSE;
+
+   if (ReadPointerNoFence((PVOID*)&gVerdict.packetRing) == NULL)
+   {
+      return;
+   }
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   if (gVerdict.packetRing != NULL)
+   {
+      consumed = TLInspectVerdictConsumeCompletions();
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   if (consumed)
+   {
+      TLInspectVerdictRetire();
+   }
+}
+
+void
+TLInspectVerdictExchange(
+   _In_ WDFREQUEST request
+   )
+/* ++
+
+   This function handles IOCTL_TL_INSPECT_EXCHANGE_VERDICTS: it records
+   the verdicts of the request and applies those that can be, then
+   completes the request with the descriptors not yet sent, or parks it
+   until there are some. The first handle to send the request becomes the
+   daemon. It completes the request itself.
+
+-- */
+{
+   NTSTATUS status;
+   WDFFILEOBJECT fileObject = WdfRequestGetFileObject(request);
+   TL_INSPECT_VERDICT_BATCH* input;
+   TL_INSPECT_VERDICT_REQUESTS* output;
+   SIZE_T inputLength;
+   SIZE_T outputLength;
+   KLOCK_QUEUE_HANDLE lockHandle;
+   ULONG bytesReturned = 0;
+   LONG64 verdicts = 0;
+   LONG64 unknown = 0;
+   UINT32 i;
+
+   status = WdfRequestRetrieveInputBuffer(
+               request,
+               FIELD_OFFSET(TL_INSPECT_VERDICT_BATCH, verdicts),
+               (PVOID*)&input,
+               &inputLength
+               );
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   if (input->count > (inputLength -
+                         FIELD_OFFSET(TL_INSPECT_VERDICT_BATCH, verdicts)) /
+                         sizeof(TL_INSPECT_VERDICT))
+   {
+      status = STATUS_INVALID_PARAMETER;
+      goto Exit;
+   }
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               sizeof(TL_INSPECT_VERDICT_REQUESTS),
+               (PVOID*)&output,
+               &outputLength
+               );
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   if (gVerdict.daemon == NULL)
+   {
+      gVerdict.daemon = fileObject;
+      InterlockedExchange(&gVerdict.active, TRUE);
+      TLInspectVerdictSetTimer(TRUE);
+   }
+   else if (gVerdict.daemon != fileObject)
+   {
+      KeReleaseInStackQueuedSpinLock(&lockHandle);
+      status = STATUS_DEVICE_BUSY;
+      goto Exit;
+   }
+
+   //
+   // The input and output buffers are the same system buffer; the
+   // verdicts are all read before any descriptor is written.
+   //
+   for (i = 0; i < input->count; i++)
+   {
+      if (TLInspectVerdictRingDecide(
+             &gVerdict.ring,
+             input->verdicts[i].id,
+             input->verdicts[i].verdict))
+      {
+         verdicts++;
+      }
+      else
+      {
+         unknown++;
+      }
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   TLInspectStatsIncrement(verdict.exchanges);
+   TLInspectStatsAdd(verdict.verdicts, verdicts);
+   TLInspectStatsAdd(verdict.unknown, unknown);
+
+   TLInspectVerdictRetire();
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   bytesReturned = TLInspectVerdictFillOutput(output, outputLength);
+
+   if (bytesReturned == 0)
+   {
+      //
+      // Parked under the lock, so that a descriptor submitted meanwhile
+      // finds the request.
+      //
+      status = WdfRequestForwardToIoQueue(request, gVerdict.pendingQueue);
+      if (NT_SUCCESS(status))
+      {
+         KeReleaseInStackQueuedSpinLock(&lockHandle);
+         return;
+      }
+   }
+   else
+   {
+      TLInspectStatsAdd(verdict.delivered, output->count);
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+Exit:
+
+   WdfRequestCompleteWithInformation(request, status, bytesReturned);
+}
+
+NTSTATUS
+TLInspectVerdictMapPacketRing(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   )
+/* ++
+
+   This function handles IOCTL_TL_INSPECT_MAP_PACKET_RING: it maps a new
+   packet ring into the calling process, and makes the handle the daemon.
+   It runs in the context of the caller, at PASSIVE_LEVEL.
+
+-- */
+{
+   NTSTATUS status;
+   WDFFILEOBJECT fileObject = WdfRequestGetFileObject(request);
+   TL_INSPECT_PACKET_RING_SETUP* input;
+   TL_INSPECT_PACKET_RING_SETUP setup;
+   TL_INSPECT_PACKET_RING_MAPPING* mapping;
+   TL_INSPECT_PACKET_RING_MAPPING layout;
+   TL_INSPECT_PACKET_RING* packetRing;
+   KLOCK_QUEUE_HANDLE lockHandle;
+
+   *bytesReturned = 0;
+
+   if (WdfRequestGetRequestorMode(request) != UserMode)
+   {
+      return STATUS_INVALID_DEVICE_REQUEST;
+   }
+
+   status = WdfRequestRetrieveInputBuffer(
+               request,
+               sizeof(TL_INSPECT_PACKET_RING_SETUP),
+               (PVOID*)&input,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   //
+   // The input and output buffers are the same system buffer; keep a copy
+   // of the input.
+   //
+   setup = *input;
+
+   status = WdfRequestRetrieveOutputBuffer(
+               request,
+               sizeof(TL_INSPECT_PACKET_RING_MAPPING),
+               (PVOID*)&mapping,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   status = TLInspectPacketRingCreate(&setup, &packetRing);
+   if (!NT_SUCCESS(status))
+   {
+      return status;
+   }
+
+   layout = packetRing->layout;
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   if (gVerdict.daemon == NULL)
+   {
+      gVerdict.daemon = fileObject;
+      gVerdict.packetRing = packetRing;
+      InterlockedExchange(&gVerdict.active, TRUE);
+      TLInspectVerdictSetTimer(TRUE);
+   }
+   else
+   {
+      //
+      // The descriptors a daemon was sent through exchange requests are
+      // not in the packet ring; it cannot switch to it.
+      //
+      status = (gVerdict.daemon == fileObject) ? STATUS_INVALID_DEVICE_STATE :
+                                                 STATUS_DEVICE_BUSY;
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   if (!NT_SUCCESS(status))
+   {
+      TLInspectPacketRingDestroy(packetRing);
+      return status;
+   }
+
+   *mapping = layout;
+   *bytesReturned = sizeof(TL_INSPECT_PACKET_RING_MAPPING);
+
+   return STATUS_SUCCESS;
+}
+
+void
+TLInspectVerdictWaitPacketRing(
+   _In_ WDFREQUEST request
+   )
+/* ++
+
+   This function handles IOCTL_TL_INSPECT_WAIT_PACKET_RING: it records the
+   verdicts of the completion rings and applies those that can be, then
+   completes the request if the partition holds descriptors the daemon has
+   not consumed, or parks it until one is written there. It completes the
+   request itself.
+
+-- */
+{
+   NTSTATUS status;
+   WDFFILEOBJECT fileObject = WdfRequestGetFileObject(request);
+   TL_INSPECT_PACKET_RING_PARTITION* partition;
+   KLOCK_QUEUE_HANDLE lockHandle;
+   BOOLEAN consumed;
+   UINT32* input;
+   UINT32 index;
+
+   status = WdfRequestRetrieveInputBuffer(
+               request,
+               sizeof(UINT32),
+               (PVOID*)&input,
+               NULL
+               );
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   index = *input;
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   if ((gVerdict.daemon != fileObject) || (gVerdict.packetRing == NULL))
+   {
+      KeReleaseInStackQueuedSpinLock(&lockHandle);
+      status = STATUS_INVALID_DEVICE_STATE;
+      goto Exit;
+   }
+
+   if (index >= gVerdict.packetRing->layout.partitions)
+   {
+      KeReleaseInStackQueuedSpinLock(&lockHandle);
+      status = STATUS_INVALID_PARAMETER;
+      goto Exit;
+   }
+
+   TLInspectStatsIncrement(packetRing.waits);
+
+   consumed = TLInspectVerdictConsumeCompletions();
+
+   partition = &gVerdict.packetRing->partitions[index];
+
+   if (!TLInspectPacketRingUnconsumed(partition))
+   {
+      //
+      // Parked under the lock, so that a descriptor written meanwhile
+      // finds the request.
+      //
+      status = WdfRequestForwardToIoQueue(request, gVerdict.waitQueues[index]);
+      if (NT_SUCCESS(status))
+      {
+         partition->waiting++;
+
+         KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+         if (consumed)
+         {
+            TLInspectVerdictRetire();
+         }
+         return;
+      }
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   if (consumed)
+   {
+      TLInspectVerdictRetire();
+   }
+
+Exit:
+
+   WdfRequestComplete(request, status);
+}
+
+void
+TLInspectVerdictFileCleanup(
+   _In_ WDFFILEOBJECT fileObject
+   )
+/* ++
+
+   This function detaches the daemon when its handle is closed: the
+   descriptors it did not decide are decided by the default verdict, its
+   parked requests are cancelled, and its packet ring is unmapped.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   TL_INSPECT_PACKET_RING* packetRing;
+   WDFREQUEST request;
+   ULONG i;
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   if (gVerdict.daemon != fileObject)
+   {
+      KeReleaseInStackQueuedSpinLock(&lockHandle);
+      return;
+   }
+
+   gVerdict.daemon = NULL;
+
+   //
+   // Once the lock is released, no thread reads or writes the ring.
+   //
+   packetRing = gVerdict.packetRing;
+   gVerdict.packetRing = NULL;
+
+   TLInspectVerdictRingDefaultAll(&gVerdict.ring);
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+   TLInspectVerdictRetire();
+
+   while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(
+                        gVerdict.pendingQueue,
+                        fileObject,
+                        &request)))
+   {
+      WdfRequestComplete(request, STATUS_CANCELLED);
+   }
+
+   if (packetRing == NULL)
+   {
+      return;
+   }
+
+   for (i = 0; i < packetRing->layout.partitions; i++)
+   {
+      while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(
+                           gVerdict.waitQueues[i],
+                           fileObject,
+                           &request)))
+      {
+         WdfRequestComplete(request, STATUS_CANCELLED);
+      }
+   }
+
+   TLInspectPacketRingDestroy(packetRing);
+}
+
+void
+TLInspectVerdictTimerDpc(
+   _In_ KDPC* dpc,
+   _In_opt_ void* deferredContext,
+   _In_opt_ void* systemArgument1,
+   _In_opt_ void* systemArgument2
+   )
+/* ++
+
+   This function decides the descriptors past their deadline by the
+   default verdict and applies them. The verdicts waiting in the
+   completion rings are recorded first, so that a verdict the daemon wrote
+   in time is not taken for a timeout.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+   ULONG expired;
+
+   UNREFERENCED_PARAMETER(dpc);
+   UNREFERENCED_PARAMETER(deferredContext);
+   UNREFERENCED_PARAMETER(systemArgument1);
+   UNREFERENCED_PARAMETER(systemArgument2);
+
+   KeAcquireInStackQueuedSpinLockAtDpcLevel(&gVerdict.lock, &lockHandle);
+
+   if (gVerdict.packetRing != NULL)
+   {
+      TLInspectVerdictConsumeCompletions();
+   }
+
+   expired = TLInspectVerdictRingExpire(
+                &gVerdict.ring,
+                KeQueryInterruptTime()
+                );
+
+   KeReleaseInStackQueuedSpinLockFromDpcLevel(&lockHandle);
+
+   if (expired != 0)
+   {
+      TLInspectStatsAdd(verdict.timeouts, expired);
+   }
+
+   TLInspectVerdictRetire();
+}
+
+LONG
+TLInspectVerdictPending(void)
+/* ++
+
+   Returns the number of descriptors in the ring, sampled without the lock.
+
+-- */
+{
+   return (LONG)(ReadULong64NoFence(&gVerdict.ring.tail) -
+                 ReadULong64NoFence(&gVerdict.ring.head));
+}
+
+BOOLEAN
+TLInspectVerdictAttached(void)
+{
+   return ReadPointerNoFence((PVOID*)&gVerdict.daemon) != NULL;
+}
+
+void
+TLInspectVerdictQueryPacketRing(
+   _Out_ UINT32* partitions,
+   _Out_ UINT32* snapLength
+   )
+/* ++
+
+   Returns the number of partitions and the snap length of the packet ring
+   of the daemon, 0 when it did not map one.
+
+-- */
+{
+   KLOCK_QUEUE_HANDLE lockHandle;
+
+   *partitions = 0;
+   *snapLength = 0;
+
+   KeAcquireInStackQueuedSpinLock(&gVerdict.lock, &lockHandle);
+
+   if (gVerdict.packetRing != NULL)
+   {
+      *partitions = gVerdict.packetRing->layout.partitions;
+      *snapLength = gVerdict.packetRing->layout.snapLength;
+   }
+
+   KeReleaseInStackQueuedSpinLock(&lockHandle);
+}
+
+NTSTATUS
+TLInspectVerdictInitialize(
+   _In_ WDFDEVICE device,
+   _In_ ULONG timeout
+   )
+/* ++
+
+   This function allocates the ring and creates the queues of the parked
+   requests of the daemon. timeout is in milliseconds.
+
+-- */
+{
+   NTSTATUS status;
+   WDF_IO_QUEUE_CONFIG queueConfig;
+   ULONG i;
+
+   RtlZeroMemory(&gVerdict, sizeof(gVerdict));
+
+   KeInitializeSpinLock(&gVerdict.lock);
+   KeInitializeTimerEx(&gVerdict.timer, NotificationTimer);
+   KeInitializeDpc(&gVerdict.timerDpc, TLInspectVerdictTimerDpc, NULL);
+
+   gVerdict.timeout = (UINT64)max(timeout, 1) * 10000;
+
+   gVerdict.ring.size = TL_INSPECT_VERDICT_RING_SIZE;
+   gVerdict.ring.slots = ExAllocatePoolZero(
+                            NonPagedPool,
+                            TL_INSPECT_VERDICT_RING_SIZE *
+                               sizeof(TL_INSPECT_VERDICT_SLOT),
+                            TL_INSPECT_VERDICT_POOL_TAG
+                            );
+   if (gVerdict.ring.slots == NULL)
+   {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      goto Exit;
+   }
+
+   WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+   status = WdfIoQueueCreate(
+               device,
+               &queueConfig,
+               WDF_NO_OBJECT_ATTRIBUTES,
+               &gVerdict.pendingQueue
+               );
+   if (!NT_SUCCESS(status))
+   {
+      goto Exit;
+   }
+
+   for (i = 0; i < TL_INSPECT_PACKET_RING_MAX_PARTITIONS; i++)
+   {
+      status = WdfIoQueueCreate(
+                  device,
+                  &queueConfig,
+                  WDF_NO_OBJECT_ATTRIBUTES,
+                  &gVerdict.waitQueues[i]
+                  );
+      if (!NT_SUCCESS(status))
+      {
+         goto Exit;
+      }
+   }
+
+Exit:
+
+   return status;
+}
+
+void
+TLInspectVerdictFree(void)
+/* ++
+
+   Called during unload once every worker thread has exited and the daemon
+   has closed its handle. The descriptors left in the ring are discarded
+   as TLInspectDrainQueues discards the pended packets: connects are
+   completed with a block decision, along with the connects coalesced with
+   them.
+
+-- */
+{
+   const TL_INSPECT_VERDICT_SLOT* slot;
+   TL_INSPECT_PENDED_PACKET* packet;
+
+   NT_ASSERT(gDriverUnloading);
+   NT_ASSERT(gVerdict.packetRing == NULL);
+
+   if (gVerdict.ring.slots == NULL)
+   {
+      return;
+   }
+
+   KeCancelTimer(&gVerdict.timer);
+   KeFlushQueuedDpcs();
+
+   TLInspectVerdictRingDefaultAll(&gVerdict.ring);
+
+   while ((slot = TLInspectVerdictRingTake(&gVerdict.ring)) != NULL)
+   {
+      packet = slot->context;
+
+      if (packet->type == TL_INSPECT_CONNECT_PACKET)
+      {
+         TLInspectDiscardConnect(packet);
+      }
+      else
+      {
+         FreePendedPacket(packet);
+      }
+   }
+
+   ExFreePoolWithTag(gVerdict.ring.slots, TL_INSPECT_VERDICT_POOL_TAG);
+   gVerdict.ring.slots = NULL;
+}
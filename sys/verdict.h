@@ -0,0 +1,375 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the verdict channel of the Transport Inspect
+   sample, through which a user-mode policy daemon decides the pended
+   traffic (see verdict.c), and the ring of descriptors it is built on.
+
+   The ring holds a slot per descriptor waiting to be decided or applied,
+   in the order the descriptors were submitted; the id of a descriptor is
+   its sequence number, which picks its slot. The slots from head to sent
+   have been returned to the daemon, the ones from sent to tail not yet.
+   Descriptors are decided in any order, but their verdicts are applied
+   from the head, in submission order, so that the packets of a flow are
+   injected in the order they were queued.
+
+   The functions of the ring are called with the lock of the channel held;
+   bench\verdictbench.c measures the channel built on them.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_VERDICT_H_
+#define _TL_INSPECT_VERDICT_H_
+
+#include "inspectioctl.h"
+
+//
+// Most descriptors waiting in the ring; a descriptor submitted while it is
+// full decides the oldest one by the default verdict.
+//
+#define TL_INSPECT_VERDICT_RING_SIZE 4096
+
+//
+// Verdict of a slot: TL_INSPECT_VERDICT_PERMIT or TL_INSPECT_VERDICT_BLOCK
+// once the daemon decided it, TL_INSPECT_VERDICT_DEFAULT once it timed out
+// or could not be sent, and TL_INSPECT_VERDICT_UNDECIDED before.
+//
+#define TL_INSPECT_VERDICT_UNDECIDED 0
+#define TL_INSPECT_VERDICT_DEFAULT 3
+
+//
+// Interval, in milliseconds, at which the descriptors are checked for
+// timeouts while the channel is in use.
+//
+#define TL_INSPECT_VERDICT_TIMER_PERIOD 10
+
+//
+// Most verdicts applied per acquisition of the lock of the channel.
+//
+#define TL_INSPECT_VERDICT_RETIRE_BATCH 64
+
+//
+// TL_INSPECT_VERDICT_SLOT holds a descriptor, the pended traffic it stands
+// for, and the time past which it is decided by the default verdict.
+// generation is the generation of the flow cache when the descriptor was
+// submitted, so that a verdict is not cached across a policy change.
+//
+typedef struct TL_INSPECT_VERDICT_SLOT_
+{
+   TL_INSPECT_VERDICT_REQUEST request;
+   void* context;
+   UINT64 deadline;
+   LONG generation;
+   UINT32 verdict;
+} TL_INSPECT_VERDICT_SLOT;
+
+typedef struct TL_INSPECT_VERDICT_RING_
+{
+   TL_INSPECT_VERDICT_SLOT* slots;
+   UINT32 size;                        // a power of 2
+   UINT64 head;
+   UINT64 sent;
+   UINT64 tail;
+} TL_INSPECT_VERDICT_RING;
+
+__inline
+TL_INSPECT_VERDICT_SLOT*
+TLInspectVerdictRingSlot(
+   _In_ const TL_INSPECT_VERDICT_RING* ring,
+   _In_ UINT64 id
+   )
+{
+   return &ring->slots[id & (ring->size - 1)];
+}
+
+__inline
+BOOLEAN
+TLInspectVerdictRingFull(
+   _In_ const TL_INSPECT_VERDICT_RING* ring
+   )
+{
+   return (ring->tail - ring->head) == ring->size;
+}
+
+__inline
+BOOLEAN
+TLInspectVerdictRingEmpty(
+   _In_ const TL_INSPECT_VERDICT_RING* ring
+   )
+{
+   return ring->tail == ring->head;
+}
+
+__inline
+TL_INSPECT_VERDICT_SLOT*
+TLInspectVerdictRingAdd(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring,
+   _In_ const TL_INSPECT_VERDICT_REQUEST* request,
+   _In_ void* context,
+   _In_ UINT64 deadline
+   )
+/* ++
+
+   Adds an undecided descriptor at the tail of the ring, which must not be
+   full, and returns its slot; the id of the descriptor is set.
+
+-- */
+{
+   TL_INSPECT_VERDICT_SLOT* slot = TLInspectVerdictRingSlot(ring, ring->tail);
+
+   slot->request = *request;
+   slot->request.id = ring->tail;
+   slot->context = context;
+   slot->deadline = deadline;
+   slot->generation = 0;
+   slot->verdict = TL_INSPECT_VERDICT_UNDECIDED;
+
+   ring->tail++;
+
+   return slot;
+}
+
+__inline
+UINT32
+TLInspectVerdictRingFill(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring,
+   _Out_writes_(maxCount) TL_INSPECT_VERDICT_REQUEST* requests,
+   _In_ UINT32 maxCount
+   )
+/* ++
+
+   Copies up to maxCount of the descriptors not yet sent, skipping those
+   decided meanwhile, and marks them sent. Returns the number copied.
+
+-- */
+{
+   UINT32 count = 0;
+
+   while ((ring->sent != ring->tail) && (count < maxCount))
+   {
+      const TL_INSPECT_VERDICT_SLOT* slot =
+         TLInspectVerdictRingSlot(ring, ring->sent);
+
+      if (slot->verdict == TL_INSPECT_VERDICT_UNDECIDED)
+      {
+         requests[count++] = slot->request;
+      }
+
+      ring->sent++;
+   }
+
+   return count;
+}
+
+__inline
+BOOLEAN
+TLInspectVerdictRingDecide(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring,
+   _In_ UINT64 id,
+   _In_ UINT32 verdict
+   )
+/* ++
+
+   Records the verdict of the daemon on a descriptor it was sent. Returns
+   FALSE if the descriptor was not sent, or is decided already, or if the
+   verdict has no known value; a descriptor sent with an unknown verdict is
+   decided by the default verdict.
+
+-- */
+{
+   TL_INSPECT_VERDICT_SLOT* slot;
+
+   if ((id - ring->head) >= (ring->sent - ring->head))
+   {
+      return FALSE;
+   }
+
+   slot = TLInspectVerdictRingSlot(ring, id);
+
+   if (slot->verdict != TL_INSPECT_VERDICT_UNDECIDED)
+   {
+      return FALSE;
+   }
+
+   if ((verdict != TL_INSPECT_VERDICT_PERMIT) &&
+       (verdict != TL_INSPECT_VERDICT_BLOCK))
+   {
+      slot->verdict = TL_INSPECT_VERDICT_DEFAULT;
+      return FALSE;
+   }
+
+   slot->verdict = verdict;
+
+   return TRUE;
+}
+
+__inline
+ULONG
+TLInspectVerdictRingExpire(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring,
+   _In_ UINT64 now
+   )
+/* ++
+
+   Decides by the default verdict the descriptors whose deadline passed,
+   and returns their number. The deadlines increase from the head, so the
+   scan stops at the first one not passed.
+
+-- */
+{
+   ULONG expired = 0;
+   UINT64 id;
+
+   for (id = ring->head; id != ring->tail; id++)
+   {
+      TL_INSPECT_VERDICT_SLOT* slot = TLInspectVerdictRingSlot(ring, id);
+
+      if (slot->deadline > now)
+      {
+         break;
+      }
+
+      if (slot->verdict == TL_INSPECT_VERDICT_UNDECIDED)
+      {
+         slot->verdict = TL_INSPECT_VERDICT_DEFAULT;
+         expired++;
+      }
+   }
+
+   return expired;
+}
+
+__inline
+void
+TLInspectVerdictRingDefaultOldest(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring
+   )
+{
+   TL_INSPECT_VERDICT_SLOT* slot = TLInspectVerdictRingSlot(ring, ring->head);
+
+   if (slot->verdict == TL_INSPECT_VERDICT_UNDECIDED)
+   {
+      slot->verdict = TL_INSPECT_VERDICT_DEFAULT;
+   }
+}
+
+__inline
+void
+TLInspectVerdictRingDefaultAll(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring
+   )
+{
+   UINT64 id;
+
+   for (id = ring->head; id != ring->tail; id++)
+   {
+      TL_INSPECT_VERDICT_SLOT* slot = TLInspectVerdictRingSlot(ring, id);
+
+      if (slot->verdict == TL_INSPECT_VERDICT_UNDECIDED)
+      {
+         slot->verdict = TL_INSPECT_VERDICT_DEFAULT;
+      }
+   }
+
+   ring->sent = ring->tail;
+}
+
+__inline
+const TL_INSPECT_VERDICT_SLOT*
+TLInspectVerdictRingTake(
+   _Inout_ TL_INSPECT_VERDICT_RING* ring
+   )
+/* ++
+
+   Removes the descriptor at the head of the ring if it is decided, and
+   returns its slot, which stays valid until the lock is released; returns
+   NULL otherwise.
+
+-- */
+{
+   TL_INSPECT_VERDICT_SLOT* slot;
+
+   if (TLInspectVerdictRingEmpty(ring))
+   {
+      return NULL;
+   }
+
+   slot = TLInspectVerdictRingSlot(ring, ring->head);
+
+   if (slot->verdict == TL_INSPECT_VERDICT_UNDECIDED)
+   {
+      return NULL;
+   }
+
+   ring->head++;
+   if (ring->sent < ring->head)
+   {
+      ring->sent = ring->head;
+   }
+
+   return slot;
+}
+
+#ifndef TL_INSPECT_VERDICT_USER_MODE
+
+BOOLEAN
+TLInspectVerdictSubmit(
+   _In_ TL_INSPECT_PENDED_PACKET* packet,
+   _In_ LONG generation
+   );
+
+void
+TLInspectVerdictPoll(void);
+
+void
+TLInspectVerdictExchange(
+   _In_ WDFREQUEST request
+   );
+
+NTSTATUS
+TLInspectVerdictMapPacketRing(
+   _In_ WDFREQUEST request,
+   _Out_ SIZE_T* bytesReturned
+   );
+
+void
+TLInspectVerdictWaitPacketRing(
+   _In_ WDFREQUEST request
+   );
+
+void
+TLInspectVerdictFileCleanup(
+   _In_ WDFFILEOBJECT fileObject
+   );
+
+LONG
+TLInspectVerdictPending(void);
+
+BOOLEAN
+TLInspectVerdictAttached(void);
+
+void
+TLInspectVerdictQueryPacketRing(
+   _Out_ UINT32* partitions,
+   _Out_ UINT32* snapLength
+   );
+
+NTSTATUS
+TLInspectVerdictInitialize(
+   _In_ WDFDEVICE device,
+   _In_ ULONG timeout
+   );
+
+void
+TLInspectVerdictFree(void);
+
+#endif // TL_INSPECT_VERDICT_USER_MODE
+
+#endif // _TL_INSPECT_VERDICT_H_
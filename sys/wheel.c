@@ -0,0 +1,143 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This file implements the periodic timer of the Transport Inspect
+   sample, which advances the timer wheels (see wheel.h) every tick: the
+   wheel of the pended connects, so that the connects left undecided or
+   left waiting for their re-auth for the connect timeout are done with
+   (see TLInspectExpireConnects), and the wheels of the verdict caches, so
+   that their entries are freed once expired (see
+   TLInspectFlowCacheExpire).
+
+   Each wheel is advanced under the lock of its owner, and the timers that
+   fired are handled once it is released, so the DPC holds no lock for
+   longer than the timers of a tick take to move.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201)       // unnamed struct/union
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "inspect.h"
+#include "flowcache.h"
+
+//
+// TL_INSPECT_WHEEL_CLOCK is the periodic timer; started is set while it
+// runs.
+//
+typedef struct TL_INSPECT_WHEEL_CLOCK_
+{
+   KTIMER timer;
+   KDPC dpc;
+   BOOLEAN started;
+} TL_INSPECT_WHEEL_CLOCK;
+
+TL_INSPECT_WHEEL_CLOCK gWheelClock;
+
+KDEFERRED_ROUTINE TLInspectWheelDpc;
+
+UINT64
+TLInspectWheelNow(void)
+/* ++
+
+   Returns the current tick.
+
+-- */
+{
+   return KeQueryInterruptTime() / ((UINT64)TL_INSPECT_WHEEL_TICK * 10000);
+}
+
+UINT64
+TLInspectWheelTicks(
+   _In_ UINT64 time
+   )
+/* ++
+
+   Returns the first tick at or after an interrupt time, in 100ns units.
+
+-- */
+{
+   UINT64 tick = (UINT64)TL_INSPECT_WHEEL_TICK * 10000;
+
+   return (time + tick - 1) / tick;
+}
+
+void
+TLInspectWheelDpc(
+   _In_ KDPC* dpc,
+   _In_opt_ void* deferredContext,
+   _In_opt_ void* systemArgument1,
+   _In_opt_ void* systemArgument2
+   )
+{
+   UINT64 now = TLInspectWheelNow();
+
+   UNREFERENCED_PARAMETER(dpc);
+   UNREFERENCED_PARAMETER(deferredContext);
+   UNREFERENCED_PARAMETER(systemArgument1);
+   UNREFERENCED_PARAMETER(systemArgument2);
+
+   TLInspectExpireConnects(now);
+   TLInspectFlowCacheExpire(now);
+}
+
+void
+TLInspectWheelStart(void)
+/* ++
+
+   This function starts the periodic timer. It is called once the pended
+   connects can be completed and injected, and the caches exist.
+
+-- */
+{
+   LARGE_INTEGER dueTime;
+
+   KeInitializeTimerEx(&gWheelClock.timer, NotificationTimer);
+   KeInitializeDpc(&gWheelClock.dpc, TLInspectWheelDpc, NULL);
+
+   dueTime.QuadPart = -(LONGLONG)TL_INSPECT_WHEEL_TICK * 10000;
+
+   KeSetTimerEx(
+      &gWheelClock.timer,
+      dueTime,
+      TL_INSPECT_WHEEL_TICK,
+      &gWheelClock.dpc
+      );
+
+   gWheelClock.started = TRUE;
+}
+
+void
+TLInspectWheelStop(void)
+/* ++
+
+   This function stops the periodic timer, and returns once its DPC has
+   run for the last time. It is called during unload once the pended
+   connects are drained, since the connects waiting for their re-auth may
+   only be done with by the timer.
+
+-- */
+{
+   if (!gWheelClock.started)
+   {
+      return;
+   }
+
+   KeCancelTimer(&gWheelClock.timer);
+   KeFlushQueuedDpcs();
+
+   gWheelClock.started = FALSE;
+}
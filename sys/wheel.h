@@ -0,0 +1,294 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Abstract:
+
+   This header file declares the timer wheels of the Transport Inspect
+   sample, which time out the pended connects and age out the entries of
+   the verdict caches, and the periodic timer that advances them (see
+   wheel.c).
+
+   A wheel is hierarchical: TL_INSPECT_WHEEL_LEVELS levels of
+   TL_INSPECT_WHEEL_SLOTS slots, each slot of a level spanning all the
+   slots of the level below. A timer is linked into the slot of the lowest
+   level that its time reaches, so arming and cancelling it are a list
+   insertion and removal. Advancing the wheel by a tick fires the timers
+   of the next slot of the first level; once every slot of a level has
+   been passed, the timers of the next slot of the level above are moved
+   down to the levels below, a timer moving down at most once per level.
+
+   Times are in ticks of TL_INSPECT_WHEEL_TICK milliseconds since boot.
+   A timer fires once the wheel is advanced to its time, which may be up
+   to a tick after the time it stands for; a time beyond the span of the
+   wheel fires at the end of the span, early, so the owner of a timer
+   checks whether its time really passed.
+
+   The functions of a wheel are called with the lock of its owner held;
+   bench\wheelbench.c measures them.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef _TL_INSPECT_WHEEL_H_
+#define _TL_INSPECT_WHEEL_H_
+
+//
+// Length of a tick, in milliseconds, and period of the timer that
+// advances the wheels.
+//
+#define TL_INSPECT_WHEEL_TICK 100
+
+#define TL_INSPECT_WHEEL_LEVELS 4
+#define TL_INSPECT_WHEEL_LEVEL_BITS 6
+#define TL_INSPECT_WHEEL_SLOTS (1 << TL_INSPECT_WHEEL_LEVEL_BITS)
+
+//
+// Most ticks a timer is armed for: about 19 days.
+//
+#define TL_INSPECT_WHEEL_SPAN \
+   ((UINT64)1 << (TL_INSPECT_WHEEL_LEVELS * TL_INSPECT_WHEEL_LEVEL_BITS))
+
+//
+// TL_INSPECT_TIMER is embedded in the object it times. link is in a slot
+// of the wheel while the timer is armed, and its Flink is NULL otherwise;
+// a zeroed timer is not armed.
+//
+typedef struct TL_INSPECT_TIMER_
+{
+   LIST_ENTRY link;
+   UINT64 expires;
+} TL_INSPECT_TIMER;
+
+//
+// TL_INSPECT_TIMER_WHEEL is a wheel; now is the last tick it was advanced
+// to, and count the number of timers armed.
+//
+typedef struct TL_INSPECT_TIMER_WHEEL_
+{
+   LIST_ENTRY slots[TL_INSPECT_WHEEL_LEVELS][TL_INSPECT_WHEEL_SLOTS];
+   UINT64 now;
+   ULONG count;
+} TL_INSPECT_TIMER_WHEEL;
+
+__inline
+void
+TLInspectWheelInitialize(
+   _Out_ TL_INSPECT_TIMER_WHEEL* wheel,
+   _In_ UINT64 now
+   )
+{
+   ULONG level;
+   ULONG slot;
+
+   for (level = 0; level < TL_INSPECT_WHEEL_LEVELS; level++)
+   {
+      for (slot = 0; slot < TL_INSPECT_WHEEL_SLOTS; slot++)
+      {
+         InitializeListHead(&wheel->slots[level][slot]);
+      }
+   }
+
+   wheel->now = now;
+   wheel->count = 0;
+}
+
+__inline
+BOOLEAN
+TLInspectTimerArmed(
+   _In_ const TL_INSPECT_TIMER* timer
+   )
+{
+   return timer->link.Flink != NULL;
+}
+
+__inline
+void
+TLInspectWheelInsert(
+   _Inout_ TL_INSPECT_TIMER_WHEEL* wheel,
+   _Inout_ TL_INSPECT_TIMER* timer
+   )
+/* ++
+
+   Links a timer whose time is not before the wheel and within its span
+   into the slot of the lowest level that the time reaches.
+
+-- */
+{
+   UINT64 delta = timer->expires - wheel->now;
+   ULONG level = 0;
+
+   while ((level < TL_INSPECT_WHEEL_LEVELS - 1) &&
+          (delta >= ((UINT64)1 << ((level + 1) * TL_INSPECT_WHEEL_LEVEL_BITS))))
+   {
+      level++;
+   }
+
+   InsertTailList(
+      &wheel->slots[level][(timer->expires >> (level * TL_INSPECT_WHEEL_LEVEL_BITS)) &
+                           (TL_INSPECT_WHEEL_SLOTS - 1)],
+      &timer->link
+      );
+}
+
+__inline
+void
+TLInspectWheelArm(
+   _Inout_ TL_INSPECT_TIMER_WHEEL* wheel,
+   _Inout_ TL_INSPECT_TIMER* timer,
+   _In_ UINT64 expires
+   )
+/* ++
+
+   Arms a timer that is not armed to fire once the wheel is advanced to
+   expires. A time already passed fires at the next tick.
+
+-- */
+{
+   if (expires <= wheel->now)
+   {
+      expires = wheel->now + 1;
+   }
+   else if (expires - wheel->now >= TL_INSPECT_WHEEL_SPAN)
+   {
+      expires = wheel->now + TL_INSPECT_WHEEL_SPAN - 1;
+   }
+
+   timer->expires = expires;
+   TLInspectWheelInsert(wheel, timer);
+   wheel->count++;
+}
+
+__inline
+void
+TLInspectWheelCancel(
+   _Inout_ TL_INSPECT_TIMER_WHEEL* wheel,
+   _Inout_ TL_INSPECT_TIMER* timer
+   )
+{
+   if (!TLInspectTimerArmed(timer))
+   {
+      return;
+   }
+
+   RemoveEntryList(&timer->link);
+   timer->link.Flink = NULL;
+   wheel->count--;
+}
+
+__inline
+ULONG
+TLInspectWheelAdvance(
+   _Inout_ TL_INSPECT_TIMER_WHEEL* wheel,
+   _In_ UINT64 now,
+   _Inout_ LIST_ENTRY* expired
+   )
+/* ++
+
+   Advances the wheel tick by tick up to now, moves the timers that fired
+   to the tail of expired, and returns their number. They stay armed until
+   taken by TLInspectWheelNextExpired, so a timer cancelled before then is
+   taken off expired. An empty wheel skips to now at once.
+
+-- */
+{
+   ULONG count = 0;
+
+   if (wheel->count == 0)
+   {
+      if (now > wheel->now)
+      {
+         wheel->now = now;
+      }
+      return 0;
+   }
+
+   while (wheel->now < now)
+   {
+      LIST_ENTRY* slot;
+      ULONG level;
+
+      wheel->now++;
+
+      for (level = 1; level < TL_INSPECT_WHEEL_LEVELS; level++)
+      {
+         ULONG shift = level * TL_INSPECT_WHEEL_LEVEL_BITS;
+
+         if ((wheel->now & (((UINT64)1 << shift) - 1)) != 0)
+         {
+            break;
+         }
+
+         slot = &wheel->slots[level][(wheel->now >> shift) &
+                                     (TL_INSPECT_WHEEL_SLOTS - 1)];
+
+         while (!IsListEmpty(slot))
+         {
+            TLInspectWheelInsert(
+               wheel,
+               CONTAINING_RECORD(RemoveHeadList(slot), TL_INSPECT_TIMER, link)
+               );
+         }
+      }
+
+      slot = &wheel->slots[0][wheel->now & (TL_INSPECT_WHEEL_SLOTS - 1)];
+
+      while (!IsListEmpty(slot))
+      {
+         InsertTailList(expired, RemoveHeadList(slot));
+         count++;
+      }
+   }
+
+   return count;
+}
+
+__inline
+TL_INSPECT_TIMER*
+TLInspectWheelNextExpired(
+   _Inout_ TL_INSPECT_TIMER_WHEEL* wheel,
+   _Inout_ LIST_ENTRY* expired
+   )
+/* ++
+
+   Takes the first timer of expired, which is no longer armed, or returns
+   NULL once expired is empty.
+
+-- */
+{
+   TL_INSPECT_TIMER* timer;
+
+   if (IsListEmpty(expired))
+   {
+      return NULL;
+   }
+
+   timer = CONTAINING_RECORD(RemoveHeadList(expired), TL_INSPECT_TIMER, link);
+   timer->link.Flink = NULL;
+   wheel->count--;
+
+   return timer;
+}
+
+#ifndef TL_INSPECT_WHEEL_USER_MODE
+
+UINT64
+TLInspectWheelNow(void);
+
+UINT64
+TLInspectWheelTicks(
+   _In_ UINT64 time
+   );
+
+void
+TLInspectWheelStart(void);
+
+void
+TLInspectWheelStop(void);
+
+#endif // TL_INSPECT_WHEEL_USER_MODE
+
+#endif // _TL_INSPECT_WHEEL_H_